@@ -0,0 +1,68 @@
+# Copyright (c) 2003-2019 by Mike Jarvis
+#
+# TreeCorr is free software: redistribution and use in source and binary forms,
+# with or without modification, are permitted provided that the following
+# conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions, and the disclaimer given in the accompanying LICENSE
+#    file.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions, and the disclaimer given in the documentation
+#    and/or other materials provided with the distribution.
+
+# Benchmark the time to build and destroy Fields of various sizes.
+#
+# Usage: python bench_field.py [ngal ...]
+#
+# The default is to run 1e5, 1e6, and 1e7 objects.  For each one, we time building each kind
+# of field (N, K, G) with a few different min_size values, and then the time to destroy it.
+
+from __future__ import print_function
+import sys
+import time
+import gc
+import numpy as np
+import treecorr
+
+def bench(ngal, coords, min_size, nrep=3):
+    rng = np.random.RandomState(8675309)
+    if coords == 'flat':
+        x = rng.uniform(0, 1000, ngal)
+        y = rng.uniform(0, 1000, ngal)
+        kwargs = dict(x=x, y=y)
+    else:
+        ra = rng.uniform(0, 60, ngal)
+        dec = rng.uniform(-30, 30, ngal)
+        kwargs = dict(ra=ra, dec=dec, ra_units='deg', dec_units='deg')
+    k = rng.normal(0, 0.1, ngal)
+    g1 = rng.normal(0, 0.1, ngal)
+    g2 = rng.normal(0, 0.1, ngal)
+    cat = treecorr.Catalog(k=k, g1=g1, g2=g2, **kwargs)
+
+    for name, cls in [('N', treecorr.NField), ('K', treecorr.KField), ('G', treecorr.GField)]:
+        tbuild = tdestroy = 0.
+        for rep in range(nrep):
+            gc.collect()
+            t0 = time.time()
+            field = cls(cat, min_size=min_size)
+            field.nTopLevelNodes  # Make sure the cells are actually built.
+            t1 = time.time()
+            del field
+            gc.collect()
+            t2 = time.time()
+            tbuild += t1-t0
+            tdestroy += t2-t1
+        print('%9d  %6s  %8.3f  %s   build: %8.4f   destroy: %8.4f'%(
+              ngal, coords, min_size, name, tbuild/nrep, tdestroy/nrep))
+
+def main(argv):
+    ngals = [int(float(a)) for a in argv[1:]] or [100000, 1000000, 10000000]
+    print('Using %d threads'%treecorr.set_omp_threads(None))
+    print('     ngal  coords  min_size')
+    for ngal in ngals:
+        for coords, min_size in [('flat', 0.), ('flat', 1.), ('sphere', 0.), ('sphere', 1.e-3)]:
+            bench(ngal, coords, min_size)
+
+if __name__ == '__main__':
+    main(sys.argv)
@@ -0,0 +1,534 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+// Microbenchmarks of the C++ kernels, to check whether a change to e.g. Split.h, BinType.h or
+// Metric.h makes things slower.
+//
+// Build with:  python setup.py build_ext --bench
+// which also builds the _treecorr extension and then links this file with the same objects
+// into build/bench_kernels.
+//
+// Usage: bench_kernels [--n nobj] [--threads n] [--min_time t] [--filter str] [--list]
+//                      [--out file.json]
+//
+// Each benchmark works on synthetic clustered catalogs with nobj objects (default 1e5; the
+// three-point ones use nobj/20).  The names are:
+//
+//     build/{N,K,G}/<split method>/<coords>    Building the Field (i.e. BuildCell)
+//     process2/<d1d2>/<metric>/<bin type>      ProcessCross2 (i.e. process11)
+//     process3/<d1d2d3>/<metric>/<bin type>    ProcessAuto3 (i.e. process111)
+//     kmeans/run/<coords>                      KMeansRun (i.e. KMeansRun2)
+//     kmeans/quick_assign                      QuickAssign
+//
+// --filter only runs the benchmarks whose name contains the given string.  The results are
+// written in the same JSON format as Google Benchmark's --benchmark_format=json, so they can be
+// compared with its tools/compare.py, e.g.
+//
+//     compare.py benchmarks before.json after.json
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <cfloat>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <map>
+#include <random>
+#include <functional>
+#include <unistd.h>
+
+#include "WallTime.h"
+
+extern "C" {
+#include "BinType_C.h"
+#include "Metric_C.h"
+#include "Position_C.h"
+#include "BinnedCorr2_C.h"
+#include "BinnedCorr3_C.h"
+#include "Field_C.h"
+}
+
+// The wall and cpu time of the timed part of each iteration.
+struct Timer
+{
+    Timer() : real(0.), cpu(0.) {}
+    void start() { _real0 = WallTime(); _cpu0 = std::clock(); }
+    void stop()
+    {
+        real += WallTime() - _real0;
+        cpu += double(std::clock() - _cpu0) / CLOCKS_PER_SEC;
+    }
+
+    double real, cpu;
+private:
+    double _real0;
+    std::clock_t _cpu0;
+};
+
+// A benchmark times one iteration with the Timer it is given, and returns the number of items
+// (objects or pairs) that it processed.
+struct Benchmark
+{
+    std::string name;
+    std::function<double(Timer&)> run;
+};
+
+// A catalog of points in clusters, plus a uniform background, with all the columns that any
+// kind of field might need.
+struct Catalog
+{
+    std::vector<double> x, y, z, k, g1, g2, w;
+    long n() const { return long(x.size()); }
+    double* zp() { return z.empty() ? 0 : &z[0]; }
+};
+
+// For Flat, the points are in a 1000 x 1000 box.  For Sphere, they are unit vectors in a
+// 20 x 20 degree patch around the x axis.  For ThreeD, the Sphere points have distances
+// from 1000 to 2000, so the Rperp and Rlens separations are similar to the Flat ones.
+Catalog MakeCatalog(long n, int coords, unsigned seed)
+{
+    const int nclust = 100;
+    const double clust_frac = 0.7;
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> u(0., 1.);
+    std::normal_distribution<double> gauss(0., 1.);
+
+    std::vector<double> cx(nclust), cy(nclust);
+    for (int i=0; i<nclust; ++i) { cx[i] = u(rng); cy[i] = u(rng); }
+
+    Catalog cat;
+    cat.x.resize(n); cat.y.resize(n);
+    if (coords != Flat) cat.z.resize(n);
+    cat.k.resize(n); cat.g1.resize(n); cat.g2.resize(n); cat.w.resize(n);
+    for (long i=0; i<n; ++i) {
+        double s, t;
+        if (u(rng) < clust_frac) {
+            int c = int(u(rng) * nclust) % nclust;
+            s = cx[c] + 0.01 * gauss(rng);
+            t = cy[c] + 0.01 * gauss(rng);
+        } else {
+            s = u(rng);
+            t = u(rng);
+        }
+        if (coords == Flat) {
+            cat.x[i] = 1000. * s;
+            cat.y[i] = 1000. * t;
+        } else {
+            double ra = (s - 0.5) * 20. * M_PI / 180.;
+            double dec = (t - 0.5) * 20. * M_PI / 180.;
+            double r = coords == ThreeD ? 1000. * (1. + u(rng)) : 1.;
+            cat.x[i] = r * std::cos(dec) * std::cos(ra);
+            cat.y[i] = r * std::cos(dec) * std::sin(ra);
+            cat.z[i] = r * std::sin(dec);
+        }
+        cat.k[i] = 0.1 * gauss(rng);
+        cat.g1[i] = 0.1 * gauss(rng);
+        cat.g2[i] = 0.1 * gauss(rng);
+        cat.w[i] = 0.5 + u(rng);
+    }
+    return cat;
+}
+
+void* BuildField(Catalog& cat, int d, int coords, int sm)
+{
+    const double minsize = 0., maxsize = DBL_MAX;
+    const int mintop = 0, maxtop = 10;
+    void* field = 0;
+    switch(d) {
+      case 1:
+           field = BuildNField(&cat.x[0], &cat.y[0], cat.zp(), &cat.w[0], 0, cat.n(),
+                               minsize, maxsize, sm, 0, mintop, maxtop, 0, 0, 0, "", coords);
+           break;
+      case 2:
+           field = BuildKField(&cat.x[0], &cat.y[0], cat.zp(), &cat.k[0], &cat.w[0], 0, cat.n(),
+                               minsize, maxsize, sm, 0, mintop, maxtop, 0, 0, 0, "", coords);
+           break;
+      case 3:
+           field = BuildGField(&cat.x[0], &cat.y[0], cat.zp(), &cat.g1[0], &cat.g2[0],
+                               &cat.w[0], 0, cat.n(),
+                               minsize, maxsize, sm, 0, mintop, maxtop, 0, 0, 0, "", coords);
+           break;
+    }
+    // Make sure the cells are all built now rather than on first use.
+    FieldGetNTopLevel(field, d, coords);
+    return field;
+}
+
+void DestroyField(void* field, int d, int coords)
+{
+    switch(d) {
+      case 1: DestroyNField(field, coords); break;
+      case 2: DestroyKField(field, coords); break;
+      case 3: DestroyGField(field, coords); break;
+    }
+}
+
+const char* const kind_names[] = { "", "N", "K", "G" };
+const char* const sm_names[] = { "middle", "median", "mean", "random" };
+const char* const coord_names[] = { "", "flat", "3d", "sphere" };
+const char* const bin_names[] = { "", "Log", "Linear", "TwoD" };
+const char* const metric_names[] = { "", "Euclidean", "Rperp", "Rlens", "Arc", "OldRperp",
+                                      "Periodic" };
+
+// The catalogs and the fields made from them, which are shared by the process benchmarks.
+// Each (coords, which) pair is a different catalog, so the cross correlations are between
+// two independent realizations.
+class Data
+{
+public:
+    Data(long n) : _n(n) {}
+    ~Data()
+    {
+        for (std::map<Key,void*>::iterator it=_fields.begin(); it!=_fields.end(); ++it)
+            DestroyField(it->second, it->first.d, it->first.coords);
+    }
+
+    Catalog& cat(long n, int coords, int which)
+    {
+        CatKey key = { n, coords, which };
+        std::map<CatKey,Catalog>::iterator it = _cats.find(key);
+        if (it == _cats.end())
+            it = _cats.insert(std::make_pair(key, MakeCatalog(n, coords, 1234 + 17*which))).first;
+        return it->second;
+    }
+
+    void* field(long n, int d, int coords, int which)
+    {
+        Key key = { n, d, coords, which };
+        std::map<Key,void*>::iterator it = _fields.find(key);
+        if (it == _fields.end())
+            it = _fields.insert(std::make_pair(key, BuildField(cat(n,coords,which), d, coords, 2)))
+                .first;
+        return it->second;
+    }
+
+    long n() const { return _n; }
+
+private:
+    struct CatKey
+    {
+        long n; int coords, which;
+        bool operator<(const CatKey& rhs) const
+        {
+            if (n != rhs.n) return n < rhs.n;
+            if (coords != rhs.coords) return coords < rhs.coords;
+            return which < rhs.which;
+        }
+    };
+    struct Key
+    {
+        long n; int d, coords, which;
+        bool operator<(const Key& rhs) const
+        {
+            if (n != rhs.n) return n < rhs.n;
+            if (d != rhs.d) return d < rhs.d;
+            if (coords != rhs.coords) return coords < rhs.coords;
+            return which < rhs.which;
+        }
+    };
+
+    long _n;
+    std::map<CatKey,Catalog> _cats;
+    std::map<Key,void*> _fields;
+};
+
+void AddBuildBenchmarks(std::vector<Benchmark>& benchmarks, Data& data)
+{
+    for (int d=1; d<=3; ++d) {
+        for (int sm=0; sm<4; ++sm) {
+            for (int coords=1; coords<=3; ++coords) {
+                // Just do all the split methods and coordinates for N.  They are the same
+                // trees for K and G with more data per cell.
+                if (d > 1 && (sm != 2 || coords != Flat)) continue;
+                Benchmark b;
+                b.name = std::string("build/") + kind_names[d] + "/" + sm_names[sm] + "/" +
+                    coord_names[coords];
+                b.run = [&data, d, sm, coords](Timer& timer) {
+                    Catalog& cat = data.cat(data.n(), coords, 0);
+                    timer.start();
+                    void* field = BuildField(cat, d, coords, sm);
+                    timer.stop();
+                    DestroyField(field, d, coords);
+                    return double(cat.n());
+                };
+                benchmarks.push_back(b);
+            }
+        }
+    }
+}
+
+// The coordinates to use for each metric.
+int MetricCoords(int metric)
+{
+    switch(metric) {
+      case Euclidean: return Flat;
+      case Periodic: return Flat;
+      case Arc: return Sphere;
+      default: return ThreeD;
+    }
+}
+
+void AddProcess2Benchmark(std::vector<Benchmark>& benchmarks, Data& data,
+                          int d1, int d2, int metric, int bin_type)
+{
+    Benchmark b;
+    b.name = std::string("process2/") + kind_names[d1] + kind_names[d2] + "/" +
+        metric_names[metric] + "/" + bin_names[bin_type];
+    b.run = [&data, d1, d2, metric, bin_type](Timer& timer) {
+        int coords = MetricCoords(metric);
+        void* field1 = data.field(data.n(), d1, coords, 1);
+        void* field2 = data.field(data.n(), d2, coords, 2);
+
+        // The separations are from 5 to 100 in the Flat and ThreeD units, and the same
+        // angles for Sphere.
+        double scale = coords == Sphere ? 20. * M_PI / 180. / 1000. : 1.;
+        double minsep = 5. * scale, maxsep = 100. * scale;
+        int nbins = 20;
+        int ntot = nbins;
+        double binsize, bslop;
+        if (bin_type == Log) {
+            binsize = std::log(maxsep/minsep) / nbins;
+            bslop = binsize;
+        } else if (bin_type == Linear) {
+            binsize = (maxsep-minsep) / nbins;
+            bslop = binsize / maxsep;
+        } else {
+            minsep = 0.;
+            binsize = 2.*maxsep / nbins;
+            bslop = binsize / maxsep;
+            ntot = nbins * nbins;
+        }
+        double period = coords == Flat ? 1000. : 0.;
+        std::vector<double> xip(ntot), xip_im(ntot), xim(ntot), xim_im(ntot);
+        std::vector<double> meanr(ntot), meanlogr(ntot), weight(ntot), npairs(ntot);
+        void* corr = BuildCorr2(d1, d2, bin_type, minsep, maxsep, ntot, binsize, bslop,
+                                0, -DBL_MAX, DBL_MAX, period, period, period,
+                                &xip[0], &xip_im[0], &xim[0], &xim_im[0],
+                                &meanr[0], &meanlogr[0], &weight[0], &npairs[0]);
+        timer.start();
+        ProcessCross2(corr, field1, field2, 0, d1, d2, coords, bin_type, metric);
+        timer.stop();
+        DestroyCorr2(corr, d1, d2, bin_type);
+        double tot = 0.;
+        for (int i=0; i<ntot; ++i) tot += npairs[i];
+        return tot;
+    };
+    benchmarks.push_back(b);
+}
+
+void AddProcess2Benchmarks(std::vector<Benchmark>& benchmarks, Data& data)
+{
+    const int dd[6][2] = { {1,1}, {1,2}, {1,3}, {2,2}, {2,3}, {3,3} };
+    // All the data types and bin types with the Euclidean metric.
+    for (int i=0; i<6; ++i)
+        for (int bin_type=Log; bin_type<=TwoD; ++bin_type)
+            AddProcess2Benchmark(benchmarks, data, dd[i][0], dd[i][1], Euclidean, bin_type);
+    // And the other metrics, which only affect the distance calculations, just for NN and GG.
+    const int metrics[] = { Rperp, Rlens, Arc, OldRperp, Periodic };
+    for (int i=0; i<5; ++i) {
+        AddProcess2Benchmark(benchmarks, data, 1, 1, metrics[i], Log);
+        AddProcess2Benchmark(benchmarks, data, 3, 3, metrics[i], Log);
+    }
+}
+
+void AddProcess3Benchmarks(std::vector<Benchmark>& benchmarks, Data& data)
+{
+    for (int d=1; d<=3; ++d) {
+        Benchmark b;
+        b.name = std::string("process3/") + kind_names[d] + kind_names[d] + kind_names[d] +
+            "/Euclidean/Log";
+        b.run = [&data, d](Timer& timer) {
+            void* field = data.field(data.n()/20, d, Flat, 1);
+            double minsep = 5., maxsep = 50.;
+            int nbins = 10, nubins = 5, nvbins = 5;
+            double binsize = std::log(maxsep/minsep) / nbins;
+            double ubinsize = 1. / nubins, vbinsize = 1. / nvbins;
+            int ntot = nbins * nubins * 2*nvbins;
+            std::vector<double> gam(8*ntot), means(8*ntot), weight(ntot), ntri(ntot);
+            void* corr = BuildCorr3(d, d, d, Log,
+                                    minsep, maxsep, nbins, binsize, binsize,
+                                    0., 1., nubins, ubinsize, ubinsize,
+                                    0., 1., nvbins, vbinsize, vbinsize,
+                                    -DBL_MAX, DBL_MAX, 0., 0., 0.,
+                                    &gam[0], &gam[ntot], &gam[2*ntot], &gam[3*ntot],
+                                    &gam[4*ntot], &gam[5*ntot], &gam[6*ntot], &gam[7*ntot],
+                                    &means[0], &means[ntot], &means[2*ntot], &means[3*ntot],
+                                    &means[4*ntot], &means[5*ntot], &means[6*ntot],
+                                    &means[7*ntot], &weight[0], &ntri[0]);
+            timer.start();
+            ProcessAuto3(corr, field, 0, d, Flat, Log, Euclidean);
+            timer.stop();
+            DestroyCorr3(corr, d, d, d, Log);
+            double tot = 0.;
+            for (int i=0; i<ntot; ++i) tot += ntri[i];
+            return tot;
+        };
+        benchmarks.push_back(b);
+    }
+}
+
+void AddKMeansBenchmarks(std::vector<Benchmark>& benchmarks, Data& data)
+{
+    const int npatch = 50;
+    for (int coords=1; coords<=3; ++coords) {
+        Benchmark b;
+        b.name = std::string("kmeans/run/") + coord_names[coords];
+        b.run = [&data, coords, npatch](Timer& timer) {
+            void* field = data.field(data.n(), 1, coords, 1);
+            std::vector<double> centers(3*npatch);
+            KMeansInitTree(field, &centers[0], npatch, 1, coords);
+            timer.start();
+            KMeansRun(field, &centers[0], npatch, 30, 1.e-5, 0, 1, coords);
+            timer.stop();
+            return double(data.n());
+        };
+        benchmarks.push_back(b);
+    }
+
+    Benchmark b;
+    b.name = "kmeans/quick_assign";
+    b.run = [&data, npatch](Timer& timer) {
+        void* field = data.field(data.n(), 1, ThreeD, 1);
+        Catalog& cat = data.cat(data.n(), ThreeD, 2);
+        std::vector<double> centers(3*npatch);
+        KMeansInitTree(field, &centers[0], npatch, 1, ThreeD);
+        std::vector<long> patches(cat.n());
+        timer.start();
+        QuickAssign(&centers[0], npatch, &cat.x[0], &cat.y[0], &cat.z[0], &patches[0], cat.n());
+        timer.stop();
+        return double(cat.n());
+    };
+    benchmarks.push_back(b);
+}
+
+std::string JSONString(const std::string& s)
+{
+    std::string out = "\"";
+    for (size_t i=0; i<s.size(); ++i) {
+        if (s[i] == '"' || s[i] == '\\') out += '\\';
+        out += s[i];
+    }
+    return out + "\"";
+}
+
+void Usage()
+{
+    std::fprintf(stderr,
+                 "Usage: bench_kernels [--n nobj] [--threads n] [--min_time t] [--filter str]\n"
+                 "                     [--list] [--out file.json]\n");
+    std::exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    long n = 100000;
+    int num_threads = 0;
+    double min_time = 0.5;
+    std::string filter, out_file;
+    bool list = false;
+    for (int i=1; i<argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--list") { list = true; continue; }
+        if (i+1 == argc) Usage();
+        if (arg == "--n") n = long(std::atof(argv[++i]));
+        else if (arg == "--threads") num_threads = std::atoi(argv[++i]);
+        else if (arg == "--min_time") min_time = std::atof(argv[++i]);
+        else if (arg == "--filter") filter = argv[++i];
+        else if (arg == "--out") out_file = argv[++i];
+        else Usage();
+    }
+    if (n < 20) Usage();
+    num_threads = num_threads > 0 ? SetOMPThreads(num_threads) : GetOMPThreads();
+
+    Data data(n);
+    std::vector<Benchmark> benchmarks;
+    AddBuildBenchmarks(benchmarks, data);
+    AddProcess2Benchmarks(benchmarks, data);
+    AddProcess3Benchmarks(benchmarks, data);
+    AddKMeansBenchmarks(benchmarks, data);
+
+    if (list) {
+        for (size_t i=0; i<benchmarks.size(); ++i)
+            std::printf("%s\n", benchmarks[i].name.c_str());
+        return 0;
+    }
+
+    FILE* out = stdout;
+    if (out_file != "") {
+        out = std::fopen(out_file.c_str(), "w");
+        if (!out) {
+            std::fprintf(stderr, "Unable to open %s\n", out_file.c_str());
+            return 1;
+        }
+    }
+
+    char host[256] = "";
+    gethostname(host, sizeof(host)-1);
+    char date[64] = "";
+    std::time_t now = std::time(0);
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+    std::fprintf(out, "{\n  \"context\": {\n");
+    std::fprintf(out, "    \"date\": %s,\n", JSONString(date).c_str());
+    std::fprintf(out, "    \"host_name\": %s,\n", JSONString(host).c_str());
+    std::fprintf(out, "    \"executable\": %s,\n", JSONString(argv[0]).c_str());
+    std::fprintf(out, "    \"num_cpus\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+    std::fprintf(out, "    \"num_threads\": %d,\n", num_threads);
+    std::fprintf(out, "    \"nobj\": %ld,\n", n);
+    std::fprintf(out, "    \"library_build_type\": \"release\"\n  },\n");
+    std::fprintf(out, "  \"benchmarks\": [");
+
+    bool first = true;
+    for (size_t i=0; i<benchmarks.size(); ++i) {
+        Benchmark& b = benchmarks[i];
+        if (b.name.find(filter) == std::string::npos) continue;
+        std::fprintf(stderr, "%-40s", b.name.c_str());
+
+        // One untimed iteration first to build the shared fields and warm up the caches.
+        Timer warmup;
+        b.run(warmup);
+
+        Timer timer;
+        long iterations = 0;
+        double items = 0.;
+        while (iterations == 0 || timer.real < min_time) {
+            items += b.run(timer);
+            ++iterations;
+        }
+        double real_ms = 1.e3 * timer.real / iterations;
+        double cpu_ms = 1.e3 * timer.cpu / iterations;
+        double rate = timer.real > 0. ? items / timer.real : 0.;
+        std::fprintf(stderr, " %10.3f ms %10.3f ms cpu %12.4g items/s  (%ld iterations)\n",
+                     real_ms, cpu_ms, rate, iterations);
+
+        std::fprintf(out, "%s\n    {\n", first ? "" : ",");
+        first = false;
+        std::fprintf(out, "      \"name\": %s,\n", JSONString(b.name).c_str());
+        std::fprintf(out, "      \"run_name\": %s,\n", JSONString(b.name).c_str());
+        std::fprintf(out, "      \"run_type\": \"iteration\",\n");
+        std::fprintf(out, "      \"repetitions\": 1,\n");
+        std::fprintf(out, "      \"repetition_index\": 0,\n");
+        std::fprintf(out, "      \"threads\": 1,\n");
+        std::fprintf(out, "      \"iterations\": %ld,\n", iterations);
+        std::fprintf(out, "      \"real_time\": %.6g,\n", real_ms);
+        std::fprintf(out, "      \"cpu_time\": %.6g,\n", cpu_ms);
+        std::fprintf(out, "      \"time_unit\": \"ms\",\n");
+        std::fprintf(out, "      \"items_per_second\": %.6g\n", rate);
+        std::fprintf(out, "    }");
+    }
+    std::fprintf(out, "\n  ]\n}\n");
+    if (out != stdout) std::fclose(out);
+    return 0;
+}
@@ -0,0 +1,285 @@
+# Copyright (c) 2003-2019 by Mike Jarvis
+#
+# TreeCorr is free software: redistribution and use in source and binary forms,
+# with or without modification, are permitted provided that the following
+# conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions, and the disclaimer given in the accompanying LICENSE
+#    file.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions, and the disclaimer given in the documentation
+#    and/or other materials provided with the distribution.
+
+# Strong and weak scaling benchmark of the full process calls.
+#
+# Usage: python bench_scaling.py [options]
+#    or: mpiexec -n 4 python bench_scaling.py --mpi [options]
+#
+# For each combination of the correlation (--kind), number of threads (--threads), number of
+# patches (--npatch), number of objects (--ngal) and bin_slop (--bin_slop), this times the
+# process call on a synthetic clustered catalog and reports the time, the pairs (or triangles)
+# per second, the peak RSS during the call, and the parallel efficiency relative to the run
+# with the fewest cores in the same sweep.
+#
+# With --weak, ngal is the number of objects per core, so the catalog grows with the number
+# of threads (times the number of MPI processes).  Otherwise it is strong scaling with the
+# same catalog for each thread count.  The efficiency is the pairs per second per core over
+# that of the reference run, which is the usual ratio of times for strong scaling.
+#
+# With --mpi, the process calls are split over the MPI processes with the comm option, as in
+# mpi_example.py.  This needs npatch > 1, and doesn't apply to GGG.
+#
+# The results are compared with the ones in scaling_baseline.json (or --baseline) that have
+# the same parameters, and any that are slower by more than --tol are flagged, in which case
+# the exit status is 1.  Use --save to write the results as the new baseline, e.g. when making
+# a release:
+#
+#   python bench_scaling.py --save
+
+from __future__ import print_function
+import sys
+import os
+import time
+import json
+import socket
+import argparse
+import resource
+import multiprocessing
+import numpy as np
+import treecorr
+
+default_baseline = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                'scaling_baseline.json')
+
+def make_cat(ngal, npatch, comm=None, seed=8675309):
+    # Points in 200 clusters plus a uniform background in a 20 x 20 degree patch, with a
+    # small random shear.
+    rng = np.random.RandomState(seed)
+    nclust = 200
+    ncl = int(0.7 * ngal)
+    cra = rng.uniform(-10, 10, nclust)
+    cdec = rng.uniform(-10, 10, nclust)
+    c = rng.randint(nclust, size=ncl)
+    ra = np.concatenate([cra[c] + rng.normal(0, 0.2, ncl), rng.uniform(-10, 10, ngal-ncl)])
+    dec = np.concatenate([cdec[c] + rng.normal(0, 0.2, ncl), rng.uniform(-10, 10, ngal-ncl)])
+    g1 = rng.normal(0, 0.2, ngal)
+    g2 = rng.normal(0, 0.2, ngal)
+    kwargs = dict(ra=ra, dec=dec, g1=g1, g2=g2, ra_units='deg', dec_units='deg')
+    if npatch <= 1:
+        return treecorr.Catalog(**kwargs)
+
+    # Make the patches up front, so the kmeans time isn't part of the process time, and so
+    # all the MPI processes use the same patches.
+    if comm is None or comm.Get_rank() == 0:
+        centers = treecorr.Catalog(npatch=npatch, **kwargs).patch_centers
+    else:
+        centers = None
+    if comm is not None:
+        centers = comm.bcast(centers, root=0)
+    return treecorr.Catalog(patch_centers=centers, **kwargs)
+
+def make_corr(kind, bin_slop):
+    if kind == 'ggg':
+        return treecorr.GGGCorrelation(min_sep=1., max_sep=20., nbins=10,
+                                       min_u=0., max_u=1., nubins=5,
+                                       min_v=0., max_v=1., nvbins=5,
+                                       sep_units='arcmin', bin_slop=bin_slop)
+    cls = treecorr.NNCorrelation if kind == 'nn' else treecorr.GGCorrelation
+    return cls(min_sep=1., max_sep=100., nbins=20, sep_units='arcmin', bin_slop=bin_slop)
+
+def reset_peak_rss():
+    # On Linux, writing 5 to clear_refs resets the peak RSS (VmHWM) to the current RSS.
+    try:
+        with open('/proc/self/clear_refs', 'w') as f:
+            f.write('5')
+    except (IOError, OSError):
+        pass
+
+def peak_rss():
+    """The peak RSS in MBytes since the last reset_peak_rss() (if that is possible on this
+    system, else since the start of the program).
+    """
+    try:
+        with open('/proc/self/status') as f:
+            for line in f:
+                if line.startswith('VmHWM:'):
+                    return int(line.split()[1]) / 1024.
+    except (IOError, OSError):
+        pass
+    maxrss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    # ru_maxrss is in bytes on OSX, but in kBytes on Linux.
+    return maxrss / 1024.**2 if sys.platform == 'darwin' else maxrss / 1024.
+
+def max_op():
+    from mpi4py import MPI
+    return MPI.MAX
+
+def run(kind, ngal, npatch, bin_slop, nthreads, low_mem, comm):
+    """Time one process call.  Returns the dict of results, or None if this combination
+    isn't possible.
+    """
+    if comm is not None and (npatch <= 1 or kind == 'ggg'):
+        return None
+    nproc = 1 if comm is None else comm.Get_size()
+    cat = make_cat(ngal, npatch, comm)
+    corr = make_corr(kind, bin_slop)
+    kwargs = dict(num_threads=nthreads)
+    if kind != 'ggg':
+        kwargs.update(comm=comm, low_mem=low_mem)
+
+    if comm is not None:
+        comm.Barrier()
+    reset_peak_rss()
+    t0 = time.time()
+    corr.process(cat, **kwargs)
+    if comm is not None:
+        comm.Barrier()
+    t1 = time.time()
+    rss = peak_rss()
+    if comm is not None:
+        rss = comm.allreduce(rss, op=max_op())
+
+    npairs = np.sum(corr.ntri if kind == 'ggg' else corr.npairs)
+    return dict(kind=kind, ngal=ngal, npatch=npatch, bin_slop=bin_slop, low_mem=low_mem,
+                nthreads=nthreads, nproc=nproc, time=t1-t0, npairs=float(npairs),
+                pairs_per_sec=npairs/(t1-t0), peak_rss=rss)
+
+def key(r, weak=False):
+    # The parameters that identify a run.  With weak=True, leave out the ones that change
+    # along a weak scaling sweep, which gives the groups for the efficiency.
+    k = (r['kind'], r['npatch'], r['bin_slop'], r['low_mem'])
+    if weak:
+        return k
+    return k + (r['ngal'], r['nthreads'], r['nproc'])
+
+def set_efficiency(results, weak):
+    groups = {}
+    for r in results:
+        k = key(r, weak=True) if weak else key(r)[:-2]
+        groups.setdefault(k, []).append(r)
+    for group in groups.values():
+        ref = min(group, key=lambda r: r['nthreads'] * r['nproc'])
+        ref_rate = ref['pairs_per_sec'] / (ref['nthreads'] * ref['nproc'])
+        for r in group:
+            rate = r['pairs_per_sec'] / (r['nthreads'] * r['nproc'])
+            r['efficiency'] = rate / ref_rate if ref_rate > 0 else 0.
+
+def compare(results, baseline, tol):
+    """Add the ratio of the time to the baseline time to each result that has a matching
+    baseline entry.  Returns the number of results that are slower by more than tol.
+    """
+    base = dict((key(b), b) for b in baseline['results'])
+    nslow = 0
+    for r in results:
+        b = base.get(key(r))
+        if b is None: continue
+        r['ratio'] = r['time'] / b['time']
+        if r['ratio'] > 1. + tol:
+            nslow += 1
+    return nslow
+
+def print_results(results, tol):
+    print('%4s %9s %6s %8s %7s %8s %5s %9s %11s %9s %6s %7s'%(
+          'kind', 'ngal', 'npatch', 'bin_slop', 'low_mem', 'nthreads', 'nproc',
+          'time', 'pairs/sec', 'RSS (MB)', 'eff', 'vs base'))
+    for r in results:
+        if 'ratio' in r:
+            ratio = '%6.2f%s'%(r['ratio'], ' SLOWER' if r['ratio'] > 1. + tol else '')
+        else:
+            ratio = '     -'
+        print('%4s %9d %6d %8g %7s %8d %5d %9.3f %11.4g %9.1f %6.2f %s'%(
+              r['kind'], r['ngal'], r['npatch'], r['bin_slop'], r['low_mem'], r['nthreads'],
+              r['nproc'], r['time'], r['pairs_per_sec'], r['peak_rss'], r['efficiency'],
+              ratio))
+
+def parse_args(argv):
+    parser = argparse.ArgumentParser(description='Strong and weak scaling of TreeCorr.')
+    parser.add_argument('--kind', nargs='+', default=['nn', 'gg', 'ggg'],
+                        choices=['nn', 'gg', 'ggg'], help='Which correlations to run')
+    parser.add_argument('--threads', nargs='+', type=int, default=None,
+                        help='The numbers of threads (default 1, 2, 4, ... up to all of them)')
+    parser.add_argument('--npatch', nargs='+', type=int, default=[1, 16],
+                        help='The numbers of patches')
+    parser.add_argument('--ngal', nargs='+', type=float, default=[1.e5],
+                        help='The numbers of objects (per core with --weak)')
+    parser.add_argument('--bin_slop', nargs='+', type=float, default=[1., 0.],
+                        help='The bin_slop values')
+    parser.add_argument('--ggg_factor', type=float, default=0.05,
+                        help='The fraction of ngal to use for GGG')
+    parser.add_argument('--low_mem', action='store_true', help='Use low_mem=True')
+    parser.add_argument('--weak', action='store_true', help='Weak rather than strong scaling')
+    parser.add_argument('--mpi', action='store_true', help='Split the work over MPI processes')
+    parser.add_argument('--baseline', default=default_baseline,
+                        help='The baseline file to compare with')
+    parser.add_argument('--save', action='store_true',
+                        help='Write the results to the baseline file')
+    parser.add_argument('--tol', type=float, default=0.2,
+                        help='The fractional slow down to flag as a regression')
+    return parser.parse_args(argv)
+
+def main(argv):
+    args = parse_args(argv)
+
+    comm = None
+    if args.mpi:
+        from mpi4py import MPI
+        comm = MPI.COMM_WORLD
+    rank = 0 if comm is None else comm.Get_rank()
+    nproc = 1 if comm is None else comm.Get_size()
+
+    threads = args.threads
+    if threads is None:
+        max_threads = treecorr.set_omp_threads(None)
+        threads = [1]
+        while 2*threads[-1] <= max_threads:
+            threads.append(2*threads[-1])
+        if threads[-1] != max_threads:
+            threads.append(max_threads)
+
+    results = []
+    for kind in args.kind:
+        for ngal in args.ngal:
+            for npatch in args.npatch:
+                for bin_slop in args.bin_slop:
+                    for nthreads in threads:
+                        n = ngal * nthreads * nproc if args.weak else ngal
+                        if kind == 'ggg':
+                            n *= args.ggg_factor
+                        r = run(kind, int(n), npatch, bin_slop, nthreads, args.low_mem, comm)
+                        if r is None: continue
+                        if args.weak:
+                            r['ngal_per_core'] = ngal
+                        if rank == 0:
+                            print('%s ngal=%d npatch=%d bin_slop=%g nthreads=%d: %.3f sec'%(
+                                  kind, r['ngal'], npatch, bin_slop, nthreads, r['time']))
+                            sys.stdout.flush()
+                        results.append(r)
+    if rank != 0:
+        return 0
+
+    set_efficiency(results, args.weak)
+    nslow = 0
+    if os.path.exists(args.baseline) and not args.save:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+        print('Comparing with %s (TreeCorr %s on %s)'%(
+              args.baseline, baseline['version'], baseline['host']))
+        nslow = compare(results, baseline, args.tol)
+    print()
+    print_results(results, args.tol)
+
+    if args.save:
+        baseline = dict(version=treecorr.__version__, host=socket.gethostname(),
+                        date=time.strftime('%Y-%m-%d'), ncpu=multiprocessing.cpu_count(),
+                        weak=args.weak, results=results)
+        with open(args.baseline, 'w') as f:
+            json.dump(baseline, f, indent=1)
+        print('Wrote baseline to', args.baseline)
+    elif nslow > 0:
+        print('%d runs are more than %d%% slower than the baseline'%(nslow, 100*args.tol))
+        return 1
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
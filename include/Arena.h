@@ -0,0 +1,289 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#ifndef TreeCorr_Arena_H
+#define TreeCorr_Arena_H
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <cerrno>
+#include <new>
+#include <vector>
+#include <string>
+#include <utility>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "dbg.h"
+
+// An Arena is a simple bump allocator.  Memory is handed out sequentially from large blocks,
+// and it is only released all at once when the Arena itself is destroyed.
+//
+// We use this for the Cells and CellData objects in the tree.  There are typically a huge
+// number of these, and allocating (and later deleting) each one separately with new/delete
+// ends up dominating the time to build (and destroy) a Field for large catalogs.
+//
+// Objects are created with placement new: new (arena) Cell<D,C>(...).  Their destructors are
+// not run, so this should only be used for types whose destructors don't need to do anything.
+// The exception is things registered with own(), which get their destructors called when the
+// Arena is cleared.
+//
+// Note: An Arena is not thread safe.  When building in parallel, each thread should use its
+// own Arena.
+
+// A temporary file that Arenas can use for their memory instead of malloc, for trees that are
+// too large to fit in memory.  The blocks are memory mapped from the file, so the OS pages them
+// in and out through the page cache as they are used.  The file is deleted as soon as it is
+// opened, so it goes away when the process ends, even if TreeCorr doesn't exit cleanly.
+// Unlike Arena, map() is thread safe, so many Arenas can share the same SpillFile.
+class SpillFile
+{
+public:
+    explicit SpillFile(const std::string& dir) : _dir(dir), _size(0)
+    {
+        std::string name = dir + "/treecorr_spill_XXXXXX";
+        std::vector<char> buf(name.begin(), name.end());
+        buf.push_back(0);
+        _fd = mkstemp(&buf[0]);
+        if (_fd < 0)
+            throw std::runtime_error("Unable to create spill file in " + dir + ": " +
+                                     std::strerror(errno));
+        unlink(&buf[0]);
+        dbg<<"SpillFile: opened "<<&buf[0]<<std::endl;
+    }
+
+    ~SpillFile() { if (_fd >= 0) close(_fd); }
+
+    // Extend the file by n bytes (which should be a multiple of the page size), and map that
+    // part of the file into memory.
+    void* map(size_t n)
+    {
+        off_t offset = 0;
+        bool ok = true;
+#ifdef _OPENMP
+#pragma omp critical (TreeCorr_spill_file)
+#endif
+        {
+            offset = _size;
+            // Unlike ftruncate, this actually reserves the disk space, so we find out now if
+            // there isn't enough, rather than getting a SIGBUS when the memory is used.
+            ok = posix_fallocate(_fd, offset, n) == 0;
+            if (ok) _size += n;
+        }
+        void* p = ok ? mmap(0, n, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, offset) : MAP_FAILED;
+        if (p == MAP_FAILED) throw std::bad_alloc();
+        return p;
+    }
+
+    const std::string& getDir() const { return _dir; }
+    // The total size of the file.
+    size_t getNBytes() const { return _size; }
+
+private:
+
+    // Not copyable.
+    SpillFile(const SpillFile&);
+    SpillFile& operator=(const SpillFile&);
+
+    std::string _dir;
+    int _fd;
+    size_t _size;
+};
+
+class Arena
+{
+public:
+    // Everything we store has at most double or complex<double> alignment requirements.
+    enum { ALIGN = 16 };
+
+    explicit Arena(size_t block_size=65536) :
+        _block_size(block_size), _ptr(0), _left(0), _nbytes(0), _external(0),
+        _spill(0), _resident_nobj(0), _resident(0), _fixed(false) {}
+
+    ~Arena() { clear(); }
+
+    void* allocate(size_t n)
+    {
+        n = (n + ALIGN - 1) & ~size_t(ALIGN - 1);
+        if (n > _left) newBlock(n);
+        char* p = _ptr;
+        _ptr += n;
+        _left -= n;
+        return p;
+    }
+
+    // Allocate the memory for something that represents nobj objects (e.g. a Cell).  If this
+    // Arena spills to a file, things with at least resident_nobj objects are stored in regular
+    // memory instead, so the top levels of a tree, which are used the most, stay resident.
+    void* allocate(size_t n, size_t nobj)
+    {
+        if (_spill && nobj >= _resident_nobj) {
+            // Only the cells near the top go here, which are a small fraction of them.
+            if (!_resident) _resident = new Arena(BlockSizeFor(_block_size / 16));
+            return _resident->allocate(n);
+        }
+        return allocate(n);
+    }
+
+    // Use memory mapped blocks from spill for all the following allocations.
+    // This should be called before anything is allocated.  The SpillFile must outlive
+    // this Arena.
+    void spillTo(SpillFile* spill, size_t resident_nobj)
+    {
+        Assert(_blocks.empty());
+        _spill = spill;
+        _resident_nobj = resident_nobj;
+    }
+    bool isSpilled() const { return _spill != 0; }
+
+    // Hand out the memory from the given block of n bytes, which the caller owns, rather than
+    // from blocks that this Arena allocates.  (e.g. a shared memory segment.)  This should be
+    // called before anything is allocated, and n needs to be enough for everything, since
+    // running out throws std::bad_alloc.  The block should be aligned to ALIGN.
+    void useBlock(void* block, size_t n)
+    {
+        Assert(_blocks.empty() && !_spill);
+        _ptr = static_cast<char*>(block);
+        _left = n;
+        _fixed = true;
+    }
+
+    // A block size for an Arena that is expected to hold about nbytes in total.
+    static size_t BlockSizeFor(size_t nbytes)
+    { return std::max(size_t(4096), std::min(size_t(1<<24), nbytes)); }
+
+    // Make a new Arena with the same settings, which is owned by this one.  block_size should
+    // be about the total size that the child will hold, since it may be much less than the
+    // parent's.
+    Arena* newChild(size_t block_size)
+    {
+        Arena* child = new (allocate(sizeof(Arena))) Arena(block_size);
+        if (_spill) child->spillTo(_spill, _resident_nobj);
+        own(child);
+        _children.push_back(child);
+        return child;
+    }
+
+    // Register an object that was allocated from this Arena, but which does need to have
+    // its destructor called when the Arena is cleared.  (e.g. a child Arena)
+    // heap_bytes is the memory that the object allocates itself, which is only used to
+    // report the memory held by this Arena.
+    template <typename T>
+    void own(T* p, size_t heap_bytes=0)
+    {
+        _owned.push_back(std::make_pair(static_cast<void*>(p), &Destroy<T>));
+        _external += heap_bytes;
+    }
+
+    // The number of bytes held in regular memory by this Arena and its children, including
+    // the heap_bytes of the objects it owns.
+    size_t getMemoryNBytes() const
+    {
+        size_t n = _external + (_spill ? 0 : _nbytes);
+        if (_resident) n += _resident->getMemoryNBytes();
+        for (size_t i=0; i<_children.size(); ++i) n += _children[i]->getMemoryNBytes();
+        return n;
+    }
+
+    // The number of bytes of the spill file that are used by this Arena and its children.
+    size_t getSpillNBytes() const
+    {
+        size_t n = _spill ? _nbytes : 0;
+        for (size_t i=0; i<_children.size(); ++i) n += _children[i]->getSpillNBytes();
+        return n;
+    }
+
+    // The total number of bytes that have been allocated in blocks.
+    size_t getNBytes() const { return getMemoryNBytes() + getSpillNBytes(); }
+    size_t getBlockSize() const { return _block_size; }
+
+    void clear()
+    {
+        for (size_t i=0; i<_owned.size(); ++i) (*_owned[i].second)(_owned[i].first);
+        _owned.clear();
+        _children.clear();
+        for (size_t i=0; i<_blocks.size(); ++i) {
+            if (_spill) munmap(_blocks[i], _block_sizes[i]);
+            else std::free(_blocks[i]);
+        }
+        _blocks.clear();
+        _block_sizes.clear();
+        delete _resident;
+        _resident = 0;
+        _ptr = 0;
+        _left = 0;
+        _nbytes = 0;
+        _external = 0;
+        _fixed = false;
+    }
+
+private:
+
+    // Not copyable.
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+
+    template <typename T>
+    static void Destroy(void* p) { static_cast<T*>(p)->~T(); }
+
+    void newBlock(size_t n)
+    {
+        // If a single request is larger than the block size, give it its own block.
+        if (_fixed) throw std::bad_alloc();
+        size_t size = n > _block_size ? n : _block_size;
+        xdbg<<"Arena: allocate new block of "<<size<<" bytes\n";
+        void* block = 0;
+        if (_spill) {
+            // mmap needs whole pages, and the blocks are page aligned.
+            const size_t page = sysconf(_SC_PAGESIZE);
+            size = (size + page - 1) / page * page;
+            block = _spill->map(size);
+        } else {
+            // malloc guarantees alignment suitable for any standard type, which is at least ALIGN.
+            block = std::malloc(size);
+            if (!block) throw std::bad_alloc();
+        }
+        _blocks.push_back(block);
+        _block_sizes.push_back(size);
+        _ptr = static_cast<char*>(block);
+        _left = size;
+        _nbytes += size;
+    }
+
+    size_t _block_size;
+    char* _ptr;
+    size_t _left;
+    size_t _nbytes;
+    size_t _external;
+    std::vector<void*> _blocks;
+    std::vector<size_t> _block_sizes;
+    SpillFile* _spill;
+    size_t _resident_nobj;
+    Arena* _resident;
+    bool _fixed;  // Whether the memory is from useBlock.
+    std::vector<std::pair<void*, void (*)(void*)> > _owned;
+    std::vector<Arena*> _children;
+};
+
+inline void* operator new(size_t n, Arena& arena)
+{ return arena.allocate(n); }
+
+// This is only called if a constructor throws during placement new.  The memory is
+// reclaimed when the Arena is cleared, so nothing to do here.
+inline void operator delete(void*, Arena&) {}
+
+#endif
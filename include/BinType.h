@@ -19,6 +19,8 @@
 #include "BinType_C.h"
 #include <limits>
 #include <cmath>
+#include <vector>
+#include <algorithm>
 
 
 template <int M>
@@ -136,6 +138,112 @@ struct BinTypeHelper<Log>
 
 };
 
+// For Log binning, BinnedCorr2 can instead find the bins from a table of the squared bin
+// edges, which avoids computing log(r) for each pair.  The edges are adjusted so that the
+// bins are exactly the ones that calculateBinK and isRSqInRange would give.  The table has
+// an extra bin on each side of the range, since singleBin may put a pair of cells that is
+// just out of range into a single bin, which then isn't accumulated.
+//
+// For the Arc metric on the sphere, the table can also be in terms of the chord distances,
+// L = 2 sin(theta/2), so the traversal can use the Euclidean distances between the positions
+// and skip the trig functions.  This requires all the angles in the table to be less than pi.
+class LogBinTable
+{
+public:
+    LogBinTable() :
+        _nbins(0), _chord(false), _binsize(0.), _logminsep(0.), _minsepsq(0.), _maxsepsq(0.),
+        _maxfracsq(0.) {}
+
+    void setup(double minsep, double maxsep, int nbins, double binsize, double b,
+               bool chord=false)
+    {
+        _nbins = nbins;
+        _chord = chord;
+        _binsize = binsize;
+        _logminsep = std::log(minsep);
+        _minsepsq = minsep * minsep;
+        _maxsepsq = maxsep * maxsep;
+        _maxfracsq = 0.25 * SQR(binsize + b);
+        // _edgesq[k+1] is the squared lower edge of bin k, for k = -1..nbins+1.
+        _edgesq.resize(nbins+3);
+        for (int k=-1; k<=nbins+1; ++k) {
+            double esq = SQR(toDist(std::exp(_logminsep + k*binsize)));
+            if (k >= 0 && k <= nbins) {
+                // Find the smallest rsq that is not below edge k.
+                while (!belowEdge(esq, k)) esq = nextafter(esq, 0.);
+                while (belowEdge(esq, k)) esq = nextafter(esq, 2.*esq);
+            }
+            _edgesq[k+1] = esq;
+        }
+        // All the pairs for two cells can go in bin k if r-s1ps2 >= _lo[k+1] and
+        // r+s1ps2 < _hi[k+1], which lets them miss the bin by up to b in log(theta).
+        _lo.resize(nbins+2);
+        _hi.resize(nbins+2);
+        const double expb = std::exp(b);
+        for (int k=-1; k<=nbins; ++k) {
+            _lo[k+1] = toDist(toSep(_edgesq[k+1]) / expb);
+            _hi[k+1] = toDist(toSep(_edgesq[k+2]) * expb);
+        }
+    }
+
+    bool active() const { return _nbins > 0; }
+    size_t getNBytes() const
+    { return (_edgesq.capacity() + _lo.capacity() + _hi.capacity()) * sizeof(double); }
+
+    // The range of rsq to accumulate, which is [minsepsq, maxsepsq) unless this is for chords.
+    double getMinSepSq() const { return _edgesq[1]; }
+    double getMaxSepSq() const { return _edgesq[_nbins+1]; }
+
+    // The bin k with edge_k^2 <= rsq < edge_k+1^2.  This is between -1 and nbins, or else
+    // -2 or nbins+1 if rsq is outside the table.
+    int findBin(double rsq) const
+    { return int(std::upper_bound(_edgesq.begin(), _edgesq.end(), rsq) - _edgesq.begin()) - 2; }
+
+    // The equivalent of BinTypeHelper<Log>::singleBin, getting the bin from the table.
+    // If it returns true, k and r are set unless s1ps2 is small enough that any pair is fine.
+    bool singleBin(double rsq, double s1ps2, double bsq, int& k, double& r) const
+    {
+        if (s1ps2 == 0.) return true;
+        const double s1ps2sq = s1ps2 * s1ps2;
+        if (s1ps2sq <= bsq*rsq) return true;
+        if (s1ps2sq > _maxfracsq * rsq) return false;
+        const int ik = findBin(rsq);
+        if (ik < -1 || ik > _nbins) return false;
+        const double rr = std::sqrt(rsq);
+        if (rr - s1ps2 < _lo[ik+1] || rr + s1ps2 >= _hi[ik+1]) return false;
+        k = ik;
+        r = rr;
+        return true;
+    }
+
+private:
+    // Convert between the separation (theta for chords) and the distance in the table.
+    double toDist(double sep) const { return _chord ? 2. * std::sin(0.5*sep) : sep; }
+    double toSep(double rsq) const
+    { return _chord ? 2. * std::asin(0.5*std::sqrt(rsq)) : std::sqrt(rsq); }
+
+    // Whether rsq is below the lower edge of bin k (for 0 <= k <= nbins), calculated the same
+    // way as the usual binning does it.
+    bool belowEdge(double rsq, int k) const
+    {
+        if (_chord) rsq = SQR(toSep(rsq));
+        if (k == 0) return rsq < _minsepsq;
+        else if (k == _nbins) return rsq < _maxsepsq;
+        else return int((std::log(std::sqrt(rsq)) - _logminsep) / _binsize) < k;
+    }
+
+    int _nbins;
+    bool _chord;
+    double _binsize;
+    double _logminsep;
+    double _minsepsq;
+    double _maxsepsq;
+    double _maxfracsq;
+    std::vector<double> _edgesq;
+    std::vector<double> _lo;
+    std::vector<double> _hi;
+};
+
 template <>
 struct BinTypeHelper<Linear>
 {
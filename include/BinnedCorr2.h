@@ -17,15 +17,206 @@
 
 #include <vector>
 #include <string>
+#include <map>
 
 #include "Cell.h"
 #include "Field.h"
 #include "BinType.h"
 #include "Metric.h"
+#include "ProcessBudget.h"
+#include "TraversalStats.h"
+#include "Checkpoint.h"
+#include "InteractionList.h"
+#include "CellColumns.h"
 
 template <int D1, int D2>
 struct XiData;
 
+template <int B>
+class MultiCorr2;
+
+template <int D1, int D2>
+class MultiBinCorr2;
+
+template <int D1, int D2, int B>
+class MultiPartnerCorr2;
+
+template <int B>
+class ColumnCorr2;
+
+template <int D, int C>
+class PatchLabels;
+
+// While accumulating, all the values for a single bin are kept together in one record
+// that fills a 64-byte cache line, so adding a pair to a bin only touches one cache line.
+// The records are only used by the per-thread accumulators.  The results are added to the
+// separate output arrays (from the python layer) at the end of each process call.
+struct PairBin
+{
+    // xi[0..4] are xip, xip_im, xim, xim_im for GG, xi, xi_im for NG, KG, or xi for NK, KK.
+    double xi[4];
+    double meanr;
+    double meanlogr;
+    double weight;
+    double npairs;
+};
+
+// The PairBin records of an accumulator.  Usually these are a single array, but a large TwoD
+// grid is mostly empty when max_sep cuts off the corners, or when only a narrow range of
+// separations is populated.  So for those, the records are in tiles of TILE bins, which are
+// only allocated when a pair is first added to one of them.  Then the threads only need
+// memory for (and only need to merge) the parts of the grid that they actually used.
+class PairBins
+{
+public:
+    enum { TILE = 64 };
+
+    PairBins(int nbins, bool tiled) :
+        _nbins(nbins), _tile(tiled ? int(TILE) : std::max(nbins,1)),
+        _tiles((nbins + _tile - 1) / _tile, static_cast<PairBin*>(0)),
+        _mem(_tiles.size(), static_cast<char*>(0))
+    {
+        if (!tiled && nbins > 0) allocate(0);
+    }
+
+    ~PairBins()
+    {
+        for (size_t t=0; t<_mem.size(); ++t) delete [] _mem[t];
+    }
+
+    PairBin& operator[](int k)
+    {
+        const int t = k / _tile;
+        if (!_tiles[t]) allocate(t);
+        return _tiles[t][k - t*_tile];
+    }
+
+    // Tile t has the bins from getStart(t) to getStart(t) + getSize(t).  getTile returns 0
+    // if none of these have been used yet, unless alloc is true.
+    int getNTiles() const { return int(_tiles.size()); }
+    int getStart(int t) const { return t * _tile; }
+    int getSize(int t) const { return std::min(_tile, _nbins - t*_tile); }
+    const PairBin* getTile(int t) const { return _tiles[t]; }
+    PairBin* getTile(int t, bool alloc)
+    {
+        if (!_tiles[t] && alloc) allocate(t);
+        return _tiles[t];
+    }
+
+    void clear()
+    {
+        for (size_t t=0; t<_tiles.size(); ++t) {
+            if (_tiles[t]) {
+                std::fill(reinterpret_cast<double*>(_tiles[t]),
+                          reinterpret_cast<double*>(_tiles[t] + getSize(t)), 0.);
+            }
+        }
+    }
+
+    size_t getNBytes() const
+    {
+        size_t n = sizeof(*this) + _tiles.capacity() * (sizeof(PairBin*) + sizeof(char*));
+        for (size_t t=0; t<_tiles.size(); ++t)
+            if (_tiles[t]) n += getSize(t) * sizeof(PairBin) + ALIGN;
+        return n;
+    }
+
+private:
+    enum { ALIGN = 64 };
+
+    void allocate(int t)
+    {
+        // Align the records to a cache line, so each one only touches a single line.
+        const int n = getSize(t);
+        _mem[t] = new char[n * sizeof(PairBin) + ALIGN];
+        size_t addr = reinterpret_cast<size_t>(_mem[t]);
+        _tiles[t] = reinterpret_cast<PairBin*>((addr + ALIGN - 1) & ~size_t(ALIGN - 1));
+        std::fill(reinterpret_cast<double*>(_tiles[t]),
+                  reinterpret_cast<double*>(_tiles[t] + n), 0.);
+    }
+
+    int _nbins;
+    int _tile;
+    std::vector<PairBin*> _tiles;
+    std::vector<char*> _mem;
+};
+
+// Rather than adding each pair to its bin one at a time, directProcess11 stores the values
+// for the pair in a PairBuffer.  When the buffer is full (or at the end of processing), all
+// the pairs are done at once in flushPairs.  The values are kept in separate arrays for
+// each quantity, so the loops that do the shear projections and the xi products can be
+// vectorized by the compiler.
+struct PairBuffer
+{
+    enum { SIZE = 256 };
+
+    PairBuffer() : n(0) {}
+
+    int n;          // The number of pairs currently in the buffer.
+    int k[SIZE];    // The bin for each pair.
+    int k2[SIZE];   // The bin for the reverse pair, or -1 if none.
+    double r[SIZE];
+    double logr[SIZE];
+    double nn[SIZE];
+    double ww[SIZE];
+    // The values for each cell: w or wk, or the real and imaginary parts of wg.
+    double v1r[SIZE], v1i[SIZE];
+    double v2r[SIZE], v2i[SIZE];
+    // For Flat coordinates, the separation (x2-x1, y2-y1), which is used for projecting the
+    // shears.  For other coordinates, the shears are already projected, and this is (1,0).
+    double dx[SIZE], dy[SIZE];
+    // The resulting xi values for each pair.
+    double xi0[SIZE], xi1[SIZE], xi2[SIZE], xi3[SIZE];
+};
+
+// The scratch arrays for processLeaves, which are kept with each accumulator like its
+// PairBuffer, so they don't need to be allocated again for every pair of cells.  The types of
+// the leaves and positions depend on the coordinate system, which isn't a template parameter
+// of BinnedCorr2, so they are stored untyped here, and processLeaves casts them back.
+struct LeafBuffer
+{
+    std::vector<const void*> leaves1;   // The Cell<D1,C>* for the leaves of c1
+    std::vector<const void*> leaves2;   // The Cell<D2,C>* for the leaves of c2
+    std::vector<double> pos2;           // Storage for a Position<C> for each of leaves2
+    std::vector<double> rsq;
+    std::vector<char> ok;
+};
+
+// One unit of work for the parallel loop in BinnedCorr2::process: a pair of top-level cells
+// (i,j), or process2 for cell i if j < 0.  The cost is a rough estimate of how long it will
+// take, which is used to do the most expensive ones first.  In processPatches, k is the
+// index of the pair of patches that the item belongs to.
+struct WorkItem
+{
+    WorkItem(double c, long i1, long j1, long k1=0) :
+        cost(c), i(i1), j(j1), k(k1), domain(-1) {}
+    // Sort in order of decreasing cost.
+    bool operator<(const WorkItem& rhs) const { return cost > rhs.cost; }
+
+    double cost;
+    long i;
+    long j;
+    long k;
+    int domain;  // The NUMA domain to run it in, or -1 for any.
+};
+
+// The input arrays for processPairwiseArrays.  z may be null for Flat coordinates.  The ones
+// of g1, g2, k that aren't used for the data type may also be null.
+struct ObjectArrays
+{
+    ObjectArrays(const double* x1, const double* y1, const double* z1, const double* g11,
+                 const double* g21, const double* k1, const double* w1) :
+        x(x1), y(y1), z(z1), g1(g11 ? g11 : w1), g2(g21 ? g21 : w1), k(k1 ? k1 : w1), w(w1) {}
+
+    const double* x;
+    const double* y;
+    const double* z;
+    const double* g1;
+    const double* g2;
+    const double* k;
+    const double* w;
+};
+
 // BinnedCorr2 encapsulates a binned correlation function.
 template <int D1, int D2, int B>
 class BinnedCorr2
@@ -34,7 +225,7 @@ class BinnedCorr2
 public:
 
     BinnedCorr2(double minsep, double maxsep, int nbins, double binsize, double b,
-                double minrpar, double maxrpar, double xp, double yp, double zp,
+                int leaf_size, double minrpar, double maxrpar, double xp, double yp, double zp,
                 double* xi0, double* xi1, double* xi2, double* xi3,
                 double* meanr, double* meanlogr, double* weight, double* npairs);
     BinnedCorr2(const BinnedCorr2& rhs, bool copy_data=true);
@@ -49,6 +240,76 @@ public:
     template <int C, int M>
     void processPairwise(const SimpleField<D1, C>& field, const SimpleField<D2, C>& field2,
                          bool dots);
+    // The same thing, but directly from the input arrays, without building any Cells.
+    // The objects are done in blocks of PairBuffer::SIZE, so the distances and the bins for
+    // each block are calculated in simple loops over contiguous arrays.
+    template <int C, int M>
+    void processPairwiseArrays(const ObjectArrays& obj1, const ObjectArrays& obj2, long nobj,
+                               bool dots);
+
+    // Process many pairs of patches (fields1[pairs_i[k]], fields2[pairs_j[k]]) in a single
+    // parallel loop, adding the results for pair k to row k (of length nbins) of each of the
+    // output arrays.  For an auto-correlation, fields2 is the same as fields1, and the pairs
+    // with i == j are done as auto-correlations.
+    template <int C, int M>
+    void processPatches(const std::vector<const Field<D1,C>*>& fields1,
+                        const std::vector<const Field<D2,C>*>& fields2,
+                        const std::vector<long>& pairs_i, const std::vector<long>& pairs_j,
+                        bool is_auto, double* xi0, double* xi1, double* xi2, double* xi3,
+                        double* meanr, double* meanlogr, double* weight, double* npairs,
+                        bool dots);
+
+    // Process a single field1 (and field2) over the whole catalog, whose objects are in patches
+    // patch1 (and patch2), adding the results for each pair of patches (i,j) to row
+    // i*npatch2+j of the output arrays, as processPatches would for fields of the separate
+    // patches.  Pairs of cells that are both within a single patch are done as usual, but
+    // ones with objects in several patches are split until they aren't.  For an
+    // auto-correlation, field2 is the same as field1, and the pairs of different patches are
+    // added to the row with i < j.  Returns false (without doing anything) if some leaf has
+    // objects in more than one patch.
+    template <int C, int M>
+    bool processTagged(const Field<D1,C>& field1, const Field<D2,C>& field2, bool is_auto,
+                       const long* patch1, const long* patch2, int npatch1, int npatch2,
+                       double* xi0, double* xi1, double* xi2, double* xi3,
+                       double* meanr, double* meanlogr, double* weight, double* npairs,
+                       bool dots);
+
+    // Process the field(s) as usual, but also record the list of pairs of cells that are
+    // added to the bins.  For an auto-correlation, field2 is the same as field1.
+    template <int C, int M>
+    InteractionList* record(const Field<D1,C>& field1, const Field<D2,C>& field2, bool is_auto,
+                            bool dots);
+
+    // Add the pairs in a list from record to the bins, using the data in field1 and field2,
+    // which must have the same trees as the fields that were used to record it.
+    template <int C>
+    void replay(const InteractionList& list, const Field<D1,C>& field1,
+                const Field<D2,C>& field2, bool dots);
+
+    // Check that a list from record has the same binning as this, and that it was recorded
+    // with the trees of cells1 and cells2 (all the cells of each field, in the order of
+    // CollectCells).  Returns the correlation whose bins the list uses, which is the
+    // chord-space copy if it was recorded in chord space.  Throws runtime_error if not.
+    template <int C>
+    BinnedCorr2<D1,D2,B>* checkList(const InteractionList& list,
+                                    const std::vector<const Cell<D1,C>*>& cells1,
+                                    const std::vector<const Cell<D2,C>*>& cells2);
+
+    // Whether two fields are too far apart to have any pairs in the range of separations.
+    template <int C, int M>
+    bool tooFarApart(const Field<D1,C>& field1, const Field<D2,C>& field2,
+                     const MetricHelper<M>& metric) const;
+
+    // For the Periodic metric, do the calculation with the Euclidean metric, pairing the
+    // top-level cells with both the cells of the other field and their periodic images.
+    // This only works if max_sep is at most half the period in every direction.
+    // Returns false if it doesn't, in which case the caller should use the Periodic metric.
+    template <int C>
+    bool processImages(const Field<D1,C>& field, bool dots);
+    template <int C>
+    bool processImages(const Field<D1,C>& field1, const Field<D2,C>& field2, bool dots);
+    template <int C>
+    bool canUseImages() const;
 
     // Main worker functions for calculating the result
     template <int C, int M>
@@ -58,34 +319,194 @@ public:
     void process11(const Cell<D1,C>& c1, const Cell<D2,C>& c2, const MetricHelper<M>& m,
                    bool do_reverse);
 
+    // Run process2 or process11 for each item, in parallel if OpenMP is available.
+    // If in_order, the items are done in the given order, rather than the most expensive first.
+    template <int C, int M>
+    void processItems(const std::vector<Cell<D1,C>*>& cells1,
+                      const std::vector<Cell<D2,C>*>& cells2,
+                      std::vector<WorkItem>& items, bool do_reverse, bool dots,
+                      bool in_order=false);
+
+    // Run the items [start,end) in parallel, and accumulate the results in _thread_accums[0].
+    // finished[n] is set for each item that gets done.
+    template <int C, int M>
+    void processChunk(const std::vector<Cell<D1,C>*>& cells1,
+                      const std::vector<Cell<D2,C>*>& cells2,
+                      const std::vector<WorkItem>& items, long start, long end,
+                      bool do_reverse, bool dots, long dot_step, double task_min,
+                      BudgetTracker& tracker, std::vector<char>& finished);
+
+    // The recursion for processTagged.  Once both cells are within a single patch, these
+    // call process2 or process11 for the accumulator of that pair of patches.
+    template <int C, int M>
+    void taggedProcess2(const Cell<D1,C>& c12, const MetricHelper<M>& m,
+                        const PatchLabels<D1,C>& labels);
+    template <int C, int M>
+    void taggedProcess11(const Cell<D1,C>& c1, const Cell<D2,C>& c2, const MetricHelper<M>& m,
+                         const PatchLabels<D1,C>& labels1, const PatchLabels<D2,C>& labels2,
+                         bool do_reverse);
+
+    // The accumulator for the pair of patches (p1,p2) in processTagged, from _tagged_pool if
+    // this is the first time the current item uses it.
+    BinnedCorr2<D1,D2,B>& taggedOut(int p1, int p2);
+    // Add all the accumulators that the current item used to their rows in outs, and
+    // return them to the pool.
+    void flushTagged(std::vector<BinnedCorr2<D1,D2,B>*>& outs);
+
+    // Run process2 or process11 as an OpenMP task, which may run on a different thread.
+    template <int C, int M>
+    void spawnProcess2(const Cell<D1,C>& c12);
+    template <int C, int M>
+    void spawnProcess11(const Cell<D1,C>& c1, const Cell<D2,C>& c2, bool do_reverse);
+
+    // Do all pairs of leaves in c1 and c2 directly, rather than recursing.
+    template <int C, int M>
+    void processLeaves(const Cell<D1,C>& c1, const Cell<D2,C>& c2, const MetricHelper<M>& m,
+                       bool do_reverse);
+
     template <int C>
     void directProcess11(const Cell<D1,C>& c1, const Cell<D2,C>& c2, const double dsq,
                          bool do_reverse, int k=-1, double r=0., double logr=0.);
 
+    // The part of directProcess11 that only needs the CellData.  This is also used by
+    // processPairwiseArrays for objects that aren't in Cells.
+    template <int C>
+    void directProcessData(const CellData<D1,C>& c1, const CellData<D2,C>& c2, const double dsq,
+                           bool do_reverse, int k=-1, double r=0., double logr=0.);
+
+    // Find the bin for a pair with separation rsq.  If k >= 0, it (and r, logr) are already
+    // known from the traversal, but otherwise they are calculated here.  For the Arc metric in
+    // chord space, r is converted to the angle.
+    template <int C>
+    int findBin(const Position<C>& p1, const Position<C>& p2, double rsq,
+                int k, double& r, double& logr) const;
+
+    // The bin of the reverse pair (p2,p1), which is only different for TwoD binning.
+    template <int C>
+    int findReverseBin(const Position<C>& p1, const Position<C>& p2, double r, double logr) const;
+
+    // Add all the pairs in _buffer to the accumulator bins.  UW is whether the weights are
+    // all 1, which uses nn as the weight of each pair.
+    void flushPairs();
+    template <bool UW>
+    void flushPairs();
+
+    // Add the accumulated pairs to out, and reset the bins.  Several threads may call this
+    // with the same out.
+    void flushTo(BinnedCorr2<D1,D2,B>& out);
+
+    // Set the limits for the progressive mode, and the flag for cancelling a call.
+    // cf. ProcessBudget.
+    void setBudget(double max_time, double max_pairs, double* used, long* cancel)
+    {
+        _budget.max_time = max_time;
+        _budget.max_pairs = max_pairs;
+        _budget.used = used;
+        _budget.cancel = cancel;
+    }
+
+    // Set the array where the TraversalStats of each process call are added.  (May be null.)
+    void setStats(double* stats) { _stats_out = stats; }
+
+    // Set the file to use for checkpointing, and how often to write it.  cf. Checkpoint.h.
+    // An empty file name turns off checkpointing.  If publish_interval > 0, the results
+    // are added to the output arrays about that often (in seconds), rather than at the end.
+    void setCheckpoint(const char* file, double interval, double publish_interval)
+    {
+        _checkpoint.file = file;
+        _checkpoint.interval = interval;
+        _checkpoint.publish_interval = publish_interval;
+    }
+
+    // Copy the output arrays to these, which have the same layout, while no chunk of
+    // the process function is being added to them.  This is safe to call from another
+    // thread while a process function is running.
+    void copyResults(double* xi0, double* xi1, double* xi2, double* xi3,
+                     double* meanr, double* meanlogr, double* weight, double* npairs) const;
+
+    // Only do the share of the top-level work items that belongs to rank, when nranks
+    // processes each do the same process call and then add up their results.
+    // cf. PartitionItems.
+    void setPartition(int rank, int nranks) { _rank = rank; _nranks = nranks; }
+
+    // Set whether to find the Log bins from a table of the bin edges rather than computing
+    // log(r) for each pair, and whether to skip accumulating meanlogr.  cf. LogBinTable.
+    void setBinOptions(bool fast_bins, bool skip_meanlogr);
+
+    // Set the factor f for splitting both cells rather than just the larger one when they
+    // are of comparable size: the smaller one is split too if s2 > f*b.  cf. CalcSplitSq.
+    void setSplitFactor(double split_factor);
+
+    // Set whether all the objects in the fields have w = 1, in which case w = n for every
+    // cell, and the weight of each pair is just the product of the counts.
+    void setUnitWeights(bool unit_weights);
+
+    // Only accumulate pairs with separations below maxsep, rather than the full range of the
+    // bins.  The hybrid mesh engine does the bins above this scale.
+    void setMaxSep(double maxsep);
+
+    // For the Arc metric on the sphere with the LogBinTable set up, a copy of this that uses
+    // the chord distances for its bins and separations, so it can be run with the Euclidean
+    // metric.  It adds to the same output arrays.  Returns null if this isn't possible.
+    BinnedCorr2<D1,D2,B>* getChordCorr();
+
+    // BinTypeHelper<B>::singleBin, or the faster version if the LogBinTable is set up.
+    template <int C>
+    bool singleBin(double rsq, double s1ps2, const Position<C>& p1, const Position<C>& p2,
+                   int& k, double& r, double& logr) const
+    {
+        if (_logbins.active()) return _logbins.singleBin(rsq, s1ps2, _bsq, k, r);
+        return BinTypeHelper<B>::singleBin(rsq, s1ps2, p1, p2, _binsize, _b, _bsq,
+                                           _minsep, _maxsep, _logminsep, k, r, logr);
+    }
+
+    // Copy the accumulated results to or from a vector of doubles for the checkpoint file.
+    // These are only valid for the accumulators.
+    void packData(std::vector<double>& data) const;
+    void unpackData(const std::vector<double>& data);
+
+    // The number of bytes of memory used by this object, including its per-thread
+    // accumulators, but not the output arrays, which belong to the python layer.
+    size_t getNBytes() const;
+    // The number of bytes that each per-thread accumulator uses for the given number of bins.
+    static size_t getThreadNBytes(int nbins);
+
     // Note: op= only copies _data.  Not all the params.
     void operator=(const BinnedCorr2<D1,D2,B>& rhs);
     void operator+=(const BinnedCorr2<D1,D2,B>& rhs);
 
-    // Sample a random subset of pairs in a given range
+    // Sample a random subset of pairs in a given range.  This is reproducible for a given
+    // seed > 0 and number of threads.  If seed = 0, a random seed is used.
     template <int C, int M>
     long samplePairs(const Field<D1, C>& field1, const Field<D2, C>& field2,
-                     double min_sep, double max_sep, long* i1, long* i2, double* sep, int n);
+                     double min_sep, double max_sep, long* i1, long* i2, double* sep, int n,
+                     long seed);
     template <int C, int M>
     void samplePairs(const Cell<D1, C>& c1, const Cell<D2, C>& c2, const MetricHelper<M>& m,
                      double min_sep, double min_sepsq, double max_sep, double max_sepsq,
-                     long* i1, long* i2, double* sep, int n, long& k);
+                     long* i1, long* i2, double* sep, int n, long& k, RandomStream& rng);
     template <int C>
     void sampleFrom(const Cell<D1, C>& c1, const Cell<D2, C>& c2, double rsq, double r,
-                    long* i1, long* i2, double* sep, int n, long& k);
+                    long* i1, long* i2, double* sep, int n, long& k, RandomStream& rng);
 
 
 protected:
 
+    template <int B2>
+    friend class MultiCorr2;
+    template <int D1b, int D2b>
+    friend class MultiBinCorr2;
+    template <int D1b, int D2b, int B2>
+    friend class MultiPartnerCorr2;
+    template <int B2>
+    friend class ColumnCorr2;
+
     double _minsep;
     double _maxsep;
     int _nbins;
     double _binsize;
     double _b;
+    int _leaf_size; // Cells with at most this many objects are processed pair by pair.
     double _minrpar, _maxrpar;
     double _xp, _yp, _zp;
     double _logminsep;
@@ -97,11 +518,63 @@ protected:
     double _fullmaxsepsq;
     int _coords; // Stores the kind of coordinates being used for the analysis.
 
-    // These are usually allocated in the python layer and just built up here.
+    // If active, the table of bin edges to use for Log binning.
+    LogBinTable _logbins;
+    // Whether to skip the meanlogr accumulation, in which case log(r) isn't needed.
+    bool _skip_meanlogr;
+    // The square of the split factor.  cf. setSplitFactor.
+    double _splitfactorsq;
+    // Whether the weights are all 1.  cf. setUnitWeights.
+    bool _unit_weights;
+    // Whether the separations are chord distances, which are converted to angles when the
+    // pairs are accumulated.  cf. getChordCorr.
+    bool _chord;
+    BinnedCorr2<D1,D2,B>* _chord_corr;
+
+    // Whether to record the pairs of cells passed to directProcess11 in _recorded.
+    bool _recording;
+    std::vector<RecordedPair> _recorded;
+
+    // When processing in parallel, big pairs of cells are split into OpenMP tasks, which may
+    // run on any thread, so idle threads can help finish them.  Each task adds its results
+    // to the copy for the thread it runs on, which is found in _thread_corrs.
+    // Pairs whose estimated cost is more than _task_min are split this way.
+    std::vector<BinnedCorr2<D1,D2,B>*>* _thread_corrs;
+    double _task_min;
+
+    // The per-thread accumulators used when processing in parallel.  These are kept from one
+    // process call to the next, so they don't need to be reallocated each time.
+    std::vector<BinnedCorr2<D1,D2,B>*> _thread_accums;
+
+    // The limits for the progressive mode, if any.
+    ProcessBudget _budget;
+
+    // The counters for the current process call, and where to add them when it is done.
+    TraversalStats _stats;
+    double* _stats_out;
+
+    // The checkpoint file, if any.
+    CheckpointSpec _checkpoint;
+
+    // Which share of the work items to do, if the work is split over several processes.
+    int _rank;
+    int _nranks;
+
+    // For processTagged, the accumulators that the current item has used, by their row in
+    // the output, and the ones that aren't being used.
+    std::map<long, BinnedCorr2<D1,D2,B>*> _tagged_active;
+    std::vector<BinnedCorr2<D1,D2,B>*> _tagged_pool;
+    long _tagged_npatch2;
+    bool _tagged_auto;
+
+    // The output arrays are allocated in the python layer and just built up here.
     // So all we have here is a bare pointer for each of them.
-    // However, for the OpenMP stuff, we do create copies that we need to delete.
-    // So keep track if we own the data and need to delete the memory ourselves.
+    // The accumulators we make with the copy constructor instead have a PairBin record for
+    // each bin in _bins, which we own and need to delete ourselves.
     bool _owns_data;
+    PairBins* _bins;
+    PairBuffer* _buffer;  // The pairs waiting to be added to _bins.
+    LeafBuffer* _leaf_buffer;  // Scratch space for processLeaves.
 
     // The different correlation functions have different numbers of arrays for xi,
     // so encapsulate that difference with a templated XiData class.
@@ -112,17 +585,275 @@ protected:
     double* _npairs;
 };
 
+// A set of corresponding cells in an NField, a KField and a GField of the same catalog,
+// which were built with the same tree structure.  Any of them may be null (but not all).
+// The positions and sizes are the same for all of them, so these are taken from the first
+// one that is set.
+template <int C>
+struct CellSet
+{
+    CellSet(const Cell<NData,C>* n_=0, const Cell<KData,C>* k_=0, const Cell<GData,C>* g_=0) :
+        n(n_), k(k_), g(g_) {}
+
+    const Position<C>& getPos() const
+    { return n ? n->getPos() : k ? k->getPos() : g->getPos(); }
+    double getSize() const { return n ? n->getSize() : k ? k->getSize() : g->getSize(); }
+    long getN() const { return n ? n->getN() : k ? k->getN() : g->getN(); }
+    double getW() const { return n ? n->getW() : k ? k->getW() : g->getW(); }
+
+    CellSet<C> getLeft() const
+    { return CellSet<C>(n ? n->getLeft() : 0, k ? k->getLeft() : 0, g ? g->getLeft() : 0); }
+    CellSet<C> getRight() const
+    { return CellSet<C>(n ? n->getRight() : 0, k ? k->getRight() : 0, g ? g->getRight() : 0); }
+
+    const Cell<NData,C>* n;
+    const Cell<KData,C>* k;
+    const Cell<GData,C>* g;
+};
+
+// MultiCorr2 does several correlation functions of the same catalogs (e.g. NN, NG and GG)
+// with a single walk through the trees.  They must all use the same binning, so the
+// decisions about when to split the cells are the same for all of them.  Each pair of cells
+// that lands in a single bin is then added to each of the correlation functions.
+// Any of the BinnedCorr2 pointers may be null if that correlation isn't wanted.
+template <int B>
+class MultiCorr2
+{
+public:
+
+    MultiCorr2(BinnedCorr2<NData,NData,B>* nn, BinnedCorr2<NData,KData,B>* nk,
+               BinnedCorr2<NData,GData,B>* ng, BinnedCorr2<KData,KData,B>* kk,
+               BinnedCorr2<KData,GData,B>* kg, BinnedCorr2<GData,GData,B>* gg);
+
+    // For the auto-correlations, only nn, kk, and gg may be set.
+    template <int C, int M>
+    void process(const std::vector<CellSet<C> >& cells, bool dots);
+    template <int C, int M>
+    void process(const std::vector<CellSet<C> >& cells1, const std::vector<CellSet<C> >& cells2,
+                 bool dots);
+
+    template <int C, int M>
+    void process2(const CellSet<C>& c12, const MetricHelper<M>& m);
+    template <int C, int M>
+    void process11(const CellSet<C>& c1, const CellSet<C>& c2, const MetricHelper<M>& m,
+                   bool do_reverse);
+    template <int C>
+    void directProcess11(const CellSet<C>& c1, const CellSet<C>& c2, double rsq,
+                         bool do_reverse, int k, double r, double logr);
+
+private:
+
+    template <int C, int M>
+    void processItems(const std::vector<CellSet<C> >& cells1,
+                      const std::vector<CellSet<C> >& cells2,
+                      std::vector<WorkItem>& items, bool do_reverse, bool dots);
+
+    // Copy the binning parameters from one of the correlation functions.
+    template <int D1, int D2>
+    void setParams(const BinnedCorr2<D1,D2,B>& corr);
+
+    // Helpers to do each step of processItems for one of the correlation functions,
+    // which do nothing if corr is null.
+    template <typename T>
+    static void getAccums(T* corr, int nthreads, int coords);
+    template <typename T>
+    static T* startThread(T* corr, int tid);
+    template <typename T>
+    static void finish(T* corr);
+
+    BinnedCorr2<NData,NData,B>* _nn;
+    BinnedCorr2<NData,KData,B>* _nk;
+    BinnedCorr2<NData,GData,B>* _ng;
+    BinnedCorr2<KData,KData,B>* _kk;
+    BinnedCorr2<KData,GData,B>* _kg;
+    BinnedCorr2<GData,GData,B>* _gg;
+
+    double _minsep;
+    double _maxsep;
+    int _nbins;
+    double _binsize;
+    double _b;
+    double _minrpar, _maxrpar;
+    double _xp, _yp, _zp;
+    double _logminsep;
+    double _halfminsep;
+    double _minsepsq;
+    double _maxsepsq;
+    double _bsq;
+    double _fullmaxsep;
+    double _fullmaxsepsq;
+    double _splitfactorsq;
+};
+
+// MultiBinCorr2 does the same correlation function with several different binnings (e.g.
+// coarse Log bins, fine Linear bins and a TwoD map) with a single walk through the trees.
+// Each pair of cells is checked against each binning that still needs it.  The ones for which
+// it falls into a single bin get the pair right away, and if any of the others need the cells
+// to be split, they are split according to the strictest b of those.  The children are then
+// only checked against the binnings that needed the split, which are tracked with a bit mask.
+// The binnings must all use the same metric parameters (rpar range and periods).
+template <int D1, int D2>
+class MultiBinCorr2
+{
+public:
+
+    enum { MAX_BINNINGS = 32 };
+
+    MultiBinCorr2(const std::vector<BinnedCorr2<D1,D2,Log>*>& logs,
+                  const std::vector<BinnedCorr2<D1,D2,Linear>*>& lins,
+                  const std::vector<BinnedCorr2<D1,D2,TwoD>*>& twods);
+
+    template <int C, int M>
+    void process(const Field<D1,C>& field, bool dots);
+    template <int C, int M>
+    void process(const Field<D1,C>& field1, const Field<D2,C>& field2, bool dots);
+
+    // mask has a bit set for each of the binnings to check, in the order logs, lins, twods.
+    template <int C, int M>
+    void process2(const Cell<D1,C>& c12, const MetricHelper<M>& m, unsigned int mask);
+    template <int C, int M>
+    void process11(const Cell<D1,C>& c1, const Cell<D2,C>& c2, const MetricHelper<M>& m,
+                   bool is_auto, unsigned int mask);
+
+private:
+
+    template <int C, int M>
+    void processItems(const std::vector<Cell<D1,C>*>& cells1,
+                      const std::vector<Cell<D2,C>*>& cells2,
+                      std::vector<WorkItem>& items, bool is_auto, bool dots);
+
+    // Check the pair against one binning.  If it is done with this pair (either because it
+    // is outside the range or because it was added to a single bin), return false.
+    // Otherwise return true and update bsq_eff to the effective bsq to use for splitting.
+    template <int B, int C, int M>
+    static bool checkBinning(BinnedCorr2<D1,D2,B>& corr, const Cell<D1,C>& c1,
+                             const Cell<D2,C>& c2, const MetricHelper<M>& m,
+                             double rsq, double s1ps2, double rpar, bool do_reverse,
+                             double& bsq_eff);
+
+    std::vector<BinnedCorr2<D1,D2,Log>*> _logs;
+    std::vector<BinnedCorr2<D1,D2,Linear>*> _lins;
+    std::vector<BinnedCorr2<D1,D2,TwoD>*> _twods;
+    int _n;  // The total number of binnings.
+
+    // The metric parameters, which are the same for all of them.
+    double _minrpar, _maxrpar;
+    double _xp, _yp, _zp;
+    // The most permissive range of any of them.
+    double _halfminsep;
+    double _fullmaxsep;
+    // The smallest split factor of any of them.
+    double _splitfactorsq;
+};
+
+// The shared and partner cells of a MultiPartnerCorr2, which are on sides 1 and 2 of each
+// pair if S1, else on sides 2 and 1.
+template <int D1, int D2, int C, bool S1>
+struct PartnerCells
+{
+    typedef Cell<D1,C> Shared;
+    typedef Cell<D2,C> Partner;
+    typedef Field<D1,C> SharedField;
+    typedef Field<D2,C> PartnerField;
+    static const Cell<D1,C>& first(const Shared& s, const Partner& ) { return s; }
+    static const Cell<D2,C>& second(const Shared& , const Partner& p) { return p; }
+};
+
+template <int D1, int D2, int C>
+struct PartnerCells<D1,D2,C,false>
+{
+    typedef Cell<D2,C> Shared;
+    typedef Cell<D1,C> Partner;
+    typedef Field<D2,C> SharedField;
+    typedef Field<D1,C> PartnerField;
+    static const Cell<D1,C>& first(const Shared& , const Partner& p) { return p; }
+    static const Cell<D2,C>& second(const Shared& s, const Partner& ) { return s; }
+};
+
+// MultiPartnerCorr2 does the cross-correlations of one shared field with each of several
+// partner fields in a single walk of the shared tree, e.g. one source catalog with each of
+// the lens bins of a tomographic analysis.  The results with partner p go in corrs[p].
+// Each cell of the shared tree is checked against the list of partner cells that are still
+// active there.  The ones that fall into a single bin, or only need the partner cell to be
+// split, are finished with that partner's correlation as usual.  The rest are passed on to
+// the children of the shared cell, so it is only split once for all of them.
+// The shared field is on side 1 of the correlations if shared1, else on side 2.  The
+// correlations must all use the same metric parameters (rpar range and periods).
+template <int D1, int D2, int B>
+class MultiPartnerCorr2
+{
+public:
+
+    MultiPartnerCorr2(const std::vector<BinnedCorr2<D1,D2,B>*>& corrs);
+
+    // If S1, field is a Field<D1,C> and fields are Field<D2,C>, else the other way around.
+    template <int C, int M, bool S1>
+    void process(const typename PartnerCells<D1,D2,C,S1>::SharedField& field,
+                 const std::vector<const typename
+                                   PartnerCells<D1,D2,C,S1>::PartnerField*>& fields,
+                 bool dots);
+
+    // Each of the pairs is the index of a partner and a cell of that partner's field.
+    template <int C, int M, bool S1>
+    void process11(const typename PartnerCells<D1,D2,C,S1>::Shared& s,
+                   const std::vector<std::pair<int, const typename
+                                               PartnerCells<D1,D2,C,S1>::Partner*> >& pairs,
+                   const MetricHelper<M>& m);
+
+private:
+
+    std::vector<BinnedCorr2<D1,D2,B>*> _corrs;
+
+    // The metric parameters, which are the same for all of them.
+    double _minrpar, _maxrpar;
+    double _xp, _yp, _zp;
+};
+
+// ColumnCorr2 does the correlations of many columns of k or g values with the same positions
+// and weights (cf. CellColumns) from a single list of the pairs of cells, which is recorded
+// by an NN correlation of NFields with those positions.  (cf. BinnedCorr2::record)
+// The npairs, weight, meanr and meanlogr are the same for all of the columns, so those are
+// just the results of the NN correlation.  Here, each pair of cells is added to the bins
+// of all the columns at once.
+//
+// The results for each column j are added to xi0[j*nbins + k], etc., with the same xi arrays
+// as the usual correlation of that kind.  e.g. xip, xip_im, xim, xim_im for GG.
+template <int B>
+class ColumnCorr2
+{
+public:
+
+    ColumnCorr2(BinnedCorr2<NData,NData,B>& nn, int ncol,
+                double* xi0, double* xi1, double* xi2, double* xi3);
+
+    // D1,D2 are the kinds of values in cols1, cols2.  For D1 == NData, the weights of the
+    // cells in cells1 are used, and cols1 is ignored.
+    template <int D1, int D2, int C>
+    void process(const InteractionList& list,
+                 const std::vector<const Cell<NData,C>*>& cells1,
+                 const std::vector<const Cell<NData,C>*>& cells2,
+                 const CellColumns<C>* cols1, const CellColumns<C>& cols2, bool dots);
+
+private:
+
+    BinnedCorr2<NData,NData,B>& _nn;
+    int _ncol;
+    double* _xi[4];
+};
+
 template <int D1, int D2>
 struct XiData // This works for NK, KK
 {
     XiData(double* xi0, double*, double*, double*) : xi(xi0) {}
 
-    void new_data(int n) { xi = new double[n]; }
-    void delete_data(int n) { delete [] xi; xi = 0; }
-    void copy(const XiData<D1,D2>& rhs,int n)
-    { for (int i=0; i<n; ++i) xi[i] = rhs.xi[i]; }
     void add(const XiData<D1,D2>& rhs,int n)
     { for (int i=0; i<n; ++i) xi[i] += rhs.xi[i]; }
+    // Add values from n PairBin records for the bins starting at k0, or add these values to
+    // the records.
+    void addBins(const PairBin* bins, int k0, int n)
+    { for (int i=0; i<n; ++i) xi[k0+i] += bins[i].xi[0]; }
+    void addToBins(PairBin* bins, int k0, int n) const
+    { for (int i=0; i<n; ++i) bins[i].xi[0] += xi[k0+i]; }
     void clear(int n)
     { for (int i=0; i<n; ++i) xi[i] = 0.; }
     void write(std::ostream& os) const // Just used for debugging.  Print the first value.
@@ -140,25 +871,20 @@ struct XiData<D1, GData> // This works for NG, KG
 {
     XiData(double* xi0, double* xi1, double*, double*) : xi(xi0), xi_im(xi1) {}
 
-    void new_data(int n)
+    void add(const XiData<D1,GData>& rhs,int n)
     {
-        xi = new double[n];
-        xi_im = new double[n];
+        for (int i=0; i<n; ++i) xi[i] += rhs.xi[i];
+        for (int i=0; i<n; ++i) xi_im[i] += rhs.xi_im[i];
     }
-    void delete_data(int n)
+    void addBins(const PairBin* bins, int k0, int n)
     {
-        delete [] xi; xi = 0;
-        delete [] xi_im; xi_im = 0;
+        for (int i=0; i<n; ++i) xi[k0+i] += bins[i].xi[0];
+        for (int i=0; i<n; ++i) xi_im[k0+i] += bins[i].xi[1];
     }
-    void copy(const XiData<D1,GData>& rhs,int n)
+    void addToBins(PairBin* bins, int k0, int n) const
     {
-        for (int i=0; i<n; ++i) xi[i] = rhs.xi[i];
-        for (int i=0; i<n; ++i) xi_im[i] = rhs.xi_im[i];
-    }
-    void add(const XiData<D1,GData>& rhs,int n)
-    {
-        for (int i=0; i<n; ++i) xi[i] += rhs.xi[i];
-        for (int i=0; i<n; ++i) xi_im[i] += rhs.xi_im[i];
+        for (int i=0; i<n; ++i) bins[i].xi[0] += xi[k0+i];
+        for (int i=0; i<n; ++i) bins[i].xi[1] += xi_im[k0+i];
     }
     void clear(int n)
     {
@@ -178,27 +904,6 @@ struct XiData<GData, GData>
     XiData(double* xi0, double* xi1, double* xi2, double* xi3) :
         xip(xi0), xip_im(xi1), xim(xi2), xim_im(xi3) {}
 
-    void new_data(int n)
-    {
-        xip = new double[n];
-        xip_im = new double[n];
-        xim = new double[n];
-        xim_im = new double[n];
-    }
-    void delete_data(int n)
-    {
-        delete [] xip; xip = 0;
-        delete [] xip_im; xip_im = 0;
-        delete [] xim; xim = 0;
-        delete [] xim_im; xim_im = 0;
-    }
-    void copy(const XiData<GData,GData>& rhs,int n)
-    {
-        for (int i=0; i<n; ++i) xip[i] = rhs.xip[i];
-        for (int i=0; i<n; ++i) xip_im[i] = rhs.xip_im[i];
-        for (int i=0; i<n; ++i) xim[i] = rhs.xim[i];
-        for (int i=0; i<n; ++i) xim_im[i] = rhs.xim_im[i];
-    }
     void add(const XiData<GData,GData>& rhs,int n)
     {
         for (int i=0; i<n; ++i) xip[i] += rhs.xip[i];
@@ -206,6 +911,20 @@ struct XiData<GData, GData>
         for (int i=0; i<n; ++i) xim[i] += rhs.xim[i];
         for (int i=0; i<n; ++i) xim_im[i] += rhs.xim_im[i];
     }
+    void addBins(const PairBin* bins, int k0, int n)
+    {
+        for (int i=0; i<n; ++i) xip[k0+i] += bins[i].xi[0];
+        for (int i=0; i<n; ++i) xip_im[k0+i] += bins[i].xi[1];
+        for (int i=0; i<n; ++i) xim[k0+i] += bins[i].xi[2];
+        for (int i=0; i<n; ++i) xim_im[k0+i] += bins[i].xi[3];
+    }
+    void addToBins(PairBin* bins, int k0, int n) const
+    {
+        for (int i=0; i<n; ++i) bins[i].xi[0] += xip[k0+i];
+        for (int i=0; i<n; ++i) bins[i].xi[1] += xip_im[k0+i];
+        for (int i=0; i<n; ++i) bins[i].xi[2] += xim[k0+i];
+        for (int i=0; i<n; ++i) bins[i].xi[3] += xim_im[k0+i];
+    }
     void clear(int n)
     {
         for (int i=0; i<n; ++i) xip[i] = 0.;
@@ -226,10 +945,9 @@ template <>
 struct XiData<NData, NData>
 {
     XiData(double* , double* , double* , double* ) {}
-    void new_data(int n) {}
-    void delete_data(int n) {}
-    void copy(const XiData<NData,NData>& rhs,int n) {}
     void add(const XiData<NData,NData>& rhs,int n) {}
+    void addBins(const PairBin* bins, int k0, int n) {}
+    void addToBins(PairBin* bins, int k0, int n) const {}
     void clear(int n) {}
     void write(std::ostream& os) const {}
 };
@@ -14,24 +14,181 @@
 
 extern void* BuildCorr2(int d1, int d2, int bin_type,
                         double minsep, double maxsep, int nbins, double binsize, double b,
-                        double minrpar, double maxrpar, double xp, double yp, double zp,
+                        int leaf_size, double minrpar, double maxrpar,
+                        double xp, double yp, double zp,
                         double* xip, double* xip_im, double* xim, double* xim_im,
                         double* meanr, double* meanlogr, double* weight, double* npairs);
 
 extern void DestroyCorr2(void* corr, int d1, int d2, int bin_type);
 
-extern void ProcessAuto2(void* corr, void* field, int dots,
-                         int d, int coord, int bin_type, int metric);
+// Set the limits for the progressive mode of the process functions.  0 means no limit.
+// The limits are for all the process calls that share the array used (cf. ProcessBudget),
+// which also records how much of the top-level work was done.  If *cancel is set to a
+// non-zero value (e.g. from another thread), the process functions stop starting new work.
+extern void SetCorr2Budget(void* corr, int d1, int d2, int bin_type,
+                           double max_time, double max_pairs, double* used,
+                           long* cancel);
 
-extern void ProcessCross2(void* corr, void* field1, void* field2, int dots,
-                          int d1, int d2, int coord, int bin_type, int metric);
+// Set the array to which the traversal counters (cf. TraversalStats.h) of each process call
+// are added.  It should have GetNTraversalStats() elements.
+extern void SetCorr2Stats(void* corr, int d1, int d2, int bin_type, double* stats);
+extern int GetNTraversalStats();
+
+// Set whether to find the bins for Log binning from a table of the bin edges rather than
+// computing log(r) for each pair, and whether to skip accumulating meanlogr, in which case
+// the meanlogr array is left as 0.
+extern void SetCorr2BinOptions(void* corr, int d1, int d2, int bin_type, int fast_bins,
+                               int skip_meanlogr);
+
+// Set the maximum separation of the pairs to accumulate, which may be less than the max_sep
+// used to build corr.  The bins above this are left alone.
+extern void SetCorr2MaxSep(void* corr, int d1, int d2, int bin_type, double maxsep);
+
+// Set the factor f for when to split both cells of a pair of comparable size rather than
+// just the larger one.  The smaller one is split if its size is > f*b.  The default is 0.585.
+extern void SetCorr2SplitFactor(void* corr, int d1, int d2, int bin_type, double split_factor);
+
+// Set whether all the objects have w = 1, which lets the weight of each pair be the product
+// of the counts rather than the weights.
+extern void SetCorr2UnitWeights(void* corr, int d1, int d2, int bin_type, int unit_weights);
+
+// The number of bytes of memory used by corr, including the per-thread accumulators, but not
+// the output arrays.  If corr is NULL, return the number of bytes that each per-thread
+// accumulator would use for nbins.
+extern long GetCorr2NBytes(void* corr, int d1, int d2, int bin_type, int nbins);
+
+// Set the file to use for checkpointing the process functions, which is written every
+// interval seconds.  An empty file name turns it off.  If publish_interval > 0, the results
+// so far are added to the output arrays about every publish_interval seconds.
+extern void SetCorr2Checkpoint(void* corr, int d1, int d2, int bin_type,
+                               const char* file_name, double interval,
+                               double publish_interval);
+
+// Copy the output arrays of corr to these, which are as in BuildCorr2.  This can be called
+// from another thread while a process function is running, and gets the results of the
+// chunks that have been added so far.
+extern void CopyCorr2Results(void* corr, int d1, int d2, int bin_type,
+                             double* xip, double* xip_im, double* xim, double* xim_im,
+                             double* meanr, double* meanlogr, double* weight, double* npairs);
+
+// Only do the share of the top-level work that belongs to rank, out of nranks processes that
+// each make the same process calls with the same fields.  The sum of the results of all the
+// processes is then the full result.  nranks = 1 (the default) does all the work.
+extern void SetCorr2Partition(void* corr, int d1, int d2, int bin_type, int rank, int nranks);
+
+// ProcessAuto2 and ProcessCross2 return 0 if the checkpoint file could not be read or written.
+extern int ProcessAuto2(void* corr, void* field, int dots,
+                        int d, int coord, int bin_type, int metric);
+
+extern int ProcessCross2(void* corr, void* field1, void* field2, int dots,
+                         int d1, int d2, int coord, int bin_type, int metric);
+
+// Like ProcessAuto2 (if is_auto, with field2 = field1) or ProcessCross2, but also return the
+// list of the pairs of cells that were added to the bins, which can be used with
+// ReplayInteractions2 for other fields with the same trees.
+extern void* RecordInteractions2(void* corr, void* field1, void* field2, int is_auto, int dots,
+                                 int d1, int d2, int coord, int bin_type, int metric);
+
+// Add the pairs in an interaction list to the bins, using the data in field1 and field2.
+// Returns 0 if the fields don't have the trees or corr doesn't have the binning of the list,
+// 1 otherwise.
+extern int ReplayInteractions2(void* corr, void* ilist, void* field1, void* field2, int dots,
+                               int d1, int d2, int coord, int bin_type);
+extern long InteractionListSize(void* ilist);
+extern void DestroyInteractionList(void* ilist);
+
+// Add the correlations of ncol columns of k (d=2) or g (d=3) values to the xi arrays, with
+// a row of nbins for each column, using a list from RecordInteractions2 for the NN correlation
+// corr of the NFields field1 and field2.  The values of column j for object i are
+// v1r[j*nobj1+i] (and v1i for the imaginary part of g).  For d1=1, there are no values for
+// field1, and its weights are used instead.  Returns 0 if the list doesn't match.
+extern int ProcessColumns2(void* corr, void* ilist, void* field1, void* field2, int dots,
+                           int d1, int d2, int ncol, long nobj1, long nobj2,
+                           double* w1, double* v1r, double* v1i,
+                           double* w2, double* v2r, double* v2i,
+                           double* xi0, double* xi1, double* xi2, double* xi3,
+                           int coords, int bin_type);
+
+// Process several correlation functions of the same catalogs with a single walk through the
+// trees.  Any of the correlations may be NULL.  The fields for each catalog are the N, K and G
+// fields that are needed (the others NULL), which must have the same tree structure.
+// For an auto-correlation, the fields for the second catalog are all NULL.
+// Returns 0 if the fields don't have the same tree structure, 1 otherwise.
+extern int ProcessMulti2(void* nn, void* nk, void* ng, void* kk, void* kg, void* gg,
+                         void* nfield1, void* kfield1, void* gfield1,
+                         void* nfield2, void* kfield2, void* gfield2, int dots,
+                         int coord, int bin_type, int metric);
+
+// Process the same correlation function with several binnings with a single walk through the
+// trees.  corrs has ncorr BinnedCorr2 objects, all with the given d1,d2, and bin_types has the
+// bin_type of each.  For an auto-correlation, field2 is NULL.
+extern void ProcessMultiBin2(void** corrs, int* bin_types, int ncorr,
+                             void* field1, void* field2, int dots,
+                             int d1, int d2, int coord, int metric);
+
+// Process the cross-correlations of field with each of the ncorr partner fields in fields with
+// a single walk through the tree of field.  The results with fields[p] are added to corrs[p],
+// which all have the given d1,d2,bin_type.  field is on side 1 of the correlations if
+// shared1, else on side 2.
+extern void ProcessMultiPartner2(void** corrs, int ncorr, void* field, void** fields,
+                                 int shared1, int dots, int d1, int d2, int coord,
+                                 int bin_type, int metric);
+
+// Process all the pairs of patches (fields1[pairs_i[k]], fields2[pairs_j[k]]) in a single
+// parallel loop, which balances the work over the threads much better than doing them one
+// at a time.  For an auto-correlation, fields2 is NULL, and the pairs with i == j are the
+// auto-correlations of the patches.  The results for pair k are added to row k (of length
+// nbins) of each of the output arrays.  The xi arrays are as in BuildCorr2, with NULL for the
+// ones that are not used.  Pairs of patches that are too far apart to have any pairs in range
+// are skipped.
+extern void ProcessPatches2(void* corr, void** fields1, int nfields1,
+                            void** fields2, int nfields2,
+                            long npairs, long* pairs_i, long* pairs_j,
+                            double* xi0, double* xi1, double* xi2, double* xi3,
+                            double* meanr, double* meanlogr, double* weight, double* npairs_out,
+                            int dots, int d1, int d2, int coord, int bin_type, int metric);
+
+// Like ProcessPatches2, but with a single field1 (and field2, or NULL for an
+// auto-correlation) over the whole catalog, whose objects are in the patches given by
+// patch1 (and patch2).  The pairs of cells with objects in several patches are split as
+// needed, so this accumulates all the pairs of patches in one traversal of the trees.  The
+// results for the pair of patches (i,j) are added to row i*npatch2+j of the output arrays,
+// with only i <= j used for an auto-correlation.  Returns 0 (without doing anything) if some
+// leaf has objects in more than one patch, or 1 if it worked.
+extern int ProcessTagged2(void* corr, void* field1, void* field2, long* patch1, long* patch2,
+                          int npatch1, int npatch2,
+                          double* xi0, double* xi1, double* xi2, double* xi3,
+                          double* meanr, double* meanlogr, double* weight, double* npairs_out,
+                          int dots, int d1, int d2, int coord, int bin_type, int metric);
 
 extern void ProcessPair(void* corr, void* field1, void* field2, int dots,
                         int d1, int d2, int coord, int bin_type, int metric);
 
+// Like ProcessPair, but directly from the catalog arrays rather than from SimpleFields.
+// z1, z2 may be NULL for flat coordinates, and the ones of g1, g2, k that aren't used for
+// the data types may also be NULL.
+extern void ProcessPairwiseArrays(void* corr,
+                                  double* x1, double* y1, double* z1, double* g1_1, double* g2_1,
+                                  double* k1, double* w1,
+                                  double* x2, double* y2, double* z2, double* g1_2, double* g2_2,
+                                  double* k2, double* w2,
+                                  long nobj, int dots, int d1, int d2, int coord, int bin_type,
+                                  int metric);
+
 extern int SetOMPThreads(int num_threads);
 extern int GetOMPThreads();
+// The number of NUMA domains to split the threads into.  See NumaDomains.h.
+extern int SetOMPNumaDomains(int num_domains);
+extern int GetOMPNumaDomains();
+// Pin the threads to cores.  Returns the number of threads that were pinned.
+extern int PinOMPThreads();
+// The maximum number of threads for each phase (0 = build, 1 = process), when several calls
+// run at the same time.  0 means no limit other than the total.  See ThreadBudget.h.
+extern int SetOMPPhaseThreads(int phase, int num_threads);
+extern int GetOMPPhaseThreads(int phase);
 
+// The sample is reproducible for a given seed > 0 and number of threads.  seed = 0 picks a
+// random seed.
 extern long SamplePairs(void* corr, void* field1, void* field2, double min_sep, double max_sep,
                         int d1, int d2, int coords, int bin_type, int metric,
-                        long* i1, long* i2, double* sep, int n);
+                        long* i1, long* i2, double* sep, int n, long seed);
@@ -22,10 +22,45 @@
 #include "Field.h"
 #include "BinType.h"
 #include "Metric.h"
+#include "ProcessBudget.h"
+#include "TraversalStats.h"
+#include "Checkpoint.h"
 
 template <int DC1, int DC2, int DC3>
 struct ZetaData;
 
+// Like the PairBuffer for BinnedCorr2, directProcess111 stores the values for each triangle
+// in a TriangleBuffer, and when it is full (or at the end of processing), all the triangles
+// are added to the bins at once in flushTriangles.  The values are kept in separate arrays
+// for each quantity, so the loops that do the shear projections and the products for zeta
+// can be vectorized by the compiler.
+struct TriangleBuffer
+{
+    enum { SIZE = 256 };
+
+    TriangleBuffer() : n(0) {}
+
+    int n;              // The number of triangles currently in the buffer.
+    int index[SIZE];    // The bin for each triangle.
+    double nnn[SIZE];
+    double www[SIZE];
+    double d1[SIZE], d2[SIZE], d3[SIZE];
+    double logr[SIZE], u[SIZE], v[SIZE];
+    double logd1[SIZE], logd3[SIZE];    // These are calculated in flushTriangles.
+    // The values for each cell: wk, or the real and imaginary parts of wg.
+    double v1r[SIZE], v1i[SIZE];
+    double v2r[SIZE], v2i[SIZE];
+    double v3r[SIZE], v3i[SIZE];
+    // For Flat coordinates, the vector from each point to the centroid, which is used for
+    // projecting the shears.  For other coordinates, the shears are already projected, and
+    // these are (1,0).
+    double dx1[SIZE], dy1[SIZE];
+    double dx2[SIZE], dy2[SIZE];
+    double dx3[SIZE], dy3[SIZE];
+    // The resulting zeta values for each triangle (gam0r, gam0i, ... gam3i for GGG).
+    double zeta[8][SIZE];
+};
+
 // BinnedCorr3 encapsulates a binned correlation function.
 template <int DC1, int DC2, int DC3, int B>
 class BinnedCorr3
@@ -42,7 +77,9 @@ public:
                 double* meand1, double* meanlogd1, double* meand2, double* meanlogd2,
                 double* meand3, double* meanlogd3, double* meanu, double* meanv,
                 double* weight, double* ntri);
-    BinnedCorr3(const BinnedCorr3& rhs, bool copy_data=true);
+    // If share_data, the new object adds to the same arrays as rhs, rather than having its
+    // own copy.  cf. getThreadAccumulators.
+    BinnedCorr3(const BinnedCorr3& rhs, bool copy_data=true, bool share_data=false);
     ~BinnedCorr3();
 
     void clear();  // Set all data to 0.
@@ -57,9 +94,13 @@ public:
     template <int C, int M>
     void process3(const Cell<DC1,C>* c123, const MetricHelper<M>& metric);
 
+    // d2sq is the distance between c12 and c3, if it is already known.
     template <bool sort, int C, int M>
-    void process21(const Cell<DC1,C>* c12, const Cell<DC3,C>* c3, const MetricHelper<M>& metric);
+    void process21(const Cell<DC1,C>* c12, const Cell<DC3,C>* c3, const MetricHelper<M>& metric,
+                   double d2sq=0.);
 
+    // d1sq, d2sq, d3sq are the distances c2-c3, c1-c3, c1-c2 if they are already known,
+    // or 0 if not.
     template <bool sort, int C, int M>
     void process111(const Cell<DC1,C>* c1, const Cell<DC2,C>* c2, const Cell<DC3,C>* c3,
                     const MetricHelper<M>& metric,
@@ -70,12 +111,66 @@ public:
                           const double d1, const double d2, const double d3,
                           const double logr, const double u, const double v, const int index);
 
+    // Add all the triangles in _buffer to the accumulator bins.
+    void flushTriangles();
+
     // Note: op= only copies _data.  Not all the params.
     void operator=(const BinnedCorr3<DC1,DC2,DC3,B>& rhs);
     void operator+=(const BinnedCorr3<DC1,DC2,DC3,B>& rhs);
 
+    // Set the limits for the progressive mode.  cf. ProcessBudget.
+    void setBudget(double max_time, double max_pairs, double* used)
+    {
+        _budget.max_time = max_time;
+        _budget.max_pairs = max_pairs;
+        _budget.used = used;
+    }
+
+    // Set the array where the TraversalStats of each process call are added.  (May be null.)
+    void setStats(double* stats) { _stats_out = stats; }
+
+    // Set the file to use for checkpointing, and how often to write it.  cf. Checkpoint.h.
+    // An empty file name turns off checkpointing.
+    void setCheckpoint(const char* file, double interval)
+    {
+        _checkpoint.file = file;
+        _checkpoint.interval = interval;
+    }
+
+    // Copy the accumulated results to or from a vector of doubles for the checkpoint file.
+    void packData(std::vector<double>& data) const;
+    void unpackData(const std::vector<double>& data);
+
+    // Set the maximum memory in bytes to use for the per-thread copies of the results.
+    void setMaxThreadMemory(double max_mem) { _max_thread_mem = max_mem; }
+
+    // Whether nthreads threads will add to a single shared copy of the results, rather than
+    // each having their own copy, and the memory in bytes that the copies will use.
+    bool shareThreadData(int nthreads) const;
+    double threadMemory(int nthreads) const;
+
 protected:
 
+    // Set all the result arrays to 0.
+    void clearData();
+
+    // Make sure there are nthreads accumulators in _thread_accums.  Normally, each is a
+    // separate copy of the results, which are added up at the end.  If these would take
+    // more than _max_thread_mem, then all threads add to the arrays of _thread_accums[0]
+    // with atomic updates instead.
+    void getThreadAccumulators(int nthreads);
+
+    // Add the triangles in _buffer to the bins, using atomic updates if atomic.
+    template <bool atomic>
+    void addTriangles();
+
+    // All the arrays of results, in the order they are written to a checkpoint file.
+    void getArrays(std::vector<double*>& arrays) const;
+
+    // The binning parameters, coordinates c and metric m, which identify the calculation
+    // in a checkpoint file.
+    void makeCheckpointKey(std::vector<double>& key, int c, int m) const;
+
     double _minsep;
     double _maxsep;
     int _nbins;
@@ -96,6 +191,9 @@ protected:
     double _logminsep;
     double _halfminsep;
     double _halfmind3;
+    double _mind3;      // = minu * minsep, the smallest possible d3
+    double _maxd3;      // = maxu * maxsep, the largest possible d3
+    double _maxd1;      // = maxsep * (1 + maxu * maxv), the largest possible d1
     double _minsepsq;
     double _maxsepsq;
     double _minusq;
@@ -111,11 +209,28 @@ protected:
     int _nuv; // = nubins * nvbins2
     int _ntot; // = nbins * nubins2 * nvbins
 
+    // The per-thread accumulators used when processing in parallel.  These are kept from one
+    // process call to the next, so they don't need to be reallocated each time.
+    std::vector<BinnedCorr3<DC1,DC2,DC3,B>*> _thread_accums;
+
+    // The limits for the progressive mode, if any.
+    ProcessBudget _budget;
+
+    // The counters for the current process call, and where to add them when it is done.
+    TraversalStats _stats;
+    double* _stats_out;
+
+    // The checkpoint file, if any.
+    CheckpointSpec _checkpoint;
+
     // These are usually allocated in the python layer and just built up here.
     // So all we have here is a bare pointer for each of them.
     // However, for the OpenMP stuff, we do create copies that we need to delete.
     // So keep track if we own the data and need to delete the memory ourselves.
     bool _owns_data;
+    TriangleBuffer* _buffer;  // The triangles waiting to be added to the bins.
+    double _max_thread_mem;
+    bool _shared;   // Whether other threads are adding to the same arrays.
 
     // The different correlation functions have different numbers of arrays for zeta,
     // so encapsulate that difference with a templated ZetaData class.
@@ -150,6 +265,8 @@ struct ZetaData // This works for NNK, NKK, KKK
     { os << zeta[0]; }
     void write_full(std::ostream& os, int n) const
     { for(int i=0;i<n;++i) os << zeta[i] <<" "; }
+    void getArrays(std::vector<double*>& arrays) const
+    { arrays.push_back(zeta); }
 
     double* zeta;
 };
@@ -193,6 +310,11 @@ struct ZetaData<DC1, DC2, GData> // This works for NNG, NKG, KKG
     { os << zeta[0]<<','<<zeta_im[0]; }
     void write_full(std::ostream& os, int n) const
     { for(int i=0;i<n;++i) os << zeta[i] <<" "; }
+    void getArrays(std::vector<double*>& arrays) const
+    {
+        arrays.push_back(zeta);
+        arrays.push_back(zeta_im);
+    }
 
     double* zeta;
     double* zeta_im;
@@ -243,6 +365,13 @@ struct ZetaData<DC1, GData, GData> // This works for NGG, KGG
     { os << zetap[0]<<','<<zetap_im[0]<<','<<zetam[0]<<','<<zetam_im; }
     void write_full(std::ostream& os, int n) const
     { for(int i=0;i<n;++i) os << zetap[i] <<" "; }
+    void getArrays(std::vector<double*>& arrays) const
+    {
+        arrays.push_back(zetap);
+        arrays.push_back(zetap_im);
+        arrays.push_back(zetam);
+        arrays.push_back(zetam_im);
+    }
 
     double* zetap;
     double* zetap_im;
@@ -321,6 +450,17 @@ struct ZetaData<GData, GData, GData>
     }
     void write_full(std::ostream& os, int n) const
     { for(int i=0;i<n;++i) os << gam0r[i] <<" "; }
+    void getArrays(std::vector<double*>& arrays) const
+    {
+        arrays.push_back(gam0r);
+        arrays.push_back(gam0i);
+        arrays.push_back(gam1r);
+        arrays.push_back(gam1i);
+        arrays.push_back(gam2r);
+        arrays.push_back(gam2i);
+        arrays.push_back(gam3r);
+        arrays.push_back(gam3i);
+    }
 
     double* gam0r;
     double* gam0i;
@@ -343,6 +483,7 @@ struct ZetaData<NData, NData, NData>
     void clear(int n) {}
     void write(std::ostream& os) const {}
     void write_full(std::ostream& os, int n) const {}
+    void getArrays(std::vector<double*>& arrays) const {}
 };
 
 
@@ -25,8 +25,41 @@ extern void* BuildCorr3(int d1, int d2, int d3, int bin_type,
 
 extern void DestroyCorr3(void* corr, int d1, int d2, int d3, int bin_type);
 
-extern void ProcessAuto3(void* corr, void* field, int dots,
-                         int d, int coord, int bin_type, int metric);
+// Set the limits for the progressive mode of the process functions.  cf. SetCorr2Budget.
+extern void SetCorr3Budget(void* corr, int d1, int d2, int d3, int bin_type,
+                           double max_time, double max_triples, double* used);
 
-extern void ProcessCross3(void* corr, void* field1, void* field2, void* field3, int dots,
-                          int d1, int d2, int d3, int coord, int bin_type, int metric);
+// Set the array to which the traversal counters of each process call are added.
+// cf. SetCorr2Stats.
+extern void SetCorr3Stats(void* corr, int d1, int d2, int d3, int bin_type, double* stats);
+
+// Set the file to use for checkpointing the process functions.  cf. SetCorr2Checkpoint.
+extern void SetCorr3Checkpoint(void* corr, int d1, int d2, int d3, int bin_type,
+                               const char* file_name, double interval);
+
+// Set the maximum memory in bytes to use for the per-thread copies of the results.
+// If nthreads copies would need more than this, all the threads add to one shared copy.
+extern void SetCorr3ThreadMemory(void* corr, int d1, int d2, int d3, int bin_type,
+                                 double max_mem);
+
+// Get the memory in bytes that the results for nthreads threads will use in info[0], and
+// whether they will share a single copy in info[1].
+extern void GetCorr3ThreadMemory(void* corr, int d1, int d2, int d3, int bin_type,
+                                 int nthreads, double* info);
+
+// ProcessAuto3 and ProcessCross3 return 0 if the checkpoint file could not be read or written.
+extern int ProcessAuto3(void* corr, void* field, int dots,
+                        int d, int coord, int bin_type, int metric);
+
+extern int ProcessCross3(void* corr, void* field1, void* field2, void* field3, int dots,
+                         int d1, int d2, int d3, int coord, int bin_type, int metric);
+
+// Accumulate the multipoles of the three-point function of field1 with two points from field2.
+// This doesn't use a BinnedCorr3 object.  The results are added to the given arrays.
+// cf. MultipoleCorr3.h.
+extern void ProcessMultipole3(void* field1, void* field2, int dots, int d, int coords,
+                              double minsep, double maxsep, int nbins, double binsize,
+                              double b, double bphi, int maxn,
+                              double* weight_re, double* weight_im,
+                              double* zeta_re, double* zeta_im,
+                              double* meanr, double* meanlogr, double* npairs);
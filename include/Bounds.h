@@ -57,6 +57,20 @@ public:
         }
     }
 
+    // Expand the bounds to include another bounds.
+    void operator+=(const Bounds<Flat>& rhs)
+    {
+        if (!rhs._defined) return;
+        if (_defined) {
+            if (rhs._xmin < _xmin) _xmin = rhs._xmin;
+            if (rhs._xmax > _xmax) _xmax = rhs._xmax;
+            if (rhs._ymin < _ymin) _ymin = rhs._ymin;
+            if (rhs._ymax > _ymax) _ymax = rhs._ymax;
+        } else {
+            *this = rhs;
+        }
+    }
+
     void write(std::ostream& fout) const
     { fout << _xmin << ' ' << _xmax << ' ' << _ymin << ' ' << _ymax << ' '; }
     void read(std::istream& fin)
@@ -122,6 +136,22 @@ public:
         }
     }
 
+    // Expand the bounds to include another bounds.
+    void operator+=(const Bounds<ThreeD>& rhs)
+    {
+        if (!rhs._defined) return;
+        if (_defined) {
+            if (rhs._xmin < _xmin) _xmin = rhs._xmin;
+            if (rhs._xmax > _xmax) _xmax = rhs._xmax;
+            if (rhs._ymin < _ymin) _ymin = rhs._ymin;
+            if (rhs._ymax > _ymax) _ymax = rhs._ymax;
+            if (rhs._zmin < _zmin) _zmin = rhs._zmin;
+            if (rhs._zmax > _zmax) _zmax = rhs._zmax;
+        } else {
+            *this = rhs;
+        }
+    }
+
     void write(std::ostream& fout) const
     {
         fout << _xmin << ' ' << _xmax << ' ' << _ymin << ' ' << _ymax <<
@@ -163,6 +193,8 @@ public:
     // Expand the bounds to include the given position.
     void operator+=(const Position<Sphere>& pos)
     { Bounds<ThreeD>::operator+=(pos); }
+    void operator+=(const Bounds<Sphere>& rhs)
+    { Bounds<ThreeD>::operator+=(rhs); }
 
 };
 
@@ -19,8 +19,10 @@
 #include <algorithm>
 #include <complex>
 #include <vector>
+#include <new>
 
 #include "Position.h"
+#include "Arena.h"
 #include "dbg.h"
 
 enum SplitMethod { MIDDLE, MEDIAN, MEAN, RANDOM };
@@ -39,6 +41,28 @@ enum DataType { NData=1 , KData=2 , GData=3 };
 // Return a random number between 0 and 1.
 double urand();
 
+// A random number generator with its own state, for when each thread needs a separate stream
+// that can be reproduced from a seed.  (urand uses the global rand state, which is neither.)
+// This is SplitMix64, which is fast and good enough for picking random samples.
+class RandomStream
+{
+public:
+    explicit RandomStream(unsigned long long seed) : _state(seed) {}
+
+    // Return a random number in [0,1).
+    double operator()()
+    {
+        unsigned long long z = (_state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        z ^= z >> 31;
+        return double(z >> 11) * (1. / 9007199254740992.);  // 53 random bits / 2^53
+    }
+
+private:
+    unsigned long long _state;
+};
+
 // This is usually what we store in the leaf cells. It has size 4, which is always <= the
 // size of a pointer on modern machines, so it never adds any space to the memory needed.
 // (Since it is in a union with the _right pointer.)
@@ -55,9 +79,49 @@ struct WPosLeafInfo : public LeafInfo
 };
 
 // When we decide we're at a leaf, but we have >1 index to include, we use this instead.
+// The indices are a block of getN() values allocated from the Field's Arena, right after the
+// Cells of the leaves before it.  So the indices of a whole subtree are close together, and
+// there is no separate heap allocation for each leaf.  They are stored as 32-bit ints, unless
+// some index doesn't fit in one, in which case the lowest bit of the pointer is set (it is
+// otherwise 0, since Arena blocks are aligned), and they are longs.
 struct ListLeafInfo
 {
-    std::vector<long>* indices;
+    // Allocate the block for n indices, the largest of which is maxindex.
+    void allocate(long n, long maxindex, Arena& arena)
+    {
+        if (maxindex > 0x7fffffffL) {
+            block = reinterpret_cast<size_t>(arena.allocate(n * sizeof(long))) | 1;
+        } else {
+            block = reinterpret_cast<size_t>(arena.allocate(n * sizeof(int)));
+        }
+    }
+
+    bool isWide() const { return block & 1; }
+    const int* getInts() const { return reinterpret_cast<const int*>(block); }
+    const long* getLongs() const { return reinterpret_cast<const long*>(block & ~size_t(1)); }
+
+    long operator[](long i) const { return isWide() ? getLongs()[i] : getInts()[i]; }
+    void set(long i, long index)
+    {
+        if (isWide()) const_cast<long*>(getLongs())[i] = index;
+        else const_cast<int*>(getInts())[i] = int(index);
+    }
+
+    // Append the n indices to out.
+    void appendTo(long n, std::vector<long>& out) const
+    {
+        if (isWide()) out.insert(out.end(), getLongs(), getLongs() + n);
+        else out.insert(out.end(), getInts(), getInts() + n);
+    }
+
+    // Copy the n indices to out.
+    void copyTo(long n, long* out) const
+    {
+        if (isWide()) std::copy(getLongs(), getLongs() + n, out);
+        else std::copy(getInts(), getInts() + n, out);
+    }
+
+    size_t block;
 };
 
 
@@ -90,6 +154,8 @@ public:
                         size_t , size_t ) {}
 
     const Position<C>& getPos() const { return _pos; }
+    // Move the position by shift, for the periodic images of a Cell.
+    void shiftPos(const Position<C>& shift) { _pos += shift; }
     double getW() const { return _w; }
     long getN() const { return _n; }
 
@@ -128,6 +194,7 @@ public:
                         size_t start, size_t end);
 
     const Position<C>& getPos() const { return _pos; }
+    void shiftPos(const Position<C>& shift) { _pos += shift; }
     double getWK() const { return _wk; }
     double getW() const { return _w; }
     long getN() const { return _n; }
@@ -168,6 +235,7 @@ public:
                         size_t start, size_t end);
 
     const Position<C>& getPos() const { return _pos; }
+    void shiftPos(const Position<C>& shift) { _pos += shift; }
     std::complex<double> getWG() const { return _wg; }
     double getW() const { return _w; }
     long getN() const { return _n; }
@@ -184,6 +252,53 @@ template <int C>
 std::ostream& operator<<(std::ostream& os, const CellData<GData,C>& c)
 { return os << c.getPos() << " " << c.getWG() << " " << c.getW() << " " << c.getN(); }
 
+template <int D, int C>
+class Cell;
+
+// A minimal spinlock for the lazy builds, which only hold it for a short time.
+// A zero-initialized one is unlocked.
+struct SpinLock
+{
+    int locked;
+
+    void acquire()
+    {
+        while (__atomic_exchange_n(&locked, 1, __ATOMIC_ACQUIRE)) {
+            // Wait until it looks free before trying again, so the waiting threads don't
+            // keep writing to the cache line.
+            while (__atomic_load_n(&locked, __ATOMIC_RELAXED)) {}
+        }
+    }
+    void release() { __atomic_store_n(&locked, 0, __ATOMIC_RELEASE); }
+};
+
+// When a Field is built lazily, each top-level Cell has one of these, which holds what is
+// needed to build the children of a Cell the first time they are asked for.
+// The children are allocated from the arena of the top-level cell, which isn't thread safe,
+// so lock is held while building children anywhere in this tree.  Builds in different trees
+// don't need to wait for each other.
+template <int D, int C>
+struct LazyBuilder
+{
+    std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >* vdata;
+    double minsizesq;
+    bool brute;
+    SplitMethod sm;
+    Arena* arena;
+    Cell<D,C>* leaves;
+    SpinLock lock;
+};
+
+// An internal Cell whose children haven't been built yet uses this.  It records which
+// range of the LazyBuilder's vdata belongs to the Cell.
+template <int D, int C>
+struct LazyInfo
+{
+    LazyBuilder<D,C>* builder;
+    size_t start;
+    size_t end;
+};
+
 template <int D, int C>
 class Cell
 {
@@ -198,33 +313,30 @@ public:
     // The structure also keeps track of some averages and sums about
     // the galaxies which are used in the correlation function calculations.
 
-    Cell(CellData<D,C>* data, const LeafInfo& info) :
+    // The CellData is stored directly in the Cell (rather than through a pointer) so that
+    // traversing the tree doesn't need to chase a second pointer to get the position.
+    // BuildCell also allocates the Cells in depth-first order, so the left child of a Cell
+    // is normally right after it in memory.
+
+    Cell(const CellData<D,C>& data, const LeafInfo& info) :
         _data(data), _size(0.), _sizesq(0.), _left(0), _info(info) {}
 
-    Cell(CellData<D,C>* data, const ListLeafInfo& listinfo) :
+    Cell(const CellData<D,C>& data, const ListLeafInfo& listinfo) :
         _data(data), _size(0.), _sizesq(0.), _left(0), _listinfo(listinfo) {}
 
-    Cell(CellData<D,C>* data, double size, double sizesq, Cell<D,C>* l, Cell<D,C>* r) :
+    Cell(const CellData<D,C>& data, double size, double sizesq, Cell<D,C>* l, Cell<D,C>* r) :
         _data(data), _size(size), _sizesq(sizesq), _left(l), _right(r) {}
 
-    ~Cell()
-    {
-        if (_left) {
-            Assert(_right);
-            delete _left;
-            delete _right;
-        } else if (_data && _data->getN() > 1) {
-            delete _listinfo.indices;
-        } // if !left and N==1, then _info, which doesn't need anything to be deleted.
-        if (_data) {
-            delete (_data);
-        }
-    }
+    Cell(const CellData<D,C>& data, double size, double sizesq, LazyInfo<D,C>* lazy) :
+        _data(data), _size(size), _sizesq(sizesq), _left(0), _lazy(lazy) {}
+
+    // Note: There is no destructor.  Cells and the ListLeafInfo indices are all allocated
+    // from an Arena owned by the Field, which frees them all at once.
 
-    const CellData<D,C>& getData() const { return *_data; }
-    const Position<C>& getPos() const { return _data->getPos(); }
-    double getW() const { return _data->getW(); }
-    long getN() const { return _data->getN(); }
+    const CellData<D,C>& getData() const { return _data; }
+    const Position<C>& getPos() const { return _data.getPos(); }
+    double getW() const { return _data.getW(); }
+    long getN() const { return _data.getN(); }
 
     double getSize() const { return _size; }
     double getSizeSq() const { return _sizesq; }
@@ -232,10 +344,19 @@ public:
     double getAllSize() const { return _size; }
     double calculateInertia() const;
 
-    const Cell<D,C>* getLeft() const { return _left; }
-    const Cell<D,C>* getRight() const { return _left ? _right : 0; }
-    const LeafInfo& getInfo() const { Assert(!_left && getN()==1); return _info; }
-    const ListLeafInfo& getListInfo() const { Assert(!_left && getN()!=1); return _listinfo; }
+    // Leaves have size 0, so a Cell with no children yet, but a non-zero size, is one that is
+    // being built lazily.  Its children are built the first time they are needed.
+    // The children may be built by another thread, so _left is read with acquire semantics.
+    // Then _right (which is written first) is guaranteed to be valid if _left is set.
+    const Cell<D,C>* getLeft() const
+    {
+        const Cell<D,C>* left = __atomic_load_n(&_left, __ATOMIC_ACQUIRE);
+        return (left || !(_size > 0.)) ? left : buildChildren();
+    }
+    const Cell<D,C>* getRight() const { return getLeft() ? _right : 0; }
+    const LeafInfo& getInfo() const { Assert(!getLeft() && getN()==1); return _info; }
+    const ListLeafInfo& getListInfo() const
+    { Assert(!getLeft() && getN()!=1); return _listinfo; }
 
     // These are mostly used for debugging purposes.
     long countLeaves() const;
@@ -249,7 +370,7 @@ public:
 
 protected:
 
-    CellData<D,C>* _data;
+    CellData<D,C> _data;
     float _size;
     float _sizesq;
 
@@ -258,7 +379,10 @@ protected:
         Cell<D,C>* _right;      // Use this when _left != 0
         LeafInfo _info;         // Use this when _left == 0 and N == 1
         ListLeafInfo _listinfo; // Use this when _left == 0 and N > 1
+        LazyInfo<D,C>* _lazy;   // Use this when _left == 0 and size > 0
     };
+
+    const Cell<D,C>* buildChildren() const;
 };
 
 template <int D, int C>
@@ -273,8 +397,91 @@ size_t SplitData(
 
 template <int D, int C, int SM>
 Cell<D,C>* BuildCell(std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata,
-                     double minsizesq, bool brute, size_t start, size_t end,
-                     CellData<D,C>* ave=0, double sizesq=0.);
+                     double minsizesq, bool brute, size_t start, size_t end, Arena& arena,
+                     const CellData<D,C>* ave=0, double sizesq=0., Cell<D,C>* leaves=0,
+                     LazyBuilder<D,C>* lazy=0);
+
+// Build a Cell with the same tree structure as src, which may have a different data type.
+// The splits only depend on the positions and wpos, so only the data need to be recalculated.
+// vdata[start:start+src->getN()] should have the objects in the order of the leaves of src.
+template <int D, int C, int D2>
+Cell<D,C>* CopyCell(const Cell<D2,C>* src,
+                    const std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata,
+                    size_t start, Arena& arena);
+
+// A helper struct to build the right kind of CellData object in the given memory location.
+template <int D, int C>
+struct CellDataHelper;
+
+// Specialize for each D,C
+template <>
+struct CellDataHelper<NData,Flat>
+{
+    static CellData<NData,Flat>* build(double x, double y, double,
+                                       double , double , double, double w, void* mem)
+    { return new (mem) CellData<NData,Flat>(Position<Flat>(x,y), w); }
+};
+template <>
+struct CellDataHelper<KData,Flat>
+{
+    static CellData<KData,Flat>* build(double x, double y, double,
+                                       double , double , double k, double w, void* mem)
+    { return new (mem) CellData<KData,Flat>(Position<Flat>(x,y), k, w); }
+};
+template <>
+struct CellDataHelper<GData,Flat>
+{
+    static CellData<GData,Flat>* build(double x, double y,  double,
+                                       double g1, double g2, double, double w, void* mem)
+    { return new (mem) CellData<GData,Flat>(Position<Flat>(x,y), std::complex<double>(g1,g2), w); }
+};
+
+
+template <>
+struct CellDataHelper<NData,ThreeD>
+{
+    static CellData<NData,ThreeD>* build(double x, double y, double z,
+                                         double , double , double, double w, void* mem)
+    { return new (mem) CellData<NData,ThreeD>(Position<ThreeD>(x,y,z), w); }
+};
+template <>
+struct CellDataHelper<KData,ThreeD>
+{
+    static CellData<KData,ThreeD>* build(double x, double y, double z,
+                                         double , double , double k, double w, void* mem)
+    { return new (mem) CellData<KData,ThreeD>(Position<ThreeD>(x,y,z), k, w); }
+};
+template <>
+struct CellDataHelper<GData,ThreeD>
+{
+    static CellData<GData,ThreeD>* build(double x, double y, double z,
+                                         double g1, double g2, double, double w, void* mem)
+    { return new (mem) CellData<GData,ThreeD>(Position<ThreeD>(x,y,z), std::complex<double>(g1,g2), w); }
+};
+
+
+// Sphere
+template <>
+struct CellDataHelper<NData,Sphere>
+{
+    static CellData<NData,Sphere>* build(double x, double y, double z,
+                                         double , double , double, double w, void* mem)
+    { return new (mem) CellData<NData,Sphere>(Position<Sphere>(x,y,z), w); }
+};
+template <>
+struct CellDataHelper<KData,Sphere>
+{
+    static CellData<KData,Sphere>* build(double x, double y, double z,
+                                         double , double , double k, double w, void* mem)
+    { return new (mem) CellData<KData,Sphere>(Position<Sphere>(x,y,z), k, w); }
+};
+template <>
+struct CellDataHelper<GData,Sphere>
+{
+    static CellData<GData,Sphere>* build(double x, double y, double z,
+                                         double g1, double g2, double, double w, void* mem)
+    { return new (mem) CellData<GData,Sphere>(Position<Sphere>(x,y,z), std::complex<double>(g1,g2), w); }
+};
 
 template <int D, int C>
 inline std::ostream& operator<<(std::ostream& os, const Cell<D,C>& c)
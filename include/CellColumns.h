@@ -0,0 +1,120 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#ifndef TreeCorr_CellColumns_H
+#define TreeCorr_CellColumns_H
+
+#include <vector>
+#include <algorithm>
+
+#include "dbg.h"
+#include "Cell.h"
+
+// Several columns of k or g values for the objects of a field, summed up for each cell of
+// its tree.  The CellData of a KField or GField only has room for a single value, so
+// correlating many maps with the same positions and weights (e.g. realizations of the shape
+// noise) would otherwise need a separate walk through the trees for each one.  With these,
+// a single list of the pairs of cells (cf. BinnedCorr2::record) can be used for all the
+// columns at once.  cf. ColumnCorr2.
+//
+// The sums for all the columns of a cell are stored together, so the loop over the columns
+// for each pair of cells runs over contiguous memory.  Like the CellData, they are stored
+// as floats.
+template <int C>
+class CellColumns
+{
+public:
+    // cells are all the cells of an NField in the order of CollectCells.  d is KData or GData.
+    // The value of column j for object i is vr[j*nobj+i] (with the imaginary part of g in
+    // vi[j*nobj+i] for GData).  w may be null if all the weights are 1.
+    CellColumns(const std::vector<const Cell<NData,C>*>& cells, int d, int ncol, long nobj,
+                const double* w, const double* vr, const double* vi) :
+        _d(d), _ncol(ncol), _nobj(nobj), _w(w), _vr(vr), _vi(vi), _cells(cells),
+        _nv(d == GData ? 2*ncol : ncol)
+    {
+        Assert(d == KData || d == GData);
+        _re.resize(cells.size() * _ncol);
+        if (_d == GData) _im.resize(cells.size() * _ncol);
+        for (long i=0; i<long(cells.size()); ) i = sumCell(i, 0);
+        std::vector<double>().swap(_scratch);
+        dbg<<"Built CellColumns with "<<ncol<<" columns for "<<cells.size()<<" cells\n";
+    }
+
+    int getD() const { return _d; }
+    int getNCol() const { return _ncol; }
+
+    // The sums of w v for each column of cell i.
+    const float* getRe(long i) const { return &_re[i*_ncol]; }
+    const float* getIm(long i) const { return &_im[i*_ncol]; }
+
+private:
+
+    // Calculate the sums for cells[i] and all the cells below it, and return the index of
+    // the next cell after them.  In the order of CollectCells, the left child of a cell comes
+    // right after it, and the right child after all the cells below the left child.
+    // The sums for the cell are left in _scratch[depth*_nv:(depth+1)*_nv].
+    long sumCell(long i, int depth)
+    {
+        if (long(_scratch.size()) < (depth+2) * _nv) _scratch.resize((depth+2) * _nv);
+        const Cell<NData,C>& cell = *_cells[i];
+        long next;
+        if (cell.getLeft()) {
+            next = sumCell(i+1, depth+1);
+            std::copy(&_scratch[(depth+1)*_nv], &_scratch[(depth+2)*_nv], &_scratch[depth*_nv]);
+            next = sumCell(next, depth+1);
+            double* s = &_scratch[depth*_nv];
+            const double* s2 = &_scratch[(depth+1)*_nv];
+            for (int j=0; j<_nv; ++j) s[j] += s2[j];
+        } else {
+            double* s = &_scratch[depth*_nv];
+            std::fill(s, s+_nv, 0.);
+            if (cell.getN() == 1) {
+                addObject(cell.getInfo().index, s);
+            } else {
+                const ListLeafInfo& indices = cell.getListInfo();
+                for (long n=0; n<cell.getN(); ++n) addObject(indices[n], s);
+            }
+            next = i+1;
+        }
+        const double* s = &_scratch[depth*_nv];
+        for (int j=0; j<_ncol; ++j) _re[i*_ncol+j] = s[j];
+        if (_d == GData)
+            for (int j=0; j<_ncol; ++j) _im[i*_ncol+j] = s[_ncol+j];
+        return next;
+    }
+
+    void addObject(long index, double* s) const
+    {
+        Assert(index >= 0 && index < _nobj);
+        const double w = _w ? _w[index] : 1.;
+        for (int j=0; j<_ncol; ++j) s[j] += w * _vr[j*_nobj + index];
+        if (_d == GData)
+            for (int j=0; j<_ncol; ++j) s[_ncol+j] += w * _vi[j*_nobj + index];
+    }
+
+    int _d;
+    int _ncol;
+    long _nobj;
+    const double* _w;
+    const double* _vr;
+    const double* _vi;
+    const std::vector<const Cell<NData,C>*>& _cells;
+    int _nv;  // The number of doubles per cell while summing: ncol, or 2*ncol for GData.
+    std::vector<double> _scratch;
+
+    std::vector<float> _re;
+    std::vector<float> _im;
+};
+
+#endif
@@ -0,0 +1,260 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#ifndef TreeCorr_Checkpoint_H
+#define TreeCorr_Checkpoint_H
+
+#include <vector>
+#include <set>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+
+#include "dbg.h"
+#include "Cell.h"
+#include "WallTime.h"
+
+// Checkpointing for long-running process calls.  When a checkpoint file is set, the
+// top-level work items are done in chunks.  After each chunk, its results are added to a
+// running total for this process call, and every interval seconds, that total and the list
+// of finished items are written to the file.  If the process call is interrupted, running it
+// again with the same fields picks up from the file and skips the finished items.  When the
+// call finishes, the file is removed.
+//
+// The results of each chunk are also added to the output right away, so the output always
+// has the results of the finished chunks.  With a publish_interval, the items are done in
+// chunks even without a file, so another thread can look at the results as they go.
+// (cf. BinnedCorr2::copyResults.)
+//
+// The file format is:
+//
+//     CheckpointHeader
+//     double key[nkey]        Identifies the fields and binning, so we don't resume
+//                             from a checkpoint of some other calculation.
+//     long done[2*ndone]      The (i,j) indices of the finished items.
+//     double data[ndata]      The accumulated results.  cf. packData in BinnedCorr2,3.
+
+const char CHECKPOINT_FILE_MAGIC[8] = "TCCkpt";
+const int CHECKPOINT_FILE_VERSION = 1;
+
+struct CheckpointHeader
+{
+    char magic[8];
+    int version;
+    long nkey;
+    long ndone;
+    long ndata;
+};
+
+struct CheckpointSpec
+{
+    CheckpointSpec() : interval(0.), publish_interval(0.) {}
+
+    std::string file;   // The file to use.  (Empty means no checkpointing.)
+    double interval;    // How often (in seconds) to write the file.
+    double publish_interval;  // How often to add the results to the output.  (0 = at the end.)
+
+    bool active() const { return !file.empty(); }
+    bool chunked() const { return active() || publish_interval > 0.; }
+
+    // How long each chunk should take, which is a tenth of the shorter interval.
+    double chunkTime() const
+    {
+        double t = active() ? interval : publish_interval;
+        if (active() && publish_interval > 0.) t = std::min(t, publish_interval);
+        return 0.1 * t;
+    }
+};
+
+// The (i,j) indices of a work item.  j = -1 for items that only use one top-level cell.
+typedef std::pair<long,long> ItemId;
+
+inline void WriteCheckpoint(const std::string& file_name, const std::vector<double>& key,
+                            const std::vector<ItemId>& done, const std::vector<double>& data)
+{
+    dbg<<"Write checkpoint "<<file_name<<" with "<<done.size()<<" items done\n";
+    CheckpointHeader header;
+    std::memset(static_cast<void*>(&header), 0, sizeof(header));
+    std::memcpy(header.magic, CHECKPOINT_FILE_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_FILE_VERSION;
+    header.nkey = key.size();
+    header.ndone = done.size();
+    header.ndata = data.size();
+
+    std::vector<long> ids(2*done.size());
+    for (size_t k=0; k<done.size(); ++k) {
+        ids[2*k] = done[k].first;
+        ids[2*k+1] = done[k].second;
+    }
+
+    // Write to a temporary file and then rename it, so if we are killed in the middle of
+    // writing, the previous checkpoint is still intact.
+    const std::string tmp_name = file_name + ".tmp";
+    std::ofstream fout(tmp_name.c_str(), std::ios::binary);
+    if (!fout) throw std::runtime_error("Unable to open checkpoint file for writing");
+    fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (key.size() > 0)
+        fout.write(reinterpret_cast<const char*>(&key[0]), key.size() * sizeof(double));
+    if (ids.size() > 0)
+        fout.write(reinterpret_cast<const char*>(&ids[0]), ids.size() * sizeof(long));
+    if (data.size() > 0)
+        fout.write(reinterpret_cast<const char*>(&data[0]), data.size() * sizeof(double));
+    fout.close();
+    if (!fout) throw std::runtime_error("Error writing checkpoint file");
+    if (std::rename(tmp_name.c_str(), file_name.c_str()) != 0)
+        throw std::runtime_error("Unable to rename checkpoint file");
+}
+
+// Returns false if there is no such file, or it isn't a checkpoint for this key.
+inline bool ReadCheckpoint(const std::string& file_name, const std::vector<double>& key,
+                           std::vector<ItemId>& done, std::vector<double>& data)
+{
+    std::ifstream fin(file_name.c_str(), std::ios::binary);
+    if (!fin) return false;
+    CheckpointHeader header;
+    fin.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!fin || std::memcmp(header.magic, CHECKPOINT_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != CHECKPOINT_FILE_VERSION || header.nkey != long(key.size()) ||
+        header.ndone < 0 || long(data.size()) != header.ndata) {
+        dbg<<"Checkpoint file "<<file_name<<" is not valid for this calculation\n";
+        return false;
+    }
+    std::vector<double> file_key(key.size());
+    if (key.size() > 0)
+        fin.read(reinterpret_cast<char*>(&file_key[0]), key.size() * sizeof(double));
+    if (!fin || file_key != key) {
+        dbg<<"Checkpoint file "<<file_name<<" is for a different calculation\n";
+        return false;
+    }
+    std::vector<long> ids(2*header.ndone);
+    if (ids.size() > 0)
+        fin.read(reinterpret_cast<char*>(&ids[0]), ids.size() * sizeof(long));
+    if (data.size() > 0)
+        fin.read(reinterpret_cast<char*>(&data[0]), data.size() * sizeof(double));
+    if (!fin) throw std::runtime_error("Error reading checkpoint file");
+    done.resize(header.ndone);
+    for (long k=0; k<header.ndone; ++k) done[k] = ItemId(ids[2*k], ids[2*k+1]);
+    dbg<<"Read checkpoint "<<file_name<<" with "<<done.size()<<" items done\n";
+    return true;
+}
+
+// Add some numbers that identify a set of top-level cells to the key for a checkpoint.
+// The weighted sums of the positions make it very unlikely that a different catalog with the
+// same number of objects and total weight matches.
+template <int D, int C>
+void AddCellsToKey(const std::vector<Cell<D,C>*>& cells, std::vector<double>& key)
+{
+    double n=0., w=0., s=0., wx=0., wy=0., wz=0.;
+    for (size_t i=0; i<cells.size(); ++i) {
+        const Cell<D,C>& c = *cells[i];
+        n += c.getN();
+        w += c.getW();
+        s += c.getSize();
+        wx += c.getW() * c.getPos().get(0);
+        wy += c.getW() * c.getPos().get(1);
+        if (C != Flat) wz += c.getW() * c.getPos().get(2);
+    }
+    key.push_back(cells.size());
+    key.push_back(n);
+    key.push_back(w);
+    key.push_back(s);
+    key.push_back(wx);
+    key.push_back(wy);
+    key.push_back(wz);
+}
+
+// Keeps track of the checkpoint during a process call.  T is the correlation class, which
+// needs a constructor T(const T& rhs, bool copy_data), operator+=, and
+// packData/unpackData to convert the accumulated results to and from a vector of doubles.
+// The caller adds the results of each chunk to the output itself, so the total here is just
+// for writing the file.
+template <typename T>
+class Checkpointer
+{
+public:
+    Checkpointer(const CheckpointSpec& spec, const T& proto, const std::vector<double>& key) :
+        _spec(spec), _key(key), _total(0), _last_write(WallTime()), _rate(0.)
+    {
+        if (_spec.active()) _total = new T(proto, false);
+    }
+    ~Checkpointer() { delete _total; }
+
+    bool active() const { return _spec.active(); }
+
+    // Read the checkpoint file if there is a valid one, and add its results to out.
+    // Returns the finished items.
+    std::set<ItemId> resume(T& out)
+    {
+        std::set<ItemId> done;
+        if (!active()) return done;
+        std::vector<double> data;
+        _total->packData(data);
+        if (ReadCheckpoint(_spec.file, _key, _done, data)) {
+            _total->unpackData(data);
+            out += *_total;
+            done.insert(_done.begin(), _done.end());
+        }
+        return done;
+    }
+
+    // The number of items to do in the next chunk.  We aim for each chunk to take about
+    // a tenth of the interval, based on how fast the previous chunks went.
+    long nextChunk(long nleft, int nthreads) const
+    {
+        if (!_spec.chunked()) return nleft;
+        long n = 4 * nthreads;
+        if (_rate > 0.) n = std::max(n, long(_spec.chunkTime() * _rate));
+        return std::min(n, nleft);
+    }
+
+    // Add the results of a finished chunk of nitems items, which took dt seconds.
+    // done is the list of the ones that were finished, which is only needed if active.
+    void add(const T& results, const std::vector<ItemId>& done, long nitems, double dt)
+    {
+        if (dt > 0.) _rate = nitems / dt;
+        if (!active()) return;
+        *_total += results;
+        _done.insert(_done.end(), done.begin(), done.end());
+        if (WallTime() - _last_write >= _spec.interval) {
+            std::vector<double> data;
+            _total->packData(data);
+            WriteCheckpoint(_spec.file, _key, _done, data);
+            _last_write = WallTime();
+        }
+    }
+
+    // Remove the checkpoint file, since we're done with it.
+    void finish()
+    {
+        if (!active()) return;
+        std::remove(_spec.file.c_str());
+    }
+
+private:
+    // Not copyable, since we own _total.
+    Checkpointer(const Checkpointer&);
+    void operator=(const Checkpointer&);
+
+    const CheckpointSpec& _spec;
+    std::vector<double> _key;
+    T* _total;
+    std::vector<ItemId> _done;
+    double _last_write;
+    double _rate;       // The number of items per second in the last chunk.
+};
+
+#endif
@@ -0,0 +1,40 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+// The rows of the design matrices for the patch-based covariance estimates.
+//
+// stat and weight are dense [npatch1, npatch2, nstat] arrays of the unnormalized statistic
+// and its weight for each pair of patches, with zeros for the pairs that have no results.
+// Each row of the design matrix sums these over some pairs of patches (possibly counting some
+// of them more than once), and then xi[row] = stat / weight, with a weight of 1 for the ones
+// that don't get any pairs.  w[row] is the sum of these weights.
+//
+// If npatch2 == 1 or npatch1 == 1, the patches are just the ones along the other axis.
+// Otherwise, npatch1 must equal npatch2.
+
+// Each row i excludes all the pairs that include patch i.
+extern void CovJackknife(const double* stat, const double* weight,
+                         int npatch1, int npatch2, int nstat, double* xi, double* w);
+
+// Each row i is the pairs whose first patch is i.
+extern void CovSample(const double* stat, const double* weight,
+                      int npatch1, int npatch2, int nstat, double* xi, double* w);
+
+// cnt is a [nboot, npatch] array of the number of times each patch was selected for each
+// bootstrap sample.  If marked, each row uses cnt[i] times the pairs whose first patch is
+// i.  Otherwise, it uses cnt[i] times the pair (i,i) and cnt[i] cnt[j] times each pair (i,j)
+// with i != j.
+extern void CovBootstrap(const double* stat, const double* weight,
+                         int npatch1, int npatch2, int nstat,
+                         const double* cnt, int nboot, int marked, double* xi, double* w);
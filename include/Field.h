@@ -35,6 +35,14 @@
 //     Rlens for the perpendicular component at the location of the "lens" (c1)
 //     Arc for great circle distances on the sphere
 
+// A Field's tree in a POSIX shared memory segment (cf. Field::share), which other processes
+// can attach to.  Defined in Field.cpp.
+struct SharedSegment;
+// Open and map a segment made by Field::share, read-only.  Throws if it doesn't exist or can't
+// be mapped at the same address as in the process that made it.
+SharedSegment* AttachSharedSegment(const char* name);
+void ReleaseSharedSegment(SharedSegment* seg);
+
 template <int D, int C>
 class Field
 {
@@ -42,20 +50,91 @@ public:
     Field(double* x, double* y, double* z, double* g1, double* g2, double* k,
           double* w, double* wpos, long nobj,
           double minsize, double maxsize,
+          SplitMethod sm, bool brute, int mintop, int maxtop, bool share_leaves,
+          bool lazy, bool presort, const char* spill_dir=0);
+
+    // Read a Field that was previously written with write().  The build parameters and
+    // data_hash must match the ones that were used for the field that was written.
+    // (Throws if not.)
+    Field(const char* file_name, long nobj, long data_hash, double minsize, double maxsize,
+          SplitMethod sm, bool brute, int mintop, int maxtop);
+
+    // Build a Field with the same tree structure as src, which is a Field of the same objects,
+    // but possibly with a different data type (e.g. a KField using the tree of an NField).
+    // The splits only depend on the positions and wpos, so only the data in each Cell need to
+    // be calculated.  The positions and wpos must be the same as the ones used to build src.
+    template <int D2>
+    Field(const Field<D2,C>& src, double* x, double* y, double* z, double* g1, double* g2,
+          double* k, double* w, double* wpos);
+
+    // Use the tree in a shared memory segment from AttachSharedSegment, directly from the
+    // read-only mapping.  This takes ownership of shared, even if it throws.  As for reading
+    // a file, the build parameters must match the ones of the field that was shared.
+    Field(SharedSegment* shared, long nobj, long data_hash, double minsize, double maxsize,
           SplitMethod sm, bool brute, int mintop, int maxtop);
     ~Field();
 
+    // Write the built tree to a binary file, which can be read back with the above constructor.
+    // data_hash identifies the objects that were used to build it.  (cf. FieldFileHeader)
+    void write(const char* file_name, long data_hash) const;
+
+    // Copy the built tree into a new POSIX shared memory segment with the given name (e.g.
+    // "/treecorr_cat1"), which other processes can attach to.  The segment is removed when
+    // this Field is destroyed, although processes that are already attached can keep using it.
+    void share(const char* name, long data_hash);
+
+    // Add more objects to the field.  Their indices continue on from the current objects.
+    // The new objects are built into additional top-level cells, so the existing trees don't
+    // need to be rebuilt.
+    void append(double* x, double* y, double* z, double* g1, double* g2, double* k,
+                double* w, double* wpos, long nobj);
+
     long getNObj() const { return _nobj; }
+    // Whether the cells are stored in a memory mapped spill file, rather than in memory.
+    bool isSpilled() const { return _spill != 0; }
+    // The number of bytes held in memory by the field, and the number used in its spill file.
+    // These are for the current state, so they may grow if the field is lazy.
+    size_t getMemoryNBytes() const;
+    size_t getSpillNBytes() const;
     double getSizeSq() const { return _sizesq; }
     Position<C> getCenter() const { return _center; }
     double getSize() const { return std::sqrt(_sizesq); }
     long getNTopLevel() const { BuildCells(); return long(_cells.size()); }
     const std::vector<Cell<D,C>*>& getCells() const { BuildCells(); return _cells; }
+    // The NUMA domain (see NumaDomains.h) where top-level cell i was built, or -1 if unknown.
+    int getCellDomain(long i) const
+    { BuildCells(); return i < long(_domains.size()) ? _domains[i] : -1; }
     long countNear(double x, double y, double z, double sep) const;
     void getNear(double x, double y, double z, double sep, long* indices, long n) const;
 
+    // Batched versions of countNear and getNear for nq query points, run in parallel.
+    // The indices for query q are written to indices[offsets[q]:offsets[q+1]], where the
+    // offsets are typically the cumulative sum of the counts from countNearMany.
+    void countNearMany(const double* x, const double* y, const double* z, const double* sep,
+                       long nq, long* counts) const;
+    void getNearMany(const double* x, const double* y, const double* z, const double* sep,
+                     long nq, const long* offsets, long* indices) const;
+
+    // Find the k nearest objects to each of nq query points.  The indices and squared
+    // distances are written to indices[q*k:(q+1)*k] and distsq[q*k:(q+1)*k], from nearest to
+    // farthest.  If there are fewer than k objects, the extra entries get index -1.
+    // Note: if minsize > 0, the distances are to the leaf cells, not the individual objects.
+    void getNearest(const double* x, const double* y, const double* z, long nq, long k,
+                    long* indices, double* distsq) const;
+
+    // The wall clock times for the three stages of building the field:
+    // init = making the CellData for each object and finding the overall center and size.
+    // top = figuring out the top-level cells.
+    // cells = building the trees below each top-level cell.
+    double getInitTime() const { return _init_time; }
+    double getTopTime() const { BuildCells(); return _top_time; }
+    double getCellsTime() const { BuildCells(); return _cells_time; }
+
 private:
 
+    template <int D2, int C2>
+    friend class Field;
+
     long _nobj;
     double _minsize;
     double _maxsize;
@@ -67,9 +146,46 @@ private:
     double _sizesq;
     mutable std::vector<Cell<D,C>*> _cells;
 
+    // The memory for all the CellData and Cells is owned by these Arenas.
+    // _arena has the input CellData for each object, which are only needed until the
+    // Cells are built.
+    // _top_arenas has one Arena for each top-level cell so they can be built in parallel.
+    // If share_leaves, _leaf_arena has the leaf Cells, which are used directly in the tree.
+    // (_leaves points to them until the Cells are built.)
+    // If lazy, the cells below the top level are only built when they are first needed, so
+    // the input CellData in _arena are kept, along with the _celldata vector for each batch
+    // of objects in _lazy_celldata.
+    // If spill_dir is given, all of these use memory mapped blocks of _spill, a temporary file
+    // in that directory, except for the cells near the top of each tree.
+    SpillFile* _spill;
+    // The shared memory segment that this Field uses (if attached) or made (if shared).
+    SharedSegment* _shared;
+    mutable Arena _arena;
+    mutable std::vector<Arena*> _top_arenas;
+    mutable std::vector<int> _domains;  // The NUMA domain of each top-level cell.
+    Arena _leaf_arena;
+    mutable Cell<D,C>* _leaves;
+    bool _lazy;
+    bool _presort;  // Whether to sort the objects along a space-filling curve before building.
+    mutable std::vector<std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >*> _lazy_celldata;
+
+    double _init_time;
+    mutable double _top_time;
+    mutable double _cells_time;
+
     // This is set at the start, but once we finish making all the cells, we don't need it anymore.
     mutable std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> > _celldata;
 
+    // Make the _celldata entries for the given objects, whose indices start at first_index.
+    void SetupCellData(double* x, double* y, double* z, double* g1, double* g2, double* k,
+                       double* w, double* wpos, long nobj, long first_index, bool share_leaves);
+
+    // Sort the _celldata entries (and the CellData they point to) into Morton order.
+    void PresortCellData(bool share_leaves);
+
+    // Make _spill, and have the arenas use it.
+    void setupSpill(const char* spill_dir);
+
     // This finishes the work of the Field constructor.
     void BuildCells() const;
     template <int SM> void DoBuildCells() const;
@@ -91,6 +207,7 @@ public:
 
 private:
     std::vector<Cell<D,C>*> _cells;
+    Arena _arena;
 };
 
 #endif
@@ -15,27 +15,66 @@
 extern void* BuildGField(double* x, double* y, double* z, double* g1, double* g2,
                          double* w, double* wpos, long nobj,
                          double minsize, double maxsize,
-                         int sm_int, int brute, int mintop, int maxtop, int coords);
+                         int sm_int, int brute, int mintop, int maxtop, int share_leaves,
+                         int lazy, int presort, const char* spill_dir, int coords);
 
 extern void* BuildKField(double* x, double* y, double* z, double* k,
                          double* w, double* wpos, long nobj,
                          double minsize, double maxsize,
-                         int sm_int, int brute, int mintop, int maxtop, int coords);
+                         int sm_int, int brute, int mintop, int maxtop, int share_leaves,
+                         int lazy, int presort, const char* spill_dir, int coords);
 
 extern void* BuildNField(double* x, double* y, double* z,
                          double* w, double* wpos, long nobj,
                          double minsize, double maxsize,
-                         int sm_int, int brute, int mintop, int maxtop, int coords);
+                         int sm_int, int brute, int mintop, int maxtop, int share_leaves,
+                         int lazy, int presort, const char* spill_dir, int coords);
+
+// data_hash identifies the objects used to build the field (e.g. a hash of the positions and
+// weights).  Reading or attaching fails unless it is the same as when the field was written.
+extern void* BuildFieldFromFile(const char* file_name, long nobj, long data_hash,
+                                double minsize, double maxsize,
+                                int sm_int, int brute, int mintop, int maxtop,
+                                int d, int coords);
+extern void* BuildGFieldFromTree(void* src, int src_d, double* x, double* y, double* z,
+                                 double* g1, double* g2, double* w, double* wpos, int coords);
+extern void* BuildKFieldFromTree(void* src, int src_d, double* x, double* y, double* z,
+                                 double* k, double* w, double* wpos, int coords);
+extern void* BuildNFieldFromTree(void* src, int src_d, double* x, double* y, double* z,
+                                 double* w, double* wpos, int coords);
+extern int FieldWrite(void* field, int d, int coords, const char* file_name, long data_hash);
+// Put a copy of the tree in a POSIX shared memory segment with the given name.  Returns 0 if
+// this fails (e.g. if the name is already in use).
+extern int FieldShare(void* field, int d, int coords, const char* name, long data_hash);
+// Use the tree from a segment made by FieldShare.  Returns NULL if this fails.
+extern void* AttachSharedField(const char* name, long nobj, long data_hash,
+                               double minsize, double maxsize,
+                               int sm_int, int brute, int mintop, int maxtop,
+                               int d, int coords);
+extern int UnlinkSharedField(const char* name);
+extern void FieldAppend(void* field, double* x, double* y, double* z, double* g1, double* g2,
+                        double* k, double* w, double* wpos, long nobj, int d, int coords);
 
 extern void DestroyGField(void* field, int coords);
 extern void DestroyKField(void* field, int coords);
 extern void DestroyNField(void* field, int coords);
 
 extern long FieldGetNTopLevel(void* field, int d, int coords);
+extern void FieldGetBuildTimes(void* field, int d, int coords, double* times);
+// nbytes[0] = the bytes held in memory by the field, nbytes[1] = the bytes in its spill file.
+extern void FieldGetNBytes(void* field, int d, int coords, long* nbytes);
+// nbytes[0] = sizeof(Cell), nbytes[1] = the bytes per object while building the field.
+extern void FieldGetObjectNBytes(int d, int coords, long* nbytes);
 extern long FieldCountNear(void* field, double x, double y, double z, double sep,
                            int d, int coords);
 extern void FieldGetNear(void* field, double x, double y, double z, double sep,
                          int d, int coords, long* indices, long n);
+extern void FieldCountNearMany(void* field, double* x, double* y, double* z, double* sep,
+                               long nq, int d, int coords, long* counts);
+extern void FieldGetNearMany(void* field, double* x, double* y, double* z, double* sep,
+                             long nq, int d, int coords, long* offsets, long* indices);
+extern void FieldGetNearest(void* field, double* x, double* y, double* z, long nq, long k,
+                            int d, int coords, long* indices, double* distsq);
 
 extern void* BuildGSimpleField(double* x, double* y, double* z, double* g1, double* g2,
                                double* w, double* wpos, long nobj, int coords);
@@ -53,10 +92,13 @@ extern void DestroyNSimpleField(void* field, int coords);
 extern void KMeansInitTree(void* field, double* centers, int npatch, int d, int coords);
 extern void KMeansInitRand(void* field, double* centers, int npatch, int d, int coords);
 extern void KMeansInitKMPP(void* field, double* centers, int npatch, int d, int coords);
+extern void KMeansInitKMPar(void* field, double* centers, int npatch, int d, int coords);
 extern void KMeansRun(void* field, double* centers, int npatch, int max_iter, double tol,
                       int alt, int d, int coords);
 extern void KMeansAssign(void* field, double* centers, int npatch,
                          long* patches, long n, int d, int coords);
+extern void KMeansChunk(void* field, double* centers, int npatch, double* inertia,
+                        double* sums, double* weights, double* new_inertia, int d, int coords);
 
 // These aren't field functions, but I'm putting them here anyway, since they're related to patches.
 extern void QuickAssign(double* centers, int npatch,
@@ -0,0 +1,133 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#ifndef TreeCorr_InteractionList_H
+#define TreeCorr_InteractionList_H
+
+#include <vector>
+#include <algorithm>
+
+#include "dbg.h"
+#include "Cell.h"
+
+// The list of pairs of cells that a process call added to the bins, i.e. the arguments of
+// each call to directProcess11.  Which pairs these are only depends on the positions and
+// weights, so for another field with the same tree structure but different k or g values
+// (e.g. one built from the same tree for a new shear realization), the pairs can be added to
+// the bins directly from the list, without going through the tree traversal again.
+//
+// The cells are identified by their index in the depth-first order of all the cells in a
+// field (cf. CollectCells), which is the same for any two fields with the same tree.
+
+// One pair of cells as it is recorded during the traversal.
+struct RecordedPair
+{
+    RecordedPair(const void* _c1, const void* _c2, double _rsq, int _k, double _r,
+                 double _logr, bool _do_reverse) :
+        c1(_c1), c2(_c2), rsq(_rsq), r(_r), logr(_logr), k(_k), do_reverse(_do_reverse) {}
+
+    const void* c1;
+    const void* c2;
+    double rsq, r, logr;
+    int k;
+    bool do_reverse;
+};
+
+// One pair of cells in the final list, with the cells given by their indices.
+struct Interaction
+{
+    Interaction(long _i1, long _i2, const RecordedPair& p) :
+        i1(_i1), i2(_i2), rsq(p.rsq), r(p.r), logr(p.logr), k(p.k), do_reverse(p.do_reverse) {}
+
+    long i1, i2;
+    double rsq, r, logr;
+    int k;
+    bool do_reverse;
+};
+
+// Add all the cells in the tree below cell (including cell) to cells in depth-first order.
+// Only the cells that have already been built are included.
+template <int D, int C>
+void CollectCells(const Cell<D,C>* cell, std::vector<const Cell<D,C>*>& cells)
+{
+    cells.push_back(cell);
+    if (cell->getLeft()) {
+        CollectCells(cell->getLeft(), cells);
+        CollectCells(cell->getRight(), cells);
+    }
+}
+
+template <int D, int C>
+void CollectCells(const std::vector<Cell<D,C>*>& top, std::vector<const Cell<D,C>*>& cells)
+{
+    for (size_t i=0; i<top.size(); ++i) CollectCells(top[i], cells);
+}
+
+// A checksum of the tree structure, so we can check that a list is used with the same trees
+// that it was recorded with.
+template <int D, int C>
+unsigned long TreeSignature(const std::vector<const Cell<D,C>*>& cells)
+{
+    unsigned long h = cells.size();
+    for (size_t i=0; i<cells.size(); ++i) {
+        const Cell<D,C>& c = *cells[i];
+        h = h * 1000003UL ^ static_cast<unsigned long>(c.getN());
+        if (!c.getLeft() && c.getN() == 1)
+            h = h * 1000003UL ^ static_cast<unsigned long>(c.getInfo().index);
+    }
+    return h;
+}
+
+// Find the index of each cell from its address.
+template <int D, int C>
+class CellIndex
+{
+public:
+    CellIndex(const std::vector<const Cell<D,C>*>& cells)
+    {
+        _index.resize(cells.size());
+        for (size_t i=0; i<cells.size(); ++i)
+            _index[i] = std::make_pair(static_cast<const void*>(cells[i]), long(i));
+        std::sort(_index.begin(), _index.end());
+    }
+
+    long find(const void* cell) const
+    {
+        std::vector<std::pair<const void*,long> >::const_iterator it =
+            std::lower_bound(_index.begin(), _index.end(), std::make_pair(cell, -1L));
+        Assert(it != _index.end() && it->first == cell);
+        return it->second;
+    }
+
+private:
+    std::vector<std::pair<const void*,long> > _index;
+};
+
+struct InteractionList
+{
+    InteractionList() :
+        nbins(0), minsep(0.), maxsep(0.), b(0.), chord(false), sig1(0), sig2(0) {}
+
+    // The binning it was recorded with, which the correlation that replays it must match.
+    int nbins;
+    double minsep, maxsep, b;
+    bool chord;     // Whether it was recorded in chord space. cf. BinnedCorr2::getChordCorr.
+
+    // The signatures of the two trees.
+    unsigned long sig1, sig2;
+
+    std::vector<Interaction> pairs;
+};
+
+#endif
@@ -19,6 +19,7 @@
 #include "Metric_C.h"
 #include <limits>
 #include <cmath>
+#include <algorithm>
 
 
 template <int M>
@@ -774,5 +775,191 @@ struct MetricHelper<Periodic>
 
 };
 
+// Whether MetricHelper<M>::DistSq leaves the sizes alone for coordinates C.  If so, a distance
+// that was already calculated for a pair of cells can be used again without calling DistSq.
+// Otherwise, DistSq is still needed to get the adjusted sizes.
+template <int M, int C>
+struct DistSqKeepsSizes
+{ enum { value = !(M == Rlens || (M == Arc && C == ThreeD)) }; };
+
+// Whether there is a range of rpar to check.  (The python layer uses +-max for no limit.)
+inline bool HasRParRange(double minrpar, double maxrpar)
+{
+    return minrpar != -std::numeric_limits<double>::max() ||
+        maxrpar != std::numeric_limits<double>::max();
+}
+
+// FusedMetric does the metric calculations that process11 needs for a pair of cells in one
+// go: DistSq (including the adjustments to the sizes) and the check of whether the pair is
+// fully outside the rpar range.  The generic version just calls the MetricHelper functions.
+// The metrics with an rpar range specialize it, so the intermediate values (e.g. |p1|^2,
+// |p2|^2 and L) are only computed once for both.  These need to match the MetricHelper
+// calculations, since the two are used for the same pairs in different places.
+//
+// leafDistSq is the version for the pairs of leaves in processLeaves, where the sizes are 0.
+// It does one point against a whole array of others.  The loops have no branches or function
+// calls, so the compiler can vectorize them.
+template <int M, int C>
+struct FusedMetric
+{
+    // Returns false if the pair is fully outside the rpar range.  rsq and rpar are set as
+    // DistSq and isRParOutsideRange would, and s1, s2 are adjusted as in DistSq.
+    static bool distSqInRPar(const MetricHelper<M>& m, const Position<C>& p1,
+                             const Position<C>& p2, double& s1, double& s2,
+                             double& rsq, double& rpar)
+    {
+        rsq = m.DistSq(p1, p2, s1, s2);
+        return !m.isRParOutsideRange(p1, p2, s1+s2, rpar);
+    }
+
+    // rsq[j] is the distance squared from p1 to p2[j], and ok[j] is whether it is in the
+    // rpar range.
+    static void leafDistSq(const MetricHelper<M>& m, const Position<C>& p1,
+                           const Position<C>* p2, long n, double* rsq, char* ok)
+    {
+        for (long j=0; j<n; ++j) {
+            double s=0.;
+            rsq[j] = m.DistSq(p1, p2[j], s, s);
+        }
+        for (long j=0; j<n; ++j) {
+            double rpar = 0.;
+            ok[j] = !m.isRParOutsideRange(p1, p2[j], 0., rpar);
+        }
+    }
+};
+
+template <>
+struct FusedMetric<OldRperp, ThreeD>
+{
+    static bool distSqInRPar(const MetricHelper<OldRperp>& m, const Position<ThreeD>& p1,
+                             const Position<ThreeD>& p2, double& s1, double& s2,
+                             double& rsq, double& rpar)
+    {
+        const double r1sq = p1.normSq();
+        const double r2sq = p2.normSq();
+        const double rparsq = SQR(r1sq - r2sq) / (r1sq + r2sq + 2.*sqrt(r1sq*r2sq));
+        if (r1sq < r2sq) {
+            if (s1 != 0. && s1 < std::numeric_limits<double>::infinity())
+                s1 *= (1. + 0.25 * (r2sq-r1sq)/r1sq);
+        } else {
+            if (s2 != 0. && s2 < std::numeric_limits<double>::infinity())
+                s2 *= (1. + 0.25 * (r1sq-r2sq)/r2sq);
+        }
+        rsq = std::abs((p1-p2).normSq() - rparsq);
+        if (!HasRParRange(m.minrpar, m.maxrpar)) return true;
+        rpar = sqrt(r2sq) - sqrt(r1sq);
+        const double s1ps2 = s1+s2;
+        return !(rpar + s1ps2 < m.minrpar || rpar - s1ps2 > m.maxrpar);
+    }
+
+    static void leafDistSq(const MetricHelper<OldRperp>& m, const Position<ThreeD>& p1,
+                           const Position<ThreeD>* p2, long n, double* rsq, char* ok)
+    {
+        const double x1 = p1.getX(), y1 = p1.getY(), z1 = p1.getZ();
+        const double r1sq = p1.normSq();
+        const double r1 = sqrt(r1sq);
+        const bool check = HasRParRange(m.minrpar, m.maxrpar);
+        const double minrpar = m.minrpar, maxrpar = m.maxrpar;
+        for (long j=0; j<n; ++j) {
+            const double x2 = p2[j].getX(), y2 = p2[j].getY(), z2 = p2[j].getZ();
+            const double r2sq = x2*x2 + y2*y2 + z2*z2;
+            const double rparsq = SQR(r1sq - r2sq) / (r1sq + r2sq + 2.*sqrt(r1sq*r2sq));
+            const double dsq = SQR(x1-x2) + SQR(y1-y2) + SQR(z1-z2);
+            rsq[j] = std::abs(dsq - rparsq);
+        }
+        if (!check) { std::fill(ok, ok+n, 1); return; }
+        for (long j=0; j<n; ++j) {
+            const double rpar = p2[j].norm() - r1;
+            ok[j] = !(rpar < minrpar || rpar > maxrpar);
+        }
+    }
+};
+
+template <>
+struct FusedMetric<Rperp, ThreeD>
+{
+    static bool distSqInRPar(const MetricHelper<Rperp>& m, const Position<ThreeD>& p1,
+                             const Position<ThreeD>& p2, double& s1, double& s2,
+                             double& rsq, double& rpar)
+    {
+        const Position<ThreeD> L = (p1+p2)*0.5;
+        const double normLsq = L.normSq();
+        m._normLsq = normLsq;  // For tooSmallDist and tooLargeDist.
+        const double r1sq = p1.normSq();
+        rsq = normLsq > 0. ? p1.cross(p2).normSq() / normLsq : 4.*r1sq;
+        const double r2sq = p2.normSq();
+        if (r2sq > normLsq && s1 != 0) s1 *= sqrt(r2sq / normLsq);
+        if (r1sq > normLsq && s2 != 0) s2 *= sqrt(r1sq / normLsq);
+        if (!HasRParRange(m.minrpar, m.maxrpar)) return true;
+        rpar = (p2-p1).dot(L) / sqrt(normLsq);
+        const double s1ps2 = s1+s2;
+        return !(rpar + s1ps2 < m.minrpar || rpar - s1ps2 > m.maxrpar);
+    }
+
+    static void leafDistSq(const MetricHelper<Rperp>& m, const Position<ThreeD>& p1,
+                           const Position<ThreeD>* p2, long n, double* rsq, char* ok)
+    {
+        const double x1 = p1.getX(), y1 = p1.getY(), z1 = p1.getZ();
+        const double r1sq = p1.normSq();
+        const bool check = HasRParRange(m.minrpar, m.maxrpar);
+        const double minrpar = m.minrpar, maxrpar = m.maxrpar;
+        for (long j=0; j<n; ++j) {
+            const double x2 = p2[j].getX(), y2 = p2[j].getY(), z2 = p2[j].getZ();
+            const double Lx = (x1+x2)*0.5, Ly = (y1+y2)*0.5, Lz = (z1+z2)*0.5;
+            const double normLsq = Lx*Lx + Ly*Ly + Lz*Lz;
+            const double cx = y1*z2 - z1*y2, cy = z1*x2 - x1*z2, cz = x1*y2 - y1*x2;
+            rsq[j] = normLsq > 0. ? (cx*cx + cy*cy + cz*cz) / normLsq : 4.*r1sq;
+        }
+        if (!check) { std::fill(ok, ok+n, 1); return; }
+        for (long j=0; j<n; ++j) {
+            const double x2 = p2[j].getX(), y2 = p2[j].getY(), z2 = p2[j].getZ();
+            const double Lx = (x1+x2)*0.5, Ly = (y1+y2)*0.5, Lz = (z1+z2)*0.5;
+            const double rpar = ((x2-x1)*Lx + (y2-y1)*Ly + (z2-z1)*Lz) /
+                sqrt(Lx*Lx + Ly*Ly + Lz*Lz);
+            ok[j] = !(rpar < minrpar || rpar > maxrpar);
+        }
+    }
+};
+
+template <>
+struct FusedMetric<Rlens, ThreeD>
+{
+    static bool distSqInRPar(const MetricHelper<Rlens>& m, const Position<ThreeD>& p1,
+                             const Position<ThreeD>& p2, double& s1, double& s2,
+                             double& rsq, double& rpar)
+    {
+        const double r2sq = p2.normSq();
+        rsq = p1.cross(p2).normSq() / r2sq;
+        s2 *= sqrt(p1.normSq() / r2sq);
+        if (!HasRParRange(m.minrpar, m.maxrpar)) return true;
+        const Position<ThreeD> L = (p1+p2)*0.5;
+        rpar = (p2-p1).dot(L) / L.norm();
+        const double s1ps2 = s1+s2;
+        return !(rpar + s1ps2 < m.minrpar || rpar - s1ps2 > m.maxrpar);
+    }
+
+    static void leafDistSq(const MetricHelper<Rlens>& m, const Position<ThreeD>& p1,
+                           const Position<ThreeD>* p2, long n, double* rsq, char* ok)
+    {
+        const double x1 = p1.getX(), y1 = p1.getY(), z1 = p1.getZ();
+        const bool check = HasRParRange(m.minrpar, m.maxrpar);
+        const double minrpar = m.minrpar, maxrpar = m.maxrpar;
+        for (long j=0; j<n; ++j) {
+            const double x2 = p2[j].getX(), y2 = p2[j].getY(), z2 = p2[j].getZ();
+            const double r2sq = x2*x2 + y2*y2 + z2*z2;
+            const double cx = y1*z2 - z1*y2, cy = z1*x2 - x1*z2, cz = x1*y2 - y1*x2;
+            rsq[j] = (cx*cx + cy*cy + cz*cz) / r2sq;
+        }
+        if (!check) { std::fill(ok, ok+n, 1); return; }
+        for (long j=0; j<n; ++j) {
+            const double x2 = p2[j].getX(), y2 = p2[j].getY(), z2 = p2[j].getZ();
+            const double Lx = (x1+x2)*0.5, Ly = (y1+y2)*0.5, Lz = (z1+z2)*0.5;
+            const double rpar = ((x2-x1)*Lx + (y2-y1)*Ly + (z2-z1)*Lz) /
+                sqrt(Lx*Lx + Ly*Ly + Lz*Lz);
+            ok[j] = !(rpar < minrpar || rpar > maxrpar);
+        }
+    }
+};
+
 #endif
 
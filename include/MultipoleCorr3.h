@@ -0,0 +1,138 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#ifndef TreeCorr_MultipoleCorr3_H
+#define TreeCorr_MultipoleCorr3_H
+
+#include <vector>
+#include <complex>
+#include <unordered_map>
+
+#include "Cell.h"
+#include "Field.h"
+
+// The multipoles of a three-point correlation function, computed from the neighbours of
+// each point rather than from triples of cells.  (cf. Slepian & Eisenstein 2015,
+// Porth et al. 2023)
+//
+// For each primary cell c1 of field1, we find all the cells c2 of field2 with
+// minsep <= |c2-c1| < maxsep, using the same kind of tree traversal as for a two-point
+// correlation, and accumulate
+//
+//     a_n(b) = Sum_{c2 in radial bin b} w2 [k2] exp(-i n phi_12)
+//
+// where phi_12 is the angle of c2 around c1.  The triangles with a vertex at c1 and the
+// other two in radial bins b1 and b2 then contribute
+//
+//     W_n(b1,b2) += w1 [k1] (a_n(b1) conj(a_n(b2)) - delta_b1b2 Sum_{c2 in b1} (w2 [k2])^2)
+//
+// where the second term removes the degenerate triangles with both vertices at the same
+// object.  When c2 is a cell with several objects, this is the sum of (w [k])^2 over the
+// objects in it, not the square of the cell's total.
+// The weight of the triangles as a function of the angle phi between the two sides is
+// then Sum_n W_n(b1,b2) exp(i n phi) / 2pi.  The cost is O(N nbins^2 max_n) after the
+// two-point traversal, rather than the O(N^3)-like scaling of BinnedCorr3::process.
+//
+// Every triangle is counted once for each of its vertices as the primary and for each
+// order of the other two.  So W_n(b1,b2) = conj(W_n(b2,b1)), and W_{-n} = conj(W_n), so we
+// only store n = 0..maxn.
+//
+// D is NData or KData.  For NData, only the weights are accumulated.  For KData, the zeta
+// arrays are the same sums with w replaced by w k.  These are currently only implemented
+// for Flat coordinates with the Euclidean metric.
+template <int D>
+class MultipoleCorr3
+{
+public:
+
+    // The output arrays are all added to, not overwritten.
+    // weight and zeta have nbins * nbins * (maxn+1) elements, indexed as
+    // (b1 * nbins + b2) * (maxn+1) + n.  zeta may be null for NData.
+    // meanr, meanlogr and npairs have nbins elements for the pairs (c1,c2) in each radial bin.
+    //
+    // b is the usual bin_slop * bin_size.  bphi is the allowed error in the angle phi_12
+    // (in radians).  Cells are only used as a single point when both are satisfied.
+    MultipoleCorr3(double minsep, double maxsep, int nbins, double binsize, double b,
+                   double bphi, int maxn,
+                   double* weight_re, double* weight_im, double* zeta_re, double* zeta_im,
+                   double* meanr, double* meanlogr, double* npairs);
+
+    void process(const Field<D,Flat>& field1, const Field<D,Flat>& field2, bool dots);
+
+protected:
+
+    // The sums for a single primary cell.
+    struct Moments
+    {
+        void resize(int nbins, int maxn);
+        void clear();
+
+        std::vector<std::complex<double> > a;   // a_n(b) for the weights, [b*(maxn+1)+n]
+        std::vector<std::complex<double> > ak;  // a_n(b) for w k (KData only)
+        std::vector<double> ww;                 // Sum (w2)^2 in each bin
+        std::vector<double> wwkk;               // Sum (w2 k2)^2 in each bin (KData only)
+        std::vector<int> used;                  // The bins that have anything in them.
+        std::vector<char> isused;
+    };
+
+    // The results for one thread.
+    struct Accum
+    {
+        void resize(int nbins, int maxn);
+
+        std::vector<std::complex<double> > weight;
+        std::vector<std::complex<double> > zeta;
+        std::vector<double> meanr, meanlogr, npairs;
+    };
+
+    // Sum (w [k])^2 over the objects in each cell of field2 with more than one object.
+    // first is Sum w^2, second is Sum (w k)^2 (KData only).
+    typedef std::unordered_map<const Cell<D,Flat>*, std::pair<double,double> > SelfSums;
+
+    // Fill sums for c and all the cells below it.  Returns the sums for c.
+    std::pair<double,double> calculateSelfSums(const Cell<D,Flat>& c, SelfSums& sums) const;
+
+    // Find the primary cells of field1, which are small enough to be used as a single point.
+    void findPrimaries(const Cell<D,Flat>* c1, std::vector<const Cell<D,Flat>*>& primaries) const;
+
+    // Add the neighbours of c1 in the tree below c2 to the moments.
+    void findNeighbours(const Cell<D,Flat>& c1, const Cell<D,Flat>& c2, const SelfSums& sums,
+                        Moments& mom, Accum& acc) const;
+
+    // Add the triangles with a vertex at c1 to the accumulated results.
+    void finishPrimary(const Cell<D,Flat>& c1, Moments& mom, Accum& acc) const;
+
+    double _minsep;
+    double _maxsep;
+    int _nbins;
+    double _binsize;
+    double _b;
+    double _bphi;
+    int _maxn;
+    double _logminsep;
+    double _minsepsq;
+    double _maxsepsq;
+    double _bmin;       // = min(b, bphi)
+    double _minprimary; // Primary cells are split until they are smaller than this.
+
+    double* _weight_re;
+    double* _weight_im;
+    double* _zeta_re;
+    double* _zeta_im;
+    double* _meanr;
+    double* _meanlogr;
+    double* _npairs;
+};
+
+#endif
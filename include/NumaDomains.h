@@ -0,0 +1,103 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#ifndef TreeCorr_NumaDomains_H
+#define TreeCorr_NumaDomains_H
+
+#include <vector>
+
+#ifdef _OPENMP
+#include "omp.h"
+#endif
+
+// On a machine with several NUMA domains (e.g. the sockets of a multi-socket node), memory is
+// much faster to use from the cores of the domain where it was first touched.
+//
+// When SetNumaDomains(n) is given n > 1, the OpenMP threads are treated as n contiguous
+// blocks, thread t being in domain t * n / nthreads.  This matches the usual numbering of the
+// cores, especially if the threads are pinned to them (PinThreads, or OMP_PROC_BIND).
+// Field builds each top-level cell (and its whole tree, unless it is lazy) on a single
+// thread, so all of its memory is first touched in that thread's domain, and it records which
+// domain that was.  Then the work loops give each thread the items whose largest cell is in
+// its own domain first, and only after those are done does it help with the other domains.
+
+int GetNumaDomains();
+void SetNumaDomains(int n);
+
+// Pin each of the current OpenMP threads to one of the cores this process may use, in order.
+// Returns the number of threads that were pinned (0 if this isn't supported here).
+int PinThreads();
+
+inline int ThreadDomain(int thread, int nthreads, int ndomains)
+{ return int(long(thread) * ndomains / nthreads); }
+
+// The domain of the current thread, or 0 if not in a parallel region.
+inline int CurrentThreadDomain(int ndomains)
+{
+#ifdef _OPENMP
+    return ThreadDomain(omp_get_thread_num(), omp_get_num_threads(), ndomains);
+#else
+    return 0;
+#endif
+}
+
+// The items start..end-1 of a work loop, in their original order, split up by domain.
+// The domains are either given directly, or Item is anything with a domain member.  It may be
+// -1 if it doesn't matter where the item is run.  Those are dealt out to the domains in turn.
+//
+// The loops use it as
+//     #pragma omp for schedule(dynamic)
+//     for (long m=start; m<end; ++m) {
+//         long n = queue.next(domain);
+// so each iteration takes one item, and since there are as many iterations as items, next
+// never runs out.  The items from each domain are still done in their original order.
+class DomainQueue
+{
+public:
+    DomainQueue(int ndomains, const std::vector<int>& domains, long start, long end) :
+        _queues(ndomains), _next(ndomains, 0)
+    { for (long n=start; n<end; ++n) add(n, domains[n]); }
+
+    template <typename Item>
+    DomainQueue(int ndomains, const std::vector<Item>& items, long start, long end) :
+        _queues(ndomains), _next(ndomains, 0)
+    { for (long n=start; n<end; ++n) add(n, items[n].domain); }
+
+    // The next item to do for a thread in domain d.  This is thread safe.
+    long next(int d)
+    {
+        const int nd = _queues.size();
+        for (int k=0; k<nd; ++k) {
+            const int dd = (d + k) % nd;
+            if (__atomic_load_n(&_next[dd], __ATOMIC_RELAXED) >= long(_queues[dd].size()))
+                continue;
+            const long q = __atomic_fetch_add(&_next[dd], 1L, __ATOMIC_RELAXED);
+            if (q < long(_queues[dd].size())) return _queues[dd][q];
+        }
+        return -1;
+    }
+
+private:
+    void add(long n, int d)
+    {
+        const int nd = _queues.size();
+        if (d < 0 || d >= nd) d = int(n % nd);
+        _queues[d].push_back(n);
+    }
+
+    std::vector<std::vector<long> > _queues;
+    std::vector<long> _next;
+};
+
+#endif
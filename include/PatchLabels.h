@@ -0,0 +1,97 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#ifndef TreeCorr_PatchLabels_H
+#define TreeCorr_PatchLabels_H
+
+#include <vector>
+#include <algorithm>
+
+#include "Cell.h"
+
+// The patch numbers of the Cells of a Field over a whole catalog, for BinnedCorr2::
+// processTagged.  A Cell whose objects are all in the same patch is "pure" and gets that
+// patch number.  One with objects in more than one patch gets -1.
+//
+// The traversal only needs to look up the Cells that are mixed, and the pure Cells just
+// below them (and the top-level Cells), since once both Cells are pure, the rest of the
+// recursion is the usual one.  So only these are stored, in a vector sorted by the
+// Cell's address.  The Cells have no room to store it themselves.
+template <int D, int C>
+class PatchLabels
+{
+public:
+
+    // patch[index] is the patch number of each object in the catalog.
+    PatchLabels(const std::vector<Cell<D,C>*>& cells, const long* patch) : _nmixed_leaves(0)
+    {
+        for (size_t i=0; i<cells.size(); ++i) {
+            int p = label(*cells[i], patch);
+            _labels.push_back(Entry(cells[i], p));
+        }
+        std::sort(_labels.begin(), _labels.end());
+        _labels.erase(std::unique(_labels.begin(), _labels.end()), _labels.end());
+        dbg<<"PatchLabels: "<<_labels.size()<<" labels, "<<_nmixed_leaves<<" mixed leaves\n";
+    }
+
+    // The patch number of c, which must be a top-level Cell, a mixed one, or a child of one.
+    int get(const Cell<D,C>* c) const
+    {
+        typename std::vector<Entry>::const_iterator it =
+            std::lower_bound(_labels.begin(), _labels.end(), Entry(c, -2));
+        Assert(it != _labels.end() && it->first == c);
+        return it->second;
+    }
+
+    // A leaf with objects in more than one patch can't be split, so processTagged can't
+    // separate its pairs.  This should only happen if some objects at the same position are
+    // in different patches.
+    long getNMixedLeaves() const { return _nmixed_leaves; }
+
+    long getNLabels() const { return _labels.size(); }
+
+private:
+
+    typedef std::pair<const Cell<D,C>*, int> Entry;
+
+    int label(const Cell<D,C>& c, const long* patch)
+    {
+        const Cell<D,C>* left = c.getLeft();
+        if (!left) {
+            if (c.getN() == 1) return int(patch[c.getInfo().index]);
+            const ListLeafInfo& indices = c.getListInfo();
+            const long p = patch[indices[0]];
+            for (long i=1; i<c.getN(); ++i) {
+                if (patch[indices[i]] != p) {
+                    ++_nmixed_leaves;
+                    return -1;
+                }
+            }
+            return int(p);
+        }
+        const Cell<D,C>* right = c.getRight();
+        const int p1 = label(*left, patch);
+        const int p2 = label(*right, patch);
+        if (p1 == p2 && p1 >= 0) return p1;
+        _labels.push_back(Entry(&c, -1));
+        _labels.push_back(Entry(left, p1));
+        _labels.push_back(Entry(right, p2));
+        return -1;
+    }
+
+    std::vector<Entry> _labels;
+    long _nmixed_leaves;
+};
+
+#endif
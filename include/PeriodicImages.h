@@ -0,0 +1,160 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#ifndef TreeCorr_PeriodicImages_H
+#define TreeCorr_PeriodicImages_H
+
+#include <vector>
+#include <cmath>
+#include <limits>
+
+#include "Cell.h"
+#include "Arena.h"
+#include "TopCellGrid.h"
+
+#ifdef _OPENMP
+#include "omp.h"
+#endif
+
+// The periodic images of the top-level cells of a Field, so the Periodic metric can be done
+// with the Euclidean one.  An image is a copy of the whole tree of a top-level cell, shifted by
+// some multiple of the period in each direction.  Only the images that come within maxsep of
+// the bounding box of the other field's top-level cells are made.
+//
+// If maxsep <= half the period in every direction, then for each pair of objects, at most one
+// of the images of the second object is within maxsep of the first, and it is the same one
+// that the Periodic metric uses.  So pairing the cells with both the original cells and these
+// images, using the Euclidean metric, gets the same pairs as the Periodic metric.
+template <int D, int C>
+class PeriodicImages
+{
+public:
+
+    // cells are the top-level cells to make images of.  cells1 are the top-level cells of the
+    // field that they will be paired with (which may be the same as cells).
+    template <int D1>
+    PeriodicImages(const std::vector<Cell<D,C>*>& cells, const std::vector<Cell<D1,C>*>& cells1,
+                   double xp, double yp, double zp, double maxsep)
+    {
+        const int ndim = C == Flat ? 2 : 3;
+        const double period[3] = { xp, yp, zp };
+        double lo[3], hi[3];
+        for (int k=0; k<ndim; ++k) {
+            lo[k] = std::numeric_limits<double>::max();
+            hi[k] = -lo[k];
+        }
+        for (size_t i=0; i<cells1.size(); ++i) {
+            double p[3];
+            GetCoords(cells1[i]->getPos(), p);
+            const double s = cells1[i]->getSize();
+            for (int k=0; k<ndim; ++k) {
+                lo[k] = std::min(lo[k], p[k] - s);
+                hi[k] = std::max(hi[k], p[k] + s);
+            }
+        }
+
+        // Find the shifts first, so the copies can be made in parallel.
+        std::vector<long> source;
+        std::vector<Position<C> > shifts;
+        for (size_t i=0; i<cells.size(); ++i) {
+            double p[3];
+            GetCoords(cells[i]->getPos(), p);
+            const double s = cells[i]->getSize();
+            const double r = maxsep + s;
+            int nmin[3] = { 0, 0, 0 };
+            int nmax[3] = { 0, 0, 0 };
+            for (int k=0; k<ndim; ++k) {
+                nmin[k] = int(std::ceil((lo[k] - r - p[k]) / period[k]));
+                nmax[k] = int(std::floor((hi[k] + r - p[k]) / period[k]));
+            }
+            for (int nx=nmin[0]; nx<=nmax[0]; ++nx)
+                for (int ny=nmin[1]; ny<=nmax[1]; ++ny)
+                    for (int nz=nmin[2]; nz<=nmax[2]; ++nz) {
+                        if (nx == 0 && ny == 0 && nz == 0) continue;
+                        const int n[3] = { nx, ny, nz };
+                        // The distance from the shifted center to the bounding box.
+                        double dsq = 0.;
+                        for (int k=0; k<ndim; ++k) {
+                            const double x = p[k] + n[k] * period[k];
+                            if (x < lo[k]) dsq += SQR(lo[k] - x);
+                            else if (x > hi[k]) dsq += SQR(x - hi[k]);
+                        }
+                        if (dsq >= SQR(r)) continue;
+                        source.push_back(i);
+                        shifts.push_back(Position<C>(nx * xp, ny * yp, nz * zp));
+                        // Lexicographically positive shifts.
+                        _positive.push_back(nx > 0 || (nx == 0 && (ny > 0 || (ny == 0 && nz > 0))));
+                    }
+        }
+
+        const long nimages = source.size();
+        _source = source;
+        _cells.resize(nimages);
+        _arenas.resize(nimages);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+        for (long m=0; m<nimages; ++m) {
+            _arenas[m] = new Arena();
+            _cells[m] = CopyShifted(*cells[source[m]], shifts[m], *_arenas[m]);
+        }
+        dbg<<"Made "<<nimages<<" periodic images of "<<cells.size()<<" top-level cells\n";
+    }
+
+    ~PeriodicImages()
+    {
+        for (size_t m=0; m<_arenas.size(); ++m) delete _arenas[m];
+    }
+
+    long size() const { return long(_cells.size()); }
+    const std::vector<Cell<D,C>*>& getCells() const { return _cells; }
+    // The index in cells of the cell that image m is a copy of.
+    long getSource(long m) const { return _source[m]; }
+    // Whether the shift of image m is lexicographically positive, i.e. the first non-zero
+    // component is positive.  For an auto-correlation, each cell's images only need to be
+    // paired with the cell itself for the positive shifts.
+    bool isPositive(long m) const { return _positive[m]; }
+
+private:
+
+    static void GetCoords(const Position<C>& pos, double* p)
+    {
+        p[0] = pos.getX();
+        p[1] = pos.getY();
+        p[2] = GridZ(pos);
+    }
+
+    static Cell<D,C>* CopyShifted(const Cell<D,C>& c, const Position<C>& shift, Arena& arena)
+    {
+        CellData<D,C> data = c.getData();
+        data.shiftPos(shift);
+        const Cell<D,C>* left = c.getLeft();
+        if (left) {
+            Cell<D,C>* l = CopyShifted(*left, shift, arena);
+            Cell<D,C>* r = CopyShifted(*c.getRight(), shift, arena);
+            return new (arena) Cell<D,C>(data, c.getSize(), c.getSizeSq(), l, r);
+        } else if (c.getN() == 1) {
+            return new (arena) Cell<D,C>(data, c.getInfo());
+        } else {
+            return new (arena) Cell<D,C>(data, c.getListInfo());
+        }
+    }
+
+    std::vector<Cell<D,C>*> _cells;
+    std::vector<long> _source;
+    std::vector<bool> _positive;
+    std::vector<Arena*> _arenas;
+};
+
+#endif
@@ -24,6 +24,19 @@
 template <typename T>
 inline T SQR(T x) { return x * x; }
 
+// The type used to store the coordinates.  Every Cell has a Position, so most of the memory
+// for the trees is positions.  Building with -DTREECORR_FLOAT_POSITIONS (python setup.py
+// build_ext --float-positions) stores them in single precision, which makes each Cell about
+// half the size.  The arithmetic is still done in double precision, but the positions (and
+// the differences between them) are rounded to float, so the separations have a relative
+// precision of about 1.e-7.  This is fine when the separations of interest are much larger
+// than that times the size of the field, but it is not the default.
+#ifdef TREECORR_FLOAT_POSITIONS
+typedef float PositionValue;
+#else
+typedef double PositionValue;
+#endif
+
 template <int C>
 class Position;
 
@@ -36,21 +49,14 @@ class Position<Flat>
 {
 
 public:
-    Position() : _x(0.), _y(0.), _normsq(0.), _norm(0.) {}
-    Position(const Position<Flat>& rhs) :
-        _x(rhs._x), _y(rhs._y), _normsq(rhs._normsq), _norm(rhs._norm) {}
-    ~Position() {}
-    Position(double x, double y) : _x(x), _y(y), _normsq(0.), _norm(0.) {}
-    Position& operator=(const Position<Flat>& rhs)
-    {
-        _x = rhs._x; _y = rhs._y;
-        _normsq = rhs._normsq; _norm = rhs._norm;
-        return *this;
-    }
+    // Note: The compiler-generated copy constructor, assignment and destructor are fine, and
+    // they let Position (and thus CellData) be trivially copyable.
+    Position() : _x(0.), _y(0.) {}
+    Position(double x, double y) : _x(x), _y(y) {}
 
     // A convenience constructor to be parallel with 3d positions so I can do things like
     // Position<C> pos(x,y,z) when z=0 for Flat.
-    Position(double x, double y, double z) : _x(x), _y(y), _normsq(0.), _norm(0.)
+    Position(double x, double y, double z) : _x(x), _y(y)
     { Assert(z==0.); }
 
     double getX() const { return _x; }
@@ -58,31 +64,27 @@ public:
     double get(int split) const { return split==1 ? _y : _x; }
     operator std::complex<double>() const { return std::complex<double>(_x,_y); }
 
-    double normSq() const
-    {
-        if (_normsq == 0.) _normsq = _x*_x + _y*_y;
-        return _normsq;
-    }
-    double norm() const
-    {
-        if (_norm == 0.) _norm = sqrt(normSq());
-        return _norm;
-    }
+    // Note: We don't cache the norm.  Positions are stored in every Cell, so keeping them
+    // small is more important than saving the occasional sqrt.
+    double normSq() const { return getX()*getX() + getY()*getY(); }
+    double norm() const { return sqrt(normSq()); }
     void normalize() {}
 
+    // These use the getters, so they are done in double precision even if the positions
+    // are stored as float.
     double dot(const Position<Flat>& p2) const
-    { return _x*p2._x + _y*p2._y; }
+    { return getX()*p2.getX() + getY()*p2.getY(); }
     double cross(const Position<Flat>& p2) const
-    { return _x*p2._y - _y*p2._x; }
+    { return getX()*p2.getY() - getY()*p2.getX(); }
 
     Position<Flat>& operator+=(const Position<Flat>& p2)
-    { _x += p2.getX(); _y += p2.getY(); resetNorm(); return *this; }
+    { _x += p2.getX(); _y += p2.getY(); return *this; }
     Position<Flat>& operator-=(const Position<Flat>& p2)
-    { _x -= p2.getX(); _y -= p2.getY(); resetNorm(); return *this; }
+    { _x -= p2.getX(); _y -= p2.getY(); return *this; }
     Position<Flat>& operator*=(double a)
-    { _x *= a; _y *= a; resetNorm(); return *this; }
+    { _x *= a; _y *= a; return *this; }
     Position<Flat>& operator/=(double a)
-    { _x /= a; _y /= a; resetNorm(); return *this; }
+    { _x /= a; _y /= a; return *this; }
 
     Position<Flat> operator+(const Position<Flat>& p2) const
     { Position<Flat> p1 = *this; p1 += p2; return p1; }
@@ -96,7 +98,7 @@ public:
     bool operator==(const Position<Flat>& p2) const
     { return _x == p2.getX() && _y == p2.getY(); }
 
-    void read(std::istream& fin) { fin >> _x >> _y; resetNorm(); }
+    void read(std::istream& fin) { fin >> _x >> _y; }
     void write(std::ostream& fout) const
     { fout << _x << " " << _y << " "; }
 
@@ -108,12 +110,8 @@ public:
         while (_y < -yp/2.) _y += yp;
     }
 
-protected:
-    void resetNorm() { _normsq = _norm = 0.; }
-
 private:
-    double _x,_y;
-    mutable double _normsq, _norm;
+    PositionValue _x,_y;
 
 }; // Position<Flat>
 
@@ -135,53 +133,36 @@ class Position<ThreeD>
 {
 
 public:
-    Position() : _x(0.), _y(0.), _z(0.), _normsq(0.), _norm(0.) {}
-    Position(const Position<ThreeD>& rhs) :
-        _x(rhs._x), _y(rhs._y), _z(rhs._z), _normsq(rhs._normsq), _norm(rhs._norm) {}
-    ~Position() {}
+    Position() : _x(0.), _y(0.), _z(0.) {}
     Position(double x, double y, double z) :
-        _x(x), _y(y), _z(z), _normsq(0.), _norm(0.) {}
-    Position<ThreeD>& operator=(const Position<ThreeD>& rhs)
-    {
-        _x = rhs._x; _y = rhs._y; _z = rhs._z;
-        _normsq = rhs._normsq; _norm = rhs._norm;
-        return *this;
-    }
+        _x(x), _y(y), _z(z) {}
 
     double getX() const { return _x; }
     double getY() const { return _y; }
     double getZ() const { return _z; }
     double get(int split) const { return split==2 ? _z : split==1 ? _y : _x; }
 
-    double normSq() const
-    {
-        if (_normsq == 0.) _normsq = _x*_x + _y*_y + _z*_z;
-        return _normsq;
-    }
-    double norm() const
-    {
-        if (_norm == 0.) _norm = sqrt(normSq());
-        return _norm;
-    }
+    double normSq() const { return getX()*getX() + getY()*getY() + getZ()*getZ(); }
+    double norm() const { return sqrt(normSq()); }
     void normalize() {}
 
     double dot(const Position<ThreeD>& p2) const
-    { return _x*p2._x + _y*p2._y + _z*p2._z; }
+    { return getX()*p2.getX() + getY()*p2.getY() + getZ()*p2.getZ(); }
     Position<ThreeD> cross(const Position<ThreeD>& p2) const
     {
-        return Position<ThreeD>(_y*p2._z - _z*p2._y,
-                                _z*p2._x - _x*p2._z,
-                                _x*p2._y - _y*p2._x);
+        return Position<ThreeD>(getY()*p2.getZ() - getZ()*p2.getY(),
+                                getZ()*p2.getX() - getX()*p2.getZ(),
+                                getX()*p2.getY() - getY()*p2.getX());
     }
 
     Position<ThreeD>& operator+=(const Position<ThreeD>& p2)
-    { _x += p2.getX(); _y += p2.getY(); _z += p2.getZ(); resetNorm(); return *this; }
+    { _x += p2.getX(); _y += p2.getY(); _z += p2.getZ(); return *this; }
     Position<ThreeD>& operator-=(const Position<ThreeD>& p2)
-    { _x -= p2.getX(); _y -= p2.getY(); _z -= p2.getZ(); resetNorm(); return *this; }
+    { _x -= p2.getX(); _y -= p2.getY(); _z -= p2.getZ(); return *this; }
     Position<ThreeD>& operator*=(double a)
-    { _x *= a; _y *= a; _z *= a; resetNorm(); return *this; }
+    { _x *= a; _y *= a; _z *= a; return *this; }
     Position<ThreeD>& operator/=(double a)
-    { _x /= a; _y /= a; _z /= a; resetNorm(); return *this; }
+    { _x /= a; _y /= a; _z /= a; return *this; }
 
     Position<ThreeD> operator+(const Position<ThreeD>& p2) const
     { Position<ThreeD> p1 = *this; p1 += p2; return p1; }
@@ -206,16 +187,12 @@ public:
     }
 
     void read(std::istream& fin)
-    { fin >> _x >> _y >> _z; resetNorm(); }
+    { fin >> _x >> _y >> _z; }
     void write(std::ostream& fout) const
     { fout << _x << " " << _y << " " << _z << " "; }
 
-protected:
-    void resetNorm() { _normsq = _norm = 0.; }
-
 private:
-    double _x,_y,_z;
-    mutable double _normsq, _norm;
+    PositionValue _x,_y,_z;
 
 }; // Position<ThreeD>
 
@@ -234,18 +211,14 @@ class Position<Sphere> : public Position<ThreeD>
 {
 public:
     Position() : Position<ThreeD>() {}
-    Position(const Position<Sphere>& rhs) : Position<ThreeD>(rhs) {}
     explicit Position(const Position<ThreeD>& rhs) : Position<ThreeD>(rhs) { normalize(); }
-    ~Position() {}
     Position(double x, double y, double z) : Position<ThreeD>(x,y,z) { normalize(); }
-    Position<Sphere>& operator=(const Position<Sphere>& rhs)
-    { Position<ThreeD>::operator=(rhs); return *this; }
 
     double normSq() const { return 1.; }
     double norm() const { return 1.; }
 
     // If appropriate, put the position back on the unit sphere.
-    void normalize() { *this /= Position<ThreeD>::norm(); resetNorm(); }
+    void normalize() { *this /= Position<ThreeD>::norm(); }
 
     Position<Sphere>& operator+=(const Position<Sphere>& p2)
     { Position<ThreeD>::operator+=(p2); return *this; }
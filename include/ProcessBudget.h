@@ -0,0 +1,126 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#ifndef TreeCorr_ProcessBudget_H
+#define TreeCorr_ProcessBudget_H
+
+#include <vector>
+#include <algorithm>
+
+#include "Cell.h"  // for urand
+#include "WallTime.h"
+
+// The limits for the progressive mode of BinnedCorr2::process and BinnedCorr3::process.
+// When either limit is set, the top-level work items are done in a random order, and no
+// new items are started once the limit is reached.  Since the items that get done are a
+// random subset of all of them, the partial results are an unbiased (if noisy) estimate
+// of the full ones.
+//
+// The limits are for everything that shares the array used, which is owned by the python
+// layer, so they cover a whole python process call (e.g. all the pairs of patches), not each
+// call into the C++ layer.  It is updated as the items are started:
+//     used[0] = The WallTime when the first item started (0 before that)
+//     used[1] = The number of pairs (or triples) in the items that were started
+//     used[2] = The number of items that were started
+//     used[3] = The number of items in all the process calls so far
+// So used[2] / used[3] is the fraction of the items that were done.
+//
+// The python layer can also cancel a process call that is running on another thread by
+// setting *cancel to a non-zero value.  Then no new items are started, so the call returns
+// soon after, with whatever partial results it had.
+struct ProcessBudget
+{
+    ProcessBudget() : max_time(0.), max_pairs(0.), used(0), cancel(0) {}
+
+    double max_time;    // The maximum wall clock time in seconds.  (0 means no limit.)
+    double max_pairs;   // The maximum number of pairs (or triples) to start.  (0 = no limit.)
+    double* used;       // If not null, the budget used so far.  (4 elements, as above.)
+    const volatile long* cancel;  // If not null, whether the call has been cancelled.
+
+    bool active() const { return max_time > 0. || max_pairs > 0.; }
+    bool cancelled() const { return cancel && *cancel; }
+};
+
+// For std::random_shuffle: return a random integer in [0,n).
+struct URandInt
+{
+    long operator()(long n) { return std::min(long(urand() * n), n-1); }
+};
+
+// Keeps track of how much of the budget has been used during a process call.
+// Without an array from the python layer, the budget is just for this call.
+class BudgetTracker
+{
+public:
+    BudgetTracker(const ProcessBudget& budget, long nitems) :
+        _budget(budget), _used(budget.used ? budget.used : _local), _nitems(nitems),
+        _stopped(false)
+    {
+        std::fill(_local, _local+4, 0.);
+        if (!_budget.active()) return;
+#ifdef _OPENMP
+#pragma omp critical (budget)
+#endif
+        {
+            if (_used[0] == 0.) _used[0] = WallTime();
+        }
+    }
+
+    // Call this before starting each item, which has approximately npairs pairs of objects.
+    // Returns false if the budget is used up, in which case the item should be skipped.
+    bool start(double npairs)
+    {
+        if (_budget.cancelled()) return false;
+        if (!_budget.active()) return true;
+        bool ok;
+#ifdef _OPENMP
+#pragma omp critical (budget)
+#endif
+        {
+            if (!_stopped &&
+                ((_budget.max_time > 0. && WallTime() - _used[0] > _budget.max_time) ||
+                 (_budget.max_pairs > 0. && _used[1] >= _budget.max_pairs))) {
+                _stopped = true;
+            }
+            if (!_stopped) {
+                _used[1] += npairs;
+                _used[2] += 1.;
+            }
+            ok = !_stopped;
+        }
+        return ok;
+    }
+
+    // Call this after all the items are finished to add them to the total.
+    void finish()
+    {
+#ifdef _OPENMP
+#pragma omp critical (budget)
+#endif
+        {
+            // Without a limit, start doesn't count them, since they all get done.
+            if (!_budget.active()) _used[2] += _nitems;
+            _used[3] += _nitems;
+        }
+    }
+
+private:
+    const ProcessBudget& _budget;
+    double _local[4];
+    double* _used;
+    long _nitems;
+    bool _stopped;
+};
+
+#endif
@@ -16,7 +16,9 @@
 #define TreeCorr_ProjectHelper_H
 
 // For the direct processing, we need a helper struct to handle some of the projections
-// we need to do to the shear values.
+// we need to do to the shear values.  The versions for pairs take the CellData rather than
+// the Cells, so they can also be used for objects that aren't in a Cell.  cf. processPairwise
+// in BinnedCorr2.cpp.
 template <int C>
 struct ProjectHelper;
 
@@ -25,23 +27,23 @@ struct ProjectHelper<Flat>
 {
     template <int DC1>
     static void ProjectShear(
-        const Cell<DC1,Flat>& c1, const Cell<GData,Flat>& c2, std::complex<double>& g2)
+        const CellData<DC1,Flat>& c1, const CellData<GData,Flat>& c2, std::complex<double>& g2)
     {
         // Project given shear to the line connecting them.
-        std::complex<double> cr(c2.getData().getPos() - c1.getData().getPos());
+        std::complex<double> cr(c2.getPos() - c1.getPos());
         std::complex<double> expm2iarg = conj(cr*cr)/std::norm(cr);
-        g2 = c2.getData().getWG() * expm2iarg;
+        g2 = c2.getWG() * expm2iarg;
     }
 
     static void ProjectShears(
-        const Cell<GData,Flat>& c1, const Cell<GData,Flat>& c2,
+        const CellData<GData,Flat>& c1, const CellData<GData,Flat>& c2,
         std::complex<double>& g1, std::complex<double>& g2)
     {
         // Project given shears to the line connecting them.
-        std::complex<double> cr(c2.getData().getPos() - c1.getData().getPos());
+        std::complex<double> cr(c2.getPos() - c1.getPos());
         std::complex<double> expm2iarg = conj(cr*cr)/std::norm(cr);
-        g1 = c1.getData().getWG() * expm2iarg;
-        g2 = c2.getData().getWG() * expm2iarg;
+        g1 = c1.getWG() * expm2iarg;
+        g2 = c2.getWG() * expm2iarg;
     }
 
     static void ProjectShears(
@@ -147,22 +149,22 @@ struct ProjectHelper<Sphere>
 
     template <int DC1>
     static void ProjectShear(
-        const Cell<DC1,Sphere>& c1, const Cell<GData,Sphere>& c2, std::complex<double>& g2)
+        const CellData<DC1,Sphere>& c1, const CellData<GData,Sphere>& c2, std::complex<double>& g2)
     {
-        const Position<Sphere>& p1 = c1.getData().getPos();
-        const Position<Sphere>& p2 = c2.getData().getPos();
-        g2 = c2.getData().getWG();
+        const Position<Sphere>& p1 = c1.getPos();
+        const Position<Sphere>& p2 = c2.getPos();
+        g2 = c2.getWG();
         ProjectShear2(p1,p2,g2);
     }
 
     static void ProjectShears(
-        const Cell<GData,Sphere>& c1, const Cell<GData,Sphere>& c2,
+        const CellData<GData,Sphere>& c1, const CellData<GData,Sphere>& c2,
         std::complex<double>& g1, std::complex<double>& g2)
     {
-        const Position<Sphere>& p1 = c1.getData().getPos();
-        const Position<Sphere>& p2 = c2.getData().getPos();
-        g1 = c1.getData().getWG();
-        g2 = c2.getData().getWG();
+        const Position<Sphere>& p1 = c1.getPos();
+        const Position<Sphere>& p2 = c2.getPos();
+        g1 = c1.getWG();
+        g2 = c2.getWG();
         ProjectShear2(p2,p1,g1);
         ProjectShear2(p1,p2,g2);
     }
@@ -192,26 +194,26 @@ struct ProjectHelper<ThreeD>
 {
     template <int DC1>
     static void ProjectShear(
-        const Cell<DC1,ThreeD>& c1, const Cell<GData,ThreeD>& c2, std::complex<double>& g2)
+        const CellData<DC1,ThreeD>& c1, const CellData<GData,ThreeD>& c2, std::complex<double>& g2)
     {
-        const Position<ThreeD>& p1 = c1.getData().getPos();
-        const Position<ThreeD>& p2 = c2.getData().getPos();
+        const Position<ThreeD>& p1 = c1.getPos();
+        const Position<ThreeD>& p2 = c2.getPos();
         Position<Sphere> sp1(p1);
         Position<Sphere> sp2(p2);
-        g2 = c2.getData().getWG();
+        g2 = c2.getWG();
         ProjectHelper<Sphere>::ProjectShear2(sp1,sp2,g2);
     }
 
     static void ProjectShears(
-        const Cell<GData,ThreeD>& c1, const Cell<GData,ThreeD>& c2,
+        const CellData<GData,ThreeD>& c1, const CellData<GData,ThreeD>& c2,
         std::complex<double>& g1, std::complex<double>& g2)
     {
-        const Position<ThreeD>& p1 = c1.getData().getPos();
-        const Position<ThreeD>& p2 = c2.getData().getPos();
+        const Position<ThreeD>& p1 = c1.getPos();
+        const Position<ThreeD>& p2 = c2.getPos();
         Position<Sphere> sp1(p1);
         Position<Sphere> sp2(p2);
-        g1 = c1.getData().getWG();
-        g2 = c2.getData().getWG();
+        g1 = c1.getWG();
+        g2 = c2.getWG();
         ProjectHelper<Sphere>::ProjectShear2(sp2,sp1,g1);
         ProjectHelper<Sphere>::ProjectShear2(sp1,sp2,g2);
     }
@@ -0,0 +1,31 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+// For both of these, the data rows are the lines of the file that are not blank or comments,
+// and the ones that are used are start, start+every_nth, ... up to (but not including) end.
+// end < 0 means to use all the rows to the end of the file.  delimiter = 0 means any
+// whitespace.  Anything after comment_marker on a line is ignored.
+
+// Return the number of rows that will be read, and set ncols to the number of columns in
+// the first data row.  Returns -1 if the file cannot be read.
+extern long CountAsciiRows(const char* file_name, const char* comment_marker, char delimiter,
+                           long start, long end, long every_nth, int* ncols);
+
+// Read the columns cols[0..ncol-1] (1-based) into out[0..ncol-1], each of which has room for
+// nrows values (as returned by CountAsciiRows).  Values that are missing or are not numbers
+// are set to NaN.  Returns the number of rows with such values, or -1 if the file cannot be
+// read or does not have nrows rows.
+extern long ReadAsciiColumns(const char* file_name, const char* comment_marker, char delimiter,
+                             long start, long end, long every_nth,
+                             int ncol, const int* cols, double** out, long nrows);
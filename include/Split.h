@@ -81,15 +81,17 @@ inline void CalcSplit(
 
 inline void CalcSplitSq(
     bool& split1, bool& split2,
-    const double s1, const double s2, const double s1ps2, const double bsq)
+    const double s1, const double s2, const double s1ps2, const double bsq,
+    const double splitfactorsq=0.3422)
 {
     // The same as above, but when we know the distance squared rather
     // than just the distance.  We get some speed up by saving the
     // square roots in some parts of the code.
-    const double splitfactorsq = 0.3422;
+    // The default splitfactorsq is 0.585^2.  BinnedCorr2 passes its own value, which can be
+    // changed with the split_factor option (e.g. by the autotune mode).
     if (split1 && split2) return;
     if (s2 > s1) {
-        CalcSplitSq(split2,split1,s2,s1,s1ps2,bsq);
+        CalcSplitSq(split2,split1,s2,s1,s1ps2,bsq,splitfactorsq);
     } else if (s1 > 2.*s2) {
         // If one cell is more than 2x the size of the other, only split that one.
         split1 = true;
@@ -0,0 +1,58 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#ifndef TreeCorr_ThreadBudget_H
+#define TreeCorr_ThreadBudget_H
+
+// Several library calls may run at the same time from different python threads, e.g. building
+// the fields for the next pair of patches while the current pair is being processed.  Each
+// of these would normally start as many OpenMP threads as there are cores, so together they
+// would oversubscribe the machine.
+//
+// Instead, the total number of threads (from SetOMPThreads) is a budget that the calls share.
+// Each call is in one of the phases below, and each phase may be capped at some number of
+// threads, so e.g. building the fields can be limited to a few threads while the rest are left
+// for processing.  When a call starts, it gets as many threads as are free, up to the cap for
+// its phase.  If none are free, it waits until some other call finishes.
+enum ThreadPhase { BuildPhase=0, ProcessPhase=1, NThreadPhases=2 };
+
+void SetThreadBudget(int nthreads);
+int GetThreadBudget();
+// n <= 0 means no cap other than the total.
+void SetPhaseThreads(int phase, int n);
+int GetPhaseThreads(int phase);
+
+// Take some threads from the budget for the duration of a call.  While this exists, the
+// OpenMP parallel regions on the calling thread use the number of threads it got.
+// Nested ones (e.g. building the cells of a lazy field while processing) just use the
+// threads that the outer one already has.
+class PhaseThreads
+{
+public:
+    explicit PhaseThreads(int phase);
+    ~PhaseThreads();
+
+    int get() const { return _n; }
+
+private:
+    PhaseThreads(const PhaseThreads&);
+    void operator=(const PhaseThreads&);
+
+    int _phase;
+    int _n;
+    int _old;
+    bool _owner;
+};
+
+#endif
@@ -0,0 +1,66 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#ifndef TreeCorr_ThreadReduce_H
+#define TreeCorr_ThreadReduce_H
+
+#include <vector>
+
+#include "Trace.h"
+
+#ifdef _OPENMP
+#include "omp.h"
+#endif
+
+// Helpers for the per-thread accumulators used by BinnedCorr2 and BinnedCorr3 when
+// processing in parallel.  T is the correlation class, which needs a constructor
+// T(const T& rhs, bool copy_data), clear(), and operator+=.
+
+// Make sure there are at least n accumulators, each a zeroed copy of proto.
+// The accumulators are kept from one process call to the next, so we don't need to
+// reallocate them (which can be quite large) each time.
+template <typename T>
+void GetThreadAccumulators(std::vector<T*>& accums, const T& proto, int n)
+{
+    accums.reserve(n);
+    while (int(accums.size()) < n) accums.push_back(new T(proto, false));
+}
+
+template <typename T>
+void DeleteThreadAccumulators(std::vector<T*>& accums)
+{
+    for (size_t i=0; i<accums.size(); ++i) delete accums[i];
+    accums.clear();
+}
+
+#ifdef _OPENMP
+// Add up accums[0..nthreads) into accums[0], where nthreads is the number of threads in the
+// current parallel region.  All threads must call this.  Rather than having each thread add
+// its results to the total one at a time in a critical section, this adds them in pairs,
+// so it only takes log2(nthreads) steps, with all the adds in each step running in parallel.
+template <typename T>
+void TreeReduce(const std::vector<T*>& accums)
+{
+    TraceScope trace("reduce");
+    const int nthreads = omp_get_num_threads();
+    const int tid = omp_get_thread_num();
+    for (int step=1; step<nthreads; step*=2) {
+#pragma omp barrier
+        if (tid % (2*step) == 0 && tid + step < nthreads)
+            *accums[tid] += *accums[tid+step];
+    }
+}
+#endif
+
+#endif
@@ -0,0 +1,143 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#ifndef TreeCorr_TopCellGrid_H
+#define TreeCorr_TopCellGrid_H
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "Cell.h"
+#include "Metric.h"
+
+// The cross-correlations used to check every pair of top-level cells, most of which are
+// usually too far apart to matter when max_sep is small compared to the size of the fields.
+// TopCellGrid puts the top-level cells of one field into a coarse grid of their centers, so
+// we can find the ones near a given cell without checking all of them.
+//
+// The grid uses the 2-d or 3-d Euclidean distance between the positions, so it can only be
+// used for metrics where the distance is never less than that.  For Rperp and Rlens, two
+// points can be very far apart in 3-d and still have a small separation, and for Periodic,
+// the distance wraps around, so those metrics still check all the pairs.
+template <int M, int C>
+struct UseTopCellGrid
+{ enum { value = (M == Euclidean) || (M == Arc && C == Sphere) }; };
+
+inline double GridZ(const Position<Flat>& p) { return 0.; }
+inline double GridZ(const Position<ThreeD>& p) { return p.getZ(); }
+
+template <int C>
+inline double GridDistSq(const Position<C>& p1, const Position<C>& p2)
+{
+    const double dx = p1.getX() - p2.getX();
+    const double dy = p1.getY() - p2.getY();
+    const double dz = GridZ(p1) - GridZ(p2);
+    return dx*dx + dy*dy + dz*dz;
+}
+
+template <int D, int C>
+class TopCellGrid
+{
+public:
+    // The width of the grid cells is at least minwidth.  They may be larger if there would
+    // otherwise be many more grid cells than top-level cells.
+    TopCellGrid(const std::vector<Cell<D,C>*>& cells, double minwidth) :
+        _cells(cells), _maxsize(0.)
+    {
+        const long n = cells.size();
+        Assert(n > 0);
+        double xmax, ymax, zmax;
+        _xmin = xmax = cells[0]->getPos().getX();
+        _ymin = ymax = cells[0]->getPos().getY();
+        _zmin = zmax = GridZ(cells[0]->getPos());
+        for (long i=0; i<n; ++i) {
+            const Position<C>& p = cells[i]->getPos();
+            _xmin = std::min(_xmin, p.getX());
+            _ymin = std::min(_ymin, p.getY());
+            _zmin = std::min(_zmin, GridZ(p));
+            xmax = std::max(xmax, p.getX());
+            ymax = std::max(ymax, p.getY());
+            zmax = std::max(zmax, GridZ(p));
+            _maxsize = std::max(_maxsize, cells[i]->getSize());
+        }
+
+        // Don't make more than about 4 grid cells per top-level cell.
+        _width = std::max(minwidth, 1.e-10 * (xmax-_xmin + ymax-_ymin + zmax-_zmin + 1.));
+        for (;;) {
+            _nx = long((xmax-_xmin) / _width) + 1;
+            _ny = long((ymax-_ymin) / _width) + 1;
+            _nz = long((zmax-_zmin) / _width) + 1;
+            if (double(_nx) * double(_ny) * double(_nz) <= 4. * n + 64.) break;
+            _width *= 1.5;
+        }
+        dbg<<"TopCellGrid: "<<n<<" cells in "<<_nx<<" x "<<_ny<<" x "<<_nz<<" grid\n";
+
+        // Sort the cells by their grid cell, and record where each grid cell starts.
+        std::vector<long> bin(n);
+        _start.assign(_nx*_ny*_nz + 1, 0);
+        for (long i=0; i<n; ++i) {
+            const Position<C>& p = cells[i]->getPos();
+            bin[i] = index(ix(p.getX()), iy(p.getY()), iz(GridZ(p)));
+            ++_start[bin[i]+1];
+        }
+        for (size_t k=1; k<_start.size(); ++k) _start[k] += _start[k-1];
+        std::vector<long> next(_start.begin(), _start.end()-1);
+        _index.resize(n);
+        for (long i=0; i<n; ++i) _index[next[bin[i]]++] = i;
+    }
+
+    // Get the indices of the cells with dist(pos, cell) < r + sfactor * cell.size.
+    // They are returned in increasing order.
+    void getNear(const Position<C>& pos, double r, double sfactor, std::vector<long>& near) const
+    {
+        near.clear();
+        const double rmax = r + sfactor * _maxsize;
+        const double x = pos.getX();
+        const double y = pos.getY();
+        const double z = GridZ(pos);
+        const long i1 = ix(x-rmax), i2 = ix(x+rmax);
+        const long j1 = iy(y-rmax), j2 = iy(y+rmax);
+        const long k1 = iz(z-rmax), k2 = iz(z+rmax);
+        for (long i=i1; i<=i2; ++i) for (long j=j1; j<=j2; ++j) for (long k=k1; k<=k2; ++k) {
+            const long b = index(i,j,k);
+            for (long n=_start[b]; n<_start[b+1]; ++n) {
+                const Cell<D,C>& c = *_cells[_index[n]];
+                if (GridDistSq(pos, c.getPos()) < SQR(r + sfactor * c.getSize()))
+                    near.push_back(_index[n]);
+            }
+        }
+        std::sort(near.begin(), near.end());
+    }
+
+    double getMaxSize() const { return _maxsize; }
+
+private:
+    long clip(double u, long nu) const
+    { return u <= 0. ? 0 : u >= nu ? nu-1 : long(u); }
+    long ix(double x) const { return clip((x-_xmin) / _width, _nx); }
+    long iy(double y) const { return clip((y-_ymin) / _width, _ny); }
+    long iz(double z) const { return clip((z-_zmin) / _width, _nz); }
+    long index(long i, long j, long k) const { return (i*_ny + j)*_nz + k; }
+
+    const std::vector<Cell<D,C>*>& _cells;
+    double _xmin, _ymin, _zmin;
+    double _width;
+    double _maxsize;
+    long _nx, _ny, _nz;
+    std::vector<long> _start;   // The cells in grid cell b are _index[_start[b]:_start[b+1]]
+    std::vector<long> _index;
+};
+
+#endif
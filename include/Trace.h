@@ -0,0 +1,66 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#ifndef TreeCorr_Trace_H
+#define TreeCorr_Trace_H
+
+// A tracer of what each thread is doing when, for finding stragglers and serial sections in
+// big runs.  Unlike the dbg output, this is compiled into the release build.  It is off until
+// StartTrace is called, and then each TraceScope records an event with its name, an integer
+// argument (e.g. the index of the top-level item), and its start and end times in nanoseconds.
+// The events go in a fixed size ring buffer for each thread, so recording one just reads the
+// clock twice, and when tracing is off, it is just a check of a flag.
+//
+// WriteTrace writes the events in the Chrome trace JSON format, which can be viewed with
+// chrome://tracing or https://ui.perfetto.dev.
+
+extern volatile bool trace_on;
+
+// The time in nanoseconds.  This is the wall clock time, so the traces from different
+// machines can be lined up.
+long long TraceNow();
+
+// nevents is the size of the ring buffer for each thread.  When it is full, the oldest events
+// are overwritten.  Starting again drops the previous events.
+void StartTrace(long nevents);
+void StopTrace();
+
+// name must stay valid until the trace is written (e.g. a string literal).
+void TraceRecord(const char* name, long arg, long long start, long long end);
+
+// Like TraceRecord, but name is copied, so it can be a temporary string.
+void TraceRecordCopy(const char* name, long arg, long long start, long long end);
+
+// The events are written in order of their start times.  Returns false if the file can't be
+// opened.  This should be called after the traced calls are finished, since it doesn't stop
+// other threads from adding more events while it runs.
+bool WriteTrace(const char* file_name);
+
+class TraceScope
+{
+public:
+    explicit TraceScope(const char* name, long arg=-1) :
+        _name(name), _arg(arg), _start(trace_on ? TraceNow() : -1) {}
+    ~TraceScope() { if (_start >= 0) TraceRecord(_name, _arg, _start, TraceNow()); }
+
+private:
+    TraceScope(const TraceScope&);
+    void operator=(const TraceScope&);
+
+    const char* _name;
+    long _arg;
+    long long _start;
+};
+
+#endif
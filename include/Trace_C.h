@@ -0,0 +1,25 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+// Tracing of the library calls.  See Trace.h.
+
+// Start recording with a ring buffer of nevents for each thread.  nevents = 0 stops.
+extern void SetTrace(long nevents);
+// Write the events in the Chrome trace JSON format.  Returns 0 if the file can't be opened.
+extern int WriteTraceFile(const char* file_name);
+
+// For recording events from python: the current time in nanoseconds, and an event from
+// start until now.
+extern long long GetTraceTime();
+extern void AddTraceEvent(const char* name, long arg, long long start);
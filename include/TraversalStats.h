@@ -0,0 +1,94 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#ifndef TreeCorr_TraversalStats_H
+#define TreeCorr_TraversalStats_H
+
+#include <algorithm>
+
+// Counters of what happened during the tree traversal in BinnedCorr2::process and
+// BinnedCorr3::process, which are useful for tuning bin_slop, min_top and max_top, and for
+// spotting load imbalance between the threads.  Each per-thread accumulator has its own,
+// so counting is just an increment with no synchronization.
+//
+// The times only include the work done directly in the top-level items, not any parts of
+// them that were split off into tasks.  MAX_THREAD_TIME / (ITEM_TIME / NTHREADS) is then
+// a measure of the load imbalance, which is 1 if the work was evenly spread.
+//
+// The order of the values here needs to match _stats_names in binnedcorr2.py.
+struct TraversalStats
+{
+    enum Stat {
+        NODES,          // The number of calls to process11, process2 (or process111, etc.)
+        SPLIT1,         // The number of times only c1 was split.
+        SPLIT2,         // The number of times only c2 was split.
+        SPLIT3,         // The number of times only c3 was split.  (3pt only)
+        SPLIT_MULTI,    // The number of times more than one cell was split.
+        RPAR_EXIT,      // The number of early exits from rpar being out of range.
+        SMALL_EXIT,     // The number of early exits from the separation being too small.
+        LARGE_EXIT,     // The number of early exits from the separation being too large.
+        RANGE_EXIT,     // For 3pt, the number of exits from d2, u or v being out of range.
+        SINGLE_BIN,     // The number of times a pair of cells dropped into a single bin.
+        DIRECT,         // The number of pairs (or triples) of cells added to the bins.
+        LEAF_PAIRS,     // The number of pairs of leaves checked directly in processLeaves.
+        NITEMS,         // The number of top-level work items.
+        ITEM_TIME,      // The total time (in seconds) spent on the top-level items.
+        MAX_ITEM_TIME,  // The longest time spent on a single top-level item.
+        MAX_THREAD_TIME,// The time the busiest thread spent on items, summed over process calls.
+        TASKS,          // The number of OpenMP tasks that big pairs of cells were split into.
+        NTHREADS,       // The number of threads that were used.
+        NSTATS
+    };
+
+    TraversalStats() { clear(); }
+
+    void clear() { for (int i=0; i<NSTATS; ++i) v[i] = 0.; }
+
+    double& operator[](int i) { return v[i]; }
+    double operator[](int i) const { return v[i]; }
+
+    // Record that a top-level item was finished, which took dt seconds.
+    void finishItem(double dt)
+    {
+        v[NITEMS] += 1.;
+        v[ITEM_TIME] += dt;
+        v[MAX_ITEM_TIME] = std::max(v[MAX_ITEM_TIME], dt);
+    }
+
+    // Combine the stats from two threads in the same process call.
+    void operator+=(const TraversalStats& rhs)
+    {
+        const double max_item = std::max(v[MAX_ITEM_TIME], rhs.v[MAX_ITEM_TIME]);
+        const double max_thread = std::max(v[MAX_THREAD_TIME], rhs.v[MAX_THREAD_TIME]);
+        for (int i=0; i<NSTATS; ++i) v[i] += rhs.v[i];
+        v[MAX_ITEM_TIME] = max_item;
+        v[MAX_THREAD_TIME] = max_thread;
+    }
+
+    // Add the stats from a completed process call to the running totals in out, which is
+    // the array owned by the python layer.  Here MAX_THREAD_TIME is summed, since the busiest
+    // thread in each call sets how long that call takes.
+    void addTo(double* out) const
+    {
+        const double max_item = std::max(out[MAX_ITEM_TIME], v[MAX_ITEM_TIME]);
+        const double nthreads = std::max(out[NTHREADS], v[NTHREADS]);
+        for (int i=0; i<NSTATS; ++i) out[i] += v[i];
+        out[MAX_ITEM_TIME] = max_item;
+        out[NTHREADS] = nthreads;
+    }
+
+    double v[NSTATS];
+};
+
+#endif
@@ -0,0 +1,36 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#ifndef TreeCorr_WallTime_H
+#define TreeCorr_WallTime_H
+
+#include <sys/time.h>
+
+#ifdef _OPENMP
+#include "omp.h"
+#endif
+
+// The wall clock time in seconds.
+inline double WallTime()
+{
+#ifdef _OPENMP
+    return omp_get_wtime();
+#else
+    struct timeval tp;
+    gettimeofday(&tp,NULL);
+    return tp.tv_sec + 1.e-6 * tp.tv_usec;
+#endif
+}
+
+#endif
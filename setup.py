@@ -521,8 +521,21 @@ def fix_compiler(compiler):
 # In particular, we want to use different compiler options for OpenMP in each case.
 # cf. http://stackoverflow.com/questions/724664/python-distutils-how-to-get-a-compiler-that-is-going-to-be-used
 class my_builder( build_ext ):
+    user_options = build_ext.user_options + [
+        ('bench', None, "also build the C++ benchmarks in devel/bench_kernels.cpp"),
+        ('float-positions', None, "store the positions in the trees in single precision")]
+    boolean_options = build_ext.boolean_options + ['bench', 'float-positions']
+
+    def initialize_options(self):
+        build_ext.initialize_options(self)
+        self.bench = False
+        self.float_positions = False
+
     def build_extensions(self):
         cflags, lflags = fix_compiler(self.compiler)
+        if self.float_positions:
+            # cf. PositionValue in include/Position.h
+            cflags = cflags + ['-DTREECORR_FLOAT_POSITIONS']
 
         # Add the appropriate extra flags for that compiler.
         for e in self.extensions:
@@ -534,6 +547,22 @@ class my_builder( build_ext ):
         # Now run the normal build function.
         build_ext.build_extensions(self)
 
+        if self.bench:
+            self.build_bench(self.extensions[0])
+
+    def build_bench(self, ext):
+        # Link the benchmark program with the same object files as the extension.
+        objects = self.compiler.object_filenames(ext.sources, output_dir=self.build_temp)
+        objects += self.compiler.compile([os.path.join('devel','bench_kernels.cpp')],
+                                         output_dir=self.build_temp,
+                                         include_dirs=ext.include_dirs,
+                                         extra_postargs=ext.extra_compile_args)
+        self.compiler.link_executable(objects, 'bench_kernels', output_dir='build',
+                                      libraries=ext.libraries,
+                                      extra_postargs=ext.extra_link_args,
+                                      target_lang='c++')
+        print('Built the benchmarks in', os.path.join('build','bench_kernels'))
+
 # AFAICT, setuptools doesn't provide any easy access to the final installation location of the
 # executable scripts.  This bit is just to save the value of script_dir so I can use it later.
 # cf. http://stackoverflow.com/questions/12975540/correct-way-to-find-scripts-directory-from-setup-py-in-python-distutils/
@@ -554,9 +583,13 @@ class my_install_scripts( install_scripts ):  # For distutils
         install_scripts.run(self)
         self.distribution.script_install_dir = self.install_dir
 
+# shm_open is in librt with older versions of glibc.
+libraries = ['rt'] if sys.platform.startswith('linux') else []
+
 ext=Extension("treecorr._treecorr",
               sources,
               depends=headers,
+              libraries=libraries,
               undef_macros = undef_macros)
 
 dependencies = ['numpy', 'cffi', 'pyyaml', 'LSSTDESC.Coord>=1.1']
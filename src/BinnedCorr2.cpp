@@ -19,12 +19,22 @@
 #include <vector>
 #include <set>
 #include <map>
+#include <queue>
+#include <functional>
+#include <algorithm>
 
 #include "dbg.h"
 #include "BinnedCorr2.h"
 #include "Split.h"
 #include "ProjectHelper.h"
 #include "Metric.h"
+#include "ThreadReduce.h"
+#include "TopCellGrid.h"
+#include "PatchLabels.h"
+#include "PeriodicImages.h"
+#include "NumaDomains.h"
+#include "ThreadBudget.h"
+#include "Trace.h"
 
 #ifdef _OPENMP
 #include "omp.h"
@@ -36,13 +46,18 @@
 
 template <int D1, int D2, int B>
 BinnedCorr2<D1,D2,B>::BinnedCorr2(
-    double minsep, double maxsep, int nbins, double binsize, double b,
+    double minsep, double maxsep, int nbins, double binsize, double b, int leaf_size,
     double minrpar, double maxrpar, double xp, double yp, double zp,
     double* xi0, double* xi1, double* xi2, double* xi3,
     double* meanr, double* meanlogr, double* weight, double* npairs) :
     _minsep(minsep), _maxsep(maxsep), _nbins(nbins), _binsize(binsize), _b(b),
+    _leaf_size(leaf_size),
     _minrpar(minrpar), _maxrpar(maxrpar), _xp(xp), _yp(yp), _zp(zp),
-    _coords(-1), _owns_data(false),
+    _coords(-1), _skip_meanlogr(false), _splitfactorsq(0.3422), _unit_weights(false),
+    _chord(false), _chord_corr(0), _recording(false),
+    _thread_corrs(0), _task_min(0.), _stats_out(0), _rank(0), _nranks(1),
+    _tagged_npatch2(0), _tagged_auto(false), _owns_data(false),
+    _bins(0), _buffer(0), _leaf_buffer(0),
     _xi(xi0,xi1,xi2,xi3), _meanr(meanr), _meanlogr(meanlogr), _weight(weight), _npairs(npairs)
 {
     dbg<<"BinnedCorr2 constructor\n";
@@ -58,6 +73,7 @@ BinnedCorr2<D1,D2,B>::BinnedCorr2(
     dbg<<"nbins = "<<_nbins<<std::endl;
     dbg<<"binsize = "<<_binsize<<std::endl;
     dbg<<"b = "<<_b<<std::endl;
+    dbg<<"leaf_size = "<<_leaf_size<<std::endl;
     dbg<<"minrpar, maxrpar = "<<_minrpar<<"  "<<_maxrpar<<std::endl;
     dbg<<"period = "<<_xp<<"  "<<_yp<<"  "<<_zp<<std::endl;
 }
@@ -65,21 +81,24 @@ BinnedCorr2<D1,D2,B>::BinnedCorr2(
 template <int D1, int D2, int B>
 BinnedCorr2<D1,D2,B>::BinnedCorr2(const BinnedCorr2<D1,D2,B>& rhs, bool copy_data) :
     _minsep(rhs._minsep), _maxsep(rhs._maxsep), _nbins(rhs._nbins),
-    _binsize(rhs._binsize), _b(rhs._b),
+    _binsize(rhs._binsize), _b(rhs._b), _leaf_size(rhs._leaf_size),
     _minrpar(rhs._minrpar), _maxrpar(rhs._maxrpar),
     _xp(rhs._xp), _yp(rhs._yp), _zp(rhs._zp),
     _logminsep(rhs._logminsep), _halfminsep(rhs._halfminsep),
     _minsepsq(rhs._minsepsq), _maxsepsq(rhs._maxsepsq), _bsq(rhs._bsq),
     _fullmaxsep(rhs._fullmaxsep), _fullmaxsepsq(rhs._fullmaxsepsq),
-    _coords(rhs._coords), _owns_data(true),
-    _xi(0,0,0,0), _weight(0)
+    _coords(rhs._coords), _logbins(rhs._logbins), _skip_meanlogr(rhs._skip_meanlogr),
+    _splitfactorsq(rhs._splitfactorsq), _unit_weights(rhs._unit_weights),
+    _chord(rhs._chord), _chord_corr(0), _recording(false),
+    _thread_corrs(0), _task_min(0.), _stats_out(0), _rank(0), _nranks(1),
+    _tagged_npatch2(0), _tagged_auto(false), _owns_data(true),
+    _xi(0,0,0,0), _meanr(0), _meanlogr(0), _weight(0), _npairs(0)
 {
     dbg<<"BinnedCorr2 copy constructor\n";
-    _xi.new_data(_nbins);
-    _meanr = new double[_nbins];
-    _meanlogr = new double[_nbins];
-    _weight = new double[_nbins];
-    _npairs = new double[_nbins];
+    // A TwoD grid is only allocated where the pairs land.  cf. PairBins.
+    _bins = new PairBins(_nbins, B == TwoD);
+    _buffer = new PairBuffer();
+    _leaf_buffer = new LeafBuffer();
 
     if (copy_data) *this = rhs;
     else clear();
@@ -89,21 +108,140 @@ template <int D1, int D2, int B>
 BinnedCorr2<D1,D2,B>::~BinnedCorr2()
 {
     dbg<<"BinnedCorr2 destructor\n";
+    DeleteThreadAccumulators(_thread_accums);
+    for (size_t i=0; i<_tagged_pool.size(); ++i) delete _tagged_pool[i];
+    delete _chord_corr; _chord_corr = 0;
     if (_owns_data) {
-        _xi.delete_data(_nbins);
-        delete [] _meanr; _meanr = 0;
-        delete [] _meanlogr; _meanlogr = 0;
-        delete [] _weight; _weight = 0;
-        delete [] _npairs; _npairs = 0;
+        delete _bins; _bins = 0;
+        delete _buffer; _buffer = 0;
+        delete _leaf_buffer; _leaf_buffer = 0;
     }
 }
 
+template <int D1, int D2, int B>
+size_t BinnedCorr2<D1,D2,B>::getNBytes() const
+{
+    size_t n = sizeof(*this);
+    if (_owns_data) {
+        n += _bins->getNBytes() + sizeof(PairBuffer) + sizeof(LeafBuffer);
+        const LeafBuffer& lb = *_leaf_buffer;
+        n += (lb.leaves1.capacity() + lb.leaves2.capacity()) * sizeof(const void*);
+        n += (lb.pos2.capacity() + lb.rsq.capacity()) * sizeof(double) + lb.ok.capacity();
+    }
+    n += _logbins.getNBytes();
+    n += _recorded.capacity() * sizeof(RecordedPair);
+    n += _thread_accums.capacity() * sizeof(BinnedCorr2<D1,D2,B>*);
+    for (size_t i=0; i<_thread_accums.size(); ++i) n += _thread_accums[i]->getNBytes();
+    if (_chord_corr) n += _chord_corr->getNBytes();
+    return n;
+}
+
+template <int D1, int D2, int B>
+size_t BinnedCorr2<D1,D2,B>::getThreadNBytes(int nbins)
+{
+    // cf. the copy constructor.  This is the most it can be, since for TwoD, the
+    // accumulators may only use some of the bins.
+    return sizeof(BinnedCorr2<D1,D2,B>) + nbins * sizeof(PairBin) + 64 + sizeof(PairBuffer) +
+        sizeof(LeafBuffer);
+}
+
+template <int D1, int D2, int B>
+void BinnedCorr2<D1,D2,B>::setBinOptions(bool fast_bins, bool skip_meanlogr)
+{
+    dbg<<"setBinOptions: "<<fast_bins<<"  "<<skip_meanlogr<<std::endl;
+    _logbins = LogBinTable();
+    if (fast_bins && B == Log) _logbins.setup(_minsep, _maxsep, _nbins, _binsize, _b);
+    _skip_meanlogr = skip_meanlogr;
+    // The accumulators have copies of these, so make new ones for the next process call.
+    DeleteThreadAccumulators(_thread_accums);
+    delete _chord_corr; _chord_corr = 0;
+}
+
+template <int D1, int D2, int B>
+void BinnedCorr2<D1,D2,B>::setSplitFactor(double split_factor)
+{
+    dbg<<"setSplitFactor: "<<split_factor<<std::endl;
+    _splitfactorsq = split_factor * split_factor;
+    DeleteThreadAccumulators(_thread_accums);
+    delete _chord_corr; _chord_corr = 0;
+}
+
+template <int D1, int D2, int B>
+void BinnedCorr2<D1,D2,B>::setUnitWeights(bool unit_weights)
+{
+    dbg<<"setUnitWeights: "<<unit_weights<<std::endl;
+    if (unit_weights == _unit_weights) return;
+    _unit_weights = unit_weights;
+    DeleteThreadAccumulators(_thread_accums);
+    delete _chord_corr; _chord_corr = 0;
+}
+
+template <int D1, int D2, int B>
+void BinnedCorr2<D1,D2,B>::setMaxSep(double maxsep)
+{
+    dbg<<"setMaxSep: "<<maxsep<<std::endl;
+    if (maxsep == _maxsep) return;
+    _maxsep = maxsep;
+    _maxsepsq = _maxsep*_maxsep;
+    _fullmaxsep = BinTypeHelper<B>::calculateFullMaxSep(_minsep, _maxsep, _nbins, _binsize);
+    _fullmaxsepsq = _fullmaxsep*_fullmaxsep;
+    // The LogBinTable is still fine as is, since the range check uses _maxsepsq.
+    DeleteThreadAccumulators(_thread_accums);
+    delete _chord_corr; _chord_corr = 0;
+}
+
+template <int D1, int D2, int B>
+BinnedCorr2<D1,D2,B>* BinnedCorr2<D1,D2,B>::getChordCorr()
+{
+    if (!_chord_corr) {
+        // The chord distance L = 2 sin(theta/2) is only monotonic in theta for theta < pi,
+        // including the bin_slop margin at the top of the last bin.
+        if (B != Log || !_logbins.active() || _chord) return 0;
+        if (_maxsep * std::exp(_binsize + _b) >= M_PI) return 0;
+        dbg<<"Make chord-space copy for Arc metric\n";
+        BinnedCorr2<D1,D2,B>* c = new BinnedCorr2<D1,D2,B>(
+            _minsep, _maxsep, _nbins, _binsize, _b, _leaf_size,
+            _minrpar, _maxrpar, _xp, _yp, _zp,
+            0, 0, 0, 0, _meanr, _meanlogr, _weight, _npairs);
+        c->_xi = _xi;
+        c->_chord = true;
+        c->_skip_meanlogr = _skip_meanlogr;
+        c->_splitfactorsq = _splitfactorsq;
+        c->_unit_weights = _unit_weights;
+        c->_logbins.setup(_minsep, _maxsep, _nbins, _binsize, _b, true);
+        // Use the same edges as the table, so the range of pairs is exactly the same as
+        // for the angles.
+        c->_minsepsq = c->_logbins.getMinSepSq();
+        c->_maxsepsq = c->_logbins.getMaxSepSq();
+        c->_minsep = std::sqrt(c->_minsepsq);
+        c->_maxsep = std::sqrt(c->_maxsepsq);
+        c->_logminsep = std::log(c->_minsep);
+        c->_halfminsep = 0.5 * c->_minsep;
+        c->_fullmaxsep = c->_maxsep;
+        c->_fullmaxsepsq = c->_maxsepsq;
+        _chord_corr = c;
+    }
+    // These may have changed since the copy was made.
+    _chord_corr->_budget = _budget;
+    _chord_corr->_stats_out = _stats_out;
+    _chord_corr->_checkpoint = _checkpoint;
+    _chord_corr->_rank = _rank;
+    _chord_corr->_nranks = _nranks;
+    _chord_corr->_coords = _coords;
+    _chord_corr->_recording = _recording;
+    return _chord_corr;
+}
+
 // BinnedCorr2::process2 is invalid if D1 != D2, so this helper struct lets us only call
-// process2 when D1 == D2.
+// process2 when D1 == D2.  Likewise for the auto-correlation version of process.
 template <int D1, int D2, int B, int C, int M>
 struct ProcessHelper
 {
     static void process2(BinnedCorr2<D1,D2,B>& , const Cell<D1,C>&, const MetricHelper<M>& ) {}
+    static void processAuto(BinnedCorr2<D1,D2,B>& , const Field<D1,C>&, bool)
+    { Assert(false); }
+    static void taggedProcess2(BinnedCorr2<D1,D2,B>& , const Cell<D1,C>&, const MetricHelper<M>&,
+                               const PatchLabels<D1,C>& ) {}
 };
 
 template <int D, int B, int C, int M>
@@ -111,71 +249,204 @@ struct ProcessHelper<D,D,B,C,M>
 {
     static void process2(BinnedCorr2<D,D,B>& b, const Cell<D,C>& c12, const MetricHelper<M>& m)
     { b.template process2<C,M>(c12, m); }
+    static void processAuto(BinnedCorr2<D,D,B>& b, const Field<D,C>& field, bool dots)
+    { b.template process<C,M>(field, dots); }
+    static void taggedProcess2(BinnedCorr2<D,D,B>& b, const Cell<D,C>& c12,
+                               const MetricHelper<M>& m, const PatchLabels<D,C>& labels)
+    { b.template taggedProcess2<C,M>(c12, m, labels); }
 };
 
 template <int D1, int D2, int B>
 void BinnedCorr2<D1,D2,B>::clear()
 {
-    _xi.clear(_nbins);
-    for (int i=0; i<_nbins; ++i) _meanr[i] = 0.;
-    for (int i=0; i<_nbins; ++i) _meanlogr[i] = 0.;
-    for (int i=0; i<_nbins; ++i) _weight[i] = 0.;
-    for (int i=0; i<_nbins; ++i) _npairs[i] = 0.;
+    if (_bins) {
+        _bins->clear();
+        _buffer->n = 0;
+    } else {
+        _xi.clear(_nbins);
+        for (int i=0; i<_nbins; ++i) _meanr[i] = 0.;
+        for (int i=0; i<_nbins; ++i) _meanlogr[i] = 0.;
+        for (int i=0; i<_nbins; ++i) _weight[i] = 0.;
+        for (int i=0; i<_nbins; ++i) _npairs[i] = 0.;
+    }
+    _stats.clear();
     _coords = -1;
 }
 
+// A rough estimate of the cost of processing a pair of cells, which have n1n2 pairs of
+// objects and whose sizes add up to s1ps2.  Only the pairs that are closer than maxsep need
+// to be done in any detail, which is roughly a fraction (maxsep/s1ps2)^2 of them.
+inline double PairCost(double n1n2, double s1ps2, double maxsep)
+{ return s1ps2 > maxsep ? n1n2 * SQR(maxsep / s1ps2) : n1n2; }
+
+// Don't bother splitting pairs into tasks if they have fewer than this many pairs to do.
+const double TASK_MIN_COST = 1.e6;
+
+// Order the indices of items by decreasing cost, for PartitionItems.
+struct ItemCostOrder
+{
+    ItemCostOrder(const std::vector<WorkItem>& items) : _items(items) {}
+    bool operator()(long a, long b) const { return _items[a] < _items[b]; }
+    const std::vector<WorkItem>& _items;
+};
+
+// When the work is split over nranks processes, keep only the items that belong to rank.
+// Every process makes the same list of items, so they can all do the same greedy assignment
+// without any communication: each item, most expensive first, goes to whichever rank has the
+// least total cost so far.  The items that are kept stay in their original order.
+void PartitionItems(std::vector<WorkItem>& items, int rank, int nranks)
+{
+    if (nranks <= 1) return;
+    const long nitems = items.size();
+    std::vector<long> order(nitems);
+    for (long n=0; n<nitems; ++n) order[n] = n;
+    std::stable_sort(order.begin(), order.end(), ItemCostOrder(items));
+
+    typedef std::pair<double,int> Load;
+    std::priority_queue<Load, std::vector<Load>, std::greater<Load> > loads;
+    for (int r=0; r<nranks; ++r) loads.push(Load(0., r));
+    std::vector<char> mine(nitems, 0);
+    for (long n=0; n<nitems; ++n) {
+        Load next = loads.top();
+        loads.pop();
+        if (next.second == rank) mine[order[n]] = 1;
+        // Even the items with no pairs in range take a little time to check.
+        next.first += std::max(items[order[n]].cost, 1.);
+        loads.push(next);
+    }
+    std::vector<WorkItem> keep;
+    keep.reserve(nitems / nranks + 1);
+    for (long n=0; n<nitems; ++n) if (mine[n]) keep.push_back(items[n]);
+    dbg<<"Rank "<<rank<<" of "<<nranks<<" has "<<keep.size()<<" of "<<nitems<<" items\n";
+    items.swap(keep);
+}
+
+// Add the work items for the auto-correlation of a field with top-level cells cells.
+// Rather than having each thread do process2 for cell i and then all the pairs (i,j>i),
+// which makes the first few i much slower than the last ones, make each of these a
+// separate item.  k is the patch pair that they belong to in processPatches.
+template <int D, int C, int M>
+void AddAutoItems(const std::vector<Cell<D,C>*>& cells, const MetricHelper<M>& metric,
+                  double fullmaxsep, long k, std::vector<WorkItem>& items)
+{
+    const long n1 = cells.size();
+    for (long i=0;i<n1;++i) {
+        const Cell<D,C>& c1 = *cells[i];
+        double n = c1.getN();
+        items.push_back(WorkItem(PairCost(0.5*n*n, 2.*c1.getSize(), fullmaxsep), i, -1, k));
+        for (long j=i+1;j<n1;++j) {
+            const Cell<D,C>& c2 = *cells[j];
+            double s1 = c1.getSize();
+            double s2 = c2.getSize();
+            const double rsq = metric.DistSq(c1.getPos(), c2.getPos(), s1, s2);
+            double cost = 0.;
+            if (rsq < SQR(fullmaxsep + s1 + s2))
+                cost = PairCost(double(c1.getN()) * double(c2.getN()), s1+s2, fullmaxsep);
+            items.push_back(WorkItem(cost, i, j, k));
+        }
+    }
+}
+
+// Add the work items for the cross-correlation of two fields: one for each pair of top-level
+// cells that are close enough to have any pairs in range.  When the metric allows it, use a
+// grid of the cells in cells2 to find these, rather than checking all n1 x n2 pairs.
+template <int D1, int D2, int C, int M>
+void AddCrossItems(const std::vector<Cell<D1,C>*>& cells1,
+                   const std::vector<Cell<D2,C>*>& cells2, const MetricHelper<M>& metric,
+                   double fullmaxsep, long k, std::vector<WorkItem>& items)
+{
+    const long n1 = cells1.size();
+    const long n2 = cells2.size();
+    const bool use_grid = UseTopCellGrid<M,C>::value && n2 > 1;
+    TopCellGrid<D2,C>* grid = use_grid ? new TopCellGrid<D2,C>(cells2, fullmaxsep) : 0;
+    std::vector<long> near;
+    if (!use_grid) {
+        near.resize(n2);
+        for (long j=0;j<n2;++j) near[j] = j;
+    }
+    for (long i=0;i<n1;++i) {
+        const Cell<D1,C>& c1 = *cells1[i];
+        if (use_grid) grid->getNear(c1.getPos(), fullmaxsep + c1.getSize(), 1., near);
+        for (size_t jj=0;jj<near.size();++jj) {
+            const long j = near[jj];
+            const Cell<D2,C>& c2 = *cells2[j];
+            double s1 = c1.getSize();
+            double s2 = c2.getSize();
+            const double rsq = metric.DistSq(c1.getPos(), c2.getPos(), s1, s2);
+            double cost = 0.;
+            if (rsq < SQR(fullmaxsep + s1 + s2))
+                cost = PairCost(double(c1.getN()) * double(c2.getN()), s1+s2, fullmaxsep);
+            items.push_back(WorkItem(cost, i, j, k));
+        }
+    }
+    delete grid;
+}
+
+// With NUMA domains, run each item in the domain of its larger cell, since most of the memory
+// it uses is in that cell's tree.  For an auto-correlation, field2 is field1.
+template <int D1, int D2, int C>
+void SetItemDomains(const Field<D1,C>& field1, const Field<D2,C>& field2,
+                    std::vector<WorkItem>& items)
+{
+    if (GetNumaDomains() == 1) return;
+    const std::vector<Cell<D1,C>*>& cells1 = field1.getCells();
+    const std::vector<Cell<D2,C>*>& cells2 = field2.getCells();
+    for (size_t n=0; n<items.size(); ++n) {
+        WorkItem& item = items[n];
+        if (item.j >= 0 && cells2[item.j]->getN() > cells1[item.i]->getN())
+            item.domain = field2.getCellDomain(item.j);
+        else
+            item.domain = field1.getCellDomain(item.i);
+    }
+}
+
 template <int D1, int D2, int B> template <int C, int M>
 void BinnedCorr2<D1,D2,B>::process(const Field<D1,C>& field, bool dots)
 {
     xdbg<<"Start process (auto): M,C = "<<M<<"  "<<C<<std::endl;
     Assert(D1 == D2);
     Assert(_coords == -1 || _coords == C);
+    if (M == Arc && C == Sphere) {
+        BinnedCorr2<D1,D2,B>* chord = getChordCorr();
+        if (chord) {
+            chord->template process<C,Euclidean>(field, dots);
+            _coords = C;
+            return;
+        }
+    }
     _coords = C;
+    if (M == Periodic && processImages(field, dots)) return;
     const long n1 = field.getNTopLevel();
     dbg<<"field has "<<n1<<" top level nodes\n";
     Assert(n1 > 0);
 
-#ifdef _OPENMP
-#pragma omp parallel
-    {
-        // Give each thread their own copy of the data vector to fill in.
-        BinnedCorr2<D1,D2,B> bc2(*this,false);
-#else
-        BinnedCorr2<D1,D2,B>& bc2 = *this;
-#endif
-
-        // Inside the omp parallel, so each thread has its own MetricHelper.
-        MetricHelper<M> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
+    const std::vector<Cell<D1,C>*>& cells = field.getCells();
+    MetricHelper<M> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
+    std::vector<WorkItem> items;
+    items.reserve(n1*(n1+1)/2);
+    AddAutoItems(cells, metric, _fullmaxsep, 0, items);
+    SetItemDomains(field, field, items);
+    processItems<C,M>(cells, cells, items, BinTypeHelper<B>::doReverse(), dots,
+                      field.isSpilled());
+}
 
-#ifdef _OPENMP
-#pragma omp for schedule(dynamic)
-#endif
-        for (long i=0;i<n1;++i) {
-#ifdef _OPENMP
-#pragma omp critical
-#endif
-            {
-#ifdef _OPENMP
-                xdbg<<omp_get_thread_num()<<" "<<i<<std::endl;
-#endif
-                if (dots) std::cout<<'.'<<std::flush;
-            }
-            const Cell<D1,C>& c1 = *field.getCells()[i];
-            ProcessHelper<D1,D2,B,C,M>::process2(bc2, c1, metric);
-            for (long j=i+1;j<n1;++j) {
-                const Cell<D1,C>& c2 = *field.getCells()[j];
-                bc2.process11<C,M>(c1, c2, metric, BinTypeHelper<B>::doReverse());
-            }
-        }
-#ifdef _OPENMP
-        // Accumulate the results
-#pragma omp critical
-        {
-            *this += bc2;
-        }
-    }
-#endif
-    if (dots) std::cout<<std::endl;
+template <int D1, int D2, int B> template <int C, int M>
+bool BinnedCorr2<D1,D2,B>::tooFarApart(const Field<D1,C>& field1, const Field<D2,C>& field2,
+                                       const MetricHelper<M>& metric) const
+{
+    const Position<C>& p1 = field1.getCenter();
+    const Position<C>& p2 = field2.getCenter();
+    double s1 = field1.getSize();
+    double s2 = field2.getSize();
+    double rsq;
+    double rpar = 0; // Gets set to correct value by this function if appropriate
+    const bool in_rpar = FusedMetric<M,C>::distSqInRPar(metric, p1, p2, s1, s2, rsq, rpar);
+    double s1ps2 = s1 + s2;
+    return (!in_rpar ||
+            (BinTypeHelper<B>::tooSmallDist(rsq, s1ps2, _minsep, _minsepsq) &&
+             metric.tooSmallDist(p1, p2, rsq, rpar, s1ps2, _minsep, _minsepsq)) ||
+            (BinTypeHelper<B>::tooLargeDist(rsq, s1ps2, _maxsep, _maxsepsq) &&
+             metric.tooLargeDist(p1, p2, rsq, rpar, s1ps2, _fullmaxsep, _fullmaxsepsq)));
 }
 
 template <int D1, int D2, int B> template <int C, int M>
@@ -184,25 +455,23 @@ void BinnedCorr2<D1,D2,B>::process(const Field<D1,C>& field1, const Field<D2,C>&
 {
     xdbg<<"Start process (cross): M,C = "<<M<<"  "<<C<<std::endl;
     Assert(_coords == -1 || _coords == C);
+    if (M == Arc && C == Sphere) {
+        BinnedCorr2<D1,D2,B>* chord = getChordCorr();
+        if (chord) {
+            chord->template process<C,Euclidean>(field1, field2, dots);
+            _coords = C;
+            return;
+        }
+    }
     _coords = C;
 
     // Before possibly triggering a call to BuildCells, check if we can early exit.
     MetricHelper<M> metric1(_minrpar, _maxrpar, _xp, _yp, _zp);
-    const Position<C>& p1 = field1.getCenter();
-    const Position<C>& p2 = field2.getCenter();
-    double s1 = field1.getSize();
-    double s2 = field2.getSize();
-    const double rsq = metric1.DistSq(p1, p2, s1, s2);
-    double s1ps2 = s1 + s2;
-    double rpar = 0; // Gets set to correct value by isRParOutsideRange if appropriate
-    if (metric1.isRParOutsideRange(p1, p2, s1ps2, rpar) ||
-        (BinTypeHelper<B>::tooSmallDist(rsq, s1ps2, _minsep, _minsepsq) &&
-         metric1.tooSmallDist(p1, p2, rsq, rpar, s1ps2, _minsep, _minsepsq)) ||
-        (BinTypeHelper<B>::tooLargeDist(rsq, s1ps2, _maxsep, _maxsepsq) &&
-         metric1.tooLargeDist(p1, p2, rsq, rpar, s1ps2, _fullmaxsep, _fullmaxsepsq))) {
+    if (tooFarApart(field1, field2, metric1)) {
         dbg<<"Fields have no relevant coverage.  Early exit.\n";
         return;
     }
+    if (M == Periodic && processImages(field1, field2, dots)) return;
 
     const long n1 = field1.getNTopLevel();
     const long n2 = field2.getNTopLevel();
@@ -211,865 +480,4571 @@ void BinnedCorr2<D1,D2,B>::process(const Field<D1,C>& field1, const Field<D2,C>&
     Assert(n1 > 0);
     Assert(n2 > 0);
 
+    const std::vector<Cell<D1,C>*>& cells1 = field1.getCells();
+    const std::vector<Cell<D2,C>*>& cells2 = field2.getCells();
+    std::vector<WorkItem> items;
+    items.reserve(n1*n2);
+    AddCrossItems(cells1, cells2, metric1, _fullmaxsep, 0, items);
+    SetItemDomains(field1, field2, items);
+    processItems<C,M>(cells1, cells2, items, false, dots,
+                      field1.isSpilled() || field2.isSpilled());
+}
+
+template <int D1, int D2, int B> template <int C>
+bool BinnedCorr2<D1,D2,B>::canUseImages() const
+{
+    double minp = std::min(_xp, _yp);
+    if (C != Flat) minp = std::min(minp, _zp);
+    // Any image other than the nearest one is at least half the period away in some
+    // direction, so it can't be in range for any of the bin types.
+    return _maxsep <= 0.5 * minp;
+}
+
+template <int D1, int D2, int B> template <int C>
+bool BinnedCorr2<D1,D2,B>::processImages(const Field<D1,C>& field, bool dots)
+{
+    if (!canUseImages<C>()) return false;
+    dbg<<"Using periodic images for the auto-correlation\n";
+    const std::vector<Cell<D1,C>*>& cells = field.getCells();
+    const long n1 = cells.size();
+    PeriodicImages<D1,C> images(cells, cells, _xp, _yp, _zp, _fullmaxsep);
+
+    // Each pair of objects is only counted once, so each cell is paired with the images of
+    // the cells after it, and with its own images with a positive shift.  It would be paired
+    // with the others in the opposite order (with the opposite shift).
+    MetricHelper<Euclidean> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
+    std::vector<WorkItem> items;
+    AddAutoItems(cells, metric, _fullmaxsep, 0, items);
+    std::vector<WorkItem> image_items;
+    AddCrossItems(cells, images.getCells(), metric, _fullmaxsep, 0, image_items);
+    for (size_t n=0; n<image_items.size(); ++n) {
+        WorkItem item = image_items[n];
+        const long src = images.getSource(item.j);
+        if (item.i < src || (item.i == src && images.isPositive(item.j))) {
+            item.j += n1;
+            items.push_back(item);
+        }
+    }
+
+    std::vector<Cell<D1,C>*> cells2(cells);
+    cells2.insert(cells2.end(), images.getCells().begin(), images.getCells().end());
+    processItems<C,Euclidean>(cells, cells2, items, BinTypeHelper<B>::doReverse(), dots,
+                              field.isSpilled());
+    return true;
+}
+
+template <int D1, int D2, int B> template <int C>
+bool BinnedCorr2<D1,D2,B>::processImages(const Field<D1,C>& field1, const Field<D2,C>& field2,
+                                         bool dots)
+{
+    if (!canUseImages<C>()) return false;
+    dbg<<"Using periodic images for the cross-correlation\n";
+    const std::vector<Cell<D1,C>*>& cells1 = field1.getCells();
+    const std::vector<Cell<D2,C>*>& cells = field2.getCells();
+    PeriodicImages<D2,C> images(cells, cells1, _xp, _yp, _zp, _fullmaxsep);
+
+    std::vector<Cell<D2,C>*> cells2(cells);
+    cells2.insert(cells2.end(), images.getCells().begin(), images.getCells().end());
+    MetricHelper<Euclidean> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
+    std::vector<WorkItem> items;
+    AddCrossItems(cells1, cells2, metric, _fullmaxsep, 0, items);
+    processItems<C,Euclidean>(cells1, cells2, items, false, dots,
+                              field1.isSpilled() || field2.isSpilled());
+    return true;
+}
+
+// For processPatches: order the items by the total cost of their pair of patches, keeping
+// the items of each pair together.
+struct PatchOrder
+{
+    PatchOrder(const std::vector<double>& cost) : pair_cost(cost) {}
+    bool operator()(const WorkItem& a, const WorkItem& b) const
+    {
+        if (pair_cost[a.k] != pair_cost[b.k]) return pair_cost[a.k] > pair_cost[b.k];
+        return a.k < b.k;
+    }
+    const std::vector<double>& pair_cost;
+};
+
+template <int D1, int D2, int B> template <int C, int M>
+void BinnedCorr2<D1,D2,B>::processPatches(
+    const std::vector<const Field<D1,C>*>& fields1,
+    const std::vector<const Field<D2,C>*>& fields2,
+    const std::vector<long>& pairs_i, const std::vector<long>& pairs_j, bool is_auto,
+    double* xi0, double* xi1, double* xi2, double* xi3,
+    double* meanr, double* meanlogr, double* weight, double* npairs, bool dots)
+{
+    xdbg<<"Start processPatches: M,C = "<<M<<"  "<<C<<std::endl;
+    Assert(_coords == -1 || _coords == C);
+    Assert(pairs_i.size() == pairs_j.size());
+    if (M == Arc && C == Sphere) {
+        BinnedCorr2<D1,D2,B>* chord = getChordCorr();
+        if (chord) {
+            chord->template processPatches<C,Euclidean>(
+                fields1, fields2, pairs_i, pairs_j, is_auto,
+                xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs, dots);
+            _coords = C;
+            return;
+        }
+    }
+    _coords = C;
+    const long npatch_pairs = pairs_i.size();
+    dbg<<"Process "<<npatch_pairs<<" pairs of patches\n";
+
+    // The results for pair k go in row k of the output arrays.
+    std::vector<BinnedCorr2<D1,D2,B>*> outs(npatch_pairs);
+    for (long k=0;k<npatch_pairs;++k) {
+        const long offset = k * _nbins;
+        outs[k] = new BinnedCorr2<D1,D2,B>(
+            _minsep, _maxsep, _nbins, _binsize, _b, _leaf_size,
+            _minrpar, _maxrpar, _xp, _yp, _zp,
+            xi0 ? xi0 + offset : 0, xi1 ? xi1 + offset : 0,
+            xi2 ? xi2 + offset : 0, xi3 ? xi3 + offset : 0,
+            meanr + offset, meanlogr + offset, weight + offset, npairs + offset);
+        outs[k]->_coords = C;
+    }
+
+    // Make the work items for all the pairs of patches.  Pairs that are too far apart to have
+    // any pairs of objects in range are skipped before building their cells.
+    MetricHelper<M> metric1(_minrpar, _maxrpar, _xp, _yp, _zp);
+    std::vector<const std::vector<Cell<D1,C>*>*> cells1(npatch_pairs, 0);
+    std::vector<const std::vector<Cell<D2,C>*>*> cells2(npatch_pairs, 0);
+    std::vector<char> do_reverse(npatch_pairs, 0);
+    std::vector<WorkItem> items;
+    for (long k=0;k<npatch_pairs;++k) {
+        const Field<D1,C>& field1 = *fields1[pairs_i[k]];
+        const Field<D2,C>& field2 = *fields2[pairs_j[k]];
+        if (is_auto && pairs_i[k] == pairs_j[k]) {
+            cells1[k] = &field1.getCells();
+            cells2[k] = &field2.getCells();
+            do_reverse[k] = BinTypeHelper<B>::doReverse();
+            AddAutoItems(*cells1[k], metric1, _fullmaxsep, k, items);
+        } else if (!tooFarApart(field1, field2, metric1)) {
+            cells1[k] = &field1.getCells();
+            cells2[k] = &field2.getCells();
+            AddCrossItems(*cells1[k], *cells2[k], metric1, _fullmaxsep, k, items);
+        } else {
+            xdbg<<"Skip pair "<<k<<": "<<pairs_i[k]<<','<<pairs_j[k]<<std::endl;
+        }
+    }
+
+    PartitionItems(items, _rank, _nranks);
+
+    // Do the most expensive pairs of patches first, and within each one, the most expensive
+    // items first.  Keeping each pair's items together means each thread only adds its
+    // results to the output for that pair a few times.
+    std::vector<double> pair_cost(npatch_pairs, 0.);
+    for (size_t n=0;n<items.size();++n) pair_cost[items[n].k] += items[n].cost;
+    std::stable_sort(items.begin(), items.end());
+    std::stable_sort(items.begin(), items.end(), PatchOrder(pair_cost));
+    const long nitems = items.size();
+    dbg<<"Process "<<nitems<<" items\n";
+    const long dot_step = std::max(1L, nitems / std::max(1L, npatch_pairs));
+
+#ifdef _OPENMP
+    const int nthreads = omp_get_max_threads();
+#else
+    const int nthreads = 1;
+#endif
+    GetThreadAccumulators(_thread_accums, *this, nthreads);
+
 #ifdef _OPENMP
 #pragma omp parallel
     {
-        // Give each thread their own copy of the data vector to fill in.
-        BinnedCorr2<D1,D2,B> bc2(*this,false);
+        BinnedCorr2<D1,D2,B>& bc2 = *_thread_accums[omp_get_thread_num()];
 #else
-        BinnedCorr2<D1,D2,B>& bc2 = *this;
+        BinnedCorr2<D1,D2,B>& bc2 = *_thread_accums[0];
 #endif
-
+        bc2.clear();
+        // Tasks add their pairs to the accumulator of whichever thread runs them, which may be
+        // working on a different pair of patches, so don't split any items into tasks here.
+        // With many pairs of patches, there are plenty of items to balance the work anyway.
+        bc2._thread_corrs = 0;
         MetricHelper<M> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
+        TraversalStats& stats = bc2._stats;
+        stats[TraversalStats::NTHREADS] = 1.;
+        long current = -1;
 
 #ifdef _OPENMP
 #pragma omp for schedule(dynamic)
 #endif
-        for (long i=0;i<n1;++i) {
+        for (long n=0;n<nitems;++n) {
+            if (dots && n % dot_step == 0) {
 #ifdef _OPENMP
 #pragma omp critical
 #endif
-            {
-#ifdef _OPENMP
-                xdbg<<omp_get_thread_num()<<" "<<i<<std::endl;
-#endif
-                if (dots) std::cout<<'.'<<std::flush;
+                std::cout<<'.'<<std::flush;
             }
-            const Cell<D1,C>& c1 = *field1.getCells()[i];
-            for (long j=0;j<n2;++j) {
-                const Cell<D2,C>& c2 = *field2.getCells()[j];
-                bc2.process11<C,M>(c1, c2, metric, false);
+            if (_budget.cancelled()) continue;
+            const WorkItem& item = items[n];
+            if (item.k != current) {
+                if (current >= 0) bc2.flushTo(*outs[current]);
+                current = item.k;
             }
+            TraceScope trace("process2 item", n);
+            const double t0 = WallTime();
+            const Cell<D1,C>& c1 = *(*cells1[item.k])[item.i];
+            if (item.j < 0) {
+                ProcessHelper<D1,D2,B,C,M>::process2(bc2, c1, metric);
+            } else {
+                const Cell<D2,C>& c2 = *(*cells2[item.k])[item.j];
+                bc2.template process11<C,M>(c1, c2, metric, do_reverse[item.k]);
+            }
+            stats.finishItem(WallTime() - t0);
         }
+        if (current >= 0) bc2.flushTo(*outs[current]);
+        stats[TraversalStats::MAX_THREAD_TIME] = stats[TraversalStats::ITEM_TIME];
 #ifdef _OPENMP
-        // Accumulate the results
-#pragma omp critical
-        {
-            *this += bc2;
-        }
+        // This just adds up the stats, since the bins have all been flushed.
+        TreeReduce(_thread_accums);
     }
 #endif
+    if (_stats_out) _thread_accums[0]->_stats.addTo(_stats_out);
+    for (long k=0;k<npatch_pairs;++k) delete outs[k];
     if (dots) std::cout<<std::endl;
 }
 
 template <int D1, int D2, int B> template <int C, int M>
-void BinnedCorr2<D1,D2,B>::processPairwise(
-    const SimpleField<D1,C>& field1, const SimpleField<D2,C>& field2, bool dots)
+bool BinnedCorr2<D1,D2,B>::processTagged(
+    const Field<D1,C>& field1, const Field<D2,C>& field2, bool is_auto,
+    const long* patch1, const long* patch2, int npatch1, int npatch2,
+    double* xi0, double* xi1, double* xi2, double* xi3,
+    double* meanr, double* meanlogr, double* weight, double* npairs, bool dots)
 {
+    xdbg<<"Start processTagged: M,C = "<<M<<"  "<<C<<std::endl;
     Assert(_coords == -1 || _coords == C);
+    if (M == Arc && C == Sphere) {
+        BinnedCorr2<D1,D2,B>* chord = getChordCorr();
+        if (chord) {
+            bool ok = chord->template processTagged<C,Euclidean>(
+                field1, field2, is_auto, patch1, patch2, npatch1, npatch2,
+                xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs, dots);
+            _coords = C;
+            return ok;
+        }
+    }
     _coords = C;
-    const long nobj = field1.getNObj();
-    const long nobj2 = field2.getNObj();
-    xdbg<<"field1 has "<<nobj<<" objects\n";
-    xdbg<<"field2 has "<<nobj2<<" objects\n";
-    Assert(nobj > 0);
-    Assert(nobj == nobj2);
 
-    const long sqrtn = long(sqrt(double(nobj)));
+    const std::vector<Cell<D1,C>*>& cells1 = field1.getCells();
+    const std::vector<Cell<D2,C>*>& cells2 = field2.getCells();
+    PatchLabels<D1,C> labels1(cells1, patch1);
+    if (labels1.getNMixedLeaves() > 0) return false;
+    // For an auto-correlation, field2 is field1 (and D2 == D1), but the compiler doesn't know
+    // that, so this is a second copy of the same labels.
+    PatchLabels<D2,C> labels2(cells2, patch2);
+    if (labels2.getNMixedLeaves() > 0) return false;
+    dbg<<"Labelled "<<labels1.getNLabels()<<", "<<labels2.getNLabels()<<" cells\n";
+
+    // The results for the pair of patches (i,j) go in row i*npatch2+j of the output arrays.
+    const long nrows = long(npatch1) * npatch2;
+    std::vector<BinnedCorr2<D1,D2,B>*> outs(nrows);
+    for (long k=0;k<nrows;++k) {
+        const long offset = k * _nbins;
+        outs[k] = new BinnedCorr2<D1,D2,B>(
+            _minsep, _maxsep, _nbins, _binsize, _b, _leaf_size,
+            _minrpar, _maxrpar, _xp, _yp, _zp,
+            xi0 ? xi0 + offset : 0, xi1 ? xi1 + offset : 0,
+            xi2 ? xi2 + offset : 0, xi3 ? xi3 + offset : 0,
+            meanr + offset, meanlogr + offset, weight + offset, npairs + offset);
+        outs[k]->_coords = C;
+    }
+
+    MetricHelper<M> metric1(_minrpar, _maxrpar, _xp, _yp, _zp);
+    std::vector<WorkItem> items;
+    if (is_auto) AddAutoItems(cells1, metric1, _fullmaxsep, 0, items);
+    else AddCrossItems(cells1, cells2, metric1, _fullmaxsep, 0, items);
+    PartitionItems(items, _rank, _nranks);
+    std::stable_sort(items.begin(), items.end());
+    const long nitems = items.size();
+    dbg<<"Process "<<nitems<<" items\n";
+    const long dot_step = std::max(1L, nitems / long(cells1.size()));
+    const bool do_reverse = is_auto && BinTypeHelper<B>::doReverse();
+
+#ifdef _OPENMP
+    const int nthreads = omp_get_max_threads();
+#else
+    const int nthreads = 1;
+#endif
+    GetThreadAccumulators(_thread_accums, *this, nthreads);
 
 #ifdef _OPENMP
 #pragma omp parallel
     {
-        // Give each thread their own copy of the data vector to fill in.
-        BinnedCorr2<D1,D2,B> bc2(*this,false);
+        BinnedCorr2<D1,D2,B>& bc2 = *_thread_accums[omp_get_thread_num()];
 #else
-        BinnedCorr2<D1,D2,B>& bc2 = *this;
+        BinnedCorr2<D1,D2,B>& bc2 = *_thread_accums[0];
 #endif
-
+        bc2.clear();
+        // As in processPatches, the items add to many different outputs, so don't use tasks.
+        bc2._thread_corrs = 0;
+        bc2._tagged_npatch2 = npatch2;
+        bc2._tagged_auto = is_auto;
         MetricHelper<M> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
+        TraversalStats& stats = bc2._stats;
+        stats[TraversalStats::NTHREADS] = 1.;
 
 #ifdef _OPENMP
-#pragma omp for schedule(static)
+#pragma omp for schedule(dynamic)
 #endif
-        for (long i=0;i<nobj;++i) {
-            // Let the progress dots happen every sqrt(n) iterations.
-            if (dots && (i % sqrtn == 0)) {
+        for (long n=0;n<nitems;++n) {
+            if (dots && n % dot_step == 0) {
 #ifdef _OPENMP
 #pragma omp critical
 #endif
-                {
-#ifdef _OPENMP
-                    xdbg<<omp_get_thread_num()<<" "<<i<<std::endl;
-#endif
-                    std::cout<<'.'<<std::flush;
-                }
+                std::cout<<'.'<<std::flush;
             }
-            const Cell<D1,C>& c1 = *field1.getCells()[i];
-            const Cell<D2,C>& c2 = *field2.getCells()[i];
-            const Position<C>& p1 = c1.getPos();
-            const Position<C>& p2 = c2.getPos();
-            double s=0.;
-            const double rsq = metric.DistSq(p1, p2, s, s);
-            if (BinTypeHelper<B>::isRSqInRange(rsq, p1, p2,
-                                               _minsep, _minsepsq, _maxsep, _maxsepsq)) {
-                bc2.template directProcess11(c1,c2,rsq,false);
+            if (_budget.cancelled()) continue;
+            const WorkItem& item = items[n];
+            TraceScope trace("process2 item", n);
+            const double t0 = WallTime();
+            const Cell<D1,C>& c1 = *cells1[item.i];
+            if (item.j < 0) {
+                ProcessHelper<D1,D2,B,C,M>::taggedProcess2(bc2, c1, metric, labels1);
+            } else {
+                const Cell<D2,C>& c2 = *cells2[item.j];
+                bc2.template taggedProcess11<C,M>(c1, c2, metric, labels1, labels2, do_reverse);
             }
+            bc2.flushTagged(outs);
+            stats.finishItem(WallTime() - t0);
         }
+        stats[TraversalStats::MAX_THREAD_TIME] = stats[TraversalStats::ITEM_TIME];
 #ifdef _OPENMP
-        // Accumulate the results
-#pragma omp critical
-        {
-            *this += bc2;
-        }
+        // This just adds up the stats, since the bins have all been flushed.
+        TreeReduce(_thread_accums);
     }
 #endif
+    if (_stats_out) _thread_accums[0]->_stats.addTo(_stats_out);
+    for (long k=0;k<nrows;++k) delete outs[k];
     if (dots) std::cout<<std::endl;
+    return true;
+}
+
+template <int D1, int D2, int B>
+BinnedCorr2<D1,D2,B>& BinnedCorr2<D1,D2,B>::taggedOut(int p1, int p2)
+{
+    if (_tagged_auto && p1 > p2) std::swap(p1, p2);
+    const long k = long(p1) * _tagged_npatch2 + p2;
+    typename std::map<long, BinnedCorr2<D1,D2,B>*>::iterator it = _tagged_active.find(k);
+    if (it != _tagged_active.end()) return *it->second;
+    BinnedCorr2<D1,D2,B>* out;
+    if (_tagged_pool.empty()) {
+        out = new BinnedCorr2<D1,D2,B>(*this, false);
+    } else {
+        out = _tagged_pool.back();
+        _tagged_pool.pop_back();
+    }
+    out->_coords = _coords;
+    _tagged_active[k] = out;
+    return *out;
+}
+
+template <int D1, int D2, int B>
+void BinnedCorr2<D1,D2,B>::flushTagged(std::vector<BinnedCorr2<D1,D2,B>*>& outs)
+{
+    typename std::map<long, BinnedCorr2<D1,D2,B>*>::iterator it;
+    for (it = _tagged_active.begin(); it != _tagged_active.end(); ++it) {
+        BinnedCorr2<D1,D2,B>* out = it->second;
+        out->flushTo(*outs[it->first]);
+        _stats += out->_stats;
+        out->_stats.clear();
+        _tagged_pool.push_back(out);
+    }
+    _tagged_active.clear();
 }
 
 template <int D1, int D2, int B> template <int C, int M>
-void BinnedCorr2<D1,D2,B>::process2(const Cell<D1,C>& c12, const MetricHelper<M>& metric)
+void BinnedCorr2<D1,D2,B>::taggedProcess2(const Cell<D1,C>& c12, const MetricHelper<M>& metric,
+                                          const PatchLabels<D1,C>& labels)
 {
     if (c12.getW() == 0.) return;
+    const int p = labels.get(&c12);
+    if (p >= 0) {
+        taggedOut(p, p).template process2<C,M>(c12, metric);
+        return;
+    }
+    ++_stats[TraversalStats::NODES];
     if (c12.getSize() <= _halfminsep) return;
 
+    // A mixed cell can't be a leaf, or processTagged would have given up.
     Assert(c12.getLeft());
     Assert(c12.getRight());
-    process2<C,M>(*c12.getLeft(), metric);
-    process2<C,M>(*c12.getRight(), metric);
-    process11<C,M>(*c12.getLeft(), *c12.getRight(), metric, BinTypeHelper<B>::doReverse());
+    taggedProcess2<C,M>(*c12.getLeft(), metric, labels);
+    taggedProcess2<C,M>(*c12.getRight(), metric, labels);
+    taggedProcess11<C,M>(*c12.getLeft(), *c12.getRight(), metric, labels, labels,
+                         BinTypeHelper<B>::doReverse());
 }
 
 template <int D1, int D2, int B> template <int C, int M>
-void BinnedCorr2<D1,D2,B>::process11(const Cell<D1,C>& c1, const Cell<D2,C>& c2,
-                                     const MetricHelper<M>& metric, bool do_reverse)
+void BinnedCorr2<D1,D2,B>::taggedProcess11(
+    const Cell<D1,C>& c1, const Cell<D2,C>& c2, const MetricHelper<M>& metric,
+    const PatchLabels<D1,C>& labels1, const PatchLabels<D2,C>& labels2, bool do_reverse)
 {
-    //set_verbose(2);
-    xdbg<<"Start process11 for "<<c1.getPos()<<",  "<<c2.getPos()<<"   ";
-    xdbg<<"w = "<<c1.getW()<<", "<<c2.getW()<<std::endl;
     if (c1.getW() == 0. || c2.getW() == 0.) return;
+    const int p1 = labels1.get(&c1);
+    const int p2 = labels2.get(&c2);
+    if (p1 >= 0 && p2 >= 0) {
+        taggedOut(p1, p2).template process11<C,M>(c1, c2, metric, do_reverse);
+        return;
+    }
+    ++_stats[TraversalStats::NODES];
 
-    const Position<C>& p1 = c1.getPos();
-    const Position<C>& p2 = c2.getPos();
-    double s1 = c1.getSize(); // May be modified by DistSq function.
-    double s2 = c2.getSize(); // "
-    xdbg<<"s1,s2 = "<<s1<<','<<s2<<std::endl;
-    xdbg<<"M,C = "<<M<<"  "<<C<<std::endl;
-    const double rsq = metric.DistSq(p1,p2,s1,s2);
-    xdbg<<"rsq = "<<rsq<<std::endl;
-    xdbg<<"s1,s2 => "<<s1<<','<<s2<<std::endl;
-    const double s1ps2 = s1+s2;
-
+    // The same early exits as process11.  If these don't apply, split the mixed cells, even
+    // if the pair could have gone into a single bin.
+    const Position<C>& pos1 = c1.getPos();
+    const Position<C>& pos2 = c2.getPos();
+    double s1 = c1.getSize();
+    double s2 = c2.getSize();
+    double rsq;
     double rpar = 0; // Gets set to correct value by this function if appropriate
-    if (metric.isRParOutsideRange(p1, p2, s1ps2, rpar)) {
+    const bool in_rpar = FusedMetric<M,C>::distSqInRPar(metric, pos1, pos2, s1, s2, rsq, rpar);
+    const double s1ps2 = s1+s2;
+    if (!in_rpar) {
+        ++_stats[TraversalStats::RPAR_EXIT];
         return;
     }
-    xdbg<<"RPar in range\n";
-
     if (BinTypeHelper<B>::tooSmallDist(rsq, s1ps2, _minsep, _minsepsq) &&
-        metric.tooSmallDist(p1, p2, rsq, rpar, s1ps2, _minsep, _minsepsq)) {
+        metric.tooSmallDist(pos1, pos2, rsq, rpar, s1ps2, _minsep, _minsepsq)) {
+        ++_stats[TraversalStats::SMALL_EXIT];
         return;
     }
-    xdbg<<"Not too small separation\n";
-
     if (BinTypeHelper<B>::tooLargeDist(rsq, s1ps2, _maxsep, _maxsepsq) &&
-        metric.tooLargeDist(p1, p2, rsq, rpar, s1ps2, _fullmaxsep, _fullmaxsepsq)) {
+        metric.tooLargeDist(pos1, pos2, rsq, rpar, s1ps2, _fullmaxsep, _fullmaxsepsq)) {
+        ++_stats[TraversalStats::LARGE_EXIT];
         return;
     }
-    xdbg<<"Not too large separation\n";
 
-    // Now check if these cells are small enough that it is ok to drop into a single bin.
-    int k=-1;
-    double r=0,logr=0;  // If singleBin is true, these values are set for use by directProcess11
-    if (metric.isRParInsideRange(p1, p2, s1ps2, rpar) &&
-        BinTypeHelper<B>::singleBin(rsq, s1ps2, p1, p2, _binsize, _b, _bsq,
-                                    _minsep, _maxsep, _logminsep, k, r, logr))
-    {
-        xdbg<<"Drop into single bin.\n";
-        if (BinTypeHelper<B>::isRSqInRange(rsq, p1, p2, _minsep, _minsepsq, _maxsep, _maxsepsq)) {
-            directProcess11(c1,c2,rsq,do_reverse,k,r,logr);
-        }
+    // If both are mixed, only split the larger one, unless they are similar in size.
+    bool split1 = p1 < 0;
+    bool split2 = p2 < 0;
+    if (split1 && split2) {
+        if (c1.getSize() > 2.*c2.getSize()) split2 = false;
+        else if (c2.getSize() > 2.*c1.getSize()) split1 = false;
+    }
+    ++_stats[split1 && split2 ? TraversalStats::SPLIT_MULTI :
+             split1 ? TraversalStats::SPLIT1 : TraversalStats::SPLIT2];
+    if (split1 && split2) {
+        taggedProcess11<C,M>(*c1.getLeft(),*c2.getLeft(),metric,labels1,labels2,do_reverse);
+        taggedProcess11<C,M>(*c1.getLeft(),*c2.getRight(),metric,labels1,labels2,do_reverse);
+        taggedProcess11<C,M>(*c1.getRight(),*c2.getLeft(),metric,labels1,labels2,do_reverse);
+        taggedProcess11<C,M>(*c1.getRight(),*c2.getRight(),metric,labels1,labels2,do_reverse);
+    } else if (split1) {
+        taggedProcess11<C,M>(*c1.getLeft(),c2,metric,labels1,labels2,do_reverse);
+        taggedProcess11<C,M>(*c1.getRight(),c2,metric,labels1,labels2,do_reverse);
     } else {
-        xdbg<<"Need to split.\n";
-        bool split1=false, split2=false;
-        double bsq_eff = BinTypeHelper<B>::getEffectiveBSq(rsq,_bsq);
-        xdbg<<"bsq_eff = "<<bsq_eff<<std::endl;
-        CalcSplitSq(split1,split2,s1,s2,s1ps2,bsq_eff);
-        xdbg<<"rsq = "<<rsq<<", s1ps2 = "<<s1ps2<<"  ";
-        xdbg<<"s1ps2 / r = "<<s1ps2 / sqrt(rsq)<<", b = "<<_b<<"  ";
-        xdbg<<"split = "<<split1<<','<<split2<<std::endl;
-
-        if (split1 && split2) {
-            Assert(c1.getLeft());
-            Assert(c1.getRight());
-            Assert(c2.getLeft());
-            Assert(c2.getRight());
-            process11<C,M>(*c1.getLeft(),*c2.getLeft(),metric,do_reverse);
-            process11<C,M>(*c1.getLeft(),*c2.getRight(),metric,do_reverse);
-            process11<C,M>(*c1.getRight(),*c2.getLeft(),metric,do_reverse);
-            process11<C,M>(*c1.getRight(),*c2.getRight(),metric,do_reverse);
-        } else if (split1) {
-            Assert(c1.getLeft());
-            Assert(c1.getRight());
-            process11<C,M>(*c1.getLeft(),c2,metric,do_reverse);
-            process11<C,M>(*c1.getRight(),c2,metric,do_reverse);
-        } else {
-            Assert(split2);
-            Assert(c2.getLeft());
-            Assert(c2.getRight());
-            process11<C,M>(c1,*c2.getLeft(),metric,do_reverse);
-            process11<C,M>(c1,*c2.getRight(),metric,do_reverse);
-        }
+        taggedProcess11<C,M>(c1,*c2.getLeft(),metric,labels1,labels2,do_reverse);
+        taggedProcess11<C,M>(c1,*c2.getRight(),metric,labels1,labels2,do_reverse);
     }
 }
 
-
-// We also set up a helper class for doing the direct processing
-template <int D1, int D2>
-struct DirectHelper;
-
-template <>
-struct DirectHelper<NData,NData>
+template <int D1, int D2, int B> template <int C, int M>
+InteractionList* BinnedCorr2<D1,D2,B>::record(
+    const Field<D1,C>& field1, const Field<D2,C>& field2, bool is_auto, bool dots)
 {
-    template <int C>
-    static void ProcessXi(
-        const Cell<NData,C>& , const Cell<NData,C>& , const double ,
-        XiData<NData,NData>& , int, int )
-    {}
-};
+    dbg<<"Start record: M,C = "<<M<<"  "<<C<<std::endl;
+    _recording = true;
+    if (is_auto) ProcessHelper<D1,D2,B,C,M>::processAuto(*this, field1, dots);
+    else process<C,M>(field1, field2, dots);
+    _recording = false;
 
-template <>
-struct DirectHelper<NData,KData>
-{
-    template <int C>
-    static void ProcessXi(
-        const Cell<NData,C>& c1, const Cell<KData,C>& c2, const double ,
-        XiData<NData,KData>& xi, int k, int )
-    { xi.xi[k] += c1.getW() * c2.getData().getWK(); }
-};
+    // If the process call went through the chord-space copy, that's where the pairs are.
+    BinnedCorr2<D1,D2,B>* corr = (M == Arc && C == Sphere && _chord_corr) ? _chord_corr : this;
+    corr->_recording = false;
 
-template <>
-struct DirectHelper<NData,GData>
-{
-    template <int C>
-    static void ProcessXi(
-        const Cell<NData,C>& c1, const Cell<GData,C>& c2, const double rsq,
-        XiData<NData,GData>& xi, int k, int )
-    {
-        std::complex<double> g2;
-        ProjectHelper<C>::ProjectShear(c1,c2,g2);
-        // The minus sign here is to make it accumulate tangential shear, rather than radial.
-        // g2 from the above ProjectShear is measured along the connecting line, not tangent.
-        g2 *= -c1.getW();
-        xi.xi[k] += real(g2);
-        xi.xi_im[k] += imag(g2);
-    }
-};
+    InteractionList* list = new InteractionList();
+    list->nbins = _nbins;
+    list->minsep = _minsep;
+    list->maxsep = _maxsep;
+    list->b = _b;
+    list->chord = (corr != this);
 
-template <>
-struct DirectHelper<KData,KData>
-{
-    template <int C>
-    static void ProcessXi(
-        const Cell<KData,C>& c1, const Cell<KData,C>& c2, const double ,
-        XiData<KData,KData>& xi, int k, int k2)
-    {
-        double wkk = c1.getData().getWK() * c2.getData().getWK();
-        xi.xi[k] += wkk;
-        if (k2 != -1) xi.xi[k2] += wkk;
-    }
-};
+    std::vector<const Cell<D1,C>*> cells1;
+    std::vector<const Cell<D2,C>*> cells2;
+    CollectCells(field1.getCells(), cells1);
+    CollectCells(field2.getCells(), cells2);
+    list->sig1 = TreeSignature(cells1);
+    list->sig2 = TreeSignature(cells2);
+    CellIndex<D1,C> index1(cells1);
+    CellIndex<D2,C> index2(cells2);
 
-template <>
-struct DirectHelper<KData,GData>
-{
-    template <int C>
-    static void ProcessXi(
-        const Cell<KData,C>& c1, const Cell<GData,C>& c2, const double rsq,
-        XiData<KData,GData>& xi, int k, int )
-    {
-        std::complex<double> g2;
-        ProjectHelper<C>::ProjectShear(c1,c2,g2);
-        // The minus sign here is to make it accumulate tangential shear, rather than radial.
-        // g2 from the above ProjectShear is measured along the connecting line, not tangent.
-        g2 *= -c1.getData().getWK();
-        xi.xi[k] += real(g2);
-        xi.xi_im[k] += imag(g2);
+    long npairs = 0;
+    for (size_t t=0; t<corr->_thread_accums.size(); ++t)
+        npairs += corr->_thread_accums[t]->_recorded.size();
+    list->pairs.reserve(npairs);
+    for (size_t t=0; t<corr->_thread_accums.size(); ++t) {
+        std::vector<RecordedPair>& recorded = corr->_thread_accums[t]->_recorded;
+        for (size_t n=0; n<recorded.size(); ++n) {
+            const RecordedPair& p = recorded[n];
+            list->pairs.push_back(Interaction(index1.find(p.c1), index2.find(p.c2), p));
+        }
+        std::vector<RecordedPair>().swap(recorded);
     }
-};
+    dbg<<"Recorded "<<list->pairs.size()<<" pairs of cells\n";
+    return list;
+}
 
-template <>
-struct DirectHelper<GData,GData>
+template <int D1, int D2, int B> template <int C>
+BinnedCorr2<D1,D2,B>* BinnedCorr2<D1,D2,B>::checkList(
+    const InteractionList& list, const std::vector<const Cell<D1,C>*>& cells1,
+    const std::vector<const Cell<D2,C>*>& cells2)
 {
-    template <int C>
-    static void ProcessXi(
-        const Cell<GData,C>& c1, const Cell<GData,C>& c2, const double rsq,
-        XiData<GData,GData>& xi, int k, int k2)
-    {
-        std::complex<double> g1, g2;
-        ProjectHelper<C>::ProjectShears(c1,c2,g1,g2);
-
-        // The complex products g1 g2 and g1 g2* share most of the calculations,
-        // so faster to do this manually.
-        double g1rg2r = g1.real() * g2.real();
-        double g1rg2i = g1.real() * g2.imag();
-        double g1ig2r = g1.imag() * g2.real();
-        double g1ig2i = g1.imag() * g2.imag();
-
-        xi.xip[k] += g1rg2r + g1ig2i;       // g1 * conj(g2)
-        xi.xip_im[k] += g1ig2r - g1rg2i;
-        xi.xim[k] += g1rg2r - g1ig2i;       // g1 * g2
-        xi.xim_im[k] += g1ig2r + g1rg2i;
+    if (list.nbins != _nbins || list.minsep != _minsep || list.maxsep != _maxsep ||
+        list.b != _b)
+        throw std::runtime_error("The interaction list was recorded with different binning");
+    if (TreeSignature(cells1) != list.sig1 || TreeSignature(cells2) != list.sig2)
+        throw std::runtime_error("The fields do not have the trees of the interaction list");
 
-        if (k2 != -1) {
-            xi.xip[k2] += g1rg2r + g1ig2i;       // g1 * conj(g2)
-            xi.xip_im[k2] += g1ig2r - g1rg2i;
-            xi.xim[k2] += g1rg2r - g1ig2i;       // g1 * g2
-            xi.xim_im[k2] += g1ig2r + g1rg2i;
-        }
-    }
-};
+    // The bins and r values of a list recorded in chord space need the chord-space copy.
+    BinnedCorr2<D1,D2,B>* corr = list.chord ? getChordCorr() : this;
+    if (!corr) throw std::runtime_error("The interaction list needs fast_bins");
+    corr->_coords = C;
+    return corr;
+}
 
 template <int D1, int D2, int B> template <int C>
-void BinnedCorr2<D1,D2,B>::directProcess11(
-    const Cell<D1,C>& c1, const Cell<D2,C>& c2, const double rsq, bool do_reverse,
-    int k, double r, double logr)
+void BinnedCorr2<D1,D2,B>::replay(
+    const InteractionList& list, const Field<D1,C>& field1, const Field<D2,C>& field2,
+    bool dots)
 {
-    xdbg<<"DirectProcess11: rsq = "<<rsq<<std::endl;
-    XAssert(rsq >= _minsepsq);
-    XAssert(rsq < _fullmaxsepsq);
-    // Note that most of these XAsserts around are still hardcoded for Log binning and Euclidean
-    // metric.  If turning on verbose>=3, these could fail.
-    XAssert(c1.getSize()+c2.getSize() < sqrt(rsq)*_b + 0.0001);
-
-    XAssert(_binsize != 0.);
-    const Position<C>& p1 = c1.getPos();
-    const Position<C>& p2 = c2.getPos();
-    if (k < 0) {
-        r = sqrt(rsq);
-        logr = log(r);
-        Assert(logr >= _logminsep);
-        k = BinTypeHelper<B>::calculateBinK(p1, p2, r, logr, _binsize,
-                                            _minsep, _maxsep, _logminsep);
-    } else {
-        XAssert(std::abs(r - sqrt(rsq)) < 1.e-10*r);
-        XAssert(std::abs(logr - 0.5*log(rsq)) < 1.e-10);
-        XAssert(k == BinTypeHelper<B>::calculateBinK(p1, p2, r, logr, _binsize,
-                                                     _minsep, _maxsep, _logminsep));
-    }
-    Assert(k >= 0);
-    Assert(k <= _nbins);
-    // It's possible for k to be == _nbins here if the r is very close to the top of the
-    // last bin, but numerical rounding in the log calculation bumped k into the next
-    // (non-existent) bin.
-    if (k == _nbins) {
-        XAssert(BinTypeHelper<B>::calculateBinK(p2, p1, r, logr-1.e-10, _binsize,
-                                                _minsep, _maxsep, _logminsep) == _nbins-1);
-        --k;
-    }
-    Assert(k < _nbins);
-    xdbg<<"r,logr,k = "<<r<<','<<logr<<','<<k<<std::endl;
+    dbg<<"Start replay: C = "<<C<<std::endl;
+    Assert(_coords == -1 || _coords == C);
+    _coords = C;
+    std::vector<const Cell<D1,C>*> cells1;
+    std::vector<const Cell<D2,C>*> cells2;
+    CollectCells(field1.getCells(), cells1);
+    CollectCells(field2.getCells(), cells2);
+    BinnedCorr2<D1,D2,B>* corr = checkList(list, cells1, cells2);
 
-    double nn = double(c1.getN()) * double(c2.getN());
-    _npairs[k] += nn;
+    const long npairs = list.pairs.size();
+#ifdef _OPENMP
+    const int nthreads = omp_get_max_threads();
+#else
+    const int nthreads = 1;
+#endif
+    GetThreadAccumulators(corr->_thread_accums, *corr, nthreads);
 
-    double ww = double(c1.getW()) * double(c2.getW());
-    _meanr[k] += ww * r;
-    _meanlogr[k] += ww * logr;
-    _weight[k] += ww;
-    xdbg<<"n,w = "<<nn<<','<<ww<<" ==>  "<<_npairs[k]<<','<<_weight[k]<<std::endl;
+#ifdef _OPENMP
+#pragma omp parallel
+    {
+        BinnedCorr2<D1,D2,B>& bc2 = *corr->_thread_accums[omp_get_thread_num()];
+#else
+        BinnedCorr2<D1,D2,B>& bc2 = *corr->_thread_accums[0];
+#endif
+        bc2.clear();
+        bc2._recording = false;
+        TraversalStats& stats = bc2._stats;
+        stats[TraversalStats::NTHREADS] = 1.;
 
-    int k2 = -1;
-    if (do_reverse) {
-        k2 = BinTypeHelper<B>::calculateBinK(p2, p1, r, logr, _binsize,
-                                             _minsep, _maxsep, _logminsep);
-        if (k == _nbins) --k;  // As before, this can (rarely) happen.
-        Assert(k2 >= 0);
-        Assert(k2 < _nbins);
-        _npairs[k2] += nn;
-        _meanr[k2] += ww * r;
-        _meanlogr[k2] += ww * logr;
-        _weight[k2] += ww;
+        // The pairs are just added to the bins in order, so there's no need for dynamic
+        // scheduling here.
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+        for (long n=0; n<npairs; ++n) {
+            const Interaction& p = list.pairs[n];
+            Assert(p.i1 < long(cells1.size()) && p.i2 < long(cells2.size()));
+            bc2.directProcess11(*cells1[p.i1], *cells2[p.i2], p.rsq, p.do_reverse,
+                                p.k, p.r, p.logr);
+        }
+        bc2.flushPairs();
+#ifdef _OPENMP
+        TreeReduce(corr->_thread_accums);
     }
-
-    DirectHelper<D1,D2>::template ProcessXi<C>(c1,c2,rsq,_xi,k,k2);
+#endif
+    *corr += *corr->_thread_accums[0];
+    if (_stats_out) corr->_thread_accums[0]->_stats.addTo(_stats_out);
+    if (dots) std::cout<<'.'<<std::endl;
 }
 
 template <int D1, int D2, int B>
-void BinnedCorr2<D1,D2,B>::operator=(const BinnedCorr2<D1,D2,B>& rhs)
+void BinnedCorr2<D1,D2,B>::copyResults(
+    double* xi0, double* xi1, double* xi2, double* xi3,
+    double* meanr, double* meanlogr, double* weight, double* npairs) const
 {
-    Assert(rhs._nbins == _nbins);
-    _xi.copy(rhs._xi,_nbins);
-    for (int i=0; i<_nbins; ++i) _meanr[i] = rhs._meanr[i];
-    for (int i=0; i<_nbins; ++i) _meanlogr[i] = rhs._meanlogr[i];
-    for (int i=0; i<_nbins; ++i) _weight[i] = rhs._weight[i];
-    for (int i=0; i<_nbins; ++i) _npairs[i] = rhs._npairs[i];
+    Assert(!_bins);
+    XiData<D1,D2> xi(xi0, xi1, xi2, xi3);
+#ifdef _OPENMP
+#pragma omp critical (TreeCorr_results)
+#endif
+    {
+        xi.clear(_nbins);
+        xi.add(_xi, _nbins);
+        std::copy(_meanr, _meanr + _nbins, meanr);
+        std::copy(_meanlogr, _meanlogr + _nbins, meanlogr);
+        std::copy(_weight, _weight + _nbins, weight);
+        std::copy(_npairs, _npairs + _nbins, npairs);
+    }
 }
 
 template <int D1, int D2, int B>
-void BinnedCorr2<D1,D2,B>::operator+=(const BinnedCorr2<D1,D2,B>& rhs)
+void BinnedCorr2<D1,D2,B>::flushTo(BinnedCorr2<D1,D2,B>& out)
 {
-    Assert(rhs._nbins == _nbins);
-    _xi.add(rhs._xi,_nbins);
-    for (int i=0; i<_nbins; ++i) _meanr[i] += rhs._meanr[i];
-    for (int i=0; i<_nbins; ++i) _meanlogr[i] += rhs._meanlogr[i];
-    for (int i=0; i<_nbins; ++i) _weight[i] += rhs._weight[i];
-    for (int i=0; i<_nbins; ++i) _npairs[i] += rhs._npairs[i];
+    Assert(_bins);
+    flushPairs();
+#ifdef _OPENMP
+#pragma omp critical (patch_results)
+#endif
+    out += *this;
+    // Reset the bins, but not the stats.
+    _bins->clear();
 }
 
 template <int D1, int D2, int B> template <int C, int M>
-long BinnedCorr2<D1,D2,B>::samplePairs(
-    const Field<D1, C>& field1, const Field<D2, C>& field2,
-    double minsep, double maxsep, long* i1, long* i2, double* sep, int n)
+void BinnedCorr2<D1,D2,B>::processItems(
+    const std::vector<Cell<D1,C>*>& cells1, const std::vector<Cell<D2,C>*>& cells2,
+    std::vector<WorkItem>& items, bool do_reverse, bool dots, bool in_order)
 {
-    Assert(_coords == -1 || _coords == C);
-    _coords = C;
-    const long n1 = field1.getNTopLevel();
-    const long n2 = field2.getNTopLevel();
-    dbg<<"field1 has "<<n1<<" top level nodes\n";
-    dbg<<"field2 has "<<n2<<" top level nodes\n";
-    Assert(n1 > 0);
-    Assert(n2 > 0);
+    PartitionItems(items, _rank, _nranks);
 
-    MetricHelper<M> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
+    // If checkpointing, skip any items that were already done according to the file.
+    std::vector<double> key;
+    if (_checkpoint.active()) {
+        // Everything that changes which pairs go in which bins, or what is accumulated.
+        const double params[] = {
+            D1, D2, B, C, M, double(_nbins), _minsep, _maxsep, _binsize, _b,
+            _minrpar, _maxrpar, _xp, _yp, _zp, double(_leaf_size), _splitfactorsq,
+            double(_logbins.active()), double(_skip_meanlogr), double(_unit_weights),
+            double(_chord), double(do_reverse), double(items.size()) };
+        // (Not key.assign, which gets a spurious -Wnonnull warning from gcc 12 with -O3.)
+        const int nparams = sizeof(params)/sizeof(double);
+        key.reserve(nparams);
+        for (int i=0; i<nparams; ++i) key.push_back(params[i]);
+        AddCellsToKey(cells1, key);
+        AddCellsToKey(cells2, key);
+    }
+    Checkpointer<BinnedCorr2<D1,D2,B> > ckpt(_checkpoint, *this, key);
+    std::set<ItemId> done = ckpt.resume(*this);
+    if (done.size() > 0) {
+        dbg<<"Resuming with "<<done.size()<<" items already done\n";
+        std::vector<WorkItem> todo;
+        todo.reserve(items.size());
+        for (size_t n=0; n<items.size(); ++n)
+            if (!done.count(ItemId(items[n].i, items[n].j))) todo.push_back(items[n]);
+        items.swap(todo);
+    }
 
-    double minsepsq = minsep*minsep;
-    double maxsepsq = maxsep*maxsep;
+    if (_budget.active()) {
+        // In progressive mode, do the items in a random order, so the ones that get done
+        // before we run out of budget are a fair sample of all of them.
+        URandInt gen;
+        std::random_shuffle(items.begin(), items.end(), gen);
+    } else if (in_order) {
+        // The items are in order of the top-level cells in cells1, and for each of these, the
+        // nearby cells in cells2.  The top-level cells are themselves in spatial order, so the
+        // items that are done at around the same time mostly use the same cells.  When the
+        // cells are spilled to disk, this keeps the pages they need in the page cache, rather
+        // than jumping all over the trees.
+        dbg<<"Doing items in order for locality\n";
+    } else {
+        // Do the most expensive items first, so the cheap ones can fill in the gaps at the end.
+        std::stable_sort(items.begin(), items.end());
+    }
+    const long nitems = items.size();
+    BudgetTracker tracker(_budget, nitems);
+    double total_cost = 0.;
+    for (long n=0;n<nitems;++n) total_cost += items[n].cost;
+    dbg<<"Process "<<nitems<<" items with total cost "<<total_cost<<std::endl;
+    // Write about one dot per top-level cell in cells1, as we used to do.
+    const long dot_step = std::max(1L, nitems / long(cells1.size()));
 
-    long k=0;
-    for (long i=0;i<n1;++i) {
-        const Cell<D1,C>& c1 = *field1.getCells()[i];
-        for (long j=0;j<n2;++j) {
-            const Cell<D2,C>& c2 = *field2.getCells()[j];
-            samplePairs(c1, c2, metric, minsep, minsepsq, maxsep, maxsepsq, i1, i2, sep, n, k);
+    // All the pairs are accumulated in the per-thread accumulators, even without OpenMP,
+    // since they use the PairBin layout, which is faster to fill in.
+#ifdef _OPENMP
+    const int nthreads = omp_get_max_threads();
+#else
+    const int nthreads = 1;
+#endif
+    GetThreadAccumulators(_thread_accums, *this, nthreads);
+    // If a single item is a significant fraction of the total, split it into tasks.
+    const double task_min = std::max(total_cost / (16. * nthreads), TASK_MIN_COST);
+
+    // Without a checkpoint file or publish_interval, this is a single chunk with all the items.
+    std::vector<char> finished(nitems, 0);
+    long end;
+    for (long start=0; start<nitems; start=end) {
+        end = start + ckpt.nextChunk(nitems-start, nthreads);
+        const double t0 = WallTime();
+        processChunk<C,M>(cells1, cells2, items, start, end, do_reverse, dots, dot_step,
+                          task_min, tracker, finished);
+        std::vector<ItemId> ids;
+        long nfinished = 0;
+        for (long n=start; n<end; ++n) {
+            if (!finished[n]) continue;
+            ++nfinished;
+            if (ckpt.active()) ids.push_back(ItemId(items[n].i, items[n].j));
         }
+        ckpt.add(*_thread_accums[0], ids, nfinished, WallTime() - t0);
+        // Add the results to the output arrays, where copyResults may be looking at them.
+#ifdef _OPENMP
+#pragma omp critical (TreeCorr_results)
+#endif
+        *this += *_thread_accums[0];
     }
-    return k;
+    ckpt.finish();
+    tracker.finish();
+    if (dots) std::cout<<std::endl;
 }
 
 template <int D1, int D2, int B> template <int C, int M>
-void BinnedCorr2<D1,D2,B>::samplePairs(
-    const Cell<D1, C>& c1, const Cell<D2, C>& c2, const MetricHelper<M>& metric,
-    double minsep, double minsepsq, double maxsep, double maxsepsq,
-    long* i1, long* i2, double* sep, int n, long& k)
+void BinnedCorr2<D1,D2,B>::processChunk(
+    const std::vector<Cell<D1,C>*>& cells1, const std::vector<Cell<D2,C>*>& cells2,
+    const std::vector<WorkItem>& items, long start, long end,
+    bool do_reverse, bool dots, long dot_step, double task_min,
+    BudgetTracker& tracker, std::vector<char>& finished)
 {
-    // This tracks process11, but we only select pairs at the end, not call directProcess11
-    xdbg<<"Start samplePairs for "<<c1.getPos()<<",  "<<c2.getPos()<<"   ";
-    xdbg<<"w = "<<c1.getW()<<", "<<c2.getW()<<std::endl;
-    if (c1.getW() == 0. || c2.getW() == 0.) return;
+    const int ndomains = GetNumaDomains();
+    DomainQueue* queue = ndomains > 1 ? new DomainQueue(ndomains, items, start, end) : 0;
+#ifdef _OPENMP
+#pragma omp parallel
+    {
+        // Give each thread their own copy of the data vector to fill in.
+        BinnedCorr2<D1,D2,B>& bc2 = *_thread_accums[omp_get_thread_num()];
+        bc2.clear();
+        bc2._thread_corrs = omp_get_num_threads() > 1 ? &_thread_accums : 0;
+        bc2._task_min = task_min;
+        bc2._recording = _recording;
+        // Make sure all the accumulators are ready before any tasks might use them.
+#pragma omp barrier
+#else
+        BinnedCorr2<D1,D2,B>& bc2 = *_thread_accums[0];
+        bc2.clear();
+        bc2._recording = _recording;
+#endif
 
-    const Position<C>& p1 = c1.getPos();
-    const Position<C>& p2 = c2.getPos();
-    double s1 = c1.getSize(); // May be modified by DistSq function.
-    double s2 = c2.getSize(); // "
-    xdbg<<"s1,s2 = "<<s1<<','<<s2<<std::endl;
-    xdbg<<"M,C = "<<M<<"  "<<C<<std::endl;
-    const double rsq = metric.DistSq(p1, p2, s1, s2);
-    xdbg<<"rsq = "<<rsq<<std::endl;
-    xdbg<<"s1,s2 => "<<s1<<','<<s2<<std::endl;
-    const double s1ps2 = s1+s2;
+        // Inside the omp parallel, so each thread has its own MetricHelper.
+        MetricHelper<M> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
+        TraversalStats& stats = bc2._stats;
+        stats[TraversalStats::NTHREADS] = 1.;
+        const int domain = CurrentThreadDomain(ndomains);
 
-    double rpar = 0; // Gets set to correct value by this function if appropriate
-    if (metric.isRParOutsideRange(p1, p2, s1ps2, rpar)) {
-        return;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (long m=start;m<end;++m) {
+            if (dots && m % dot_step == 0) {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+                std::cout<<'.'<<std::flush;
+            }
+            const long n = queue ? queue->next(domain) : m;
+            const WorkItem& item = items[n];
+            xdbg<<"item "<<n<<": "<<item.i<<" "<<item.j<<" "<<item.cost<<std::endl;
+            // The cost is our estimate of the number of pairs that need to be done.
+            if (!tracker.start(item.cost)) continue;
+            TraceScope trace("process2 item", n);
+            const double t0 = WallTime();
+            const Cell<D1,C>& c1 = *cells1[item.i];
+            if (item.j < 0) {
+                ProcessHelper<D1,D2,B,C,M>::process2(bc2, c1, metric);
+            } else {
+                const Cell<D2,C>& c2 = *cells2[item.j];
+                bc2.template process11<C,M>(c1, c2, metric, do_reverse);
+            }
+            stats.finishItem(WallTime() - t0);
+            finished[n] = 1;
+        }
+        stats[TraversalStats::MAX_THREAD_TIME] = stats[TraversalStats::ITEM_TIME];
+        // The barrier at the end of the for loop also waits for all the tasks to finish,
+        // so now we can accumulate the results.
+        bc2.flushPairs();
+#ifdef _OPENMP
+        TreeReduce(_thread_accums);
     }
-    xdbg<<"RPar in range\n";
+#endif
+    delete queue;
+    if (_stats_out) _thread_accums[0]->_stats.addTo(_stats_out);
+}
 
-    if (BinTypeHelper<B>::tooSmallDist(rsq, s1ps2, minsep, minsepsq) &&
-        metric.tooSmallDist(p1, p2, rsq, rpar, s1ps2, minsep, minsepsq)) {
-        return;
+template <int D1, int D2, int B> template <int C, int M>
+void BinnedCorr2<D1,D2,B>::spawnProcess2(const Cell<D1,C>& c12)
+{
+#ifdef _OPENMP
+    const Cell<D1,C>* p12 = &c12;
+    std::vector<BinnedCorr2<D1,D2,B>*>* corrs = _thread_corrs;
+    ++_stats[TraversalStats::TASKS];
+#pragma omp task firstprivate(p12, corrs)
+    {
+        BinnedCorr2<D1,D2,B>& bc2 = *(*corrs)[omp_get_thread_num()];
+        // The MetricHelper isn't thread safe, so each task needs its own.
+        MetricHelper<M> metric(bc2._minrpar, bc2._maxrpar, bc2._xp, bc2._yp, bc2._zp);
+        bc2.template process2<C,M>(*p12, metric);
     }
-    xdbg<<"Not too small separation\n";
+#endif
+}
 
-    if (BinTypeHelper<B>::tooLargeDist(rsq, s1ps2, maxsep, maxsepsq) &&
-        metric.tooLargeDist(p1, p2, rsq, rpar, s1ps2, maxsep, maxsepsq)) {
-        return;
+template <int D1, int D2, int B> template <int C, int M>
+void BinnedCorr2<D1,D2,B>::spawnProcess11(const Cell<D1,C>& c1, const Cell<D2,C>& c2,
+                                          bool do_reverse)
+{
+#ifdef _OPENMP
+    const Cell<D1,C>* p1 = &c1;
+    const Cell<D2,C>* p2 = &c2;
+    std::vector<BinnedCorr2<D1,D2,B>*>* corrs = _thread_corrs;
+    ++_stats[TraversalStats::TASKS];
+#pragma omp task firstprivate(p1, p2, corrs, do_reverse)
+    {
+        BinnedCorr2<D1,D2,B>& bc2 = *(*corrs)[omp_get_thread_num()];
+        MetricHelper<M> metric(bc2._minrpar, bc2._maxrpar, bc2._xp, bc2._yp, bc2._zp);
+        bc2.template process11<C,M>(*p1, *p2, metric, do_reverse);
     }
-    xdbg<<"Not too large separation\n";
+#endif
+}
 
-    // Now check if these cells are small enough that it is ok to drop into a single bin.
-    int kk=-1;
-    double r=0,logr=0;  // If singleBin is true, these values are set for use by directProcess11
-    if (metric.isRParInsideRange(p1, p2, s1ps2, rpar) &&
-        BinTypeHelper<B>::singleBin(rsq, s1ps2, p1, p2, _binsize, _b, _bsq,
-                                    _minsep, _maxsep, _logminsep, kk, r, logr))
-    {
-        xdbg<<"Drop into single bin.\n";
-        xdbg<<"rsq = "<<rsq<<std::endl;
-        xdbg<<"minsepsq = "<<minsepsq<<std::endl;
-        xdbg<<"maxsepsq = "<<maxsepsq<<std::endl;
-        if (BinTypeHelper<B>::isRSqInRange(rsq, p1, p2, minsep, minsepsq, maxsep, maxsepsq)) {
-            sampleFrom(c1,c2,rsq,r,i1,i2,sep,n,k);
+template <int D1, int D2, int B> template <int C, int M>
+void BinnedCorr2<D1,D2,B>::processPairwise(
+    const SimpleField<D1,C>& field1, const SimpleField<D2,C>& field2, bool dots)
+{
+    Assert(_coords == -1 || _coords == C);
+    _coords = C;
+    const long nobj = field1.getNObj();
+    const long nobj2 = field2.getNObj();
+    xdbg<<"field1 has "<<nobj<<" objects\n";
+    xdbg<<"field2 has "<<nobj2<<" objects\n";
+    Assert(nobj > 0);
+    Assert(nobj == nobj2);
+
+    const long sqrtn = long(sqrt(double(nobj)));
+
+#ifdef _OPENMP
+    GetThreadAccumulators(_thread_accums, *this, omp_get_max_threads());
+#pragma omp parallel
+    {
+        // Give each thread their own copy of the data vector to fill in.
+        BinnedCorr2<D1,D2,B>& bc2 = *_thread_accums[omp_get_thread_num()];
+        bc2.clear();
+#else
+        GetThreadAccumulators(_thread_accums, *this, 1);
+        BinnedCorr2<D1,D2,B>& bc2 = *_thread_accums[0];
+        bc2.clear();
+#endif
+
+        MetricHelper<M> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+        for (long i=0;i<nobj;++i) {
+            // Let the progress dots happen every sqrt(n) iterations.
+            if (dots && (i % sqrtn == 0)) {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+                {
+#ifdef _OPENMP
+                    xdbg<<omp_get_thread_num()<<" "<<i<<std::endl;
+#endif
+                    std::cout<<'.'<<std::flush;
+                }
+            }
+            const Cell<D1,C>& c1 = *field1.getCells()[i];
+            const Cell<D2,C>& c2 = *field2.getCells()[i];
+            const Position<C>& p1 = c1.getPos();
+            const Position<C>& p2 = c2.getPos();
+            double s=0.;
+            const double rsq = metric.DistSq(p1, p2, s, s);
+            if (BinTypeHelper<B>::isRSqInRange(rsq, p1, p2,
+                                               _minsep, _minsepsq, _maxsep, _maxsepsq)) {
+                bc2.template directProcess11(c1,c2,rsq,false);
+            }
+        }
+        bc2.flushPairs();
+#ifdef _OPENMP
+        // Accumulate the results
+        TreeReduce(_thread_accums);
+    }
+#endif
+    *this += *_thread_accums[0];
+    if (_stats_out) _thread_accums[0]->_stats.addTo(_stats_out);
+    if (dots) std::cout<<std::endl;
+}
+
+template <int D1, int D2, int B> template <int C, int M>
+void BinnedCorr2<D1,D2,B>::processPairwiseArrays(
+    const ObjectArrays& obj1, const ObjectArrays& obj2, long nobj, bool dots)
+{
+    Assert(_coords == -1 || _coords == C);
+    _coords = C;
+    xdbg<<"processPairwiseArrays with "<<nobj<<" objects\n";
+    Assert(nobj > 0);
+    if (!obj1.z || !obj2.z) Assert(C == Flat);
+
+    const int bsize = PairBuffer::SIZE;
+    const long nblocks = (nobj-1) / bsize + 1;
+    const long sqrtn = long(sqrt(double(nblocks)));
+
+#ifdef _OPENMP
+    GetThreadAccumulators(_thread_accums, *this, omp_get_max_threads());
+#pragma omp parallel
+    {
+        BinnedCorr2<D1,D2,B>& bc2 = *_thread_accums[omp_get_thread_num()];
+        bc2.clear();
+#else
+        GetThreadAccumulators(_thread_accums, *this, 1);
+        BinnedCorr2<D1,D2,B>& bc2 = *_thread_accums[0];
+        bc2.clear();
+#endif
+
+        MetricHelper<M> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
+        std::vector<CellData<D1,C> > data1(bsize);
+        std::vector<CellData<D2,C> > data2(bsize);
+        std::vector<double> rsq(bsize);
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+        for (long blk=0; blk<nblocks; ++blk) {
+            if (dots && (blk % sqrtn == 0)) {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+                {
+                    std::cout<<'.'<<std::flush;
+                }
+            }
+            const long start = blk * bsize;
+            const int n = int(std::min(long(bsize), nobj - start));
+            const ObjectArrays& a1 = obj1;
+            const ObjectArrays& a2 = obj2;
+            for (int i=0; i<n; ++i) {
+                const long j = start + i;
+                CellDataHelper<D1,C>::build(a1.x[j], a1.y[j], a1.z ? a1.z[j] : 0.,
+                                            a1.g1[j], a1.g2[j], a1.k[j], a1.w[j], &data1[i]);
+                CellDataHelper<D2,C>::build(a2.x[j], a2.y[j], a2.z ? a2.z[j] : 0.,
+                                            a2.g1[j], a2.g2[j], a2.k[j], a2.w[j], &data2[i]);
+            }
+            for (int i=0; i<n; ++i) {
+                double s=0.;
+                rsq[i] = metric.DistSq(data1[i].getPos(), data2[i].getPos(), s, s);
+            }
+            for (int i=0; i<n; ++i) {
+                if (BinTypeHelper<B>::isRSqInRange(rsq[i], data1[i].getPos(), data2[i].getPos(),
+                                                   _minsep, _minsepsq, _maxsep, _maxsepsq)) {
+                    bc2.template directProcessData<C>(data1[i], data2[i], rsq[i], false);
+                }
+            }
+        }
+        bc2.flushPairs();
+#ifdef _OPENMP
+        TreeReduce(_thread_accums);
+    }
+#endif
+    *this += *_thread_accums[0];
+    if (_stats_out) _thread_accums[0]->_stats.addTo(_stats_out);
+    if (dots) std::cout<<std::endl;
+}
+
+template <int D1, int D2, int B> template <int C, int M>
+void BinnedCorr2<D1,D2,B>::process2(const Cell<D1,C>& c12, const MetricHelper<M>& metric)
+{
+    if (c12.getW() == 0.) return;
+    ++_stats[TraversalStats::NODES];
+    if (c12.getSize() <= _halfminsep) return;
+
+    Assert(c12.getLeft());
+    Assert(c12.getRight());
+    if (_thread_corrs) {
+        double n = c12.getN();
+        if (PairCost(0.5*n*n, 2.*c12.getSize(), _fullmaxsep) > _task_min) {
+            // Let other threads help with big cells.
+            spawnProcess2<C,M>(*c12.getLeft());
+            spawnProcess2<C,M>(*c12.getRight());
+            spawnProcess11<C,M>(*c12.getLeft(), *c12.getRight(), BinTypeHelper<B>::doReverse());
+            return;
+        }
+    }
+    process2<C,M>(*c12.getLeft(), metric);
+    process2<C,M>(*c12.getRight(), metric);
+    process11<C,M>(*c12.getLeft(), *c12.getRight(), metric, BinTypeHelper<B>::doReverse());
+}
+
+template <int D1, int D2, int B> template <int C, int M>
+void BinnedCorr2<D1,D2,B>::process11(const Cell<D1,C>& c1, const Cell<D2,C>& c2,
+                                     const MetricHelper<M>& metric, bool do_reverse)
+{
+    //set_verbose(2);
+    xdbg<<"Start process11 for "<<c1.getPos()<<",  "<<c2.getPos()<<"   ";
+    xdbg<<"w = "<<c1.getW()<<", "<<c2.getW()<<std::endl;
+    if (c1.getW() == 0. || c2.getW() == 0.) return;
+    ++_stats[TraversalStats::NODES];
+
+    const Position<C>& p1 = c1.getPos();
+    const Position<C>& p2 = c2.getPos();
+    double s1 = c1.getSize(); // May be modified by DistSq function.
+    double s2 = c2.getSize(); // "
+    xdbg<<"s1,s2 = "<<s1<<','<<s2<<std::endl;
+    xdbg<<"M,C = "<<M<<"  "<<C<<std::endl;
+    double rsq;
+    double rpar = 0; // Gets set to correct value by this function if appropriate
+    const bool in_rpar = FusedMetric<M,C>::distSqInRPar(metric, p1, p2, s1, s2, rsq, rpar);
+    xdbg<<"rsq = "<<rsq<<std::endl;
+    xdbg<<"s1,s2 => "<<s1<<','<<s2<<std::endl;
+    const double s1ps2 = s1+s2;
+
+    if (!in_rpar) {
+        ++_stats[TraversalStats::RPAR_EXIT];
+        return;
+    }
+    xdbg<<"RPar in range\n";
+
+    if (BinTypeHelper<B>::tooSmallDist(rsq, s1ps2, _minsep, _minsepsq) &&
+        metric.tooSmallDist(p1, p2, rsq, rpar, s1ps2, _minsep, _minsepsq)) {
+        ++_stats[TraversalStats::SMALL_EXIT];
+        return;
+    }
+    xdbg<<"Not too small separation\n";
+
+    if (BinTypeHelper<B>::tooLargeDist(rsq, s1ps2, _maxsep, _maxsepsq) &&
+        metric.tooLargeDist(p1, p2, rsq, rpar, s1ps2, _fullmaxsep, _fullmaxsepsq)) {
+        ++_stats[TraversalStats::LARGE_EXIT];
+        return;
+    }
+    xdbg<<"Not too large separation\n";
+
+    // Now check if these cells are small enough that it is ok to drop into a single bin.
+    int k=-1;
+    double r=0,logr=0;  // If singleBin is true, these values are set for use by directProcess11
+    if (metric.isRParInsideRange(p1, p2, s1ps2, rpar) &&
+        singleBin(rsq, s1ps2, p1, p2, k, r, logr))
+    {
+        xdbg<<"Drop into single bin.\n";
+        ++_stats[TraversalStats::SINGLE_BIN];
+        if (BinTypeHelper<B>::isRSqInRange(rsq, p1, p2, _minsep, _minsepsq, _maxsep, _maxsepsq)) {
+            directProcess11(c1,c2,rsq,do_reverse,k,r,logr);
         }
     } else {
         xdbg<<"Need to split.\n";
+        if (c1.getN() <= _leaf_size && c2.getN() <= _leaf_size) {
+            // Both cells are small enough that it is faster to just do all the pairs
+            // of leaves directly than to keep recursing.
+            xdbg<<"Process leaves directly.\n";
+            processLeaves<C,M>(c1,c2,metric,do_reverse);
+            return;
+        }
         bool split1=false, split2=false;
         double bsq_eff = BinTypeHelper<B>::getEffectiveBSq(rsq,_bsq);
-        CalcSplitSq(split1,split2,s1,s2,s1ps2,bsq_eff);
+        xdbg<<"bsq_eff = "<<bsq_eff<<std::endl;
+        CalcSplitSq(split1,split2,s1,s2,s1ps2,bsq_eff,_splitfactorsq);
         xdbg<<"rsq = "<<rsq<<", s1ps2 = "<<s1ps2<<"  ";
         xdbg<<"s1ps2 / r = "<<s1ps2 / sqrt(rsq)<<", b = "<<_b<<"  ";
         xdbg<<"split = "<<split1<<','<<split2<<std::endl;
+        ++_stats[split1 && split2 ? TraversalStats::SPLIT_MULTI :
+                 split1 ? TraversalStats::SPLIT1 : TraversalStats::SPLIT2];
 
-        if (split1 && split2) {
+        if (_thread_corrs &&
+            PairCost(double(c1.getN()) * double(c2.getN()), s1ps2, _fullmaxsep) > _task_min) {
+            // Let other threads help with big pairs.
+            if (split1 && split2) {
+                spawnProcess11<C,M>(*c1.getLeft(),*c2.getLeft(),do_reverse);
+                spawnProcess11<C,M>(*c1.getLeft(),*c2.getRight(),do_reverse);
+                spawnProcess11<C,M>(*c1.getRight(),*c2.getLeft(),do_reverse);
+                spawnProcess11<C,M>(*c1.getRight(),*c2.getRight(),do_reverse);
+            } else if (split1) {
+                spawnProcess11<C,M>(*c1.getLeft(),c2,do_reverse);
+                spawnProcess11<C,M>(*c1.getRight(),c2,do_reverse);
+            } else {
+                spawnProcess11<C,M>(c1,*c2.getLeft(),do_reverse);
+                spawnProcess11<C,M>(c1,*c2.getRight(),do_reverse);
+            }
+        } else if (split1 && split2) {
             Assert(c1.getLeft());
             Assert(c1.getRight());
             Assert(c2.getLeft());
             Assert(c2.getRight());
-            samplePairs<C,M>(*c1.getLeft(), *c2.getLeft(), metric,
-                             minsep, minsepsq, maxsep, maxsepsq, i1, i2, sep, n, k);
-            samplePairs<C,M>(*c1.getLeft(), *c2.getRight(), metric,
-                             minsep, minsepsq, maxsep, maxsepsq, i1, i2, sep, n, k);
-            samplePairs<C,M>(*c1.getRight(), *c2.getLeft(), metric,
-                             minsep, minsepsq, maxsep, maxsepsq, i1, i2, sep, n, k);
-            samplePairs<C,M>(*c1.getRight(), *c2.getRight(), metric,
-                             minsep, minsepsq, maxsep, maxsepsq, i1, i2, sep, n, k);
+            process11<C,M>(*c1.getLeft(),*c2.getLeft(),metric,do_reverse);
+            process11<C,M>(*c1.getLeft(),*c2.getRight(),metric,do_reverse);
+            process11<C,M>(*c1.getRight(),*c2.getLeft(),metric,do_reverse);
+            process11<C,M>(*c1.getRight(),*c2.getRight(),metric,do_reverse);
         } else if (split1) {
             Assert(c1.getLeft());
             Assert(c1.getRight());
-            samplePairs<C,M>(*c1.getLeft(), c2, metric,
-                             minsep, minsepsq, maxsep, maxsepsq, i1, i2, sep, n, k);
-            samplePairs<C,M>(*c1.getRight(), c2, metric,
-                             minsep, minsepsq, maxsep, maxsepsq, i1, i2, sep, n, k);
+            process11<C,M>(*c1.getLeft(),c2,metric,do_reverse);
+            process11<C,M>(*c1.getRight(),c2,metric,do_reverse);
         } else {
             Assert(split2);
             Assert(c2.getLeft());
             Assert(c2.getRight());
-            samplePairs<C,M>(c1, *c2.getLeft(), metric,
-                             minsep, minsepsq, maxsep, maxsepsq, i1, i2, sep, n, k);
-            samplePairs<C,M>(c1, *c2.getRight(), metric,
-                             minsep, minsepsq, maxsep, maxsepsq, i1, i2, sep, n, k);
+            process11<C,M>(c1,*c2.getLeft(),metric,do_reverse);
+            process11<C,M>(c1,*c2.getRight(),metric,do_reverse);
         }
     }
 }
 
-void SelectRandomFrom(long m, std::vector<long>& selection)
+
+// Collect all the leaves of a cell with non-zero weight.
+template <int D, int C>
+void CollectLeaves(const Cell<D,C>& c, std::vector<const void*>& leaves)
 {
-    xdbg<<"SelectRandomFrom("<<m<<", "<<selection.size()<<")\n";
-    long n = selection.size();
-    // There are two algorithms here.
-    // Floyd's algorithm is efficient for m >> n.
-    // Fisher-Yates is efficient for m not much > n.
-    // I don't know exactly the transition for when Floyd's becomes the better choice.
-    // So I'm somewhat arbitrarily picking 3*n.
-    if (m > 3*n) {
-        dbg<<"Floyd's algorithm\n";
-        // Floyd's algorithm
-        // O(n) in memory, but slightly more than O(n) in time, especially as m ~ n.
-        std::set<long> selected;
-        while (long(selected.size()) < n) {
-            double urd = urand();
-            long j = long(urd * m); // 0 <= j < m
-            if (j == m) j = m-1;    // Just in case.
-            std::pair<std::set<long>::iterator,bool> ret = selected.insert(j);
-            if (ret.second) {
-                // Then insertion happened.  I.e. not already present.
-                // Also write it to the end of the selection list
-                selection[selected.size()-1] = j;
-            }
-        }
+    if (c.getW() == 0.) return;
+    if (c.getLeft()) {
+        Assert(c.getRight());
+        CollectLeaves(*c.getLeft(), leaves);
+        CollectLeaves(*c.getRight(), leaves);
     } else {
-        dbg<<"Fisher-Yates\n";
-        // Fisher-Yates shuffle up through n elements
-        // O(n) in time, but O(m) in memory.
-        std::vector<long> full(m);
-        for (long i=0; i<m; ++i) full[i] = i;
-        for (long i=0; i<n; ++i) {
-            double urd = urand();
-            long j = long(urd * (m-i)); // 0 <= j < m-i
-            j += i;                     // i <= j < m
-            if (j == m) j = m-1;        // Just in case.
-            std::swap(full[i], full[j]);
-        }
-        std::copy(full.begin(), full.begin()+n, selection.begin());
+        leaves.push_back(&c);
     }
 }
 
-template <int D1, int D2, int B> template <int C>
-void BinnedCorr2<D1,D2,B>::sampleFrom(
-    const Cell<D1, C>& c1, const Cell<D2, C>& c2, double rsq, double r,
-    long* i1, long* i2, double* sep, int n, long& k)
+template <int D1, int D2, int B> template <int C, int M>
+void BinnedCorr2<D1,D2,B>::processLeaves(const Cell<D1,C>& c1, const Cell<D2,C>& c2,
+                                         const MetricHelper<M>& metric, bool do_reverse)
 {
-    // At the start, k pairs will already have been considered for selection.
-    // Of these min(k,n) will have been selected for inclusion in the lists.
+    // Only the accumulators have a _leaf_buffer.  cf. flushPairs.
+    Assert(_leaf_buffer);
+    LeafBuffer& buf = *_leaf_buffer;
+    // The vectors keep their capacity, so after the first few calls, these don't allocate.
+    std::vector<const void*>& leaves1 = buf.leaves1;
+    std::vector<const void*>& leaves2 = buf.leaves2;
+    leaves1.clear();
+    leaves2.clear();
+    CollectLeaves(c1, leaves1);
+    CollectLeaves(c2, leaves2);
+    xdbg<<"processLeaves: "<<leaves1.size()<<" x "<<leaves2.size()<<std::endl;
+    _stats[TraversalStats::LEAF_PAIRS] += double(leaves1.size()) * double(leaves2.size());
 
-    // If we consider each pair one at a time, then the algorithm to end up with a
-    // uniform probability that any given pair is selected is as follows.
-    // 1. When k < n, always select the next pair.
-    // 2. When k >= n, select the next pair with probability n/(k+1).
-    // 3. If selected, replace a random pair currently in the list with the new pair.
+    const long n2 = leaves2.size();
+    if (n2 == 0) return;
+    // Position is trivially copyable, so it's fine to keep them in the raw storage of pos2.
+    const size_t posdoubles = (sizeof(Position<C>) + sizeof(double) - 1) / sizeof(double);
+    if (buf.pos2.size() < n2 * posdoubles) buf.pos2.resize(n2 * posdoubles);
+    if (buf.rsq.size() < size_t(n2)) {
+        buf.rsq.resize(n2);
+        buf.ok.resize(n2);
+    }
+    Position<C>* pos2 = reinterpret_cast<Position<C>*>(&buf.pos2[0]);
+    for (long j=0; j<n2; ++j)
+        new (pos2+j) Position<C>(static_cast<const Cell<D2,C>*>(leaves2[j])->getPos());
+    double* rsq = &buf.rsq[0];
+    char* ok = &buf.ok[0];
+    for (size_t i=0; i<leaves1.size(); ++i) {
+        const Cell<D1,C>& l1 = *static_cast<const Cell<D1,C>*>(leaves1[i]);
+        const Position<C>& p1 = l1.getPos();
+        // Do all the distance and rpar calculations first in tight loops over a contiguous
+        // copy of the positions, which the compiler is able to vectorize.  Only the pairs
+        // that are in range need the rest.
+        FusedMetric<M,C>::leafDistSq(metric, p1, pos2, n2, rsq, ok);
+        for (long j=0; j<n2; ++j) {
+            if (!ok[j]) continue;
+            const Cell<D2,C>& l2 = *static_cast<const Cell<D2,C>*>(leaves2[j]);
+            const Position<C>& p2 = l2.getPos();
+            if (BinTypeHelper<B>::isRSqInRange(rsq[j], p1, p2,
+                                               _minsep, _minsepsq, _maxsep, _maxsepsq)) {
+                directProcess11(l1,l2,rsq[j],do_reverse);
+            }
+        }
+    }
+}
 
-    // Proof that for all k >= n, all pairs fromm i=1..k have P(selected) = n/k:
-    //
-    // 1. If k==n, then all items are selected with probability 1 = n/k.
-    // 2. If true for some k>=n, then for step k+1:
-    //    - probability for i=k+1 is n/(k+1)
-    //    - probability for i<=k is
-    //      P(already selected) * P(remains in list | alread selected)
-    //      = n/k * (P(i=k+1 not selected) + P(i=k+1 is selected, but given pair is not replaced))
-    //      = n/k * ( (1 - n/(k+1)) + n/(k+1) * (n-1)/n )
-    //      = n/k * ( (k+1 - n + n-1)/(k+1) )
-    //      = n/k * ( k/(k+1) )
-    //      = n/(k+1)
-    // QED
+// When buffering the pairs, we need to store the shears for each pair.  For Flat coordinates,
+// the projection is simple enough to do in the vectorized loop in ComputeXi, so we just store
+// the shears and the separation.  For the others, do the projection here.
+template <int C>
+struct ShearHelper
+{
+    template <int D1>
+    static void StoreShear(const CellData<D1,C>& c1, const CellData<GData,C>& c2,
+                           PairBuffer& buf, int i)
+    {
+        std::complex<double> g2;
+        ProjectHelper<C>::ProjectShear(c1,c2,g2);
+        buf.v2r[i] = real(g2);
+        buf.v2i[i] = imag(g2);
+        buf.dx[i] = 1.;
+        buf.dy[i] = 0.;
+    }
 
-    // In practice, we usually have many pairs to add, not just one at a time.  So we want to
-    // try to do the net result of m passes of the above algorithm.
-    // Consider 3 cases:
-    // 1. k+m<=n:           Take all m pairs
-    // 2. m<=n:             Just do m passes of the above algorithm.
-    // 3. k+m>n and m>n:    Choose n pairs randomly without replacement from full k+m set.
-    //                      For the selected pairs with k<=i<k+m, either place in the next spot
-    //                      (if k<n) or randomly replace one of the ones that was already there.
+    static void StoreShears(const CellData<GData,C>& c1, const CellData<GData,C>& c2,
+                            PairBuffer& buf, int i)
+    {
+        std::complex<double> g1, g2;
+        ProjectHelper<C>::ProjectShears(c1,c2,g1,g2);
+        buf.v1r[i] = real(g1);
+        buf.v1i[i] = imag(g1);
+        buf.v2r[i] = real(g2);
+        buf.v2i[i] = imag(g2);
+        buf.dx[i] = 1.;
+        buf.dy[i] = 0.;
+    }
+};
 
-    long n1 = c1.getN();
-    long n2 = c2.getN();
-    long m = n1 * n2;
+template <>
+struct ShearHelper<Flat>
+{
+    template <int D1>
+    static void StoreShear(const CellData<D1,Flat>& c1, const CellData<GData,Flat>& c2,
+                           PairBuffer& buf, int i)
+    {
+        const std::complex<double> g2 = c2.getWG();
+        buf.v2r[i] = real(g2);
+        buf.v2i[i] = imag(g2);
+        buf.dx[i] = c2.getPos().getX() - c1.getPos().getX();
+        buf.dy[i] = c2.getPos().getY() - c1.getPos().getY();
+    }
 
-    std::vector<const Cell<D1,C>*> leaf1 = c1.getAllLeaves();
-    std::vector<const Cell<D2,C>*> leaf2 = c2.getAllLeaves();
+    static void StoreShears(const CellData<GData,Flat>& c1, const CellData<GData,Flat>& c2,
+                            PairBuffer& buf, int i)
+    {
+        const std::complex<double> g1 = c1.getWG();
+        buf.v1r[i] = real(g1);
+        buf.v1i[i] = imag(g1);
+        StoreShear(c1,c2,buf,i);
+    }
+};
 
-    if (r == 0.) {
+// Project the shear (gr,gi) to the line with separation (dx,dy).
+// i.e. g *= conj(cr*cr)/norm(cr), where cr = dx + i dy.
+// If (dx,dy) = (1,0), this leaves the shear unchanged.
+inline void ProjectShear(double dx, double dy, double& gr, double& gi)
+{
+    const double dxsq = dx*dx;
+    const double dysq = dy*dy;
+    const double norm = dxsq + dysq;
+    const double er = (dxsq - dysq) / norm;
+    const double ei = -2. * dx * dy / norm;
+    const double tmp = gr * er - gi * ei;
+    gi = gr * ei + gi * er;
+    gr = tmp;
+}
+
+// We also set up a helper class for doing the direct processing.
+// StoreValues saves what we need for each pair in the PairBuffer, and ComputeXi calculates
+// the xi values for all the pairs in the buffer.  NXI is the number of xi values.
+template <int D1, int D2>
+struct DirectHelper;
+
+template <>
+struct DirectHelper<NData,NData>
+{
+    enum { NXI = 0 };
+
+    template <int C>
+    static void StoreValues(const CellData<NData,C>& , const CellData<NData,C>& ,
+                            PairBuffer& , int )
+    {}
+
+    static void ComputeXi(PairBuffer& ) {}
+};
+
+template <>
+struct DirectHelper<NData,KData>
+{
+    enum { NXI = 1 };
+
+    template <int C>
+    static void StoreValues(const CellData<NData,C>& c1, const CellData<KData,C>& c2,
+                            PairBuffer& buf, int i)
+    {
+        buf.v1r[i] = c1.getW();
+        buf.v2r[i] = c2.getWK();
+    }
+
+    static void ComputeXi(PairBuffer& buf)
+    {
+        const int n = buf.n;
+        for (int i=0; i<n; ++i) buf.xi0[i] = buf.v1r[i] * buf.v2r[i];
+    }
+};
+
+template <>
+struct DirectHelper<NData,GData>
+{
+    enum { NXI = 2 };
+
+    template <int C>
+    static void StoreValues(const CellData<NData,C>& c1, const CellData<GData,C>& c2,
+                            PairBuffer& buf, int i)
+    {
+        // The minus sign here is to make it accumulate tangential shear, rather than radial.
+        // g2 from the projection is measured along the connecting line, not tangent.
+        buf.v1r[i] = -c1.getW();
+        ShearHelper<C>::StoreShear(c1,c2,buf,i);
+    }
+
+    static void ComputeXi(PairBuffer& buf)
+    {
+        const int n = buf.n;
+        for (int i=0; i<n; ++i) {
+            double g2r = buf.v2r[i];
+            double g2i = buf.v2i[i];
+            ProjectShear(buf.dx[i], buf.dy[i], g2r, g2i);
+            buf.xi0[i] = buf.v1r[i] * g2r;
+            buf.xi1[i] = buf.v1r[i] * g2i;
+        }
+    }
+};
+
+template <>
+struct DirectHelper<KData,KData>
+{
+    enum { NXI = 1 };
+
+    template <int C>
+    static void StoreValues(const CellData<KData,C>& c1, const CellData<KData,C>& c2,
+                            PairBuffer& buf, int i)
+    {
+        buf.v1r[i] = c1.getWK();
+        buf.v2r[i] = c2.getWK();
+    }
+
+    static void ComputeXi(PairBuffer& buf)
+    {
+        const int n = buf.n;
+        for (int i=0; i<n; ++i) buf.xi0[i] = buf.v1r[i] * buf.v2r[i];
+    }
+};
+
+template <>
+struct DirectHelper<KData,GData>
+{
+    enum { NXI = 2 };
+
+    template <int C>
+    static void StoreValues(const CellData<KData,C>& c1, const CellData<GData,C>& c2,
+                            PairBuffer& buf, int i)
+    {
+        // As for NG, the minus sign makes this tangential shear.
+        buf.v1r[i] = -c1.getWK();
+        ShearHelper<C>::StoreShear(c1,c2,buf,i);
+    }
+
+    static void ComputeXi(PairBuffer& buf)
+    { DirectHelper<NData,GData>::ComputeXi(buf); }
+};
+
+template <>
+struct DirectHelper<GData,GData>
+{
+    enum { NXI = 4 };
+
+    template <int C>
+    static void StoreValues(const CellData<GData,C>& c1, const CellData<GData,C>& c2,
+                            PairBuffer& buf, int i)
+    { ShearHelper<C>::StoreShears(c1,c2,buf,i); }
+
+    static void ComputeXi(PairBuffer& buf)
+    {
+        const int n = buf.n;
+        for (int i=0; i<n; ++i) {
+            double g1r = buf.v1r[i];
+            double g1i = buf.v1i[i];
+            double g2r = buf.v2r[i];
+            double g2i = buf.v2i[i];
+            ProjectShear(buf.dx[i], buf.dy[i], g1r, g1i);
+            ProjectShear(buf.dx[i], buf.dy[i], g2r, g2i);
+
+            // The complex products g1 g2 and g1 g2* share most of the calculations,
+            // so faster to do this manually.
+            double g1rg2r = g1r * g2r;
+            double g1rg2i = g1r * g2i;
+            double g1ig2r = g1i * g2r;
+            double g1ig2i = g1i * g2i;
+
+            buf.xi0[i] = g1rg2r + g1ig2i;       // g1 * conj(g2)
+            buf.xi1[i] = g1ig2r - g1rg2i;
+            buf.xi2[i] = g1rg2r - g1ig2i;       // g1 * g2
+            buf.xi3[i] = g1ig2r + g1rg2i;
+        }
+    }
+};
+
+template <int D1, int D2, int B> template <int C>
+void BinnedCorr2<D1,D2,B>::directProcess11(
+    const Cell<D1,C>& c1, const Cell<D2,C>& c2, const double rsq, bool do_reverse,
+    int k, double r, double logr)
+{
+    xdbg<<"DirectProcess11: rsq = "<<rsq<<std::endl;
+    XAssert(rsq >= _minsepsq);
+    XAssert(rsq < _fullmaxsepsq);
+    // Note that most of these XAsserts around are still hardcoded for Log binning and Euclidean
+    // metric.  If turning on verbose>=3, these could fail.
+    XAssert(c1.getSize()+c2.getSize() < sqrt(rsq)*_b + 0.0001);
+    if (_recording) _recorded.push_back(RecordedPair(&c1, &c2, rsq, k, r, logr, do_reverse));
+    directProcessData(c1.getData(), c2.getData(), rsq, do_reverse, k, r, logr);
+}
+
+template <int D1, int D2, int B> template <int C>
+int BinnedCorr2<D1,D2,B>::findBin(
+    const Position<C>& p1, const Position<C>& p2, double rsq, int k, double& r,
+    double& logr) const
+{
+    if (_logbins.active()) {
+        // Get the bin from the table.  Then logr is only needed for meanlogr.
+        if (k < 0) {
+            r = sqrt(rsq);
+            k = _logbins.findBin(rsq);
+        }
+        XAssert(std::abs(r - sqrt(rsq)) < 1.e-10*r);
+        // Only the pairs that are actually binned need the angle from the chord distance.
+        if (_chord) r = 2. * asin(0.5 * r);
+        logr = _skip_meanlogr ? 0. : log(r);
+    } else if (k < 0) {
         r = sqrt(rsq);
+        // Log binning needs logr to get the bin, but otherwise it is only used for meanlogr.
+        if (B == Log || !_skip_meanlogr) {
+            logr = log(r);
+            Assert(logr >= _logminsep);
+        }
+        k = BinTypeHelper<B>::calculateBinK(p1, p2, r, logr, _binsize,
+                                            _minsep, _maxsep, _logminsep);
     } else {
         XAssert(std::abs(r - sqrt(rsq)) < 1.e-10*r);
+        XAssert(std::abs(logr - 0.5*log(rsq)) < 1.e-10);
+        XAssert(k == BinTypeHelper<B>::calculateBinK(p1, p2, r, logr, _binsize,
+                                                     _minsep, _maxsep, _logminsep));
     }
-    xdbg<<"sampleFrom: "<<c1.getN()<<"  "<<c2.getN()<<"  "<<rsq<<"  "<<r<<std::endl;
-    xdbg<<"   n1,n2,k,n,m = "<<n1<<','<<n2<<','<<k<<','<<n<<','<<m<<std::endl;
+    if (_skip_meanlogr) logr = 0.;
+    Assert(k >= 0);
+    Assert(k <= _nbins);
+    // It's possible for k to be == _nbins here if the r is very close to the top of the
+    // last bin, but numerical rounding in the log calculation bumped k into the next
+    // (non-existent) bin.
+    if (k == _nbins) {
+        XAssert(BinTypeHelper<B>::calculateBinK(p2, p1, r, logr-1.e-10, _binsize,
+                                                _minsep, _maxsep, _logminsep) == _nbins-1);
+        --k;
+    }
+    Assert(k < _nbins);
+    xdbg<<"r,logr,k = "<<r<<','<<logr<<','<<k<<std::endl;
+    return k;
+}
 
-    if (k + m <= n) {
-        // Case 1
-        xdbg<<"Case 1: take all pairs\n";
-        for (size_t p1=0; p1<leaf1.size(); ++p1) {
-            long nn1 = leaf1[p1]->getN();
-            for (long q1=0; q1<nn1; ++q1) {
-                long index1;
-                if (nn1 == 1) index1 = leaf1[p1]->getInfo().index;
-                else index1 = (*leaf1[p1]->getListInfo().indices)[q1];
-                for (size_t p2=0; p2<leaf2.size(); ++p2) {
-                    long nn2 = leaf2[p2]->getN();
-                    for (long q2=0; q2<nn2; ++q2) {
-                        long index2;
-                        if (nn2 == 1) index2 = leaf2[p2]->getInfo().index;
-                        else index2 = (*leaf2[p2]->getListInfo().indices)[q2];
-                        i1[k] = index1;
-                        i2[k] = index2;
-                        sep[k] = r;
-                        ++k;
-                    }
-                }
-            }
+template <int D1, int D2, int B> template <int C>
+int BinnedCorr2<D1,D2,B>::findReverseBin(
+    const Position<C>& p1, const Position<C>& p2, double r, double logr) const
+{
+    int k2 = BinTypeHelper<B>::calculateBinK(p2, p1, r, logr, _binsize,
+                                             _minsep, _maxsep, _logminsep);
+    if (k2 == _nbins) --k2;  // As before, this can (rarely) happen.
+    Assert(k2 >= 0);
+    Assert(k2 < _nbins);
+    return k2;
+}
+
+template <int D1, int D2, int B> template <int C>
+void BinnedCorr2<D1,D2,B>::directProcessData(
+    const CellData<D1,C>& c1, const CellData<D2,C>& c2, const double rsq, bool do_reverse,
+    int k, double r, double logr)
+{
+    XAssert(_binsize != 0.);
+    const Position<C>& p1 = c1.getPos();
+    const Position<C>& p2 = c2.getPos();
+    k = findBin(p1, p2, rsq, k, r, logr);
+
+    // Only the accumulators have a _buffer, so this should never be called for the main object.
+    Assert(_buffer);
+    ++_stats[TraversalStats::DIRECT];
+    PairBuffer& buf = *_buffer;
+    const int i = buf.n;
+    buf.k[i] = k;
+    buf.r[i] = r;
+    buf.logr[i] = logr;
+    buf.nn[i] = double(c1.getN()) * double(c2.getN());
+    // With unit weights, flushPairs uses nn for the weights, so ww isn't needed.
+    if (!_unit_weights) buf.ww[i] = double(c1.getW()) * double(c2.getW());
+    xdbg<<"n,w = "<<buf.nn[i]<<','<<(_unit_weights ? buf.nn[i] : buf.ww[i])<<std::endl;
+    buf.k2[i] = do_reverse ? findReverseBin(p1, p2, r, logr) : -1;
+
+    DirectHelper<D1,D2>::template StoreValues<C>(c1,c2,buf,i);
+    if (++buf.n == PairBuffer::SIZE) flushPairs();
+}
+
+template <int D1, int D2, int B>
+void BinnedCorr2<D1,D2,B>::flushPairs()
+{
+    if (_unit_weights) flushPairs<true>();
+    else flushPairs<false>();
+}
+
+template <int D1, int D2, int B> template <bool UW>
+void BinnedCorr2<D1,D2,B>::flushPairs()
+{
+    PairBuffer& buf = *_buffer;
+    const int n = buf.n;
+    xdbg<<"flushPairs: n = "<<n<<std::endl;
+    DirectHelper<D1,D2>::ComputeXi(buf);
+
+    const int nxi = DirectHelper<D1,D2>::NXI;
+    const double* xi[4] = { buf.xi0, buf.xi1, buf.xi2, buf.xi3 };
+    // When all the weights are 1, w = n for every cell, so the weight of each pair is nn.
+    const double* ww = UW ? buf.nn : buf.ww;
+    PairBins& bins = *_bins;
+    for (int i=0; i<n; ++i) {
+        PairBin& bin = bins[buf.k[i]];
+        bin.npairs += buf.nn[i];
+        bin.meanr += ww[i] * buf.r[i];
+        bin.meanlogr += ww[i] * buf.logr[i];
+        bin.weight += ww[i];
+        for (int j=0; j<nxi; ++j) bin.xi[j] += xi[j][i];
+        if (buf.k2[i] != -1) {
+            PairBin& bin2 = bins[buf.k2[i]];
+            bin2.npairs += buf.nn[i];
+            bin2.meanr += ww[i] * buf.r[i];
+            bin2.meanlogr += ww[i] * buf.logr[i];
+            bin2.weight += ww[i];
+            for (int j=0; j<nxi; ++j) bin2.xi[j] += xi[j][i];
         }
-    } else if (m <= n) {
-        // Case 2
-        xdbg<<"Case 2: Check one at a time.\n";
-        for (size_t p1=0; p1<leaf1.size(); ++p1) {
-            long nn1 = leaf1[p1]->getN();
-            for (long q1=0; q1<nn1; ++q1) {
-                long index1;
-                if (nn1 == 1) index1 = leaf1[p1]->getInfo().index;
-                else index1 = (*leaf1[p1]->getListInfo().indices)[q1];
-                for (size_t p2=0; p2<leaf2.size(); ++p2) {
-                    long nn2 = leaf2[p2]->getN();
-                    for (long q2=0; q2<nn2; ++q2) {
-                        long index2;
-                        if (nn2 == 1) index2 = leaf2[p2]->getInfo().index;
-                        else index2 = (*leaf2[p2]->getListInfo().indices)[q2];
-                        long j = k;  // j is where in the lists we will place this
-                        if (k >= n) {
-                            double urd = urand(); // 0 < urd < 1
-                            j = int(urd * (k+1)); // 0 <= j < k+1
-                        }
-                        if (j < n)  {
-                            i1[j] = index1;
-                            i2[j] = index2;
-                            sep[j] = r;
-                        }
-                        ++k;
-                    }
-                }
-            }
+    }
+    buf.n = 0;
+}
+
+template <int D1, int D2, int B>
+void BinnedCorr2<D1,D2,B>::operator=(const BinnedCorr2<D1,D2,B>& rhs)
+{
+    Assert(rhs._nbins == _nbins);
+    if (&rhs == this) return;
+    int coords = _coords;
+    clear();
+    _coords = coords;
+    *this += rhs;
+}
+
+template <int D1, int D2, int B>
+void BinnedCorr2<D1,D2,B>::operator+=(const BinnedCorr2<D1,D2,B>& rhs)
+{
+    Assert(rhs._nbins == _nbins);
+    if (_bins && rhs._bins) {
+        // Both are accumulators, so just add up the records of the tiles rhs has used.
+        for (int t=0; t<_bins->getNTiles(); ++t) {
+            const PairBin* from_bins = rhs._bins->getTile(t);
+            if (!from_bins) continue;
+            const double* from = reinterpret_cast<const double*>(from_bins);
+            double* to = reinterpret_cast<double*>(_bins->getTile(t, true));
+            const int n = _bins->getSize(t) * int(sizeof(PairBin) / sizeof(double));
+            for (int i=0; i<n; ++i) to[i] += from[i];
         }
-    } else {
-        // Case 3
-        xdbg<<"Case 3: Select n without replacement\n";
-        std::vector<long> selection(n);
-        SelectRandomFrom(k+m, selection);
-        // If any items in k<=i<n are from the original set, put them in their original place.
-        for(long i=k;i<n;++i) {
-            long j = selection[i];
-            if (j < n) std::swap(selection[i], selection[j]);
+    } else if (rhs._bins) {
+        // Adding an accumulator into the output arrays.
+        for (int t=0; t<rhs._bins->getNTiles(); ++t) {
+            const PairBin* bins = rhs._bins->getTile(t);
+            if (!bins) continue;
+            const int k0 = rhs._bins->getStart(t);
+            const int n = rhs._bins->getSize(t);
+            _xi.addBins(bins,k0,n);
+            for (int i=0; i<n; ++i) _meanr[k0+i] += bins[i].meanr;
+            for (int i=0; i<n; ++i) _meanlogr[k0+i] += bins[i].meanlogr;
+            for (int i=0; i<n; ++i) _weight[k0+i] += bins[i].weight;
+            for (int i=0; i<n; ++i) _npairs[k0+i] += bins[i].npairs;
         }
-
-        // Now any items with j >= k can replace the value at their i in this list.
-        std::map<long, long> places;
-        for(long i=0;i<n;++i) {
-            long j = selection[i];
-            if (j >= k) places[j] = i;
+    } else if (_bins) {
+        // Adding output arrays into an accumulator.  Skip the tiles with no pairs, so they
+        // don't need to be allocated.
+        for (int t=0; t<_bins->getNTiles(); ++t) {
+            const int k0 = _bins->getStart(t);
+            const int n = _bins->getSize(t);
+            bool used = false;
+            for (int i=0; i<n && !used; ++i)
+                used = rhs._npairs[k0+i] != 0. || rhs._weight[k0+i] != 0.;
+            if (!used) continue;
+            PairBin* bins = _bins->getTile(t, true);
+            rhs._xi.addToBins(bins,k0,n);
+            for (int i=0; i<n; ++i) bins[i].meanr += rhs._meanr[k0+i];
+            for (int i=0; i<n; ++i) bins[i].meanlogr += rhs._meanlogr[k0+i];
+            for (int i=0; i<n; ++i) bins[i].weight += rhs._weight[k0+i];
+            for (int i=0; i<n; ++i) bins[i].npairs += rhs._npairs[k0+i];
         }
-        if (places.size() == 0) {
-            // If nothing selected from the new set, then we're done.
-            k += m;
+    } else {
+        _xi.add(rhs._xi,_nbins);
+        for (int i=0; i<_nbins; ++i) _meanr[i] += rhs._meanr[i];
+        for (int i=0; i<_nbins; ++i) _meanlogr[i] += rhs._meanlogr[i];
+        for (int i=0; i<_nbins; ++i) _weight[i] += rhs._weight[i];
+        for (int i=0; i<_nbins; ++i) _npairs[i] += rhs._npairs[i];
+    }
+    _stats += rhs._stats;
+}
+
+template <int D1, int D2, int B>
+void BinnedCorr2<D1,D2,B>::packData(std::vector<double>& data) const
+{
+    Assert(_bins);
+    // The data are written out densely, with zeros for any tiles that weren't used.
+    const int nd = int(sizeof(PairBin) / sizeof(double));
+    data.assign(_nbins * nd, 0.);
+    for (int t=0; t<_bins->getNTiles(); ++t) {
+        const PairBin* bins = _bins->getTile(t);
+        if (!bins) continue;
+        const double* from = reinterpret_cast<const double*>(bins);
+        std::copy(from, from + _bins->getSize(t) * nd, data.begin() + _bins->getStart(t) * nd);
+    }
+}
+
+template <int D1, int D2, int B>
+void BinnedCorr2<D1,D2,B>::unpackData(const std::vector<double>& data)
+{
+    Assert(_bins);
+    Assert(data.size() == _nbins * sizeof(PairBin) / sizeof(double));
+    const int nd = int(sizeof(PairBin) / sizeof(double));
+    _bins->clear();
+    for (int t=0; t<_bins->getNTiles(); ++t) {
+        std::vector<double>::const_iterator from = data.begin() + _bins->getStart(t) * nd;
+        const int n = _bins->getSize(t) * nd;
+        bool used = false;
+        for (int i=0; i<n && !used; ++i) used = from[i] != 0.;
+        if (used) std::copy(from, from + n, reinterpret_cast<double*>(_bins->getTile(t, true)));
+    }
+}
+
+// A uniform random sample of up to n of the k pairs that have been considered so far.
+// (Once k > n, this is the reservoir of sampleFrom.)
+struct PairSample
+{
+    explicit PairSample(int n) : i1(n), i2(n), sep(n), k(0) {}
+
+    // Combine this with rhs, an independent sample of up to n of rhs.k other pairs, so this is
+    // a uniform sample of up to n of all k + rhs.k pairs.  rhs is reordered.
+    void mergeFrom(PairSample& rhs, int n, RandomStream& rng)
+    {
+        if (k + rhs.k <= n) {
+            // Then both have all of their pairs, so just keep them all.
+            std::copy(rhs.i1.begin(), rhs.i1.begin() + rhs.k, i1.begin() + k);
+            std::copy(rhs.i2.begin(), rhs.i2.begin() + rhs.k, i2.begin() + k);
+            std::copy(rhs.sep.begin(), rhs.sep.begin() + rhs.k, sep.begin() + k);
+            k += rhs.k;
             return;
         }
+        // Draw n pairs without replacement from the full k + rhs.k.  Each draw comes from
+        // this sample or rhs in proportion to how many pairs in each haven't been drawn yet,
+        // and then it is a random one of the remaining sampled pairs on that side.
+        // The number drawn from each side is never more than its sample size.
+        PairSample merged(n);
+        PairSample* side[2] = { this, &rhs };
+        long nleft[2] = { k, rhs.k };
+        long nsample[2] = { std::min(k, long(n)), std::min(rhs.k, long(n)) };
+        for (int m=0; m<n; ++m) {
+            const int t = rng() * (nleft[0] + nleft[1]) < nleft[0] ? 0 : 1;
+            Assert(nsample[t] > 0);
+            PairSample& from = *side[t];
+            long q = long(rng() * nsample[t]);
+            if (q >= nsample[t]) q = nsample[t]-1;  // Just in case.
+            merged.i1[m] = from.i1[q];
+            merged.i2[m] = from.i2[q];
+            merged.sep[m] = from.sep[q];
+            --nsample[t];
+            std::swap(from.i1[q], from.i1[nsample[t]]);
+            std::swap(from.i2[q], from.i2[nsample[t]]);
+            std::swap(from.sep[q], from.sep[nsample[t]]);
+            --nleft[t];
+        }
+        i1.swap(merged.i1);
+        i2.swap(merged.i2);
+        sep.swap(merged.sep);
+        k += rhs.k;
+    }
+
+    std::vector<long> i1;
+    std::vector<long> i2;
+    std::vector<double> sep;
+    long k;
+};
+
+template <int D1, int D2, int B> template <int C, int M>
+long BinnedCorr2<D1,D2,B>::samplePairs(
+    const Field<D1, C>& field1, const Field<D2, C>& field2,
+    double minsep, double maxsep, long* i1, long* i2, double* sep, int n, long seed)
+{
+    Assert(_coords == -1 || _coords == C);
+    _coords = C;
+    const long n1 = field1.getNTopLevel();
+    const long n2 = field2.getNTopLevel();
+    dbg<<"field1 has "<<n1<<" top level nodes\n";
+    dbg<<"field2 has "<<n2<<" top level nodes\n";
+    Assert(n1 > 0);
+    Assert(n2 > 0);
+
+    MetricHelper<M> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
+
+    double minsepsq = minsep*minsep;
+    double maxsepsq = maxsep*maxsep;
+
+    // Each thread keeps its own sample of the pairs from the pairs of top-level cells that it
+    // does, with its own random stream.  Then these are merged at the end.  The cell pairs are
+    // dealt out to the threads in a fixed order, so the result only depends on the seed and
+    // the number of threads.
+    if (seed <= 0) seed = long(urand() * 2147483647.) + 1;
+    dbg<<"seed = "<<seed<<std::endl;
+#ifdef _OPENMP
+    const int nthreads = omp_get_max_threads();
+#else
+    const int nthreads = 1;
+#endif
+    std::vector<PairSample> samples(nthreads, PairSample(n));
+    const std::vector<Cell<D1,C>*>& cells1 = field1.getCells();
+    const std::vector<Cell<D2,C>*>& cells2 = field2.getCells();
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nthreads)
+    {
+        const int t = omp_get_thread_num();
+#else
+    {
+        const int t = 0;
+#endif
+        PairSample& sample = samples[t];
+        RandomStream rng(seed + t * 0x5851f42d4c957f2dULL);
+#ifdef _OPENMP
+#pragma omp for schedule(static,1)
+#endif
+        for (long ij=0; ij<n1*n2; ++ij) {
+            const Cell<D1,C>& c1 = *cells1[ij / n2];
+            const Cell<D2,C>& c2 = *cells2[ij % n2];
+            samplePairs(c1, c2, metric, minsep, minsepsq, maxsep, maxsepsq,
+                        &sample.i1[0], &sample.i2[0], &sample.sep[0], n, sample.k, rng);
+        }
+    }
+
+    RandomStream rng(seed - 1);
+    for (int t=1; t<nthreads; ++t) samples[0].mergeFrom(samples[t], n, rng);
+    const PairSample& sample = samples[0];
+    const long nout = std::min(sample.k, long(n));
+    std::copy(sample.i1.begin(), sample.i1.begin() + nout, i1);
+    std::copy(sample.i2.begin(), sample.i2.begin() + nout, i2);
+    std::copy(sample.sep.begin(), sample.sep.begin() + nout, sep);
+    return sample.k;
+}
+
+template <int D1, int D2, int B> template <int C, int M>
+void BinnedCorr2<D1,D2,B>::samplePairs(
+    const Cell<D1, C>& c1, const Cell<D2, C>& c2, const MetricHelper<M>& metric,
+    double minsep, double minsepsq, double maxsep, double maxsepsq,
+    long* i1, long* i2, double* sep, int n, long& k, RandomStream& rng)
+{
+    // This tracks process11, but we only select pairs at the end, not call directProcess11
+    xdbg<<"Start samplePairs for "<<c1.getPos()<<",  "<<c2.getPos()<<"   ";
+    xdbg<<"w = "<<c1.getW()<<", "<<c2.getW()<<std::endl;
+    if (c1.getW() == 0. || c2.getW() == 0.) return;
+
+    const Position<C>& p1 = c1.getPos();
+    const Position<C>& p2 = c2.getPos();
+    double s1 = c1.getSize(); // May be modified by DistSq function.
+    double s2 = c2.getSize(); // "
+    xdbg<<"s1,s2 = "<<s1<<','<<s2<<std::endl;
+    xdbg<<"M,C = "<<M<<"  "<<C<<std::endl;
+    double rsq;
+    double rpar = 0; // Gets set to correct value by this function if appropriate
+    const bool in_rpar = FusedMetric<M,C>::distSqInRPar(metric, p1, p2, s1, s2, rsq, rpar);
+    xdbg<<"rsq = "<<rsq<<std::endl;
+    xdbg<<"s1,s2 => "<<s1<<','<<s2<<std::endl;
+    const double s1ps2 = s1+s2;
+
+    if (!in_rpar) {
+        return;
+    }
+    xdbg<<"RPar in range\n";
+
+    if (BinTypeHelper<B>::tooSmallDist(rsq, s1ps2, minsep, minsepsq) &&
+        metric.tooSmallDist(p1, p2, rsq, rpar, s1ps2, minsep, minsepsq)) {
+        return;
+    }
+    xdbg<<"Not too small separation\n";
+
+    if (BinTypeHelper<B>::tooLargeDist(rsq, s1ps2, maxsep, maxsepsq) &&
+        metric.tooLargeDist(p1, p2, rsq, rpar, s1ps2, maxsep, maxsepsq)) {
+        return;
+    }
+    xdbg<<"Not too large separation\n";
+
+    // Now check if these cells are small enough that it is ok to drop into a single bin.
+    int kk=-1;
+    double r=0,logr=0;  // If singleBin is true, these values are set for use by directProcess11
+    if (metric.isRParInsideRange(p1, p2, s1ps2, rpar) &&
+        BinTypeHelper<B>::singleBin(rsq, s1ps2, p1, p2, _binsize, _b, _bsq,
+                                    _minsep, _maxsep, _logminsep, kk, r, logr))
+    {
+        xdbg<<"Drop into single bin.\n";
+        xdbg<<"rsq = "<<rsq<<std::endl;
+        xdbg<<"minsepsq = "<<minsepsq<<std::endl;
+        xdbg<<"maxsepsq = "<<maxsepsq<<std::endl;
+        if (BinTypeHelper<B>::isRSqInRange(rsq, p1, p2, minsep, minsepsq, maxsep, maxsepsq)) {
+            sampleFrom(c1,c2,rsq,r,i1,i2,sep,n,k,rng);
+        }
+    } else {
+        xdbg<<"Need to split.\n";
+        bool split1=false, split2=false;
+        double bsq_eff = BinTypeHelper<B>::getEffectiveBSq(rsq,_bsq);
+        CalcSplitSq(split1,split2,s1,s2,s1ps2,bsq_eff,_splitfactorsq);
+        xdbg<<"rsq = "<<rsq<<", s1ps2 = "<<s1ps2<<"  ";
+        xdbg<<"s1ps2 / r = "<<s1ps2 / sqrt(rsq)<<", b = "<<_b<<"  ";
+        xdbg<<"split = "<<split1<<','<<split2<<std::endl;
+
+        if (split1 && split2) {
+            Assert(c1.getLeft());
+            Assert(c1.getRight());
+            Assert(c2.getLeft());
+            Assert(c2.getRight());
+            samplePairs<C,M>(*c1.getLeft(), *c2.getLeft(), metric,
+                             minsep, minsepsq, maxsep, maxsepsq, i1, i2, sep, n, k, rng);
+            samplePairs<C,M>(*c1.getLeft(), *c2.getRight(), metric,
+                             minsep, minsepsq, maxsep, maxsepsq, i1, i2, sep, n, k, rng);
+            samplePairs<C,M>(*c1.getRight(), *c2.getLeft(), metric,
+                             minsep, minsepsq, maxsep, maxsepsq, i1, i2, sep, n, k, rng);
+            samplePairs<C,M>(*c1.getRight(), *c2.getRight(), metric,
+                             minsep, minsepsq, maxsep, maxsepsq, i1, i2, sep, n, k, rng);
+        } else if (split1) {
+            Assert(c1.getLeft());
+            Assert(c1.getRight());
+            samplePairs<C,M>(*c1.getLeft(), c2, metric,
+                             minsep, minsepsq, maxsep, maxsepsq, i1, i2, sep, n, k, rng);
+            samplePairs<C,M>(*c1.getRight(), c2, metric,
+                             minsep, minsepsq, maxsep, maxsepsq, i1, i2, sep, n, k, rng);
+        } else {
+            Assert(split2);
+            Assert(c2.getLeft());
+            Assert(c2.getRight());
+            samplePairs<C,M>(c1, *c2.getLeft(), metric,
+                             minsep, minsepsq, maxsep, maxsepsq, i1, i2, sep, n, k, rng);
+            samplePairs<C,M>(c1, *c2.getRight(), metric,
+                             minsep, minsepsq, maxsep, maxsepsq, i1, i2, sep, n, k, rng);
+        }
+    }
+}
+
+template <typename RNG>
+void SelectRandomFrom(long m, std::vector<long>& selection, RNG& rng)
+{
+    xdbg<<"SelectRandomFrom("<<m<<", "<<selection.size()<<")\n";
+    long n = selection.size();
+    // There are two algorithms here.
+    // Floyd's algorithm is efficient for m >> n.
+    // Fisher-Yates is efficient for m not much > n.
+    // I don't know exactly the transition for when Floyd's becomes the better choice.
+    // So I'm somewhat arbitrarily picking 3*n.
+    if (m > 3*n) {
+        dbg<<"Floyd's algorithm\n";
+        // Floyd's algorithm
+        // O(n) in memory, but slightly more than O(n) in time, especially as m ~ n.
+        std::set<long> selected;
+        while (long(selected.size()) < n) {
+            double urd = rng();
+            long j = long(urd * m); // 0 <= j < m
+            if (j == m) j = m-1;    // Just in case.
+            std::pair<std::set<long>::iterator,bool> ret = selected.insert(j);
+            if (ret.second) {
+                // Then insertion happened.  I.e. not already present.
+                // Also write it to the end of the selection list
+                selection[selected.size()-1] = j;
+            }
+        }
+    } else {
+        dbg<<"Fisher-Yates\n";
+        // Fisher-Yates shuffle up through n elements
+        // O(n) in time, but O(m) in memory.
+        std::vector<long> full(m);
+        for (long i=0; i<m; ++i) full[i] = i;
+        for (long i=0; i<n; ++i) {
+            double urd = rng();
+            long j = long(urd * (m-i)); // 0 <= j < m-i
+            j += i;                     // i <= j < m
+            if (j == m) j = m-1;        // Just in case.
+            std::swap(full[i], full[j]);
+        }
+        std::copy(full.begin(), full.begin()+n, selection.begin());
+    }
+}
+
+struct URand
+{
+    double operator()() { return urand(); }
+};
+
+void SelectRandomFrom(long m, std::vector<long>& selection)
+{
+    URand rng;
+    SelectRandomFrom(m, selection, rng);
+}
+
+template <int D1, int D2, int B> template <int C>
+void BinnedCorr2<D1,D2,B>::sampleFrom(
+    const Cell<D1, C>& c1, const Cell<D2, C>& c2, double rsq, double r,
+    long* i1, long* i2, double* sep, int n, long& k, RandomStream& rng)
+{
+    // At the start, k pairs will already have been considered for selection.
+    // Of these min(k,n) will have been selected for inclusion in the lists.
+
+    // If we consider each pair one at a time, then the algorithm to end up with a
+    // uniform probability that any given pair is selected is as follows.
+    // 1. When k < n, always select the next pair.
+    // 2. When k >= n, select the next pair with probability n/(k+1).
+    // 3. If selected, replace a random pair currently in the list with the new pair.
+
+    // Proof that for all k >= n, all pairs fromm i=1..k have P(selected) = n/k:
+    //
+    // 1. If k==n, then all items are selected with probability 1 = n/k.
+    // 2. If true for some k>=n, then for step k+1:
+    //    - probability for i=k+1 is n/(k+1)
+    //    - probability for i<=k is
+    //      P(already selected) * P(remains in list | alread selected)
+    //      = n/k * (P(i=k+1 not selected) + P(i=k+1 is selected, but given pair is not replaced))
+    //      = n/k * ( (1 - n/(k+1)) + n/(k+1) * (n-1)/n )
+    //      = n/k * ( (k+1 - n + n-1)/(k+1) )
+    //      = n/k * ( k/(k+1) )
+    //      = n/(k+1)
+    // QED
+
+    // In practice, we usually have many pairs to add, not just one at a time.  So we want to
+    // try to do the net result of m passes of the above algorithm.
+    // Consider 3 cases:
+    // 1. k+m<=n:           Take all m pairs
+    // 2. m<=n:             Just do m passes of the above algorithm.
+    // 3. k+m>n and m>n:    Choose n pairs randomly without replacement from full k+m set.
+    //                      For the selected pairs with k<=i<k+m, either place in the next spot
+    //                      (if k<n) or randomly replace one of the ones that was already there.
+
+    long n1 = c1.getN();
+    long n2 = c2.getN();
+    long m = n1 * n2;
+
+    std::vector<const Cell<D1,C>*> leaf1 = c1.getAllLeaves();
+    std::vector<const Cell<D2,C>*> leaf2 = c2.getAllLeaves();
+
+    if (r == 0.) {
+        r = sqrt(rsq);
+    } else {
+        XAssert(std::abs(r - sqrt(rsq)) < 1.e-10*r);
+    }
+    xdbg<<"sampleFrom: "<<c1.getN()<<"  "<<c2.getN()<<"  "<<rsq<<"  "<<r<<std::endl;
+    xdbg<<"   n1,n2,k,n,m = "<<n1<<','<<n2<<','<<k<<','<<n<<','<<m<<std::endl;
+
+    if (k + m <= n) {
+        // Case 1
+        xdbg<<"Case 1: take all pairs\n";
+        for (size_t p1=0; p1<leaf1.size(); ++p1) {
+            long nn1 = leaf1[p1]->getN();
+            for (long q1=0; q1<nn1; ++q1) {
+                long index1;
+                if (nn1 == 1) index1 = leaf1[p1]->getInfo().index;
+                else index1 = leaf1[p1]->getListInfo()[q1];
+                for (size_t p2=0; p2<leaf2.size(); ++p2) {
+                    long nn2 = leaf2[p2]->getN();
+                    for (long q2=0; q2<nn2; ++q2) {
+                        long index2;
+                        if (nn2 == 1) index2 = leaf2[p2]->getInfo().index;
+                        else index2 = leaf2[p2]->getListInfo()[q2];
+                        i1[k] = index1;
+                        i2[k] = index2;
+                        sep[k] = r;
+                        ++k;
+                    }
+                }
+            }
+        }
+    } else if (m <= n) {
+        // Case 2
+        xdbg<<"Case 2: Check one at a time.\n";
+        for (size_t p1=0; p1<leaf1.size(); ++p1) {
+            long nn1 = leaf1[p1]->getN();
+            for (long q1=0; q1<nn1; ++q1) {
+                long index1;
+                if (nn1 == 1) index1 = leaf1[p1]->getInfo().index;
+                else index1 = leaf1[p1]->getListInfo()[q1];
+                for (size_t p2=0; p2<leaf2.size(); ++p2) {
+                    long nn2 = leaf2[p2]->getN();
+                    for (long q2=0; q2<nn2; ++q2) {
+                        long index2;
+                        if (nn2 == 1) index2 = leaf2[p2]->getInfo().index;
+                        else index2 = leaf2[p2]->getListInfo()[q2];
+                        long j = k;  // j is where in the lists we will place this
+                        if (k >= n) {
+                            double urd = rng(); // 0 <= urd < 1
+                            j = long(urd * (k+1)); // 0 <= j < k+1
+                        }
+                        if (j < n)  {
+                            i1[j] = index1;
+                            i2[j] = index2;
+                            sep[j] = r;
+                        }
+                        ++k;
+                    }
+                }
+            }
+        }
+    } else {
+        // Case 3
+        xdbg<<"Case 3: Select n without replacement\n";
+        std::vector<long> selection(n);
+        SelectRandomFrom(k+m, selection, rng);
+        // If any items in k<=i<n are from the original set, put them in their original place.
+        for(long i=k;i<n;++i) {
+            long j = selection[i];
+            if (j < n) std::swap(selection[i], selection[j]);
+        }
+
+        // Now any items with j >= k can replace the value at their i in this list.
+        std::map<long, long> places;
+        for(long i=0;i<n;++i) {
+            long j = selection[i];
+            if (j >= k) places[j] = i;
+        }
+        if (places.size() == 0) {
+            // If nothing selected from the new set, then we're done.
+            k += m;
+            return;
+        }
+
+        std::map<long, long>::iterator next = places.begin();
+
+        long i=k;  // When i is in the map, place it at places[i]
+        for (size_t p1=0; p1<leaf1.size(); ++p1) {
+            long nn1 = leaf1[p1]->getN();
+            for (long q1=0; q1<nn1; ++q1) {
+                xdbg<<"i = "<<i<<", next = "<<next->first<<"  "<<next->second<<std::endl;
+                Assert(i <= next->first);
+                if (next->first > i + n2) {
+                    // Then skip this loop through the second vector
+                    i += n2;
+                    continue;
+                }
+                long index1;
+                if (nn1 == 1) index1 = leaf1[p1]->getInfo().index;
+                else index1 = leaf1[p1]->getListInfo()[q1];
+                for (size_t p2=0; p2<leaf2.size(); ++p2) {
+                    long nn2 = leaf2[p2]->getN();
+                    for (long q2=0; q2<nn2; ++q2,++i) {
+                        if (i == next->first) {
+                            xdbg<<"Use i = "<<i<<std::endl;
+                            long index2;
+                            if (nn2 == 1) index2 = leaf2[p2]->getInfo().index;
+                            else index2 = leaf2[p2]->getListInfo()[q2];
+                            long j = next->second;
+                            i1[j] = index1;
+                            i2[j] = index2;
+                            sep[j] = r;
+                            ++next;
+                        }
+                        if (next == places.end()) break;
+                    }
+                    if (next == places.end()) break;
+                }
+                if (next == places.end()) break;
+            }
+            if (next == places.end()) break;
+        }
+        xdbg<<"Done: i = "<<i<<", k+m = "<<k+m<<std::endl;
+        k += m;
+    }
+}
+
+//
+//
+// MultiCorr2: several correlation functions with a single walk through the trees.
+//
+//
+
+template <int B>
+MultiCorr2<B>::MultiCorr2(
+    BinnedCorr2<NData,NData,B>* nn, BinnedCorr2<NData,KData,B>* nk,
+    BinnedCorr2<NData,GData,B>* ng, BinnedCorr2<KData,KData,B>* kk,
+    BinnedCorr2<KData,GData,B>* kg, BinnedCorr2<GData,GData,B>* gg) :
+    _nn(nn), _nk(nk), _ng(ng), _kk(kk), _kg(kg), _gg(gg)
+{
+    // The python layer checks that the binning is the same for all of them, so just
+    // take the parameters from the first one.
+    if (_nn) setParams(*_nn);
+    else if (_nk) setParams(*_nk);
+    else if (_ng) setParams(*_ng);
+    else if (_kk) setParams(*_kk);
+    else if (_kg) setParams(*_kg);
+    else { Assert(_gg); setParams(*_gg); }
+}
+
+template <int B> template <int D1, int D2>
+void MultiCorr2<B>::setParams(const BinnedCorr2<D1,D2,B>& corr)
+{
+    _minsep = corr._minsep;
+    _maxsep = corr._maxsep;
+    _nbins = corr._nbins;
+    _binsize = corr._binsize;
+    _b = corr._b;
+    _minrpar = corr._minrpar;
+    _maxrpar = corr._maxrpar;
+    _xp = corr._xp;
+    _yp = corr._yp;
+    _zp = corr._zp;
+    _logminsep = corr._logminsep;
+    _halfminsep = corr._halfminsep;
+    _minsepsq = corr._minsepsq;
+    _maxsepsq = corr._maxsepsq;
+    _bsq = corr._bsq;
+    _fullmaxsep = corr._fullmaxsep;
+    _fullmaxsepsq = corr._fullmaxsepsq;
+    _splitfactorsq = corr._splitfactorsq;
+}
+
+template <int B> template <int C, int M>
+void MultiCorr2<B>::process(const std::vector<CellSet<C> >& cells, bool dots)
+{
+    xdbg<<"Start MultiCorr2 process (auto): M,C = "<<M<<"  "<<C<<std::endl;
+    Assert(!_nk && !_ng && !_kg);
+    const long n1 = cells.size();
+    Assert(n1 > 0);
+
+    MetricHelper<M> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
+    std::vector<WorkItem> items;
+    items.reserve(n1*(n1+1)/2);
+    for (long i=0;i<n1;++i) {
+        const CellSet<C>& c1 = cells[i];
+        double n = c1.getN();
+        items.push_back(WorkItem(PairCost(0.5*n*n, 2.*c1.getSize(), _fullmaxsep), i, -1));
+        for (long j=i+1;j<n1;++j) {
+            const CellSet<C>& c2 = cells[j];
+            double s1 = c1.getSize();
+            double s2 = c2.getSize();
+            const double rsq = metric.DistSq(c1.getPos(), c2.getPos(), s1, s2);
+            double cost = 0.;
+            if (rsq < SQR(_fullmaxsep + s1 + s2))
+                cost = PairCost(double(c1.getN()) * double(c2.getN()), s1+s2, _fullmaxsep);
+            items.push_back(WorkItem(cost, i, j));
+        }
+    }
+    processItems<C,M>(cells, cells, items, BinTypeHelper<B>::doReverse(), dots);
+}
+
+template <int B> template <int C, int M>
+void MultiCorr2<B>::process(const std::vector<CellSet<C> >& cells1,
+                            const std::vector<CellSet<C> >& cells2, bool dots)
+{
+    xdbg<<"Start MultiCorr2 process (cross): M,C = "<<M<<"  "<<C<<std::endl;
+    const long n1 = cells1.size();
+    const long n2 = cells2.size();
+    Assert(n1 > 0);
+    Assert(n2 > 0);
+
+    MetricHelper<M> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
+    std::vector<WorkItem> items;
+    items.reserve(n1*n2);
+    for (long i=0;i<n1;++i) {
+        const CellSet<C>& c1 = cells1[i];
+        for (long j=0;j<n2;++j) {
+            const CellSet<C>& c2 = cells2[j];
+            double s1 = c1.getSize();
+            double s2 = c2.getSize();
+            const double rsq = metric.DistSq(c1.getPos(), c2.getPos(), s1, s2);
+            double cost = 0.;
+            if (rsq < SQR(_fullmaxsep + s1 + s2))
+                cost = PairCost(double(c1.getN()) * double(c2.getN()), s1+s2, _fullmaxsep);
+            items.push_back(WorkItem(cost, i, j));
+        }
+    }
+    processItems<C,M>(cells1, cells2, items, false, dots);
+}
+
+template <int B> template <typename T>
+void MultiCorr2<B>::getAccums(T* corr, int nthreads, int coords)
+{
+    if (!corr) return;
+    Assert(corr->_coords == -1 || corr->_coords == coords);
+    corr->_coords = coords;
+    GetThreadAccumulators(corr->_thread_accums, *corr, nthreads);
+}
+
+template <int B> template <typename T>
+T* MultiCorr2<B>::startThread(T* corr, int tid)
+{
+    if (!corr) return 0;
+    T* accum = corr->_thread_accums[tid];
+    accum->clear();
+    accum->_thread_corrs = 0;
+    return accum;
+}
+
+template <int B> template <typename T>
+void MultiCorr2<B>::finish(T* corr)
+{
+    if (!corr) return;
+    *corr += *corr->_thread_accums[0];
+}
+
+template <int B> template <int C, int M>
+void MultiCorr2<B>::processItems(
+    const std::vector<CellSet<C> >& cells1, const std::vector<CellSet<C> >& cells2,
+    std::vector<WorkItem>& items, bool do_reverse, bool dots)
+{
+    std::stable_sort(items.begin(), items.end());
+    const long nitems = items.size();
+    const long dot_step = std::max(1L, nitems / long(cells1.size()));
+
+#ifdef _OPENMP
+    const int nthreads = omp_get_max_threads();
+#else
+    const int nthreads = 1;
+#endif
+    getAccums(_nn, nthreads, C);
+    getAccums(_nk, nthreads, C);
+    getAccums(_ng, nthreads, C);
+    getAccums(_kk, nthreads, C);
+    getAccums(_kg, nthreads, C);
+    getAccums(_gg, nthreads, C);
+
+#ifdef _OPENMP
+#pragma omp parallel
+    {
+        const int tid = omp_get_thread_num();
+#else
+    {
+        const int tid = 0;
+#endif
+        // Each thread has an engine that adds to its own copy of each correlation function.
+        MultiCorr2<B> mc2(*this);
+        mc2._nn = startThread(_nn, tid);
+        mc2._nk = startThread(_nk, tid);
+        mc2._ng = startThread(_ng, tid);
+        mc2._kk = startThread(_kk, tid);
+        mc2._kg = startThread(_kg, tid);
+        mc2._gg = startThread(_gg, tid);
+
+        MetricHelper<M> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (long n=0;n<nitems;++n) {
+            if (dots && n % dot_step == 0) {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+                std::cout<<'.'<<std::flush;
+            }
+            const WorkItem& item = items[n];
+            const CellSet<C>& c1 = cells1[item.i];
+            if (item.j < 0) {
+                mc2.template process2<C,M>(c1, metric);
+            } else {
+                mc2.template process11<C,M>(c1, cells2[item.j], metric, do_reverse);
+            }
+        }
+        if (mc2._nn) mc2._nn->flushPairs();
+        if (mc2._nk) mc2._nk->flushPairs();
+        if (mc2._ng) mc2._ng->flushPairs();
+        if (mc2._kk) mc2._kk->flushPairs();
+        if (mc2._kg) mc2._kg->flushPairs();
+        if (mc2._gg) mc2._gg->flushPairs();
+#ifdef _OPENMP
+        if (_nn) TreeReduce(_nn->_thread_accums);
+        if (_nk) TreeReduce(_nk->_thread_accums);
+        if (_ng) TreeReduce(_ng->_thread_accums);
+        if (_kk) TreeReduce(_kk->_thread_accums);
+        if (_kg) TreeReduce(_kg->_thread_accums);
+        if (_gg) TreeReduce(_gg->_thread_accums);
+#endif
+    }
+    finish(_nn);
+    finish(_nk);
+    finish(_ng);
+    finish(_kk);
+    finish(_kg);
+    finish(_gg);
+    if (dots) std::cout<<std::endl;
+}
+
+template <int B> template <int C, int M>
+void MultiCorr2<B>::process2(const CellSet<C>& c12, const MetricHelper<M>& metric)
+{
+    if (c12.getW() == 0.) return;
+    if (c12.getSize() <= _halfminsep) return;
+
+    process2<C,M>(c12.getLeft(), metric);
+    process2<C,M>(c12.getRight(), metric);
+    process11<C,M>(c12.getLeft(), c12.getRight(), metric, BinTypeHelper<B>::doReverse());
+}
+
+template <int B> template <int C, int M>
+void MultiCorr2<B>::process11(const CellSet<C>& c1, const CellSet<C>& c2,
+                              const MetricHelper<M>& metric, bool do_reverse)
+{
+    if (c1.getW() == 0. || c2.getW() == 0.) return;
+
+    const Position<C>& p1 = c1.getPos();
+    const Position<C>& p2 = c2.getPos();
+    double s1 = c1.getSize(); // May be modified by DistSq function.
+    double s2 = c2.getSize(); // "
+    double rsq;
+    double rpar = 0; // Gets set to correct value by this function if appropriate
+    const bool in_rpar = FusedMetric<M,C>::distSqInRPar(metric, p1, p2, s1, s2, rsq, rpar);
+    const double s1ps2 = s1+s2;
+
+    if (!in_rpar) {
+        return;
+    }
+
+    if (BinTypeHelper<B>::tooSmallDist(rsq, s1ps2, _minsep, _minsepsq) &&
+        metric.tooSmallDist(p1, p2, rsq, rpar, s1ps2, _minsep, _minsepsq)) {
+        return;
+    }
+
+    if (BinTypeHelper<B>::tooLargeDist(rsq, s1ps2, _maxsep, _maxsepsq) &&
+        metric.tooLargeDist(p1, p2, rsq, rpar, s1ps2, _fullmaxsep, _fullmaxsepsq)) {
+        return;
+    }
+
+    int k=-1;
+    double r=0,logr=0;  // If singleBin is true, these values are set for use by directProcess11
+    if (metric.isRParInsideRange(p1, p2, s1ps2, rpar) &&
+        BinTypeHelper<B>::singleBin(rsq, s1ps2, p1, p2, _binsize, _b, _bsq,
+                                    _minsep, _maxsep, _logminsep, k, r, logr))
+    {
+        if (BinTypeHelper<B>::isRSqInRange(rsq, p1, p2, _minsep, _minsepsq, _maxsep, _maxsepsq)) {
+            directProcess11(c1,c2,rsq,do_reverse,k,r,logr);
+        }
+    } else {
+        bool split1=false, split2=false;
+        double bsq_eff = BinTypeHelper<B>::getEffectiveBSq(rsq,_bsq);
+        CalcSplitSq(split1,split2,s1,s2,s1ps2,bsq_eff,_splitfactorsq);
+
+        if (split1 && split2) {
+            process11<C,M>(c1.getLeft(),c2.getLeft(),metric,do_reverse);
+            process11<C,M>(c1.getLeft(),c2.getRight(),metric,do_reverse);
+            process11<C,M>(c1.getRight(),c2.getLeft(),metric,do_reverse);
+            process11<C,M>(c1.getRight(),c2.getRight(),metric,do_reverse);
+        } else if (split1) {
+            process11<C,M>(c1.getLeft(),c2,metric,do_reverse);
+            process11<C,M>(c1.getRight(),c2,metric,do_reverse);
+        } else {
+            Assert(split2);
+            process11<C,M>(c1,c2.getLeft(),metric,do_reverse);
+            process11<C,M>(c1,c2.getRight(),metric,do_reverse);
+        }
+    }
+}
+
+template <int B> template <int C>
+void MultiCorr2<B>::directProcess11(const CellSet<C>& c1, const CellSet<C>& c2, double rsq,
+                                    bool do_reverse, int k, double r, double logr)
+{
+    if (_nn) _nn->directProcess11(*c1.n, *c2.n, rsq, do_reverse, k, r, logr);
+    if (_nk) _nk->directProcess11(*c1.n, *c2.k, rsq, do_reverse, k, r, logr);
+    if (_ng) _ng->directProcess11(*c1.n, *c2.g, rsq, do_reverse, k, r, logr);
+    if (_kk) _kk->directProcess11(*c1.k, *c2.k, rsq, do_reverse, k, r, logr);
+    if (_kg) _kg->directProcess11(*c1.k, *c2.g, rsq, do_reverse, k, r, logr);
+    if (_gg) _gg->directProcess11(*c1.g, *c2.g, rsq, do_reverse, k, r, logr);
+}
+
+//
+//
+// MultiBinCorr2: one correlation function with several binnings in a single walk.
+//
+//
+
+template <int D1, int D2>
+MultiBinCorr2<D1,D2>::MultiBinCorr2(const std::vector<BinnedCorr2<D1,D2,Log>*>& logs,
+                                    const std::vector<BinnedCorr2<D1,D2,Linear>*>& lins,
+                                    const std::vector<BinnedCorr2<D1,D2,TwoD>*>& twods) :
+    _logs(logs), _lins(lins), _twods(twods), _n(logs.size() + lins.size() + twods.size()),
+    _halfminsep(std::numeric_limits<double>::max()), _fullmaxsep(0.),
+    _splitfactorsq(std::numeric_limits<double>::max())
+{
+    Assert(_n > 0);
+    Assert(_n <= MAX_BINNINGS);
+    // The python layer checks that the metric parameters are the same for all of them.
+    for (size_t i=0; i<_logs.size(); ++i) {
+        _halfminsep = std::min(_halfminsep, _logs[i]->_halfminsep);
+        _fullmaxsep = std::max(_fullmaxsep, _logs[i]->_fullmaxsep);
+        _splitfactorsq = std::min(_splitfactorsq, _logs[i]->_splitfactorsq);
+        _minrpar = _logs[i]->_minrpar; _maxrpar = _logs[i]->_maxrpar;
+        _xp = _logs[i]->_xp; _yp = _logs[i]->_yp; _zp = _logs[i]->_zp;
+    }
+    for (size_t i=0; i<_lins.size(); ++i) {
+        _halfminsep = std::min(_halfminsep, _lins[i]->_halfminsep);
+        _fullmaxsep = std::max(_fullmaxsep, _lins[i]->_fullmaxsep);
+        _splitfactorsq = std::min(_splitfactorsq, _lins[i]->_splitfactorsq);
+        _minrpar = _lins[i]->_minrpar; _maxrpar = _lins[i]->_maxrpar;
+        _xp = _lins[i]->_xp; _yp = _lins[i]->_yp; _zp = _lins[i]->_zp;
+    }
+    for (size_t i=0; i<_twods.size(); ++i) {
+        _halfminsep = std::min(_halfminsep, _twods[i]->_halfminsep);
+        _fullmaxsep = std::max(_fullmaxsep, _twods[i]->_fullmaxsep);
+        _splitfactorsq = std::min(_splitfactorsq, _twods[i]->_splitfactorsq);
+        _minrpar = _twods[i]->_minrpar; _maxrpar = _twods[i]->_maxrpar;
+        _xp = _twods[i]->_xp; _yp = _twods[i]->_yp; _zp = _twods[i]->_zp;
+    }
+}
+
+template <int D1, int D2> template <int C, int M>
+void MultiBinCorr2<D1,D2>::process(const Field<D1,C>& field, bool dots)
+{
+    xdbg<<"Start MultiBinCorr2 process (auto): M,C = "<<M<<"  "<<C<<std::endl;
+    Assert(D1 == D2);
+    const long n1 = field.getNTopLevel();
+    Assert(n1 > 0);
+
+    const std::vector<Cell<D1,C>*>& cells = field.getCells();
+    MetricHelper<M> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
+    std::vector<WorkItem> items;
+    items.reserve(n1*(n1+1)/2);
+    for (long i=0;i<n1;++i) {
+        const Cell<D1,C>& c1 = *cells[i];
+        double n = c1.getN();
+        items.push_back(WorkItem(PairCost(0.5*n*n, 2.*c1.getSize(), _fullmaxsep), i, -1));
+        for (long j=i+1;j<n1;++j) {
+            const Cell<D1,C>& c2 = *cells[j];
+            double s1 = c1.getSize();
+            double s2 = c2.getSize();
+            const double rsq = metric.DistSq(c1.getPos(), c2.getPos(), s1, s2);
+            double cost = 0.;
+            if (rsq < SQR(_fullmaxsep + s1 + s2))
+                cost = PairCost(double(c1.getN()) * double(c2.getN()), s1+s2, _fullmaxsep);
+            items.push_back(WorkItem(cost, i, j));
+        }
+    }
+    processItems<C,M>(cells, cells, items, true, dots);
+}
+
+template <int D1, int D2> template <int C, int M>
+void MultiBinCorr2<D1,D2>::process(const Field<D1,C>& field1, const Field<D2,C>& field2,
+                                   bool dots)
+{
+    xdbg<<"Start MultiBinCorr2 process (cross): M,C = "<<M<<"  "<<C<<std::endl;
+    const long n1 = field1.getNTopLevel();
+    const long n2 = field2.getNTopLevel();
+    Assert(n1 > 0);
+    Assert(n2 > 0);
+
+    const std::vector<Cell<D1,C>*>& cells1 = field1.getCells();
+    const std::vector<Cell<D2,C>*>& cells2 = field2.getCells();
+    MetricHelper<M> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
+    std::vector<WorkItem> items;
+    items.reserve(n1*n2);
+    for (long i=0;i<n1;++i) {
+        const Cell<D1,C>& c1 = *cells1[i];
+        for (long j=0;j<n2;++j) {
+            const Cell<D2,C>& c2 = *cells2[j];
+            double s1 = c1.getSize();
+            double s2 = c2.getSize();
+            const double rsq = metric.DistSq(c1.getPos(), c2.getPos(), s1, s2);
+            double cost = 0.;
+            if (rsq < SQR(_fullmaxsep + s1 + s2))
+                cost = PairCost(double(c1.getN()) * double(c2.getN()), s1+s2, _fullmaxsep);
+            items.push_back(WorkItem(cost, i, j));
+        }
+    }
+    processItems<C,M>(cells1, cells2, items, false, dots);
+}
+
+// As for BinnedCorr2, process2 and the auto-correlation process are only valid if D1 == D2.
+template <int D1, int D2, int C, int M>
+struct MultiBinHelper
+{
+    static void process2(MultiBinCorr2<D1,D2>& , const Cell<D1,C>&, const MetricHelper<M>&,
+                         unsigned int) {}
+    static void process(MultiBinCorr2<D1,D2>& , const Field<D1,C>& , bool )
+    { Assert(false); }
+};
+
+template <int D, int C, int M>
+struct MultiBinHelper<D,D,C,M>
+{
+    static void process2(MultiBinCorr2<D,D>& mb2, const Cell<D,C>& c12,
+                         const MetricHelper<M>& m, unsigned int mask)
+    { mb2.template process2<C,M>(c12, m, mask); }
+    static void process(MultiBinCorr2<D,D>& mb2, const Field<D,C>& field, bool dots)
+    { mb2.template process<C,M>(field, dots); }
+};
+
+template <int D1, int D2> template <int C, int M>
+void MultiBinCorr2<D1,D2>::processItems(
+    const std::vector<Cell<D1,C>*>& cells1, const std::vector<Cell<D2,C>*>& cells2,
+    std::vector<WorkItem>& items, bool is_auto, bool dots)
+{
+    std::stable_sort(items.begin(), items.end());
+    const long nitems = items.size();
+    const long dot_step = std::max(1L, nitems / long(cells1.size()));
+    const unsigned int all = _n == 32 ? ~0U : (1U << _n) - 1U;
+
+#ifdef _OPENMP
+    const int nthreads = omp_get_max_threads();
+#else
+    const int nthreads = 1;
+#endif
+    for (size_t i=0; i<_logs.size(); ++i) {
+        Assert(_logs[i]->_coords == -1 || _logs[i]->_coords == C);
+        _logs[i]->_coords = C;
+        GetThreadAccumulators(_logs[i]->_thread_accums, *_logs[i], nthreads);
+    }
+    for (size_t i=0; i<_lins.size(); ++i) {
+        Assert(_lins[i]->_coords == -1 || _lins[i]->_coords == C);
+        _lins[i]->_coords = C;
+        GetThreadAccumulators(_lins[i]->_thread_accums, *_lins[i], nthreads);
+    }
+    for (size_t i=0; i<_twods.size(); ++i) {
+        Assert(_twods[i]->_coords == -1 || _twods[i]->_coords == C);
+        _twods[i]->_coords = C;
+        GetThreadAccumulators(_twods[i]->_thread_accums, *_twods[i], nthreads);
+    }
+
+#ifdef _OPENMP
+#pragma omp parallel
+    {
+        const int tid = omp_get_thread_num();
+#else
+    {
+        const int tid = 0;
+#endif
+        // Each thread has an engine that adds to its own copy of each correlation function.
+        MultiBinCorr2<D1,D2> mb2(*this);
+        for (size_t i=0; i<_logs.size(); ++i) {
+            mb2._logs[i] = _logs[i]->_thread_accums[tid];
+            mb2._logs[i]->clear();
+            mb2._logs[i]->_thread_corrs = 0;
+        }
+        for (size_t i=0; i<_lins.size(); ++i) {
+            mb2._lins[i] = _lins[i]->_thread_accums[tid];
+            mb2._lins[i]->clear();
+            mb2._lins[i]->_thread_corrs = 0;
+        }
+        for (size_t i=0; i<_twods.size(); ++i) {
+            mb2._twods[i] = _twods[i]->_thread_accums[tid];
+            mb2._twods[i]->clear();
+            mb2._twods[i]->_thread_corrs = 0;
+        }
+
+        MetricHelper<M> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (long n=0;n<nitems;++n) {
+            if (dots && n % dot_step == 0) {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+                std::cout<<'.'<<std::flush;
+            }
+            const WorkItem& item = items[n];
+            const Cell<D1,C>& c1 = *cells1[item.i];
+            if (item.j < 0) {
+                MultiBinHelper<D1,D2,C,M>::process2(mb2, c1, metric, all);
+            } else {
+                mb2.template process11<C,M>(c1, *cells2[item.j], metric, is_auto, all);
+            }
+        }
+        for (size_t i=0; i<_logs.size(); ++i) mb2._logs[i]->flushPairs();
+        for (size_t i=0; i<_lins.size(); ++i) mb2._lins[i]->flushPairs();
+        for (size_t i=0; i<_twods.size(); ++i) mb2._twods[i]->flushPairs();
+#ifdef _OPENMP
+        for (size_t i=0; i<_logs.size(); ++i) TreeReduce(_logs[i]->_thread_accums);
+        for (size_t i=0; i<_lins.size(); ++i) TreeReduce(_lins[i]->_thread_accums);
+        for (size_t i=0; i<_twods.size(); ++i) TreeReduce(_twods[i]->_thread_accums);
+#endif
+    }
+    for (size_t i=0; i<_logs.size(); ++i) *_logs[i] += *_logs[i]->_thread_accums[0];
+    for (size_t i=0; i<_lins.size(); ++i) *_lins[i] += *_lins[i]->_thread_accums[0];
+    for (size_t i=0; i<_twods.size(); ++i) *_twods[i] += *_twods[i]->_thread_accums[0];
+    if (dots) std::cout<<std::endl;
+}
+
+template <int D1, int D2> template <int C, int M>
+void MultiBinCorr2<D1,D2>::process2(const Cell<D1,C>& c12, const MetricHelper<M>& metric,
+                                    unsigned int mask)
+{
+    if (c12.getW() == 0.) return;
+    if (c12.getSize() <= _halfminsep) return;
+
+    process2<C,M>(*c12.getLeft(), metric, mask);
+    process2<C,M>(*c12.getRight(), metric, mask);
+    process11<C,M>(*c12.getLeft(), *c12.getRight(), metric, true, mask);
+}
+
+template <int D1, int D2> template <int B, int C, int M>
+bool MultiBinCorr2<D1,D2>::checkBinning(
+    BinnedCorr2<D1,D2,B>& bc2, const Cell<D1,C>& c1, const Cell<D2,C>& c2,
+    const MetricHelper<M>& metric, double rsq, double s1ps2, double rpar, bool do_reverse,
+    double& bsq_eff)
+{
+    const Position<C>& p1 = c1.getPos();
+    const Position<C>& p2 = c2.getPos();
+
+    if (BinTypeHelper<B>::tooSmallDist(rsq, s1ps2, bc2._minsep, bc2._minsepsq) &&
+        metric.tooSmallDist(p1, p2, rsq, rpar, s1ps2, bc2._minsep, bc2._minsepsq)) {
+        return false;
+    }
+    if (BinTypeHelper<B>::tooLargeDist(rsq, s1ps2, bc2._maxsep, bc2._maxsepsq) &&
+        metric.tooLargeDist(p1, p2, rsq, rpar, s1ps2, bc2._fullmaxsep, bc2._fullmaxsepsq)) {
+        return false;
+    }
+
+    int k=-1;
+    double r=0,logr=0;
+    if (metric.isRParInsideRange(p1, p2, s1ps2, rpar) &&
+        BinTypeHelper<B>::singleBin(rsq, s1ps2, p1, p2, bc2._binsize, bc2._b, bc2._bsq,
+                                    bc2._minsep, bc2._maxsep, bc2._logminsep, k, r, logr))
+    {
+        if (BinTypeHelper<B>::isRSqInRange(rsq, p1, p2, bc2._minsep, bc2._minsepsq,
+                                           bc2._maxsep, bc2._maxsepsq)) {
+            bc2.directProcess11(c1,c2,rsq,do_reverse,k,r,logr);
+        }
+        return false;
+    }
+    bsq_eff = std::min(bsq_eff, BinTypeHelper<B>::getEffectiveBSq(rsq,bc2._bsq));
+    return true;
+}
+
+template <int D1, int D2> template <int C, int M>
+void MultiBinCorr2<D1,D2>::process11(const Cell<D1,C>& c1, const Cell<D2,C>& c2,
+                                     const MetricHelper<M>& metric, bool is_auto,
+                                     unsigned int mask)
+{
+    if (c1.getW() == 0. || c2.getW() == 0.) return;
+
+    const Position<C>& p1 = c1.getPos();
+    const Position<C>& p2 = c2.getPos();
+    double s1 = c1.getSize(); // May be modified by DistSq function.
+    double s2 = c2.getSize(); // "
+    double rsq;
+    double rpar = 0; // Gets set to correct value by this function if appropriate
+    const bool in_rpar = FusedMetric<M,C>::distSqInRPar(metric, p1, p2, s1, s2, rsq, rpar);
+    const double s1ps2 = s1+s2;
+
+    if (!in_rpar) {
+        return;
+    }
+
+    // Find which of the binnings still need this pair to be split.
+    unsigned int split_mask = 0;
+    double bsq_eff = std::numeric_limits<double>::max();
+    int n = 0;
+    for (size_t i=0; i<_logs.size(); ++i, ++n) {
+        if ((mask & (1U << n)) &&
+            checkBinning(*_logs[i], c1, c2, metric, rsq, s1ps2, rpar,
+                         is_auto && BinTypeHelper<Log>::doReverse(), bsq_eff))
+            split_mask |= 1U << n;
+    }
+    for (size_t i=0; i<_lins.size(); ++i, ++n) {
+        if ((mask & (1U << n)) &&
+            checkBinning(*_lins[i], c1, c2, metric, rsq, s1ps2, rpar,
+                         is_auto && BinTypeHelper<Linear>::doReverse(), bsq_eff))
+            split_mask |= 1U << n;
+    }
+    for (size_t i=0; i<_twods.size(); ++i, ++n) {
+        if ((mask & (1U << n)) &&
+            checkBinning(*_twods[i], c1, c2, metric, rsq, s1ps2, rpar,
+                         is_auto && BinTypeHelper<TwoD>::doReverse(), bsq_eff))
+            split_mask |= 1U << n;
+    }
+    if (!split_mask) return;
+
+    bool split1=false, split2=false;
+    CalcSplitSq(split1,split2,s1,s2,s1ps2,bsq_eff,_splitfactorsq);
+
+    if (split1 && split2) {
+        Assert(c1.getLeft());
+        Assert(c2.getLeft());
+        process11<C,M>(*c1.getLeft(),*c2.getLeft(),metric,is_auto,split_mask);
+        process11<C,M>(*c1.getLeft(),*c2.getRight(),metric,is_auto,split_mask);
+        process11<C,M>(*c1.getRight(),*c2.getLeft(),metric,is_auto,split_mask);
+        process11<C,M>(*c1.getRight(),*c2.getRight(),metric,is_auto,split_mask);
+    } else if (split1) {
+        Assert(c1.getLeft());
+        process11<C,M>(*c1.getLeft(),c2,metric,is_auto,split_mask);
+        process11<C,M>(*c1.getRight(),c2,metric,is_auto,split_mask);
+    } else {
+        Assert(split2);
+        Assert(c2.getLeft());
+        process11<C,M>(c1,*c2.getLeft(),metric,is_auto,split_mask);
+        process11<C,M>(c1,*c2.getRight(),metric,is_auto,split_mask);
+    }
+}
+
+//
+//
+// MultiPartnerCorr2: the cross-correlations of one field with several others in a single walk.
+//
+//
+
+template <int D1, int D2, int B>
+MultiPartnerCorr2<D1,D2,B>::MultiPartnerCorr2(const std::vector<BinnedCorr2<D1,D2,B>*>& corrs) :
+    _corrs(corrs)
+{
+    Assert(_corrs.size() > 0);
+    // The python layer checks that the metric parameters are the same for all of them.
+    _minrpar = _corrs[0]->_minrpar; _maxrpar = _corrs[0]->_maxrpar;
+    _xp = _corrs[0]->_xp; _yp = _corrs[0]->_yp; _zp = _corrs[0]->_zp;
+}
+
+template <int D1, int D2, int B> template <int C, int M, bool S1>
+void MultiPartnerCorr2<D1,D2,B>::process(
+    const typename PartnerCells<D1,D2,C,S1>::SharedField& field,
+    const std::vector<const typename PartnerCells<D1,D2,C,S1>::PartnerField*>& fields,
+    bool dots)
+{
+    xdbg<<"Start MultiPartnerCorr2 process: M,C = "<<M<<"  "<<C<<"  S1 = "<<S1<<std::endl;
+    typedef PartnerCells<D1,D2,C,S1> PC;
+    typedef typename PC::Shared Shared;
+    typedef typename PC::Partner Partner;
+    typedef std::pair<int, const Partner*> PartnerPair;
+    Assert(fields.size() == _corrs.size());
+    const int npartner = _corrs.size();
+
+    // There is one work item for each top-level cell of the shared field, which has the
+    // top-level cells of all the partner fields that are close enough to it.
+    const std::vector<Shared*>& cells = field.getCells();
+    const long n1 = cells.size();
+    Assert(n1 > 0);
+    MetricHelper<M> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
+    std::vector<std::vector<PartnerPair> > pairs(n1);
+    std::vector<WorkItem> items;
+    items.reserve(n1);
+    for (long i=0;i<n1;++i) items.push_back(WorkItem(0., i, -1));
+    for (int p=0;p<npartner;++p) {
+        const std::vector<Partner*>& pcells = fields[p]->getCells();
+        std::vector<WorkItem> pitems;
+        if (S1) {
+            AddCrossItems(cells, pcells, metric, _corrs[p]->_fullmaxsep, p, pitems);
+        } else {
+            AddCrossItems(pcells, cells, metric, _corrs[p]->_fullmaxsep, p, pitems);
+        }
+        for (size_t n=0; n<pitems.size(); ++n) {
+            const WorkItem& pitem = pitems[n];
+            if (pitem.cost == 0.) continue;
+            const long i = S1 ? pitem.i : pitem.j;
+            const long j = S1 ? pitem.j : pitem.i;
+            pairs[i].push_back(PartnerPair(p, pcells[j]));
+            items[i].cost += pitem.cost;
+        }
+    }
+    std::stable_sort(items.begin(), items.end());
+    const long nitems = items.size();
+    dbg<<"Process "<<nitems<<" shared cells with "<<npartner<<" partners\n";
+
+#ifdef _OPENMP
+    const int nthreads = omp_get_max_threads();
+#else
+    const int nthreads = 1;
+#endif
+    for (int p=0;p<npartner;++p) {
+        Assert(_corrs[p]->_coords == -1 || _corrs[p]->_coords == C);
+        _corrs[p]->_coords = C;
+        GetThreadAccumulators(_corrs[p]->_thread_accums, *_corrs[p], nthreads);
+    }
+
+#ifdef _OPENMP
+#pragma omp parallel
+    {
+        const int tid = omp_get_thread_num();
+#else
+    {
+        const int tid = 0;
+#endif
+        // Each thread has an engine that adds to its own copy of each correlation function.
+        MultiPartnerCorr2<D1,D2,B> mp2(*this);
+        for (int p=0;p<npartner;++p) {
+            mp2._corrs[p] = _corrs[p]->_thread_accums[tid];
+            mp2._corrs[p]->clear();
+            mp2._corrs[p]->_thread_corrs = 0;
+        }
+
+        MetricHelper<M> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (long n=0;n<nitems;++n) {
+            if (dots) {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+                std::cout<<'.'<<std::flush;
+            }
+            const WorkItem& item = items[n];
+            if (pairs[item.i].empty()) continue;
+            TraceScope trace("partner item", n);
+            mp2.template process11<C,M,S1>(*cells[item.i], pairs[item.i], metric);
+        }
+        for (int p=0;p<npartner;++p) mp2._corrs[p]->flushPairs();
+#ifdef _OPENMP
+        for (int p=0;p<npartner;++p) TreeReduce(_corrs[p]->_thread_accums);
+#endif
+    }
+    for (int p=0;p<npartner;++p) *_corrs[p] += *_corrs[p]->_thread_accums[0];
+    if (dots) std::cout<<std::endl;
+}
+
+template <int D1, int D2, int B> template <int C, int M, bool S1>
+void MultiPartnerCorr2<D1,D2,B>::process11(
+    const typename PartnerCells<D1,D2,C,S1>::Shared& s,
+    const std::vector<std::pair<int, const typename PartnerCells<D1,D2,C,S1>::Partner*> >& pairs,
+    const MetricHelper<M>& metric)
+{
+    typedef PartnerCells<D1,D2,C,S1> PC;
+    typedef typename PC::Partner Partner;
+    typedef std::pair<int, const Partner*> PartnerPair;
+    if (s.getW() == 0.) return;
+
+    // The pairs that need the shared cell to be split, which are passed on to its children.
+    std::vector<PartnerPair> deferred;
+    for (size_t n=0; n<pairs.size(); ++n) {
+        BinnedCorr2<D1,D2,B>& bc2 = *_corrs[pairs[n].first];
+        const Partner& pc = *pairs[n].second;
+        if (pc.getW() == 0.) continue;
+        const Cell<D1,C>& c1 = PC::first(s, pc);
+        const Cell<D2,C>& c2 = PC::second(s, pc);
+        ++bc2._stats[TraversalStats::NODES];
+
+        // The rest is the same as BinnedCorr2::process11, except for where the children go.
+        const Position<C>& p1 = c1.getPos();
+        const Position<C>& p2 = c2.getPos();
+        double s1 = c1.getSize(); // May be modified by DistSq function.
+        double s2 = c2.getSize(); // "
+        double rsq;
+        double rpar = 0; // Gets set to correct value by this function if appropriate
+        const bool in_rpar = FusedMetric<M,C>::distSqInRPar(metric, p1, p2, s1, s2, rsq, rpar);
+        const double s1ps2 = s1+s2;
+
+        if (!in_rpar) {
+            ++bc2._stats[TraversalStats::RPAR_EXIT];
+            continue;
+        }
+        if (BinTypeHelper<B>::tooSmallDist(rsq, s1ps2, bc2._minsep, bc2._minsepsq) &&
+            metric.tooSmallDist(p1, p2, rsq, rpar, s1ps2, bc2._minsep, bc2._minsepsq)) {
+            ++bc2._stats[TraversalStats::SMALL_EXIT];
+            continue;
+        }
+        if (BinTypeHelper<B>::tooLargeDist(rsq, s1ps2, bc2._maxsep, bc2._maxsepsq) &&
+            metric.tooLargeDist(p1, p2, rsq, rpar, s1ps2, bc2._fullmaxsep, bc2._fullmaxsepsq)) {
+            ++bc2._stats[TraversalStats::LARGE_EXIT];
+            continue;
+        }
+
+        int k=-1;
+        double r=0,logr=0;
+        if (metric.isRParInsideRange(p1, p2, s1ps2, rpar) &&
+            bc2.singleBin(rsq, s1ps2, p1, p2, k, r, logr))
+        {
+            ++bc2._stats[TraversalStats::SINGLE_BIN];
+            if (BinTypeHelper<B>::isRSqInRange(rsq, p1, p2, bc2._minsep, bc2._minsepsq,
+                                               bc2._maxsep, bc2._maxsepsq)) {
+                bc2.directProcess11(c1,c2,rsq,false,k,r,logr);
+            }
+            continue;
+        }
+        if (c1.getN() <= bc2._leaf_size && c2.getN() <= bc2._leaf_size) {
+            bc2.template processLeaves<C,M>(c1,c2,metric,false);
+            continue;
+        }
+        bool split1=false, split2=false;
+        double bsq_eff = BinTypeHelper<B>::getEffectiveBSq(rsq,bc2._bsq);
+        CalcSplitSq(split1,split2,s1,s2,s1ps2,bsq_eff,bc2._splitfactorsq);
+        ++bc2._stats[split1 && split2 ? TraversalStats::SPLIT_MULTI :
+                     split1 ? TraversalStats::SPLIT1 : TraversalStats::SPLIT2];
+        const bool split_shared = S1 ? split1 : split2;
+        const bool split_partner = S1 ? split2 : split1;
+
+        if (!split_shared) {
+            // Only the partner cell needs to be split, so this pair is done as usual.
+            Assert(split_partner);
+            Assert(pc.getLeft());
+            Assert(pc.getRight());
+            bc2.template process11<C,M>(PC::first(s, *pc.getLeft()), PC::second(s, *pc.getLeft()),
+                                        metric, false);
+            bc2.template process11<C,M>(PC::first(s, *pc.getRight()),
+                                        PC::second(s, *pc.getRight()), metric, false);
+        } else if (split_partner) {
+            Assert(pc.getLeft());
+            Assert(pc.getRight());
+            deferred.push_back(PartnerPair(pairs[n].first, pc.getLeft()));
+            deferred.push_back(PartnerPair(pairs[n].first, pc.getRight()));
+        } else {
+            deferred.push_back(pairs[n]);
+        }
+    }
+    if (deferred.empty()) return;
+
+    Assert(s.getLeft());
+    Assert(s.getRight());
+    process11<C,M,S1>(*s.getLeft(), deferred, metric);
+    process11<C,M,S1>(*s.getRight(), deferred, metric);
+}
+
+// The projection factors exp(-2i alpha) for the shears of a pair of cells at p1 and p2, which
+// are the same as the ones used by ProjectHelper<C>::ProjectShears.  The projected shears are
+// then g1 e1 and g2 e2.  (For NG and KG, only e2 is needed.)
+template <int C>
+struct ColumnProjection
+{
+    static void get(const Position<C>& p1, const Position<C>& p2,
+                    std::complex<double>& e1, std::complex<double>& e2)
+    {
+        e1 = e2 = 1.;
+        ProjectHelper<Sphere>::ProjectShear2(p2,p1,e1);
+        ProjectHelper<Sphere>::ProjectShear2(p1,p2,e2);
+    }
+};
+
+template <>
+struct ColumnProjection<Flat>
+{
+    static void get(const Position<Flat>& p1, const Position<Flat>& p2,
+                    std::complex<double>& e1, std::complex<double>& e2)
+    {
+        std::complex<double> cr(p2 - p1);
+        e1 = e2 = conj(cr*cr)/std::norm(cr);
+    }
+};
+
+template <>
+struct ColumnProjection<ThreeD>
+{
+    static void get(const Position<ThreeD>& p1, const Position<ThreeD>& p2,
+                    std::complex<double>& e1, std::complex<double>& e2)
+    {
+        Position<Sphere> sp1(p1);
+        Position<Sphere> sp2(p2);
+        ColumnProjection<Sphere>::get(sp1, sp2, e1, e2);
+    }
+};
+
+// The values of a pair of cells for ColumnHelper::add.
+struct ColumnPair
+{
+    double w1;                  // The weight of c1 (if D1 == NData)
+    const float* v1r;           // The sums of w k or w g for each column of c1
+    const float* v1i;
+    const float* v2r;           // And for c2
+    const float* v2i;
+    double e1r, e1i, e2r, e2i;  // The projection factors for the shears.
+};
+
+// Add the xi values for each column of a pair of cells to the bin xi, which has NXI rows
+// of ncol values.  These are the same calculations as in the DirectHelper, but with a loop
+// over the columns.
+template <int D1, int D2>
+struct ColumnHelper;
+
+template <>
+struct ColumnHelper<NData,KData>
+{
+    enum { NXI = 1 };
+
+    static void add(const ColumnPair& p, int ncol, double* xi)
+    {
+        const double w1 = p.w1;
+        const float* v2 = p.v2r;
+        for (int j=0; j<ncol; ++j) xi[j] += w1 * v2[j];
+    }
+};
+
+template <>
+struct ColumnHelper<NData,GData>
+{
+    enum { NXI = 2 };
+
+    static void add(const ColumnPair& p, int ncol, double* xi)
+    {
+        // As for NG, the minus sign makes this tangential shear.
+        const double w1 = -p.w1;
+        const float* g2r = p.v2r;
+        const float* g2i = p.v2i;
+        const double er = p.e2r, ei = p.e2i;
+        double* xi_im = xi + ncol;
+        for (int j=0; j<ncol; ++j) {
+            xi[j] += w1 * (g2r[j] * er - g2i[j] * ei);
+            xi_im[j] += w1 * (g2r[j] * ei + g2i[j] * er);
+        }
+    }
+};
+
+template <>
+struct ColumnHelper<KData,KData>
+{
+    enum { NXI = 1 };
+
+    static void add(const ColumnPair& p, int ncol, double* xi)
+    {
+        const float* v1 = p.v1r;
+        const float* v2 = p.v2r;
+        for (int j=0; j<ncol; ++j) xi[j] += double(v1[j]) * v2[j];
+    }
+};
+
+template <>
+struct ColumnHelper<KData,GData>
+{
+    enum { NXI = 2 };
+
+    static void add(const ColumnPair& p, int ncol, double* xi)
+    {
+        const float* v1 = p.v1r;
+        const float* g2r = p.v2r;
+        const float* g2i = p.v2i;
+        const double er = p.e2r, ei = p.e2i;
+        double* xi_im = xi + ncol;
+        for (int j=0; j<ncol; ++j) {
+            const double k1 = -v1[j];
+            xi[j] += k1 * (g2r[j] * er - g2i[j] * ei);
+            xi_im[j] += k1 * (g2r[j] * ei + g2i[j] * er);
+        }
+    }
+};
+
+template <>
+struct ColumnHelper<GData,GData>
+{
+    enum { NXI = 4 };
+
+    static void add(const ColumnPair& p, int ncol, double* xi)
+    {
+        const float* a1r = p.v1r;
+        const float* a1i = p.v1i;
+        const float* a2r = p.v2r;
+        const float* a2i = p.v2i;
+        const double e1r = p.e1r, e1i = p.e1i, e2r = p.e2r, e2i = p.e2i;
+        double* xip = xi;
+        double* xip_im = xi + ncol;
+        double* xim = xi + 2*ncol;
+        double* xim_im = xi + 3*ncol;
+        for (int j=0; j<ncol; ++j) {
+            const double g1r = a1r[j] * e1r - a1i[j] * e1i;
+            const double g1i = a1r[j] * e1i + a1i[j] * e1r;
+            const double g2r = a2r[j] * e2r - a2i[j] * e2i;
+            const double g2i = a2r[j] * e2i + a2i[j] * e2r;
+            const double g1rg2r = g1r * g2r;
+            const double g1rg2i = g1r * g2i;
+            const double g1ig2r = g1i * g2r;
+            const double g1ig2i = g1i * g2i;
+            xip[j] += g1rg2r + g1ig2i;       // g1 * conj(g2)
+            xip_im[j] += g1ig2r - g1rg2i;
+            xim[j] += g1rg2r - g1ig2i;       // g1 * g2
+            xim_im[j] += g1ig2r + g1rg2i;
+        }
+    }
+};
+
+template <int B>
+ColumnCorr2<B>::ColumnCorr2(BinnedCorr2<NData,NData,B>& nn, int ncol,
+                            double* xi0, double* xi1, double* xi2, double* xi3) :
+    _nn(nn), _ncol(ncol)
+{
+    _xi[0] = xi0;
+    _xi[1] = xi1;
+    _xi[2] = xi2;
+    _xi[3] = xi3;
+}
+
+template <int B> template <int D1, int D2, int C>
+void ColumnCorr2<B>::process(
+    const InteractionList& list,
+    const std::vector<const Cell<NData,C>*>& cells1,
+    const std::vector<const Cell<NData,C>*>& cells2,
+    const CellColumns<C>* cols1, const CellColumns<C>& cols2, bool dots)
+{
+    dbg<<"Start ColumnCorr2::process: D1,D2,C = "<<D1<<','<<D2<<','<<C<<std::endl;
+    Assert(D1 == NData || (cols1 && cols1->getNCol() == _ncol));
+    Assert(cols2.getNCol() == _ncol);
+    const BinnedCorr2<NData,NData,B>& corr = *_nn.checkList(list, cells1, cells2);
+
+    const int nxi = ColumnHelper<D1,D2>::NXI;
+    const int nbins = corr._nbins;
+    const long rowsize = long(nxi) * _ncol;
+    const long npairs = list.pairs.size();
+    // The bins for bin k are total[k*rowsize:(k+1)*rowsize], with each xi for all the
+    // columns together.
+    std::vector<double> total(nbins * rowsize, 0.);
+
+#ifdef _OPENMP
+#pragma omp parallel
+    {
+#endif
+        std::vector<double> bins(nbins * rowsize, 0.);
+        ColumnPair p;
+        p.w1 = 0.;
+        p.v1r = p.v1i = 0;
+        p.e1r = p.e2r = 1.;
+        p.e1i = p.e2i = 0.;
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+        for (long n=0; n<npairs; ++n) {
+            const Interaction& pair = list.pairs[n];
+            const Cell<NData,C>& c1 = *cells1[pair.i1];
+            const Cell<NData,C>& c2 = *cells2[pair.i2];
+            double r = pair.r, logr = pair.logr;
+            const int k = corr.findBin(c1.getPos(), c2.getPos(), pair.rsq, pair.k, r, logr);
+            if (D1 == NData) {
+                p.w1 = c1.getW();
+            } else {
+                p.v1r = cols1->getRe(pair.i1);
+                if (D1 == GData) p.v1i = cols1->getIm(pair.i1);
+            }
+            p.v2r = cols2.getRe(pair.i2);
+            if (D2 == GData) {
+                p.v2i = cols2.getIm(pair.i2);
+                std::complex<double> e1, e2;
+                ColumnProjection<C>::get(c1.getPos(), c2.getPos(), e1, e2);
+                p.e1r = real(e1); p.e1i = imag(e1);
+                p.e2r = real(e2); p.e2i = imag(e2);
+            }
+            ColumnHelper<D1,D2>::add(p, _ncol, &bins[k*rowsize]);
+            if (pair.do_reverse) {
+                const int k2 = corr.findReverseBin(c1.getPos(), c2.getPos(), r, logr);
+                ColumnHelper<D1,D2>::add(p, _ncol, &bins[k2*rowsize]);
+            }
+        }
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+        for (size_t i=0; i<total.size(); ++i) total[i] += bins[i];
+#ifdef _OPENMP
+    }
+#endif
+
+    // Add the results to the output arrays, which have a row of nbins for each column.
+    for (int x=0; x<nxi; ++x)
+        for (int k=0; k<nbins; ++k)
+            for (int j=0; j<_ncol; ++j)
+                _xi[x][j*nbins + k] += total[k*rowsize + x*_ncol + j];
+    if (dots) std::cout<<'.'<<std::endl;
+}
+
+
+//
+//
+// The C interface for python
+//
+//
+
+extern "C" {
+#include "BinnedCorr2_C.h"
+}
+
+template <int D1, int D2>
+void* BuildCorr2b(int bin_type,
+                  double minsep, double maxsep, int nbins, double binsize, double b,
+                  int leaf_size, double minrpar, double maxrpar, double xp, double yp, double zp,
+                  double* xi0, double* xi1, double* xi2, double* xi3,
+                  double* meanr, double* meanlogr, double* weight, double* npairs)
+{
+    switch(bin_type) {
+      case Log:
+           return static_cast<void*>(new BinnedCorr2<D1,D2,Log>(
+                   minsep, maxsep, nbins, binsize, b, leaf_size,
+                   minrpar, maxrpar, xp, yp, zp,
+                   xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs));
+           break;
+      case Linear:
+           return static_cast<void*>(new BinnedCorr2<D1,D2,Linear>(
+                   minsep, maxsep, nbins, binsize, b, leaf_size,
+                   minrpar, maxrpar, xp, yp, zp,
+                   xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs));
+           break;
+      case TwoD:
+           return static_cast<void*>(new BinnedCorr2<D1,D2,TwoD>(
+                   minsep, maxsep, nbins, binsize, b, leaf_size,
+                   minrpar, maxrpar, xp, yp, zp,
+                   xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs));
+           break;
+      default:
+           Assert(false);
+    }
+    return 0;
+}
+
+template <int D1>
+void* BuildCorr2a(int d2, int bin_type,
+                  double minsep, double maxsep, int nbins, double binsize, double b,
+                  int leaf_size, double minrpar, double maxrpar, double xp, double yp, double zp,
+                  double* xi0, double* xi1, double* xi2, double* xi3,
+                  double* meanr, double* meanlogr, double* weight, double* npairs)
+{
+    // Note: we only ever call this with d2 >= d1, so the MAX bit below is equivalent to
+    // just using d2 for the cases that actually get called, but doing this saves some
+    // compile time and some size in the final library from not instantiating templates
+    // that aren't needed.
+    switch(d2) {
+      case NData:
+           return BuildCorr2b<D1,MAX(D1,NData)>(bin_type,
+                                                minsep, maxsep, nbins, binsize, b, leaf_size,
+                                                minrpar, maxrpar, xp, yp, zp,
+                                                xi0, xi1, xi2, xi3,
+                                                meanr, meanlogr, weight, npairs);
+           break;
+      case KData:
+           return BuildCorr2b<D1,MAX(D1,KData)>(bin_type,
+                                                minsep, maxsep, nbins, binsize, b, leaf_size,
+                                                minrpar, maxrpar, xp, yp, zp,
+                                                xi0, xi1, xi2, xi3,
+                                                meanr, meanlogr, weight, npairs);
+           break;
+      case GData:
+           return BuildCorr2b<D1,MAX(D1,GData)>(bin_type,
+                                                minsep, maxsep, nbins, binsize, b, leaf_size,
+                                                minrpar, maxrpar, xp, yp, zp,
+                                                xi0, xi1, xi2, xi3,
+                                                meanr, meanlogr, weight, npairs);
+           break;
+      default:
+           Assert(false);
+    }
+    return 0;
+}
+
+
+void* BuildCorr2(int d1, int d2, int bin_type,
+                 double minsep, double maxsep, int nbins, double binsize, double b,
+                 int leaf_size, double minrpar, double maxrpar, double xp, double yp, double zp,
+                 double* xi0, double* xi1, double* xi2, double* xi3,
+                 double* meanr, double* meanlogr, double* weight, double* npairs)
+{
+    dbg<<"Start BuildCorr2: "<<d1<<" "<<d2<<" "<<bin_type<<std::endl;
+    void* corr=0;
+    switch(d1) {
+      case NData:
+           corr = BuildCorr2a<NData>(d2, bin_type,
+                                     minsep, maxsep, nbins, binsize, b, leaf_size,
+                                     minrpar, maxrpar, xp, yp, zp,
+                                     xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs);
+           break;
+      case KData:
+           corr = BuildCorr2a<KData>(d2, bin_type,
+                                     minsep, maxsep, nbins, binsize, b, leaf_size,
+                                     minrpar, maxrpar, xp, yp, zp,
+                                     xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs);
+           break;
+      case GData:
+           corr = BuildCorr2a<GData>(d2, bin_type,
+                                     minsep, maxsep, nbins, binsize, b, leaf_size,
+                                     minrpar, maxrpar, xp, yp, zp,
+                                     xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs);
+           break;
+      default:
+           Assert(false);
+    }
+    xdbg<<"corr = "<<corr<<std::endl;
+    return corr;
+}
+
+template <int D1, int D2>
+void DestroyCorr2b(void* corr, int bin_type)
+{
+    switch(bin_type) {
+      case Log:
+           delete static_cast<BinnedCorr2<D1,D2,Log>*>(corr);
+           break;
+      case Linear:
+           delete static_cast<BinnedCorr2<D1,D2,Linear>*>(corr);
+           break;
+      case TwoD:
+           delete static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1>
+void DestroyCorr2a(void* corr, int d2, int bin_type)
+{
+    switch(d2) {
+      case NData:
+           DestroyCorr2b<D1,MAX(D1,NData)>(corr, bin_type);
+           break;
+      case KData:
+           DestroyCorr2b<D1,MAX(D1,KData)>(corr, bin_type);
+           break;
+      case GData:
+           DestroyCorr2b<D1,MAX(D1,GData)>(corr, bin_type);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+void DestroyCorr2(void* corr, int d1, int d2, int bin_type)
+{
+    dbg<<"Start DestroyCorr2: "<<d1<<" "<<d2<<" "<<bin_type<<std::endl;
+    xdbg<<"corr = "<<corr<<std::endl;
+    switch(d1) {
+      case NData:
+           DestroyCorr2a<NData>(corr, d2, bin_type);
+           break;
+      case KData:
+           DestroyCorr2a<KData>(corr, d2, bin_type);
+           break;
+      case GData:
+           DestroyCorr2a<GData>(corr, d2, bin_type);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1, int D2>
+void SetCorr2Budgetb(void* corr, int bin_type, double max_time, double max_pairs,
+                     double* used, long* cancel)
+{
+    switch(bin_type) {
+      case Log:
+           static_cast<BinnedCorr2<D1,D2,Log>*>(corr)->setBudget(
+               max_time, max_pairs, used, cancel);
+           break;
+      case Linear:
+           static_cast<BinnedCorr2<D1,D2,Linear>*>(corr)->setBudget(
+               max_time, max_pairs, used, cancel);
+           break;
+      case TwoD:
+           static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr)->setBudget(
+               max_time, max_pairs, used, cancel);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1>
+void SetCorr2Budgeta(void* corr, int d2, int bin_type, double max_time, double max_pairs,
+                     double* used, long* cancel)
+{
+    switch(d2) {
+      case NData:
+           SetCorr2Budgetb<D1,MAX(D1,NData)>(corr, bin_type, max_time, max_pairs, used,
+                                              cancel);
+           break;
+      case KData:
+           SetCorr2Budgetb<D1,MAX(D1,KData)>(corr, bin_type, max_time, max_pairs, used,
+                                              cancel);
+           break;
+      case GData:
+           SetCorr2Budgetb<D1,MAX(D1,GData)>(corr, bin_type, max_time, max_pairs, used,
+                                              cancel);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+void SetCorr2Budget(void* corr, int d1, int d2, int bin_type,
+                    double max_time, double max_pairs, double* used, long* cancel)
+{
+    dbg<<"Start SetCorr2Budget: "<<max_time<<" "<<max_pairs<<std::endl;
+    switch(d1) {
+      case NData:
+           SetCorr2Budgeta<NData>(corr, d2, bin_type, max_time, max_pairs, used,
+                                  cancel);
+           break;
+      case KData:
+           SetCorr2Budgeta<KData>(corr, d2, bin_type, max_time, max_pairs, used,
+                                  cancel);
+           break;
+      case GData:
+           SetCorr2Budgeta<GData>(corr, d2, bin_type, max_time, max_pairs, used,
+                                  cancel);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1, int D2>
+void SetCorr2Statsb(void* corr, int bin_type, double* stats)
+{
+    switch(bin_type) {
+      case Log:
+           static_cast<BinnedCorr2<D1,D2,Log>*>(corr)->setStats(stats);
+           break;
+      case Linear:
+           static_cast<BinnedCorr2<D1,D2,Linear>*>(corr)->setStats(stats);
+           break;
+      case TwoD:
+           static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr)->setStats(stats);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1>
+void SetCorr2Statsa(void* corr, int d2, int bin_type, double* stats)
+{
+    switch(d2) {
+      case NData:
+           SetCorr2Statsb<D1,MAX(D1,NData)>(corr, bin_type, stats);
+           break;
+      case KData:
+           SetCorr2Statsb<D1,MAX(D1,KData)>(corr, bin_type, stats);
+           break;
+      case GData:
+           SetCorr2Statsb<D1,MAX(D1,GData)>(corr, bin_type, stats);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+void SetCorr2Stats(void* corr, int d1, int d2, int bin_type, double* stats)
+{
+    dbg<<"Start SetCorr2Stats\n";
+    switch(d1) {
+      case NData:
+           SetCorr2Statsa<NData>(corr, d2, bin_type, stats);
+           break;
+      case KData:
+           SetCorr2Statsa<KData>(corr, d2, bin_type, stats);
+           break;
+      case GData:
+           SetCorr2Statsa<GData>(corr, d2, bin_type, stats);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+int GetNTraversalStats()
+{ return TraversalStats::NSTATS; }
+
+template <int D1, int D2>
+void SetCorr2BinOptionsb(void* corr, int bin_type, int fast_bins, int skip_meanlogr)
+{
+    switch(bin_type) {
+      case Log:
+           static_cast<BinnedCorr2<D1,D2,Log>*>(corr)->setBinOptions(fast_bins, skip_meanlogr);
+           break;
+      case Linear:
+           static_cast<BinnedCorr2<D1,D2,Linear>*>(corr)->setBinOptions(fast_bins,
+                                                                        skip_meanlogr);
+           break;
+      case TwoD:
+           static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr)->setBinOptions(fast_bins, skip_meanlogr);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1>
+void SetCorr2BinOptionsa(void* corr, int d2, int bin_type, int fast_bins, int skip_meanlogr)
+{
+    switch(d2) {
+      case NData:
+           SetCorr2BinOptionsb<D1,MAX(D1,NData)>(corr, bin_type, fast_bins, skip_meanlogr);
+           break;
+      case KData:
+           SetCorr2BinOptionsb<D1,MAX(D1,KData)>(corr, bin_type, fast_bins, skip_meanlogr);
+           break;
+      case GData:
+           SetCorr2BinOptionsb<D1,MAX(D1,GData)>(corr, bin_type, fast_bins, skip_meanlogr);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+void SetCorr2BinOptions(void* corr, int d1, int d2, int bin_type, int fast_bins,
+                        int skip_meanlogr)
+{
+    dbg<<"Start SetCorr2BinOptions\n";
+    switch(d1) {
+      case NData:
+           SetCorr2BinOptionsa<NData>(corr, d2, bin_type, fast_bins, skip_meanlogr);
+           break;
+      case KData:
+           SetCorr2BinOptionsa<KData>(corr, d2, bin_type, fast_bins, skip_meanlogr);
+           break;
+      case GData:
+           SetCorr2BinOptionsa<GData>(corr, d2, bin_type, fast_bins, skip_meanlogr);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1, int D2>
+void SetCorr2MaxSepb(void* corr, int bin_type, double maxsep)
+{
+    switch(bin_type) {
+      case Log:
+           static_cast<BinnedCorr2<D1,D2,Log>*>(corr)->setMaxSep(maxsep);
+           break;
+      case Linear:
+           static_cast<BinnedCorr2<D1,D2,Linear>*>(corr)->setMaxSep(maxsep);
+           break;
+      case TwoD:
+           static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr)->setMaxSep(maxsep);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1>
+void SetCorr2MaxSepa(void* corr, int d2, int bin_type, double maxsep)
+{
+    switch(d2) {
+      case NData:
+           SetCorr2MaxSepb<D1,MAX(D1,NData)>(corr, bin_type, maxsep);
+           break;
+      case KData:
+           SetCorr2MaxSepb<D1,MAX(D1,KData)>(corr, bin_type, maxsep);
+           break;
+      case GData:
+           SetCorr2MaxSepb<D1,MAX(D1,GData)>(corr, bin_type, maxsep);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+void SetCorr2MaxSep(void* corr, int d1, int d2, int bin_type, double maxsep)
+{
+    dbg<<"Start SetCorr2MaxSep\n";
+    switch(d1) {
+      case NData:
+           SetCorr2MaxSepa<NData>(corr, d2, bin_type, maxsep);
+           break;
+      case KData:
+           SetCorr2MaxSepa<KData>(corr, d2, bin_type, maxsep);
+           break;
+      case GData:
+           SetCorr2MaxSepa<GData>(corr, d2, bin_type, maxsep);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1, int D2>
+void SetCorr2SplitFactorb(void* corr, int bin_type, double split_factor)
+{
+    switch(bin_type) {
+      case Log:
+           static_cast<BinnedCorr2<D1,D2,Log>*>(corr)->setSplitFactor(split_factor);
+           break;
+      case Linear:
+           static_cast<BinnedCorr2<D1,D2,Linear>*>(corr)->setSplitFactor(split_factor);
+           break;
+      case TwoD:
+           static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr)->setSplitFactor(split_factor);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1>
+void SetCorr2SplitFactora(void* corr, int d2, int bin_type, double split_factor)
+{
+    switch(d2) {
+      case NData:
+           SetCorr2SplitFactorb<D1,MAX(D1,NData)>(corr, bin_type, split_factor);
+           break;
+      case KData:
+           SetCorr2SplitFactorb<D1,MAX(D1,KData)>(corr, bin_type, split_factor);
+           break;
+      case GData:
+           SetCorr2SplitFactorb<D1,MAX(D1,GData)>(corr, bin_type, split_factor);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+void SetCorr2SplitFactor(void* corr, int d1, int d2, int bin_type, double split_factor)
+{
+    dbg<<"Start SetCorr2SplitFactor\n";
+    switch(d1) {
+      case NData:
+           SetCorr2SplitFactora<NData>(corr, d2, bin_type, split_factor);
+           break;
+      case KData:
+           SetCorr2SplitFactora<KData>(corr, d2, bin_type, split_factor);
+           break;
+      case GData:
+           SetCorr2SplitFactora<GData>(corr, d2, bin_type, split_factor);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1, int D2>
+void SetCorr2UnitWeightsb(void* corr, int bin_type, int unit_weights)
+{
+    switch(bin_type) {
+      case Log:
+           static_cast<BinnedCorr2<D1,D2,Log>*>(corr)->setUnitWeights(unit_weights);
+           break;
+      case Linear:
+           static_cast<BinnedCorr2<D1,D2,Linear>*>(corr)->setUnitWeights(unit_weights);
+           break;
+      case TwoD:
+           static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr)->setUnitWeights(unit_weights);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1>
+void SetCorr2UnitWeightsa(void* corr, int d2, int bin_type, int unit_weights)
+{
+    switch(d2) {
+      case NData:
+           SetCorr2UnitWeightsb<D1,MAX(D1,NData)>(corr, bin_type, unit_weights);
+           break;
+      case KData:
+           SetCorr2UnitWeightsb<D1,MAX(D1,KData)>(corr, bin_type, unit_weights);
+           break;
+      case GData:
+           SetCorr2UnitWeightsb<D1,MAX(D1,GData)>(corr, bin_type, unit_weights);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+void SetCorr2UnitWeights(void* corr, int d1, int d2, int bin_type, int unit_weights)
+{
+    dbg<<"Start SetCorr2UnitWeights\n";
+    switch(d1) {
+      case NData:
+           SetCorr2UnitWeightsa<NData>(corr, d2, bin_type, unit_weights);
+           break;
+      case KData:
+           SetCorr2UnitWeightsa<KData>(corr, d2, bin_type, unit_weights);
+           break;
+      case GData:
+           SetCorr2UnitWeightsa<GData>(corr, d2, bin_type, unit_weights);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1, int D2, int B>
+long GetCorr2NBytesc(void* corr, int nbins)
+{
+    if (corr) return static_cast<BinnedCorr2<D1,D2,B>*>(corr)->getNBytes();
+    else return BinnedCorr2<D1,D2,B>::getThreadNBytes(nbins);
+}
+
+template <int D1, int D2>
+long GetCorr2NBytesb(void* corr, int bin_type, int nbins)
+{
+    switch(bin_type) {
+      case Log:
+           return GetCorr2NBytesc<D1,D2,Log>(corr, nbins);
+      case Linear:
+           return GetCorr2NBytesc<D1,D2,Linear>(corr, nbins);
+      case TwoD:
+           return GetCorr2NBytesc<D1,D2,TwoD>(corr, nbins);
+      default:
+           Assert(false);
+    }
+    return 0;  // Can't get here, but saves a compiler warning
+}
+
+template <int D1>
+long GetCorr2NBytesa(void* corr, int d2, int bin_type, int nbins)
+{
+    switch(d2) {
+      case NData:
+           return GetCorr2NBytesb<D1,MAX(D1,NData)>(corr, bin_type, nbins);
+      case KData:
+           return GetCorr2NBytesb<D1,MAX(D1,KData)>(corr, bin_type, nbins);
+      case GData:
+           return GetCorr2NBytesb<D1,MAX(D1,GData)>(corr, bin_type, nbins);
+      default:
+           Assert(false);
+    }
+    return 0;
+}
+
+long GetCorr2NBytes(void* corr, int d1, int d2, int bin_type, int nbins)
+{
+    dbg<<"Start GetCorr2NBytes\n";
+    switch(d1) {
+      case NData:
+           return GetCorr2NBytesa<NData>(corr, d2, bin_type, nbins);
+      case KData:
+           return GetCorr2NBytesa<KData>(corr, d2, bin_type, nbins);
+      case GData:
+           return GetCorr2NBytesa<GData>(corr, d2, bin_type, nbins);
+      default:
+           Assert(false);
+    }
+    return 0;
+}
+
+template <int D1, int D2>
+void SetCorr2Checkpointb(void* corr, int bin_type, const char* file_name, double interval,
+                         double publish_interval)
+{
+    switch(bin_type) {
+      case Log:
+           static_cast<BinnedCorr2<D1,D2,Log>*>(corr)->setCheckpoint(
+               file_name, interval, publish_interval);
+           break;
+      case Linear:
+           static_cast<BinnedCorr2<D1,D2,Linear>*>(corr)->setCheckpoint(
+               file_name, interval, publish_interval);
+           break;
+      case TwoD:
+           static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr)->setCheckpoint(
+               file_name, interval, publish_interval);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1>
+void SetCorr2Checkpointa(void* corr, int d2, int bin_type, const char* file_name,
+                         double interval, double publish_interval)
+{
+    switch(d2) {
+      case NData:
+           SetCorr2Checkpointb<D1,MAX(D1,NData)>(corr, bin_type, file_name, interval,
+                                                 publish_interval);
+           break;
+      case KData:
+           SetCorr2Checkpointb<D1,MAX(D1,KData)>(corr, bin_type, file_name, interval,
+                                                 publish_interval);
+           break;
+      case GData:
+           SetCorr2Checkpointb<D1,MAX(D1,GData)>(corr, bin_type, file_name, interval,
+                                                 publish_interval);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+void SetCorr2Checkpoint(void* corr, int d1, int d2, int bin_type,
+                        const char* file_name, double interval, double publish_interval)
+{
+    dbg<<"Start SetCorr2Checkpoint: "<<file_name<<" "<<interval<<" "<<publish_interval<<std::endl;
+    switch(d1) {
+      case NData:
+           SetCorr2Checkpointa<NData>(corr, d2, bin_type, file_name, interval, publish_interval);
+           break;
+      case KData:
+           SetCorr2Checkpointa<KData>(corr, d2, bin_type, file_name, interval, publish_interval);
+           break;
+      case GData:
+           SetCorr2Checkpointa<GData>(corr, d2, bin_type, file_name, interval, publish_interval);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1, int D2>
+void CopyCorr2Resultsb(void* corr, int bin_type, double* xip, double* xip_im,
+                       double* xim, double* xim_im,
+                       double* meanr, double* meanlogr, double* weight, double* npairs)
+{
+    switch(bin_type) {
+      case Log:
+           static_cast<BinnedCorr2<D1,D2,Log>*>(corr)->copyResults(
+               xip, xip_im, xim, xim_im, meanr, meanlogr, weight, npairs);
+           break;
+      case Linear:
+           static_cast<BinnedCorr2<D1,D2,Linear>*>(corr)->copyResults(
+               xip, xip_im, xim, xim_im, meanr, meanlogr, weight, npairs);
+           break;
+      case TwoD:
+           static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr)->copyResults(
+               xip, xip_im, xim, xim_im, meanr, meanlogr, weight, npairs);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1>
+void CopyCorr2Resultsa(void* corr, int d2, int bin_type, double* xip, double* xip_im,
+                       double* xim, double* xim_im,
+                       double* meanr, double* meanlogr, double* weight, double* npairs)
+{
+    switch(d2) {
+      case NData:
+           CopyCorr2Resultsb<D1,MAX(D1,NData)>(corr, bin_type, xip, xip_im, xim, xim_im,
+                                               meanr, meanlogr, weight, npairs);
+           break;
+      case KData:
+           CopyCorr2Resultsb<D1,MAX(D1,KData)>(corr, bin_type, xip, xip_im, xim, xim_im,
+                                               meanr, meanlogr, weight, npairs);
+           break;
+      case GData:
+           CopyCorr2Resultsb<D1,MAX(D1,GData)>(corr, bin_type, xip, xip_im, xim, xim_im,
+                                               meanr, meanlogr, weight, npairs);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+void CopyCorr2Results(void* corr, int d1, int d2, int bin_type,
+                      double* xip, double* xip_im, double* xim, double* xim_im,
+                      double* meanr, double* meanlogr, double* weight, double* npairs)
+{
+    switch(d1) {
+      case NData:
+           CopyCorr2Resultsa<NData>(corr, d2, bin_type, xip, xip_im, xim, xim_im,
+                                    meanr, meanlogr, weight, npairs);
+           break;
+      case KData:
+           CopyCorr2Resultsa<KData>(corr, d2, bin_type, xip, xip_im, xim, xim_im,
+                                    meanr, meanlogr, weight, npairs);
+           break;
+      case GData:
+           CopyCorr2Resultsa<GData>(corr, d2, bin_type, xip, xip_im, xim, xim_im,
+                                    meanr, meanlogr, weight, npairs);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1, int D2>
+void SetCorr2Partitionb(void* corr, int bin_type, int rank, int nranks)
+{
+    switch(bin_type) {
+      case Log:
+           static_cast<BinnedCorr2<D1,D2,Log>*>(corr)->setPartition(rank, nranks);
+           break;
+      case Linear:
+           static_cast<BinnedCorr2<D1,D2,Linear>*>(corr)->setPartition(rank, nranks);
+           break;
+      case TwoD:
+           static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr)->setPartition(rank, nranks);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1>
+void SetCorr2Partitiona(void* corr, int d2, int bin_type, int rank, int nranks)
+{
+    switch(d2) {
+      case NData:
+           SetCorr2Partitionb<D1,MAX(D1,NData)>(corr, bin_type, rank, nranks);
+           break;
+      case KData:
+           SetCorr2Partitionb<D1,MAX(D1,KData)>(corr, bin_type, rank, nranks);
+           break;
+      case GData:
+           SetCorr2Partitionb<D1,MAX(D1,GData)>(corr, bin_type, rank, nranks);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+void SetCorr2Partition(void* corr, int d1, int d2, int bin_type, int rank, int nranks)
+{
+    dbg<<"Start SetCorr2Partition: "<<rank<<" "<<nranks<<std::endl;
+    Assert(nranks >= 1);
+    Assert(rank >= 0 && rank < nranks);
+    switch(d1) {
+      case NData:
+           SetCorr2Partitiona<NData>(corr, d2, bin_type, rank, nranks);
+           break;
+      case KData:
+           SetCorr2Partitiona<KData>(corr, d2, bin_type, rank, nranks);
+           break;
+      case GData:
+           SetCorr2Partitiona<GData>(corr, d2, bin_type, rank, nranks);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int M, int D, int B>
+void ProcessAuto2d(BinnedCorr2<D,D,B>* corr, void* field, int dots, int coords)
+{
+    switch(coords) {
+      case Flat:
+           Assert(MetricHelper<M>::_Flat == int(Flat));
+           corr->template process<MetricHelper<M>::_Flat, M>(
+               *static_cast<Field<D,MetricHelper<M>::_Flat>*>(field), dots);
+           break;
+      case Sphere:
+           Assert(MetricHelper<M>::_Sphere == int(Sphere));
+           corr->template process<MetricHelper<M>::_Sphere, M>(
+               *static_cast<Field<D,MetricHelper<M>::_Sphere>*>(field), dots);
+           break;
+      case ThreeD:
+           Assert(MetricHelper<M>::_ThreeD == int(ThreeD));
+           corr->template process<MetricHelper<M>::_ThreeD, M>(
+               *static_cast<Field<D,MetricHelper<M>::_ThreeD>*>(field), dots);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D, int B>
+void ProcessAuto2c(BinnedCorr2<D,D,B>* corr, void* field, int dots,
+                   int coords, int metric)
+{
+    switch(metric) {
+      case Euclidean:
+           ProcessAuto2d<Euclidean>(corr, field, dots, coords);
+           break;
+      case Rperp:
+           ProcessAuto2d<Rperp>(corr, field, dots, coords);
+           break;
+      case OldRperp:
+           ProcessAuto2d<OldRperp>(corr, field, dots, coords);
+           break;
+      case Rlens:
+           ProcessAuto2d<Rlens>(corr, field, dots, coords);
+           break;
+      case Arc:
+           ProcessAuto2d<Arc>(corr, field, dots, coords);
+           break;
+      case Periodic:
+           ProcessAuto2d<Periodic>(corr, field, dots, coords);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D>
+void ProcessAuto2b(void* corr, void* field, int dots, int coords, int bin_type, int metric)
+{
+    switch(bin_type) {
+      case Log:
+           ProcessAuto2c(static_cast<BinnedCorr2<D,D,Log>*>(corr), field, dots, coords, metric);
+           break;
+      case Linear:
+           ProcessAuto2c(static_cast<BinnedCorr2<D,D,Linear>*>(corr), field, dots, coords, metric);
+           break;
+      case TwoD:
+           ProcessAuto2c(static_cast<BinnedCorr2<D,D,TwoD>*>(corr), field, dots, coords, metric);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+int ProcessAuto2(void* corr, void* field, int dots,
+                 int d, int coords, int bin_type, int metric)
+{
+    PhaseThreads threads(ProcessPhase);
+    dbg<<"Start ProcessAuto2: "<<d<<" "<<coords<<" "<<bin_type<<" "<<metric<<std::endl;
+
+    // Errors reading or writing the checkpoint file are signalled by returning 0, since we
+    // can't throw across the C interface.
+    try {
+        switch(d) {
+          case NData:
+               ProcessAuto2b<NData>(corr, field, dots, coords, bin_type, metric);
+               break;
+          case KData:
+               ProcessAuto2b<KData>(corr, field, dots, coords, bin_type, metric);
+               break;
+          case GData:
+               ProcessAuto2b<GData>(corr, field, dots, coords, bin_type, metric);
+               break;
+          default:
+               Assert(false);
+        }
+    } catch (std::runtime_error& e) {
+        dbg<<"Unable to process auto-correlation: "<<e.what()<<std::endl;
+        return 0;
+    }
+    return 1;
+}
+
+template <int M, int D1, int D2, int B>
+void ProcessCross2d(BinnedCorr2<D1,D2,B>* corr, void* field1, void* field2, int dots, int coords)
+{
+    switch(coords) {
+      case Flat:
+           Assert(MetricHelper<M>::_Flat == int(Flat));
+           corr->template process<MetricHelper<M>::_Flat, M>(
+               *static_cast<Field<D1,MetricHelper<M>::_Flat>*>(field1),
+               *static_cast<Field<D2,MetricHelper<M>::_Flat>*>(field2), dots);
+           break;
+      case Sphere:
+           Assert(MetricHelper<M>::_Sphere == int(Sphere));
+           corr->template process<MetricHelper<M>::_Sphere, M>(
+               *static_cast<Field<D1,MetricHelper<M>::_Sphere>*>(field1),
+               *static_cast<Field<D2,MetricHelper<M>::_Sphere>*>(field2), dots);
+           break;
+      case ThreeD:
+           Assert(MetricHelper<M>::_ThreeD == int(ThreeD));
+           corr->template process<MetricHelper<M>::_ThreeD, M>(
+               *static_cast<Field<D1,MetricHelper<M>::_ThreeD>*>(field1),
+               *static_cast<Field<D2,MetricHelper<M>::_ThreeD>*>(field2), dots);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1, int D2, int B>
+void ProcessCross2c(BinnedCorr2<D1,D2,B>* corr, void* field1, void* field2, int dots,
+                    int coords, int metric)
+{
+    switch(metric) {
+      case Euclidean:
+           ProcessCross2d<Euclidean>(corr, field1, field2, dots, coords);
+           break;
+      case Rperp:
+           ProcessCross2d<Rperp>(corr, field1, field2, dots, coords);
+           break;
+      case OldRperp:
+           ProcessCross2d<OldRperp>(corr, field1, field2, dots, coords);
+           break;
+      case Rlens:
+           ProcessCross2d<Rlens>(corr, field1, field2, dots, coords);
+           break;
+      case Arc:
+           ProcessCross2d<Arc>(corr, field1, field2, dots, coords);
+           break;
+      case Periodic:
+           ProcessCross2d<Periodic>(corr, field1, field2, dots, coords);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1, int D2>
+void ProcessCross2b(void* corr, void* field1, void* field2, int dots,
+                    int coords, int bin_type, int metric)
+{
+    switch(bin_type) {
+      case Log:
+           ProcessCross2c(static_cast<BinnedCorr2<D1,D2,Log>*>(corr), field1, field2, dots,
+                          coords, metric);
+           break;
+      case Linear:
+           ProcessCross2c(static_cast<BinnedCorr2<D1,D2,Linear>*>(corr), field1, field2, dots,
+                          coords, metric);
+           break;
+      case TwoD:
+           ProcessCross2c(static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr), field1, field2, dots,
+                          coords, metric);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1>
+void ProcessCross2a(void* corr, void* field1, void* field2, int dots,
+                    int d2, int coords, int bin_type, int metric)
+{
+    // Note: we only ever call this with d2 >= d1, so the MAX bit below is equivalent to
+    // just using d2 for the cases that actually get called, but doing this saves some
+    // compile time and some size in the final library from not instantiating templates
+    // that aren't needed.
+    Assert(d2 >= D1);
+    switch(d2) {
+      case NData:
+           ProcessCross2b<D1,MAX(D1,NData)>(corr, field1, field2, dots,
+                                            coords, bin_type, metric);
+           break;
+      case KData:
+           ProcessCross2b<D1,MAX(D1,KData)>(corr, field1, field2, dots,
+                                            coords, bin_type, metric);
+           break;
+      case GData:
+           ProcessCross2b<D1,MAX(D1,GData)>(corr, field1, field2, dots,
+                                            coords, bin_type, metric);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+int ProcessCross2(void* corr, void* field1, void* field2, int dots,
+                  int d1, int d2, int coords, int bin_type, int metric)
+{
+    PhaseThreads threads(ProcessPhase);
+    dbg<<"Start ProcessCross2: "<<d1<<" "<<d2<<" "<<coords<<" "<<bin_type<<" "<<metric<<std::endl;
+
+    // Errors reading or writing the checkpoint file are signalled by returning 0, since we
+    // can't throw across the C interface.
+    try {
+        switch(d1) {
+          case NData:
+               ProcessCross2a<NData>(corr, field1, field2, dots,
+                                     d2, coords, bin_type, metric);
+               break;
+          case KData:
+               ProcessCross2a<KData>(corr, field1, field2, dots,
+                                     d2, coords, bin_type, metric);
+               break;
+          case GData:
+               ProcessCross2a<GData>(corr, field1, field2, dots,
+                                     d2, coords, bin_type, metric);
+               break;
+          default:
+               Assert(false);
+        }
+    } catch (std::runtime_error& e) {
+        dbg<<"Unable to process cross-correlation: "<<e.what()<<std::endl;
+        return 0;
+    }
+    return 1;
+}
+
+template <int M, int D1, int D2, int B>
+void* RecordInteractions2d(BinnedCorr2<D1,D2,B>* corr, void* field1, void* field2,
+                           bool is_auto, int dots, int coords)
+{
+    switch(coords) {
+      case Flat:
+           Assert(MetricHelper<M>::_Flat == int(Flat));
+           return corr->template record<MetricHelper<M>::_Flat, M>(
+               *static_cast<Field<D1,MetricHelper<M>::_Flat>*>(field1),
+               *static_cast<Field<D2,MetricHelper<M>::_Flat>*>(field2), is_auto, dots);
+      case Sphere:
+           Assert(MetricHelper<M>::_Sphere == int(Sphere));
+           return corr->template record<MetricHelper<M>::_Sphere, M>(
+               *static_cast<Field<D1,MetricHelper<M>::_Sphere>*>(field1),
+               *static_cast<Field<D2,MetricHelper<M>::_Sphere>*>(field2), is_auto, dots);
+      case ThreeD:
+           Assert(MetricHelper<M>::_ThreeD == int(ThreeD));
+           return corr->template record<MetricHelper<M>::_ThreeD, M>(
+               *static_cast<Field<D1,MetricHelper<M>::_ThreeD>*>(field1),
+               *static_cast<Field<D2,MetricHelper<M>::_ThreeD>*>(field2), is_auto, dots);
+      default:
+           Assert(false);
+    }
+    return 0;
+}
 
-        std::map<long, long>::iterator next = places.begin();
+template <int D1, int D2, int B>
+void* RecordInteractions2c(BinnedCorr2<D1,D2,B>* corr, void* field1, void* field2,
+                           bool is_auto, int dots, int coords, int metric)
+{
+    switch(metric) {
+      case Euclidean:
+           return RecordInteractions2d<Euclidean>(corr, field1, field2, is_auto, dots, coords);
+      case Rperp:
+           return RecordInteractions2d<Rperp>(corr, field1, field2, is_auto, dots, coords);
+      case OldRperp:
+           return RecordInteractions2d<OldRperp>(corr, field1, field2, is_auto, dots, coords);
+      case Rlens:
+           return RecordInteractions2d<Rlens>(corr, field1, field2, is_auto, dots, coords);
+      case Arc:
+           return RecordInteractions2d<Arc>(corr, field1, field2, is_auto, dots, coords);
+      case Periodic:
+           return RecordInteractions2d<Periodic>(corr, field1, field2, is_auto, dots, coords);
+      default:
+           Assert(false);
+    }
+    return 0;
+}
 
-        long i=k;  // When i is in the map, place it at places[i]
-        for (size_t p1=0; p1<leaf1.size(); ++p1) {
-            long nn1 = leaf1[p1]->getN();
-            for (long q1=0; q1<nn1; ++q1) {
-                xdbg<<"i = "<<i<<", next = "<<next->first<<"  "<<next->second<<std::endl;
-                Assert(i <= next->first);
-                if (next->first > i + n2) {
-                    // Then skip this loop through the second vector
-                    i += n2;
-                    continue;
-                }
-                long index1;
-                if (nn1 == 1) index1 = leaf1[p1]->getInfo().index;
-                else index1 = (*leaf1[p1]->getListInfo().indices)[q1];
-                for (size_t p2=0; p2<leaf2.size(); ++p2) {
-                    long nn2 = leaf2[p2]->getN();
-                    for (long q2=0; q2<nn2; ++q2,++i) {
-                        if (i == next->first) {
-                            xdbg<<"Use i = "<<i<<std::endl;
-                            long index2;
-                            if (nn2 == 1) index2 = leaf2[p2]->getInfo().index;
-                            else index2 = (*leaf2[p2]->getListInfo().indices)[q2];
-                            long j = next->second;
-                            i1[j] = index1;
-                            i2[j] = index2;
-                            sep[j] = r;
-                            ++next;
-                        }
-                        if (next == places.end()) break;
-                    }
-                    if (next == places.end()) break;
-                }
-                if (next == places.end()) break;
-            }
-            if (next == places.end()) break;
-        }
-        xdbg<<"Done: i = "<<i<<", k+m = "<<k+m<<std::endl;
-        k += m;
+template <int D1, int D2>
+void* RecordInteractions2b(void* corr, void* field1, void* field2, bool is_auto, int dots,
+                           int coords, int bin_type, int metric)
+{
+    switch(bin_type) {
+      case Log:
+           return RecordInteractions2c(static_cast<BinnedCorr2<D1,D2,Log>*>(corr),
+                                       field1, field2, is_auto, dots, coords, metric);
+      case Linear:
+           return RecordInteractions2c(static_cast<BinnedCorr2<D1,D2,Linear>*>(corr),
+                                       field1, field2, is_auto, dots, coords, metric);
+      case TwoD:
+           return RecordInteractions2c(static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr),
+                                       field1, field2, is_auto, dots, coords, metric);
+      default:
+           Assert(false);
     }
+    return 0;
 }
 
+template <int D1>
+void* RecordInteractions2a(void* corr, void* field1, void* field2, bool is_auto, int dots,
+                           int d2, int coords, int bin_type, int metric)
+{
+    Assert(d2 >= D1);
+    switch(d2) {
+      case NData:
+           return RecordInteractions2b<D1,MAX(D1,NData)>(corr, field1, field2, is_auto, dots,
+                                                         coords, bin_type, metric);
+      case KData:
+           return RecordInteractions2b<D1,MAX(D1,KData)>(corr, field1, field2, is_auto, dots,
+                                                         coords, bin_type, metric);
+      case GData:
+           return RecordInteractions2b<D1,MAX(D1,GData)>(corr, field1, field2, is_auto, dots,
+                                                         coords, bin_type, metric);
+      default:
+           Assert(false);
+    }
+    return 0;
+}
 
-//
-//
-// The C interface for python
-//
-//
+void* RecordInteractions2(void* corr, void* field1, void* field2, int is_auto, int dots,
+                          int d1, int d2, int coords, int bin_type, int metric)
+{
+    PhaseThreads threads(ProcessPhase);
+    dbg<<"Start RecordInteractions2: "<<d1<<" "<<d2<<" "<<coords<<" "<<bin_type<<" "
+        <<metric<<std::endl;
 
-extern "C" {
-#include "BinnedCorr2_C.h"
+    switch(d1) {
+      case NData:
+           return RecordInteractions2a<NData>(corr, field1, field2, bool(is_auto), dots,
+                                              d2, coords, bin_type, metric);
+      case KData:
+           return RecordInteractions2a<KData>(corr, field1, field2, bool(is_auto), dots,
+                                              d2, coords, bin_type, metric);
+      case GData:
+           return RecordInteractions2a<GData>(corr, field1, field2, bool(is_auto), dots,
+                                              d2, coords, bin_type, metric);
+      default:
+           Assert(false);
+    }
+    return 0;
+}
+
+template <int D1, int D2, int B>
+void ReplayInteractions2c(BinnedCorr2<D1,D2,B>* corr, const InteractionList& list,
+                          void* field1, void* field2, int dots, int coords)
+{
+    switch(coords) {
+      case Flat:
+           corr->template replay<Flat>(list, *static_cast<Field<D1,Flat>*>(field1),
+                                       *static_cast<Field<D2,Flat>*>(field2), dots);
+           break;
+      case Sphere:
+           corr->template replay<Sphere>(list, *static_cast<Field<D1,Sphere>*>(field1),
+                                         *static_cast<Field<D2,Sphere>*>(field2), dots);
+           break;
+      case ThreeD:
+           corr->template replay<ThreeD>(list, *static_cast<Field<D1,ThreeD>*>(field1),
+                                         *static_cast<Field<D2,ThreeD>*>(field2), dots);
+           break;
+      default:
+           Assert(false);
+    }
 }
 
 template <int D1, int D2>
-void* BuildCorr2b(int bin_type,
-                  double minsep, double maxsep, int nbins, double binsize, double b,
-                  double minrpar, double maxrpar, double xp, double yp, double zp,
-                  double* xi0, double* xi1, double* xi2, double* xi3,
-                  double* meanr, double* meanlogr, double* weight, double* npairs)
+void ReplayInteractions2b(void* corr, const InteractionList& list, void* field1, void* field2,
+                          int dots, int coords, int bin_type)
 {
     switch(bin_type) {
       case Log:
-           return static_cast<void*>(new BinnedCorr2<D1,D2,Log>(
-                   minsep, maxsep, nbins, binsize, b, minrpar, maxrpar, xp, yp, zp,
-                   xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs));
+           ReplayInteractions2c(static_cast<BinnedCorr2<D1,D2,Log>*>(corr), list,
+                                field1, field2, dots, coords);
            break;
       case Linear:
-           return static_cast<void*>(new BinnedCorr2<D1,D2,Linear>(
-                   minsep, maxsep, nbins, binsize, b, minrpar, maxrpar, xp, yp, zp,
-                   xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs));
+           ReplayInteractions2c(static_cast<BinnedCorr2<D1,D2,Linear>*>(corr), list,
+                                field1, field2, dots, coords);
            break;
       case TwoD:
-           return static_cast<void*>(new BinnedCorr2<D1,D2,TwoD>(
-                   minsep, maxsep, nbins, binsize, b, minrpar, maxrpar, xp, yp, zp,
-                   xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs));
+           ReplayInteractions2c(static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr), list,
+                                field1, field2, dots, coords);
            break;
       default:
            Assert(false);
     }
-    return 0;
 }
 
 template <int D1>
-void* BuildCorr2a(int d2, int bin_type,
-                  double minsep, double maxsep, int nbins, double binsize, double b,
-                  double minrpar, double maxrpar, double xp, double yp, double zp,
-                  double* xi0, double* xi1, double* xi2, double* xi3,
-                  double* meanr, double* meanlogr, double* weight, double* npairs)
+void ReplayInteractions2a(void* corr, const InteractionList& list, void* field1, void* field2,
+                          int dots, int d2, int coords, int bin_type)
 {
-    // Note: we only ever call this with d2 >= d1, so the MAX bit below is equivalent to
-    // just using d2 for the cases that actually get called, but doing this saves some
-    // compile time and some size in the final library from not instantiating templates
-    // that aren't needed.
+    Assert(d2 >= D1);
     switch(d2) {
       case NData:
-           return BuildCorr2b<D1,MAX(D1,NData)>(bin_type,
-                                                minsep, maxsep, nbins, binsize, b,
-                                                minrpar, maxrpar, xp, yp, zp,
-                                                xi0, xi1, xi2, xi3,
-                                                meanr, meanlogr, weight, npairs);
+           ReplayInteractions2b<D1,MAX(D1,NData)>(corr, list, field1, field2, dots,
+                                                  coords, bin_type);
            break;
       case KData:
-           return BuildCorr2b<D1,MAX(D1,KData)>(bin_type,
-                                                minsep, maxsep, nbins, binsize, b,
-                                                minrpar, maxrpar, xp, yp, zp,
-                                                xi0, xi1, xi2, xi3,
-                                                meanr, meanlogr, weight, npairs);
+           ReplayInteractions2b<D1,MAX(D1,KData)>(corr, list, field1, field2, dots,
+                                                  coords, bin_type);
            break;
       case GData:
-           return BuildCorr2b<D1,MAX(D1,GData)>(bin_type,
-                                                minsep, maxsep, nbins, binsize, b,
-                                                minrpar, maxrpar, xp, yp, zp,
-                                                xi0, xi1, xi2, xi3,
-                                                meanr, meanlogr, weight, npairs);
+           ReplayInteractions2b<D1,MAX(D1,GData)>(corr, list, field1, field2, dots,
+                                                  coords, bin_type);
            break;
       default:
            Assert(false);
     }
-    return 0;
 }
 
+int ReplayInteractions2(void* corr, void* ilist, void* field1, void* field2, int dots,
+                        int d1, int d2, int coords, int bin_type)
+{
+    PhaseThreads threads(ProcessPhase);
+    dbg<<"Start ReplayInteractions2: "<<d1<<" "<<d2<<" "<<coords<<" "<<bin_type<<std::endl;
+    const InteractionList& list = *static_cast<InteractionList*>(ilist);
+    // Errors from a list that doesn't match the fields or the binning are signalled by
+    // returning 0, since we can't throw across the C interface.
+    try {
+        switch(d1) {
+          case NData:
+               ReplayInteractions2a<NData>(corr, list, field1, field2, dots,
+                                           d2, coords, bin_type);
+               break;
+          case KData:
+               ReplayInteractions2a<KData>(corr, list, field1, field2, dots,
+                                           d2, coords, bin_type);
+               break;
+          case GData:
+               ReplayInteractions2a<GData>(corr, list, field1, field2, dots,
+                                           d2, coords, bin_type);
+               break;
+          default:
+               Assert(false);
+        }
+    } catch (std::runtime_error& e) {
+        dbg<<"Unable to replay interaction list: "<<e.what()<<std::endl;
+        return 0;
+    }
+    return 1;
+}
+
+long InteractionListSize(void* ilist)
+{ return long(static_cast<InteractionList*>(ilist)->pairs.size()); }
 
-void* BuildCorr2(int d1, int d2, int bin_type,
-                 double minsep, double maxsep, int nbins, double binsize, double b,
-                 double minrpar, double maxrpar, double xp, double yp, double zp,
-                 double* xi0, double* xi1, double* xi2, double* xi3,
-                 double* meanr, double* meanlogr, double* weight, double* npairs)
+void DestroyInteractionList(void* ilist)
+{ delete static_cast<InteractionList*>(ilist); }
+
+template <int D1, int D2, int C, int B>
+void ProcessColumns2e(ColumnCorr2<B>& cc2, const InteractionList& list,
+                      const std::vector<const Cell<NData,C>*>& cells1,
+                      const std::vector<const Cell<NData,C>*>& cells2,
+                      const CellColumns<C>* cols1, const CellColumns<C>& cols2, int dots)
+{ cc2.template process<D1,D2,C>(list, cells1, cells2, cols1, cols2, dots); }
+
+template <int D1, int C, int B>
+void ProcessColumns2d(ColumnCorr2<B>& cc2, const InteractionList& list,
+                      const std::vector<const Cell<NData,C>*>& cells1,
+                      const std::vector<const Cell<NData,C>*>& cells2,
+                      const CellColumns<C>* cols1, const CellColumns<C>& cols2, int dots)
 {
-    dbg<<"Start BuildCorr2: "<<d1<<" "<<d2<<" "<<bin_type<<std::endl;
-    void* corr=0;
-    switch(d1) {
-      case NData:
-           corr = BuildCorr2a<NData>(d2, bin_type,
-                                     minsep, maxsep, nbins, binsize, b,
-                                     minrpar, maxrpar, xp, yp, zp,
-                                     xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs);
-           break;
+    switch(cols2.getD()) {
       case KData:
-           corr = BuildCorr2a<KData>(d2, bin_type,
-                                     minsep, maxsep, nbins, binsize, b,
-                                     minrpar, maxrpar, xp, yp, zp,
-                                     xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs);
+           ProcessColumns2e<D1,MAX(D1,KData)>(cc2, list, cells1, cells2, cols1, cols2, dots);
            break;
       case GData:
-           corr = BuildCorr2a<GData>(d2, bin_type,
-                                     minsep, maxsep, nbins, binsize, b,
-                                     minrpar, maxrpar, xp, yp, zp,
-                                     xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs);
+           ProcessColumns2e<D1,MAX(D1,GData)>(cc2, list, cells1, cells2, cols1, cols2, dots);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int C, int B>
+void ProcessColumns2c(ColumnCorr2<B>& cc2, const InteractionList& list,
+                      void* field1, void* field2, int dots, int d1, int d2, int ncol,
+                      long nobj1, long nobj2, double* w1, double* v1r, double* v1i,
+                      double* w2, double* v2r, double* v2i)
+{
+    std::vector<const Cell<NData,C>*> cells1;
+    std::vector<const Cell<NData,C>*> cells2;
+    CollectCells(static_cast<Field<NData,C>*>(field1)->getCells(), cells1);
+    CollectCells(static_cast<Field<NData,C>*>(field2)->getCells(), cells2);
+
+    // For an auto-correlation, the columns are the same for both.
+    const bool same = field1 == field2 && d1 == d2 && v1r == v2r;
+    CellColumns<C>* cols1 = d1 == NData ? 0 :
+        new CellColumns<C>(cells1, d1, ncol, nobj1, w1, v1r, v1i);
+    CellColumns<C>* cols2 = same ? cols1 :
+        new CellColumns<C>(cells2, d2, ncol, nobj2, w2, v2r, v2i);
+    try {
+        switch(d1) {
+          case NData:
+               ProcessColumns2d<NData>(cc2, list, cells1, cells2, cols1, *cols2, dots);
+               break;
+          case KData:
+               ProcessColumns2d<KData>(cc2, list, cells1, cells2, cols1, *cols2, dots);
+               break;
+          case GData:
+               ProcessColumns2d<GData>(cc2, list, cells1, cells2, cols1, *cols2, dots);
+               break;
+          default:
+               Assert(false);
+        }
+    } catch (...) {
+        if (!same) delete cols2;
+        delete cols1;
+        throw;
+    }
+    if (!same) delete cols2;
+    delete cols1;
+}
+
+template <int B>
+void ProcessColumns2b(void* corr, const InteractionList& list, void* field1, void* field2,
+                      int dots, int d1, int d2, int ncol, long nobj1, long nobj2,
+                      double* w1, double* v1r, double* v1i,
+                      double* w2, double* v2r, double* v2i,
+                      double* xi0, double* xi1, double* xi2, double* xi3, int coords)
+{
+    ColumnCorr2<B> cc2(*static_cast<BinnedCorr2<NData,NData,B>*>(corr), ncol,
+                       xi0, xi1, xi2, xi3);
+    switch(coords) {
+      case Flat:
+           ProcessColumns2c<Flat>(cc2, list, field1, field2, dots, d1, d2, ncol,
+                                  nobj1, nobj2, w1, v1r, v1i, w2, v2r, v2i);
+           break;
+      case Sphere:
+           ProcessColumns2c<Sphere>(cc2, list, field1, field2, dots, d1, d2, ncol,
+                                    nobj1, nobj2, w1, v1r, v1i, w2, v2r, v2i);
+           break;
+      case ThreeD:
+           ProcessColumns2c<ThreeD>(cc2, list, field1, field2, dots, d1, d2, ncol,
+                                    nobj1, nobj2, w1, v1r, v1i, w2, v2r, v2i);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+int ProcessColumns2(void* corr, void* ilist, void* field1, void* field2, int dots,
+                    int d1, int d2, int ncol, long nobj1, long nobj2,
+                    double* w1, double* v1r, double* v1i,
+                    double* w2, double* v2r, double* v2i,
+                    double* xi0, double* xi1, double* xi2, double* xi3,
+                    int coords, int bin_type)
+{
+    PhaseThreads threads(ProcessPhase);
+    dbg<<"Start ProcessColumns2: "<<d1<<" "<<d2<<" "<<ncol<<" "<<coords<<" "<<bin_type<<std::endl;
+    Assert(d1 <= d2 && d2 != NData);
+    const InteractionList& list = *static_cast<InteractionList*>(ilist);
+    try {
+        switch(bin_type) {
+          case Log:
+               ProcessColumns2b<Log>(corr, list, field1, field2, dots, d1, d2, ncol,
+                                     nobj1, nobj2, w1, v1r, v1i, w2, v2r, v2i,
+                                     xi0, xi1, xi2, xi3, coords);
+               break;
+          case Linear:
+               ProcessColumns2b<Linear>(corr, list, field1, field2, dots, d1, d2, ncol,
+                                        nobj1, nobj2, w1, v1r, v1i, w2, v2r, v2i,
+                                        xi0, xi1, xi2, xi3, coords);
+               break;
+          case TwoD:
+               ProcessColumns2b<TwoD>(corr, list, field1, field2, dots, d1, d2, ncol,
+                                      nobj1, nobj2, w1, v1r, v1i, w2, v2r, v2i,
+                                      xi0, xi1, xi2, xi3, coords);
+               break;
+          default:
+               Assert(false);
+        }
+    } catch (std::runtime_error& e) {
+        dbg<<"Unable to process columns: "<<e.what()<<std::endl;
+        return 0;
+    }
+    return 1;
+}
+
+// The arguments of ProcessPatches2 that are just passed along by the dispatch functions.
+struct PatchArgs
+{
+    void** fields1;
+    void** fields2;
+    int nfields1;
+    int nfields2;
+    long npairs;
+    long* pairs_i;
+    long* pairs_j;
+    double* xi0;
+    double* xi1;
+    double* xi2;
+    double* xi3;
+    double* meanr;
+    double* meanlogr;
+    double* weight;
+    double* npairs_out;
+    int dots;
+    // For ProcessTagged2, the patch numbers of the objects of fields1[0] and fields2[0],
+    // and where to write whether it worked.
+    long* patch1;
+    long* patch2;
+    int npatch1;
+    int npatch2;
+    int* ok;
+};
+
+template <int C, int M, int D1, int D2, int B>
+void ProcessPatches2e(BinnedCorr2<D1,D2,B>* corr, const PatchArgs& args)
+{
+    // For an auto-correlation, the second set of fields is the same as the first.
+    const bool is_auto = !args.fields2;
+    void** f2 = is_auto ? args.fields1 : args.fields2;
+    const int n2 = is_auto ? args.nfields1 : args.nfields2;
+    std::vector<const Field<D1,C>*> fields1(args.nfields1);
+    for (int i=0; i<args.nfields1; ++i)
+        fields1[i] = static_cast<const Field<D1,C>*>(args.fields1[i]);
+    std::vector<const Field<D2,C>*> fields2(n2);
+    for (int i=0; i<n2; ++i) fields2[i] = static_cast<const Field<D2,C>*>(f2[i]);
+    if (args.patch1) {
+        *args.ok = corr->template processTagged<C,M>(
+            *fields1[0], *fields2[0], is_auto, args.patch1, is_auto ? args.patch1 : args.patch2,
+            args.npatch1, is_auto ? args.npatch1 : args.npatch2,
+            args.xi0, args.xi1, args.xi2, args.xi3,
+            args.meanr, args.meanlogr, args.weight, args.npairs_out, args.dots);
+        return;
+    }
+    std::vector<long> pairs_i(args.pairs_i, args.pairs_i + args.npairs);
+    std::vector<long> pairs_j(args.pairs_j, args.pairs_j + args.npairs);
+    corr->template processPatches<C,M>(fields1, fields2, pairs_i, pairs_j, is_auto,
+                                       args.xi0, args.xi1, args.xi2, args.xi3,
+                                       args.meanr, args.meanlogr, args.weight, args.npairs_out,
+                                       args.dots);
+}
+
+template <int M, int D1, int D2, int B>
+void ProcessPatches2d(BinnedCorr2<D1,D2,B>* corr, const PatchArgs& args, int coords)
+{
+    switch(coords) {
+      case Flat:
+           Assert(MetricHelper<M>::_Flat == int(Flat));
+           ProcessPatches2e<MetricHelper<M>::_Flat, M>(corr, args);
+           break;
+      case Sphere:
+           Assert(MetricHelper<M>::_Sphere == int(Sphere));
+           ProcessPatches2e<MetricHelper<M>::_Sphere, M>(corr, args);
+           break;
+      case ThreeD:
+           Assert(MetricHelper<M>::_ThreeD == int(ThreeD));
+           ProcessPatches2e<MetricHelper<M>::_ThreeD, M>(corr, args);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1, int D2, int B>
+void ProcessPatches2c(BinnedCorr2<D1,D2,B>* corr, const PatchArgs& args, int coords, int metric)
+{
+    switch(metric) {
+      case Euclidean:
+           ProcessPatches2d<Euclidean>(corr, args, coords);
+           break;
+      case Rperp:
+           ProcessPatches2d<Rperp>(corr, args, coords);
+           break;
+      case OldRperp:
+           ProcessPatches2d<OldRperp>(corr, args, coords);
+           break;
+      case Rlens:
+           ProcessPatches2d<Rlens>(corr, args, coords);
+           break;
+      case Arc:
+           ProcessPatches2d<Arc>(corr, args, coords);
+           break;
+      case Periodic:
+           ProcessPatches2d<Periodic>(corr, args, coords);
            break;
       default:
            Assert(false);
     }
-    xdbg<<"corr = "<<corr<<std::endl;
-    return corr;
 }
 
 template <int D1, int D2>
-void DestroyCorr2b(void* corr, int bin_type)
+void ProcessPatches2b(void* corr, const PatchArgs& args, int coords, int bin_type, int metric)
 {
     switch(bin_type) {
       case Log:
-           delete static_cast<BinnedCorr2<D1,D2,Log>*>(corr);
+           ProcessPatches2c(static_cast<BinnedCorr2<D1,D2,Log>*>(corr), args, coords, metric);
            break;
       case Linear:
-           delete static_cast<BinnedCorr2<D1,D2,Linear>*>(corr);
+           ProcessPatches2c(static_cast<BinnedCorr2<D1,D2,Linear>*>(corr), args, coords, metric);
            break;
       case TwoD:
-           delete static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr);
+           ProcessPatches2c(static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr), args, coords, metric);
            break;
       default:
            Assert(false);
@@ -1077,153 +5052,445 @@ void DestroyCorr2b(void* corr, int bin_type)
 }
 
 template <int D1>
-void DestroyCorr2a(void* corr, int d2, int bin_type)
+void ProcessPatches2a(void* corr, const PatchArgs& args, int d2, int coords, int bin_type,
+                      int metric)
 {
+    Assert(d2 >= D1);
     switch(d2) {
       case NData:
-           DestroyCorr2b<D1,MAX(D1,NData)>(corr, bin_type);
+           ProcessPatches2b<D1,MAX(D1,NData)>(corr, args, coords, bin_type, metric);
+           break;
+      case KData:
+           ProcessPatches2b<D1,MAX(D1,KData)>(corr, args, coords, bin_type, metric);
+           break;
+      case GData:
+           ProcessPatches2b<D1,MAX(D1,GData)>(corr, args, coords, bin_type, metric);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+void ProcessPatches2(void* corr, void** fields1, int nfields1, void** fields2, int nfields2,
+                     long npairs, long* pairs_i, long* pairs_j,
+                     double* xi0, double* xi1, double* xi2, double* xi3,
+                     double* meanr, double* meanlogr, double* weight, double* npairs_out,
+                     int dots, int d1, int d2, int coords, int bin_type, int metric)
+{
+    PhaseThreads threads(ProcessPhase);
+    dbg<<"Start ProcessPatches2: "<<npairs<<" "<<d1<<" "<<d2<<" "<<coords<<" "<<
+        bin_type<<" "<<metric<<std::endl;
+    PatchArgs args;
+    args.fields1 = fields1;
+    args.fields2 = fields2;
+    args.nfields1 = nfields1;
+    args.nfields2 = nfields2;
+    args.npairs = npairs;
+    args.pairs_i = pairs_i;
+    args.pairs_j = pairs_j;
+    args.xi0 = xi0;
+    args.xi1 = xi1;
+    args.xi2 = xi2;
+    args.xi3 = xi3;
+    args.meanr = meanr;
+    args.meanlogr = meanlogr;
+    args.weight = weight;
+    args.npairs_out = npairs_out;
+    args.dots = dots;
+    args.patch1 = 0;
+    args.patch2 = 0;
+
+    switch(d1) {
+      case NData:
+           ProcessPatches2a<NData>(corr, args, d2, coords, bin_type, metric);
            break;
       case KData:
-           DestroyCorr2b<D1,MAX(D1,KData)>(corr, bin_type);
+           ProcessPatches2a<KData>(corr, args, d2, coords, bin_type, metric);
            break;
       case GData:
-           DestroyCorr2b<D1,MAX(D1,GData)>(corr, bin_type);
+           ProcessPatches2a<GData>(corr, args, d2, coords, bin_type, metric);
            break;
       default:
            Assert(false);
     }
 }
 
-void DestroyCorr2(void* corr, int d1, int d2, int bin_type)
+int ProcessTagged2(void* corr, void* field1, void* field2, long* patch1, long* patch2,
+                   int npatch1, int npatch2,
+                   double* xi0, double* xi1, double* xi2, double* xi3,
+                   double* meanr, double* meanlogr, double* weight, double* npairs_out,
+                   int dots, int d1, int d2, int coords, int bin_type, int metric)
 {
-    dbg<<"Start DestroyCorr2: "<<d1<<" "<<d2<<" "<<bin_type<<std::endl;
-    xdbg<<"corr = "<<corr<<std::endl;
+    PhaseThreads threads(ProcessPhase);
+    dbg<<"Start ProcessTagged2: "<<npatch1<<" "<<npatch2<<" "<<d1<<" "<<d2<<" "<<coords<<" "<<
+        bin_type<<" "<<metric<<std::endl;
+    void* fields1[1] = { field1 };
+    void* fields2[1] = { field2 };
+    int ok = 0;
+    PatchArgs args;
+    args.fields1 = fields1;
+    args.fields2 = field2 ? fields2 : 0;
+    args.nfields1 = 1;
+    args.nfields2 = field2 ? 1 : 0;
+    args.npairs = 0;
+    args.pairs_i = 0;
+    args.pairs_j = 0;
+    args.xi0 = xi0;
+    args.xi1 = xi1;
+    args.xi2 = xi2;
+    args.xi3 = xi3;
+    args.meanr = meanr;
+    args.meanlogr = meanlogr;
+    args.weight = weight;
+    args.npairs_out = npairs_out;
+    args.dots = dots;
+    args.patch1 = patch1;
+    args.patch2 = patch2;
+    args.npatch1 = npatch1;
+    args.npatch2 = npatch2;
+    args.ok = &ok;
+
     switch(d1) {
       case NData:
-           DestroyCorr2a<NData>(corr, d2, bin_type);
+           ProcessPatches2a<NData>(corr, args, d2, coords, bin_type, metric);
            break;
       case KData:
-           DestroyCorr2a<KData>(corr, d2, bin_type);
+           ProcessPatches2a<KData>(corr, args, d2, coords, bin_type, metric);
            break;
       case GData:
-           DestroyCorr2a<GData>(corr, d2, bin_type);
+           ProcessPatches2a<GData>(corr, args, d2, coords, bin_type, metric);
            break;
       default:
            Assert(false);
     }
+    return ok;
 }
 
-template <int M, int D, int B>
-void ProcessAuto2d(BinnedCorr2<D,D,B>* corr, void* field, int dots, int coords)
+// Check that two trees of the same objects were built with the same structure.
+template <int D1, int D2, int C>
+bool SameTree(const Cell<D1,C>& c1, const Cell<D2,C>& c2)
+{
+    if (c1.getN() != c2.getN()) return false;
+    if (!c1.getLeft() != !c2.getLeft()) return false;
+    if (!c1.getLeft()) return true;
+    return (SameTree(*c1.getLeft(), *c2.getLeft()) &&
+            SameTree(*c1.getRight(), *c2.getRight()));
+}
+
+template <int C>
+bool MakeCellSets(void* nfield, void* kfield, void* gfield, std::vector<CellSet<C> >& cells)
+{
+    const Field<NData,C>* nf = static_cast<const Field<NData,C>*>(nfield);
+    const Field<KData,C>* kf = static_cast<const Field<KData,C>*>(kfield);
+    const Field<GData,C>* gf = static_cast<const Field<GData,C>*>(gfield);
+    Assert(nf || kf || gf);
+    const long n = nf ? nf->getNTopLevel() : kf ? kf->getNTopLevel() : gf->getNTopLevel();
+    if ((nf && nf->getNTopLevel() != n) || (kf && kf->getNTopLevel() != n) ||
+        (gf && gf->getNTopLevel() != n)) {
+        dbg<<"Fields have different numbers of top level cells\n";
+        return false;
+    }
+    cells.resize(n);
+    for (long i=0; i<n; ++i) {
+        const Cell<NData,C>* nc = nf ? nf->getCells()[i] : 0;
+        const Cell<KData,C>* kc = kf ? kf->getCells()[i] : 0;
+        const Cell<GData,C>* gc = gf ? gf->getCells()[i] : 0;
+        if ((nc && kc && !SameTree(*nc, *kc)) || (nc && gc && !SameTree(*nc, *gc)) ||
+            (kc && gc && !SameTree(*kc, *gc))) {
+            dbg<<"Fields have different tree structures\n";
+            return false;
+        }
+        cells[i] = CellSet<C>(nc, kc, gc);
+    }
+    return true;
+}
+
+template <int M, int C, int B>
+int ProcessMulti2e(MultiCorr2<B>& mc2, void* nfield1, void* kfield1, void* gfield1,
+                   void* nfield2, void* kfield2, void* gfield2, int dots)
+{
+    std::vector<CellSet<C> > cells1;
+    if (!MakeCellSets<C>(nfield1, kfield1, gfield1, cells1)) return 0;
+    if (!nfield2 && !kfield2 && !gfield2) {
+        mc2.template process<C,M>(cells1, dots);
+    } else {
+        std::vector<CellSet<C> > cells2;
+        if (!MakeCellSets<C>(nfield2, kfield2, gfield2, cells2)) return 0;
+        mc2.template process<C,M>(cells1, cells2, dots);
+    }
+    return 1;
+}
+
+template <int M, int B>
+int ProcessMulti2d(MultiCorr2<B>& mc2, void* nfield1, void* kfield1, void* gfield1,
+                   void* nfield2, void* kfield2, void* gfield2, int dots, int coords)
 {
     switch(coords) {
       case Flat:
            Assert(MetricHelper<M>::_Flat == int(Flat));
-           corr->template process<MetricHelper<M>::_Flat, M>(
-               *static_cast<Field<D,MetricHelper<M>::_Flat>*>(field), dots);
+           return ProcessMulti2e<M,MetricHelper<M>::_Flat>(
+               mc2, nfield1, kfield1, gfield1, nfield2, kfield2, gfield2, dots);
+      case Sphere:
+           Assert(MetricHelper<M>::_Sphere == int(Sphere));
+           return ProcessMulti2e<M,MetricHelper<M>::_Sphere>(
+               mc2, nfield1, kfield1, gfield1, nfield2, kfield2, gfield2, dots);
+      case ThreeD:
+           Assert(MetricHelper<M>::_ThreeD == int(ThreeD));
+           return ProcessMulti2e<M,MetricHelper<M>::_ThreeD>(
+               mc2, nfield1, kfield1, gfield1, nfield2, kfield2, gfield2, dots);
+      default:
+           Assert(false);
+    }
+    return 0;
+}
+
+template <int B>
+int ProcessMulti2c(MultiCorr2<B>& mc2, void* nfield1, void* kfield1, void* gfield1,
+                   void* nfield2, void* kfield2, void* gfield2, int dots,
+                   int coords, int metric)
+{
+    switch(metric) {
+      case Euclidean:
+           return ProcessMulti2d<Euclidean>(mc2, nfield1, kfield1, gfield1,
+                                            nfield2, kfield2, gfield2, dots, coords);
+      case Rperp:
+           return ProcessMulti2d<Rperp>(mc2, nfield1, kfield1, gfield1,
+                                        nfield2, kfield2, gfield2, dots, coords);
+      case OldRperp:
+           return ProcessMulti2d<OldRperp>(mc2, nfield1, kfield1, gfield1,
+                                           nfield2, kfield2, gfield2, dots, coords);
+      case Rlens:
+           return ProcessMulti2d<Rlens>(mc2, nfield1, kfield1, gfield1,
+                                        nfield2, kfield2, gfield2, dots, coords);
+      case Arc:
+           return ProcessMulti2d<Arc>(mc2, nfield1, kfield1, gfield1,
+                                      nfield2, kfield2, gfield2, dots, coords);
+      case Periodic:
+           return ProcessMulti2d<Periodic>(mc2, nfield1, kfield1, gfield1,
+                                           nfield2, kfield2, gfield2, dots, coords);
+      default:
+           Assert(false);
+    }
+    return 0;
+}
+
+template <int B>
+int ProcessMulti2b(void* nn, void* nk, void* ng, void* kk, void* kg, void* gg,
+                   void* nfield1, void* kfield1, void* gfield1,
+                   void* nfield2, void* kfield2, void* gfield2, int dots,
+                   int coords, int metric)
+{
+    MultiCorr2<B> mc2(static_cast<BinnedCorr2<NData,NData,B>*>(nn),
+                      static_cast<BinnedCorr2<NData,KData,B>*>(nk),
+                      static_cast<BinnedCorr2<NData,GData,B>*>(ng),
+                      static_cast<BinnedCorr2<KData,KData,B>*>(kk),
+                      static_cast<BinnedCorr2<KData,GData,B>*>(kg),
+                      static_cast<BinnedCorr2<GData,GData,B>*>(gg));
+    return ProcessMulti2c(mc2, nfield1, kfield1, gfield1, nfield2, kfield2, gfield2, dots,
+                          coords, metric);
+}
+
+int ProcessMulti2(void* nn, void* nk, void* ng, void* kk, void* kg, void* gg,
+                  void* nfield1, void* kfield1, void* gfield1,
+                  void* nfield2, void* kfield2, void* gfield2, int dots,
+                  int coords, int bin_type, int metric)
+{
+    PhaseThreads threads(ProcessPhase);
+    dbg<<"Start ProcessMulti2: "<<coords<<" "<<bin_type<<" "<<metric<<std::endl;
+
+    switch(bin_type) {
+      case Log:
+           return ProcessMulti2b<Log>(nn, nk, ng, kk, kg, gg, nfield1, kfield1, gfield1,
+                                      nfield2, kfield2, gfield2, dots, coords, metric);
+      case Linear:
+           return ProcessMulti2b<Linear>(nn, nk, ng, kk, kg, gg, nfield1, kfield1, gfield1,
+                                         nfield2, kfield2, gfield2, dots, coords, metric);
+      case TwoD:
+           return ProcessMulti2b<TwoD>(nn, nk, ng, kk, kg, gg, nfield1, kfield1, gfield1,
+                                       nfield2, kfield2, gfield2, dots, coords, metric);
+      default:
+           Assert(false);
+    }
+    return 0;
+}
+
+template <int M, int C, int D1, int D2>
+void ProcessMultiBin2e(MultiBinCorr2<D1,D2>& mb2, void* field1, void* field2, int dots)
+{
+    if (field2) {
+        mb2.template process<C,M>(*static_cast<Field<D1,C>*>(field1),
+                                  *static_cast<Field<D2,C>*>(field2), dots);
+    } else {
+        MultiBinHelper<D1,D2,C,M>::process(mb2, *static_cast<Field<D1,C>*>(field1), dots);
+    }
+}
+
+template <int M, int D1, int D2>
+void ProcessMultiBin2d(MultiBinCorr2<D1,D2>& mb2, void* field1, void* field2, int dots,
+                       int coords)
+{
+    switch(coords) {
+      case Flat:
+           Assert(MetricHelper<M>::_Flat == int(Flat));
+           ProcessMultiBin2e<M,MetricHelper<M>::_Flat>(mb2, field1, field2, dots);
            break;
       case Sphere:
            Assert(MetricHelper<M>::_Sphere == int(Sphere));
-           corr->template process<MetricHelper<M>::_Sphere, M>(
-               *static_cast<Field<D,MetricHelper<M>::_Sphere>*>(field), dots);
+           ProcessMultiBin2e<M,MetricHelper<M>::_Sphere>(mb2, field1, field2, dots);
            break;
       case ThreeD:
            Assert(MetricHelper<M>::_ThreeD == int(ThreeD));
-           corr->template process<MetricHelper<M>::_ThreeD, M>(
-               *static_cast<Field<D,MetricHelper<M>::_ThreeD>*>(field), dots);
+           ProcessMultiBin2e<M,MetricHelper<M>::_ThreeD>(mb2, field1, field2, dots);
            break;
       default:
            Assert(false);
     }
 }
 
-template <int D, int B>
-void ProcessAuto2c(BinnedCorr2<D,D,B>* corr, void* field, int dots,
-                   int coords, int metric)
+template <int D1, int D2>
+void ProcessMultiBin2c(MultiBinCorr2<D1,D2>& mb2, void* field1, void* field2, int dots,
+                       int coords, int metric)
 {
     switch(metric) {
       case Euclidean:
-           ProcessAuto2d<Euclidean>(corr, field, dots, coords);
+           ProcessMultiBin2d<Euclidean>(mb2, field1, field2, dots, coords);
            break;
       case Rperp:
-           ProcessAuto2d<Rperp>(corr, field, dots, coords);
+           ProcessMultiBin2d<Rperp>(mb2, field1, field2, dots, coords);
            break;
       case OldRperp:
-           ProcessAuto2d<OldRperp>(corr, field, dots, coords);
+           ProcessMultiBin2d<OldRperp>(mb2, field1, field2, dots, coords);
            break;
       case Rlens:
-           ProcessAuto2d<Rlens>(corr, field, dots, coords);
+           ProcessMultiBin2d<Rlens>(mb2, field1, field2, dots, coords);
            break;
       case Arc:
-           ProcessAuto2d<Arc>(corr, field, dots, coords);
+           ProcessMultiBin2d<Arc>(mb2, field1, field2, dots, coords);
            break;
       case Periodic:
-           ProcessAuto2d<Periodic>(corr, field, dots, coords);
+           ProcessMultiBin2d<Periodic>(mb2, field1, field2, dots, coords);
            break;
       default:
            Assert(false);
     }
 }
 
-template <int D>
-void ProcessAuto2b(void* corr, void* field, int dots, int coords, int bin_type, int metric)
+template <int D1, int D2>
+void ProcessMultiBin2b(void** corrs, int* bin_types, int ncorr, void* field1, void* field2,
+                       int dots, int coords, int metric)
 {
-    switch(bin_type) {
-      case Log:
-           ProcessAuto2c(static_cast<BinnedCorr2<D,D,Log>*>(corr), field, dots, coords, metric);
+    std::vector<BinnedCorr2<D1,D2,Log>*> logs;
+    std::vector<BinnedCorr2<D1,D2,Linear>*> lins;
+    std::vector<BinnedCorr2<D1,D2,TwoD>*> twods;
+    for (int i=0; i<ncorr; ++i) {
+        switch(bin_types[i]) {
+          case Log:
+               logs.push_back(static_cast<BinnedCorr2<D1,D2,Log>*>(corrs[i]));
+               break;
+          case Linear:
+               lins.push_back(static_cast<BinnedCorr2<D1,D2,Linear>*>(corrs[i]));
+               break;
+          case TwoD:
+               twods.push_back(static_cast<BinnedCorr2<D1,D2,TwoD>*>(corrs[i]));
+               break;
+          default:
+               Assert(false);
+        }
+    }
+    MultiBinCorr2<D1,D2> mb2(logs, lins, twods);
+    ProcessMultiBin2c(mb2, field1, field2, dots, coords, metric);
+}
+
+template <int D1>
+void ProcessMultiBin2a(void** corrs, int* bin_types, int ncorr, void* field1, void* field2,
+                       int dots, int d2, int coords, int metric)
+{
+    // As in ProcessCross2a, we only ever call this with d2 >= d1.
+    Assert(d2 >= D1);
+    switch(d2) {
+      case NData:
+           ProcessMultiBin2b<D1,MAX(D1,NData)>(corrs, bin_types, ncorr, field1, field2, dots,
+                                               coords, metric);
            break;
-      case Linear:
-           ProcessAuto2c(static_cast<BinnedCorr2<D,D,Linear>*>(corr), field, dots, coords, metric);
+      case KData:
+           ProcessMultiBin2b<D1,MAX(D1,KData)>(corrs, bin_types, ncorr, field1, field2, dots,
+                                               coords, metric);
            break;
-      case TwoD:
-           ProcessAuto2c(static_cast<BinnedCorr2<D,D,TwoD>*>(corr), field, dots, coords, metric);
+      case GData:
+           ProcessMultiBin2b<D1,MAX(D1,GData)>(corrs, bin_types, ncorr, field1, field2, dots,
+                                               coords, metric);
            break;
       default:
            Assert(false);
     }
 }
 
-void ProcessAuto2(void* corr, void* field, int dots,
-                  int d, int coords, int bin_type, int metric)
+void ProcessMultiBin2(void** corrs, int* bin_types, int ncorr, void* field1, void* field2,
+                      int dots, int d1, int d2, int coords, int metric)
 {
-    dbg<<"Start ProcessAuto2: "<<d<<" "<<coords<<" "<<bin_type<<" "<<metric<<std::endl;
+    PhaseThreads threads(ProcessPhase);
+    dbg<<"Start ProcessMultiBin2: "<<ncorr<<" "<<d1<<" "<<d2<<" "<<coords<<" "<<metric<<std::endl;
 
-    switch(d) {
+    switch(d1) {
       case NData:
-           ProcessAuto2b<NData>(corr, field, dots, coords, bin_type, metric);
+           ProcessMultiBin2a<NData>(corrs, bin_types, ncorr, field1, field2, dots,
+                                    d2, coords, metric);
            break;
       case KData:
-           ProcessAuto2b<KData>(corr, field, dots, coords, bin_type, metric);
+           ProcessMultiBin2a<KData>(corrs, bin_types, ncorr, field1, field2, dots,
+                                    d2, coords, metric);
            break;
       case GData:
-           ProcessAuto2b<GData>(corr, field, dots, coords, bin_type, metric);
+           ProcessMultiBin2a<GData>(corrs, bin_types, ncorr, field1, field2, dots,
+                                    d2, coords, metric);
            break;
       default:
            Assert(false);
     }
 }
 
+template <int C, int M, bool S1, int D1, int D2, int B>
+void ProcessMultiPartner2f(MultiPartnerCorr2<D1,D2,B>& mp2, void* field, void** fields,
+                           int nfields, int dots)
+{
+    typedef PartnerCells<D1,D2,C,S1> PC;
+    std::vector<const typename PC::PartnerField*> partners(nfields);
+    for (int p=0; p<nfields; ++p)
+        partners[p] = static_cast<const typename PC::PartnerField*>(fields[p]);
+    mp2.template process<C,M,S1>(*static_cast<const typename PC::SharedField*>(field),
+                                 partners, dots);
+}
+
+template <int M, int C, int D1, int D2, int B>
+void ProcessMultiPartner2e(MultiPartnerCorr2<D1,D2,B>& mp2, void* field, void** fields,
+                           int nfields, int shared1, int dots)
+{
+    if (shared1) {
+        ProcessMultiPartner2f<C,M,true>(mp2, field, fields, nfields, dots);
+    } else {
+        ProcessMultiPartner2f<C,M,false>(mp2, field, fields, nfields, dots);
+    }
+}
+
 template <int M, int D1, int D2, int B>
-void ProcessCross2d(BinnedCorr2<D1,D2,B>* corr, void* field1, void* field2, int dots, int coords)
+void ProcessMultiPartner2d(MultiPartnerCorr2<D1,D2,B>& mp2, void* field, void** fields,
+                           int nfields, int shared1, int dots, int coords)
 {
     switch(coords) {
       case Flat:
            Assert(MetricHelper<M>::_Flat == int(Flat));
-           corr->template process<MetricHelper<M>::_Flat, M>(
-               *static_cast<Field<D1,MetricHelper<M>::_Flat>*>(field1),
-               *static_cast<Field<D2,MetricHelper<M>::_Flat>*>(field2), dots);
+           ProcessMultiPartner2e<M,MetricHelper<M>::_Flat>(mp2, field, fields, nfields,
+                                                           shared1, dots);
            break;
       case Sphere:
            Assert(MetricHelper<M>::_Sphere == int(Sphere));
-           corr->template process<MetricHelper<M>::_Sphere, M>(
-               *static_cast<Field<D1,MetricHelper<M>::_Sphere>*>(field1),
-               *static_cast<Field<D2,MetricHelper<M>::_Sphere>*>(field2), dots);
+           ProcessMultiPartner2e<M,MetricHelper<M>::_Sphere>(mp2, field, fields, nfields,
+                                                             shared1, dots);
            break;
       case ThreeD:
            Assert(MetricHelper<M>::_ThreeD == int(ThreeD));
-           corr->template process<MetricHelper<M>::_ThreeD, M>(
-               *static_cast<Field<D1,MetricHelper<M>::_ThreeD>*>(field1),
-               *static_cast<Field<D2,MetricHelper<M>::_ThreeD>*>(field2), dots);
+           ProcessMultiPartner2e<M,MetricHelper<M>::_ThreeD>(mp2, field, fields, nfields,
+                                                             shared1, dots);
            break;
       default:
            Assert(false);
@@ -1231,27 +5498,30 @@ void ProcessCross2d(BinnedCorr2<D1,D2,B>* corr, void* field1, void* field2, int
 }
 
 template <int D1, int D2, int B>
-void ProcessCross2c(BinnedCorr2<D1,D2,B>* corr, void* field1, void* field2, int dots,
-                    int coords, int metric)
+void ProcessMultiPartner2c(void** corrs, int ncorr, void* field, void** fields, int shared1,
+                           int dots, int coords, int metric)
 {
+    std::vector<BinnedCorr2<D1,D2,B>*> bc2s(ncorr);
+    for (int p=0; p<ncorr; ++p) bc2s[p] = static_cast<BinnedCorr2<D1,D2,B>*>(corrs[p]);
+    MultiPartnerCorr2<D1,D2,B> mp2(bc2s);
     switch(metric) {
       case Euclidean:
-           ProcessCross2d<Euclidean>(corr, field1, field2, dots, coords);
+           ProcessMultiPartner2d<Euclidean>(mp2, field, fields, ncorr, shared1, dots, coords);
            break;
       case Rperp:
-           ProcessCross2d<Rperp>(corr, field1, field2, dots, coords);
+           ProcessMultiPartner2d<Rperp>(mp2, field, fields, ncorr, shared1, dots, coords);
            break;
       case OldRperp:
-           ProcessCross2d<OldRperp>(corr, field1, field2, dots, coords);
+           ProcessMultiPartner2d<OldRperp>(mp2, field, fields, ncorr, shared1, dots, coords);
            break;
       case Rlens:
-           ProcessCross2d<Rlens>(corr, field1, field2, dots, coords);
+           ProcessMultiPartner2d<Rlens>(mp2, field, fields, ncorr, shared1, dots, coords);
            break;
       case Arc:
-           ProcessCross2d<Arc>(corr, field1, field2, dots, coords);
+           ProcessMultiPartner2d<Arc>(mp2, field, fields, ncorr, shared1, dots, coords);
            break;
       case Periodic:
-           ProcessCross2d<Periodic>(corr, field1, field2, dots, coords);
+           ProcessMultiPartner2d<Periodic>(mp2, field, fields, ncorr, shared1, dots, coords);
            break;
       default:
            Assert(false);
@@ -1259,21 +5529,21 @@ void ProcessCross2c(BinnedCorr2<D1,D2,B>* corr, void* field1, void* field2, int
 }
 
 template <int D1, int D2>
-void ProcessCross2b(void* corr, void* field1, void* field2, int dots,
-                    int coords, int bin_type, int metric)
+void ProcessMultiPartner2b(void** corrs, int ncorr, void* field, void** fields, int shared1,
+                           int dots, int coords, int bin_type, int metric)
 {
     switch(bin_type) {
       case Log:
-           ProcessCross2c(static_cast<BinnedCorr2<D1,D2,Log>*>(corr), field1, field2, dots,
-                          coords, metric);
+           ProcessMultiPartner2c<D1,D2,Log>(corrs, ncorr, field, fields, shared1, dots,
+                                            coords, metric);
            break;
       case Linear:
-           ProcessCross2c(static_cast<BinnedCorr2<D1,D2,Linear>*>(corr), field1, field2, dots,
-                          coords, metric);
+           ProcessMultiPartner2c<D1,D2,Linear>(corrs, ncorr, field, fields, shared1, dots,
+                                               coords, metric);
            break;
       case TwoD:
-           ProcessCross2c(static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr), field1, field2, dots,
-                          coords, metric);
+           ProcessMultiPartner2c<D1,D2,TwoD>(corrs, ncorr, field, fields, shared1, dots,
+                                             coords, metric);
            break;
       default:
            Assert(false);
@@ -1281,49 +5551,48 @@ void ProcessCross2b(void* corr, void* field1, void* field2, int dots,
 }
 
 template <int D1>
-void ProcessCross2a(void* corr, void* field1, void* field2, int dots,
-                    int d2, int coords, int bin_type, int metric)
+void ProcessMultiPartner2a(void** corrs, int ncorr, void* field, void** fields, int shared1,
+                           int dots, int d2, int coords, int bin_type, int metric)
 {
-    // Note: we only ever call this with d2 >= d1, so the MAX bit below is equivalent to
-    // just using d2 for the cases that actually get called, but doing this saves some
-    // compile time and some size in the final library from not instantiating templates
-    // that aren't needed.
+    // As in ProcessCross2a, we only ever call this with d2 >= d1.
     Assert(d2 >= D1);
     switch(d2) {
       case NData:
-           ProcessCross2b<D1,MAX(D1,NData)>(corr, field1, field2, dots,
-                                            coords, bin_type, metric);
+           ProcessMultiPartner2b<D1,MAX(D1,NData)>(corrs, ncorr, field, fields, shared1, dots,
+                                                   coords, bin_type, metric);
            break;
       case KData:
-           ProcessCross2b<D1,MAX(D1,KData)>(corr, field1, field2, dots,
-                                            coords, bin_type, metric);
+           ProcessMultiPartner2b<D1,MAX(D1,KData)>(corrs, ncorr, field, fields, shared1, dots,
+                                                   coords, bin_type, metric);
            break;
       case GData:
-           ProcessCross2b<D1,MAX(D1,GData)>(corr, field1, field2, dots,
-                                            coords, bin_type, metric);
+           ProcessMultiPartner2b<D1,MAX(D1,GData)>(corrs, ncorr, field, fields, shared1, dots,
+                                                   coords, bin_type, metric);
            break;
       default:
            Assert(false);
     }
 }
 
-void ProcessCross2(void* corr, void* field1, void* field2, int dots,
-                   int d1, int d2, int coords, int bin_type, int metric)
+void ProcessMultiPartner2(void** corrs, int ncorr, void* field, void** fields, int shared1,
+                          int dots, int d1, int d2, int coords, int bin_type, int metric)
 {
-    dbg<<"Start ProcessCross2: "<<d1<<" "<<d2<<" "<<coords<<" "<<bin_type<<" "<<metric<<std::endl;
+    PhaseThreads threads(ProcessPhase);
+    dbg<<"Start ProcessMultiPartner2: "<<ncorr<<" "<<shared1<<" "<<d1<<" "<<d2<<" "<<coords<<" "
+        <<bin_type<<" "<<metric<<std::endl;
 
     switch(d1) {
       case NData:
-           ProcessCross2a<NData>(corr, field1, field2, dots,
-                                 d2, coords, bin_type, metric);
+           ProcessMultiPartner2a<NData>(corrs, ncorr, field, fields, shared1, dots,
+                                        d2, coords, bin_type, metric);
            break;
       case KData:
-           ProcessCross2a<KData>(corr, field1, field2, dots,
-                                 d2, coords, bin_type, metric);
+           ProcessMultiPartner2a<KData>(corrs, ncorr, field, fields, shared1, dots,
+                                        d2, coords, bin_type, metric);
            break;
       case GData:
-           ProcessCross2a<GData>(corr, field1, field2, dots,
-                                 d2, coords, bin_type, metric);
+           ProcessMultiPartner2a<GData>(corrs, ncorr, field, fields, shared1, dots,
+                                        d2, coords, bin_type, metric);
            break;
       default:
            Assert(false);
@@ -1432,6 +5701,7 @@ void ProcessPair2a(void* corr, void* field1, void* field2, int dots,
 void ProcessPair(void* corr, void* field1, void* field2, int dots,
                  int d1, int d2, int coords, int bin_type, int metric)
 {
+    PhaseThreads threads(ProcessPhase);
     dbg<<"Start ProcessPair: "<<d1<<" "<<d2<<" "<<coords<<" "<<bin_type<<" "<<metric<<std::endl;
 
     switch(d1) {
@@ -1452,11 +5722,143 @@ void ProcessPair(void* corr, void* field1, void* field2, int dots,
     }
 }
 
+template <int C, int M, int D1, int D2, int B>
+void ProcessPairwiseArrays2e(BinnedCorr2<D1,D2,B>* corr, const ObjectArrays& obj1,
+                             const ObjectArrays& obj2, long nobj, int dots)
+{ corr->template processPairwiseArrays<C,M>(obj1, obj2, nobj, dots); }
+
+template <int M, int D1, int D2, int B>
+void ProcessPairwiseArrays2d(BinnedCorr2<D1,D2,B>* corr, const ObjectArrays& obj1,
+                             const ObjectArrays& obj2, long nobj, int dots, int coords)
+{
+    switch(coords) {
+      case Flat:
+           Assert(MetricHelper<M>::_Flat == int(Flat));
+           ProcessPairwiseArrays2e<MetricHelper<M>::_Flat, M>(corr, obj1, obj2, nobj, dots);
+           break;
+      case Sphere:
+           Assert(MetricHelper<M>::_Sphere == int(Sphere));
+           ProcessPairwiseArrays2e<MetricHelper<M>::_Sphere, M>(corr, obj1, obj2, nobj, dots);
+           break;
+      case ThreeD:
+           Assert(MetricHelper<M>::_ThreeD == int(ThreeD));
+           ProcessPairwiseArrays2e<MetricHelper<M>::_ThreeD, M>(corr, obj1, obj2, nobj, dots);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1, int D2, int B>
+void ProcessPairwiseArrays2c(BinnedCorr2<D1,D2,B>* corr, const ObjectArrays& obj1,
+                             const ObjectArrays& obj2, long nobj, int dots,
+                             int coords, int metric)
+{
+    switch(metric) {
+      case Euclidean:
+           ProcessPairwiseArrays2d<Euclidean>(corr, obj1, obj2, nobj, dots, coords);
+           break;
+      case Rperp:
+           ProcessPairwiseArrays2d<Rperp>(corr, obj1, obj2, nobj, dots, coords);
+           break;
+      case OldRperp:
+           ProcessPairwiseArrays2d<OldRperp>(corr, obj1, obj2, nobj, dots, coords);
+           break;
+      case Rlens:
+           ProcessPairwiseArrays2d<Rlens>(corr, obj1, obj2, nobj, dots, coords);
+           break;
+      case Arc:
+           ProcessPairwiseArrays2d<Arc>(corr, obj1, obj2, nobj, dots, coords);
+           break;
+      case Periodic:
+           ProcessPairwiseArrays2d<Periodic>(corr, obj1, obj2, nobj, dots, coords);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1, int D2>
+void ProcessPairwiseArrays2b(void* corr, const ObjectArrays& obj1, const ObjectArrays& obj2,
+                             long nobj, int dots, int coords, int bin_type, int metric)
+{
+    switch(bin_type) {
+      case Log:
+           ProcessPairwiseArrays2c(static_cast<BinnedCorr2<D1,D2,Log>*>(corr),
+                                   obj1, obj2, nobj, dots, coords, metric);
+           break;
+      case Linear:
+           ProcessPairwiseArrays2c(static_cast<BinnedCorr2<D1,D2,Linear>*>(corr),
+                                   obj1, obj2, nobj, dots, coords, metric);
+           break;
+      case TwoD:
+           ProcessPairwiseArrays2c(static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr),
+                                   obj1, obj2, nobj, dots, coords, metric);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1>
+void ProcessPairwiseArrays2a(void* corr, const ObjectArrays& obj1, const ObjectArrays& obj2,
+                             long nobj, int dots, int d2, int coords, int bin_type, int metric)
+{
+    Assert(d2 >= D1);
+    switch(d2) {
+      case NData:
+           ProcessPairwiseArrays2b<D1,MAX(D1,NData)>(corr, obj1, obj2, nobj, dots,
+                                                     coords, bin_type, metric);
+           break;
+      case KData:
+           ProcessPairwiseArrays2b<D1,MAX(D1,KData)>(corr, obj1, obj2, nobj, dots,
+                                                     coords, bin_type, metric);
+           break;
+      case GData:
+           ProcessPairwiseArrays2b<D1,MAX(D1,GData)>(corr, obj1, obj2, nobj, dots,
+                                                     coords, bin_type, metric);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+void ProcessPairwiseArrays(void* corr,
+                           double* x1, double* y1, double* z1, double* g1_1, double* g2_1,
+                           double* k1, double* w1,
+                           double* x2, double* y2, double* z2, double* g1_2, double* g2_2,
+                           double* k2, double* w2,
+                           long nobj, int dots, int d1, int d2, int coords, int bin_type,
+                           int metric)
+{
+    dbg<<"Start ProcessPairwiseArrays: "<<nobj<<" "<<d1<<" "<<d2<<" "<<coords<<" "<<
+        bin_type<<" "<<metric<<std::endl;
+    ObjectArrays obj1(x1, y1, z1, g1_1, g2_1, k1, w1);
+    ObjectArrays obj2(x2, y2, z2, g1_2, g2_2, k2, w2);
+
+    switch(d1) {
+      case NData:
+           ProcessPairwiseArrays2a<NData>(corr, obj1, obj2, nobj, dots,
+                                          d2, coords, bin_type, metric);
+           break;
+      case KData:
+           ProcessPairwiseArrays2a<KData>(corr, obj1, obj2, nobj, dots,
+                                          d2, coords, bin_type, metric);
+           break;
+      case GData:
+           ProcessPairwiseArrays2a<GData>(corr, obj1, obj2, nobj, dots,
+                                          d2, coords, bin_type, metric);
+           break;
+      default:
+           Assert(false);
+    }
+}
 
 int SetOMPThreads(int num_threads)
 {
 #ifdef _OPENMP
     omp_set_num_threads(num_threads);
+    SetThreadBudget(omp_get_max_threads());
     return omp_get_max_threads();
 #else
     return 1;
@@ -1472,10 +5874,31 @@ int GetOMPThreads()
 #endif
 }
 
+int SetOMPNumaDomains(int num_domains)
+{
+    SetNumaDomains(num_domains);
+    return GetNumaDomains();
+}
+
+int GetOMPNumaDomains()
+{ return GetNumaDomains(); }
+
+int PinOMPThreads()
+{ return PinThreads(); }
+
+int SetOMPPhaseThreads(int phase, int num_threads)
+{
+    SetPhaseThreads(phase, num_threads);
+    return GetPhaseThreads(phase);
+}
+
+int GetOMPPhaseThreads(int phase)
+{ return GetPhaseThreads(phase); }
+
 template <int M, int D1, int D2, int B>
 long SamplePairs2d(BinnedCorr2<D1,D2,B>* corr, void* field1, void* field2,
                    double minsep, double maxsep,
-                   int coords, long* i1, long* i2, double* sep, int n)
+                   int coords, long* i1, long* i2, double* sep, int n, long seed)
 {
     switch(coords) {
       case Flat:
@@ -1483,21 +5906,21 @@ long SamplePairs2d(BinnedCorr2<D1,D2,B>* corr, void* field1, void* field2,
            return corr->template samplePairs<MetricHelper<M>::_Flat, M>(
                *static_cast<Field<D1,MetricHelper<M>::_Flat>*>(field1),
                *static_cast<Field<D2,MetricHelper<M>::_Flat>*>(field2),
-               minsep, maxsep, i1, i2, sep, n);
+               minsep, maxsep, i1, i2, sep, n, seed);
            break;
       case Sphere:
            Assert(MetricHelper<M>::_Sphere == int(Sphere));
            return corr->template samplePairs<MetricHelper<M>::_Sphere, M>(
                *static_cast<Field<D1,MetricHelper<M>::_Sphere>*>(field1),
                *static_cast<Field<D2,MetricHelper<M>::_Sphere>*>(field2),
-               minsep, maxsep, i1, i2, sep, n);
+               minsep, maxsep, i1, i2, sep, n, seed);
            break;
       case ThreeD:
            Assert(MetricHelper<M>::_ThreeD == int(ThreeD));
            return corr->template samplePairs<MetricHelper<M>::_ThreeD, M>(
                *static_cast<Field<D1,MetricHelper<M>::_ThreeD>*>(field1),
                *static_cast<Field<D2,MetricHelper<M>::_ThreeD>*>(field2),
-               minsep, maxsep, i1, i2, sep, n);
+               minsep, maxsep, i1, i2, sep, n, seed);
            break;
       default:
            Assert(false);
@@ -1507,32 +5930,32 @@ long SamplePairs2d(BinnedCorr2<D1,D2,B>* corr, void* field1, void* field2,
     template <int D1, int D2, int B>
     long SamplePairs2c(BinnedCorr2<D1,D2,B>* corr, void* field1, void* field2,
                        double minsep, double maxsep,
-                       int coords, int metric, long* i1, long* i2, double* sep, int n)
+                       int coords, int metric, long* i1, long* i2, double* sep, int n, long seed)
 {
     switch(metric) {
       case Euclidean:
            return SamplePairs2d<Euclidean>(corr, field1, field2, minsep, maxsep,
-                                           coords, i1, i2, sep, n);
+                                           coords, i1, i2, sep, n, seed);
            break;
       case Rperp:
            return SamplePairs2d<Rperp>(corr, field1, field2, minsep, maxsep,
-                                       coords, i1, i2, sep, n);
+                                       coords, i1, i2, sep, n, seed);
            break;
       case OldRperp:
            return SamplePairs2d<OldRperp>(corr, field1, field2, minsep, maxsep,
-                                          coords, i1, i2, sep, n);
+                                          coords, i1, i2, sep, n, seed);
            break;
       case Rlens:
            return SamplePairs2d<Rlens>(corr, field1, field2, minsep, maxsep,
-                                       coords, i1, i2, sep, n);
+                                       coords, i1, i2, sep, n, seed);
            break;
       case Arc:
            return SamplePairs2d<Arc>(corr, field1, field2, minsep, maxsep,
-                                     coords, i1, i2, sep, n);
+                                     coords, i1, i2, sep, n, seed);
            break;
       case Periodic:
            return SamplePairs2d<Periodic>(corr, field1, field2, minsep, maxsep,
-                                          coords, i1, i2, sep, n);
+                                          coords, i1, i2, sep, n, seed);
            break;
       default:
            Assert(false);
@@ -1543,18 +5966,18 @@ long SamplePairs2d(BinnedCorr2<D1,D2,B>* corr, void* field1, void* field2,
 template <int D1, int D2>
 long SamplePairs2b(void* corr, void* field1, void* field2, double minsep, double maxsep,
                    int coords, int bin_type, int metric,
-                   long* i1, long* i2, double* sep, int n)
+                   long* i1, long* i2, double* sep, int n, long seed)
 {
     switch(bin_type) {
       case Log:
            return SamplePairs2c(static_cast<BinnedCorr2<D1,D2,Log>*>(corr),
                                 field1, field2, minsep, maxsep,
-                                coords, metric, i1, i2, sep, n);
+                                coords, metric, i1, i2, sep, n, seed);
            break;
       case Linear:
            return SamplePairs2c(static_cast<BinnedCorr2<D1,D2,Linear>*>(corr),
                                 field1, field2, minsep, maxsep,
-                                coords, metric, i1, i2, sep, n);
+                                coords, metric, i1, i2, sep, n, seed);
            break;
       case TwoD:
            // TwoD not implemented.
@@ -1568,21 +5991,21 @@ long SamplePairs2b(void* corr, void* field1, void* field2, double minsep, double
 template <int D1>
 long SamplePairs2a(void* corr, void* field1, void* field2, double minsep, double maxsep,
                    int d2, int coords, int bin_type, int metric,
-                   long* i1, long* i2, double* sep, int n)
+                   long* i1, long* i2, double* sep, int n, long seed)
 {
     Assert(d2 >= D1);
     switch(d2) {
       case NData:
            return SamplePairs2b<D1,MAX(D1,NData)>(corr, field1, field2, minsep, maxsep,
-                                                  coords, bin_type, metric, i1, i2, sep, n);
+                                                  coords, bin_type, metric, i1, i2, sep, n, seed);
            break;
       case KData:
            return SamplePairs2b<D1,MAX(D1,KData)>(corr, field1, field2, minsep, maxsep,
-                                                  coords, bin_type, metric, i1, i2, sep, n);
+                                                  coords, bin_type, metric, i1, i2, sep, n, seed);
            break;
       case GData:
            return SamplePairs2b<D1,MAX(D1,GData)>(corr, field1, field2, minsep, maxsep,
-                                                  coords, bin_type, metric, i1, i2, sep, n);
+                                                  coords, bin_type, metric, i1, i2, sep, n, seed);
            break;
       default:
            Assert(false);
@@ -1592,22 +6015,23 @@ long SamplePairs2a(void* corr, void* field1, void* field2, double minsep, double
 
 long SamplePairs(void* corr, void* field1, void* field2, double minsep, double maxsep,
                  int d1, int d2, int coords, int bin_type, int metric,
-                 long* i1, long* i2, double* sep, int n)
+                 long* i1, long* i2, double* sep, int n, long seed)
 {
+    PhaseThreads threads(ProcessPhase);
     dbg<<"Start SamplePairs: "<<d1<<" "<<d2<<" "<<coords<<" "<<bin_type<<" "<<metric<<std::endl;
 
     switch(d1) {
       case NData:
            return SamplePairs2a<NData>(corr, field1, field2, minsep, maxsep,
-                                       d2, coords, bin_type, metric, i1, i2, sep, n);
+                                       d2, coords, bin_type, metric, i1, i2, sep, n, seed);
            break;
       case KData:
            return SamplePairs2a<KData>(corr, field1, field2, minsep, maxsep,
-                                       d2, coords, bin_type, metric, i1, i2, sep, n);
+                                       d2, coords, bin_type, metric, i1, i2, sep, n, seed);
            break;
       case GData:
            return SamplePairs2a<GData>(corr, field1, field2, minsep, maxsep,
-                                       d2, coords, bin_type, metric, i1, i2, sep, n);
+                                       d2, coords, bin_type, metric, i1, i2, sep, n, seed);
            break;
       default:
            Assert(false);
@@ -14,10 +14,17 @@
 
 //#define DEBUGLOGGING
 
+#include <limits>
+
 #include "dbg.h"
 #include "BinnedCorr3.h"
 #include "Split.h"
 #include "ProjectHelper.h"
+#include "ThreadReduce.h"
+#include "TopCellGrid.h"
+#include "NumaDomains.h"
+#include "ThreadBudget.h"
+#include "Trace.h"
 
 #ifdef _OPENMP
 #include "omp.h"
@@ -38,7 +45,8 @@ BinnedCorr3<D1,D2,D3,B>::BinnedCorr3(
     _minu(minu), _maxu(maxu), _nubins(nubins), _ubinsize(ubinsize), _bu(bu),
     _minv(minv), _maxv(maxv), _nvbins(nvbins), _vbinsize(vbinsize), _bv(bv),
     _minrpar(minrpar), _maxrpar(maxrpar), _xp(xp), _yp(yp), _zp(zp),
-    _coords(-1), _owns_data(false),
+    _coords(-1), _stats_out(0), _owns_data(false), _buffer(0),
+    _max_thread_mem(std::numeric_limits<double>::max()), _shared(false),
     _zeta(zeta0,zeta1,zeta2,zeta3,zeta4,zeta5,zeta6,zeta7),
     _meand1(meand1), _meanlogd1(meanlogd1), _meand2(meand2), _meanlogd2(meanlogd2),
     _meand3(meand3), _meanlogd3(meanlogd3), _meanu(meanu), _meanv(meanv),
@@ -48,6 +56,9 @@ BinnedCorr3<D1,D2,D3,B>::BinnedCorr3(
     _logminsep = log(_minsep);
     _halfminsep = 0.5*_minsep;
     _halfmind3 = 0.5*_minsep*_minu;
+    _mind3 = _minsep*_minu;
+    _maxd3 = _maxsep*_maxu;
+    _maxd1 = _maxsep*(1. + _maxu*_maxv);
     _minsepsq = _minsep*_minsep;
     _maxsepsq = _maxsep*_maxsep;
     _minusq = _minu*_minu;
@@ -64,7 +75,8 @@ BinnedCorr3<D1,D2,D3,B>::BinnedCorr3(
 }
 
 template <int D1, int D2, int D3, int B>
-BinnedCorr3<D1,D2,D3,B>::BinnedCorr3(const BinnedCorr3<D1,D2,D3,B>& rhs, bool copy_data) :
+BinnedCorr3<D1,D2,D3,B>::BinnedCorr3(const BinnedCorr3<D1,D2,D3,B>& rhs, bool copy_data,
+                                     bool share_data) :
     _minsep(rhs._minsep), _maxsep(rhs._maxsep), _nbins(rhs._nbins),
     _binsize(rhs._binsize), _b(rhs._b),
     _minu(rhs._minu), _maxu(rhs._maxu), _nubins(rhs._nubins),
@@ -72,13 +84,31 @@ BinnedCorr3<D1,D2,D3,B>::BinnedCorr3(const BinnedCorr3<D1,D2,D3,B>& rhs, bool co
     _minv(rhs._minv), _maxv(rhs._maxv), _nvbins(rhs._nvbins),
     _vbinsize(rhs._vbinsize), _bv(rhs._bv),
     _logminsep(rhs._logminsep), _halfminsep(rhs._halfminsep), _halfmind3(rhs._halfmind3),
+    _mind3(rhs._mind3), _maxd3(rhs._maxd3), _maxd1(rhs._maxd1),
     _minsepsq(rhs._minsepsq), _maxsepsq(rhs._maxsepsq),
     _minusq(rhs._minusq), _maxusq(rhs._maxusq),
     _minvsq(rhs._minvsq), _maxvsq(rhs._maxvsq),
     _bsq(rhs._bsq), _busq(rhs._busq), _bvsq(rhs._bvsq), _sqrttwobv(rhs._sqrttwobv),
     _coords(rhs._coords), _nvbins2(rhs._nvbins2), _nuv(rhs._nuv), _ntot(rhs._ntot),
-    _owns_data(true), _zeta(0,0,0,0,0,0,0,0), _weight(0)
+    _stats_out(0), _owns_data(!share_data), _buffer(0), _max_thread_mem(rhs._max_thread_mem),
+    _shared(share_data), _zeta(0,0,0,0,0,0,0,0), _weight(0)
 {
+    _buffer = new TriangleBuffer();
+    if (share_data) {
+        _zeta = rhs._zeta;
+        _meand1 = rhs._meand1;
+        _meanlogd1 = rhs._meanlogd1;
+        _meand2 = rhs._meand2;
+        _meanlogd2 = rhs._meanlogd2;
+        _meand3 = rhs._meand3;
+        _meanlogd3 = rhs._meanlogd3;
+        _meanu = rhs._meanu;
+        _meanv = rhs._meanv;
+        _weight = rhs._weight;
+        _ntri = rhs._ntri;
+        clear();
+        return;
+    }
     _zeta.new_data(_ntot);
     _meand1 = new double[_ntot];
     _meanlogd1 = new double[_ntot];
@@ -98,6 +128,7 @@ BinnedCorr3<D1,D2,D3,B>::BinnedCorr3(const BinnedCorr3<D1,D2,D3,B>& rhs, bool co
 template <int D1, int D2, int D3, int B>
 BinnedCorr3<D1,D2,D3,B>::~BinnedCorr3()
 {
+    DeleteThreadAccumulators(_thread_accums);
     if (_owns_data) {
         _zeta.delete_data();
         delete [] _meand1; _meand1 = 0;
@@ -111,10 +142,21 @@ BinnedCorr3<D1,D2,D3,B>::~BinnedCorr3()
         delete [] _weight; _weight = 0;
         delete [] _ntri; _ntri = 0;
     }
+    delete _buffer; _buffer = 0;
 }
 
 template <int D1, int D2, int D3, int B>
 void BinnedCorr3<D1,D2,D3,B>::clear()
+{
+    // If the arrays are shared with other threads, they are cleared once in clearData.
+    if (!_shared) clearData();
+    if (_buffer) _buffer->n = 0;
+    _stats.clear();
+    _coords = -1;
+}
+
+template <int D1, int D2, int D3, int B>
+void BinnedCorr3<D1,D2,D3,B>::clearData()
 {
     _zeta.clear(_ntot);
     for (int i=0; i<_ntot; ++i) _meand1[i] = 0.;
@@ -127,7 +169,45 @@ void BinnedCorr3<D1,D2,D3,B>::clear()
     for (int i=0; i<_ntot; ++i) _meanv[i] = 0.;
     for (int i=0; i<_ntot; ++i) _weight[i] = 0.;
     for (int i=0; i<_ntot; ++i) _ntri[i] = 0.;
-    _coords = -1;
+}
+
+template <int D1, int D2, int D3, int B>
+bool BinnedCorr3<D1,D2,D3,B>::shareThreadData(int nthreads) const
+{
+    std::vector<double*> arrays;
+    getArrays(arrays);
+    const double mem = double(_ntot) * arrays.size() * sizeof(double);
+    return nthreads > 1 && nthreads * mem > _max_thread_mem;
+}
+
+template <int D1, int D2, int D3, int B>
+double BinnedCorr3<D1,D2,D3,B>::threadMemory(int nthreads) const
+{
+    std::vector<double*> arrays;
+    getArrays(arrays);
+    const double mem = double(_ntot) * arrays.size() * sizeof(double);
+    const int ncopies = shareThreadData(nthreads) ? 1 : nthreads;
+    return ncopies * mem + nthreads * double(sizeof(TriangleBuffer));
+}
+
+template <int D1, int D2, int D3, int B>
+void BinnedCorr3<D1,D2,D3,B>::getThreadAccumulators(int nthreads)
+{
+    const bool shared = shareThreadData(nthreads);
+    if (!_thread_accums.empty() && _thread_accums[0]->_shared != shared)
+        DeleteThreadAccumulators(_thread_accums);
+    if (shared) {
+        if (_thread_accums.empty()) {
+            _thread_accums.push_back(new BinnedCorr3<D1,D2,D3,B>(*this, false));
+            _thread_accums[0]->_shared = true;
+        }
+        while (int(_thread_accums.size()) < nthreads)
+            _thread_accums.push_back(new BinnedCorr3<D1,D2,D3,B>(*_thread_accums[0], false, true));
+    } else {
+        GetThreadAccumulators(_thread_accums, *this, nthreads);
+    }
+    dbg<<"Using "<<(shared ? "shared" : "separate")<<" results for "<<nthreads<<" threads: "<<
+        threadMemory(nthreads)/(1<<20)<<" MB\n";
 }
 
 // BinnedCorr3::process3 is invalid if D1 != D2 or D3, so this helper struct lets us only call
@@ -137,9 +217,10 @@ struct ProcessHelper
 {
     static void process3(BinnedCorr3<D1,D2,D3,B>& , const Cell<D1,C>*, const MetricHelper<M>&) {}
     static void process21(BinnedCorr3<D1,D2,D3,B>& , const Cell<D1,C>*, const Cell<D3,C>*,
-                          const MetricHelper<M>&) {}
+                          const MetricHelper<M>&, double=0.) {}
     static void process111(BinnedCorr3<D1,D2,D3,B>& , const Cell<D1,C>*, const Cell<D2,C>*,
-                           const Cell<D3,C>*, const MetricHelper<M>&) {}
+                           const Cell<D3,C>*, const MetricHelper<M>&,
+                           double=0., double=0., double=0.) {}
 };
 
 template <int D1, int D3, int B, int C, int M>
@@ -147,9 +228,10 @@ struct ProcessHelper<D1,D1,D3,B,C,M>
 {
     static void process3(BinnedCorr3<D1,D1,D3,B>& b, const Cell<D1,C>*, const MetricHelper<M>&) {}
     static void process21(BinnedCorr3<D1,D1,D3,B>& b, const Cell<D1,C>* , const Cell<D3,C>*,
-                          const MetricHelper<M>&) {}
+                          const MetricHelper<M>&, double=0.) {}
     static void process111(BinnedCorr3<D1,D1,D3,B>& b, const Cell<D1,C>* , const Cell<D1,C>*,
-                           const Cell<D3,C>*, const MetricHelper<M>&) {}
+                           const Cell<D3,C>*, const MetricHelper<M>&,
+                           double=0., double=0., double=0.) {}
 };
 
 template <int D, int B, int C, int M>
@@ -159,13 +241,125 @@ struct ProcessHelper<D,D,D,B,C,M>
                          const MetricHelper<M>& metric)
     { b.template process3<C,M>(c123, metric); }
     static void process21(BinnedCorr3<D,D,D,B>& b, const Cell<D,C>* c12, const Cell<D,C>* c3,
-                          const MetricHelper<M>& metric)
-    { b.template process21<true,C,M>(c12,c3, metric); }
+                          const MetricHelper<M>& metric, double d2sq=0.)
+    { b.template process21<true,C,M>(c12,c3, metric, d2sq); }
     static void process111(BinnedCorr3<D,D,D,B>& b, const Cell<D,C>* c1, const Cell<D,C>* c2,
-                           const Cell<D,C>* c3, const MetricHelper<M>& metric)
-    { b.template process111<true,C,M>(c1,c2,c3, metric); }
+                           const Cell<D,C>* c3, const MetricHelper<M>& metric,
+                           double d1sq=0., double d2sq=0., double d3sq=0.)
+    { b.template process111<true,C,M>(c1,c2,c3, metric, d1sq, d2sq, d3sq); }
 };
 
+// The distance between two cells, when we don't need the adjusted sizes.
+template <int C, int M, int Da, int Db>
+inline double CellDistSq(const Cell<Da,C>* ca, const Cell<Db,C>* cb, const MetricHelper<M>& metric)
+{
+    double s=0.;
+    return metric.DistSq(ca->getData().getPos(), cb->getData().getPos(), s, s);
+}
+
+// The distances between all pairs (i<j) of the top-level cells of a field.  Each of these is
+// used for many of the triples (i,j,k) in an auto-correlation, so we only compute them once.
+// If there are too many cells for this to take a reasonable amount of memory, get returns 0,
+// which process111 takes to mean that the distance isn't known yet.
+template <int D, int C, int M>
+class TopCellDistSq
+{
+public:
+    TopCellDistSq(const std::vector<Cell<D,C>*>& cells, const MetricHelper<M>& metric) :
+        _n(cells.size())
+    {
+        // 2048 cells take 16 MB.
+        if (_n > 2048) return;
+        _dsq.resize(_n*(_n-1)/2);
+        for (long i=0;i<_n;++i)
+            for (long j=i+1;j<_n;++j)
+                _dsq[index(i,j)] = CellDistSq(cells[i], cells[j], metric);
+    }
+
+    // The distance from cell i to cell j.  Only valid for i < j.
+    double get(long i, long j) const { return _dsq.empty() ? 0. : _dsq[index(i,j)]; }
+
+private:
+    long index(long i, long j) const { return i*(2*_n-i-1)/2 + j-i-1; }
+
+    long _n;
+    std::vector<double> _dsq;
+};
+
+// A unit of work for the process functions: all the triangles whose first two cells are
+// in the top-level cells i and j, rather than all the triangles with their first cell in i.
+// For auto-correlations, j = -1 means the triangles with all three cells in i.  Doing all of
+// i in one item made the first few items much slower than the last ones, so the last
+// threads would run alone for a long time.
+//
+// cost is a rough estimate of how long the item takes, which we use to do the slowest ones
+// first.  ntri is the number of triangles of objects, which is what max_triples counts.
+struct Corr3Item
+{
+    Corr3Item(double c, double n, long i1, long j1) :
+        cost(c), ntri(n), i(i1), j(j1), domain(-1) {}
+    // Sort in order of decreasing cost.
+    bool operator<(const Corr3Item& rhs) const { return cost > rhs.cost; }
+
+    double cost;
+    double ntri;
+    long i;
+    long j;
+    int domain;  // The NUMA domain to run it in, or -1 for any.
+};
+
+// With NUMA domains, run each item in the domain of the larger of its first two cells.
+template <int D1, int D2, int C>
+void SetItemDomains(const Field<D1,C>& field1, const Field<D2,C>& field2,
+                    std::vector<Corr3Item>& items)
+{
+    if (GetNumaDomains() == 1) return;
+    const std::vector<Cell<D1,C>*>& cells1 = field1.getCells();
+    const std::vector<Cell<D2,C>*>& cells2 = field2.getCells();
+    for (size_t n=0; n<items.size(); ++n) {
+        Corr3Item& item = items[n];
+        if (item.j >= 0 && cells2[item.j]->getN() > cells1[item.i]->getN())
+            item.domain = field2.getCellDomain(item.j);
+        else
+            item.domain = field1.getCellDomain(item.i);
+    }
+}
+
+// The cost of an item with ntri triangles, whose first two cells have sizes adding up to
+// s1ps2 and are a distance sqrt(dsq) apart, and which checks nk cells for the third vertex.
+// All the sides of a triangle that gets binned are less than maxside, so only a fraction
+// of about (maxside/s1ps2)^2 of the triangles need to be done in any detail.  Checking each
+// third cell costs something even when it is too far away.
+inline double TripleCost(double ntri, double dsq, double s1ps2, double maxside, double nk)
+{
+    if (dsq >= SQR(maxside + s1ps2)) return nk;
+    return nk + (s1ps2 > maxside ? ntri * SQR(maxside / s1ps2) : ntri);
+}
+
+// Put the items in the order to do them, and skip any that were already done according to
+// the checkpoint file.
+inline void OrderItems(std::vector<Corr3Item>& items, const std::set<ItemId>& done,
+                       bool random)
+{
+    if (done.size() > 0) {
+        dbg<<"Resuming with "<<done.size()<<" items already done\n";
+        std::vector<Corr3Item> todo;
+        todo.reserve(items.size());
+        for (size_t n=0; n<items.size(); ++n)
+            if (!done.count(ItemId(items[n].i, items[n].j))) todo.push_back(items[n]);
+        items.swap(todo);
+    }
+    if (random) {
+        // In progressive mode, do the items in a random order, so the ones that get done
+        // before we run out of budget are a fair sample of all of them.
+        URandInt gen;
+        std::random_shuffle(items.begin(), items.end(), gen);
+    } else {
+        // Do the most expensive items first, so the cheap ones can fill in the gaps at the end.
+        std::stable_sort(items.begin(), items.end());
+    }
+}
+
 template <int D1, int D2, int D3, int B> template <int C, int M>
 void BinnedCorr3<D1,D2,D3,B>::process(const Field<D1,C>& field, bool dots)
 {
@@ -176,55 +370,139 @@ void BinnedCorr3<D1,D2,D3,B>::process(const Field<D1,C>& field, bool dots)
     xdbg<<"field has "<<n1<<" top level nodes\n";
     xdbg<<"zeta[0] = "<<_zeta<<std::endl;
     Assert(n1 > 0);
+    const std::vector<Cell<D1,C>*>& cells = field.getCells();
 
     MetricHelper<M> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
 
+    // The items are (i,-1) for process3(i), and (i,j) with i<j for process21(i,j),
+    // process21(j,i), and process111(i,j,k) for all k>j.
+    // S[j] = the number of objects in cells > j.
+    std::vector<double> S(n1, 0.);
+    for (long j=n1-2;j>=0;--j) S[j] = S[j+1] + cells[j+1]->getN();
+    const double maxside = 2. * _maxsep;
+    std::vector<Corr3Item> items;
+    items.reserve(n1*(n1+1)/2);
+    for (long i=0;i<n1;++i) {
+        const Cell<D1,C>& c1 = *cells[i];
+        const double ni = c1.getN();
+        const double s1 = c1.getSize();
+        const double ntri3 = ni*ni*ni/6.;
+        items.push_back(Corr3Item(TripleCost(ntri3, 0., 2.*s1, maxside, 0.), ntri3, i, -1));
+        for (long j=i+1;j<n1;++j) {
+            const Cell<D1,C>& c2 = *cells[j];
+            const double nj = c2.getN();
+            double ss1 = s1;
+            double ss2 = c2.getSize();
+            const double dsq = metric.DistSq(c1.getPos(), c2.getPos(), ss1, ss2);
+            const double ntri = 0.5*ni*nj*(ni+nj) + ni*nj*S[j];
+            const double cost = TripleCost(ntri, dsq, ss1+ss2, maxside, n1-j);
+            items.push_back(Corr3Item(cost, ntri, i, j));
+        }
+    }
+
+    SetItemDomains(field, field, items);
+    const TopCellDistSq<D1,C,M> dsq(cells, metric);
+
+    // If checkpointing, skip any items that were already done according to the file.
+    std::vector<double> key;
+    if (_checkpoint.active()) {
+        makeCheckpointKey(key, C, M);
+        key.push_back(items.size());
+        AddCellsToKey(cells, key);
+    }
+    Checkpointer<BinnedCorr3<D1,D2,D3,B> > ckpt(_checkpoint, *this, key);
+    OrderItems(items, ckpt.resume(*this), _budget.active());
+    const long nitems = items.size();
+    BudgetTracker tracker(_budget, nitems);
+    _stats.clear();
+    // Write about one dot per top-level cell, as we used to do.
+    const long dot_step = std::max(1L, nitems / n1);
+
+    // The results of each chunk are accumulated in the per-thread accumulators, even without
+    // OpenMP, so they can be added to the checkpoint separately from the output arrays.
+#ifdef _OPENMP
+    const int nthreads = omp_get_max_threads();
+#else
+    const int nthreads = 1;
+#endif
+    getThreadAccumulators(nthreads);
+
+    // Without a checkpoint file, this is a single chunk with all the items.
+    std::vector<char> finished(nitems, 0);
+    long end;
+    for (long start=0; start<nitems; start=end) {
+        end = start + ckpt.nextChunk(nitems-start, nthreads);
+        const double tchunk = WallTime();
+        if (_thread_accums[0]->_shared) _thread_accums[0]->clearData();
+        const int ndomains = GetNumaDomains();
+        DomainQueue* queue = ndomains > 1 ? new DomainQueue(ndomains, items, start, end) : 0;
 #ifdef _OPENMP
 #pragma omp parallel
-    {
-        // Give each thread their own copy of the data vector to fill in.
-        BinnedCorr3<D1,D2,D3,B> bc3(*this,false);
+        {
+            // Give each thread their own copy of the data vector to fill in.
+            BinnedCorr3<D1,D2,D3,B>& bc3 = *_thread_accums[omp_get_thread_num()];
 #else
-        BinnedCorr3<D1,D2,D3,B>& bc3 = *this;
+            BinnedCorr3<D1,D2,D3,B>& bc3 = *_thread_accums[0];
 #endif
+            bc3.clear();
+            TraversalStats& stats = bc3._stats;
+            stats[TraversalStats::NTHREADS] = 1.;
+            const int domain = CurrentThreadDomain(ndomains);
 
 #ifdef _OPENMP
 #pragma omp for schedule(dynamic)
 #endif
-        for (long i=0;i<n1;++i) {
-            const Cell<D1,C>* c1 = field.getCells()[i];
+            for (long m=start;m<end;++m) {
+                const long n = queue ? queue->next(domain) : m;
+                const Corr3Item& item = items[n];
+                if (!tracker.start(item.ntri)) continue;
+                if (dots && m % dot_step == 0) {
 #ifdef _OPENMP
 #pragma omp critical
 #endif
-            {
-                if (dots) std::cout<<'.'<<std::flush;
-#ifdef _OPENMP
-                dbg<<omp_get_thread_num()<<" "<<i<<std::endl;
-#endif
-                xdbg<<"field = \n";
-#ifdef DEBUGLOGGING
-                if (verbose_level >= 2) c1->WriteTree(get_dbgout());
-#endif
-            }
-            ProcessHelper<D1,D2,D3,B,C,M>::process3(bc3,c1, metric);
-            for (long j=i+1;j<n1;++j) {
-                const Cell<D1,C>* c2 = field.getCells()[j];
-                ProcessHelper<D1,D2,D3,B,C,M>::process21(bc3,c1,c2, metric);
-                ProcessHelper<D1,D2,D3,B,C,M>::process21(bc3,c2,c1, metric);
-                for (long k=j+1;k<n1;++k) {
-                    const Cell<D1,C>* c3 = field.getCells()[k];
-                    ProcessHelper<D1,D2,D3,B,C,M>::process111(bc3,c1,c2,c3, metric);
+                    std::cout<<'.'<<std::flush;
+                }
+                xdbg<<"item "<<n<<": "<<item.i<<" "<<item.j<<" "<<item.cost<<std::endl;
+                TraceScope trace("process3 item", n);
+                const double t0 = WallTime();
+                const Cell<D1,C>* c1 = cells[item.i];
+                if (item.j < 0) {
+                    ProcessHelper<D1,D2,D3,B,C,M>::process3(bc3,c1, metric);
+                } else {
+                    const Cell<D1,C>* c2 = cells[item.j];
+                    const double d3sq = dsq.get(item.i, item.j);
+                    ProcessHelper<D1,D2,D3,B,C,M>::process21(bc3,c1,c2, metric, d3sq);
+                    ProcessHelper<D1,D2,D3,B,C,M>::process21(bc3,c2,c1, metric);
+                    for (long k=item.j+1;k<n1;++k) {
+                        const Cell<D1,C>* c3 = cells[k];
+                        ProcessHelper<D1,D2,D3,B,C,M>::process111(
+                            bc3,c1,c2,c3, metric, dsq.get(item.j,k), dsq.get(item.i,k), d3sq);
+                    }
                 }
+                stats.finishItem(WallTime() - t0);
+                finished[n] = 1;
             }
-        }
+            bc3.flushTriangles();
+            stats[TraversalStats::MAX_THREAD_TIME] = stats[TraversalStats::ITEM_TIME];
 #ifdef _OPENMP
-        // Accumulate the results
-#pragma omp critical
-        {
-            *this += bc3;
+            // Accumulate the results
+            TreeReduce(_thread_accums);
         }
-    }
 #endif
+        delete queue;
+        std::vector<ItemId> ids;
+        long nfinished = 0;
+        for (long n=start; n<end; ++n) {
+            if (!finished[n]) continue;
+            ++nfinished;
+            if (ckpt.active()) ids.push_back(ItemId(items[n].i, items[n].j));
+        }
+        ckpt.add(*_thread_accums[0], ids, nfinished, WallTime() - tchunk);
+        *this += *_thread_accums[0];
+    }
+    ckpt.finish();
+    if (_stats_out) _stats.addTo(_stats_out);
+    tracker.finish();
     if (dots) std::cout<<std::endl;
     xdbg<<"zeta[0] -> "<<_zeta<<std::endl;
 }
@@ -249,6 +527,61 @@ void BinnedCorr3<D1,D2,D3,B>::process(const Field<D1,C>& field1, const Field<D2,
 
     MetricHelper<M> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
 
+    // All three sides of any triangle that gets binned are less than 2 maxsep, so when the
+    // metric allows it, use grids of the cells in fields 2 and 3 to find the ones that are
+    // close enough to c1 (and each other) to matter.
+    const bool use_grid = UseTopCellGrid<M,C>::value;
+    const double maxside = 2. * _maxsep;
+    std::vector<std::vector<long> > near2(use_grid ? n1 : 1), near3(use_grid ? n1 : 1);
+    if (use_grid) {
+        TopCellGrid<D2,C> grid2(field2.getCells(), maxside);
+        TopCellGrid<D3,C> grid3(field3.getCells(), maxside);
+        for (long i=0;i<n1;++i) {
+            const Cell<D1,C>* c1 = field1.getCells()[i];
+            grid2.getNear(c1->getPos(), maxside + c1->getSize(), 1., near2[i]);
+            grid3.getNear(c1->getPos(), maxside + c1->getSize(), 1., near3[i]);
+        }
+    } else {
+        near2[0].resize(n2);
+        for (long j=0;j<n2;++j) near2[0][j] = j;
+        near3[0].resize(n3);
+        for (long k=0;k<n3;++k) near3[0][k] = k;
+    }
+
+    // The items are (i,j) for process111(i,j,k) for all the k in field3.
+    const double n3tot = field3.getNObj();
+    std::vector<Corr3Item> items;
+    for (long i=0;i<n1;++i) {
+        const Cell<D1,C>& c1 = *field1.getCells()[i];
+        const std::vector<long>& ind2 = near2[use_grid ? i : 0];
+        const double nk = near3[use_grid ? i : 0].size();
+        for (size_t jj=0;jj<ind2.size();++jj) {
+            const Cell<D2,C>& c2 = *field2.getCells()[ind2[jj]];
+            double s1 = c1.getSize();
+            double s2 = c2.getSize();
+            const double dsq = metric.DistSq(c1.getPos(), c2.getPos(), s1, s2);
+            const double ntri = double(c1.getN()) * double(c2.getN()) * n3tot;
+            const double cost = TripleCost(ntri, dsq, s1+s2, maxside, nk);
+            items.push_back(Corr3Item(cost, ntri, i, ind2[jj]));
+        }
+    }
+    SetItemDomains(field1, field2, items);
+
+    std::vector<double> key;
+    if (_checkpoint.active()) {
+        makeCheckpointKey(key, C, M);
+        key.push_back(items.size());
+        AddCellsToKey(field1.getCells(), key);
+        AddCellsToKey(field2.getCells(), key);
+        AddCellsToKey(field3.getCells(), key);
+    }
+    Checkpointer<BinnedCorr3<D1,D2,D3,B> > ckpt(_checkpoint, *this, key);
+    OrderItems(items, ckpt.resume(*this), _budget.active());
+    const long nitems = items.size();
+    BudgetTracker tracker(_budget, nitems);
+    _stats.clear();
+    const long dot_step = std::max(1L, nitems / n1);
+
 #ifdef DEBUGLOGGING
     if (verbose_level >= 2) {
         xdbg<<"field1: \n";
@@ -272,45 +605,84 @@ void BinnedCorr3<D1,D2,D3,B>::process(const Field<D1,C>& field1, const Field<D2,
     }
 #endif
 
+#ifdef _OPENMP
+    const int nthreads = omp_get_max_threads();
+#else
+    const int nthreads = 1;
+#endif
+    getThreadAccumulators(nthreads);
+
+    std::vector<char> finished(nitems, 0);
+    long end;
+    for (long start=0; start<nitems; start=end) {
+        end = start + ckpt.nextChunk(nitems-start, nthreads);
+        const double tchunk = WallTime();
+        if (_thread_accums[0]->_shared) _thread_accums[0]->clearData();
+        const int ndomains = GetNumaDomains();
+        DomainQueue* queue = ndomains > 1 ? new DomainQueue(ndomains, items, start, end) : 0;
 #ifdef _OPENMP
 #pragma omp parallel
-    {
-        // Give each thread their own copy of the data vector to fill in.
-        BinnedCorr3<D1,D2,D3,B> bc3(*this,false);
+        {
+            // Give each thread their own copy of the data vector to fill in.
+            BinnedCorr3<D1,D2,D3,B>& bc3 = *_thread_accums[omp_get_thread_num()];
 #else
-        BinnedCorr3<D1,D2,D3,B>& bc3 = *this;
+            BinnedCorr3<D1,D2,D3,B>& bc3 = *_thread_accums[0];
 #endif
+            bc3.clear();
+            TraversalStats& stats = bc3._stats;
+            stats[TraversalStats::NTHREADS] = 1.;
+            const int domain = CurrentThreadDomain(ndomains);
 
 #ifdef _OPENMP
 #pragma omp for schedule(dynamic)
 #endif
-        for (long i=0;i<n1;++i) {
+            for (long m=start;m<end;++m) {
+                const long n = queue ? queue->next(domain) : m;
+                const Corr3Item& item = items[n];
+                if (!tracker.start(item.ntri)) continue;
+                if (dots && m % dot_step == 0) {
 #ifdef _OPENMP
 #pragma omp critical
 #endif
-            {
-                if (dots) std::cout<<'.'<<std::flush;
-#ifdef _OPENMP
-                dbg<<omp_get_thread_num()<<" "<<i<<std::endl;
-#endif
-            }
-            const Cell<D1,C>* c1 = field1.getCells()[i];
-            for (long j=0;j<n2;++j) {
-                const Cell<D2,C>* c2 = field2.getCells()[j];
-                for (long k=0;k<n3;++k) {
-                    const Cell<D3,C>* c3 = field3.getCells()[k];
-                    bc3.template process111<false,C,M>(c1, c2, c3, metric);
+                    std::cout<<'.'<<std::flush;
                 }
+                xdbg<<"item "<<n<<": "<<item.i<<" "<<item.j<<" "<<item.cost<<std::endl;
+                TraceScope trace("process3 item", n);
+                const double t0 = WallTime();
+                const Cell<D1,C>* c1 = field1.getCells()[item.i];
+                const Cell<D2,C>* c2 = field2.getCells()[item.j];
+                const std::vector<long>& ind3 = near3[use_grid ? item.i : 0];
+                const double d3sq = CellDistSq(c1, c2, metric);
+                for (size_t kk=0;kk<ind3.size();++kk) {
+                    const Cell<D3,C>* c3 = field3.getCells()[ind3[kk]];
+                    if (use_grid && GridDistSq(c2->getPos(), c3->getPos()) >=
+                        SQR(maxside + c2->getSize() + c3->getSize())) continue;
+                    bc3.template process111<false,C,M>(c1, c2, c3, metric, 0., 0., d3sq);
+                }
+                stats.finishItem(WallTime() - t0);
+                finished[n] = 1;
             }
-        }
+            bc3.flushTriangles();
+            stats[TraversalStats::MAX_THREAD_TIME] = stats[TraversalStats::ITEM_TIME];
 #ifdef _OPENMP
-        // Accumulate the results
-#pragma omp critical
-        {
-            *this += bc3;
+            // Accumulate the results
+            TreeReduce(_thread_accums);
         }
-    }
 #endif
+        delete queue;
+        std::vector<ItemId> ids;
+        long nfinished = 0;
+        for (long n=start; n<end; ++n) {
+            if (!finished[n]) continue;
+            ++nfinished;
+            if (ckpt.active()) ids.push_back(ItemId(items[n].i, items[n].j));
+        }
+        ckpt.add(*_thread_accums[0], ids, nfinished, WallTime() - tchunk);
+        *this += *_thread_accums[0];
+    }
+    ckpt.finish();
+    if (_stats_out) _stats.addTo(_stats_out);
+    tracker.finish();
     if (dots) std::cout<<std::endl;
 }
 
@@ -323,6 +695,7 @@ void BinnedCorr3<D1,D2,D3,B>::process3(const Cell<D1,C>* c123, const MetricHelpe
         xdbg<<"    w == 0.  return\n";
         return;
     }
+    ++_stats[TraversalStats::NODES];
     if (c123->getSize() < _halfminsep) {
         xdbg<<"    size < halfminsep.  return\n";
         return;
@@ -338,7 +711,7 @@ void BinnedCorr3<D1,D2,D3,B>::process3(const Cell<D1,C>* c123, const MetricHelpe
 
 template <int D1, int D2, int D3, int B> template <bool sort, int C, int M>
 void BinnedCorr3<D1,D2,D3,B>::process21(const Cell<D1,C>* c12, const Cell<D3,C>* c3,
-                                        const MetricHelper<M>& metric)
+                                        const MetricHelper<M>& metric, double d2sq)
 {
     // Does all triangles with two points in c12 and 3rd point in c3
     // This version is allowed to swap the positions of points 1,2,3
@@ -354,6 +727,7 @@ void BinnedCorr3<D1,D2,D3,B>::process21(const Cell<D1,C>* c12, const Cell<D3,C>*
         xdbg<<"    w3 == 0.  return\n";
         return;
     }
+    ++_stats[TraversalStats::NODES];
     if (c12->getSize() == 0.) {
         xdbg<<"    size12 == 0.  return\n";
         return;
@@ -365,7 +739,8 @@ void BinnedCorr3<D1,D2,D3,B>::process21(const Cell<D1,C>* c12, const Cell<D3,C>*
 
     double s12 = c12->getSize();
     double s3 = c3->getSize();
-    double d2sq = metric.DistSq(c12->getData().getPos(), c3->getData().getPos(), s12, s3);
+    if (d2sq == 0. || !DistSqKeepsSizes<M,C>::value)
+        d2sq = metric.DistSq(c12->getData().getPos(), c3->getData().getPos(), s12, s3);
     double s12ps3 = s12 + s3;
 
     // If all possible triangles will have d2 < minsep, then abort the recursion here.
@@ -373,6 +748,7 @@ void BinnedCorr3<D1,D2,D3,B>::process21(const Cell<D1,C>* c12, const Cell<D3,C>*
     // Since we aren't sorting, we only need to check the actual d2 value.
     if (d2sq < _minsepsq && s12ps3 < _minsep && d2sq < SQR(_minsep - s12ps3)) {
         xdbg<<"    d2 cannot be as large as minsep\n";
+        ++_stats[TraversalStats::SMALL_EXIT];
         return;
     }
 
@@ -380,6 +756,7 @@ void BinnedCorr3<D1,D2,D3,B>::process21(const Cell<D1,C>* c12, const Cell<D3,C>*
     // i.e. if  d2 - s1 - s3 >= maxsep
     if (d2sq >= _maxsepsq && d2sq >= SQR(_maxsep + s12ps3)) {
         xdbg<<"    d2 cannot be as small as maxsep\n";
+        ++_stats[TraversalStats::LARGE_EXIT];
         return;
     }
 
@@ -390,14 +767,18 @@ void BinnedCorr3<D1,D2,D3,B>::process21(const Cell<D1,C>* c12, const Cell<D3,C>*
     // minu * d2 > 2s12 + minu * (s12 + s3)
     if (d2sq > SQR(s12 + s3) && _minusq * d2sq > SQR(2.*s12 + _minu * (s12 + s3))) {
         xdbg<<"    u cannot be as large as minu\n";
+        ++_stats[TraversalStats::RANGE_EXIT];
         return;
     }
 
     Assert(c12->getLeft());
     Assert(c12->getRight());
-    process21<true,C,M>(c12->getLeft(), c3, metric);
-    process21<true,C,M>(c12->getRight(), c3, metric);
-    process111<true,C,M>(c12->getLeft(), c12->getRight(), c3, metric);
+    // Each of the children's distances to c3 is needed twice, so only calculate them once.
+    const double dlsq = CellDistSq(c12->getLeft(), c3, metric);
+    const double drsq = CellDistSq(c12->getRight(), c3, metric);
+    process21<true,C,M>(c12->getLeft(), c3, metric, dlsq);
+    process21<true,C,M>(c12->getRight(), c3, metric, drsq);
+    process111<true,C,M>(c12->getLeft(), c12->getRight(), c3, metric, drsq, dlsq);
 }
 
 // A helper to calculate the distances and possibly sort the points.
@@ -546,6 +927,47 @@ struct SortHelper
     }
 };
 
+// The u,v ranges also limit the lengths of the sides.  The smallest side of a triangle
+// with u >= minu and d2 >= minsep is at least minu * minsep, and it is less than
+// maxu * maxsep.  Since d1 = d2 + |v| d3, the largest side is less than
+// maxsep * (1 + maxu * maxv).  We don't know which side of the triangles in c1,c2,c3 will end
+// up being which, but each side is at most as large as the largest side and at least as
+// large as the smallest.  So these checks are valid whether or not the sides are sorted.
+inline bool SideRangeStop(double d1sq, double d2sq, double d3sq,
+                          double s1, double s2, double s3,
+                          double maxsep, double mind3, double maxd3, double maxd1)
+{
+    const double s23 = s2+s3;
+    const double s13 = s1+s3;
+    const double s12 = s1+s2;
+
+    // Stop if any side will always be shorter than mind3.
+    if (mind3 > 0. && (
+            (s23 < mind3 && d1sq < SQR(mind3 - s23)) ||
+            (s13 < mind3 && d2sq < SQR(mind3 - s13)) ||
+            (s12 < mind3 && d3sq < SQR(mind3 - s12)))) {
+        xdbg<<"smallest side cannot be as large as minu * minsep\n";
+        return true;
+    }
+
+    // Stop if all sides will always be at least maxd3.
+    // (If maxu = 1, this is implied by the check of d2 against maxsep.)
+    if (maxd3 < maxsep &&
+        d1sq >= SQR(maxd3 + s23) && d2sq >= SQR(maxd3 + s13) && d3sq >= SQR(maxd3 + s12)) {
+        xdbg<<"smallest side cannot be as small as maxu * maxsep\n";
+        return true;
+    }
+
+    // Stop if any side will always be at least maxd1.
+    // (If maxu * maxv = 1, this is implied by the triangle inequality.)
+    if (maxd1 < 2.*maxsep &&
+        (d1sq >= SQR(maxd1 + s23) || d2sq >= SQR(maxd1 + s13) || d3sq >= SQR(maxd1 + s12))) {
+        xdbg<<"largest side cannot be as small as maxsep * (1 + maxu * maxv)\n";
+        return true;
+    }
+    return false;
+}
+
 // This one has sort = true, so the points get sorted, and always returns true.
 template <int D, int C, int M>
 struct SortHelper<D,D,D,true,C,M>
@@ -723,6 +1145,7 @@ void BinnedCorr3<D1,D2,D3,B>::process111(
         xdbg<<"    w3 == 0.  return\n";
         return;
     }
+    ++_stats[TraversalStats::NODES];
 
     // Calculate the distances if they aren't known yet, and sort so that d3 < d2 < d1
     SortHelper<D1,D2,D3,sort,C,M>::sort3(c1,c2,c3,metric,d1sq,d2sq,d3sq);
@@ -744,7 +1167,9 @@ void BinnedCorr3<D1,D2,D3,B>::process111(
     if (SortHelper<D1,D2,D3,sort,C,M>::stop111(d1sq,d2sq,d3sq,d2,s1,s2,s3,
                                                _minsep,_minsepsq,_maxsep,_maxsepsq,
                                                _minu,_minusq,_maxu,_maxusq,
-                                               _minv,_minvsq,_maxv,_maxvsq)) {
+                                               _minv,_minvsq,_maxv,_maxvsq) ||
+        SideRangeStop(d1sq,d2sq,d3sq,s1,s2,s3,_maxsep,_mind3,_maxd3,_maxd1)) {
+        ++_stats[TraversalStats::RANGE_EXIT];
         return;
     }
 
@@ -889,6 +1314,10 @@ void BinnedCorr3<D1,D2,D3,B>::process111(
         Assert(split1 == false || s1 > 0);
         Assert(split2 == false || s2 > 0);
         Assert(split3 == false || s3 > 0);
+        const int nsplit = int(split1) + int(split2) + int(split3);
+        ++_stats[nsplit > 1 ? TraversalStats::SPLIT_MULTI :
+                 split1 ? TraversalStats::SPLIT1 :
+                 split2 ? TraversalStats::SPLIT2 : TraversalStats::SPLIT3];
 
         if (split3) {
             if (split2) {
@@ -900,24 +1329,36 @@ void BinnedCorr3<D1,D2,D3,B>::process111(
                     Assert(c2->getRight());
                     Assert(c3->getLeft());
                     Assert(c3->getRight());
-                    process111<sort,C,M>(c1->getLeft(),c2->getLeft(),c3->getLeft(),metric);
-                    process111<sort,C,M>(c1->getLeft(),c2->getLeft(),c3->getRight(),metric);
-                    process111<sort,C,M>(c1->getLeft(),c2->getRight(),c3->getLeft(),metric);
-                    process111<sort,C,M>(c1->getLeft(),c2->getRight(),c3->getRight(),metric);
-                    process111<sort,C,M>(c1->getRight(),c2->getLeft(),c3->getLeft(),metric);
-                    process111<sort,C,M>(c1->getRight(),c2->getLeft(),c3->getRight(),metric);
-                    process111<sort,C,M>(c1->getRight(),c2->getRight(),c3->getLeft(),metric);
-                    process111<sort,C,M>(c1->getRight(),c2->getRight(),c3->getRight(),metric);
+                    // Each distance between two of the children is used for two of the
+                    // eight triangles, so calculate them all first.
+                    const Cell<D1,C>* c1s[2] = { c1->getLeft(), c1->getRight() };
+                    const Cell<D2,C>* c2s[2] = { c2->getLeft(), c2->getRight() };
+                    const Cell<D3,C>* c3s[2] = { c3->getLeft(), c3->getRight() };
+                    double d1s[2][2], d2s[2][2], d3s[2][2];
+                    for (int i=0;i<2;++i) for (int j=0;j<2;++j) {
+                        d1s[i][j] = CellDistSq(c2s[i], c3s[j], metric);
+                        d2s[i][j] = CellDistSq(c1s[i], c3s[j], metric);
+                        d3s[i][j] = CellDistSq(c1s[i], c2s[j], metric);
+                    }
+                    for (int i=0;i<2;++i) for (int j=0;j<2;++j) for (int k=0;k<2;++k)
+                        process111<sort,C,M>(c1s[i],c2s[j],c3s[k],metric,
+                                             d1s[j][k],d2s[i][k],d3s[i][j]);
                 } else {
                     // split 2,3
                     Assert(c2->getLeft());
                     Assert(c2->getRight());
                     Assert(c3->getLeft());
                     Assert(c3->getRight());
-                    process111<sort,C,M>(c1,c2->getLeft(),c3->getLeft(),metric);
-                    process111<sort,C,M>(c1,c2->getLeft(),c3->getRight(),metric);
-                    process111<sort,C,M>(c1,c2->getRight(),c3->getLeft(),metric);
-                    process111<sort,C,M>(c1,c2->getRight(),c3->getRight(),metric);
+                    const Cell<D2,C>* c2s[2] = { c2->getLeft(), c2->getRight() };
+                    const Cell<D3,C>* c3s[2] = { c3->getLeft(), c3->getRight() };
+                    double d1s[2][2], d2s[2], d3s[2];
+                    for (int i=0;i<2;++i) {
+                        for (int j=0;j<2;++j) d1s[i][j] = CellDistSq(c2s[i], c3s[j], metric);
+                        d2s[i] = CellDistSq(c1, c3s[i], metric);
+                        d3s[i] = CellDistSq(c1, c2s[i], metric);
+                    }
+                    for (int j=0;j<2;++j) for (int k=0;k<2;++k)
+                        process111<sort,C,M>(c1,c2s[j],c3s[k],metric,d1s[j][k],d2s[k],d3s[j]);
                 }
             } else {
                 if (split1) {
@@ -926,10 +1367,16 @@ void BinnedCorr3<D1,D2,D3,B>::process111(
                     Assert(c1->getRight());
                     Assert(c3->getLeft());
                     Assert(c3->getRight());
-                    process111<sort,C,M>(c1->getLeft(),c2,c3->getLeft(),metric);
-                    process111<sort,C,M>(c1->getLeft(),c2,c3->getRight(),metric);
-                    process111<sort,C,M>(c1->getRight(),c2,c3->getLeft(),metric);
-                    process111<sort,C,M>(c1->getRight(),c2,c3->getRight(),metric);
+                    const Cell<D1,C>* c1s[2] = { c1->getLeft(), c1->getRight() };
+                    const Cell<D3,C>* c3s[2] = { c3->getLeft(), c3->getRight() };
+                    double d1s[2], d2s[2][2], d3s[2];
+                    for (int i=0;i<2;++i) {
+                        d1s[i] = CellDistSq(c2, c3s[i], metric);
+                        for (int j=0;j<2;++j) d2s[i][j] = CellDistSq(c1s[i], c3s[j], metric);
+                        d3s[i] = CellDistSq(c1s[i], c2, metric);
+                    }
+                    for (int i=0;i<2;++i) for (int k=0;k<2;++k)
+                        process111<sort,C,M>(c1s[i],c2,c3s[k],metric,d1s[k],d2s[i][k],d3s[i]);
                 } else {
                     // split 3 only
                     Assert(c3->getLeft());
@@ -946,10 +1393,16 @@ void BinnedCorr3<D1,D2,D3,B>::process111(
                     Assert(c1->getRight());
                     Assert(c2->getLeft());
                     Assert(c2->getRight());
-                    process111<sort,C,M>(c1->getLeft(),c2->getLeft(),c3,metric);
-                    process111<sort,C,M>(c1->getLeft(),c2->getRight(),c3,metric);
-                    process111<sort,C,M>(c1->getRight(),c2->getLeft(),c3,metric);
-                    process111<sort,C,M>(c1->getRight(),c2->getRight(),c3,metric);
+                    const Cell<D1,C>* c1s[2] = { c1->getLeft(), c1->getRight() };
+                    const Cell<D2,C>* c2s[2] = { c2->getLeft(), c2->getRight() };
+                    double d1s[2], d2s[2], d3s[2][2];
+                    for (int i=0;i<2;++i) {
+                        d1s[i] = CellDistSq(c2s[i], c3, metric);
+                        d2s[i] = CellDistSq(c1s[i], c3, metric);
+                        for (int j=0;j<2;++j) d3s[i][j] = CellDistSq(c1s[i], c2s[j], metric);
+                    }
+                    for (int i=0;i<2;++i) for (int j=0;j<2;++j)
+                        process111<sort,C,M>(c1s[i],c2s[j],c3,metric,d1s[j],d2s[i],d3s[i][j]);
                 } else {
                     // split 2 only
                     Assert(c2->getLeft());
@@ -972,19 +1425,23 @@ void BinnedCorr3<D1,D2,D3,B>::process111(
         Assert(u > 0.);
         Assert(v >= 0.);  // v can potentially == 0.
         // No splits required.
+        ++_stats[TraversalStats::SINGLE_BIN];
         // Now we can check to make sure the final d2, u, v are in the right ranges.
         if (d2 < _minsep || d2 >= _maxsep) {
             xdbg<<"d2 not in minsep .. maxsep\n";
+            ++_stats[TraversalStats::RANGE_EXIT];
             return;
         }
 
         if (u < _minu || u >= _maxu) {
             xdbg<<"u not in minu .. maxu\n";
+            ++_stats[TraversalStats::RANGE_EXIT];
             return;
         }
 
         if (v < _minv || v >= _maxv) {
             xdbg<<"v not in minv .. maxv\n";
+            ++_stats[TraversalStats::RANGE_EXIT];
             return;
         }
 
@@ -1045,86 +1502,217 @@ void BinnedCorr3<D1,D2,D3,B>::process111(
         if (index < 0 || index >= _ntot) {
             return;
         }
+        ++_stats[TraversalStats::DIRECT];
         directProcess111<C,M>(*c1,*c2,*c3,d1,d2,d3,logr,u,v,index);
     }
 }
 
-// We also set up a helper class for doing the direct processing
+// When buffering the triangles, we need to store the shears for each one.  For Flat
+// coordinates, the projection is simple enough to do in the vectorized loop in ComputeZeta,
+// so we just store the shears and the vectors to the centroid.  For the others, do the
+// projection here.
+template <int C>
+struct ShearHelper3
+{
+    static void StoreShears(const Cell<GData,C>& c1, const Cell<GData,C>& c2,
+                            const Cell<GData,C>& c3, TriangleBuffer& buf, int i)
+    {
+        std::complex<double> g1, g2, g3;
+        ProjectHelper<C>::ProjectShears(c1,c2,c3,g1,g2,g3);
+        buf.v1r[i] = real(g1);
+        buf.v1i[i] = imag(g1);
+        buf.v2r[i] = real(g2);
+        buf.v2i[i] = imag(g2);
+        buf.v3r[i] = real(g3);
+        buf.v3i[i] = imag(g3);
+        buf.dx1[i] = buf.dx2[i] = buf.dx3[i] = 1.;
+        buf.dy1[i] = buf.dy2[i] = buf.dy3[i] = 0.;
+    }
+};
+
+template <>
+struct ShearHelper3<Flat>
+{
+    static void StoreShears(const Cell<GData,Flat>& c1, const Cell<GData,Flat>& c2,
+                            const Cell<GData,Flat>& c3, TriangleBuffer& buf, int i)
+    {
+        const Position<Flat>& p1 = c1.getData().getPos();
+        const Position<Flat>& p2 = c2.getData().getPos();
+        const Position<Flat>& p3 = c3.getData().getPos();
+        const Position<Flat> cen = (p1 + p2 + p3)/3.;
+        const std::complex<double> g1 = c1.getData().getWG();
+        const std::complex<double> g2 = c2.getData().getWG();
+        const std::complex<double> g3 = c3.getData().getWG();
+        buf.v1r[i] = real(g1);
+        buf.v1i[i] = imag(g1);
+        buf.v2r[i] = real(g2);
+        buf.v2i[i] = imag(g2);
+        buf.v3r[i] = real(g3);
+        buf.v3i[i] = imag(g3);
+        buf.dx1[i] = cen.getX() - p1.getX();
+        buf.dy1[i] = cen.getY() - p1.getY();
+        buf.dx2[i] = cen.getX() - p2.getX();
+        buf.dy2[i] = cen.getY() - p2.getY();
+        buf.dx3[i] = cen.getX() - p3.getX();
+        buf.dy3[i] = cen.getY() - p3.getY();
+    }
+};
+
+// Project the shear (gr,gi) to the line with direction (dx,dy).
+// i.e. g *= conj(cr*cr)/norm(cr), where cr = dx + i dy.
+// If (dx,dy) = (1,0), this leaves the shear unchanged.
+inline void ProjectShear3(double dx, double dy, double& gr, double& gi)
+{
+    const double dxsq = dx*dx;
+    const double dysq = dy*dy;
+    const double norm = dxsq + dysq;
+    const double er = (dxsq - dysq) / norm;
+    const double ei = -2. * dx * dy / norm;
+    const double tmp = gr * er - gi * ei;
+    gi = gr * ei + gi * er;
+    gr = tmp;
+}
+
+// Add v to x.  If other threads may be adding to x at the same time (cf. shareThreadData),
+// this needs to be an atomic update.
+template <bool atomic>
+struct BinAdder
+{
+    static void add(double& x, double v) { x += v; }
+};
+
+template <>
+struct BinAdder<true>
+{
+    static void add(double& x, double v)
+    {
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+        x += v;
+    }
+};
+
+// We also set up a helper class for doing the direct processing.
+// StoreValues saves what we need for each triangle in the TriangleBuffer, and ComputeZeta
+// calculates the zeta values for all the triangles in the buffer, which AddZeta then adds
+// to the bins.
 template <int D1, int D2, int D3>
 struct DirectHelper;
 
 template <>
 struct DirectHelper<NData,NData,NData>
 {
-    template <int C, int M>
-    static void ProcessZeta(
-        const Cell<NData,C>& , const Cell<NData,C>& , const Cell<NData,C>&,
-        const double , const double , const double ,
-        ZetaData<NData,NData,NData>& , int )
+    template <int C>
+    static void StoreValues(const Cell<NData,C>& , const Cell<NData,C>& , const Cell<NData,C>& ,
+                            TriangleBuffer& , int )
     {}
+
+    static void ComputeZeta(TriangleBuffer& ) {}
+
+    template <bool atomic>
+    static void AddZeta(const TriangleBuffer& , ZetaData<NData,NData,NData>& ) {}
 };
 
 template <>
 struct DirectHelper<KData,KData,KData>
 {
-    template <int C, int M>
-    static void ProcessZeta(
-        const Cell<KData,C>& c1, const Cell<KData,C>& c2, const Cell<KData,C>& c3,
-        const double , const double , const double ,
-        ZetaData<KData,KData,KData>& zeta, int index)
+    template <int C>
+    static void StoreValues(const Cell<KData,C>& c1, const Cell<KData,C>& c2,
+                            const Cell<KData,C>& c3, TriangleBuffer& buf, int i)
     {
-        zeta.zeta[index] += c1.getData().getWK() * c2.getData().getWK() * c3.getData().getWK();
+        buf.v1r[i] = c1.getData().getWK();
+        buf.v2r[i] = c2.getData().getWK();
+        buf.v3r[i] = c3.getData().getWK();
+    }
+
+    static void ComputeZeta(TriangleBuffer& buf)
+    {
+        const int n = buf.n;
+        for (int i=0; i<n; ++i) buf.zeta[0][i] = buf.v1r[i] * buf.v2r[i] * buf.v3r[i];
+    }
+
+    template <bool atomic>
+    static void AddZeta(const TriangleBuffer& buf, ZetaData<KData,KData,KData>& zeta)
+    {
+        const int n = buf.n;
+        for (int i=0; i<n; ++i) BinAdder<atomic>::add(zeta.zeta[buf.index[i]], buf.zeta[0][i]);
     }
 };
 
 template <>
 struct DirectHelper<GData,GData,GData>
 {
-    template <int C, int M>
-    static void ProcessZeta(
-        const Cell<GData,C>& c1, const Cell<GData,C>& c2, const Cell<GData,C>& c3,
-        const double d1, const double d2, const double d3,
-        ZetaData<GData,GData,GData>& zeta, int index)
+    template <int C>
+    static void StoreValues(const Cell<GData,C>& c1, const Cell<GData,C>& c2,
+                            const Cell<GData,C>& c3, TriangleBuffer& buf, int i)
+    { ShearHelper3<C>::StoreShears(c1,c2,c3,buf,i); }
+
+    static void ComputeZeta(TriangleBuffer& buf)
     {
-        std::complex<double> g1, g2, g3;
-        ProjectHelper<C>::ProjectShears(c1,c2,c3,g1,g2,g3);
+        const int n = buf.n;
+        for (int i=0; i<n; ++i) {
+            double g1r = buf.v1r[i], g1i = buf.v1i[i];
+            double g2r = buf.v2r[i], g2i = buf.v2i[i];
+            double g3r = buf.v3r[i], g3i = buf.v3i[i];
+            ProjectShear3(buf.dx1[i], buf.dy1[i], g1r, g1i);
+            ProjectShear3(buf.dx2[i], buf.dy2[i], g2r, g2i);
+            ProjectShear3(buf.dx3[i], buf.dy3[i], g3r, g3i);
+
+            //std::complex<double> gam0 = g1 * g2 * g3;
+            //std::complex<double> gam1 = std::conj(g1) * g2 * g3;
+            //std::complex<double> gam2 = g1 * std::conj(g2) * g3;
+            //std::complex<double> gam3 = g1 * g2 * std::conj(g3);
+
+            // The complex products g1 g2 and g1 g2* share most of the calculations,
+            // so faster to do this manually.
+            // The above uses 32 multiplies and 16 adds.
+            // We can do this with just 12 multiplies and 12 adds.
+            const double g1rg2r = g1r * g2r;
+            const double g1rg2i = g1r * g2i;
+            const double g1ig2r = g1i * g2r;
+            const double g1ig2i = g1i * g2i;
+
+            const double g1g2r = g1rg2r - g1ig2i;
+            const double g1g2i = g1rg2i + g1ig2r;
+            const double g1cg2r = g1rg2r + g1ig2i;
+            const double g1cg2i = g1rg2i - g1ig2r;
+
+            const double g1g2rg3r = g1g2r * g3r;
+            const double g1g2rg3i = g1g2r * g3i;
+            const double g1g2ig3r = g1g2i * g3r;
+            const double g1g2ig3i = g1g2i * g3i;
+            const double g1cg2rg3r = g1cg2r * g3r;
+            const double g1cg2rg3i = g1cg2r * g3i;
+            const double g1cg2ig3r = g1cg2i * g3r;
+            const double g1cg2ig3i = g1cg2i * g3i;
+
+            buf.zeta[0][i] = g1g2rg3r - g1g2ig3i;
+            buf.zeta[1][i] = g1g2rg3i + g1g2ig3r;
+            buf.zeta[2][i] = g1cg2rg3r - g1cg2ig3i;
+            buf.zeta[3][i] = g1cg2rg3i + g1cg2ig3r;
+            buf.zeta[4][i] = g1cg2rg3r + g1cg2ig3i;
+            buf.zeta[5][i] = g1cg2rg3i - g1cg2ig3r;
+            buf.zeta[6][i] = g1g2rg3r + g1g2ig3i;
+            buf.zeta[7][i] = -g1g2rg3i + g1g2ig3r;
+        }
+    }
 
-        //std::complex<double> gam0 = g1 * g2 * g3;
-        //std::complex<double> gam1 = std::conj(g1) * g2 * g3;
-        //std::complex<double> gam2 = g1 * std::conj(g2) * g3;
-        //std::complex<double> gam3 = g1 * g2 * std::conj(g3);
-
-        // The complex products g1 g2 and g1 g2* share most of the calculations,
-        // so faster to do this manually.
-        // The above uses 32 multiplies and 16 adds.
-        // We can do this with just 12 multiplies and 12 adds.
-        double g1rg2r = g1.real() * g2.real();
-        double g1rg2i = g1.real() * g2.imag();
-        double g1ig2r = g1.imag() * g2.real();
-        double g1ig2i = g1.imag() * g2.imag();
-
-        double g1g2r = g1rg2r - g1ig2i;
-        double g1g2i = g1rg2i + g1ig2r;
-        double g1cg2r = g1rg2r + g1ig2i;
-        double g1cg2i = g1rg2i - g1ig2r;
-
-        double g1g2rg3r = g1g2r * g3.real();
-        double g1g2rg3i = g1g2r * g3.imag();
-        double g1g2ig3r = g1g2i * g3.real();
-        double g1g2ig3i = g1g2i * g3.imag();
-        double g1cg2rg3r = g1cg2r * g3.real();
-        double g1cg2rg3i = g1cg2r * g3.imag();
-        double g1cg2ig3r = g1cg2i * g3.real();
-        double g1cg2ig3i = g1cg2i * g3.imag();
-
-        zeta.gam0r[index] += g1g2rg3r - g1g2ig3i;
-        zeta.gam0i[index] += g1g2rg3i + g1g2ig3r;
-        zeta.gam1r[index] += g1cg2rg3r - g1cg2ig3i;
-        zeta.gam1i[index] += g1cg2rg3i + g1cg2ig3r;
-        zeta.gam2r[index] += g1cg2rg3r + g1cg2ig3i;
-        zeta.gam2i[index] += g1cg2rg3i - g1cg2ig3r;
-        zeta.gam3r[index] += g1g2rg3r + g1g2ig3i;
-        zeta.gam3i[index] += -g1g2rg3i + g1g2ig3r;
+    template <bool atomic>
+    static void AddZeta(const TriangleBuffer& buf, ZetaData<GData,GData,GData>& zeta)
+    {
+        const int n = buf.n;
+        for (int i=0; i<n; ++i) {
+            const int k = buf.index[i];
+            BinAdder<atomic>::add(zeta.gam0r[k], buf.zeta[0][i]);
+            BinAdder<atomic>::add(zeta.gam0i[k], buf.zeta[1][i]);
+            BinAdder<atomic>::add(zeta.gam1r[k], buf.zeta[2][i]);
+            BinAdder<atomic>::add(zeta.gam1i[k], buf.zeta[3][i]);
+            BinAdder<atomic>::add(zeta.gam2r[k], buf.zeta[4][i]);
+            BinAdder<atomic>::add(zeta.gam2i[k], buf.zeta[5][i]);
+            BinAdder<atomic>::add(zeta.gam3r[k], buf.zeta[6][i]);
+            BinAdder<atomic>::add(zeta.gam3i[k], buf.zeta[7][i]);
+        }
     }
 };
 
@@ -1135,32 +1723,68 @@ void BinnedCorr3<D1,D2,D3,B>::directProcess111(
     const double d1, const double d2, const double d3,
     const double logr, const double u, const double v, const int index)
 {
-    double nnn = double(c1.getData().getN()) * double(c2.getData().getN()) *
+    Assert(_buffer);
+    TriangleBuffer& buf = *_buffer;
+    const int i = buf.n;
+    buf.index[i] = index;
+    buf.nnn[i] = double(c1.getData().getN()) * double(c2.getData().getN()) *
         double(c3.getData().getN());
-    _ntri[index] += nnn;
+    buf.www[i] = double(c1.getData().getW()) * double(c2.getData().getW()) *
+        double(c3.getData().getW());
     xdbg<<"            index = "<<index<<std::endl;
-    xdbg<<"            nnn = "<<nnn<<std::endl;
-    xdbg<<"            ntri = "<<_ntri[index]<<std::endl;
+    xdbg<<"            nnn = "<<buf.nnn[i]<<std::endl;
+    buf.d1[i] = d1;
+    buf.d2[i] = d2;
+    buf.d3[i] = d3;
+    buf.logr[i] = logr;
+    buf.u[i] = u;
+    buf.v[i] = v;
+    DirectHelper<D1,D2,D3>::StoreValues(c1,c2,c3,buf,i);
+    if (++buf.n == TriangleBuffer::SIZE) flushTriangles();
+}
 
-    double www = double(c1.getData().getW()) * double(c2.getData().getW()) *
-        double(c3.getData().getW());
-    _meand1[index] += www * d1;
-    _meanlogd1[index] += www * log(d1);
-    _meand2[index] += www * d2;
-    _meanlogd2[index] += www * logr;
-    _meand3[index] += www * d3;
-    _meanlogd3[index] += www * log(d3);
-    _meanu[index] += www * u;
-    _meanv[index] += www * v;
-    _weight[index] += www;
-
-    DirectHelper<D1,D2,D3>::template ProcessZeta<C,M>(c1,c2,c3,d1,d2,d3,_zeta,index);
+template <int D1, int D2, int D3, int B>
+void BinnedCorr3<D1,D2,D3,B>::flushTriangles()
+{
+    if (!_buffer || _buffer->n == 0) return;
+    TriangleBuffer& buf = *_buffer;
+    const int n = buf.n;
+
+    for (int i=0; i<n; ++i) buf.logd1[i] = log(buf.d1[i]);
+    for (int i=0; i<n; ++i) buf.logd3[i] = log(buf.d3[i]);
+    DirectHelper<D1,D2,D3>::ComputeZeta(buf);
+    if (_shared) addTriangles<true>();
+    else addTriangles<false>();
+    buf.n = 0;
+}
+
+template <int D1, int D2, int D3, int B> template <bool atomic>
+void BinnedCorr3<D1,D2,D3,B>::addTriangles()
+{
+    const TriangleBuffer& buf = *_buffer;
+    const int n = buf.n;
+    for (int i=0; i<n; ++i) {
+        const int k = buf.index[i];
+        const double www = buf.www[i];
+        BinAdder<atomic>::add(_ntri[k], buf.nnn[i]);
+        BinAdder<atomic>::add(_meand1[k], www * buf.d1[i]);
+        BinAdder<atomic>::add(_meanlogd1[k], www * buf.logd1[i]);
+        BinAdder<atomic>::add(_meand2[k], www * buf.d2[i]);
+        BinAdder<atomic>::add(_meanlogd2[k], www * buf.logr[i]);
+        BinAdder<atomic>::add(_meand3[k], www * buf.d3[i]);
+        BinAdder<atomic>::add(_meanlogd3[k], www * buf.logd3[i]);
+        BinAdder<atomic>::add(_meanu[k], www * buf.u[i]);
+        BinAdder<atomic>::add(_meanv[k], www * buf.v[i]);
+        BinAdder<atomic>::add(_weight[k], www);
+    }
+    DirectHelper<D1,D2,D3>::template AddZeta<atomic>(buf, _zeta);
 }
 
 template <int D1, int D2, int D3, int B>
 void BinnedCorr3<D1,D2,D3,B>::operator=(const BinnedCorr3<D1,D2,D3,B>& rhs)
 {
     Assert(rhs._ntot == _ntot);
+    if (rhs._ntri == _ntri) return;  // Shared arrays
     _zeta.copy(rhs._zeta,_ntot);
     for (int i=0; i<_ntot; ++i) _meand1[i] = rhs._meand1[i];
     for (int i=0; i<_ntot; ++i) _meanlogd1[i] = rhs._meanlogd1[i];
@@ -1178,6 +1802,9 @@ template <int D1, int D2, int D3, int B>
 void BinnedCorr3<D1,D2,D3,B>::operator+=(const BinnedCorr3<D1,D2,D3,B>& rhs)
 {
     Assert(rhs._ntot == _ntot);
+    _stats += rhs._stats;
+    // If the arrays are shared, rhs's triangles are already in them.
+    if (rhs._ntri == _ntri) return;
     _zeta.add(rhs._zeta,_ntot);
     for (int i=0; i<_ntot; ++i) _meand1[i] += rhs._meand1[i];
     for (int i=0; i<_ntot; ++i) _meanlogd1[i] += rhs._meanlogd1[i];
@@ -1191,6 +1818,54 @@ void BinnedCorr3<D1,D2,D3,B>::operator+=(const BinnedCorr3<D1,D2,D3,B>& rhs)
     for (int i=0; i<_ntot; ++i) _ntri[i] += rhs._ntri[i];
 }
 
+template <int D1, int D2, int D3, int B>
+void BinnedCorr3<D1,D2,D3,B>::getArrays(std::vector<double*>& arrays) const
+{
+    arrays.clear();
+    _zeta.getArrays(arrays);
+    arrays.push_back(_meand1);
+    arrays.push_back(_meanlogd1);
+    arrays.push_back(_meand2);
+    arrays.push_back(_meanlogd2);
+    arrays.push_back(_meand3);
+    arrays.push_back(_meanlogd3);
+    arrays.push_back(_meanu);
+    arrays.push_back(_meanv);
+    arrays.push_back(_weight);
+    arrays.push_back(_ntri);
+}
+
+template <int D1, int D2, int D3, int B>
+void BinnedCorr3<D1,D2,D3,B>::packData(std::vector<double>& data) const
+{
+    std::vector<double*> arrays;
+    getArrays(arrays);
+    data.resize(arrays.size() * _ntot);
+    for (size_t k=0; k<arrays.size(); ++k)
+        std::copy(arrays[k], arrays[k] + _ntot, data.begin() + k*_ntot);
+}
+
+template <int D1, int D2, int D3, int B>
+void BinnedCorr3<D1,D2,D3,B>::unpackData(const std::vector<double>& data)
+{
+    std::vector<double*> arrays;
+    getArrays(arrays);
+    Assert(data.size() == arrays.size() * _ntot);
+    for (size_t k=0; k<arrays.size(); ++k)
+        std::copy(data.begin() + k*_ntot, data.begin() + (k+1)*_ntot, arrays[k]);
+}
+
+template <int D1, int D2, int D3, int B>
+void BinnedCorr3<D1,D2,D3,B>::makeCheckpointKey(std::vector<double>& key, int c, int m) const
+{
+    const double params[] = {
+        D1, D2, D3, B, double(c), double(m), double(_nbins), _minsep, _maxsep, _binsize, _b,
+        double(_nubins), _minu, _maxu, _ubinsize, _bu,
+        double(_nvbins), _minv, _maxv, _vbinsize, _bv,
+        _minrpar, _maxrpar, _xp, _yp, _zp };
+    key.assign(params, params + sizeof(params)/sizeof(double));
+}
+
 //
 //
 // The C interface for python
@@ -1306,6 +1981,149 @@ void DestroyCorr3(void* corr, int d1, int d2, int d3, int bin_type)
     }
 }
 
+template <int D1, int D2, int D3>
+void SetCorr3Budgetc(void* corr, int bin_type, double max_time, double max_triples,
+                     double* used)
+{
+    Assert(bin_type == Log);  // This is the only one we have yet.
+    static_cast<BinnedCorr3<D1,D2,D3,Log>*>(corr)->setBudget(max_time, max_triples, used);
+}
+
+void SetCorr3Budget(void* corr, int d1, int d2, int d3, int bin_type,
+                    double max_time, double max_triples, double* used)
+{
+    dbg<<"Start SetCorr3Budget: "<<max_time<<" "<<max_triples<<std::endl;
+    Assert(d2 == d1);
+    Assert(d3 == d1);
+    switch(d1) {
+      case NData:
+           SetCorr3Budgetc<NData, NData, NData>(corr, bin_type, max_time, max_triples,
+                                                used);
+           break;
+      case KData:
+           SetCorr3Budgetc<KData, KData, KData>(corr, bin_type, max_time, max_triples,
+                                                used);
+           break;
+      case GData:
+           SetCorr3Budgetc<GData, GData, GData>(corr, bin_type, max_time, max_triples,
+                                                used);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1, int D2, int D3>
+void SetCorr3Statsc(void* corr, int bin_type, double* stats)
+{
+    Assert(bin_type == Log);  // This is the only one we have yet.
+    static_cast<BinnedCorr3<D1,D2,D3,Log>*>(corr)->setStats(stats);
+}
+
+void SetCorr3Stats(void* corr, int d1, int d2, int d3, int bin_type, double* stats)
+{
+    dbg<<"Start SetCorr3Stats\n";
+    Assert(d2 == d1);
+    Assert(d3 == d1);
+    switch(d1) {
+      case NData:
+           SetCorr3Statsc<NData, NData, NData>(corr, bin_type, stats);
+           break;
+      case KData:
+           SetCorr3Statsc<KData, KData, KData>(corr, bin_type, stats);
+           break;
+      case GData:
+           SetCorr3Statsc<GData, GData, GData>(corr, bin_type, stats);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1, int D2, int D3>
+void SetCorr3Checkpointc(void* corr, int bin_type, const char* file_name, double interval)
+{
+    Assert(bin_type == Log);  // This is the only one we have yet.
+    static_cast<BinnedCorr3<D1,D2,D3,Log>*>(corr)->setCheckpoint(file_name, interval);
+}
+
+void SetCorr3Checkpoint(void* corr, int d1, int d2, int d3, int bin_type,
+                        const char* file_name, double interval)
+{
+    dbg<<"Start SetCorr3Checkpoint: "<<file_name<<" "<<interval<<std::endl;
+    Assert(d2 == d1);
+    Assert(d3 == d1);
+    switch(d1) {
+      case NData:
+           SetCorr3Checkpointc<NData, NData, NData>(corr, bin_type, file_name, interval);
+           break;
+      case KData:
+           SetCorr3Checkpointc<KData, KData, KData>(corr, bin_type, file_name, interval);
+           break;
+      case GData:
+           SetCorr3Checkpointc<GData, GData, GData>(corr, bin_type, file_name, interval);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1, int D2, int D3>
+void SetCorr3ThreadMemoryc(void* corr, int bin_type, double max_mem)
+{
+    Assert(bin_type == Log);  // This is the only one we have yet.
+    static_cast<BinnedCorr3<D1,D2,D3,Log>*>(corr)->setMaxThreadMemory(max_mem);
+}
+
+void SetCorr3ThreadMemory(void* corr, int d1, int d2, int d3, int bin_type, double max_mem)
+{
+    dbg<<"Start SetCorr3ThreadMemory: "<<max_mem<<std::endl;
+    Assert(d2 == d1);
+    Assert(d3 == d1);
+    switch(d1) {
+      case NData:
+           SetCorr3ThreadMemoryc<NData, NData, NData>(corr, bin_type, max_mem);
+           break;
+      case KData:
+           SetCorr3ThreadMemoryc<KData, KData, KData>(corr, bin_type, max_mem);
+           break;
+      case GData:
+           SetCorr3ThreadMemoryc<GData, GData, GData>(corr, bin_type, max_mem);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1, int D2, int D3>
+void GetCorr3ThreadMemoryc(void* corr, int bin_type, int nthreads, double* info)
+{
+    Assert(bin_type == Log);  // This is the only one we have yet.
+    BinnedCorr3<D1,D2,D3,Log>* bc3 = static_cast<BinnedCorr3<D1,D2,D3,Log>*>(corr);
+    info[0] = bc3->threadMemory(nthreads);
+    info[1] = bc3->shareThreadData(nthreads);
+}
+
+void GetCorr3ThreadMemory(void* corr, int d1, int d2, int d3, int bin_type, int nthreads,
+                          double* info)
+{
+    Assert(d2 == d1);
+    Assert(d3 == d1);
+    switch(d1) {
+      case NData:
+           GetCorr3ThreadMemoryc<NData, NData, NData>(corr, bin_type, nthreads, info);
+           break;
+      case KData:
+           GetCorr3ThreadMemoryc<KData, KData, KData>(corr, bin_type, nthreads, info);
+           break;
+      case GData:
+           GetCorr3ThreadMemoryc<GData, GData, GData>(corr, bin_type, nthreads, info);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
 template <int M, int D, int B>
 void ProcessAuto3e(BinnedCorr3<D,D,D,B>* corr, void* field, int dots, int coords)
 {
@@ -1355,23 +2173,32 @@ void ProcessAuto3c(void* corr, void* field, int dots, int coords, int bin_type,
     ProcessAuto3d(static_cast<BinnedCorr3<D,D,D,Log>*>(corr), field, dots, coords, metric);
 }
 
-void ProcessAuto3(void* corr, void* field, int dots, int d, int coords, int bin_type, int metric)
+int ProcessAuto3(void* corr, void* field, int dots, int d, int coords, int bin_type, int metric)
 {
+    PhaseThreads threads(ProcessPhase);
     dbg<<"Start ProcessAuto3 "<<d<<" "<<coords<<" "<<bin_type<<" "<<metric<<std::endl;
 
-    switch(d) {
-      case NData:
-           ProcessAuto3c<NData>(corr, field, dots, coords, bin_type, metric);
-           break;
-      case KData:
-           ProcessAuto3c<KData>(corr, field, dots, coords, bin_type, metric);
-           break;
-      case GData:
-           ProcessAuto3c<GData>(corr, field, dots, coords, bin_type, metric);
-           break;
-      default:
-           Assert(false);
+    // Errors reading or writing the checkpoint file are signalled by returning 0, since we
+    // can't throw across the C interface.
+    try {
+        switch(d) {
+          case NData:
+               ProcessAuto3c<NData>(corr, field, dots, coords, bin_type, metric);
+               break;
+          case KData:
+               ProcessAuto3c<KData>(corr, field, dots, coords, bin_type, metric);
+               break;
+          case GData:
+               ProcessAuto3c<GData>(corr, field, dots, coords, bin_type, metric);
+               break;
+          default:
+               Assert(false);
+        }
+    } catch (std::runtime_error& e) {
+        dbg<<"Unable to process auto-correlation: "<<e.what()<<std::endl;
+        return 0;
     }
+    return 1;
 }
 
 template <int M, int D1, int D2, int D3, int B>
@@ -1433,27 +2260,36 @@ void ProcessCross3c(void* corr, void* field1, void* field2, void* field3, int do
                    coords, metric);
 }
 
-void ProcessCross3(void* corr, void* field1, void* field2, void* field3, int dots,
-                   int d1, int d2, int d3, int coords, int bin_type, int metric)
+int ProcessCross3(void* corr, void* field1, void* field2, void* field3, int dots,
+                  int d1, int d2, int d3, int coords, int bin_type, int metric)
 {
+    PhaseThreads threads(ProcessPhase);
     dbg<<"Start ProcessCross3 "<<d1<<" "<<d2<<" "<<d3<<" "<<coords<<" "<<bin_type<<" "<<metric<<std::endl;
 
     Assert(d2 == d1);
     Assert(d3 == d1);
-    switch(d1) {
-      case NData:
-           ProcessCross3c<NData,NData,NData>(corr, field1, field2, field3, dots,
-                                             bin_type, coords, metric);
-           break;
-      case KData:
-           ProcessCross3c<KData,KData,KData>(corr, field1, field2, field3, dots,
-                                             bin_type, coords, metric);
-           break;
-      case GData:
-           ProcessCross3c<GData,GData,GData>(corr, field1, field2, field3, dots,
-                                             bin_type, coords, metric);
-           break;
-      default:
-           Assert(false);
+    // Errors reading or writing the checkpoint file are signalled by returning 0, since we
+    // can't throw across the C interface.
+    try {
+        switch(d1) {
+          case NData:
+               ProcessCross3c<NData,NData,NData>(corr, field1, field2, field3, dots,
+                                                 bin_type, coords, metric);
+               break;
+          case KData:
+               ProcessCross3c<KData,KData,KData>(corr, field1, field2, field3, dots,
+                                                 bin_type, coords, metric);
+               break;
+          case GData:
+               ProcessCross3c<GData,GData,GData>(corr, field1, field2, field3, dots,
+                                                 bin_type, coords, metric);
+               break;
+          default:
+               Assert(false);
+        }
+    } catch (std::runtime_error& e) {
+        dbg<<"Unable to process cross-correlation: "<<e.what()<<std::endl;
+        return 0;
     }
+    return 1;
 }
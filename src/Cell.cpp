@@ -21,6 +21,11 @@
 #include "dbg.h"
 #include "Cell.h"
 #include "Bounds.h"
+#include "NumaDomains.h"
+
+#ifdef _OPENMP
+#include "omp.h"
+#endif
 
 
 // Helper functions to setup random numbers properly
@@ -66,21 +71,71 @@ double urand()
 }
 
 
+// For very large ranges (e.g. the whole catalog at the top of the tree), the accumulations
+// we do while building the tree are worth doing in parallel.  Below this many objects, the
+// overhead isn't worth it.
+const size_t PARALLEL_BUILD_MIN = 100000;
+
+// Run the accumulator f over [start,end), giving each thread a contiguous chunk of the range.
+// The partial results are combined in order, so the answer doesn't depend on the scheduling.
+// This only goes parallel if we aren't already in a parallel region, since the lower levels of
+// the tree are built in parallel across the top-level cells.
+// F needs to have run(start,end) and operator+=(const F&).
+template <typename F>
+void ParallelAccumulate(F& f, size_t start, size_t end)
+{
+#ifdef _OPENMP
+    int nthreads = omp_get_max_threads();
+    if (end - start >= PARALLEL_BUILD_MIN && nthreads > 1 && !omp_in_parallel()) {
+        std::vector<F> partial(nthreads, f);
+#pragma omp parallel num_threads(nthreads)
+        {
+            int t = omp_get_thread_num();
+            int nt = omp_get_num_threads();
+            partial[t].run(start + (end-start)*t/nt, start + (end-start)*(t+1)/nt);
+        }
+        for (int t=0; t<nthreads; ++t) f += partial[t];
+        return;
+    }
+#endif
+    f.run(start, end);
+}
+
+
 //
 // CellData
 //
 
+template <int D, int C>
+struct MaxDevSq
+{
+    const std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >* vdata;
+    Position<C> cen;
+    double sizesq;
+
+    MaxDevSq(const std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& v,
+             const Position<C>& c) : vdata(&v), cen(c), sizesq(0.) {}
+
+    void run(size_t start, size_t end)
+    {
+        for(size_t i=start;i<end;++i) {
+            double devsq = (cen-(*vdata)[i].first->getPos()).normSq();
+            if (devsq > sizesq) sizesq = devsq;
+        }
+    }
+
+    void operator+=(const MaxDevSq<D,C>& rhs)
+    { if (rhs.sizesq > sizesq) sizesq = rhs.sizesq; }
+};
+
 template <int D, int C>
 double CalculateSizeSq(
     const Position<C>& cen, const std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata,
     size_t start, size_t end)
 {
-    double sizesq = 0.;
-    for(size_t i=start;i<end;++i) {
-        double devsq = (cen-vdata[i].first->getPos()).normSq();
-        if (devsq > sizesq) sizesq = devsq;
-    }
-    return sizesq;
+    MaxDevSq<D,C> f(vdata, cen);
+    ParallelAccumulate(f, start, end);
+    return f.sizesq;
 }
 
 template <int D, int C>
@@ -120,24 +175,43 @@ double Cell<D,C>::calculateInertia() const
 }
 
 
+template <int D, int C>
+struct SumPos
+{
+    const std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >* vdata;
+    Position<C> pos;
+    double sumwp;
+    double sumw;
+
+    SumPos(const std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& v) :
+        vdata(&v), sumwp(0.), sumw(0.) {}
+
+    void run(size_t start, size_t end)
+    {
+        for(size_t i=start; i!=end; ++i) {
+            const CellData<D,C>& data = *(*vdata)[i].first;
+            double wp = (*vdata)[i].second.wpos;
+            pos += data.getPos() * wp;
+            sumwp += wp;
+            sumw += data.getW();
+        }
+    }
+
+    void operator+=(const SumPos<D,C>& rhs)
+    { pos += rhs.pos; sumwp += rhs.sumwp; sumw += rhs.sumw; }
+};
+
 template <int D, int C>
 void BuildCellData(
     const std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, size_t start, size_t end,
     Position<C>& pos, float& w)
 {
     Assert(start < end);
-    double wp = vdata[start].second.wpos;
-    pos = vdata[start].first->getPos();
-    pos *= wp;
-    w = vdata[start].first->getW();
-    double sumwp = wp;
-    for(size_t i=start+1; i!=end; ++i) {
-        const CellData<D,C>& data = *vdata[i].first;
-        wp = vdata[i].second.wpos;
-        pos += data.getPos() * wp;
-        sumwp += wp;
-        w += data.getW();
-    }
+    SumPos<D,C> f(vdata);
+    ParallelAccumulate(f, start, end);
+    pos = f.pos;
+    w = f.sumw;
+    double sumwp = f.sumwp;
     if (sumwp != 0.) {
         pos /= sumwp;
         // If C == Sphere, the average position is no longer on the surface of the unit sphere.
@@ -169,26 +243,70 @@ CellData<GData,C>::CellData(
     _wg(0.), _w(0.), _n(end-start)
 { BuildCellData(vdata,start,end,_pos,_w); }
 
+template <int C>
+struct SumWK
+{
+    const std::vector<std::pair<CellData<KData,C>*,WPosLeafInfo> >* vdata;
+    double dwk;
+
+    SumWK(const std::vector<std::pair<CellData<KData,C>*,WPosLeafInfo> >& v) :
+        vdata(&v), dwk(0.) {}
+
+    void run(size_t start, size_t end)
+    { for(size_t i=start;i<end;++i) dwk += (*vdata)[i].first->getWK(); }
+
+    void operator+=(const SumWK<C>& rhs) { dwk += rhs.dwk; }
+};
+
 template <int C>
 void CellData<KData,C>::finishAverages(
     const std::vector<std::pair<CellData<KData,C>*,WPosLeafInfo> >& vdata, size_t start, size_t end)
 {
     // Accumulate in double precision for better accuracy.
-    double dwk = 0.;
-    for(size_t i=start;i<end;++i) dwk += vdata[i].first->getWK();
-    _wk = dwk;
+    SumWK<C> f(vdata);
+    ParallelAccumulate(f, start, end);
+    _wk = f.dwk;
 }
 
+struct SumWG
+{
+    const std::vector<std::pair<CellData<GData,Flat>*,WPosLeafInfo> >* vdata;
+    std::complex<double> dwg;
+
+    SumWG(const std::vector<std::pair<CellData<GData,Flat>*,WPosLeafInfo> >& v) :
+        vdata(&v), dwg(0.) {}
+
+    void run(size_t start, size_t end)
+    { for(size_t i=start;i<end;++i) dwg += (*vdata)[i].first->getWG(); }
+
+    void operator+=(const SumWG& rhs) { dwg += rhs.dwg; }
+};
+
 template <>
 void CellData<GData,Flat>::finishAverages(
     const std::vector<std::pair<CellData<GData,Flat>*,WPosLeafInfo> >& vdata, size_t start, size_t end)
 {
     // Accumulate in double precision for better accuracy.
-    std::complex<double> dwg(0.);
-    for(size_t i=start;i<end;++i) dwg += vdata[i].first->getWG();
-    _wg = dwg;
+    SumWG f(vdata);
+    ParallelAccumulate(f, start, end);
+    _wg = f.dwg;
 }
 
+template <int C>
+struct ParallelTransportSum
+{
+    const std::vector<std::pair<CellData<GData,C>*,WPosLeafInfo> >* vdata;
+    Position<C> center;
+    std::complex<double> dwg;
+
+    ParallelTransportSum(const std::vector<std::pair<CellData<GData,C>*,WPosLeafInfo> >& v,
+                         const Position<C>& c) : vdata(&v), center(c), dwg(0.) {}
+
+    void run(size_t start, size_t end);
+
+    void operator+=(const ParallelTransportSum<C>& rhs) { dwg += rhs.dwg; }
+};
+
 template <int C>
 std::complex<double> ParallelTransportShift(
     const std::vector<std::pair<CellData<GData,C>*,WPosLeafInfo> >& vdata,
@@ -197,7 +315,15 @@ std::complex<double> ParallelTransportShift(
     // For the average shear, we need to parallel transport each one to the center
     // to account for the different coordinate systems for each measurement.
     xdbg<<"Finish Averages for Center = "<<center<<std::endl;
-    std::complex<double> dwg=0.;
+    ParallelTransportSum<C> f(vdata, center);
+    ParallelAccumulate(f, start, end);
+    return f.dwg;
+}
+
+template <int C>
+void ParallelTransportSum<C>::run(size_t start, size_t end)
+{
+    const std::vector<std::pair<CellData<GData,C>*,WPosLeafInfo> >& vdata = *this->vdata;
     for(size_t i=start;i<end;++i) {
         xxdbg<<"Project shear "<<(vdata[i].first->getWG()/vdata[i].first->getW())<<
             " at point "<<vdata[i].first->getPos()<<std::endl;
@@ -237,7 +363,6 @@ std::complex<double> ParallelTransportShift(
             dwg += vdata[i].first->getWG() * exp2ibeta;
         }
     }
-    return dwg;
 }
 
 // These two need to do the same thing, so pull it out into the above function.
@@ -371,6 +496,21 @@ struct SplitDataCore<D, C, RANDOM>
     }
 };
 
+template <int D, int C>
+struct BoundsAccumulator
+{
+    const std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >* vdata;
+    Bounds<C> b;
+
+    BoundsAccumulator(const std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& v) :
+        vdata(&v) {}
+
+    void run(size_t start, size_t end)
+    { for(size_t i=start;i<end;++i) b += (*vdata)[i].first->getPos(); }
+
+    void operator+=(const BoundsAccumulator<D,C>& rhs) { b += rhs.b; }
+};
+
 template <int D, int C, int SM>
 size_t SplitData(
     std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata,
@@ -378,8 +518,9 @@ size_t SplitData(
 {
     Assert(end-start > 1);
 
-    Bounds<C> b;
-    for(size_t i=start;i<end;++i) b += vdata[i].first->getPos();
+    BoundsAccumulator<D,C> f(vdata);
+    ParallelAccumulate(f, start, end);
+    const Bounds<C>& b = f.b;
     int split = b.getSplit();
 
     size_t mid = SplitDataCore<D,C,SM>::run(vdata, start, end, meanpos, b, split);
@@ -407,37 +548,59 @@ size_t SplitData(
     return mid;
 }
 
+// The indices of the objects in vdata[start:end], for a leaf with more than one object.
+template <int D, int C>
+ListLeafInfo MakeListLeafInfo(const std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata,
+                              size_t start, size_t end, Arena& arena)
+{
+    long maxindex = 0;
+    for (size_t i=start; i<end; ++i) maxindex = std::max(maxindex, vdata[i].second.index);
+    ListLeafInfo info;
+    info.allocate(end-start, maxindex, arena);
+    for (size_t i=start; i<end; ++i) {
+        xdbg<<"Set indices["<<i-start<<"] = "<<vdata[i].second.index<<std::endl;
+        info.set(i-start, vdata[i].second.index);
+    }
+    return info;
+}
+
+// When building in parallel, cells with at least this many objects build their left
+// sub-cell as a separate OpenMP task.
+const size_t BUILD_TASK_MIN = 10000;
+
 template <int D, int C, int SM>
 Cell<D,C>* BuildCell(std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata,
-                     double minsizesq, bool brute, size_t start, size_t end,
-                     CellData<D,C>* data, double sizesq)
+                     double minsizesq, bool brute, size_t start, size_t end, Arena& arena,
+                     const CellData<D,C>* ave, double sizesq, Cell<D,C>* leaves,
+                     LazyBuilder<D,C>* lazy)
 {
-    xdbg<<"Build "<<minsizesq<<" "<<brute<<" "<<start<<" "<<end<<" "<<data<<" "<<sizesq<<std::endl;
+    xdbg<<"Build "<<minsizesq<<" "<<brute<<" "<<start<<" "<<end<<" "<<ave<<" "<<sizesq<<std::endl;
     Assert(sizesq >= 0.);
     Assert(vdata.size()>0);
     Assert(end <= vdata.size());
     Assert(end > start);
 
     if (end - start == 1) {
-        if (!data) {
-            data = vdata[start].first;
-            vdata[start].first = 0; // Make sure calling routine doesn't delete this one!
-        }
-        xdbg<<"Make leaf cell from "<<*data<<std::endl;
+        // If the Field already made all the leaves, just use the one for this object.
+        if (leaves) return leaves + vdata[start].second.index;
+        if (!ave) ave = vdata[start].first;
+        xdbg<<"Make leaf cell from "<<*ave<<std::endl;
         LeafInfo info = vdata[start].second; // Only copies as a LeafInfo, so throws away wpos.
         xdbg<<"info.index = "<<info.index<<"  "<<vdata[start].second.index<<std::endl;
-        return new Cell<D,C>(data, info);
+        return new (arena) Cell<D,C>(*ave, info);
     }
 
     // Not a leaf.  Calculate size and data for this Cell.
-    if (data) {
-        xdbg<<"Make cell starting with ave = "<<*data<<std::endl;
+    CellData<D,C> data;
+    if (ave) {
+        xdbg<<"Make cell starting with ave = "<<*ave<<std::endl;
         xdbg<<"sizesq = "<<sizesq<<", brute = "<<brute<<std::endl;
+        data = *ave;
     } else {
-        data = new CellData<D,C>(vdata,start,end);
-        data->finishAverages(vdata,start,end);
-        xdbg<<"Make cell from "<<start<<".."<<end<<" = "<<*data<<std::endl;
-        sizesq = CalculateSizeSq(data->getPos(),vdata,start,end);
+        data = CellData<D,C>(vdata,start,end);
+        data.finishAverages(vdata,start,end);
+        xdbg<<"Make cell from "<<start<<".."<<end<<" = "<<data<<std::endl;
+        sizesq = CalculateSizeSq(data.getPos(),vdata,start,end);
         Assert(sizesq >= 0.);
     }
 
@@ -447,45 +610,166 @@ Cell<D,C>* BuildCell(std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata
         double size = brute ? std::numeric_limits<double>::infinity() : sqrt(sizesq);
         if (brute) sizesq = std::numeric_limits<double>::infinity();
         xdbg<<"size,sizesq = "<<size<<","<<sizesq<<std::endl;
-        size_t mid = SplitData<D,C,SM>(vdata,start,end,data->getPos());
-        Cell<D,C>* l = BuildCell<D,C,SM>(vdata,minsizesq,brute,start,mid);
-        xdbg<<"Made left"<<std::endl;
-        Cell<D,C>* r = BuildCell<D,C,SM>(vdata,minsizesq,brute,mid,end);
-        xdbg<<"Made right"<<std::endl;
+        if (lazy) {
+            // Don't build the children yet.  Just record what we need to build them later.
+            LazyInfo<D,C>* info = new (arena) LazyInfo<D,C>();
+            info->builder = lazy;
+            info->start = start;
+            info->end = end;
+            return new (arena.allocate(sizeof(Cell<D,C>), end-start))
+                Cell<D,C>(data, size, sizesq, info);
+        }
+        size_t mid = SplitData<D,C,SM>(vdata,start,end,data.getPos());
+        // Reserve the memory for this Cell before building the children, so the tree is laid
+        // out in depth-first order.
+        void* mem = arena.allocate(sizeof(Cell<D,C>), end-start);
+        Cell<D,C>* l = 0;
+        Cell<D,C>* r = 0;
+#ifdef _OPENMP
+        if (end-start >= BUILD_TASK_MIN && omp_in_parallel() && GetNumaDomains() == 1) {
+            // For large cells, build the left side as a separate task, so idle threads can
+            // help out when there are only a few top-level cells.  The task needs its own
+            // Arena, which is owned by this one.  (Not with NUMA domains though, since the
+            // task could run on a thread in some other domain.)
+            std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >* pvdata = &vdata;
+            Arena* left_arena = arena.newChild(
+                Arena::BlockSizeFor(2 * (mid-start) * sizeof(Cell<D,C>)));
+#pragma omp task shared(l)
+            l = BuildCell<D,C,SM>(*pvdata,minsizesq,brute,start,mid,*left_arena,
+                                  0,0.,leaves);
+            r = BuildCell<D,C,SM>(vdata,minsizesq,brute,mid,end,arena,0,0.,leaves);
+#pragma omp taskwait
+        } else
+#endif
+        {
+            l = BuildCell<D,C,SM>(vdata,minsizesq,brute,start,mid,arena,0,0.,leaves);
+            r = BuildCell<D,C,SM>(vdata,minsizesq,brute,mid,end,arena,0,0.,leaves);
+        }
+        xdbg<<"Made left and right"<<std::endl;
         xdbg<<data<<"  "<<size<<"  "<<sizesq<<"  "<<l<<"  "<<r<<std::endl;
-        return new Cell<D,C>(data, size, sizesq, l, r);
+        return new (mem) Cell<D,C>(data, size, sizesq, l, r);
     } else {
         // Too small, so stop here anyway.
-        ListLeafInfo info;
-        info.indices = new std::vector<long>(end-start);
-        for (size_t i=start; i<end; ++i) {
-            xdbg<<"Set indices["<<i-start<<"] = "<<vdata[i].second.index<<std::endl;
-            (*info.indices)[i-start] = vdata[i].second.index;
-        }
+        ListLeafInfo info = MakeListLeafInfo(vdata, start, end, arena);
         xdbg<<"Made indices"<<std::endl;
-        return new Cell<D,C>(data, info);
+        return new (arena) Cell<D,C>(data, info);
+    }
+}
+
+template <int D, int C, int SM>
+void BuildLazyChildren(const Cell<D,C>& cell, const LazyInfo<D,C>& info,
+                       Cell<D,C>*& left, Cell<D,C>*& right)
+{
+    LazyBuilder<D,C>& b = *info.builder;
+    std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata = *b.vdata;
+    size_t mid = SplitData<D,C,SM>(vdata,info.start,info.end,cell.getPos());
+    left = BuildCell<D,C,SM>(vdata,b.minsizesq,b.brute,info.start,mid,*b.arena,
+                             0,0.,b.leaves,&b);
+    right = BuildCell<D,C,SM>(vdata,b.minsizesq,b.brute,mid,info.end,*b.arena,
+                              0,0.,b.leaves,&b);
+}
+
+// The locks for buildChildren.  cf. the comments there.
+const int N_LAZY_NODE_LOCKS = 256;
+static SpinLock lazy_node_locks[N_LAZY_NODE_LOCKS];
+
+template <int D, int C>
+const Cell<D,C>* Cell<D,C>::buildChildren() const
+{
+    // First take the lock for this Cell, so only one thread builds its children.  Another
+    // thread may have built them while we were waiting, so check _left again once we have it.
+    // Until then, _lazy may be being overwritten by _right, so it can't be used to find the
+    // lock of the tree.  Hence the node locks are a fixed set, chosen by the address.
+    // Then the lock of the tree protects its arena, which the builds in this tree share.
+    Cell<D,C>* left = 0;
+    SpinLock& node_lock = lazy_node_locks[(reinterpret_cast<size_t>(this) / sizeof(Cell<D,C>))
+                                          % N_LAZY_NODE_LOCKS];
+    node_lock.acquire();
+    {
+        left = __atomic_load_n(&_left, __ATOMIC_ACQUIRE);
+        if (!left) {
+            xdbg<<"Build lazy children of "<<*this<<std::endl;
+            const LazyInfo<D,C>& info = *_lazy;
+            info.builder->lock.acquire();
+            Cell<D,C>* right = 0;
+            switch (info.builder->sm) {
+              case MIDDLE:
+                   BuildLazyChildren<D,C,MIDDLE>(*this,info,left,right);
+                   break;
+              case MEDIAN:
+                   BuildLazyChildren<D,C,MEDIAN>(*this,info,left,right);
+                   break;
+              case MEAN:
+                   BuildLazyChildren<D,C,MEAN>(*this,info,left,right);
+                   break;
+              case RANDOM:
+                   BuildLazyChildren<D,C,RANDOM>(*this,info,left,right);
+                   break;
+              default:
+                   Assert(false);
+            }
+            info.builder->lock.release();
+            // _right overwrites _lazy, so set it first.  Then publish _left.
+            // (The Cells are never actually const, so the const_cast is safe.)
+            Cell<D,C>* self = const_cast<Cell<D,C>*>(this);
+            self->_right = right;
+            __atomic_store_n(&self->_left, left, __ATOMIC_RELEASE);
+        }
+    }
+    node_lock.release();
+    return left;
+}
+
+template <int D, int C, int D2>
+Cell<D,C>* CopyCell(const Cell<D2,C>* src,
+                    const std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata,
+                    size_t start, Arena& arena)
+{
+    size_t end = start + src->getN();
+    xdbg<<"Copy "<<start<<" "<<end<<" "<<*src<<std::endl;
+    Assert(end <= vdata.size());
+
+    if (end - start == 1) {
+        LeafInfo info = vdata[start].second; // Only copies as a LeafInfo, so throws away wpos.
+        Assert(info.index == src->getInfo().index);
+        return new (arena) Cell<D,C>(*vdata[start].first, info);
+    }
+
+    CellData<D,C> data(vdata,start,end);
+    data.finishAverages(vdata,start,end);
+
+    if (src->getLeft()) {
+        // Reserve the memory for this Cell first, so the tree is in depth-first order.
+        void* mem = arena.allocate(sizeof(Cell<D,C>), end-start);
+        Cell<D,C>* l = CopyCell(src->getLeft(), vdata, start, arena);
+        Cell<D,C>* r = CopyCell(src->getRight(), vdata, start + src->getLeft()->getN(), arena);
+        Assert(start + l->getN() + r->getN() == end);
+        return new (mem) Cell<D,C>(data, src->getSize(), src->getSizeSq(), l, r);
+    } else {
+        ListLeafInfo info = MakeListLeafInfo(vdata, start, end, arena);
+        return new (arena) Cell<D,C>(data, info);
     }
 }
 
 template <int D, int C>
 long Cell<D,C>::countLeaves() const
 {
-    if (_left) {
-        Assert(_right);
-        return _left->countLeaves() + _right->countLeaves();
+    if (getLeft()) {
+        Assert(getRight());
+        return getLeft()->countLeaves() + getRight()->countLeaves();
     } else return 1;
 }
 
 template <int D, int C>
 bool Cell<D,C>::includesIndex(long index) const
 {
-    if (_left) {
-        return _left->includesIndex(index) || _right->includesIndex(index);
+    if (getLeft()) {
+        return getLeft()->includesIndex(index) || getRight()->includesIndex(index);
     } else if (getN() == 1) {
         return _info.index == index;
     } else {
-        const std::vector<long>& indices = *_listinfo.indices;
-        return std::find(indices.begin(), indices.end(), index) != indices.end();
+        for (long i=0; i<getN(); ++i) if (_listinfo[i] == index) return true;
+        return false;
     }
 }
 
@@ -493,11 +777,11 @@ template <int D, int C>
 std::vector<const Cell<D,C>*> Cell<D,C>::getAllLeaves() const
 {
     std::vector<const Cell<D,C>*> ret;
-    if (_left) {
-        std::vector<const Cell<D,C>*> temp = _left->getAllLeaves();
+    if (getLeft()) {
+        std::vector<const Cell<D,C>*> temp = getLeft()->getAllLeaves();
         ret.insert(ret.end(),temp.begin(),temp.end());
-        Assert(_right);
-        temp = _right->getAllLeaves();
+        Assert(getRight());
+        temp = getRight()->getAllLeaves();
         ret.insert(ret.end(),temp.begin(),temp.end());
     } else {
         ret.push_back(this);
@@ -509,17 +793,16 @@ template <int D, int C>
 std::vector<long> Cell<D,C>::getAllIndices() const
 {
     std::vector<long> ret;
-    if (_left) {
-        std::vector<long> temp = _left->getAllIndices();
+    if (getLeft()) {
+        std::vector<long> temp = getLeft()->getAllIndices();
         ret.insert(ret.end(),temp.begin(),temp.end());
-        Assert(_right);
-        temp = _right->getAllIndices();
+        Assert(getRight());
+        temp = getRight()->getAllIndices();
         ret.insert(ret.end(),temp.begin(),temp.end());
     } else if (getN() == 1) {
         ret.push_back(_info.index);
     } else {
-        const std::vector<long>& indices = *_listinfo.indices;
-        ret.insert(ret.end(),indices.begin(),indices.end());
+        _listinfo.appendTo(getN(), ret);
     }
     return ret;
 }
@@ -527,11 +810,11 @@ std::vector<long> Cell<D,C>::getAllIndices() const
 template <int D, int C>
 const Cell<D,C>* Cell<D,C>::getLeafNumber(long i) const
 {
-    if (_left) {
-        if (i < _left->getN())
-            return _left->getLeafNumber(i);
+    if (getLeft()) {
+        if (i < getLeft()->getN())
+            return getLeft()->getLeafNumber(i);
         else
-            return _right->getLeafNumber(i-_left->getN());
+            return getRight()->getLeafNumber(i-getLeft()->getN());
     } else {
         return this;
     }
@@ -553,6 +836,12 @@ void Cell<D,C>::WriteTree(std::ostream& os, int indent) const
     }
 }
 
+#define InstCopy(D,C,D2)\
+    template Cell<D,C>* CopyCell( \
+        const Cell<D2,C>* src, \
+        const std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, \
+        size_t start, Arena& arena)
+
 #define Inst(D,C)\
     template class CellData<D,C>; \
     template class Cell<D,C>; \
@@ -560,22 +849,41 @@ void Cell<D,C>::WriteTree(std::ostream& os, int indent) const
         const Position<C>& cen, \
         const std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, \
         size_t start, size_t end); \
+    template size_t SplitData<D,C,MIDDLE>( \
+        std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, \
+        size_t start, size_t end, const Position<C>& meanpos); \
+    template size_t SplitData<D,C,MEDIAN>( \
+        std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, \
+        size_t start, size_t end, const Position<C>& meanpos); \
+    template size_t SplitData<D,C,MEAN>( \
+        std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, \
+        size_t start, size_t end, const Position<C>& meanpos); \
+    template size_t SplitData<D,C,RANDOM>( \
+        std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, \
+        size_t start, size_t end, const Position<C>& meanpos); \
     template Cell<D,C>* BuildCell<D,C,MIDDLE>( \
         std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, \
-        double minsizesq, bool brute, size_t start, size_t end, \
-        CellData<D,C>* data, double sizesq); \
+        double minsizesq, bool brute, size_t start, size_t end, Arena& arena, \
+        const CellData<D,C>* ave, double sizesq, Cell<D,C>* leaves, \
+        LazyBuilder<D,C>* lazy); \
     template Cell<D,C>* BuildCell<D,C,MEDIAN>( \
         std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, \
-        double minsizesq, bool brute, size_t start, size_t end, \
-        CellData<D,C>* data, double sizesq); \
+        double minsizesq, bool brute, size_t start, size_t end, Arena& arena, \
+        const CellData<D,C>* ave, double sizesq, Cell<D,C>* leaves, \
+        LazyBuilder<D,C>* lazy); \
     template Cell<D,C>* BuildCell<D,C,MEAN>( \
         std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, \
-        double minsizesq, bool brute, size_t start, size_t end, \
-        CellData<D,C>* data, double sizesq); \
+        double minsizesq, bool brute, size_t start, size_t end, Arena& arena, \
+        const CellData<D,C>* ave, double sizesq, Cell<D,C>* leaves, \
+        LazyBuilder<D,C>* lazy); \
     template Cell<D,C>* BuildCell<D,C,RANDOM>( \
         std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, \
-        double minsizesq, bool brute, size_t start, size_t end, \
-        CellData<D,C>* data, double sizesq); \
+        double minsizesq, bool brute, size_t start, size_t end, Arena& arena, \
+        const CellData<D,C>* ave, double sizesq, Cell<D,C>* leaves, \
+        LazyBuilder<D,C>* lazy); \
+    InstCopy(D,C,NData); \
+    InstCopy(D,C,KData); \
+    InstCopy(D,C,GData); \
 
 Inst(NData,Flat);
 Inst(NData,ThreeD);
@@ -0,0 +1,230 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+//#define DEBUGLOGGING
+
+#include <vector>
+
+#include "dbg.h"
+
+#ifdef _OPENMP
+#include "omp.h"
+#endif
+
+extern "C" {
+#include "Cov_C.h"
+}
+
+// The sums of the stat and weight arrays over some set of pairs of patches for one row of a
+// design matrix.  nz counts the pairs with non-zero weight in each bin, so the jackknife,
+// which subtracts the pairs with patch i from the total, can tell exactly which bins have
+// no pairs left, rather than relying on the subtraction giving exactly 0.
+struct CovSums
+{
+    CovSums() {}
+    CovSums(int nstat) : n(nstat, 0.), d(nstat, 0.), nz(nstat, 0) {}
+
+    void add(const double* stat, const double* weight, double m=1.)
+    {
+        for (size_t k=0; k<n.size(); ++k) {
+            n[k] += m * stat[k];
+            d[k] += m * weight[k];
+            if (weight[k] != 0.) nz[k] += long(m);
+        }
+    }
+
+    void add(const CovSums& other, double m=1.)
+    {
+        for (size_t k=0; k<n.size(); ++k) {
+            n[k] += m * other.n[k];
+            d[k] += m * other.d[k];
+            nz[k] += long(m) * other.nz[k];
+        }
+    }
+
+    // Write xi = n/d to xi, and return the sum of the weights, treating 0 as 1, just like
+    // BinnedCorr2._calculate_xi_from_pairs.
+    double finish(double* xi) const
+    {
+        double w = 0.;
+        for (size_t k=0; k<n.size(); ++k) {
+            double nk = n[k];
+            double dk = d[k];
+            if (nz[k] == 0) nk = dk = 0.;
+            if (dk == 0.) dk = 1.;
+            xi[k] = nk / dk;
+            w += dk;
+        }
+        return w;
+    }
+
+    std::vector<double> n;
+    std::vector<double> d;
+    std::vector<long> nz;
+};
+
+// The dense [npatch1, npatch2, nstat] arrays of the results for each pair of patches.
+struct PairTensor
+{
+    PairTensor(const double* _stat, const double* _weight, int _npatch1, int _npatch2,
+               int _nstat) :
+        stat(_stat), weight(_weight), npatch1(_npatch1), npatch2(_npatch2), nstat(_nstat)
+    {}
+
+    // The number of patches along the axis that the rows of the design matrix use.
+    int npatch() const
+    { return npatch2 == 1 ? npatch1 : npatch2; }
+
+    // Whether both axes have patches.
+    bool square() const
+    {
+        if (npatch1 == 1 || npatch2 == 1) return false;
+        Assert(npatch1 == npatch2);
+        return true;
+    }
+
+    long index(int i, int j) const
+    { return (long(i) * npatch2 + j) * nstat; }
+
+    bool isZero(int i, int j) const
+    {
+        const double* wij = weight + index(i,j);
+        const double* sij = stat + index(i,j);
+        for (int k=0; k<nstat; ++k) if (wij[k] != 0. || sij[k] != 0.) return false;
+        return true;
+    }
+
+    void add(CovSums& sums, int i, int j, double m=1.) const
+    {
+        if (!isZero(i,j)) sums.add(stat + index(i,j), weight + index(i,j), m);
+    }
+
+    // The sums of the pairs whose first patch is i, or just the pair with patch i if one
+    // of the axes doesn't have patches.
+    void rowSum(CovSums& sums, int i) const
+    {
+        if (npatch2 == 1) add(sums, i, 0);
+        else if (npatch1 == 1) add(sums, 0, i);
+        else for (int j=0; j<npatch2; ++j) add(sums, i, j);
+    }
+
+    void rowSums(std::vector<CovSums>& rows) const
+    {
+        const int n = npatch();
+        rows.assign(n, CovSums(nstat));
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+        for (int i=0; i<n; ++i) rowSum(rows[i], i);
+    }
+
+    const double* stat;
+    const double* weight;
+    int npatch1;
+    int npatch2;
+    int nstat;
+};
+
+void CovJackknife(const double* stat, const double* weight,
+                  int npatch1, int npatch2, int nstat, double* xi, double* w)
+{
+    dbg<<"Start CovJackknife: "<<npatch1<<" "<<npatch2<<" "<<nstat<<std::endl;
+    PairTensor t(stat, weight, npatch1, npatch2, nstat);
+    const int n = t.npatch();
+    const bool square = t.square();
+
+    // The sums of all the pairs that include patch i, which are left out of row i.
+    std::vector<CovSums> parts;
+    t.rowSums(parts);
+    CovSums total(nstat);
+    for (int i=0; i<n; ++i) total.add(parts[i]);
+    if (square) {
+        // Also the pairs where i is the second patch.
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+        for (int i=0; i<n; ++i) {
+            for (int j=0; j<n; ++j) if (j != i) t.add(parts[i], j, i);
+        }
+    }
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (int i=0; i<n; ++i) {
+        CovSums sums = total;
+        sums.add(parts[i], -1.);
+        w[i] = sums.finish(xi + long(i) * nstat);
+    }
+}
+
+void CovSample(const double* stat, const double* weight,
+               int npatch1, int npatch2, int nstat, double* xi, double* w)
+{
+    dbg<<"Start CovSample: "<<npatch1<<" "<<npatch2<<" "<<nstat<<std::endl;
+    PairTensor t(stat, weight, npatch1, npatch2, nstat);
+    std::vector<CovSums> rows;
+    t.rowSums(rows);
+    for (int i=0; i<t.npatch(); ++i) w[i] = rows[i].finish(xi + long(i) * nstat);
+}
+
+void CovBootstrap(const double* stat, const double* weight,
+                  int npatch1, int npatch2, int nstat,
+                  const double* cnt, int nboot, int marked, double* xi, double* w)
+{
+    dbg<<"Start CovBootstrap: "<<npatch1<<" "<<npatch2<<" "<<nstat<<" "<<nboot<<" "<<
+        marked<<std::endl;
+    PairTensor t(stat, weight, npatch1, npatch2, nstat);
+    const int n = t.npatch();
+    const bool cross_terms = t.square() && !marked;
+
+    // If not using the cross terms, each row is a weighted sum of the row sums.  Otherwise,
+    // the diagonal pairs are used once for each selection, and the others are used cnt[i]
+    // cnt[j] times, so keep a list of the non-zero ones to skip the rest.
+    std::vector<CovSums> rows;
+    std::vector<std::vector<int> > nonzero;
+    if (cross_terms) {
+        nonzero.resize(n);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+        for (int i=0; i<n; ++i) {
+            for (int j=0; j<n; ++j) if (j != i && !t.isZero(i,j)) nonzero[i].push_back(j);
+        }
+    } else {
+        t.rowSums(rows);
+    }
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for (int b=0; b<nboot; ++b) {
+        const double* cb = cnt + long(b) * n;
+        CovSums sums(nstat);
+        for (int i=0; i<n; ++i) {
+            if (cb[i] == 0.) continue;
+            if (!cross_terms) {
+                sums.add(rows[i], cb[i]);
+            } else {
+                t.add(sums, i, i, cb[i]);
+                const std::vector<int>& nz = nonzero[i];
+                for (size_t k=0; k<nz.size(); ++k) {
+                    const int j = nz[k];
+                    if (cb[j] != 0.) t.add(sums, i, j, cb[i] * cb[j]);
+                }
+            }
+        }
+        w[b] = sums.finish(xi + long(b) * nstat);
+    }
+}
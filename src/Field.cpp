@@ -15,9 +15,63 @@
 //#define DEBUGLOGGING
 
 #include <cstddef>  // for ptrdiff_t
+#include <cstring>
+#include <limits>
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <string>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
 #include "Field.h"
 #include "Cell.h"
+#include "Bounds.h"
 #include "dbg.h"
+#include "WallTime.h"
+#include "NumaDomains.h"
+#include "ThreadBudget.h"
+#include "Trace.h"
+
+#ifdef _OPENMP
+#include "omp.h"
+#endif
+
+// cf. NumaDomains.h.  1 means to ignore the domains, which is the default.
+static int numa_domains = 1;
+
+int GetNumaDomains() { return numa_domains; }
+void SetNumaDomains(int n) { numa_domains = std::max(n, 1); }
+
+int PinThreads()
+{
+#if defined(__linux__) && defined(_OPENMP)
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return 0;
+    std::vector<int> cpus;
+    for (int cpu=0; cpu<CPU_SETSIZE; ++cpu) if (CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+    if (cpus.empty()) return 0;
+    int npinned = 0;
+#pragma omp parallel reduction(+:npinned)
+    {
+        // OpenMP reuses the same threads for each parallel region of the same size, so they
+        // stay pinned for the later ones.
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        CPU_SET(cpus[omp_get_thread_num() % cpus.size()], &mask);
+        if (sched_setaffinity(0, sizeof(mask), &mask) == 0) npinned = 1;
+    }
+    dbg<<"Pinned "<<npinned<<" threads to "<<cpus.size()<<" cpus\n";
+    return npinned;
+#else
+    return 0;
+#endif
+}
 
 // This function just works on the top level data to figure out which data goes into
 // each top-level Cell.  It is building up the top_* vectors, which can then be used
@@ -26,7 +80,7 @@ template <int D, int C, int SM>
 double SetupTopLevelCells(
     std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& celldata,
     double maxsizesq, size_t start, size_t end, int mintop, int maxtop,
-    std::vector<CellData<D,C>*>& top_data,
+    std::vector<CellData<D,C> >& top_data,
     std::vector<double>& top_sizesq,
     std::vector<size_t>& top_start, std::vector<size_t>& top_end)
 {
@@ -37,38 +91,37 @@ double SetupTopLevelCells(
     // The difference is that here we only construct a new Cell (and do the corresponding
     // calculation of the averages) if the size is small enough.  At that point, the
     // rest of the construction is passed onto the Cell class.
-    CellData<D,C>* ave;
+    CellData<D,C> ave;
     double sizesq;
     if (end-start == 1) {
         xdbg<<"Only 1 CellData entry: size = 0\n";
-        ave = celldata[start].first;
-        celldata[start].first = 0; // Make sure the calling function doesn't delete this!
+        ave = *celldata[start].first;
         sizesq = 0.;
     } else {
-        ave = new CellData<D,C>(celldata,start,end);
-        xdbg<<"ave pos = "<<ave->getPos()<<std::endl;
-        xdbg<<"n = "<<ave->getN()<<std::endl;
-        xdbg<<"w = "<<ave->getW()<<std::endl;
-        sizesq = CalculateSizeSq(ave->getPos(),celldata,start,end);
+        ave = CellData<D,C>(celldata,start,end);
+        xdbg<<"ave pos = "<<ave.getPos()<<std::endl;
+        xdbg<<"n = "<<ave.getN()<<std::endl;
+        xdbg<<"w = "<<ave.getW()<<std::endl;
+        sizesq = CalculateSizeSq(ave.getPos(),celldata,start,end);
         xdbg<<"size = "<<sqrt(sizesq)<<std::endl;
     }
 
     if (sizesq == 0 || (sizesq <= maxsizesq && mintop<=0)) {
         xdbg<<"Small enough.  Make a cell.\n";
-        if (end-start > 1) ave->finishAverages(celldata,start,end);
+        if (end-start > 1) ave.finishAverages(celldata,start,end);
         top_data.push_back(ave);
         top_sizesq.push_back(sizesq);
         top_start.push_back(start);
         top_end.push_back(end);
     } else if (maxtop <= 0) {
         xdbg<<"At specified end of top layer recusion\n";
-        if (end-start > 1) ave->finishAverages(celldata,start,end);
+        if (end-start > 1) ave.finishAverages(celldata,start,end);
         top_data.push_back(ave);
         top_sizesq.push_back(sizesq);
         top_start.push_back(start);
         top_end.push_back(end);
     } else {
-        size_t mid = SplitData<D,C,SM>(celldata,start,end,ave->getPos());
+        size_t mid = SplitData<D,C,SM>(celldata,start,end,ave.getPos());
         xdbg<<"Too big.  Recurse with mid = "<<mid<<std::endl;
         SetupTopLevelCells<D,C,SM>(celldata, maxsizesq, start, mid, mintop-1, maxtop-1,
                                    top_data, top_sizesq, top_start, top_end);
@@ -78,96 +131,134 @@ double SetupTopLevelCells(
     return sizesq;
 }
 
-// A helper struct to build the right kind of CellData object
-template <int D, int C>
-struct CellDataHelper;
-
-// Specialize for each D,C
-template <>
-struct CellDataHelper<NData,Flat>
-{
-    static CellData<NData,Flat>* build(double x, double y, double,
-                                       double , double , double, double w)
-    { return new CellData<NData,Flat>(Position<Flat>(x,y), w); }
-};
-template <>
-struct CellDataHelper<KData,Flat>
-{
-    static CellData<KData,Flat>* build(double x, double y, double,
-                                       double , double , double k, double w)
-    { return new CellData<KData,Flat>(Position<Flat>(x,y), k, w); }
-};
-template <>
-struct CellDataHelper<GData,Flat>
+inline WPosLeafInfo get_wpos(double* wpos, double* w, long i)
 {
-    static CellData<GData,Flat>* build(double x, double y,  double,
-                                       double g1, double g2, double, double w)
-    { return new CellData<GData,Flat>(Position<Flat>(x,y), std::complex<double>(g1,g2), w); }
-};
+    WPosLeafInfo wp;
+    wp.wpos = wpos ? wpos[i] : w[i];
+    wp.index = i;
+    return wp;
+}
 
+// Helpers for putting the objects in Morton (Z-order) order, so objects that are close together
+// are also close together in memory.
+// Spread the bits of x out so there is one empty bit between each of them.
+inline unsigned long long SpreadBits2(unsigned long long x)
+{
+    x &= 0xffffffffULL;
+    x = (x | (x << 16)) & 0x0000ffff0000ffffULL;
+    x = (x | (x << 8)) & 0x00ff00ff00ff00ffULL;
+    x = (x | (x << 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    x = (x | (x << 2)) & 0x3333333333333333ULL;
+    x = (x | (x << 1)) & 0x5555555555555555ULL;
+    return x;
+}
 
-template <>
-struct CellDataHelper<NData,ThreeD>
+// Spread the lower 21 bits of x out so there are two empty bits between each of them.
+inline unsigned long long SpreadBits3(unsigned long long x)
 {
-    static CellData<NData,ThreeD>* build(double x, double y, double z,
-                                         double , double , double, double w)
-    { return new CellData<NData,ThreeD>(Position<ThreeD>(x,y,z), w); }
-};
-template <>
-struct CellDataHelper<KData,ThreeD>
+    x &= 0x1fffffULL;
+    x = (x | (x << 32)) & 0x1f00000000ffffULL;
+    x = (x | (x << 16)) & 0x1f0000ff0000ffULL;
+    x = (x | (x << 8)) & 0x100f00f00f00f00fULL;
+    x = (x | (x << 4)) & 0x10c30c30c30c30c3ULL;
+    x = (x | (x << 2)) & 0x1249249249249249ULL;
+    return x;
+}
+
+template <int C>
+struct MortonHelper
 {
-    static CellData<KData,ThreeD>* build(double x, double y, double z,
-                                         double , double , double k, double w)
-    { return new CellData<KData,ThreeD>(Position<ThreeD>(x,y,z), k, w); }
+    // ThreeD and Sphere use the 3D Morton code with 21 bits per dimension.
+    static double maxGrid() { return double((1<<21) - 1); }
+    static double getExtent(const Bounds<C>& b)
+    {
+        return std::max(std::max(b.getXMax()-b.getXMin(), b.getYMax()-b.getYMin()),
+                        b.getZMax()-b.getZMin());
+    }
+    static unsigned long long getKey(const Position<C>& p, const Bounds<C>& b, double scale)
+    {
+        return (SpreadBits3((unsigned long long)((p.getX()-b.getXMin()) * scale)) |
+                (SpreadBits3((unsigned long long)((p.getY()-b.getYMin()) * scale)) << 1) |
+                (SpreadBits3((unsigned long long)((p.getZ()-b.getZMin()) * scale)) << 2));
+    }
 };
+
 template <>
-struct CellDataHelper<GData,ThreeD>
+struct MortonHelper<Flat>
 {
-    static CellData<GData,ThreeD>* build(double x, double y, double z,
-                                         double g1, double g2, double, double w)
-    { return new CellData<GData,ThreeD>(Position<ThreeD>(x,y,z), std::complex<double>(g1,g2), w); }
+    // Flat uses the 2D Morton code with 32 bits per dimension.
+    static double maxGrid() { return 4294967295.; }
+    static double getExtent(const Bounds<Flat>& b)
+    { return std::max(b.getXMax()-b.getXMin(), b.getYMax()-b.getYMin()); }
+    static unsigned long long getKey(const Position<Flat>& p, const Bounds<Flat>& b,
+                                     double scale)
+    {
+        return (SpreadBits2((unsigned long long)((p.getX()-b.getXMin()) * scale)) |
+                (SpreadBits2((unsigned long long)((p.getY()-b.getYMin()) * scale)) << 1));
+    }
 };
 
+typedef std::pair<unsigned long long, long> MortonKey;
 
-// Sphere
-template <>
-struct CellDataHelper<NData,Sphere>
-{
-    static CellData<NData,Sphere>* build(double x, double y, double z,
-                                         double , double , double, double w)
-    { return new CellData<NData,Sphere>(Position<Sphere>(x,y,z), w); }
-};
-template <>
-struct CellDataHelper<KData,Sphere>
-{
-    static CellData<KData,Sphere>* build(double x, double y, double z,
-                                         double , double , double k, double w)
-    { return new CellData<KData,Sphere>(Position<Sphere>(x,y,z), k, w); }
-};
-template <>
-struct CellDataHelper<GData,Sphere>
+// Sort keys in parallel: each thread sorts a chunk, and then the chunks are merged in pairs.
+inline void ParallelSort(std::vector<MortonKey>& keys)
 {
-    static CellData<GData,Sphere>* build(double x, double y, double z,
-                                         double g1, double g2, double, double w)
-    { return new CellData<GData,Sphere>(Position<Sphere>(x,y,z), std::complex<double>(g1,g2), w); }
-};
+    const long n = keys.size();
+    int nchunk = 1;
+#ifdef _OPENMP
+    // Only bother with multiple chunks if there are enough to make it worthwhile.
+    if (n > 100000) nchunk = omp_get_max_threads();
+#endif
+    std::vector<long> bounds(nchunk+1);
+    for (int i=0; i<=nchunk; ++i) bounds[i] = n * i / nchunk;
 
-inline WPosLeafInfo get_wpos(double* wpos, double* w, long i)
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (int i=0; i<nchunk; ++i)
+        std::sort(keys.begin()+bounds[i], keys.begin()+bounds[i+1]);
+
+    for (int step=1; step<nchunk; step*=2) {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+        for (int i=0; i<nchunk-step; i+=2*step) {
+            long mid = bounds[i+step];
+            long end = bounds[std::min(i+2*step, nchunk)];
+            std::inplace_merge(keys.begin()+bounds[i], keys.begin()+mid, keys.begin()+end);
+        }
+    }
+}
+
+// When the cells are spilled to a file, the ones with at least this many objects are still kept
+// in memory.  These are the top few levels of each tree, which every traversal goes through.
+// Below this, the subtrees are contiguous in the file, since the trees are built depth first,
+// so a traversal that goes into one only needs a few pages of the file.
+const size_t SPILL_RESIDENT_NOBJ = 1024;
+
+template <int D, int C>
+void Field<D,C>::setupSpill(const char* spill_dir)
 {
-    WPosLeafInfo wp;
-    wp.wpos = wpos ? wpos[i] : w[i];
-    wp.index = i;
-    return wp;
+    dbg<<"Field cells will be spilled to "<<spill_dir<<std::endl;
+    _spill = new SpillFile(spill_dir);
+    _arena.spillTo(_spill, SPILL_RESIDENT_NOBJ);
+    _leaf_arena.spillTo(_spill, SPILL_RESIDENT_NOBJ);
 }
 
 template <int D, int C>
 Field<D,C>::Field(double* x, double* y, double* z, double* g1, double* g2, double* k,
                   double* w, double* wpos, long nobj,
                   double minsize, double maxsize,
-                  SplitMethod sm, bool brute, int mintop, int maxtop) :
+                  SplitMethod sm, bool brute, int mintop, int maxtop, bool share_leaves,
+                  bool lazy, bool presort, const char* spill_dir) :
     _nobj(nobj), _minsize(minsize), _maxsize(maxsize), _sm(sm),
-    _brute(brute), _mintop(mintop), _maxtop(maxtop)
+    _brute(brute), _mintop(mintop), _maxtop(maxtop), _spill(0), _shared(0), _leaves(0),
+    _lazy(lazy), _presort(presort),
+    _init_time(0.), _top_time(0.), _cells_time(0.)
 {
+    TraceScope trace("field init", nobj);
+    double t0 = WallTime();
+    if (spill_dir && spill_dir[0]) setupSpill(spill_dir);
     //set_verbose(2);
     dbg<<"Starting to Build Field with "<<nobj<<" objects\n";
     xdbg<<"D,C = "<<D<<','<<C<<std::endl;
@@ -175,31 +266,235 @@ Field<D,C>::Field(double* x, double* y, double* z, double* g1, double* g2, doubl
     for(int i=0;i<5;++i) {
         xdbg<<x[i]<<"  "<<y[i]<<"  "<<(z?z[i]:0)<<"  "<<g1[i]<<"  "<<g2[i]<<"  "<<k[i]<<"  "<<w[i]<<"  "<<(wpos?wpos[i]:0)<<std::endl;
     }
-
-    _celldata.reserve(nobj);
-    if (z) {
-        for(long i=0;i<nobj;++i) {
-            WPosLeafInfo wp = get_wpos(wpos,w,i);
-            _celldata.push_back(std::make_pair(
-                    CellDataHelper<D,C>::build(x[i],y[i],z[i],g1[i],g2[i],k[i],w[i]),
-                    wp));
-        }
-    } else {
-        Assert(C == Flat);
-        for(long i=0;i<nobj;++i) {
-            WPosLeafInfo wp = get_wpos(wpos,w,i);
-            _celldata.push_back(std::make_pair(
-                    CellDataHelper<D,C>::build(x[i],y[i],0.,g1[i],g2[i],k[i],w[i]),
-                    wp));
-        }
-    }
+    SetupCellData(x, y, z, g1, g2, k, w, wpos, nobj, 0, share_leaves);
+    if (_presort) PresortCellData(share_leaves);
     dbg<<"Built celldata with "<<_celldata.size()<<" entries\n";
 
     // Calculate the overall center and size
+    // Note: These accumulations are done in parallel when nobj is large.
     CellData<D,C> ave(_celldata, 0, _celldata.size());
     ave.finishAverages(_celldata, 0, _celldata.size());
     _center = ave.getPos();
     _sizesq = CalculateSizeSq(_center, _celldata, 0, _celldata.size());
+    _init_time = WallTime() - t0;
+    dbg<<"Field init time = "<<_init_time<<std::endl;
+}
+
+// Add the indices of the objects in cell to indices, in the order of the leaves.
+template <int D, int C>
+void CollectIndices(const Cell<D,C>* cell, std::vector<long>& indices)
+{
+    if (cell->getLeft()) {
+        CollectIndices(cell->getLeft(), indices);
+        CollectIndices(cell->getRight(), indices);
+    } else if (cell->getN() == 1) {
+        indices.push_back(cell->getInfo().index);
+    } else {
+        cell->getListInfo().appendTo(cell->getN(), indices);
+    }
+}
+
+template <int D, int C> template <int D2>
+Field<D,C>::Field(const Field<D2,C>& src, double* x, double* y, double* z,
+                  double* g1, double* g2, double* k, double* w, double* wpos) :
+    _nobj(src._nobj), _minsize(src._minsize), _maxsize(src._maxsize), _sm(src._sm),
+    _brute(src._brute), _mintop(src._mintop), _maxtop(src._maxtop),
+    _center(src._center), _sizesq(src._sizesq), _spill(0), _shared(0), _leaves(0),
+    _lazy(false), _presort(src._presort),
+    _init_time(0.), _top_time(0.), _cells_time(0.)
+{
+    TraceScope trace("field from tree", src._nobj);
+    double t0 = WallTime();
+    // Use the same kind of storage as src.
+    if (src._spill) setupSpill(src._spill->getDir().c_str());
+    dbg<<"Starting to Build Field with "<<_nobj<<" objects from the tree of another Field\n";
+    xdbg<<"D,C = "<<D<<','<<C<<" from D = "<<D2<<std::endl;
+    const std::vector<Cell<D2,C>*>& src_cells = src.getCells();
+    SetupCellData(x, y, z, g1, g2, k, w, wpos, _nobj, 0, false);
+    _init_time = WallTime() - t0;
+
+    // The objects under each top-level cell of src are copied into the order of its leaves,
+    // and then the new Cells can each be calculated from a contiguous range of them.
+    double t1 = WallTime();
+    const ptrdiff_t n = src_cells.size();
+    _cells.resize(n);
+    _top_arenas.resize(n);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for(ptrdiff_t i=0;i<n;++i) {
+        std::vector<long> indices;
+        indices.reserve(src_cells[i]->getN());
+        CollectIndices(src_cells[i], indices);
+        std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> > vdata(indices.size());
+        for (size_t j=0; j<indices.size(); ++j) {
+            Assert(indices[j] >= 0 && indices[j] < _nobj);
+            vdata[j] = _celldata[indices[j]];
+        }
+        size_t nbytes = 2 * vdata.size() * sizeof(Cell<D,C>);
+        Arena* arena = new Arena(Arena::BlockSizeFor(nbytes));
+        if (_spill) arena->spillTo(_spill, SPILL_RESIDENT_NOBJ);
+        _top_arenas[i] = arena;
+        _cells[i] = CopyCell(src_cells[i], vdata, 0, *arena);
+    }
+
+    // As in DoBuildCells, the input CellData aren't needed anymore.
+    std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >().swap(_celldata);
+    _arena.clear();
+    _cells_time = WallTime() - t1;
+    dbg<<"Done building Field from tree: "<<_init_time<<" + "<<_cells_time<<" seconds\n";
+}
+
+template <int D, int C>
+void Field<D,C>::SetupCellData(double* x, double* y, double* z, double* g1, double* g2, double* k,
+                               double* w, double* wpos, long nobj, long first_index,
+                               bool share_leaves)
+{
+    if (!z) Assert(C == Flat);
+
+    // All the input CellData objects are allocated as a single contiguous block from the arena.
+    // If share_leaves, we instead build the leaf Cell for each object directly from the input
+    // arrays, and the CellData used for building the tree are the ones in these leaves.
+    // This avoids having a second temporary copy of every object while building the tree.
+    // The leaves are left in the input order though, rather than in depth-first order with
+    // the rest of the tree, and they are all kept, even if min_size means some aren't used.
+    CellData<D,C>* leafdata = 0;
+    if (share_leaves) {
+        Assert(first_index == 0);
+        _leaves = static_cast<Cell<D,C>*>(_leaf_arena.allocate(nobj * sizeof(Cell<D,C>)));
+    } else {
+        leafdata = static_cast<CellData<D,C>*>(_arena.allocate(nobj * sizeof(CellData<D,C>)));
+    }
+    _celldata.resize(nobj);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for(long i=0;i<nobj;++i) {
+        double zi = z ? z[i] : 0.;
+        WPosLeafInfo wp = get_wpos(wpos,w,i);
+        wp.index += first_index;
+        if (_leaves) {
+            CellData<D,C> data;
+            CellDataHelper<D,C>::build(x[i],y[i],zi,g1[i],g2[i],k[i],w[i], &data);
+            Cell<D,C>* leaf = new (_leaves+i) Cell<D,C>(data, wp);
+            // The building functions only read the CellData, so the const_cast is safe.
+            _celldata[i] = std::make_pair(const_cast<CellData<D,C>*>(&leaf->getData()), wp);
+        } else {
+            _celldata[i] = std::make_pair(
+                CellDataHelper<D,C>::build(x[i],y[i],zi,g1[i],g2[i],k[i],w[i], leafdata+i), wp);
+        }
+    }
+}
+
+template <int D, int C>
+void Field<D,C>::PresortCellData(bool share_leaves)
+{
+    const long n = _celldata.size();
+    if (n <= 1) return;
+    dbg<<"Start PresortCellData for "<<n<<" objects\n";
+
+    // Find the bounds of the objects.
+    Bounds<C> b;
+#ifdef _OPENMP
+#pragma omp parallel
+    {
+        Bounds<C> b1;
+#pragma omp for schedule(static)
+        for (long i=0; i<n; ++i) b1 += _celldata[i].first->getPos();
+#pragma omp critical
+        {
+            b += b1;
+        }
+    }
+#else
+    for (long i=0; i<n; ++i) b += _celldata[i].first->getPos();
+#endif
+    double extent = MortonHelper<C>::getExtent(b);
+    double scale = extent > 0. ? MortonHelper<C>::maxGrid() / extent : 0.;
+
+    std::vector<MortonKey> keys(n);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (long i=0; i<n; ++i) {
+        keys[i].first = MortonHelper<C>::getKey(_celldata[i].first->getPos(), b, scale);
+        keys[i].second = i;
+    }
+    ParallelSort(keys);
+
+    // Put the _celldata entries in the sorted order.  Unless the CellData are in the shared
+    // leaves (whose location is fixed by the object index), also put the CellData themselves in
+    // that order, so they are laid out in memory the same way.  They are the contiguous block
+    // from SetupCellData, so they are copied to a temporary arena and back into the block in
+    // the new order, rather than into a second block in _arena that would last as long as it.
+    std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> > sorted(n);
+    CellData<D,C>* block = share_leaves ? 0 : _celldata[0].first;
+    Arena tmp(Arena::BlockSizeFor(block ? n * sizeof(CellData<D,C>) : 0));
+    CellData<D,C>* tmp_data = 0;
+    if (block)
+        tmp_data = static_cast<CellData<D,C>*>(tmp.allocate(n * sizeof(CellData<D,C>)));
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (long i=0; i<n; ++i) {
+        const std::pair<CellData<D,C>*,WPosLeafInfo>& cd = _celldata[keys[i].second];
+        if (block) {
+            Assert(cd.first == block + keys[i].second);
+            new (tmp_data+i) CellData<D,C>(*cd.first);
+            sorted[i] = std::make_pair(block+i, cd.second);
+        } else {
+            sorted[i] = cd;
+        }
+    }
+    if (block) {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for (long i=0; i<n; ++i) block[i] = tmp_data[i];
+    }
+    _celldata.swap(sorted);
+}
+
+template <int D, int C>
+void Field<D,C>::append(double* x, double* y, double* z, double* g1, double* g2, double* k,
+                        double* w, double* wpos, long nobj)
+{
+    // Finish building the existing cells first, so _celldata is free for the new objects.
+    BuildCells();
+    dbg<<"Start Field::append with "<<nobj<<" objects\n";
+    if (nobj <= 0) return;
+
+    // The new objects get the indices following the current ones.
+    TraceScope trace("field append", nobj);
+    double t0 = WallTime();
+    SetupCellData(x, y, z, g1, g2, k, w, wpos, nobj, _nobj, false);
+    if (_presort) PresortCellData(false);
+    _nobj += nobj;
+
+    // Update the overall center and size to include the new objects.  The new center is the
+    // weighted mean of the two centers, and the new size is an upper bound on the distance to
+    // any object, based on the two sizes.
+    CellData<D,C> ave(_celldata, 0, nobj);
+    double sizesq = CalculateSizeSq(ave.getPos(), _celldata, 0, nobj);
+    double w1 = 0.;
+    for (size_t i=0; i<_cells.size(); ++i) w1 += _cells[i]->getW();
+    double w2 = ave.getW();
+    if (w1 + w2 != 0.) {
+        Position<C> center = _center;
+        center *= w1 / (w1 + w2);
+        Position<C> center2 = ave.getPos();
+        center2 *= w2 / (w1 + w2);
+        center += center2;
+        center.normalize();
+        double s1 = std::sqrt(_sizesq) + (center - _center).norm();
+        double s2 = std::sqrt(sizesq) + (center - ave.getPos()).norm();
+        _sizesq = SQR(std::max(s1,s2));
+        _center = center;
+    }
+    _init_time += WallTime() - t0;
+
+    // The new objects are built into their own top-level cells the next time the cells are
+    // needed.  The existing trees aren't changed.
 }
 
 template <int D, int C>
@@ -207,6 +502,7 @@ void Field<D,C>::BuildCells() const
 {
     // Signal that we already built the cells.
     if (_celldata.size() == 0) return;
+    PhaseThreads threads(BuildPhase);
 
     switch (_sm) {
       case MIDDLE:
@@ -243,283 +539,1357 @@ void Field<D,C>::DoBuildCells() const
     // Then we build them and their sub-nodes.
 
     // Setup the top level cells:
-    std::vector<CellData<D,C>*> top_data;
+    // Note: This part is serial, but the accumulations at each step are done in parallel
+    // for the large cells near the top.
+    double t0 = WallTime();
+    std::vector<CellData<D,C> > top_data;
     std::vector<double> top_sizesq;
     std::vector<size_t> top_start;
     std::vector<size_t> top_end;
 
-    SetupTopLevelCells<D,C,SM>(_celldata, maxsizesq, 0, _celldata.size(), _mintop, _maxtop,
-                               top_data, top_sizesq, top_start, top_end);
+    {
+        TraceScope trace("field top cells", _celldata.size());
+        SetupTopLevelCells<D,C,SM>(_celldata, maxsizesq, 0, _celldata.size(), _mintop, _maxtop,
+                                   top_data, top_sizesq, top_start, top_end);
+    }
     const ptrdiff_t n = top_data.size();
+    double t1 = WallTime();
 
     // Now build the lower cells in parallel
+    // Note: BuildCell also spawns OpenMP tasks for large sub-cells, so threads that finish
+    // early will help with the remaining ones when there are only a few top-level cells.
     dbg<<"Field has "<<n<<" top-level nodes.  Building lower nodes...\n";
-    _cells.resize(n);
+    // Note: If objects were appended, there are already some Cells, and these are added to them.
+    const ptrdiff_t n0 = _cells.size();
+    _cells.resize(n0 + n);
+    _top_arenas.resize(n0 + n);
+    _domains.resize(n0 + n, -1);
+
+    // With NUMA domains, the cells are assigned to the domains in contiguous blocks, since
+    // the top-level cells are in spatial order.  Each one is built by one of the threads of
+    // its domain, unless they are all busy with others and some other thread is idle.
+    // Either way, we record the domain of the thread that built it.
+    const int ndomains = GetNumaDomains();
+    std::vector<int> build_domain(n, -1);
+    if (ndomains > 1) {
+        for (ptrdiff_t i=0;i<n;++i) build_domain[i] = int(long(i) * ndomains / n);
+    }
+    DomainQueue queue(ndomains, build_domain, 0, n);
+
+    // If building lazily, the lower cells are built from this copy of _celldata when
+    // they are needed, so it has to stay around.
+    std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >* vdata = &_celldata;
+    if (_lazy) {
+        vdata = new std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >();
+        vdata->swap(_celldata);
+        _lazy_celldata.push_back(vdata);
+    }
 #ifdef _OPENMP
-#pragma omp parallel for
+#pragma omp parallel
+    {
+        const int domain = CurrentThreadDomain(ndomains);
+#pragma omp for schedule(dynamic)
+#else
+    {
+        const int domain = 0;
 #endif
-    for(ptrdiff_t i=0;i<n;++i) {
-        _cells[i] = BuildCell<D,C,SM>(_celldata, minsizesq, _brute,
-                                      top_start[i], top_end[i],
-                                      top_data[i], top_sizesq[i]);
-        xdbg<<i<<": "<<_cells[i]->getN()<<"  "<<_cells[i]->getW()<<"  "<<
-            _cells[i]->getPos()<<"  "<<_cells[i]->getSize()<<"  "<<_cells[i]->getSizeSq()<<std::endl;
+    for(ptrdiff_t m=0;m<n;++m) {
+        const ptrdiff_t i = queue.next(domain);
+        TraceScope trace("build top cell", i);
+        _domains[n0+i] = ndomains > 1 ? domain : -1;
+        // Each top-level cell gets its own arena, so the threads don't need to coordinate.
+        // A tree with N leaves has at most 2N-1 Cells.
+        size_t ntop = top_end[i] - top_start[i];
+        size_t nbytes = 2 * ntop * sizeof(Cell<D,C>);
+        Arena* arena = new Arena(Arena::BlockSizeFor(nbytes));
+        if (_spill) arena->spillTo(_spill, SPILL_RESIDENT_NOBJ);
+        _top_arenas[n0+i] = arena;
+        LazyBuilder<D,C>* lazy = 0;
+        if (_lazy) {
+            lazy = new (*arena) LazyBuilder<D,C>();
+            lazy->vdata = vdata;
+            lazy->minsizesq = minsizesq;
+            lazy->brute = _brute;
+            lazy->sm = _sm;
+            lazy->arena = arena;
+            lazy->leaves = _leaves;
+            lazy->lock.locked = 0;
+        }
+        _cells[n0+i] = BuildCell<D,C,SM>(*vdata, minsizesq, _brute,
+                                         top_start[i], top_end[i], *arena,
+                                         &top_data[i], top_sizesq[i], _leaves, lazy);
+        xdbg<<i<<": "<<_cells[n0+i]->getN()<<"  "<<_cells[n0+i]->getW()<<"  "<<
+            _cells[n0+i]->getPos()<<"  "<<_cells[n0+i]->getSize()<<"  "<<
+            _cells[n0+i]->getSizeSq()<<std::endl;
+    }
     }
 
-    // delete any CellData elements that didn't get kept in the _cells object.
-    for (size_t i=0;i<_celldata.size();++i) if (_celldata[i].first) delete _celldata[i].first;
+    // The Cells have their own copies of the CellData, so we don't need the input CellData
+    // objects anymore.  (The shared leaves are now part of the tree, so they stay in
+    // _leaf_arena, but we don't need to keep track of them separately anymore.)
+    // If building lazily, the input CellData are still needed, so they stay in _arena until
+    // the Field is destroyed.
     //set_verbose(1);
-    _celldata.clear();
+    std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >().swap(_celldata);
+    if (!_lazy) _arena.clear();
+    _leaves = 0;
+    _top_time += t1 - t0;
+    _cells_time += WallTime() - t1;
+    dbg<<"Field build times: top = "<<_top_time<<", cells = "<<_cells_time<<std::endl;
 }
 
 template <int D, int C>
 Field<D,C>::~Field()
 {
-    for (size_t i=0; i<_cells.size(); ++i) delete _cells[i];
-    // If this is still around, need to delete those too.
-    for (size_t i=0; i<_celldata.size(); ++i) if (_celldata[i].first) delete _celldata[i].first;
+    // All the Cells are in the arenas, so there is no need to traverse the trees.
+    // (And if the Cells were never built, the input CellData are in _arena.)
+    for (size_t i=0; i<_top_arenas.size(); ++i) delete _top_arenas[i];
+    for (size_t i=0; i<_lazy_celldata.size(); ++i) delete _lazy_celldata[i];
+    // The other arenas may also use the spill file, so clear them before closing it.
+    _arena.clear();
+    _leaf_arena.clear();
+    delete _spill;
+    if (_shared) ReleaseSharedSegment(_shared);
 }
 
 template <int D, int C>
-long CountNear(const Cell<D,C>* cell, const Position<C>& pos, double sep, double sepsq)
+size_t Field<D,C>::getMemoryNBytes() const
 {
-    double s = cell->getSize();
-    const double dsq = (cell->getPos() - pos).normSq();
-    xdbg<<"CountNear: "<<cell->getPos()<<"  "<<pos<<"  "<<dsq<<"  "<<s<<"  "<<sepsq<<std::endl;
+    size_t n = sizeof(*this) + _arena.getMemoryNBytes() + _leaf_arena.getMemoryNBytes();
+    n += _top_arenas.capacity() * sizeof(Arena*) + _top_arenas.size() * sizeof(Arena);
+    for (size_t i=0; i<_top_arenas.size(); ++i) n += _top_arenas[i]->getMemoryNBytes();
+    n += _cells.capacity() * sizeof(Cell<D,C>*);
+    n += _celldata.capacity() * sizeof(_celldata[0]);
+    n += _lazy_celldata.capacity() * sizeof(_lazy_celldata[0]);
+    for (size_t i=0; i<_lazy_celldata.size(); ++i)
+        n += sizeof(*_lazy_celldata[i]) + _lazy_celldata[i]->capacity() * sizeof(_celldata[0]);
+    return n;
+}
 
-    // If s == 0, then just check dsq
-    if (s==0.) {
-        if (dsq <= sepsq) {
-            dbg<<"s==0, d < sep   N = "<<cell->getN()<<std::endl;
-            Assert(sqrt(dsq) <= sep);
-            return cell->getN();
-        }
-        else {
-            Assert(sqrt(dsq) > sep);
-            xdbg<<"s==0, d >= sep\n";
-            return 0;
-        }
-    } else {
-        // If d - s > sep, then no points are close enough.
-        if (dsq > sepsq && dsq > SQR(sep+s)) {
-            Assert(sqrt(dsq) - s > sep);
-            xdbg<<"d - s > sep: "<<sqrt(dsq)-s<<" > "<<sep<<std::endl;
-            return 0;
-        }
+template <int D, int C>
+size_t Field<D,C>::getSpillNBytes() const
+{
+    size_t n = _arena.getSpillNBytes() + _leaf_arena.getSpillNBytes();
+    for (size_t i=0; i<_top_arenas.size(); ++i) n += _top_arenas[i]->getSpillNBytes();
+    return n;
+}
 
-        // If d + s < sep, then all points are close enough.
-        if (dsq <= sepsq && s < sep && dsq <= SQR(sep-s)) {
-            Assert(sqrt(dsq) + s <= sep);
-            dbg<<"d + s <= sep: "<<sqrt(dsq)+s<<" <= "<<sep<<"  N = "<<cell->getN()<<std::endl;
-            return cell->getN();
-        }
+//
+// Writing a built Field to a file and reading it back in.
+//
+// The file is just a binary dump of the tree, so it should only be read back on the same
+// kind of machine (with the same version of TreeCorr) as the one that wrote it.
+// The layout is:
+//
+//     FieldFileHeader<D,C>
+//     long top[ntop]            The index in nodes of each top-level cell.
+//     FieldFileNode<D,C> nodes[ncells]
+//     long indices[nindices]    The object indices for leaves with more than one object.
+//
+// The nodes for each top-level cell are in depth-first order, so reading them back in
+// recovers the same memory layout as building the tree from scratch.
+//
 
-        // Otherwise check the subcells.
-        Assert(cell->getLeft());
-        Assert(cell->getRight());
-        xdbg<<"Recurse to subcells\n";
-        return (CountNear(cell->getLeft(), pos, sep, sepsq) +
-                CountNear(cell->getRight(), pos, sep, sepsq));
-    }
-}
+const char FIELD_FILE_MAGIC[8] = "TCField";
+const int FIELD_FILE_VERSION = 2;
 
 template <int D, int C>
-long Field<D,C>::countNear(double x, double y, double z, double sep) const
+struct FieldFileHeader
 {
-    BuildCells();  // Make sure this is done.
-    Position<C> pos(x,y,z);
-    double sepsq = sep*sep;
-    long ntot = 0;
-    dbg<<"Start countNear: "<<_cells.size()<<" top level cells\n";
-    for(size_t i=0; i<_cells.size(); ++i) {
-        dbg<<"Top level "<<i<<" with N="<<_cells[i]->getN()<<std::endl;
-        ntot += CountNear(_cells[i], pos, sep, sepsq);
-        dbg<<"ntot -> "<<ntot<<std::endl;
+    char magic[8];
+    int version;
+    int d;
+    int coords;
+    int node_size;
+
+    // The build parameters.
+    int sm;
+    int brute;
+    int mintop;
+    int maxtop;
+    double minsize;
+    double maxsize;
+    long nobj;
+    // A hash of the positions, weights and other values of the objects, which is calculated
+    // by the python layer.  Otherwise a file for a different catalog of the same size would
+    // look valid.
+    long data_hash;
+
+    Position<C> center;
+    double sizesq;
+
+    long ntop;
+    long ncells;
+    long nindices;
+};
+
+template <int D, int C>
+struct FieldFileNode
+{
+    CellData<D,C> data;
+    float size;
+    float sizesq;
+    long left;      // The index of the left child in nodes, or -1 for a leaf.
+    long right;     // The index of the right child for internal nodes.  For leaves, this is
+                    // the object index if N==1, or else the starting position in indices.
+};
+
+template <int D, int C>
+long AppendNode(const Cell<D,C>* cell, std::vector<FieldFileNode<D,C> >& nodes,
+                std::vector<long>& indices)
+{
+    FieldFileNode<D,C> node;
+    node.data = cell->getData();
+    node.size = cell->getSize();
+    node.sizesq = cell->getSizeSq();
+    node.left = node.right = -1;
+    long k = nodes.size();
+    nodes.push_back(node);
+    if (cell->getLeft()) {
+        node.left = AppendNode(cell->getLeft(), nodes, indices);
+        node.right = AppendNode(cell->getRight(), nodes, indices);
+    } else if (cell->getN() == 1) {
+        node.left = -1;
+        node.right = cell->getInfo().index;
+    } else {
+        node.left = -1;
+        node.right = indices.size();
+        cell->getListInfo().appendTo(cell->getN(), indices);
     }
-    return ntot;
+    // Note: nodes might have been reallocated by the recursion, so don't use a reference.
+    nodes[k] = node;
+    return k;
 }
 
+// The deepest tree MakeCell will read.  Real trees are nowhere near this deep, but a corrupt
+// file could describe a long chain of nodes, which would overflow the stack.
+const int FIELD_FILE_MAX_DEPTH = 10000;
+
 template <int D, int C>
-void GetNear(const Cell<D,C>* cell, const Position<C>& pos, double sep, double sepsq,
-             long* indices, long& k, long n)
+Cell<D,C>* MakeCell(const FieldFileHeader<D,C>& header, const FieldFileNode<D,C>* nodes,
+                    const long* indices, long k, Arena& arena, int depth=0)
 {
-    double s = cell->getSize();
-    const double dsq = (cell->getPos() - pos).normSq();
-    dbg<<"GetNear: "<<cell->getPos()<<"  "<<pos<<"  "<<dsq<<"  "<<s<<"  "<<sepsq<<std::endl;
-
-    // If s == 0, then just check dsq
-    if (s==0.) {
-        if (dsq <= sepsq) {
-            dbg<<"s==0, d < sep   N = "<<cell->getN()<<std::endl;
-            Assert(sqrt(dsq) <= sep);
-            Assert(k < n);
-            long n1 = cell->getN();
-            Assert(k + n1 <= n);
-            // This shouldn't happen, but if it does, we can get a seg fault, so check.
-            if (k + n1 > n) return;
-            if (n1 == 1) {
-                dbg<<"N == 1 case\n";
-                indices[k++] = cell->getInfo().index;
-            } else {
-                dbg<<"N > 1 case: "<<n1<<std::endl;
-                std::vector<long>* leaf_indices = cell->getListInfo().indices;
-                Assert(long(leaf_indices->size()) == n1);
-                for (long m=0; m<n1; ++m)
-                    indices[k++] = (*leaf_indices)[m];
-            }
-            Assert(k <= n);
+    if (k < 0 || k >= header.ncells || depth > FIELD_FILE_MAX_DEPTH)
+        throw std::runtime_error("Invalid node in field file");
+    const FieldFileNode<D,C>& node = nodes[k];
+    if (node.left < 0) {
+        long n = node.data.getN();
+        if (n == 1) {
+            LeafInfo info;
+            info.index = node.right;
+            return new (arena) Cell<D,C>(node.data, info);
         } else {
-            Assert(sqrt(dsq) > sep);
-            dbg<<"s==0, d >= sep\n";
+            if (node.right < 0 || node.right + n > header.nindices)
+                throw std::runtime_error("Invalid leaf in field file");
+            const long* leaf_indices = indices + node.right;
+            ListLeafInfo info;
+            info.allocate(n, *std::max_element(leaf_indices, leaf_indices + n), arena);
+            for (long i=0; i<n; ++i) info.set(i, leaf_indices[i]);
+            return new (arena) Cell<D,C>(node.data, info);
         }
     } else {
-        // If d - s > sep, then no points are close enough.
-        if (dsq > sepsq && dsq > SQR(sep+s)) {
-            Assert(sqrt(dsq) - s > sep);
-            dbg<<"d - s > sep: "<<sqrt(dsq)-s<<" > "<<sep<<std::endl;
-        } else {
-            // Otherwise check the subcells.
-            Assert(cell->getLeft());
-            Assert(cell->getRight());
-            dbg<<"Recurse to subcells\n";
-            GetNear(cell->getLeft(), pos, sep, sepsq, indices, k, n);
-            GetNear(cell->getRight(), pos, sep, sepsq, indices, k, n);
-        }
+        // Same depth-first order as BuildCell.  AppendNode writes the left child right after
+        // its parent and the right child after that, so anything else (e.g. a cycle) means
+        // the file is corrupt.
+        if (node.left != k+1 || node.right <= node.left)
+            throw std::runtime_error("Invalid node in field file");
+        void* mem = arena.allocate(sizeof(Cell<D,C>));
+        Cell<D,C>* l = MakeCell(header, nodes, indices, node.left, arena, depth+1);
+        Cell<D,C>* r = MakeCell(header, nodes, indices, node.right, arena, depth+1);
+        return new (mem) Cell<D,C>(node.data, node.size, node.sizesq, l, r);
     }
 }
 
 template <int D, int C>
-void Field<D,C>::getNear(double x, double y, double z, double sep, long* indices, long n) const
+void Field<D,C>::write(const char* file_name, long data_hash) const
 {
     BuildCells();  // Make sure this is done.
-    Position<C> pos(x,y,z);
-    double sepsq = sep*sep;
-    dbg<<"Start getNear: "<<_cells.size()<<" top level cells\n";
-    long k = 0;
-    for(size_t i=0; i<_cells.size(); ++i) {
-        dbg<<"Top level "<<i<<" with N="<<_cells[i]->getN()<<std::endl;
-        GetNear(_cells[i], pos, sep, sepsq, indices, k, n);
-        dbg<<"k -> "<<k<<std::endl;
+    dbg<<"Start Field::write "<<file_name<<std::endl;
+
+    std::vector<long> top(_cells.size());
+    std::vector<FieldFileNode<D,C> > nodes;
+    std::vector<long> indices;
+    for (size_t i=0; i<_cells.size(); ++i) top[i] = AppendNode(_cells[i], nodes, indices);
+
+    FieldFileHeader<D,C> header;
+    // Clear any padding, so the file contents are deterministic.
+    std::memset(static_cast<void*>(&header), 0, sizeof(header));
+    std::memcpy(header.magic, FIELD_FILE_MAGIC, sizeof(header.magic));
+    header.version = FIELD_FILE_VERSION;
+    header.d = D;
+    header.coords = C;
+    header.node_size = sizeof(FieldFileNode<D,C>);
+    header.sm = _sm;
+    header.brute = _brute;
+    header.mintop = _mintop;
+    header.maxtop = _maxtop;
+    header.minsize = _minsize;
+    header.maxsize = _maxsize;
+    header.nobj = _nobj;
+    header.data_hash = data_hash;
+    header.center = _center;
+    header.sizesq = _sizesq;
+    header.ntop = top.size();
+    header.ncells = nodes.size();
+    header.nindices = indices.size();
+
+    std::ofstream fout(file_name, std::ios::binary);
+    if (!fout) throw std::runtime_error("Unable to open field file for writing");
+    fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (top.size() > 0)
+        fout.write(reinterpret_cast<const char*>(&top[0]), top.size() * sizeof(long));
+    if (nodes.size() > 0)
+        fout.write(reinterpret_cast<const char*>(&nodes[0]),
+                   nodes.size() * sizeof(FieldFileNode<D,C>));
+    if (indices.size() > 0)
+        fout.write(reinterpret_cast<const char*>(&indices[0]), indices.size() * sizeof(long));
+    fout.close();
+    if (!fout) throw std::runtime_error("Error writing field file");
+    dbg<<"Wrote "<<nodes.size()<<" cells to "<<file_name<<std::endl;
+}
+
+// A read-only memory map of a file, which is unmapped when it goes out of scope.
+struct MappedFile
+{
+    void* base;
+    size_t nbytes;
+
+    MappedFile(const char* file_name) : base(MAP_FAILED), nbytes(0)
+    {
+        int fd = open(file_name, O_RDONLY);
+        if (fd < 0) throw std::runtime_error("Unable to open field file");
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            nbytes = st.st_size;
+            base = mmap(0, nbytes, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (base == MAP_FAILED) throw std::runtime_error("Unable to map field file");
+    }
+    ~MappedFile() { munmap(base, nbytes); }
+};
+
+template <int D, int C>
+Field<D,C>::Field(const char* file_name, long nobj, long data_hash,
+                  double minsize, double maxsize,
+                  SplitMethod sm, bool brute, int mintop, int maxtop) :
+    _nobj(nobj), _minsize(minsize), _maxsize(maxsize), _sm(sm),
+    _brute(brute), _mintop(mintop), _maxtop(maxtop), _spill(0), _shared(0), _leaves(0),
+    _lazy(false), _presort(false), _init_time(0.), _top_time(0.), _cells_time(0.)
+{
+    double t0 = WallTime();
+    dbg<<"Starting to read Field from "<<file_name<<std::endl;
+    MappedFile file(file_name);
+    if (file.nbytes < sizeof(FieldFileHeader<D,C>))
+        throw std::runtime_error("Invalid field file");
+    const char* p = static_cast<const char*>(file.base);
+    const FieldFileHeader<D,C>& header = *reinterpret_cast<const FieldFileHeader<D,C>*>(p);
+    if (std::memcmp(header.magic, FIELD_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != FIELD_FILE_VERSION || header.d != D || header.coords != C ||
+        header.node_size != int(sizeof(FieldFileNode<D,C>)))
+        throw std::runtime_error("Invalid field file");
+    if (header.nobj != nobj || header.minsize != minsize || header.maxsize != maxsize ||
+        header.sm != sm || header.brute != brute ||
+        header.mintop != mintop || header.maxtop != maxtop)
+        throw std::runtime_error("Field file was built with different parameters");
+    if (header.data_hash != data_hash)
+        throw std::runtime_error("Field file was built from different objects");
+    if (header.ntop < 0 || header.ncells < 0 || header.nindices < 0 ||
+        file.nbytes != (sizeof(header) + header.ntop * sizeof(long)
+                        + header.ncells * sizeof(FieldFileNode<D,C>)
+                        + header.nindices * sizeof(long)))
+        throw std::runtime_error("Invalid field file");
+
+    const long* top = reinterpret_cast<const long*>(p + sizeof(header));
+    const FieldFileNode<D,C>* nodes = reinterpret_cast<const FieldFileNode<D,C>*>(
+        top + header.ntop);
+    const long* indices = reinterpret_cast<const long*>(nodes + header.ncells);
+    _center = header.center;
+    _sizesq = header.sizesq;
+
+    // Make the Cells for each top-level cell in parallel, each with its own Arena as usual.
+    const ptrdiff_t n = header.ntop;
+    _cells.resize(n);
+    _top_arenas.resize(n, 0);
+    bool ok = true;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for(ptrdiff_t i=0;i<n;++i) {
+        try {
+            long ncells = (i+1 < n ? top[i+1] : header.ncells) - top[i];
+            size_t nbytes = ncells * sizeof(Cell<D,C>);
+            _top_arenas[i] = new Arena(Arena::BlockSizeFor(nbytes));
+            _cells[i] = MakeCell(header, nodes, indices, top[i], *_top_arenas[i]);
+        } catch (std::runtime_error&) {
+            // Can't throw out of an OpenMP loop, so just flag it and throw below.
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+            ok = false;
+        }
+    }
+    if (!ok) {
+        for (size_t i=0; i<_top_arenas.size(); ++i) delete _top_arenas[i];
+        throw std::runtime_error("Invalid field file");
+    }
+    _init_time = WallTime() - t0;
+    dbg<<"Read "<<header.ncells<<" cells in "<<_init_time<<" seconds\n";
+}
+
+//
+// Sharing a built Field with other processes through POSIX shared memory.
+//
+// The Cells point to each other, so rather than converting the pointers to offsets (which
+// would slow down every traversal), the segment is mapped at the same address in every
+// process that uses it.  The process that makes it just picks an address that is free there,
+// and another process can attach to it if that address is free in it too, which is normally
+// the case for a process forked from it or for another instance of the same program.
+// The layout is:
+//
+//     SharedSegmentHeader
+//     FieldFileHeader<D,C>       With ncells = the number of bytes of Cells below.
+//     Cell<D,C>* top[ntop]
+//     The Cells (and ListLeafInfo indices) of each top-level cell, in depth-first order.
+//
+
+const char SHARED_SEGMENT_MAGIC[8] = "TCShare";
+
+struct SharedSegmentHeader
+{
+    char magic[8];
+    void* base;
+    size_t nbytes;
+};
+
+struct SharedSegment
+{
+    std::string name;
+    void* base;
+    size_t nbytes;
+    pid_t owner;    // If > 0, the process that made the segment, which removes it at the end.
+    int refs;       // The number of Fields in this process that use the mapping.
+};
+
+// The segments that are mapped into this process, keyed by name, so several Fields can use
+// the same mapping.  (A second mmap of the same segment couldn't go at the same address.)
+static std::map<std::string, SharedSegment*> shared_segments;
+
+// Round up to a multiple of 64, so each top-level tree starts on a new cache line.
+static size_t RoundUp64(size_t n) { return (n + 63) & ~size_t(63); }
+
+SharedSegment* AttachSharedSegment(const char* name)
+{
+    SharedSegment* seg = 0;
+#ifdef _OPENMP
+#pragma omp critical (TreeCorr_shared_segments)
+#endif
+    {
+        std::map<std::string, SharedSegment*>::iterator it = shared_segments.find(name);
+        if (it != shared_segments.end()) {
+            seg = it->second;
+            ++seg->refs;
+        }
+    }
+    if (seg) return seg;
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) throw std::runtime_error("Unable to open shared field");
+    struct stat st;
+    SharedSegmentHeader header;
+    void* p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(header)) {
+        p = mmap(0, sizeof(header), PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (p == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("Invalid shared field");
+    }
+    header = *static_cast<SharedSegmentHeader*>(p);
+    munmap(p, sizeof(header));
+    if (std::memcmp(header.magic, SHARED_SEGMENT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.nbytes != size_t(st.st_size)) {
+        close(fd);
+        throw std::runtime_error("Invalid shared field");
+    }
+    int flags = MAP_SHARED;
+#ifdef MAP_FIXED_NOREPLACE
+    // Older kernels ignore this, and treat the address as a hint, so check it below anyway.
+    flags |= MAP_FIXED_NOREPLACE;
+#endif
+    p = mmap(header.base, header.nbytes, PROT_READ, flags, fd, 0);
+    close(fd);
+    if (p != header.base) {
+        if (p != MAP_FAILED) munmap(p, header.nbytes);
+        throw std::runtime_error("The address of the shared field is in use in this process");
+    }
+    dbg<<"Attached to shared field "<<name<<" at "<<p<<std::endl;
+
+    seg = new SharedSegment();
+    seg->name = name;
+    seg->base = p;
+    seg->nbytes = header.nbytes;
+    seg->owner = 0;
+    seg->refs = 1;
+#ifdef _OPENMP
+#pragma omp critical (TreeCorr_shared_segments)
+#endif
+    shared_segments[name] = seg;
+    return seg;
+}
+
+void ReleaseSharedSegment(SharedSegment* seg)
+{
+    bool done = false;
+#ifdef _OPENMP
+#pragma omp critical (TreeCorr_shared_segments)
+#endif
+    {
+        done = --seg->refs == 0;
+        if (done && seg->base) shared_segments.erase(seg->name);
+    }
+    if (!done) return;
+    if (seg->base) munmap(seg->base, seg->nbytes);
+    // A forked copy of the Field that made it shouldn't remove it.
+    if (seg->owner == getpid()) shm_unlink(seg->name.c_str());
+    delete seg;
+}
+
+// The number of bytes that ShareCell will use from the Arena for the subtree of cell.
+// The indices are assumed to be longs, which is sometimes more than needed.
+template <int D, int C>
+size_t SharedNBytes(const Cell<D,C>* cell)
+{
+    const size_t cell_bytes = (sizeof(Cell<D,C>) + Arena::ALIGN - 1) & ~size_t(Arena::ALIGN - 1);
+    if (cell->getLeft()) {
+        return cell_bytes + SharedNBytes(cell->getLeft()) + SharedNBytes(cell->getRight());
+    } else if (cell->getN() == 1) {
+        return cell_bytes;
+    } else {
+        size_t n = cell->getN() * sizeof(long);
+        return cell_bytes + ((n + Arena::ALIGN - 1) & ~size_t(Arena::ALIGN - 1));
+    }
+}
+
+// Copy the subtree of cell, in the same depth-first order as BuildCell.
+template <int D, int C>
+Cell<D,C>* ShareCell(const Cell<D,C>* cell, Arena& arena)
+{
+    if (cell->getLeft()) {
+        void* mem = arena.allocate(sizeof(Cell<D,C>));
+        Cell<D,C>* l = ShareCell(cell->getLeft(), arena);
+        Cell<D,C>* r = ShareCell(cell->getRight(), arena);
+        return new (mem) Cell<D,C>(cell->getData(), cell->getSize(), cell->getSizeSq(), l, r);
+    } else if (cell->getN() == 1) {
+        return new (arena) Cell<D,C>(cell->getData(), cell->getInfo());
+    } else {
+        const long n = cell->getN();
+        std::vector<long> indices;
+        indices.reserve(n);
+        cell->getListInfo().appendTo(n, indices);
+        ListLeafInfo info;
+        info.allocate(n, *std::max_element(indices.begin(), indices.end()), arena);
+        for (long i=0; i<n; ++i) info.set(i, indices[i]);
+        return new (arena) Cell<D,C>(cell->getData(), info);
+    }
+}
+
+template <int D, int C>
+void Field<D,C>::share(const char* name, long data_hash)
+{
+    BuildCells();  // Make sure this is done.
+    dbg<<"Start Field::share "<<name<<std::endl;
+    const ptrdiff_t n = _cells.size();
+    std::vector<size_t> offsets(n+1);
+    offsets[0] = RoundUp64(sizeof(SharedSegmentHeader) + sizeof(FieldFileHeader<D,C>) +
+                           n * sizeof(Cell<D,C>*));
+    for (ptrdiff_t i=0; i<n; ++i)
+        offsets[i+1] = offsets[i] + RoundUp64(SharedNBytes(_cells[i]));
+    const size_t nbytes = offsets[n];
+
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) throw std::runtime_error("Unable to create shared field");
+    // The pages of the segment are only allocated when they are written, so it doesn't matter
+    // that the indices may have been overestimated.
+    void* p = ftruncate(fd, nbytes) == 0 ?
+        mmap(0, nbytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (p == MAP_FAILED) {
+        shm_unlink(name);
+        throw std::runtime_error("Unable to map shared field");
+    }
+    char* base = static_cast<char*>(p);
+
+    Cell<D,C>** top = reinterpret_cast<Cell<D,C>**>(
+        base + sizeof(SharedSegmentHeader) + sizeof(FieldFileHeader<D,C>));
+    bool ok = true;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for(ptrdiff_t i=0;i<n;++i) {
+        try {
+            Arena arena;
+            arena.useBlock(base + offsets[i], offsets[i+1] - offsets[i]);
+            top[i] = ShareCell(_cells[i], arena);
+        } catch (std::bad_alloc&) {
+            // This shouldn't happen, since SharedNBytes is an upper bound.
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+            ok = false;
+        }
+    }
+    if (!ok) {
+        munmap(p, nbytes);
+        shm_unlink(name);
+        throw std::runtime_error("Unable to copy field to shared memory");
+    }
+
+    FieldFileHeader<D,C>& header = *reinterpret_cast<FieldFileHeader<D,C>*>(
+        base + sizeof(SharedSegmentHeader));
+    std::memset(static_cast<void*>(&header), 0, sizeof(header));
+    std::memcpy(header.magic, FIELD_FILE_MAGIC, sizeof(header.magic));
+    header.version = FIELD_FILE_VERSION;
+    header.d = D;
+    header.coords = C;
+    header.node_size = sizeof(Cell<D,C>);
+    header.sm = _sm;
+    header.brute = _brute;
+    header.mintop = _mintop;
+    header.maxtop = _maxtop;
+    header.minsize = _minsize;
+    header.maxsize = _maxsize;
+    header.nobj = _nobj;
+    header.data_hash = data_hash;
+    header.center = _center;
+    header.sizesq = _sizesq;
+    header.ntop = n;
+    header.ncells = nbytes - offsets[0];
+    header.nindices = 0;
+
+    // Write the magic last, so a process attaching while this is still being written finds
+    // an invalid segment rather than a partial one.
+    SharedSegmentHeader& seg_header = *reinterpret_cast<SharedSegmentHeader*>(base);
+    seg_header.base = p;
+    seg_header.nbytes = nbytes;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    std::memcpy(seg_header.magic, SHARED_SEGMENT_MAGIC, sizeof(seg_header.magic));
+    // This Field keeps using its own copy of the tree, so the mapping isn't needed here
+    // anymore.  Unmapping it leaves its address free for attaching to it from this process
+    // (or from processes forked from it later).
+    munmap(p, nbytes);
+    dbg<<"Shared "<<nbytes<<" bytes as "<<name<<" at "<<p<<std::endl;
+
+    SharedSegment* seg = new SharedSegment();
+    seg->name = name;
+    seg->base = 0;
+    seg->nbytes = nbytes;
+    seg->owner = getpid();
+    seg->refs = 1;
+    if (_shared) ReleaseSharedSegment(_shared);
+    _shared = seg;
+}
+
+template <int D, int C>
+Field<D,C>::Field(SharedSegment* shared, long nobj, long data_hash,
+                  double minsize, double maxsize,
+                  SplitMethod sm, bool brute, int mintop, int maxtop) :
+    _nobj(nobj), _minsize(minsize), _maxsize(maxsize), _sm(sm),
+    _brute(brute), _mintop(mintop), _maxtop(maxtop), _spill(0), _shared(shared), _leaves(0),
+    _lazy(false), _presort(false), _init_time(0.), _top_time(0.), _cells_time(0.)
+{
+    dbg<<"Starting to use shared Field "<<shared->name<<std::endl;
+    const char* p = static_cast<const char*>(shared->base);
+    const FieldFileHeader<D,C>& header = *reinterpret_cast<const FieldFileHeader<D,C>*>(
+        p + sizeof(SharedSegmentHeader));
+    const char* err = 0;
+    if (std::memcmp(header.magic, FIELD_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != FIELD_FILE_VERSION || header.d != D || header.coords != C ||
+        header.node_size != int(sizeof(Cell<D,C>)) || header.ntop < 0 ||
+        sizeof(SharedSegmentHeader) + sizeof(header) + header.ntop * sizeof(Cell<D,C>*) >
+        shared->nbytes)
+        err = "Invalid shared field";
+    else if (header.nobj != nobj || header.minsize != minsize || header.maxsize != maxsize ||
+             header.sm != sm || header.brute != brute ||
+             header.mintop != mintop || header.maxtop != maxtop)
+        err = "Shared field was built with different parameters";
+    else if (header.data_hash != data_hash)
+        err = "Shared field was built from different objects";
+    if (err) {
+        ReleaseSharedSegment(shared);
+        throw std::runtime_error(err);
+    }
+    Cell<D,C>* const* top = reinterpret_cast<Cell<D,C>* const*>(p + sizeof(SharedSegmentHeader) +
+                                                                sizeof(header));
+    _cells.assign(top, top + header.ntop);
+    _center = header.center;
+    _sizesq = header.sizesq;
+}
+
+template <int D, int C>
+long CountNear(const Cell<D,C>* cell, const Position<C>& pos, double sep, double sepsq)
+{
+    double s = cell->getSize();
+    const double dsq = (cell->getPos() - pos).normSq();
+    xdbg<<"CountNear: "<<cell->getPos()<<"  "<<pos<<"  "<<dsq<<"  "<<s<<"  "<<sepsq<<std::endl;
+
+    // If s == 0, then just check dsq
+    if (s==0.) {
+        if (dsq <= sepsq) {
+            dbg<<"s==0, d < sep   N = "<<cell->getN()<<std::endl;
+            Assert(sqrt(dsq) <= sep);
+            return cell->getN();
+        }
+        else {
+            Assert(sqrt(dsq) > sep);
+            xdbg<<"s==0, d >= sep\n";
+            return 0;
+        }
+    } else {
+        // If d - s > sep, then no points are close enough.
+        if (dsq > sepsq && dsq > SQR(sep+s)) {
+            Assert(sqrt(dsq) - s > sep);
+            xdbg<<"d - s > sep: "<<sqrt(dsq)-s<<" > "<<sep<<std::endl;
+            return 0;
+        }
+
+        // If d + s < sep, then all points are close enough.
+        if (dsq <= sepsq && s < sep && dsq <= SQR(sep-s)) {
+            Assert(sqrt(dsq) + s <= sep);
+            dbg<<"d + s <= sep: "<<sqrt(dsq)+s<<" <= "<<sep<<"  N = "<<cell->getN()<<std::endl;
+            return cell->getN();
+        }
+
+        // Otherwise check the subcells.
+        Assert(cell->getLeft());
+        Assert(cell->getRight());
+        xdbg<<"Recurse to subcells\n";
+        return (CountNear(cell->getLeft(), pos, sep, sepsq) +
+                CountNear(cell->getRight(), pos, sep, sepsq));
+    }
+}
+
+template <int D, int C>
+long Field<D,C>::countNear(double x, double y, double z, double sep) const
+{
+    BuildCells();  // Make sure this is done.
+    Position<C> pos(x,y,z);
+    double sepsq = sep*sep;
+    long ntot = 0;
+    dbg<<"Start countNear: "<<_cells.size()<<" top level cells\n";
+    for(size_t i=0; i<_cells.size(); ++i) {
+        dbg<<"Top level "<<i<<" with N="<<_cells[i]->getN()<<std::endl;
+        ntot += CountNear(_cells[i], pos, sep, sepsq);
+        dbg<<"ntot -> "<<ntot<<std::endl;
+    }
+    return ntot;
+}
+
+template <int D, int C>
+void GetNear(const Cell<D,C>* cell, const Position<C>& pos, double sep, double sepsq,
+             long* indices, long& k, long n)
+{
+    double s = cell->getSize();
+    const double dsq = (cell->getPos() - pos).normSq();
+    dbg<<"GetNear: "<<cell->getPos()<<"  "<<pos<<"  "<<dsq<<"  "<<s<<"  "<<sepsq<<std::endl;
+
+    // If s == 0, then just check dsq
+    if (s==0.) {
+        if (dsq <= sepsq) {
+            dbg<<"s==0, d < sep   N = "<<cell->getN()<<std::endl;
+            Assert(sqrt(dsq) <= sep);
+            Assert(k < n);
+            long n1 = cell->getN();
+            Assert(k + n1 <= n);
+            // This shouldn't happen, but if it does, we can get a seg fault, so check.
+            if (k + n1 > n) return;
+            if (n1 == 1) {
+                dbg<<"N == 1 case\n";
+                indices[k++] = cell->getInfo().index;
+            } else {
+                dbg<<"N > 1 case: "<<n1<<std::endl;
+                cell->getListInfo().copyTo(n1, indices + k);
+                k += n1;
+            }
+            Assert(k <= n);
+        } else {
+            Assert(sqrt(dsq) > sep);
+            dbg<<"s==0, d >= sep\n";
+        }
+    } else {
+        // If d - s > sep, then no points are close enough.
+        if (dsq > sepsq && dsq > SQR(sep+s)) {
+            Assert(sqrt(dsq) - s > sep);
+            dbg<<"d - s > sep: "<<sqrt(dsq)-s<<" > "<<sep<<std::endl;
+        } else {
+            // Otherwise check the subcells.
+            Assert(cell->getLeft());
+            Assert(cell->getRight());
+            dbg<<"Recurse to subcells\n";
+            GetNear(cell->getLeft(), pos, sep, sepsq, indices, k, n);
+            GetNear(cell->getRight(), pos, sep, sepsq, indices, k, n);
+        }
+    }
+}
+
+template <int D, int C>
+void Field<D,C>::getNear(double x, double y, double z, double sep, long* indices, long n) const
+{
+    BuildCells();  // Make sure this is done.
+    Position<C> pos(x,y,z);
+    double sepsq = sep*sep;
+    dbg<<"Start getNear: "<<_cells.size()<<" top level cells\n";
+    long k = 0;
+    for(size_t i=0; i<_cells.size(); ++i) {
+        dbg<<"Top level "<<i<<" with N="<<_cells[i]->getN()<<std::endl;
+        GetNear(_cells[i], pos, sep, sepsq, indices, k, n);
+        dbg<<"k -> "<<k<<std::endl;
+    }
+}
+
+template <int D, int C>
+void Field<D,C>::countNearMany(const double* x, const double* y, const double* z,
+                               const double* sep, long nq, long* counts) const
+{
+    BuildCells();  // Make sure this is done before going parallel.
+    dbg<<"Start countNearMany: "<<nq<<" queries, "<<_cells.size()<<" top level cells\n";
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 16)
+#endif
+    for (long q=0; q<nq; ++q) {
+        Position<C> pos(x[q],y[q],z[q]);
+        double sepsq = sep[q]*sep[q];
+        long ntot = 0;
+        for(size_t i=0; i<_cells.size(); ++i)
+            ntot += CountNear(_cells[i], pos, sep[q], sepsq);
+        counts[q] = ntot;
     }
 }
 
-template <int D, int C>
-SimpleField<D,C>::SimpleField(
-    double* x, double* y, double* z, double* g1, double* g2, double* k,
-    double* w, double* wpos, long nobj)
+template <int D, int C>
+void Field<D,C>::getNearMany(const double* x, const double* y, const double* z,
+                             const double* sep, long nq, const long* offsets,
+                             long* indices) const
+{
+    BuildCells();  // Make sure this is done before going parallel.
+    dbg<<"Start getNearMany: "<<nq<<" queries, "<<_cells.size()<<" top level cells\n";
+    // The indices for query q go in indices[offsets[q]:offsets[q+1]], so each query writes
+    // to its own section of the output array, and they don't need to coordinate.
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 16)
+#endif
+    for (long q=0; q<nq; ++q) {
+        Position<C> pos(x[q],y[q],z[q]);
+        double sepsq = sep[q]*sep[q];
+        long* ind = indices + offsets[q];
+        long n = offsets[q+1] - offsets[q];
+        long k = 0;
+        for(size_t i=0; i<_cells.size(); ++i)
+            GetNear(_cells[i], pos, sep[q], sepsq, ind, k, n);
+        Assert(k == n);
+    }
+}
+
+// The heap holds the (dsq, index) pairs of the best k found so far, with the farthest one
+// at the front.
+typedef std::pair<double,long> NearestItem;
+
+inline void PushNearest(std::vector<NearestItem>& heap, long k, double dsq, long index)
+{
+    if (long(heap.size()) < k) {
+        heap.push_back(NearestItem(dsq, index));
+        std::push_heap(heap.begin(), heap.end());
+    } else if (dsq < heap.front().first) {
+        std::pop_heap(heap.begin(), heap.end());
+        heap.back() = NearestItem(dsq, index);
+        std::push_heap(heap.begin(), heap.end());
+    }
+}
+
+template <int D, int C>
+void GetNearest(const Cell<D,C>* cell, const Position<C>& pos, double dsq, long k,
+                std::vector<NearestItem>& heap)
+{
+    double s = cell->getSize();
+    xdbg<<"GetNearest: "<<cell->getPos()<<"  "<<pos<<"  "<<dsq<<"  "<<s<<std::endl;
+
+    // If the heap is full and d - s is farther than the current k-th nearest, then nothing
+    // in this cell can be closer.
+    if (long(heap.size()) == k && dsq > SQR(s)) {
+        double dmin = std::sqrt(dsq) - s;
+        if (SQR(dmin) >= heap.front().first) return;
+    }
+
+    if (s==0.) {
+        long n1 = cell->getN();
+        if (n1 == 1) {
+            PushNearest(heap, k, dsq, cell->getInfo().index);
+        } else {
+            const ListLeafInfo& leaf_indices = cell->getListInfo();
+            for (long m=0; m<n1; ++m)
+                PushNearest(heap, k, dsq, leaf_indices[m]);
+        }
+    } else {
+        // Check the closer subcell first, so the heap fills up with good candidates sooner.
+        const Cell<D,C>* c1 = cell->getLeft();
+        const Cell<D,C>* c2 = cell->getRight();
+        Assert(c1);
+        Assert(c2);
+        double dsq1 = (c1->getPos() - pos).normSq();
+        double dsq2 = (c2->getPos() - pos).normSq();
+        if (dsq2 < dsq1) {
+            std::swap(c1,c2);
+            std::swap(dsq1,dsq2);
+        }
+        GetNearest(c1, pos, dsq1, k, heap);
+        GetNearest(c2, pos, dsq2, k, heap);
+    }
+}
+
+template <int D, int C>
+void Field<D,C>::getNearest(const double* x, const double* y, const double* z, long nq,
+                            long k, long* indices, double* distsq) const
+{
+    BuildCells();  // Make sure this is done before going parallel.
+    dbg<<"Start getNearest: "<<nq<<" queries, k = "<<k<<std::endl;
+    const long ntop = _cells.size();
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+    {
+        std::vector<NearestItem> heap;
+        heap.reserve(k);
+        std::vector<std::pair<double,long> > top(ntop);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 16)
+#endif
+        for (long q=0; q<nq; ++q) {
+            Position<C> pos(x[q],y[q],z[q]);
+            heap.clear();
+            // Start with the closest top-level cells.
+            for (long i=0; i<ntop; ++i)
+                top[i] = std::make_pair((_cells[i]->getPos() - pos).normSq(), i);
+            std::sort(top.begin(), top.end());
+            for (long i=0; i<ntop; ++i)
+                GetNearest(_cells[top[i].second], pos, top[i].first, k, heap);
+            // Output them in order from nearest to farthest.
+            std::sort_heap(heap.begin(), heap.end());
+            long* ind = indices + q*k;
+            double* dsq = distsq + q*k;
+            long j=0;
+            for (; j<long(heap.size()); ++j) {
+                ind[j] = heap[j].second;
+                dsq[j] = heap[j].first;
+            }
+            // If there are fewer than k objects in the field, fill in the rest with -1.
+            for (; j<k; ++j) {
+                ind[j] = -1;
+                dsq[j] = std::numeric_limits<double>::infinity();
+            }
+        }
+    }
+}
+
+template <int D, int C>
+SimpleField<D,C>::SimpleField(
+    double* x, double* y, double* z, double* g1, double* g2, double* k,
+    double* w, double* wpos, long nobj)
+{
+    // This bit is similar to the start of the Field constructor with share_leaves, since
+    // we just turn each item into a leaf Cell and keep them all in a single vector.
+    dbg<<"Starting to Build SimpleField with "<<nobj<<" objects\n";
+    if (!z) Assert(C == Flat);
+    Cell<D,C>* leaves = static_cast<Cell<D,C>*>(_arena.allocate(nobj * sizeof(Cell<D,C>)));
+    _cells.resize(nobj);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for(long i=0;i<nobj;++i) {
+        double zi = z ? z[i] : 0.;
+        CellData<D,C> data;
+        CellDataHelper<D,C>::build(x[i],y[i],zi,g1[i],g2[i],k[i],w[i], &data);
+        _cells[i] = new (leaves+i) Cell<D,C>(data, get_wpos(wpos,w,i));
+    }
+    dbg<<"Built "<<_cells.size()<<" leaf cells\n";
+}
+
+template <int D, int C>
+SimpleField<D,C>::~SimpleField()
+{
+    // The Cells are all owned by _arena.
+}
+
+
+//
+//
+// Now the C-C++ interface functions that get used in python:
+//
+//
+
+extern "C" {
+#include "Field_C.h"
+}
+
+template <int D>
+void* BuildField(double* x, double* y, double* z, double* g1, double* g2, double* k,
+                 double* w, double* wpos, long nobj,
+                 double minsize, double maxsize,
+                 int sm_int, int brute, int mintop, int maxtop, int share_leaves, int lazy,
+                 int presort, const char* spill_dir, int coords)
+{
+    dbg<<"Start BuildField "<<D<<"  "<<coords<<std::endl;
+    PhaseThreads threads(BuildPhase);
+    void* field=0;
+    SplitMethod sm = static_cast<SplitMethod>(sm_int);
+    // Errors (i.e. if the spill file can't be made) are signalled by returning NULL.
+    try {
+        switch(coords) {
+          case Flat:
+               // Note: Use w for k, since we access k[i], even though value will be ignored.
+               field = static_cast<void*>(new Field<D,Flat>(x, y, 0, g1, g2, k,
+                                                            w, wpos, nobj,
+                                                            minsize, maxsize,
+                                                            sm, bool(brute), mintop, maxtop,
+                                                            bool(share_leaves), bool(lazy),
+                                                            bool(presort), spill_dir));
+               break;
+          case Sphere:
+               field = static_cast<void*>(new Field<D,Sphere>(x, y, z, g1, g2, k,
+                                                              w, wpos, nobj,
+                                                              minsize, maxsize,
+                                                              sm, bool(brute), mintop, maxtop,
+                                                              bool(share_leaves), bool(lazy),
+                                                              bool(presort), spill_dir));
+               break;
+          case ThreeD:
+               field = static_cast<void*>(new Field<D,ThreeD>(x, y, z, g1, g2, k,
+                                                              w, wpos, nobj,
+                                                              minsize, maxsize,
+                                                              sm, bool(brute), mintop, maxtop,
+                                                              bool(share_leaves), bool(lazy),
+                                                              bool(presort), spill_dir));
+               break;
+        }
+    } catch (std::runtime_error& e) {
+        dbg<<"Unable to build field: "<<e.what()<<std::endl;
+        field = 0;
+    }
+    xdbg<<"field = "<<field<<std::endl;
+    return field;
+}
+
+void* BuildGField(double* x, double* y, double* z, double* g1, double* g2,
+                  double* w, double* wpos, long nobj,
+                  double minsize, double maxsize,
+                  int sm_int, int brute, int mintop, int maxtop, int share_leaves, int lazy,
+                  int presort, const char* spill_dir, int coords)
+{
+    // Note: Use w for k, since we access k[i], even though value will be ignored.
+    return BuildField<GData>(x,y,z, g1,g2,w, w,wpos,nobj, minsize,maxsize, sm_int,
+                             brute,mintop,maxtop,share_leaves,lazy,presort,spill_dir,
+                             coords);
+}
+
+
+void* BuildKField(double* x, double* y, double* z, double* k,
+                  double* w, double* wpos, long nobj,
+                  double minsize, double maxsize,
+                  int sm_int, int brute, int mintop, int maxtop, int share_leaves, int lazy,
+                  int presort, const char* spill_dir, int coords)
+{
+    // Note: Use w for g1,g2, since we access g1[i],g2[i] even though values are ignored.
+    return BuildField<KData>(x,y,z, w,w,k, w,wpos,nobj, minsize,maxsize, sm_int,
+                             brute,mintop,maxtop,share_leaves,lazy,presort,spill_dir,
+                             coords);
+}
+
+void* BuildNField(double* x, double* y, double* z,
+                  double* w, double* wpos, long nobj,
+                  double minsize, double maxsize,
+                  int sm_int, int brute, int mintop, int maxtop, int share_leaves, int lazy,
+                  int presort, const char* spill_dir, int coords)
+{
+    // Note: Use w for g1,g2,k for same reasons as above.
+    return BuildField<NData>(x,y,z, w,w,w, w,wpos,nobj, minsize,maxsize, sm_int,
+                             brute,mintop,maxtop,share_leaves,lazy,presort,spill_dir,
+                             coords);
+}
+
+template <int D, int D2>
+void* BuildFieldFromTree2(void* src, double* x, double* y, double* z, double* g1, double* g2,
+                          double* k, double* w, double* wpos, int coords)
+{
+    dbg<<"Start BuildFieldFromTree "<<D<<"  "<<D2<<"  "<<coords<<std::endl;
+    void* field=0;
+    switch(coords) {
+      case Flat:
+           field = static_cast<void*>(new Field<D,Flat>(
+                   *static_cast<Field<D2,Flat>*>(src), x, y, 0, g1, g2, k, w, wpos));
+           break;
+      case Sphere:
+           field = static_cast<void*>(new Field<D,Sphere>(
+                   *static_cast<Field<D2,Sphere>*>(src), x, y, z, g1, g2, k, w, wpos));
+           break;
+      case ThreeD:
+           field = static_cast<void*>(new Field<D,ThreeD>(
+                   *static_cast<Field<D2,ThreeD>*>(src), x, y, z, g1, g2, k, w, wpos));
+           break;
+    }
+    xdbg<<"field = "<<field<<std::endl;
+    return field;
+}
+
+template <int D>
+void* BuildFieldFromTree1(void* src, int src_d, double* x, double* y, double* z,
+                          double* g1, double* g2, double* k, double* w, double* wpos, int coords)
+{
+    PhaseThreads threads(BuildPhase);
+    switch(src_d) {
+      case NData:
+           return BuildFieldFromTree2<D,NData>(src, x, y, z, g1, g2, k, w, wpos, coords);
+      case KData:
+           return BuildFieldFromTree2<D,KData>(src, x, y, z, g1, g2, k, w, wpos, coords);
+      case GData:
+           return BuildFieldFromTree2<D,GData>(src, x, y, z, g1, g2, k, w, wpos, coords);
+    }
+    return 0;
+}
+
+void* BuildGFieldFromTree(void* src, int src_d, double* x, double* y, double* z,
+                          double* g1, double* g2, double* w, double* wpos, int coords)
+{
+    // Note: Use w for k, since we access k[i], even though value will be ignored.
+    return BuildFieldFromTree1<GData>(src, src_d, x,y,z, g1,g2,w, w,wpos, coords);
+}
+
+void* BuildKFieldFromTree(void* src, int src_d, double* x, double* y, double* z,
+                          double* k, double* w, double* wpos, int coords)
+{
+    // Note: Use w for g1,g2, since we access g1[i],g2[i] even though values are ignored.
+    return BuildFieldFromTree1<KData>(src, src_d, x,y,z, w,w,k, w,wpos, coords);
+}
+
+void* BuildNFieldFromTree(void* src, int src_d, double* x, double* y, double* z,
+                          double* w, double* wpos, int coords)
+{
+    // Note: Use w for g1,g2,k for same reasons as above.
+    return BuildFieldFromTree1<NData>(src, src_d, x,y,z, w,w,w, w,wpos, coords);
+}
+
+template <int D>
+void* BuildFieldFromFile1(const char* file_name, long nobj, long data_hash,
+                          double minsize, double maxsize,
+                          SplitMethod sm, bool brute, int mintop, int maxtop, int coords)
 {
-    // This bit is the same as the start of the Field constructor.
-    dbg<<"Starting to Build SimpleField with "<<nobj<<" objects\n";
-    std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> > celldata;
-    celldata.reserve(nobj);
-    if (z) {
-        for(long i=0;i<nobj;++i) {
-            WPosLeafInfo wp = get_wpos(wpos,w,i);
-            celldata.push_back(std::make_pair(
-                    CellDataHelper<D,C>::build(x[i],y[i],z[i],g1[i],g2[i],k[i],w[i]),
-                    wp));
-        }
-    } else {
-        Assert(C == Flat);
-        for(long i=0;i<nobj;++i) {
-            WPosLeafInfo wp = get_wpos(wpos,w,i);
-            celldata.push_back(std::make_pair(
-                    CellDataHelper<D,C>::build(x[i],y[i],0.,g1[i],g2[i],k[i],w[i]),
-                    wp));
+    dbg<<"Start BuildFieldFromFile "<<D<<"  "<<coords<<std::endl;
+    PhaseThreads threads(BuildPhase);
+    void* field=0;
+    // Errors (e.g. from a missing file or one that doesn't match) are signalled by returning
+    // NULL, since we can't throw across the C interface.
+    try {
+        switch(coords) {
+          case Flat:
+               field = static_cast<void*>(new Field<D,Flat>(file_name, nobj, data_hash,
+                                                            minsize, maxsize, sm, brute,
+                                                            mintop, maxtop));
+               break;
+          case Sphere:
+               field = static_cast<void*>(new Field<D,Sphere>(file_name, nobj, data_hash,
+                                                              minsize, maxsize, sm, brute,
+                                                              mintop, maxtop));
+               break;
+          case ThreeD:
+               field = static_cast<void*>(new Field<D,ThreeD>(file_name, nobj, data_hash,
+                                                              minsize, maxsize, sm, brute,
+                                                              mintop, maxtop));
+               break;
         }
+    } catch (std::runtime_error& e) {
+        dbg<<"Unable to read field: "<<e.what()<<std::endl;
+        field = 0;
     }
-    dbg<<"Built celldata with "<<celldata.size()<<" entries\n";
+    xdbg<<"field = "<<field<<std::endl;
+    return field;
+}
 
-    // However, now we just turn each item into a leaf Cell and keep them all in a single vector.
-    ptrdiff_t n = celldata.size();
-    _cells.resize(n);
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
-    for(ptrdiff_t i=0;i<n;++i)
-        _cells[i] = new Cell<D,C>(celldata[i].first, celldata[i].second);
+void* BuildFieldFromFile(const char* file_name, long nobj, long data_hash,
+                         double minsize, double maxsize,
+                         int sm_int, int brute, int mintop, int maxtop, int d, int coords)
+{
+    SplitMethod sm = static_cast<SplitMethod>(sm_int);
+    switch(d) {
+      case NData:
+           return BuildFieldFromFile1<NData>(file_name, nobj, data_hash, minsize, maxsize, sm,
+                                             bool(brute), mintop, maxtop, coords);
+      case KData:
+           return BuildFieldFromFile1<KData>(file_name, nobj, data_hash, minsize, maxsize, sm,
+                                             bool(brute), mintop, maxtop, coords);
+      case GData:
+           return BuildFieldFromFile1<GData>(file_name, nobj, data_hash, minsize, maxsize, sm,
+                                             bool(brute), mintop, maxtop, coords);
+    }
+    return 0;
 }
 
-template <int D, int C>
-SimpleField<D,C>::~SimpleField()
+template <int D>
+int FieldWrite1(void* field, int coords, const char* file_name, long data_hash)
 {
-    for(size_t i=0; i<_cells.size(); ++i) delete _cells[i];
+    try {
+        switch(coords) {
+          case Flat:
+               static_cast<Field<D,Flat>*>(field)->write(file_name, data_hash);
+               break;
+          case Sphere:
+               static_cast<Field<D,Sphere>*>(field)->write(file_name, data_hash);
+               break;
+          case ThreeD:
+               static_cast<Field<D,ThreeD>*>(field)->write(file_name, data_hash);
+               break;
+        }
+    } catch (std::runtime_error& e) {
+        dbg<<"Unable to write field: "<<e.what()<<std::endl;
+        return 0;
+    }
+    return 1;
 }
 
+int FieldWrite(void* field, int d, int coords, const char* file_name, long data_hash)
+{
+    switch(d) {
+      case NData:
+           return FieldWrite1<NData>(field, coords, file_name, data_hash);
+      case KData:
+           return FieldWrite1<KData>(field, coords, file_name, data_hash);
+      case GData:
+           return FieldWrite1<GData>(field, coords, file_name, data_hash);
+    }
+    return 0;
+}
 
-//
-//
-// Now the C-C++ interface functions that get used in python:
-//
-//
+template <int D>
+int FieldShare1(void* field, int coords, const char* name, long data_hash)
+{
+    try {
+        switch(coords) {
+          case Flat:
+               static_cast<Field<D,Flat>*>(field)->share(name, data_hash);
+               break;
+          case Sphere:
+               static_cast<Field<D,Sphere>*>(field)->share(name, data_hash);
+               break;
+          case ThreeD:
+               static_cast<Field<D,ThreeD>*>(field)->share(name, data_hash);
+               break;
+        }
+    } catch (std::runtime_error& e) {
+        dbg<<"Unable to share field: "<<e.what()<<std::endl;
+        return 0;
+    }
+    return 1;
+}
 
-extern "C" {
-#include "Field_C.h"
+int FieldShare(void* field, int d, int coords, const char* name, long data_hash)
+{
+    switch(d) {
+      case NData:
+           return FieldShare1<NData>(field, coords, name, data_hash);
+      case KData:
+           return FieldShare1<KData>(field, coords, name, data_hash);
+      case GData:
+           return FieldShare1<GData>(field, coords, name, data_hash);
+    }
+    return 0;
 }
 
 template <int D>
-void* BuildField(double* x, double* y, double* z, double* g1, double* g2, double* k,
-                 double* w, double* wpos, long nobj,
-                 double minsize, double maxsize,
-                 int sm_int, int brute, int mintop, int maxtop, int coords)
+void* AttachSharedField1(const char* name, long nobj, long data_hash,
+                         double minsize, double maxsize,
+                         SplitMethod sm, bool brute, int mintop, int maxtop, int coords)
 {
-    dbg<<"Start BuildField "<<D<<"  "<<coords<<std::endl;
+    dbg<<"Start AttachSharedField "<<D<<"  "<<coords<<std::endl;
     void* field=0;
-    SplitMethod sm = static_cast<SplitMethod>(sm_int);
-    switch(coords) {
-      case Flat:
-           // Note: Use w for k, since we access k[i], even though value will be ignored.
-           field = static_cast<void*>(new Field<D,Flat>(x, y, 0, g1, g2, k,
-                                                        w, wpos, nobj,
-                                                        minsize, maxsize,
-                                                        sm, bool(brute), mintop, maxtop));
-           break;
-      case Sphere:
-           field = static_cast<void*>(new Field<D,Sphere>(x, y, z, g1, g2, k,
-                                                          w, wpos, nobj,
-                                                          minsize, maxsize,
-                                                          sm, bool(brute), mintop, maxtop));
-           break;
-      case ThreeD:
-           field = static_cast<void*>(new Field<D,ThreeD>(x, y, z, g1, g2, k,
-                                                          w, wpos, nobj,
-                                                          minsize, maxsize,
-                                                          sm, bool(brute), mintop, maxtop));
-           break;
+    // As for BuildFieldFromFile, errors are signalled by returning NULL.
+    try {
+        SharedSegment* seg = AttachSharedSegment(name);
+        switch(coords) {
+          case Flat:
+               field = static_cast<void*>(new Field<D,Flat>(seg, nobj, data_hash,
+                                                            minsize, maxsize, sm, brute,
+                                                            mintop, maxtop));
+               break;
+          case Sphere:
+               field = static_cast<void*>(new Field<D,Sphere>(seg, nobj, data_hash,
+                                                              minsize, maxsize, sm, brute,
+                                                              mintop, maxtop));
+               break;
+          case ThreeD:
+               field = static_cast<void*>(new Field<D,ThreeD>(seg, nobj, data_hash,
+                                                              minsize, maxsize, sm, brute,
+                                                              mintop, maxtop));
+               break;
+        }
+    } catch (std::runtime_error& e) {
+        dbg<<"Unable to attach to shared field: "<<e.what()<<std::endl;
+        field = 0;
     }
     xdbg<<"field = "<<field<<std::endl;
     return field;
 }
 
-void* BuildGField(double* x, double* y, double* z, double* g1, double* g2,
-                  double* w, double* wpos, long nobj,
-                  double minsize, double maxsize,
-                  int sm_int, int brute, int mintop, int maxtop, int coords)
+void* AttachSharedField(const char* name, long nobj, long data_hash,
+                        double minsize, double maxsize,
+                        int sm_int, int brute, int mintop, int maxtop, int d, int coords)
 {
-    // Note: Use w for k, since we access k[i], even though value will be ignored.
-    return BuildField<GData>(x,y,z, g1,g2,w, w,wpos,nobj, minsize,maxsize, sm_int,
-                             brute,mintop,maxtop,coords);
+    SplitMethod sm = static_cast<SplitMethod>(sm_int);
+    switch(d) {
+      case NData:
+           return AttachSharedField1<NData>(name, nobj, data_hash, minsize, maxsize, sm,
+                                            bool(brute), mintop, maxtop, coords);
+      case KData:
+           return AttachSharedField1<KData>(name, nobj, data_hash, minsize, maxsize, sm,
+                                            bool(brute), mintop, maxtop, coords);
+      case GData:
+           return AttachSharedField1<GData>(name, nobj, data_hash, minsize, maxsize, sm,
+                                            bool(brute), mintop, maxtop, coords);
+    }
+    return 0;
 }
 
+int UnlinkSharedField(const char* name)
+{ return shm_unlink(name) == 0; }
 
-void* BuildKField(double* x, double* y, double* z, double* k,
-                  double* w, double* wpos, long nobj,
-                  double minsize, double maxsize,
-                  int sm_int, int brute, int mintop, int maxtop, int coords)
+template <int D>
+void FieldAppend1(void* field, double* x, double* y, double* z, double* g1, double* g2,
+                  double* k, double* w, double* wpos, long nobj, int coords)
 {
-    // Note: Use w for g1,g2, since we access g1[i],g2[i] even though values are ignored.
-    return BuildField<KData>(x,y,z, w,w,k, w,wpos,nobj, minsize,maxsize, sm_int,
-                             brute,mintop,maxtop,coords);
+    switch(coords) {
+      case Flat:
+           static_cast<Field<D,Flat>*>(field)->append(x, y, 0, g1, g2, k, w, wpos, nobj);
+           break;
+      case Sphere:
+           static_cast<Field<D,Sphere>*>(field)->append(x, y, z, g1, g2, k, w, wpos, nobj);
+           break;
+      case ThreeD:
+           static_cast<Field<D,ThreeD>*>(field)->append(x, y, z, g1, g2, k, w, wpos, nobj);
+           break;
+    }
 }
 
-void* BuildNField(double* x, double* y, double* z,
-                  double* w, double* wpos, long nobj,
-                  double minsize, double maxsize,
-                  int sm_int, int brute, int mintop, int maxtop, int coords)
+void FieldAppend(void* field, double* x, double* y, double* z, double* g1, double* g2,
+                 double* k, double* w, double* wpos, long nobj, int d, int coords)
 {
-    // Note: Use w for g1,g2,k for same reasons as above.
-    return BuildField<NData>(x,y,z, w,w,w, w,wpos,nobj, minsize,maxsize, sm_int,
-                             brute,mintop,maxtop,coords);
+    // Note: As in the Build*Field functions, any unused g1, g2, k should be given as w.
+    switch(d) {
+      case NData:
+           FieldAppend1<NData>(field, x, y, z, g1, g2, k, w, wpos, nobj, coords);
+           break;
+      case KData:
+           FieldAppend1<KData>(field, x, y, z, g1, g2, k, w, wpos, nobj, coords);
+           break;
+      case GData:
+           FieldAppend1<GData>(field, x, y, z, g1, g2, k, w, wpos, nobj, coords);
+           break;
+    }
 }
 
 template <int D>
@@ -582,6 +1952,124 @@ long FieldGetNTopLevel(void* field, int d, int coords)
     return 0;  // Can't get here, but saves a compiler warning
 }
 
+template <int D, int C>
+void FieldGetBuildTimes2(Field<D,C>* field, double* times)
+{
+    // Make sure the cells are built first.
+    times[1] = field->getTopTime();
+    times[2] = field->getCellsTime();
+    times[0] = field->getInitTime();
+}
+
+template <int D>
+void FieldGetBuildTimes1(void* field, int coords, double* times)
+{
+    switch(coords) {
+      case Flat:
+           FieldGetBuildTimes2(static_cast<Field<D,Flat>*>(field), times);
+           break;
+      case Sphere:
+           FieldGetBuildTimes2(static_cast<Field<D,Sphere>*>(field), times);
+           break;
+      case ThreeD:
+           FieldGetBuildTimes2(static_cast<Field<D,ThreeD>*>(field), times);
+           break;
+    }
+}
+
+void FieldGetBuildTimes(void* field, int d, int coords, double* times)
+{
+    switch(d) {
+      case NData:
+           FieldGetBuildTimes1<NData>(field, coords, times);
+           break;
+      case KData:
+           FieldGetBuildTimes1<KData>(field, coords, times);
+           break;
+      case GData:
+           FieldGetBuildTimes1<GData>(field, coords, times);
+           break;
+    }
+}
+
+template <int D, int C>
+void FieldGetNBytes2(Field<D,C>* field, long* nbytes)
+{
+    // Make sure the cells are built first.
+    field->getNTopLevel();
+    nbytes[0] = field->getMemoryNBytes();
+    nbytes[1] = field->getSpillNBytes();
+}
+
+template <int D>
+void FieldGetNBytes1(void* field, int coords, long* nbytes)
+{
+    switch(coords) {
+      case Flat:
+           FieldGetNBytes2(static_cast<Field<D,Flat>*>(field), nbytes);
+           break;
+      case Sphere:
+           FieldGetNBytes2(static_cast<Field<D,Sphere>*>(field), nbytes);
+           break;
+      case ThreeD:
+           FieldGetNBytes2(static_cast<Field<D,ThreeD>*>(field), nbytes);
+           break;
+    }
+}
+
+void FieldGetNBytes(void* field, int d, int coords, long* nbytes)
+{
+    switch(d) {
+      case NData:
+           FieldGetNBytes1<NData>(field, coords, nbytes);
+           break;
+      case KData:
+           FieldGetNBytes1<KData>(field, coords, nbytes);
+           break;
+      case GData:
+           FieldGetNBytes1<GData>(field, coords, nbytes);
+           break;
+    }
+}
+
+template <int D, int C>
+void FieldGetObjectNBytes2(long* nbytes)
+{
+    nbytes[0] = sizeof(Cell<D,C>);
+    nbytes[1] = sizeof(CellData<D,C>) + sizeof(std::pair<CellData<D,C>*,WPosLeafInfo>);
+}
+
+template <int D>
+void FieldGetObjectNBytes1(int coords, long* nbytes)
+{
+    switch(coords) {
+      case Flat:
+           FieldGetObjectNBytes2<D,Flat>(nbytes);
+           break;
+      case Sphere:
+           FieldGetObjectNBytes2<D,Sphere>(nbytes);
+           break;
+      case ThreeD:
+           FieldGetObjectNBytes2<D,ThreeD>(nbytes);
+           break;
+    }
+}
+
+void FieldGetObjectNBytes(int d, int coords, long* nbytes)
+{
+    switch(d) {
+      case NData:
+           FieldGetObjectNBytes1<NData>(coords, nbytes);
+           break;
+      case KData:
+           FieldGetObjectNBytes1<KData>(coords, nbytes);
+           break;
+      case GData:
+           FieldGetObjectNBytes1<GData>(coords, nbytes);
+           break;
+    }
+}
+
 template <int D>
 long FieldCountNear1(void* field, double x, double y, double z, double sep, int coords)
 {
@@ -648,6 +2136,105 @@ void FieldGetNear(void* field, double x, double y, double z, double sep, int d,
     }
 }
 
+template <int D>
+void FieldCountNearMany1(void* field, double* x, double* y, double* z, double* sep, long nq,
+                         int coords, long* counts)
+{
+    switch(coords) {
+      case Flat:
+           static_cast<Field<D,Flat>*>(field)->countNearMany(x,y,z,sep,nq,counts);
+           break;
+      case Sphere:
+           static_cast<Field<D,Sphere>*>(field)->countNearMany(x,y,z,sep,nq,counts);
+           break;
+      case ThreeD:
+           static_cast<Field<D,ThreeD>*>(field)->countNearMany(x,y,z,sep,nq,counts);
+           break;
+    }
+}
+
+void FieldCountNearMany(void* field, double* x, double* y, double* z, double* sep, long nq,
+                        int d, int coords, long* counts)
+{
+    switch(d) {
+      case NData:
+           FieldCountNearMany1<NData>(field, x, y, z, sep, nq, coords, counts);
+           break;
+      case KData:
+           FieldCountNearMany1<KData>(field, x, y, z, sep, nq, coords, counts);
+           break;
+      case GData:
+           FieldCountNearMany1<GData>(field, x, y, z, sep, nq, coords, counts);
+           break;
+    }
+}
+
+template <int D>
+void FieldGetNearMany1(void* field, double* x, double* y, double* z, double* sep, long nq,
+                       int coords, long* offsets, long* indices)
+{
+    switch(coords) {
+      case Flat:
+           static_cast<Field<D,Flat>*>(field)->getNearMany(x,y,z,sep,nq,offsets,indices);
+           break;
+      case Sphere:
+           static_cast<Field<D,Sphere>*>(field)->getNearMany(x,y,z,sep,nq,offsets,indices);
+           break;
+      case ThreeD:
+           static_cast<Field<D,ThreeD>*>(field)->getNearMany(x,y,z,sep,nq,offsets,indices);
+           break;
+    }
+}
+
+void FieldGetNearMany(void* field, double* x, double* y, double* z, double* sep, long nq,
+                      int d, int coords, long* offsets, long* indices)
+{
+    switch(d) {
+      case NData:
+           FieldGetNearMany1<NData>(field, x, y, z, sep, nq, coords, offsets, indices);
+           break;
+      case KData:
+           FieldGetNearMany1<KData>(field, x, y, z, sep, nq, coords, offsets, indices);
+           break;
+      case GData:
+           FieldGetNearMany1<GData>(field, x, y, z, sep, nq, coords, offsets, indices);
+           break;
+    }
+}
+
+template <int D>
+void FieldGetNearest1(void* field, double* x, double* y, double* z, long nq, long k,
+                      int coords, long* indices, double* distsq)
+{
+    switch(coords) {
+      case Flat:
+           static_cast<Field<D,Flat>*>(field)->getNearest(x,y,z,nq,k,indices,distsq);
+           break;
+      case Sphere:
+           static_cast<Field<D,Sphere>*>(field)->getNearest(x,y,z,nq,k,indices,distsq);
+           break;
+      case ThreeD:
+           static_cast<Field<D,ThreeD>*>(field)->getNearest(x,y,z,nq,k,indices,distsq);
+           break;
+    }
+}
+
+void FieldGetNearest(void* field, double* x, double* y, double* z, long nq, long k,
+                     int d, int coords, long* indices, double* distsq)
+{
+    switch(d) {
+      case NData:
+           FieldGetNearest1<NData>(field, x, y, z, nq, k, coords, indices, distsq);
+           break;
+      case KData:
+           FieldGetNearest1<KData>(field, x, y, z, nq, k, coords, indices, distsq);
+           break;
+      case GData:
+           FieldGetNearest1<GData>(field, x, y, z, nq, k, coords, indices, distsq);
+           break;
+    }
+}
+
 template <int D>
 void* BuildSimpleField(double* x, double* y, double* z, double* g1, double* g2, double* k,
                        double* w, double* wpos, long nobj, int coords)
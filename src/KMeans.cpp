@@ -16,9 +16,12 @@
 
 #include <vector>
 #include <cmath>
+#include <algorithm>
+#include <limits>
 #include "Field.h"
 #include "Cell.h"
 #include "dbg.h"
+#include "Trace.h"
 
 extern "C" {
 #include "Field_C.h"
@@ -306,6 +309,168 @@ void InitializeCentersKMPP(std::vector<Position<C> >& centers, const std::vector
     }
 }
 
+// Collect the cells below cell with at most maxn objects, to use as the candidates for the
+// centers in InitializeCentersKMPar.
+template <int D, int C>
+void CollectCandidateCells(const Cell<D,C>* cell, long maxn,
+                           std::vector<const Cell<D,C>*>& cands)
+{
+    if (cell->getN() <= maxn || !cell->getLeft()) {
+        cands.push_back(cell);
+    } else {
+        CollectCandidateCells(cell->getLeft(), maxn, cands);
+        CollectCandidateCells(cell->getRight(), maxn, cands);
+    }
+}
+
+// Update dsq[j] and nearest[j], the distance to and index of the closest center to pos[j],
+// with the centers in [start,end).
+template <int C>
+void UpdateNearestCenters(const std::vector<Position<C> >& pos,
+                          const std::vector<Position<C> >& centers, long start, long end,
+                          std::vector<double>& dsq, std::vector<long>& nearest)
+{
+    const long m = pos.size();
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (long j=0; j<m; ++j) {
+        for (long i=start; i<end; ++i) {
+            const double d = (pos[j] - centers[i]).normSq();
+            if (d < dsq[j]) {
+                dsq[j] = d;
+                nearest[j] = i;
+            }
+        }
+    }
+}
+
+// Pick an index from 0..n-1 with probability proportional to p.
+inline long PickWeighted(const std::vector<double>& p, double sump)
+{
+    double u = urand() * sump;
+    const long n = p.size();
+    for (long j=0; j<n-1; ++j) {
+        if (u < p[j]) return j;
+        u -= p[j];
+    }
+    return n-1;
+}
+
+template <int D, int C>
+void InitializeCentersKMPar(std::vector<Position<C> >& centers, const std::vector<Cell<D,C>*>& cells)
+{
+    // This is the k-means|| algorithm of Bahmani et al (2012), which is an alternative to
+    // kmeans++ that needs only a few passes through the data, each of which can be done
+    // in parallel.
+    // 1. Pick the first center at random.
+    // 2. In each of a few rounds, select each point independently with probability
+    //    l d_i^2 / Sum d_i^2, where d_i is the distance to the nearest center selected so far,
+    //    and l ~ npatch is the oversampling factor.
+    // 3. Weight each selected point by the number of points closest to it, and use the
+    //    usual kmeans++ algorithm to pick the npatch centers from them.
+    //
+    // Rather than the individual points, we use the cells of the tree with N <= ntot/(4 npatch)
+    // as the candidates, with the same approximation for the sum of the d^2 of their points
+    // as in InitializeCentersKMPP.  The distances are updated in parallel, and the rest of
+    // the algorithm is cheap in comparison.
+
+    dbg<<"Initialize centers (kmeans||): "<<centers.size()<<"  "<<cells.size()<<std::endl;
+    const long ncenters = centers.size();
+    long ntot = 0;
+    for (size_t k=0; k<cells.size(); ++k) ntot += cells[k]->getN();
+
+    std::vector<const Cell<D,C>*> cands;
+    const long maxn = std::max(ntot / (4*ncenters), 1L);
+    for (size_t k=0; k<cells.size(); ++k) CollectCandidateCells(cells[k], maxn, cands);
+    const long m = cands.size();
+    dbg<<"Using "<<m<<" candidate cells with N <= "<<maxn<<std::endl;
+    if (m < 2*ncenters) {
+        // This only happens when npatch is nearly ntot.  Then kmeans++ is fast anyway.
+        dbg<<"Too few candidates.  Use kmeans++\n";
+        InitializeCentersKMPP(centers, cells);
+        return;
+    }
+
+    const double coef = C == ThreeD ? 0.6 : 0.5;
+    std::vector<Position<C> > pos(m);
+    std::vector<double> n(m);
+    for (long j=0; j<m; ++j) {
+        pos[j] = cands[j]->getPos();
+        n[j] = cands[j]->getN();
+    }
+    std::vector<double> dsq(m, std::numeric_limits<double>::max());
+    std::vector<long> nearest(m, -1);
+    std::vector<char> chosen(m, 0);
+    std::vector<Position<C> > sel;
+
+    // 1. The first one is chosen with probability proportional to N.
+    long j0 = PickWeighted(n, double(ntot));
+    sel.push_back(pos[j0]);
+    chosen[j0] = 1;
+
+    // 2. Oversample.  Bahmani et al found 5 rounds with l = npatch/2 to be plenty.
+    // Keep going if there are fewer than npatch of them.
+    const int nround = 5;
+    const double l = 0.5 * ncenters;
+    std::vector<double> phi(m);
+    long start = 0;
+    for (int r=0; r<nround || long(sel.size()) < ncenters; ++r) {
+        UpdateNearestCenters(pos, sel, start, sel.size(), dsq, nearest);
+        start = sel.size();
+        double sumphi = 0.;
+        for (long j=0; j<m; ++j) {
+            phi[j] = chosen[j] ? 0. : n[j] * (dsq[j] + coef * cands[j]->getSizeSq());
+            sumphi += phi[j];
+        }
+        xdbg<<"Round "<<r<<": nsel = "<<sel.size()<<", sumphi = "<<sumphi<<std::endl;
+        if (sumphi == 0.) break;
+        for (long j=0; j<m; ++j) {
+            if (phi[j] > 0. && urand() * sumphi < l * phi[j]) {
+                sel.push_back(pos[j]);
+                chosen[j] = 1;
+            }
+        }
+    }
+    UpdateNearestCenters(pos, sel, start, sel.size(), dsq, nearest);
+    const long nsel = sel.size();
+    dbg<<"Selected "<<nsel<<" candidates\n";
+    if (nsel < ncenters) {
+        dbg<<"Too few distinct candidates.  Use kmeans++\n";
+        InitializeCentersKMPP(centers, cells);
+        return;
+    }
+
+    // 3. Weight the selected points and pick the centers from them with kmeans++.
+    std::vector<double> wsel(nsel, 0.);
+    for (long j=0; j<m; ++j) wsel[nearest[j]] += n[j];
+    std::vector<double> dsq2(nsel, std::numeric_limits<double>::max());
+    std::vector<long> nearest2(nsel, -1);
+    std::vector<double> p(nsel);
+    std::vector<char> picked(nsel, 0);
+    long k = PickWeighted(wsel, double(ntot));
+    for (long i=0; i<ncenters; ++i) {
+        centers[i] = sel[k];
+        picked[k] = 1;
+        if (i == ncenters-1) break;
+        UpdateNearestCenters(sel, centers, i, i+1, dsq2, nearest2);
+        double sump = 0.;
+        for (long s=0; s<nsel; ++s) {
+            p[s] = picked[s] ? 0. : wsel[s] * dsq2[s];
+            sump += p[s];
+        }
+        if (sump > 0.) {
+            k = PickWeighted(p, sump);
+        } else {
+            // All the remaining ones are duplicates of the centers so far.  Pick one of them
+            // and shift it slightly as in InitializeCentersRand.
+            dbg<<"Found duplicate center!\n";
+            for (k=0; picked[k]; ++k);
+            sel[k] *= (1. + urand() * 1.e-8);
+        }
+    }
+}
+
 template <int D, int C>
 struct StoreCells
 {
@@ -487,10 +652,11 @@ struct AssignPatches
             inertia[patch_num] += (cell->getPos() - centers[patch_num]).normSq() * cell->getW();
 #endif
         } else {
-            std::vector<long>* indices = cell->getListInfo().indices;
-            xdbg<<"Leaf with N>1.  "<<indices->size()<<" indices\n";
-            for (size_t j=0; j<indices->size(); ++j) {
-                long index = (*indices)[j];
+            const ListLeafInfo& indices = cell->getListInfo();
+            const long n1 = cell->getN();
+            xdbg<<"Leaf with N>1.  "<<n1<<" indices\n";
+            for (long j=0; j<n1; ++j) {
+                long index = indices[j];
                 xdbg<<"    index = "<<index<<std::endl;
                 Assert(index < n);
                 patches[index] = patch_num;
@@ -761,6 +927,16 @@ void KMeansInitKMPP2(Field<D,C>*field, double* pycenters, int npatch)
     WriteCenters(centers, pycenters, npatch);
 }
 
+template <int D, int C>
+void KMeansInitKMPar2(Field<D,C>*field, double* pycenters, int npatch)
+{
+    dbg<<"Start KMeansInitKMPar for "<<npatch<<" patches\n";
+    const std::vector<Cell<D,C>*> cells = field->getCells();
+    std::vector<Position<C> > centers(npatch);
+    InitializeCentersKMPar(centers, cells);
+    WriteCenters(centers, pycenters, npatch);
+}
+
 template <int D, int C>
 void KMeansRun2(Field<D,C>*field, double* pycenters, int npatch, int max_iter, double tol,
                 bool alt)
@@ -790,6 +966,7 @@ void KMeansRun2(Field<D,C>*field, double* pycenters, int npatch, int max_iter, d
 
     for(int iter=0; iter<max_iter; ++iter) {
         dbg<<"Start iter "<<iter<<std::endl;
+        TraceScope trace("kmeans iteration", iter);
         // Update the inertia if we are doing the alternate version
         if (alt) {
             calculate_inertia.reset();
@@ -839,6 +1016,43 @@ void KMeansAssign2(Field<D,C>*field, double* pycenters, int npatch, long* patche
     dbg<<"After AssignPatches\n";
 }
 
+// One step of KMeans for a single chunk of a larger catalog.  Rather than update the centers,
+// this adds the sums that UpdateCenters would use to sums and weights, so they can be
+// accumulated over all the chunks.  If inertia is given, use it for the alt assignment.
+// (It should be normalized as in CalculateInertia::finalize.)  If new_inertia is given, add
+// the inertia of each patch with the standard assignment to it.  If sums is null, only
+// new_inertia is calculated.
+template <int D, int C>
+void KMeansChunk2(Field<D,C>*field, double* pycenters, int npatch, const double* inertia,
+                  double* sums, double* weights, double* new_inertia)
+{
+    dbg<<"Start KMeansChunk for "<<npatch<<" patches\n";
+    const std::vector<Cell<D,C>*> cells = field->getCells();
+
+    std::vector<Position<C> > centers(npatch);
+    ReadCenters(centers, pycenters, npatch);
+
+    std::vector<double> vinertia;
+    if (inertia) vinertia.assign(inertia, inertia + npatch);
+
+    if (sums) {
+        UpdateCenters<D,C> update_centers(npatch);
+        FindCellsInPatches(centers, cells, update_centers, inertia ? &vinertia : 0);
+        // Don't finalize.  We want the sums, not the centroids.
+        const int dim = C == Flat ? 2 : 3;
+        std::vector<double> s(npatch * dim);
+        WriteCenters(update_centers.new_centers, &s[0], npatch);
+        for (int i=0; i<npatch*dim; ++i) sums[i] += s[i];
+        for (int i=0; i<npatch; ++i) weights[i] += update_centers.w[i];
+    }
+
+    if (new_inertia) {
+        CalculateInertia<D,C> calculate_inertia(npatch, centers);
+        FindCellsInPatches(centers, cells, calculate_inertia);
+        for (int i=0; i<npatch; ++i) new_inertia[i] += calculate_inertia.inertia[i];
+    }
+}
+
 template <int D>
 void KMeansInitTree1(void* field, double* centers, int npatch, int coords)
 {
@@ -932,6 +1146,37 @@ void KMeansInitKMPP(void* field, double* centers, int npatch, int d, int coords)
     }
 }
 
+template <int D>
+void KMeansInitKMPar1(void* field, double* centers, int npatch, int coords)
+{
+    switch(coords) {
+      case Flat:
+           KMeansInitKMPar2(static_cast<Field<D,Flat>*>(field), centers, npatch);
+           break;
+      case Sphere:
+           KMeansInitKMPar2(static_cast<Field<D,Sphere>*>(field), centers, npatch);
+           break;
+      case ThreeD:
+           KMeansInitKMPar2(static_cast<Field<D,ThreeD>*>(field), centers, npatch);
+           break;
+    }
+}
+
+void KMeansInitKMPar(void* field, double* centers, int npatch, int d, int coords)
+{
+    switch(d) {
+      case NData:
+           KMeansInitKMPar1<NData>(field, centers, npatch, coords);
+           break;
+      case KData:
+           KMeansInitKMPar1<KData>(field, centers, npatch, coords);
+           break;
+      case GData:
+           KMeansInitKMPar1<GData>(field, centers, npatch, coords);
+           break;
+    }
+}
+
 template <int D>
 void KMeansRun1(void* field, double* centers, int npatch, int max_iter, double tol, bool alt,
                 int coords)
@@ -997,14 +1242,375 @@ void KMeansAssign(void* field, double* centers, int npatch, long* patches, long
     }
 }
 
+// A small k-d tree of the patch centers.  For 2d centers, z is taken to be 0.
+class CenterTree
+{
+public:
+    enum { MaxLeaf = 8 };
+
+    CenterTree(const double* centers, int npatch, int dim) :
+        _x(npatch), _y(npatch), _z(npatch), _index(npatch)
+    {
+        Assert(dim == 2 || dim == 3);
+        Assert(npatch > 0);
+        std::vector<long> order(npatch);
+        for (long k=0; k<npatch; ++k) order[k] = k;
+        std::vector<double> pos(centers, centers + npatch*dim);
+        build(order, pos, dim, 0, npatch);
+        for (long k=0; k<npatch; ++k) {
+            _index[k] = order[k];
+            _x[k] = pos[order[k]*dim];
+            _y[k] = pos[order[k]*dim+1];
+            _z[k] = dim == 3 ? pos[order[k]*dim+2] : 0.;
+        }
+        dbg<<"Built CenterTree with "<<_nodes.size()<<" nodes for "<<npatch<<" centers\n";
+    }
+
+    // The index of the closest center to p.
+    long findNearest(const double* p) const
+    {
+        long best = _index[0];
+        double best_dsq = SQR(p[0]-_x[0]) + SQR(p[1]-_y[0]) + SQR(p[2]-_z[0]);
+        search(0, p, best_dsq, best);
+        return best;
+    }
+
+    // Add the indices of all the centers whose distance to the box [lo,hi] may be <= sqrt(dsq).
+    void findNearBox(const double* lo, const double* hi, double dsq,
+                     std::vector<long>& indices) const
+    { findNearBox(0, lo, hi, dsq, indices); }
+
+private:
+
+    struct Node
+    {
+        double lo[3], hi[3];   // The bounding box of the centers in this node.
+        long start, end;       // The range of the centers in this node.
+        long right;            // The right child.  The left one is next.  -1 for a leaf.
+    };
+
+    struct CompareCoord
+    {
+        CompareCoord(const std::vector<double>& _pos, int _dim, int _j) :
+            pos(_pos), dim(_dim), j(_j) {}
+        bool operator()(long a, long b) const { return pos[a*dim+j] < pos[b*dim+j]; }
+        const std::vector<double>& pos;
+        int dim, j;
+    };
+
+    void build(std::vector<long>& order, const std::vector<double>& pos, int dim,
+               long start, long end)
+    {
+        const long n = _nodes.size();
+        _nodes.push_back(Node());
+        Node& node = _nodes.back();
+        node.start = start;
+        node.end = end;
+        node.right = -1;
+        for (int j=0; j<3; ++j) {
+            node.lo[j] = node.hi[j] = 0.;
+            if (j >= dim) continue;
+            node.lo[j] = node.hi[j] = pos[order[start]*dim+j];
+            for (long k=start+1; k<end; ++k) {
+                const double v = pos[order[k]*dim+j];
+                if (v < node.lo[j]) node.lo[j] = v;
+                if (v > node.hi[j]) node.hi[j] = v;
+            }
+        }
+        if (end - start <= MaxLeaf) return;
+
+        // Split at the median of the largest dimension.
+        int split = 0;
+        for (int j=1; j<dim; ++j)
+            if (node.hi[j] - node.lo[j] > node.hi[split] - node.lo[split]) split = j;
+        const long mid = (start + end) / 2;
+        std::nth_element(order.begin()+start, order.begin()+mid, order.begin()+end,
+                         CompareCoord(pos, dim, split));
+        // Note: node may be invalidated by push_back in the recursion, so use _nodes[n].
+        build(order, pos, dim, start, mid);
+        _nodes[n].right = _nodes.size();
+        build(order, pos, dim, mid, end);
+    }
+
+    // The square of the minimum distance between two boxes.  (Or a point if lo2 == hi2.)
+    static double minDistSq(const double* lo1, const double* hi1,
+                            const double* lo2, const double* hi2)
+    {
+        double dsq = 0.;
+        for (int j=0; j<3; ++j) {
+            if (hi2[j] < lo1[j]) dsq += SQR(lo1[j] - hi2[j]);
+            else if (lo2[j] > hi1[j]) dsq += SQR(lo2[j] - hi1[j]);
+        }
+        return dsq;
+    }
+
+    void search(long n, const double* p, double& best_dsq, long& best) const
+    {
+        const Node& node = _nodes[n];
+        if (node.right < 0) {
+            for (long k=node.start; k<node.end; ++k) {
+                const double dsq = SQR(p[0]-_x[k]) + SQR(p[1]-_y[k]) + SQR(p[2]-_z[k]);
+                if (dsq < best_dsq) {
+                    best_dsq = dsq;
+                    best = _index[k];
+                }
+            }
+        } else {
+            // Look in the closer child first, and skip the other one if it can't be closer.
+            const Node& left = _nodes[n+1];
+            const Node& right = _nodes[node.right];
+            const double dsq1 = minDistSq(left.lo, left.hi, p, p);
+            const double dsq2 = minDistSq(right.lo, right.hi, p, p);
+            if (dsq1 <= dsq2) {
+                search(n+1, p, best_dsq, best);
+                if (dsq2 < best_dsq) search(node.right, p, best_dsq, best);
+            } else {
+                search(node.right, p, best_dsq, best);
+                if (dsq1 < best_dsq) search(n+1, p, best_dsq, best);
+            }
+        }
+    }
+
+    void findNearBox(long n, const double* lo, const double* hi, double dsq,
+                     std::vector<long>& indices) const
+    {
+        const Node& node = _nodes[n];
+        if (minDistSq(node.lo, node.hi, lo, hi) > dsq) return;
+        if (node.right < 0) {
+            for (long k=node.start; k<node.end; ++k) {
+                const double pk[3] = { _x[k], _y[k], _z[k] };
+                if (minDistSq(lo, hi, pk, pk) <= dsq) indices.push_back(_index[k]);
+            }
+        } else {
+            findNearBox(n+1, lo, hi, dsq, indices);
+            findNearBox(node.right, lo, hi, dsq, indices);
+        }
+    }
+
+    std::vector<double> _x, _y, _z;  // The centers in the order of the tree.
+    std::vector<long> _index;        // The patch number of each of these.
+    std::vector<Node> _nodes;
+};
+
+// A grid over the bounding box of a set of points, with a list for each cell of the grid of
+// the centers that might be the closest one to some point in that cell.  These are usually
+// only a few centers, so finding the closest one to each point only needs a short loop over
+// contiguous arrays of their positions.  The lists are only made for cells with points in them.
+class CenterGrid
+{
+public:
+    CenterGrid(const double* centers, int npatch, int dim,
+               const double* x, const double* y, const double* z, long n)
+    {
+        // The bounding box of the points
+        for (int j=0; j<3; ++j) { _lo[j] = 0.; _n[j] = 1; _inv_h[j] = 0.; }
+        double hi[3] = { 0., 0., 0. };
+        _lo[0] = hi[0] = x[0];
+        _lo[1] = hi[1] = y[0];
+        if (z) _lo[2] = hi[2] = z[0];
+        for (long i=1; i<n; ++i) {
+            _lo[0] = std::min(_lo[0], x[i]); hi[0] = std::max(hi[0], x[i]);
+            _lo[1] = std::min(_lo[1], y[i]); hi[1] = std::max(hi[1], y[i]);
+            if (z) { _lo[2] = std::min(_lo[2], z[i]); hi[2] = std::max(hi[2], z[i]); }
+        }
+
+        // Use cells of the same size in each direction, with a few times more cells than
+        // centers in the volume (or area) of the points.
+        double vol = 1.;
+        int ndim = 0;
+        for (int j=0; j<dim; ++j) if (hi[j] > _lo[j]) { vol *= hi[j] - _lo[j]; ++ndim; }
+        // If the points are much thinner in some direction, this makes too many cells, so
+        // increase h until the total is reasonable.
+        if (ndim > 0) {
+            double h = std::pow(vol / (4. * npatch), 1./ndim);
+            double ntot;
+            do {
+                ntot = 1.;
+                for (int j=0; j<dim; ++j) {
+                    if (!(hi[j] > _lo[j])) continue;
+                    _n[j] = long(std::min((hi[j] - _lo[j]) / h, 1.e6)) + 1;
+                    _inv_h[j] = _n[j] / (hi[j] - _lo[j]);
+                    ntot *= _n[j];
+                }
+                h *= 1.25;
+            } while (ntot > 16. * npatch + 64.);
+        }
+        const long ncells = _n[0] * _n[1] * _n[2];
+
+        // Find which cells have points in them.
+        std::vector<char> used(ncells, 0);
+        for (long i=0; i<n; ++i) used[getCell(x[i], y[i], z ? z[i] : 0.)] = 1;
+        std::vector<long> cells;
+        for (long c=0; c<ncells; ++c) if (used[c]) cells.push_back(c);
+        const long nused = cells.size();
+
+        // Make the lists for these cells.
+        CenterTree tree(centers, npatch, dim);
+        std::vector<std::vector<long> > lists(nused);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,16)
+#endif
+        for (long k=0; k<nused; ++k) {
+            findCandidates(tree, centers, dim, cells[k], lists[k]);
+        }
+        _start.assign(ncells+1, 0);
+        for (long k=0; k<nused; ++k) _start[cells[k]+1] = lists[k].size();
+        for (long c=0; c<ncells; ++c) _start[c+1] += _start[c];
+        _index.resize(_start[ncells]);
+        _x.resize(_start[ncells]);
+        _y.resize(_start[ncells]);
+        _z.resize(_start[ncells]);
+        for (long k=0; k<nused; ++k) {
+            long m = _start[cells[k]];
+            for (size_t q=0; q<lists[k].size(); ++q, ++m) {
+                const long i = lists[k][q];
+                _index[m] = i;
+                _x[m] = centers[i*dim];
+                _y[m] = centers[i*dim+1];
+                _z[m] = dim == 3 ? centers[i*dim+2] : 0.;
+            }
+        }
+        dbg<<"Built CenterGrid with "<<_n[0]<<" x "<<_n[1]<<" x "<<_n[2]<<" cells, "
+            <<nused<<" used, with "<<double(_index.size())/nused<<" centers each\n";
+    }
+
+    long getCell(double x, double y, double z) const
+    {
+        long ix = long((x - _lo[0]) * _inv_h[0]);
+        long iy = long((y - _lo[1]) * _inv_h[1]);
+        long iz = long((z - _lo[2]) * _inv_h[2]);
+        ix = std::max(0L, std::min(ix, _n[0]-1));
+        iy = std::max(0L, std::min(iy, _n[1]-1));
+        iz = std::max(0L, std::min(iz, _n[2]-1));
+        return (iz * _n[1] + iy) * _n[0] + ix;
+    }
+
+    // The index of the closest center.  Ties go to the lowest index, as for a simple loop
+    // over all the centers.  dsq is a work space.
+    long findNearest(double x, double y, double z, std::vector<double>& dsq) const
+    {
+        const long c = getCell(x,y,z);
+        const long start = _start[c];
+        const long m = _start[c+1] - start;
+        if (long(dsq.size()) < m) dsq.resize(m);
+        calculateDistSq(x, y, z, start, m, &dsq[0]);
+        long kmin = 0;
+        for (long k=1; k<m; ++k) if (dsq[k] < dsq[kmin]) kmin = k;
+        return _index[start+kmin];
+    }
+
+private:
+
+    // This loop is the bulk of the work.  The compiler can vectorize it.
+    void calculateDistSq(double x, double y, double z, long start, long m, double* dsq) const
+    {
+        const double* xk = &_x[start];
+        const double* yk = &_y[start];
+        const double* zk = &_z[start];
+        for (long k=0; k<m; ++k) dsq[k] = SQR(x-xk[k]) + SQR(y-yk[k]) + SQR(z-zk[k]);
+    }
+
+    void findCandidates(const CenterTree& tree, const double* centers, int dim, long c,
+                        std::vector<long>& list) const
+    {
+        // The box for this cell, made a little larger to be safe from rounding errors
+        // in getCell.
+        const long ijk[3] = { c % _n[0], (c / _n[0]) % _n[1], c / (_n[0] * _n[1]) };
+        double lo[3], hi[3], mid[3];
+        for (int j=0; j<3; ++j) {
+            if (_inv_h[j] > 0.) {
+                lo[j] = _lo[j] + ijk[j] / _inv_h[j];
+                hi[j] = _lo[j] + (ijk[j]+1) / _inv_h[j];
+                const double eps = 1.e-8 * (hi[j] - lo[j]) + 1.e-12 * std::abs(lo[j]);
+                lo[j] -= eps;
+                hi[j] += eps;
+            } else {
+                lo[j] = hi[j] = _lo[j];
+            }
+            mid[j] = 0.5 * (lo[j] + hi[j]);
+        }
+        // Every point in the box is within dmax of the center closest to the middle of it,
+        // so any center farther than that from the whole box can't be the closest to any
+        // of them.  Increase this slightly, so ties between centers survive rounding errors.
+        const long i = tree.findNearest(mid);
+        const double ci[3] = { centers[i*dim], centers[i*dim+1], dim == 3 ? centers[i*dim+2] : 0. };
+        double dmaxsq = 0.;
+        for (int j=0; j<3; ++j) dmaxsq += SQR(std::max(ci[j] - lo[j], hi[j] - ci[j]));
+        tree.findNearBox(lo, hi, dmaxsq * (1. + 1.e-8), list);
+        std::sort(list.begin(), list.end());
+    }
+
+    double _lo[3];
+    double _inv_h[3];
+    long _n[3];
+    std::vector<long> _start;           // The list for cell c is _start[c]:_start[c+1]
+    std::vector<long> _index;           // The center numbers in each list, in order.
+    std::vector<double> _x, _y, _z;     // Their positions.
+};
+
+template <int D>
+void KMeansChunk1(void* field, double* centers, int npatch, double* inertia,
+                  double* sums, double* weights, double* new_inertia, int coords)
+{
+    switch(coords) {
+      case Flat:
+           KMeansChunk2(static_cast<Field<D,Flat>*>(field), centers, npatch, inertia,
+                        sums, weights, new_inertia);
+           break;
+      case Sphere:
+           KMeansChunk2(static_cast<Field<D,Sphere>*>(field), centers, npatch, inertia,
+                        sums, weights, new_inertia);
+           break;
+      case ThreeD:
+           KMeansChunk2(static_cast<Field<D,ThreeD>*>(field), centers, npatch, inertia,
+                        sums, weights, new_inertia);
+           break;
+    }
+}
+
+void KMeansChunk(void* field, double* centers, int npatch, double* inertia,
+                 double* sums, double* weights, double* new_inertia, int d, int coords)
+{
+    switch(d) {
+      case NData:
+           KMeansChunk1<NData>(field, centers, npatch, inertia, sums, weights, new_inertia,
+                               coords);
+           break;
+      case KData:
+           KMeansChunk1<KData>(field, centers, npatch, inertia, sums, weights, new_inertia,
+                               coords);
+           break;
+      case GData:
+           KMeansChunk1<GData>(field, centers, npatch, inertia, sums, weights, new_inertia,
+                               coords);
+           break;
+    }
+}
+
 void QuickAssign(double* centers, int npatch,
                  double* x, double* y, double* z, long* patches, long n)
 {
-    if (z) {
+    // The simple loop over all the centers is faster than making the CenterGrid if there are
+    // only a few of them or only a few points.
+    if (npatch > 32 && n > 16 * npatch) {
+        CenterGrid grid(centers, npatch, z ? 3 : 2, x, y, z, n);
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+        {
+            std::vector<double> dsq;
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+            for (long i=0; i<n; ++i) {
+                patches[i] = grid.findNearest(x[i], y[i], z ? z[i] : 0., dsq);
+            }
+        }
+    } else if (z) {
 #ifdef _OPENMP
 #pragma omp parallel for schedule(static)
 #endif
-        for (int i=0; i<n; ++i) {
+        for (long i=0; i<n; ++i) {
             int kmin = 0;
             double min_rsq = SQR(x[i]-centers[0]) + SQR(y[i]-centers[1]) + SQR(z[i]-centers[2]);
             for (int k=1; k<npatch; ++k) {
@@ -1020,7 +1626,7 @@ void QuickAssign(double* centers, int npatch,
 #ifdef _OPENMP
 #pragma omp parallel for schedule(static)
 #endif
-        for (int i=0; i<n; ++i) {
+        for (long i=0; i<n; ++i) {
             int kmin = 0;
             double min_rsq = SQR(x[i]-centers[0]) + SQR(y[i]-centers[1]);
             for (int k=1; k<npatch; ++k) {
@@ -1050,7 +1656,7 @@ void SelectPatch(int patch, double* centers, int npatch, double* x, double* y, d
 #ifdef _OPENMP
 #pragma omp parallel for schedule(static)
 #endif
-        for (int i=0; i<n; ++i) {
+        for (long i=0; i<n; ++i) {
             double p_dsq = SQR(x[i]-px) + SQR(y[i]-py) + SQR(z[i]-pz);
             use[i] = 1;
             for (int q=0; q<npatch; ++q) {
@@ -1072,7 +1678,7 @@ void SelectPatch(int patch, double* centers, int npatch, double* x, double* y, d
 #ifdef _OPENMP
 #pragma omp parallel for schedule(static)
 #endif
-        for (int i=0; i<n; ++i) {
+        for (long i=0; i<n; ++i) {
             double p_dsq = SQR(x[i]-px) + SQR(y[i]-py);
             use[i] = 1;
             for (int q=0; q<npatch; ++q) {
@@ -1089,31 +1695,36 @@ void SelectPatch(int patch, double* centers, int npatch, double* x, double* y, d
     }
 }
 
-void GenerateXYZ(double* x, double* y, double* z, double* ra, double* dec, double* r, long n)
-{
-#ifdef _OPENMP
-#pragma omp parallel for schedule(static)
-#endif
-    for (int i=0; i<n; ++i) {
-        double sr, cr, sd, cd;
-#ifdef _GLIBCXX_HAVE_SINCOS
-        ::sincos(ra[i],&sr,&cr);
-        ::sincos(dec[i],&sd,&cd);
+// With OpenMP 4, also let the compiler vectorize the trig functions. (e.g. with -ffast-math,
+// gcc uses the vector versions of sin and cos in glibc's libmvec.)
+#if defined(_OPENMP) && _OPENMP >= 201307
+#define PARALLEL_FOR_SIMD _Pragma("omp parallel for simd schedule(static)")
+#elif defined(_OPENMP)
+#define PARALLEL_FOR_SIMD _Pragma("omp parallel for schedule(static)")
 #else
-        // If the native sincos function isn't available, then most compilers will still optimize
-        // these into a single trig call for each.
-        sr = std::sin(ra[i]);
-        cr = std::cos(ra[i]);
-        sd = std::sin(dec[i]);
-        cd = std::cos(dec[i]);
+#define PARALLEL_FOR_SIMD
 #endif
-        x[i] = cd * cr;
-        y[i] = cd * sr;
-        z[i] = sd;
-        if (r) {
-            x[i] *= r[i];
-            y[i] *= r[i];
-            z[i] *= r[i];
+
+void GenerateXYZ(double* x, double* y, double* z, double* ra, double* dec, double* r, long n)
+{
+    // Note: sincos would take pointers to the outputs, which keeps the loop from being
+    // vectorized.  Without vectorization, most compilers still combine each sin, cos pair
+    // into a single sincos call.
+    if (r) {
+        PARALLEL_FOR_SIMD
+        for (long i=0; i<n; ++i) {
+            const double rcd = r[i] * std::cos(dec[i]);
+            x[i] = rcd * std::cos(ra[i]);
+            y[i] = rcd * std::sin(ra[i]);
+            z[i] = r[i] * std::sin(dec[i]);
+        }
+    } else {
+        PARALLEL_FOR_SIMD
+        for (long i=0; i<n; ++i) {
+            const double cd = std::cos(dec[i]);
+            x[i] = cd * std::cos(ra[i]);
+            y[i] = cd * std::sin(ra[i]);
+            z[i] = std::sin(dec[i]);
         }
     }
 }
@@ -0,0 +1,348 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+//#define DEBUGLOGGING
+
+#include <cmath>
+#include <algorithm>
+
+#include "dbg.h"
+#include "MultipoleCorr3.h"
+
+#ifdef _OPENMP
+#include "omp.h"
+#endif
+
+// The value that multiplies the weight for D.  (i.e. k for KData)
+template <int D>
+struct MultipoleHelper;
+
+template <>
+struct MultipoleHelper<NData>
+{
+    static double getWK(const Cell<NData,Flat>& c) { return c.getW(); }
+};
+
+template <>
+struct MultipoleHelper<KData>
+{
+    static double getWK(const Cell<KData,Flat>& c) { return c.getData().getWK(); }
+};
+
+template <int D>
+MultipoleCorr3<D>::MultipoleCorr3(
+    double minsep, double maxsep, int nbins, double binsize, double b, double bphi, int maxn,
+    double* weight_re, double* weight_im, double* zeta_re, double* zeta_im,
+    double* meanr, double* meanlogr, double* npairs) :
+    _minsep(minsep), _maxsep(maxsep), _nbins(nbins), _binsize(binsize), _b(b), _bphi(bphi),
+    _maxn(maxn), _weight_re(weight_re), _weight_im(weight_im),
+    _zeta_re(zeta_re), _zeta_im(zeta_im), _meanr(meanr), _meanlogr(meanlogr), _npairs(npairs)
+{
+    Assert(minsep > 0.);
+    Assert(maxn >= 0);
+    _logminsep = log(_minsep);
+    _minsepsq = _minsep*_minsep;
+    _maxsepsq = _maxsep*_maxsep;
+    _bmin = std::min(_b, _bphi);
+    // The distance to any neighbour is at least minsep, so this size of c1 uses at most half
+    // of the allowed error for every pair.
+    _minprimary = 0.5 * _bmin * _minsep;
+}
+
+template <int D>
+void MultipoleCorr3<D>::Moments::resize(int nbins, int maxn)
+{
+    a.resize(nbins * (maxn+1));
+    if (D == KData) ak.resize(nbins * (maxn+1));
+    ww.resize(nbins);
+    if (D == KData) wwkk.resize(nbins);
+    isused.resize(nbins);
+    used.reserve(nbins);
+    std::fill(isused.begin(), isused.end(), 0);
+    used.clear();
+    std::fill(a.begin(), a.end(), 0.);
+    std::fill(ak.begin(), ak.end(), 0.);
+    std::fill(ww.begin(), ww.end(), 0.);
+    std::fill(wwkk.begin(), wwkk.end(), 0.);
+}
+
+// Only clear the bins that were used, since most primaries only have neighbours in a few.
+template <int D>
+void MultipoleCorr3<D>::Moments::clear()
+{
+    const int nn = a.size() / ww.size();
+    for (size_t i=0; i<used.size(); ++i) {
+        const int b = used[i];
+        std::fill(&a[b*nn], &a[b*nn]+nn, 0.);
+        if (D == KData) std::fill(&ak[b*nn], &ak[b*nn]+nn, 0.);
+        ww[b] = 0.;
+        if (D == KData) wwkk[b] = 0.;
+        isused[b] = 0;
+    }
+    used.clear();
+}
+
+template <int D>
+void MultipoleCorr3<D>::Accum::resize(int nbins, int maxn)
+{
+    const int n = nbins * nbins * (maxn+1);
+    weight.assign(n, 0.);
+    if (D == KData) zeta.assign(n, 0.);
+    meanr.assign(nbins, 0.);
+    meanlogr.assign(nbins, 0.);
+    npairs.assign(nbins, 0.);
+}
+
+template <int D>
+std::pair<double,double> MultipoleCorr3<D>::calculateSelfSums(
+    const Cell<D,Flat>& c, SelfSums& sums) const
+{
+    const double w = c.getW();
+    const double wk = MultipoleHelper<D>::getWK(c);
+    if (c.getN() == 1) return std::make_pair(w*w, wk*wk);
+
+    std::pair<double,double> ret;
+    if (c.getLeft()) {
+        std::pair<double,double> l = calculateSelfSums(*c.getLeft(), sums);
+        std::pair<double,double> r = calculateSelfSums(*c.getRight(), sums);
+        ret = std::make_pair(l.first + r.first, l.second + r.second);
+    } else {
+        // A leaf with several objects, which are all within min_size of each other.
+        // The individual weights aren't kept, so take them to be equal.
+        const double n = c.getN();
+        ret = std::make_pair(w*w/n, wk*wk/n);
+    }
+    sums[&c] = ret;
+    return ret;
+}
+
+template <int D>
+void MultipoleCorr3<D>::findPrimaries(
+    const Cell<D,Flat>* c1, std::vector<const Cell<D,Flat>*>& primaries) const
+{
+    if (c1->getW() == 0.) return;
+    if (c1->getSize() <= _minprimary || !c1->getLeft()) {
+        primaries.push_back(c1);
+    } else {
+        findPrimaries(c1->getLeft(), primaries);
+        findPrimaries(c1->getRight(), primaries);
+    }
+}
+
+template <int D>
+void MultipoleCorr3<D>::findNeighbours(
+    const Cell<D,Flat>& c1, const Cell<D,Flat>& c2, const SelfSums& sums,
+    Moments& mom, Accum& acc) const
+{
+    if (c2.getW() == 0.) return;
+    const Position<Flat> dp = c2.getPos() - c1.getPos();
+    const double dsq = dp.normSq();
+    const double s = c1.getSize() + c2.getSize();
+
+    // Check if all the pairs are closer than minsep or farther than maxsep.
+    if (dsq < _minsepsq && s < _minsep && dsq < SQR(_minsep - s)) return;
+    if (dsq >= _maxsepsq && dsq >= SQR(_maxsep + s)) return;
+
+    // If c2 is small enough, use it as a single point.  This needs s/d < b for the radial
+    // bins, and s/d < bphi for the angle.
+    if (s == 0. || dsq * SQR(_bmin) >= s*s || !c2.getLeft()) {
+        if (dsq < _minsepsq || dsq >= _maxsepsq) return;
+        const double r = sqrt(dsq);
+        const double logr = log(r);
+        int k = int((logr - _logminsep) / _binsize);
+        if (k < 0) k = 0;
+        if (k >= _nbins) k = _nbins-1;
+
+        const double w2 = c2.getW();
+        const double wk2 = MultipoleHelper<D>::getWK(c2);
+        if (!mom.isused[k]) {
+            mom.isused[k] = 1;
+            mom.used.push_back(k);
+        }
+        if (c2.getN() == 1) {
+            mom.ww[k] += w2*w2;
+            if (D == KData) mom.wwkk[k] += wk2*wk2;
+        } else {
+            typename SelfSums::const_iterator it = sums.find(&c2);
+            Assert(it != sums.end());
+            mom.ww[k] += it->second.first;
+            if (D == KData) mom.wwkk[k] += it->second.second;
+        }
+
+        // exp(-i n phi) = conj(z)^n, where z = exp(i phi).
+        const std::complex<double> zc(dp.getX()/r, -dp.getY()/r);
+        std::complex<double>* a = &mom.a[k*(_maxn+1)];
+        std::complex<double> zn = 1.;
+        for (int n=0; n<=_maxn; ++n) {
+            a[n] += w2 * zn;
+            zn *= zc;
+        }
+        if (D == KData) {
+            std::complex<double>* ak = &mom.ak[k*(_maxn+1)];
+            zn = 1.;
+            for (int n=0; n<=_maxn; ++n) {
+                ak[n] += wk2 * zn;
+                zn *= zc;
+            }
+        }
+
+        const double ww = c1.getW() * w2;
+        acc.meanr[k] += ww * r;
+        acc.meanlogr[k] += ww * logr;
+        acc.npairs[k] += ww;
+    } else {
+        findNeighbours(c1, *c2.getLeft(), sums, mom, acc);
+        findNeighbours(c1, *c2.getRight(), sums, mom, acc);
+    }
+}
+
+template <int D>
+void MultipoleCorr3<D>::finishPrimary(const Cell<D,Flat>& c1, Moments& mom, Accum& acc) const
+{
+    const int nn = _maxn+1;
+    const double w1 = c1.getW();
+    const double wk1 = MultipoleHelper<D>::getWK(c1);
+    for (size_t i1=0; i1<mom.used.size(); ++i1) {
+        const int b1 = mom.used[i1];
+        const std::complex<double>* a1 = &mom.a[b1*nn];
+        for (size_t i2=0; i2<mom.used.size(); ++i2) {
+            const int b2 = mom.used[i2];
+            const std::complex<double>* a2 = &mom.a[b2*nn];
+            std::complex<double>* w = &acc.weight[(b1*_nbins + b2)*nn];
+            const double self = (b1 == b2) ? mom.ww[b1] : 0.;
+            for (int n=0; n<nn; ++n) w[n] += w1 * (a1[n] * std::conj(a2[n]) - self);
+            if (D == KData) {
+                const std::complex<double>* ak1 = &mom.ak[b1*nn];
+                const std::complex<double>* ak2 = &mom.ak[b2*nn];
+                std::complex<double>* z = &acc.zeta[(b1*_nbins + b2)*nn];
+                const double selfk = (b1 == b2) ? mom.wwkk[b1] : 0.;
+                for (int n=0; n<nn; ++n) z[n] += wk1 * (ak1[n] * std::conj(ak2[n]) - selfk);
+            }
+        }
+    }
+    mom.clear();
+}
+
+template <int D>
+void MultipoleCorr3<D>::process(const Field<D,Flat>& field1, const Field<D,Flat>& field2,
+                                bool dots)
+{
+    const std::vector<Cell<D,Flat>*>& cells1 = field1.getCells();
+    const std::vector<Cell<D,Flat>*>& cells2 = field2.getCells();
+    std::vector<const Cell<D,Flat>*> primaries;
+    for (size_t i=0; i<cells1.size(); ++i) findPrimaries(cells1[i], primaries);
+    const long np = primaries.size();
+    const long n2 = cells2.size();
+    // This is done before the parallel section, so the threads only read from sums.
+    SelfSums sums;
+    for (long j=0; j<n2; ++j) calculateSelfSums(*cells2[j], sums);
+    dbg<<"MultipoleCorr3: "<<np<<" primary cells, "<<n2<<" top level cells in field2\n";
+
+#ifdef _OPENMP
+#pragma omp parallel
+    {
+#endif
+        Moments mom;
+        mom.resize(_nbins, _maxn);
+        Accum acc;
+        acc.resize(_nbins, _maxn);
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic,16)
+#endif
+        for (long i=0; i<np; ++i) {
+            if (dots && i % 1000 == 0) {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+                { std::cout<<'.'<<std::flush; }
+            }
+            const Cell<D,Flat>& c1 = *primaries[i];
+            for (long j=0; j<n2; ++j) findNeighbours(c1, *cells2[j], sums, mom, acc);
+            finishPrimary(c1, mom, acc);
+        }
+
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+        {
+            const long n = acc.weight.size();
+            for (long i=0; i<n; ++i) {
+                _weight_re[i] += std::real(acc.weight[i]);
+                _weight_im[i] += std::imag(acc.weight[i]);
+            }
+            if (D == KData) {
+                for (long i=0; i<n; ++i) {
+                    _zeta_re[i] += std::real(acc.zeta[i]);
+                    _zeta_im[i] += std::imag(acc.zeta[i]);
+                }
+            }
+            for (int k=0; k<_nbins; ++k) {
+                _meanr[k] += acc.meanr[k];
+                _meanlogr[k] += acc.meanlogr[k];
+                _npairs[k] += acc.npairs[k];
+            }
+        }
+#ifdef _OPENMP
+    }
+#endif
+    if (dots) std::cout<<std::endl;
+}
+
+//
+//
+// The C interface for python
+//
+//
+
+extern "C" {
+#include "BinnedCorr3_C.h"
+}
+
+template <int D>
+void ProcessMultipole3c(void* field1, void* field2, int dots,
+                        double minsep, double maxsep, int nbins, double binsize,
+                        double b, double bphi, int maxn,
+                        double* weight_re, double* weight_im, double* zeta_re, double* zeta_im,
+                        double* meanr, double* meanlogr, double* npairs)
+{
+    MultipoleCorr3<D> corr(minsep, maxsep, nbins, binsize, b, bphi, maxn,
+                           weight_re, weight_im, zeta_re, zeta_im, meanr, meanlogr, npairs);
+    corr.process(*static_cast<Field<D,Flat>*>(field1), *static_cast<Field<D,Flat>*>(field2),
+                 dots);
+}
+
+void ProcessMultipole3(void* field1, void* field2, int dots, int d, int coords,
+                       double minsep, double maxsep, int nbins, double binsize,
+                       double b, double bphi, int maxn,
+                       double* weight_re, double* weight_im, double* zeta_re, double* zeta_im,
+                       double* meanr, double* meanlogr, double* npairs)
+{
+    dbg<<"Start ProcessMultipole3 "<<d<<" "<<coords<<std::endl;
+    Assert(coords == Flat);
+    switch(d) {
+      case NData:
+           ProcessMultipole3c<NData>(field1, field2, dots, minsep, maxsep, nbins, binsize,
+                                     b, bphi, maxn, weight_re, weight_im, zeta_re, zeta_im,
+                                     meanr, meanlogr, npairs);
+           break;
+      case KData:
+           ProcessMultipole3c<KData>(field1, field2, dots, minsep, maxsep, nbins, binsize,
+                                     b, bphi, maxn, weight_re, weight_im, zeta_re, zeta_im,
+                                     meanr, meanlogr, npairs);
+           break;
+      default:
+           Assert(false);
+    }
+}
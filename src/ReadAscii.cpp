@@ -0,0 +1,377 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+//#define DEBUGLOGGING
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <limits>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "dbg.h"
+
+#ifdef _OPENMP
+#include "omp.h"
+#endif
+
+extern "C" {
+#include "ReadAscii_C.h"
+}
+
+// A read-only memory map of a whole file.
+class MappedAsciiFile
+{
+public:
+    MappedAsciiFile(const char* file_name) : _data(0), _size(0), _fd(-1)
+    {
+        _fd = open(file_name, O_RDONLY);
+        if (_fd < 0) return;
+        struct stat st;
+        if (fstat(_fd, &st) != 0) {
+            close(_fd);
+            _fd = -1;
+            return;
+        }
+        _size = st.st_size;
+        if (_size == 0) return;
+        void* p = mmap(0, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+        if (p == MAP_FAILED) {
+            close(_fd);
+            _fd = -1;
+            _size = 0;
+            return;
+        }
+        _data = static_cast<const char*>(p);
+        madvise(p, _size, MADV_SEQUENTIAL);
+    }
+
+    ~MappedAsciiFile()
+    {
+        if (_data) munmap(const_cast<char*>(_data), _size);
+        if (_fd >= 0) close(_fd);
+    }
+
+    bool ok() const { return _fd >= 0; }
+    const char* begin() const { return _data; }
+    const char* end() const { return _data + _size; }
+    size_t size() const { return _size; }
+
+private:
+    const char* _data;
+    size_t _size;
+    int _fd;
+};
+
+// Space, \t, \v, \f or \r.  (Lines end at \n, so that one doesn't matter.)
+inline bool IsSpace(char c)
+{ return c == ' ' || (c >= '\t' && c <= '\r'); }
+
+inline bool IsDigit(char c)
+{ return c >= '0' && c <= '9'; }
+
+// The exact powers of 10 as doubles.
+static const double exact_pow10[] = {
+    1.e0, 1.e1, 1.e2, 1.e3, 1.e4, 1.e5, 1.e6, 1.e7, 1.e8, 1.e9, 1.e10, 1.e11,
+    1.e12, 1.e13, 1.e14, 1.e15, 1.e16, 1.e17, 1.e18, 1.e19, 1.e20, 1.e21, 1.e22
+};
+
+// Parse the number in [p,end), which has no whitespace around it into v.  Returns false if
+// it is not a valid number.
+// Most numbers in catalogs have at most 15 significant digits and a small exponent.  Then
+// both the integer mantissa and the power of 10 are exact doubles, so a single multiply or
+// divide gives the correctly rounded result.  (Clinger, 1990)  Anything else uses strtod.
+bool ParseDouble(const char* p, const char* end, double& v)
+{
+    const char* start = p;
+    bool neg = false;
+    if (p < end && (*p == '-' || *p == '+')) neg = (*p++ == '-');
+    unsigned long long m = 0;
+    int ndigits = 0;      // Significant digits, not including leading zeros.
+    int e10 = 0;
+    bool any = false;
+    for (; p < end && IsDigit(*p); ++p) {
+        any = true;
+        if (m > 0 || *p != '0') {
+            if (++ndigits <= 18) m = m * 10 + (*p - '0');
+            else ++e10;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (++p; p < end && IsDigit(*p); ++p) {
+            any = true;
+            if (m > 0 || *p != '0') {
+                if (++ndigits <= 18) { m = m * 10 + (*p - '0'); --e10; }
+            } else {
+                --e10;
+            }
+        }
+    }
+    if (any && p < end && (*p == 'e' || *p == 'E' || *p == 'd' || *p == 'D')) {
+        ++p;
+        bool eneg = false;
+        if (p < end && (*p == '-' || *p == '+')) eneg = (*p++ == '-');
+        if (p == end || !IsDigit(*p)) any = false;
+        int e = 0;
+        for (; p < end && IsDigit(*p); ++p) if (e < 100000) e = e * 10 + (*p - '0');
+        e10 += eneg ? -e : e;
+    }
+    if (any && p == end && ndigits <= 15 && e10 >= -22 && e10 <= 22) {
+        v = double(m);
+        if (e10 < 0) v /= exact_pow10[-e10];
+        else v *= exact_pow10[e10];
+        if (neg) v = -v;
+        return true;
+    }
+
+    // Fall back to strtod for everything else, including nan, inf, and Fortran-style 1.0d3.
+    const long n = end - start;
+    char buf[64];
+    std::string sbuf;
+    char* s = buf;
+    if (n >= long(sizeof(buf))) {
+        sbuf.assign(start, end);
+        s = &sbuf[0];
+    } else {
+        std::memcpy(buf, start, n);
+        buf[n] = '\0';
+    }
+    for (long i=0; i<n; ++i) if (s[i] == 'd' || s[i] == 'D') s[i] = 'e';
+    char* e;
+    v = std::strtod(s, &e);
+    return n > 0 && *e == '\0';
+}
+
+// The parts of a file that are common to both functions.
+class AsciiFile
+{
+public:
+    AsciiFile(const char* file_name, const char* comment_marker, char delimiter) :
+        _file(file_name), _comment(comment_marker), _ncomment(std::strlen(comment_marker)),
+        _delim(delimiter)
+    {
+        if (!_file.ok()) return;
+
+        // Split the file into chunks at line boundaries, a few for each thread.
+#ifdef _OPENMP
+        const int nthreads = omp_get_max_threads();
+#else
+        const int nthreads = 1;
+#endif
+        const size_t min_chunk = 1<<20;
+        long nchunks = std::min(long(4 * nthreads), long(_file.size() / min_chunk) + 1);
+        _chunks.push_back(_file.begin());
+        for (long k=1; k<nchunks; ++k) {
+            const char* p = _file.begin() + _file.size() / nchunks * k;
+            if (p < _chunks.back()) continue;
+            p = static_cast<const char*>(std::memchr(p, '\n', _file.end() - p));
+            if (!p) break;
+            _chunks.push_back(p+1);
+        }
+        _chunks.push_back(_file.end());
+        nchunks = _chunks.size()-1;
+
+        // Count the data rows in each chunk.
+        _first_row.resize(nchunks+1, 0);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+        for (long k=0; k<nchunks; ++k) {
+            long n = 0;
+            for (const char* p=_chunks[k]; p<_chunks[k+1]; ) {
+                const char* eol = findEOL(p, _chunks[k+1]);
+                if (isData(p, eol)) ++n;
+                p = eol + 1;
+            }
+            _first_row[k+1] = n;
+        }
+        for (long k=0; k<nchunks; ++k) _first_row[k+1] += _first_row[k];
+        dbg<<"Found "<<_first_row[nchunks]<<" rows in "<<nchunks<<" chunks of "<<file_name<<"\n";
+    }
+
+    bool ok() const { return _file.ok(); }
+    long nchunks() const { return long(_chunks.size()) - 1; }
+    long nrows() const { return _first_row.back(); }
+
+    // The number of rows that will be selected.
+    long nselected(long start, long end, long every_nth) const
+    {
+        if (end < 0 || end > nrows()) end = nrows();
+        if (end <= start) return 0;
+        return (end - start - 1) / every_nth + 1;
+    }
+
+    // The number of columns in the first data row.
+    int ncols() const
+    {
+        for (const char* p=_file.begin(); p<_file.end(); ) {
+            const char* eol = findEOL(p, _file.end());
+            if (isData(p, eol)) {
+                std::vector<const char*> fields;
+                split(p, stripComment(p, eol), fields);
+                return fields.size() / 2;
+            }
+            p = eol + 1;
+        }
+        return 0;
+    }
+
+    // Parse the columns in chunk k.  col_index[j] is the index of column j in out, or -1.
+    long readChunk(long k, long start, long end, long every_nth,
+                   const std::vector<int>& col_index, double** out) const
+    {
+        const double nan = std::numeric_limits<double>::quiet_NaN();
+        const int maxcol = col_index.size() - 1;
+        std::vector<const char*> fields;
+        long nbad = 0;
+        long row = _first_row[k];
+        for (const char* p=_chunks[k]; p<_chunks[k+1]; ) {
+            const char* eol = findEOL(p, _chunks[k+1]);
+            if (isData(p, eol)) {
+                if (row >= start && (end < 0 || row < end) && (row - start) % every_nth == 0) {
+                    const long i = (row - start) / every_nth;
+                    split(p, stripComment(p, eol), fields, maxcol);
+                    const int nf = fields.size() / 2;
+                    bool bad = false;
+                    for (int j=1; j<=maxcol; ++j) {
+                        if (col_index[j] < 0) continue;
+                        double v;
+                        if (j > nf || !ParseDouble(fields[2*j-2], fields[2*j-1], v)) {
+                            v = nan;
+                            bad = true;
+                        }
+                        out[col_index[j]][i] = v;
+                    }
+                    if (bad) ++nbad;
+                }
+                ++row;
+            }
+            p = eol + 1;
+        }
+        return nbad;
+    }
+
+private:
+
+    const char* findEOL(const char* p, const char* end) const
+    {
+        const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        return eol ? eol : end;
+    }
+
+    bool isComment(const char* p, const char* eol) const
+    {
+        return _ncomment > 0 && size_t(eol - p) >= _ncomment &&
+            std::strncmp(p, _comment, _ncomment) == 0;
+    }
+
+    // A line is data if it isn't blank once any comment is removed.
+    bool isData(const char* p, const char* eol) const
+    {
+        while (p < eol && IsSpace(*p)) ++p;
+        return p < eol && !isComment(p, eol);
+    }
+
+    const char* stripComment(const char* p, const char* eol) const
+    {
+        if (_ncomment == 0) return eol;
+        while ((p = static_cast<const char*>(std::memchr(p, _comment[0], eol - p)))) {
+            if (isComment(p, eol)) return p;
+            ++p;
+        }
+        return eol;
+    }
+
+    // Split [p,eol) into fields, each of which is stored as a begin, end pair, without the
+    // surrounding whitespace.  Stop after maxcol fields if maxcol > 0.
+    void split(const char* p, const char* eol, std::vector<const char*>& fields,
+               int maxcol=0) const
+    {
+        fields.clear();
+        if (_delim == 0) {
+            while (true) {
+                while (p < eol && IsSpace(*p)) ++p;
+                if (p == eol) break;
+                fields.push_back(p);
+                while (p < eol && !IsSpace(*p)) ++p;
+                fields.push_back(p);
+                if (maxcol > 0 && int(fields.size()) >= 2*maxcol) break;
+            }
+        } else {
+            while (true) {
+                const char* q = p;
+                while (q < eol && *q != _delim) ++q;
+                const char* b = p;
+                const char* e = q;
+                while (b < e && IsSpace(*b)) ++b;
+                while (e > b && IsSpace(*(e-1))) --e;
+                fields.push_back(b);
+                fields.push_back(e);
+                if (q == eol || (maxcol > 0 && int(fields.size()) >= 2*maxcol)) break;
+                p = q + 1;
+            }
+        }
+    }
+
+    MappedAsciiFile _file;
+    const char* _comment;
+    size_t _ncomment;
+    char _delim;
+    std::vector<const char*> _chunks;  // The start of each chunk, and the end of the file.
+    std::vector<long> _first_row;      // The index of the first data row in each chunk.
+};
+
+long CountAsciiRows(const char* file_name, const char* comment_marker, char delimiter,
+                    long start, long end, long every_nth, int* ncols)
+{
+    dbg<<"Start CountAsciiRows for "<<file_name<<std::endl;
+    AsciiFile file(file_name, comment_marker, delimiter);
+    if (!file.ok()) return -1;
+    *ncols = file.ncols();
+    return file.nselected(start, end, every_nth);
+}
+
+long ReadAsciiColumns(const char* file_name, const char* comment_marker, char delimiter,
+                      long start, long end, long every_nth,
+                      int ncol, const int* cols, double** out, long nrows)
+{
+    dbg<<"Start ReadAsciiColumns for "<<file_name<<std::endl;
+    AsciiFile file(file_name, comment_marker, delimiter);
+    if (!file.ok() || file.nselected(start, end, every_nth) != nrows) return -1;
+
+    int maxcol = 0;
+    for (int j=0; j<ncol; ++j) maxcol = std::max(maxcol, cols[j]);
+    std::vector<int> col_index(maxcol+1, -1);
+    for (int j=0; j<ncol; ++j) {
+        Assert(cols[j] >= 1);
+        col_index[cols[j]] = j;
+    }
+
+    const long nchunks = file.nchunks();
+    long nbad = 0;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) reduction(+:nbad)
+#endif
+    for (long k=0; k<nchunks; ++k) {
+        nbad += file.readChunk(k, start, end, every_nth, col_index, out);
+    }
+    dbg<<"Read "<<nrows<<" rows with "<<nbad<<" bad rows\n";
+    return nbad;
+}
@@ -0,0 +1,126 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#include <algorithm>
+
+#include "dbg.h"
+#include "ThreadBudget.h"
+
+#ifdef _OPENMP
+#include "omp.h"
+#include <pthread.h>
+#endif
+
+// Without OpenMP, each call only uses one thread anyway, so there is nothing to share.
+#ifdef _OPENMP
+
+static pthread_mutex_t budget_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t budget_cond = PTHREAD_COND_INITIALIZER;
+static int budget_total = 0;  // 0 means not set yet.
+static int budget_used = 0;
+static int phase_cap[NThreadPhases] = { 0, 0 };
+static int phase_used[NThreadPhases] = { 0, 0 };
+
+// Whether the current (python) thread already has some threads from the budget.
+static __thread bool budget_held = false;
+
+void SetThreadBudget(int nthreads)
+{
+    pthread_mutex_lock(&budget_mutex);
+    budget_total = std::max(nthreads, 1);
+    pthread_cond_broadcast(&budget_cond);
+    pthread_mutex_unlock(&budget_mutex);
+}
+
+int GetThreadBudget()
+{
+    pthread_mutex_lock(&budget_mutex);
+    if (budget_total == 0) budget_total = omp_get_max_threads();
+    const int n = budget_total;
+    pthread_mutex_unlock(&budget_mutex);
+    return n;
+}
+
+void SetPhaseThreads(int phase, int n)
+{
+    Assert(phase >= 0 && phase < NThreadPhases);
+    pthread_mutex_lock(&budget_mutex);
+    phase_cap[phase] = std::max(n, 0);
+    pthread_cond_broadcast(&budget_cond);
+    pthread_mutex_unlock(&budget_mutex);
+}
+
+int GetPhaseThreads(int phase)
+{
+    Assert(phase >= 0 && phase < NThreadPhases);
+    pthread_mutex_lock(&budget_mutex);
+    const int n = phase_cap[phase];
+    pthread_mutex_unlock(&budget_mutex);
+    return n;
+}
+
+PhaseThreads::PhaseThreads(int phase) :
+    _phase(phase), _n(omp_get_max_threads()), _old(_n), _owner(false)
+{
+    Assert(phase >= 0 && phase < NThreadPhases);
+    if (budget_held || omp_in_parallel()) return;
+
+    pthread_mutex_lock(&budget_mutex);
+    if (budget_total == 0) budget_total = omp_get_max_threads();
+    for (;;) {
+        // The budget or caps may have been lowered since the others started, so these can
+        // be negative.
+        int n = budget_total - budget_used;
+        if (phase_cap[phase] > 0) n = std::min(n, phase_cap[phase] - phase_used[phase]);
+        if (n > 0) {
+            _n = n;
+            break;
+        }
+        pthread_cond_wait(&budget_cond, &budget_mutex);
+    }
+    budget_used += _n;
+    phase_used[phase] += _n;
+    pthread_mutex_unlock(&budget_mutex);
+    dbg<<"Phase "<<phase<<" has "<<_n<<" threads\n";
+
+    _owner = true;
+    budget_held = true;
+    omp_set_num_threads(_n);
+}
+
+PhaseThreads::~PhaseThreads()
+{
+    if (!_owner) return;
+    omp_set_num_threads(_old);
+    budget_held = false;
+    pthread_mutex_lock(&budget_mutex);
+    budget_used -= _n;
+    phase_used[_phase] -= _n;
+    pthread_cond_broadcast(&budget_cond);
+    pthread_mutex_unlock(&budget_mutex);
+}
+
+#else
+
+static int phase_cap[NThreadPhases] = { 0, 0 };
+
+void SetThreadBudget(int nthreads) {}
+int GetThreadBudget() { return 1; }
+void SetPhaseThreads(int phase, int n) { phase_cap[phase] = std::max(n, 0); }
+int GetPhaseThreads(int phase) { return phase_cap[phase]; }
+
+PhaseThreads::PhaseThreads(int phase) : _phase(phase), _n(1), _old(1), _owner(false) {}
+PhaseThreads::~PhaseThreads() {}
+
+#endif
@@ -0,0 +1,195 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#include <vector>
+#include <set>
+#include <string>
+#include <algorithm>
+#include <cstdio>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "dbg.h"
+#include "Trace.h"
+
+volatile bool trace_on = false;
+
+struct TraceEvent
+{
+    const char* name;
+    long arg;
+    long long start;
+    long long end;
+    int tid;
+
+    bool operator<(const TraceEvent& rhs) const { return start < rhs.start; }
+};
+
+// The ring buffer of one thread.
+struct TraceBuffer
+{
+    std::vector<TraceEvent> events;
+    long nrecorded;     // The next event goes in events[nrecorded % events.size()].
+    long generation;    // The StartTrace call that these events are from.
+    int tid;
+};
+
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+// The buffers are never deleted, since the threads that own them may still be using them.
+static std::vector<TraceBuffer*> trace_buffers;
+static std::set<std::string> trace_names;
+static long trace_nevents = 0;
+static volatile long trace_generation = 0;
+static __thread TraceBuffer* local_buffer = 0;
+
+long long TraceNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void StartTrace(long nevents)
+{
+    pthread_mutex_lock(&trace_mutex);
+    trace_nevents = std::max(nevents, 1L);
+    ++trace_generation;
+    trace_on = true;
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+void StopTrace()
+{ trace_on = false; }
+
+// The buffer for the current thread, emptied if it is from an earlier StartTrace.
+static TraceBuffer& GetTraceBuffer()
+{
+    if (!local_buffer || local_buffer->generation != trace_generation) {
+        pthread_mutex_lock(&trace_mutex);
+        if (!local_buffer) {
+            local_buffer = new TraceBuffer();
+            local_buffer->tid = trace_buffers.size() + 1;
+            trace_buffers.push_back(local_buffer);
+        }
+        local_buffer->events.resize(trace_nevents);
+        local_buffer->nrecorded = 0;
+        local_buffer->generation = trace_generation;
+        pthread_mutex_unlock(&trace_mutex);
+    }
+    return *local_buffer;
+}
+
+void TraceRecord(const char* name, long arg, long long start, long long end)
+{
+    TraceBuffer& buf = GetTraceBuffer();
+    TraceEvent& e = buf.events[buf.nrecorded % buf.events.size()];
+    e.name = name;
+    e.arg = arg;
+    e.start = start;
+    e.end = end;
+    e.tid = buf.tid;
+    ++buf.nrecorded;
+}
+
+void TraceRecordCopy(const char* name, long arg, long long start, long long end)
+{
+    pthread_mutex_lock(&trace_mutex);
+    const char* copy = trace_names.insert(name).first->c_str();
+    pthread_mutex_unlock(&trace_mutex);
+    TraceRecord(copy, arg, start, end);
+}
+
+static std::string JSONString(const char* s)
+{
+    std::string out = "\"";
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') out += '\\';
+        if (*s >= 0 && *s < ' ') out += ' ';
+        else out += *s;
+    }
+    return out + "\"";
+}
+
+bool WriteTrace(const char* file_name)
+{
+    FILE* fout = fopen(file_name, "w");
+    if (!fout) return false;
+
+    pthread_mutex_lock(&trace_mutex);
+    std::vector<TraceEvent> events;
+    std::vector<int> tids;
+    long ndropped = 0;
+    for (size_t i=0; i<trace_buffers.size(); ++i) {
+        const TraceBuffer& buf = *trace_buffers[i];
+        if (buf.generation != trace_generation || buf.nrecorded == 0) continue;
+        const long n = std::min(buf.nrecorded, long(buf.events.size()));
+        events.insert(events.end(), buf.events.begin(), buf.events.begin() + n);
+        ndropped += buf.nrecorded - n;
+        tids.push_back(buf.tid);
+    }
+    pthread_mutex_unlock(&trace_mutex);
+    std::sort(events.begin(), events.end());
+    dbg<<"Write "<<events.size()<<" trace events to "<<file_name<<std::endl;
+
+    // Name the process by the host and pid, so the traces from an MPI run can be put together
+    // and still tell which process each event was on.
+    const int pid = getpid();
+    char host[256] = "";
+    gethostname(host, sizeof(host)-1);
+    char pname[300];
+    snprintf(pname, sizeof(pname), "%s:%d", host, pid);
+
+    fprintf(fout, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    fprintf(fout, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": 0, "
+            "\"args\": {\"name\": %s, \"dropped_events\": %ld}}",
+            pid, JSONString(pname).c_str(), ndropped);
+    for (size_t i=0; i<tids.size(); ++i) {
+        fprintf(fout, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+                "\"args\": {\"name\": \"thread %d\"}}", pid, tids[i], tids[i]);
+    }
+    // Chrome uses microseconds.  Write them as integer + fraction, since a double doesn't
+    // have enough precision for nanoseconds since 1970.
+    for (size_t i=0; i<events.size(); ++i) {
+        const TraceEvent& e = events[i];
+        const long long dur = e.end - e.start;
+        fprintf(fout, ",\n{\"name\": %s, \"cat\": \"treecorr\", \"ph\": \"X\", "
+                "\"pid\": %d, \"tid\": %d, \"ts\": %lld.%03lld, \"dur\": %lld.%03lld, "
+                "\"args\": {\"i\": %ld}}",
+                JSONString(e.name).c_str(), pid, e.tid, e.start / 1000, e.start % 1000,
+                dur / 1000, dur % 1000, e.arg);
+    }
+    fprintf(fout, "\n]}\n");
+    fclose(fout);
+    return true;
+}
+
+extern "C" {
+#include "Trace_C.h"
+}
+
+void SetTrace(long nevents)
+{
+    if (nevents > 0) StartTrace(nevents);
+    else StopTrace();
+}
+
+int WriteTraceFile(const char* file_name)
+{ return WriteTrace(file_name); }
+
+long long GetTraceTime()
+{ return TraceNow(); }
+
+void AddTraceEvent(const char* name, long arg, long long start)
+{ if (trace_on) TraceRecordCopy(name, arg, start, TraceNow()); }
@@ -57,6 +57,8 @@ class MockComm(object):
     """A class to mock up the MPI Comm API for a multiprocessing Pipe.
 
     """
+    ANY_SOURCE = -1
+
     def __init__(self, rank, size, pipes, barrier):
         self.rank = rank
         self.size = size
@@ -76,7 +78,10 @@ class MockComm(object):
             self.msg = msg
 
     def recv(self, source):
-        if source != self.rank:
+        if source == self.ANY_SOURCE:
+            from multiprocessing.connection import wait
+            msg = wait(list(self.pipes.values()))[0].recv()
+        elif source != self.rank:
             msg = self.pipes[source].recv()
         else:
             msg = self.msg
@@ -117,6 +122,23 @@ class MockComm(object):
             new_data.append(self.recv(p))
         return new_data
 
+    def allgather(self, data):
+        data = self.gather(data, 0)
+        return self.bcast(data, 0)
+
+    def allreduce(self, data):
+        # Only op=MPI.SUM, which is the default.
+        data = self.gather(data, 0)
+        if self.rank == 0:
+            data = sum(data[1:], data[0])
+        return self.bcast(data, 0)
+
+    def Reduce(self, sendbuf, recvbuf, root=0):
+        # Only op=MPI.SUM, which is the default.
+        data = self.gather(sendbuf.copy(), root)
+        if self.rank == root:
+            recvbuf[:] = sum(data[1:], data[0])
+
 
 def mock_mpiexec(nproc, target):
     """Run a function, given as target, as though it were an MPI session using mpiexec -n nproc
@@ -148,6 +170,10 @@ def mock_mpiexec(nproc, target):
     for p in procs:
         p.join()
 
+    # A rank that raised an exception would otherwise go unnoticed.
+    for rank, p in enumerate(procs):
+        assert p.exitcode == 0, "Rank %d failed with exit code %s"%(rank, p.exitcode)
+
 def test_mpi_session(comm):
     """A simple MPI session we want to run in mock MPI mode.
 
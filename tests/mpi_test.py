@@ -38,7 +38,7 @@ def setup():
         part_cat.write_patch_centers(patch_file)
         del part_cat
 
-def do_mpi_corr(comm, Correlation, auto, attr):
+def do_mpi_corr(comm, Correlation, auto, attr, mpi_split='patches'):
     rank = comm.Get_rank()
     size = comm.Get_size()
     file_name = os.path.join('data','Aardvark.fit')
@@ -74,7 +74,8 @@ def do_mpi_corr(comm, Correlation, auto, attr):
 
     # Now run in parallel.
     # Everyone needs to make their own Correlation object.
-    corr1 = Correlation(nbins=100, min_sep=1., max_sep=400., sep_units='arcmin', verbose=1)
+    corr1 = Correlation(nbins=100, min_sep=1., max_sep=400., sep_units='arcmin', verbose=1,
+                        mpi_split=mpi_split)
 
     # To use the multiple process, just pass comm to the process command.
     if auto:
@@ -183,6 +184,85 @@ def do_mpi_kg(comm):
 def do_mpi_kk(comm):
     do_mpi_corr(comm, treecorr.KKCorrelation, True, ['xi', 'npairs'])
 
+def do_mpi_cells(comm):
+    # Split the pairs of top-level cells over the processes, rather than the pairs of patches.
+    do_mpi_corr(comm, treecorr.GGCorrelation, True, ['xip', 'xim', 'npairs'], 'cells')
+    do_mpi_corr(comm, treecorr.NGCorrelation, False, ['xi', 'xi_im', 'npairs'], 'cells')
+    do_mpi_corr(comm, treecorr.NNCorrelation, True, ['npairs'], 'cells')
+
+    # This also works without patches.
+    rank = comm.Get_rank()
+    file_name = os.path.join('data','Aardvark.fit')
+    cat = treecorr.Catalog(file_name,
+                           ra_col='RA', dec_col='DEC', ra_units='deg', dec_units='deg',
+                           k_col='KAPPA', last_row=10000)
+    config = dict(nbins=50, min_sep=1., max_sep=400., sep_units='arcmin', min_top=4)
+    kk1 = treecorr.KKCorrelation(config, mpi_split='cells', lazy_build=True)
+    kk1.process(cat, comm=comm)
+    if rank == 0:
+        kk0 = treecorr.KKCorrelation(config)
+        kk0.process(cat)
+        np.testing.assert_allclose(kk1.npairs, kk0.npairs)
+        np.testing.assert_allclose(kk1.xi, kk0.xi)
+        np.testing.assert_allclose(kk1.meanr, kk0.meanr)
+
+def do_mpi_queue(comm):
+    # Hand out the pairs of patches dynamically from rank 0.
+    do_mpi_corr(comm, treecorr.GGCorrelation, True, ['xip', 'xim', 'npairs'], 'queue')
+    do_mpi_corr(comm, treecorr.NGCorrelation, False, ['xi', 'xi_im', 'npairs'], 'queue')
+    do_mpi_corr(comm, treecorr.NNCorrelation, True, ['npairs'], 'queue')
+
+def do_mpi_kmeans(comm):
+    rank = comm.Get_rank()
+    size = comm.Get_size()
+
+    # All processes make the same full catalog, but then each one only uses a region of it,
+    # as though the catalog were sharded by region on the sky.
+    ngal = 50000
+    npatch = 40
+    rng = np.random.RandomState(8675309)
+    ra = rng.uniform(0, 1, (ngal,))
+    dec = rng.uniform(-0.5, 0.5, (ngal,))
+    w = rng.uniform(1, 2, (ngal,))
+    use = (ra * size).astype(int) == rank
+    cat = treecorr.Catalog(ra=ra[use], dec=dec[use], w=w[use], ra_units='rad', dec_units='rad')
+    field = cat.getNField(max_top=5)
+
+    for alt in [False, True]:
+        t0 = time.time()
+        p, cen = field.run_kmeans(npatch, alt=alt, comm=comm)
+        t1 = time.time()
+        assert cen.shape == (npatch, 3)
+        assert len(p) == cat.ntot
+
+        # All the processes have the same centers.
+        all_cen = comm.gather(cen, root=0)
+        all_p = comm.gather(p, root=0)
+        if rank == 0:
+            for c in all_cen:
+                np.testing.assert_array_equal(c, cen)
+
+            # Compare to running on the full catalog in one process.
+            full = treecorr.Catalog(ra=ra, dec=dec, w=w, ra_units='rad', dec_units='rad')
+            full_field = full.getNField(max_top=5)
+            p0, cen0 = full_field.run_kmeans(npatch, alt=alt)
+            t2 = time.time()
+            p1 = np.empty(ngal, dtype=int)
+            for r in range(size):
+                p1[(ra * size).astype(int) == r] = all_p[r]
+            np.testing.assert_array_equal(p1, full_field.kmeans_assign_patches(cen))
+            xyz = np.array([full.x, full.y, full.z]).T
+            inertia0 = np.array([np.sum(w[p0==i][:,None] * (xyz[p0==i] - cen0[i])**2)
+                                 for i in range(npatch)])
+            inertia1 = np.array([np.sum(w[p1==i][:,None] * (xyz[p1==i] - cen[i])**2)
+                                 for i in range(npatch)])
+            print('alt = ',alt,flush=True)
+            print('serial   inertia = ',np.sum(inertia0),np.std(inertia0),t2-t1,flush=True)
+            print('parallel inertia = ',np.sum(inertia1),np.std(inertia1),t1-t0,flush=True)
+            assert np.sum(inertia1) < 1.05 * np.sum(inertia0)
+            assert np.std(inertia1) < 2. * np.std(inertia0)
+            assert len(np.unique(p1)) == npatch
+
 if __name__ == '__main__':
     from mpi4py import MPI
     from mpi_helper import NiceComm
@@ -197,3 +277,6 @@ if __name__ == '__main__':
     do_mpi_nn(comm)
     do_mpi_kg(comm)
     do_mpi_kk(comm)
+    do_mpi_cells(comm)
+    do_mpi_queue(comm)
+    do_mpi_kmeans(comm)
@@ -1452,6 +1452,12 @@ def test_field():
     print('nfield: ',t1-t0,t2-t1)
     assert t2-t1 < t1-t0
 
+    # The build times are available for checking how long each stage of the build took.
+    times = nfield1.build_times
+    print('nfield1 build times = ',times)
+    assert sorted(times.keys()) == ['cells', 'init', 'top']
+    assert all(t >= 0. for t in times.values())
+
     t0 = time.time()
     gfield1 = cat1.getGField()
     gfield2 = cat2.getGField(0.01, 1)
@@ -1631,6 +1637,161 @@ def test_field():
     assert_raises(NotImplementedError, treecorr.SimpleField)
 
 
+@timer
+def test_field_file():
+    # Test writing a built field to a file and reading it back in.
+    ngal = 5000
+    rng = np.random.RandomState(8675309)
+    x = rng.normal(222,50, (ngal,) )
+    y = rng.normal(138,20, (ngal,) )
+    w = rng.normal(1.3, 0.1, (ngal,) )
+    g1 = rng.normal(0,0.1, (ngal,) )
+    g2 = rng.normal(0,0.1, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y, w=w, g1=g1, g2=g2)
+
+    file_name = os.path.join('output','test_field_file.dat')
+    gfield1 = treecorr.GField(cat, min_size=1., max_size=100.)
+    gfield1.write(file_name)
+    gfield2 = treecorr.GField(cat, min_size=1., max_size=100., file_name=file_name)
+    assert gfield2.nTopLevelNodes == gfield1.nTopLevelNodes
+    assert gfield2.count_near(200, 140, 20.) == gfield1.count_near(200, 140, 20.)
+    np.testing.assert_array_equal(gfield2.get_near(200, 140, 20.),
+                                  gfield1.get_near(200, 140, 20.))
+
+    # Different parameters or the wrong kind of field are errors.
+    assert_raises(OSError, treecorr.GField, cat, min_size=2., max_size=100., file_name=file_name)
+    assert_raises(OSError, treecorr.GField, cat, min_size=1., max_size=100.,
+                  split_method='median', file_name=file_name)
+    assert_raises(OSError, treecorr.NField, cat, min_size=1., max_size=100., file_name=file_name)
+    assert_raises(OSError, treecorr.GField, cat, file_name='invalid_file_name')
+
+    # So is a catalog of the same size with different positions or weights.
+    cat2 = treecorr.Catalog(x=x+1, y=y, w=w, g1=g1, g2=g2)
+    assert_raises(OSError, treecorr.GField, cat2, min_size=1., max_size=100., file_name=file_name)
+    cat3 = treecorr.Catalog(x=x, y=y, w=w[::-1], g1=g1, g2=g2)
+    assert_raises(OSError, treecorr.GField, cat3, min_size=1., max_size=100., file_name=file_name)
+
+
+@timer
+def test_shared_field():
+    # Test putting a built field in shared memory and using it from another field.
+    ngal = 5000
+    rng = np.random.RandomState(8675309)
+    x = rng.normal(222,50, (ngal,) )
+    y = rng.normal(138,20, (ngal,) )
+    w = rng.normal(1.3, 0.1, (ngal,) )
+    g1 = rng.normal(0,0.1, (ngal,) )
+    g2 = rng.normal(0,0.1, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y, w=w, g1=g1, g2=g2)
+
+    name = '/treecorr_test_shared_%d'%os.getpid()
+    gfield1 = treecorr.GField(cat, min_size=1., max_size=100.)
+    gfield1.share(name)
+    # The name is in use now.
+    assert_raises(OSError, gfield1.share, name)
+    gfield2 = treecorr.GField(cat, min_size=1., max_size=100., shared_name=name)
+    gfield3 = treecorr.GField(cat, min_size=1., max_size=100., shared_name=name)
+    for f in [gfield2, gfield3]:
+        assert f.nTopLevelNodes == gfield1.nTopLevelNodes
+        assert f.count_near(200, 140, 20.) == gfield1.count_near(200, 140, 20.)
+        np.testing.assert_array_equal(f.get_near(200, 140, 20.),
+                                      gfield1.get_near(200, 140, 20.))
+
+    # Different parameters or the wrong kind of field are errors.
+    assert_raises(OSError, treecorr.GField, cat, min_size=2., max_size=100., shared_name=name)
+    assert_raises(OSError, treecorr.NField, cat, min_size=1., max_size=100., shared_name=name)
+    assert_raises(OSError, treecorr.GField, cat, shared_name='/treecorr_invalid_name')
+    cat2 = treecorr.Catalog(x=x+1, y=y, w=w, g1=g1, g2=g2)
+    assert_raises(OSError, treecorr.GField, cat2, min_size=1., max_size=100., shared_name=name)
+
+    # The correlations are the same with the shared tree.
+    gg1 = treecorr.GGCorrelation(min_sep=1., max_sep=100., nbins=10)
+    gg2 = treecorr.GGCorrelation(min_sep=1., max_sep=100., nbins=10)
+    treecorr._lib.ProcessAuto2(gg1.corr, gfield1.data, 0, 3, gfield1._coords, gg1._bintype,
+                               treecorr.util.metric_enum('Euclidean'))
+    treecorr._lib.ProcessAuto2(gg2.corr, gfield2.data, 0, 3, gfield2._coords, gg2._bintype,
+                               treecorr.util.metric_enum('Euclidean'))
+    np.testing.assert_array_equal(gg2.npairs, gg1.npairs)
+    np.testing.assert_array_equal(gg2.xip, gg1.xip)
+
+    # Once the original is gone, the segment is removed, but the others still work.
+    del gfield1
+    gc.collect()
+    assert_raises(OSError, treecorr.GField, cat, min_size=1., max_size=100., shared_name=name)
+    assert gfield2.count_near(200, 140, 20.) == gfield3.count_near(200, 140, 20.)
+
+    # With share_fields, a catalog uses (or makes) the shared fields automatically.
+    prefix = 'treecorr_test_%d'%os.getpid()
+    cat1 = treecorr.Catalog(x=x, y=y, w=w, g1=g1, g2=g2, share_fields=prefix)
+    cat2 = treecorr.Catalog(x=x, y=y, w=w, g1=g1, g2=g2, share_fields=prefix)
+    gg1 = treecorr.GGCorrelation(min_sep=1., max_sep=100., nbins=10)
+    gg2 = treecorr.GGCorrelation(min_sep=1., max_sep=100., nbins=10)
+    gg3 = treecorr.GGCorrelation(min_sep=1., max_sep=100., nbins=10)
+    gg1.process(cat)
+    gg2.process(cat1)
+    gg3.process(cat2)
+    for gg in [gg2, gg3]:
+        np.testing.assert_array_equal(gg.npairs, gg1.npairs)
+        np.testing.assert_allclose(gg.xip, gg1.xip, rtol=1.e-12)
+
+
+@timer
+def test_field_tree():
+    # Test building fields of different types from the tree of an existing field.
+    ngal = 5000
+    rng = np.random.RandomState(8675309)
+    x = rng.normal(222,50, (ngal,) )
+    y = rng.normal(138,20, (ngal,) )
+    z = rng.normal(912,130, (ngal,) )
+    w = rng.normal(1.3, 0.1, (ngal,) )
+    k = rng.normal(0,0.1, (ngal,) )
+    g1 = rng.normal(0,0.1, (ngal,) )
+    g2 = rng.normal(0,0.1, (ngal,) )
+
+    for cat, near_args in [(treecorr.Catalog(x=x, y=y, w=w, g1=g1, g2=g2, k=k), (200,140,20.)),
+                           (treecorr.Catalog(x=x, y=y, z=z, w=w, g1=g1, g2=g2, k=k),
+                            (200,140,900,100.))]:
+        nfield = treecorr.NField(cat, min_size=1., max_size=100.)
+        gfield1 = treecorr.GField(cat, min_size=1., max_size=100.)
+        gfield2 = treecorr.GField(cat, min_size=1., max_size=100., tree=nfield)
+        kfield1 = treecorr.KField(cat, min_size=1., max_size=100.)
+        kfield2 = treecorr.KField(cat, min_size=1., max_size=100., tree=gfield2)
+        nfield2 = treecorr.NField(cat, min_size=1., max_size=100., tree=kfield2)
+        for f1, f2 in [(gfield1, gfield2), (kfield1, kfield2), (nfield, nfield2)]:
+            assert f2.nTopLevelNodes == f1.nTopLevelNodes
+            np.testing.assert_array_equal(f2.get_near(*near_args), f1.get_near(*near_args))
+            np.testing.assert_allclose(f2.kmeans_initialize_centers(20),
+                                       f1.kmeans_initialize_centers(20), rtol=1.e-12)
+
+        # The correlations are the same as with a newly built tree.
+        gg1 = treecorr.GGCorrelation(min_sep=1., max_sep=100., nbins=10)
+        gg2 = treecorr.GGCorrelation(min_sep=1., max_sep=100., nbins=10)
+        kk1 = treecorr.KKCorrelation(min_sep=1., max_sep=100., nbins=10)
+        kk2 = treecorr.KKCorrelation(min_sep=1., max_sep=100., nbins=10)
+        gg1.process(cat.copy())
+        kk1.process(cat.copy())
+        # Building the NField first means the GField and KField will use its tree.
+        nn = treecorr.NNCorrelation(min_sep=1., max_sep=100., nbins=10)
+        nn.process(cat)
+        assert cat.gfields.count == 0
+        gg2.process(cat)
+        kk2.process(cat)
+        np.testing.assert_array_equal(gg2.npairs, gg1.npairs)
+        np.testing.assert_allclose(gg2.xip, gg1.xip, rtol=1.e-6, atol=1.e-12)
+        np.testing.assert_allclose(gg2.xim, gg1.xim, rtol=1.e-6, atol=1.e-12)
+        np.testing.assert_allclose(kk2.xi, kk1.xi, rtol=1.e-6, atol=1.e-12)
+
+    # The tree needs to be from the same catalog with the same parameters.
+    cat2 = treecorr.Catalog(x=x, y=y, w=w, g1=g1, g2=g2)
+    nfield = treecorr.NField(cat2, min_size=1., max_size=100.)
+    assert_raises(ValueError, treecorr.GField, cat, min_size=1., max_size=100., tree=nfield)
+    assert_raises(ValueError, treecorr.GField, cat2, min_size=2., max_size=100., tree=nfield)
+    assert_raises(ValueError, treecorr.GField, cat2, min_size=1., max_size=100.,
+                  split_method='median', tree=nfield)
+    assert_raises(ValueError, treecorr.GField, cat2, min_size=1., max_size=100., lazy=True,
+                  tree=nfield)
+
+
 @timer
 def test_lru():
     f = lambda x: x+1
@@ -1716,6 +1877,302 @@ def test_lru():
     assert_raises(ValueError, cache.resize, -20)
 
 
+@timer
+def test_keep_radec():
+    # Test dropping the ra, dec arrays after making x,y,z
+
+    ngal = 10000
+    rng = np.random.RandomState(8675309)
+    ra = rng.uniform(0, 360, (ngal,))
+    dec = rng.uniform(-90, 90, (ngal,))
+    r = rng.uniform(10, 100, (ngal,))
+    w = rng.random_sample(ngal)
+
+    cat1 = treecorr.Catalog(ra=ra, dec=dec, ra_units='deg', dec_units='deg', w=w)
+    cat2 = treecorr.Catalog(ra=ra, dec=dec, ra_units='deg', dec_units='deg', w=w,
+                            keep_radec=False)
+    assert cat1._ra is not None
+    assert cat2._ra is None
+    assert cat2._dec is None
+    np.testing.assert_array_equal(cat2.x, cat1.x)
+    np.testing.assert_array_equal(cat2.y, cat1.y)
+    np.testing.assert_array_equal(cat2.z, cat1.z)
+    np.testing.assert_allclose(cat2.ra, cat1.ra, rtol=1.e-12, atol=1.e-12)
+    np.testing.assert_allclose(cat2.dec, cat1.dec, rtol=1.e-12, atol=1.e-12)
+    assert cat2.coords == 'spherical'
+
+    # Also with r.
+    cat3 = treecorr.Catalog(ra=ra, dec=dec, r=r, ra_units='deg', dec_units='deg',
+                            keep_radec=False)
+    assert cat3.coords == '3d'
+    np.testing.assert_allclose(cat3.ra, cat1.ra, rtol=1.e-12, atol=1.e-12)
+    np.testing.assert_allclose(cat3.dec, cat1.dec, rtol=1.e-12, atol=1.e-12)
+    np.testing.assert_array_equal(cat3.r, r)
+
+    # Patches are still found on the sky.
+    cat4 = treecorr.Catalog(ra=ra, dec=dec, r=r, ra_units='deg', dec_units='deg', npatch=10)
+    cat5 = treecorr.Catalog(ra=ra, dec=dec, r=r, ra_units='deg', dec_units='deg', npatch=10,
+                            keep_radec=False)
+    np.testing.assert_array_equal(cat5.patch, cat4.patch)
+    np.testing.assert_allclose(cat5.patch_centers, cat4.patch_centers)
+
+    # The correlations are the same.
+    nn1 = treecorr.NNCorrelation(bin_size=0.3, min_sep=1., max_sep=30., sep_units='deg')
+    nn2 = treecorr.NNCorrelation(bin_size=0.3, min_sep=1., max_sep=30., sep_units='deg')
+    nn1.process(cat1)
+    nn2.process(cat2)
+    np.testing.assert_allclose(nn2.weight, nn1.weight)
+
+    # From a file, the arrays are dropped again after reloading.
+    file_name = os.path.join('output','test_keep_radec.dat')
+    np.savetxt(file_name, np.array([ra, dec, w]).T)
+    cat6 = treecorr.Catalog(file_name, ra_col=1, dec_col=2, w_col=3, ra_units='deg',
+                            dec_units='deg', keep_radec=False)
+    np.testing.assert_allclose(cat6.x, cat1.x, atol=1.e-12)
+    assert cat6._ra is None
+    cat6.unload()
+    np.testing.assert_allclose(cat6.dec, cat1.dec, rtol=1.e-12, atol=1.e-12)
+    assert cat6._ra is None
+
+
+@timer
+def test_fits_chunks():
+    # Test reading a FITS file in several chunks of rows
+    try:
+        import fitsio
+    except ImportError:
+        print('Skipping FITS tests, since fitsio is not installed')
+        return
+
+    ngal = 10000
+    rng = np.random.RandomState(8675309)
+    data = np.empty(ngal, dtype=[('RA','f8'), ('DEC','f4'), ('W','>f4'), ('FLAG','i2'),
+                                 ('G1','f8'), ('G2','f8'), ('K','f4')])
+    data['RA'] = rng.uniform(0, 360, (ngal,))
+    data['DEC'] = rng.uniform(-90, 90, (ngal,))
+    data['W'] = rng.random_sample(ngal)
+    data['FLAG'] = rng.randint(0, 4, (ngal,))
+    data['G1'] = rng.normal(0, 0.2, (ngal,))
+    data['G2'] = rng.normal(0, 0.2, (ngal,))
+    data['K'] = rng.normal(0, 0.2, (ngal,))
+    file_name = os.path.join('output','test_fits_chunks.fits')
+    with fitsio.FITS(file_name, 'rw', clobber=True) as f:
+        f.write(data)
+
+    kwargs = dict(ra_col='RA', dec_col='DEC', ra_units='deg', dec_units='deg',
+                  w_col='W', wpos_col='W', flag_col='FLAG', ignore_flag=1,
+                  g1_col='G1', g2_col='G2', k_col='K')
+    save_chunk_size = treecorr.Catalog._fits_chunk_size
+    try:
+        for rows in [{}, dict(first_row=101, last_row=9000, every_nth=3)]:
+            kwargs1 = dict(kwargs, **rows)
+            cat1 = treecorr.Catalog(file_name, **kwargs1)
+            treecorr.Catalog._fits_chunk_size = 999
+            cat2 = treecorr.Catalog(file_name, **kwargs1)
+            treecorr.Catalog._fits_chunk_size = save_chunk_size
+
+            s = slice(rows.get('first_row',1)-1, rows.get('last_row',ngal),
+                      rows.get('every_nth',1))
+            w = data['W'][s].astype(float)
+            w[(data['FLAG'][s] & 1) != 0] = 0.
+            for cat in [cat1, cat2]:
+                assert cat.ntot == len(w)
+                np.testing.assert_allclose(cat.ra, data['RA'][s] * pi/180., rtol=1.e-15)
+                np.testing.assert_allclose(cat.dec, data['DEC'][s] * pi/180., rtol=1.e-15)
+                np.testing.assert_array_equal(cat.w, w)
+                np.testing.assert_array_equal(cat.wpos, w)
+                np.testing.assert_array_equal(cat.g1, data['G1'][s])
+                np.testing.assert_array_equal(cat.k, data['K'][s])
+                assert cat.w.dtype == float
+                assert cat.w.flags['C_CONTIGUOUS']
+                # These are the same column in the file, but not the same array.
+                assert cat.w is not cat.wpos
+    finally:
+        treecorr.Catalog._fits_chunk_size = save_chunk_size
+
+
+@timer
+def test_ascii_native():
+    # Test the C++ ASCII reader against the pandas/numpy reader.
+    nobj = 5000
+    rng = np.random.RandomState(8675309)
+    x = rng.random_sample(nobj)
+    y = rng.random_sample(nobj)
+    w = rng.random_sample(nobj)
+    k = rng.normal(0, 1, (nobj,))
+    flag = rng.randint(0, 4, (nobj,))
+
+    for delim in [None, ',']:
+        sep = ' ' if delim is None else ','
+        file_name = os.path.join('output','test_ascii_native.dat')
+        with open(file_name, 'w') as fid:
+            fid.write('# Two header lines\n')
+            fid.write('# x y w k flag\n')
+            for i in range(nobj):
+                # Use the full precision for some and fewer digits for others.
+                fmt = '%.17g' if i%2 == 0 else '%.6f'
+                fid.write(sep.join([fmt%x[i], fmt%y[i], fmt%w[i], fmt%k[i], '%d'%flag[i]]))
+                if i%500 == 0:
+                    fid.write('  # trailing comment')
+                fid.write('\n')
+                if i%700 == 0:
+                    fid.write('\n# Some comment lines in the middle\n')
+        kwargs = dict(x_col=1, y_col=2, w_col=3, k_col=4, flag_col=5, delimiter=delim)
+
+        cat1 = treecorr.Catalog(file_name, **kwargs)
+        save = treecorr.Catalog._read_ascii_columns
+        try:
+            treecorr.Catalog._read_ascii_columns = lambda *args: (None, None)
+            cat2 = treecorr.Catalog(file_name, **kwargs)
+        finally:
+            treecorr.Catalog._read_ascii_columns = save
+        for cat in [cat1, cat2]:
+            np.testing.assert_allclose(cat.x, x, rtol=1.e-6)
+            np.testing.assert_allclose(cat.y, y, rtol=1.e-6)
+            np.testing.assert_allclose(cat.k, k, atol=1.e-6)
+            np.testing.assert_array_equal(cat.w, cat2.w)
+        # The C++ parser should be exact.
+        np.testing.assert_array_equal(cat1.x, cat2.x)
+        np.testing.assert_array_equal(cat1.y, cat2.y)
+        np.testing.assert_array_equal(cat1.k, cat2.k)
+        assert cat1.x.flags['C_CONTIGUOUS']
+
+        # first_row, last_row, every_nth count only the data rows.
+        cat3 = treecorr.Catalog(file_name, first_row=101, last_row=4000, every_nth=7, **kwargs)
+        np.testing.assert_array_equal(cat3.x, cat1.x[100:4000:7])
+        np.testing.assert_array_equal(cat3.k, cat1.k[100:4000:7])
+
+        # A value of 0 for k_col means the last column.
+        cat4 = treecorr.Catalog(file_name, x_col=1, y_col=2, k_col=0, delimiter=delim)
+        np.testing.assert_array_equal(cat4.k, flag)
+
+    # Rows with missing or bad values are dropped.
+    with open(file_name, 'w') as fid:
+        fid.write('1 2 3\n4 5\n7 8 nan\n10 11 12\n13 abc 15\n')
+    cat5 = treecorr.Catalog(file_name, x_col=1, y_col=2, k_col=3)
+    np.testing.assert_array_equal(cat5.x, [1, 10])
+    np.testing.assert_array_equal(cat5.k, [3, 12])
+
+
+@timer
+def test_binary():
+    # Test writing and reading the binary catalog format.
+    nobj = 5000
+    rng = np.random.RandomState(8675309)
+    ra = rng.uniform(0, 20, (nobj,))
+    dec = rng.uniform(-10, 10, (nobj,))
+    w = rng.random_sample(nobj)
+    g1 = rng.normal(0, 0.2, (nobj,))
+    g2 = rng.normal(0, 0.2, (nobj,))
+    k = rng.normal(0, 1, (nobj,))
+
+    cat1 = treecorr.Catalog(ra=ra, dec=dec, ra_units='deg', dec_units='deg', w=w,
+                            g1=g1, g2=g2, k=k)
+    file_name = os.path.join('output','test_binary.tcb')
+    col_names = cat1.write(file_name)
+    assert 'ra' in col_names and 'x' in col_names
+
+    cat2 = treecorr.Catalog(file_name)
+    assert cat2.file_type == 'Binary'
+    assert not cat2.loaded
+    # The center and size come from the header, so they don't trigger a load.
+    np.testing.assert_allclose(cat2._get_center_size(), cat1._get_center_size())
+    assert not cat2.loaded
+    for attr in ['x', 'y', 'z', 'ra', 'dec', 'w', 'g1', 'g2', 'k']:
+        np.testing.assert_array_equal(getattr(cat2, attr), getattr(cat1, attr))
+        assert getattr(cat2, attr).flags['C_CONTIGUOUS']
+    assert cat2.coords == 'spherical'
+    assert cat2.nontrivial_w
+    assert cat2.sumw == cat1.sumw
+    assert cat2.nobj == cat1.nobj
+    assert cat2.varg == cat1.varg
+    assert cat2.vark == cat1.vark
+
+    # The arrays are copy-on-write, so changing them doesn't change the file.
+    cat2.k[0] = 99.
+    cat3 = treecorr.Catalog(file_name, file_type='Binary')
+    assert cat3.k[0] == k[0]
+
+    # first_row, last_row, every_nth still apply.
+    cat4 = treecorr.Catalog(file_name, first_row=101, last_row=4000, every_nth=7)
+    np.testing.assert_array_equal(cat4.x, cat1.x[100:4000:7])
+    np.testing.assert_array_equal(cat4.g2, cat1.g2[100:4000:7])
+    assert cat4.x.flags['C_CONTIGUOUS']
+    np.testing.assert_allclose(cat4.sumw, np.sum(w[100:4000:7]))
+    np.testing.assert_allclose(cat4.varg, np.sum(w[100:4000:7]**2 * (g1[100:4000:7]**2 +
+                               g2[100:4000:7]**2)) / (2.*cat4.sumw))
+
+    # Flat coordinates with unit weights and keep_radec=False
+    cat5 = treecorr.Catalog(x=ra, y=dec, k=k)
+    cat5.write_binary(file_name)
+    cat6 = treecorr.Catalog(file_name)
+    assert cat6.coords == 'flat'
+    assert not cat6.nontrivial_w
+    np.testing.assert_array_equal(cat6.w, 1.)
+    np.testing.assert_array_equal(cat6.k, k)
+    assert cat6.g1 is None
+    cat7 = treecorr.Catalog(ra=ra, dec=dec, ra_units='deg', dec_units='deg', keep_radec=False)
+    cat7.write_binary(file_name)
+    cat8 = treecorr.Catalog(file_name)
+    assert cat8.coords == 'spherical'
+    np.testing.assert_allclose(cat8.ra, cat1.ra)
+    np.testing.assert_allclose(cat8.dec, cat1.dec)
+
+    # Not a valid binary file.
+    bad_file_name = os.path.join('output','test_binary_bad.tcb')
+    with open(bad_file_name, 'w') as fid:
+        fid.write('1 2 3\n')
+    with assert_raises(OSError):
+        treecorr.Catalog(bad_file_name)
+
+    # Patches saved as binary files give the same results with low_mem.
+    npatch = 8
+    cat9 = treecorr.Catalog(ra=ra, dec=dec, ra_units='deg', dec_units='deg', w=w,
+                            npatch=npatch, save_patch_dir='output', save_patch_type='Binary',
+                            save_fields=True)
+    cat9.get_patches(low_mem=True)
+    for i in range(npatch):
+        patch_file_name = os.path.join('output','patch%00d.tcb'%i)
+        assert os.path.exists(patch_file_name)
+        assert not os.path.exists(patch_file_name + '.nfield')
+        assert not cat9.patches[i].loaded
+    dd1 = treecorr.NNCorrelation(bin_size=0.3, min_sep=10., max_sep=300., sep_units='arcmin')
+    dd1.process(cat1)
+    dd2 = treecorr.NNCorrelation(bin_size=0.3, min_sep=10., max_sep=300., sep_units='arcmin')
+    dd2.process(cat9, low_mem=True)
+    np.testing.assert_allclose(dd2.npairs, dd1.npairs)
+    np.testing.assert_allclose(dd2.weight, dd1.weight)
+
+    # The fields were saved next to the patch files, and they are used the next time.
+    for i in range(npatch):
+        patch_file_name = os.path.join('output','patch%00d.tcb'%i)
+        assert os.path.exists(patch_file_name + '.nfield')
+    # Building a field with different parameters replaces the saved one.
+    patch0 = os.path.join('output','patch0.tcb')
+    cat10 = treecorr.Catalog(patch0, save_fields=True)
+    with CaptureLog() as cl:
+        field1 = cat10.getNField(min_size=0.01, max_size=0.1, logger=cl.logger)
+    assert 'Unable to use saved field' in cl.output
+    assert 'Saving field' in cl.output
+    cat11 = treecorr.Catalog(patch0)
+    with CaptureLog() as cl:
+        field2 = cat11.getNField(min_size=0.01, max_size=0.1, logger=cl.logger)
+    assert 'Unable to use saved field' not in cl.output
+    assert 'Saving field' not in cl.output
+    cat12 = treecorr.Catalog(ra=cat10.ra, dec=cat10.dec, ra_units='rad', dec_units='rad',
+                             w=cat10.w)
+    field3 = cat12.getNField(min_size=0.01, max_size=0.1)
+    assert field2.nTopLevelNodes == field3.nTopLevelNodes
+    for i in range(0, cat12.ntot, 97):
+        kwargs = dict(ra=cat12.ra[i], dec=cat12.dec[i], sep=0.02,
+                      ra_units='rad', dec_units='rad', sep_units='rad')
+        assert field2.count_near(**kwargs) == field3.count_near(**kwargs)
+
+    # Rewriting the patch removes the saved field.
+    cat10.write_binary(patch0)
+    assert not os.path.exists(patch0 + '.nfield')
+
+
 if __name__ == '__main__':
     test_ascii()
     test_fits()
@@ -1727,4 +2184,11 @@ if __name__ == '__main__':
     test_list()
     test_write()
     test_field()
+    test_field_file()
+    test_shared_field()
+    test_field_tree()
     test_lru()
+    test_keep_radec()
+    test_fits_chunks()
+    test_ascii_native()
+    test_binary()
@@ -521,6 +521,134 @@ def test_omp():
         assert "OpenMP reports that it will use 1 threads" in cl.output
         assert "Unable to use multiple threads" in cl.output
 
+@timer
+def test_omp_numa():
+    """Test splitting the omp threads into NUMA domains.
+    """
+    # This can't check the memory placement, but the results shouldn't depend on it.
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0, 100, 20000)
+    y = rng.uniform(0, 100, 20000)
+    k = np.sin(x/10) + np.cos(y/7)
+
+    treecorr.set_omp_threads(4, numa_domains=1)
+    cat = treecorr.Catalog(x=x, y=y, k=k)
+    kk1 = treecorr.KKCorrelation(min_sep=1., max_sep=20., nbins=10)
+    kk1.process(cat)
+
+    with CaptureLog() as cl:
+        treecorr.set_omp_threads(4, logger=cl.logger, numa_domains=2, pin=True)
+    assert "Using 2 NUMA domains" in cl.output
+    assert "Pinned" in cl.output
+    cat = treecorr.Catalog(x=x, y=y, k=k)
+    kk2 = treecorr.KKCorrelation(min_sep=1., max_sep=20., nbins=10)
+    kk2.process(cat)
+    np.testing.assert_array_equal(kk2.npairs, kk1.npairs)
+    np.testing.assert_allclose(kk2.xi, kk1.xi, rtol=1.e-10)
+    np.testing.assert_allclose(kk2.meanr, kk1.meanr, rtol=1.e-10)
+
+    # numa_domains=None leaves it alone.
+    assert treecorr.set_omp_threads(4) >= 1
+    assert treecorr._lib.GetOMPNumaDomains() == 2
+
+    with assert_raises(ValueError):
+        treecorr.set_omp_threads(4, numa_domains=0)
+    treecorr.set_omp_threads(None, numa_domains=1)
+    assert treecorr._lib.GetOMPNumaDomains() == 1
+
+@timer
+def test_phase_threads():
+    """Test running builds and processes at the same time with per-phase thread limits.
+    """
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0, 100, 20000)
+    y = rng.uniform(0, 100, 20000)
+    k = np.sin(x/10) + np.cos(y/7)
+
+    treecorr.set_omp_threads(4, numa_domains=1)
+    cat1 = treecorr.Catalog(x=x, y=y, k=k)
+    kk1 = treecorr.KKCorrelation(min_sep=1., max_sep=20., nbins=10)
+    kk1.process(cat1)
+
+    assert treecorr.set_phase_threads(build=1, process=3) == (1, 3)
+    # None leaves the current setting.
+    assert treecorr.set_phase_threads(process=2) == (1, 2)
+
+    # Build the field of a second catalog in the background while processing the first.
+    cat2 = treecorr.Catalog(x=x[::-1], y=y[::-1], k=k[::-1])
+    future = treecorr.submit(cat2.getKField)
+    kk2 = treecorr.KKCorrelation(min_sep=1., max_sep=20., nbins=10)
+    kk2.process(cat1)
+    assert future.result() is not None
+
+    # Now process the second one in the background too.
+    kk3 = treecorr.KKCorrelation(min_sep=1., max_sep=20., nbins=10)
+    future = treecorr.submit(kk3.process, cat2)
+    future.result()
+    for kk in [kk2, kk3]:
+        np.testing.assert_array_equal(kk.npairs, kk1.npairs)
+        np.testing.assert_allclose(kk.xi, kk1.xi, rtol=1.e-10)
+        np.testing.assert_allclose(kk.meanr, kk1.meanr, rtol=1.e-10)
+
+    with assert_raises(ValueError):
+        treecorr.set_phase_threads(build=-1)
+    assert treecorr.set_phase_threads(build=0, process=0) == (0, 0)
+
+@timer
+def test_trace():
+    """Test recording a trace of the C++ and python steps.
+    """
+    import json
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0, 100, 20000)
+    y = rng.uniform(0, 100, 20000)
+    cat = treecorr.Catalog(x=x, y=y, npatch=4)
+    nn = treecorr.NNCorrelation(min_sep=1., max_sep=20., nbins=10)
+
+    file_name = os.path.join('output', 'trace.json')
+    treecorr.start_trace()
+    # low_mem does each pair of patches separately, so they show up in the trace.
+    nn.process(cat, low_mem=True)
+    treecorr.stop_trace(file_name)
+
+    with open(file_name) as f:
+        data = json.load(f)
+    events = [e for e in data['traceEvents'] if e['ph'] == 'X']
+    names = set(e['name'] for e in events)
+    print('names = ',names)
+    for name in ['field init', 'build top cell', 'process2 item', 'kmeans iteration',
+                 'patch 0 auto', 'patches 0,1 cross']:
+        assert name in names
+    ts = [e['ts'] for e in events]
+    assert ts == sorted(ts)
+    assert all(e['dur'] >= 0 for e in events)
+    meta = [e for e in data['traceEvents'] if e['ph'] == 'M']
+    assert meta[0]['name'] == 'process_name'
+    assert meta[0]['args']['dropped_events'] == 0
+
+    # With a small buffer, the early events are dropped.
+    treecorr.start_trace(nevents=10)
+    nn.process(cat)
+    treecorr.stop_trace(file_name)
+    with open(file_name) as f:
+        data = json.load(f)
+    assert data['traceEvents'][0]['args']['dropped_events'] > 0
+    tids = [e['tid'] for e in data['traceEvents'] if e['ph'] == 'X']
+    for tid in set(tids):
+        assert tids.count(tid) <= 10
+
+    # After stopping, nothing more is recorded.
+    nn.process(cat)
+    treecorr.stop_trace(file_name)
+    with open(file_name) as f:
+        data2 = json.load(f)
+    assert data2 == data
+
+    with assert_raises(ValueError):
+        treecorr.start_trace(nevents=0)
+    with assert_raises(OSError):
+        treecorr.stop_trace(os.path.join('nonexistent_dir', 'trace.json'))
+
 @timer
 def test_util():
     # Test some error handling in utility functions that shouldn't be possible to get to
@@ -569,4 +697,7 @@ if __name__ == '__main__':
     test_get()
     test_merge()
     test_omp()
+    test_omp_numa()
+    test_phase_threads()
+    test_trace()
     test_util()
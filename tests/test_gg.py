@@ -137,6 +137,17 @@ def test_direct():
     np.testing.assert_allclose(gg.xim, true_xim.real, rtol=1.e-3, atol=3.e-4)
     np.testing.assert_allclose(gg.xim_im, true_xim.imag, atol=1.e-3)
 
+    # With leaf_size, the small cells are done pair by pair.
+    gg = treecorr.GGCorrelation(min_sep=min_sep, max_sep=max_sep, nbins=nbins, bin_slop=0,
+                                max_top=0, leaf_size=32)
+    gg.process(cat1, cat2)
+    np.testing.assert_array_equal(gg.npairs, true_npairs)
+    np.testing.assert_allclose(gg.weight, true_weight, rtol=1.e-5, atol=1.e-8)
+    np.testing.assert_allclose(gg.xip, true_xip.real, rtol=1.e-4, atol=1.e-8)
+    np.testing.assert_allclose(gg.xip_im, true_xip.imag, rtol=1.e-4, atol=1.e-8)
+    np.testing.assert_allclose(gg.xim, true_xim.real, rtol=1.e-3, atol=3.e-4)
+    np.testing.assert_allclose(gg.xim_im, true_xim.imag, atol=1.e-3)
+
     # Check a few basic operations with a GGCorrelation object.
     do_pickle(gg)
 
@@ -1340,6 +1351,443 @@ def test_varxi():
     np.testing.assert_allclose(mean_varxim, var_xim, rtol=0.02 * tol_factor)
 
 
+@timer
+def test_process_multi_bin():
+    # Processing several binnings with a single tree walk should give the same answers as
+    # doing them one at a time when bin_slop=0.
+    ngal = 2000
+    s = 10.
+    rng = np.random.RandomState(8675309)
+    x = rng.normal(0,s, (ngal,) )
+    y = rng.normal(0,s, (ngal,) )
+    w = rng.random_sample(ngal)
+    g1 = rng.normal(0,0.2, (ngal,) )
+    g2 = rng.normal(0,0.2, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y, w=w, g1=g1, g2=g2)
+
+    def make_corrs():
+        return [ treecorr.GGCorrelation(min_sep=1., max_sep=20., nbins=10, bin_slop=0),
+                 treecorr.GGCorrelation(min_sep=2., max_sep=10., nbins=16, bin_slop=0,
+                                        bin_type='Linear'),
+                 treecorr.GGCorrelation(max_sep=8., nbins=9, bin_slop=0, bin_type='TwoD') ]
+
+    corrs = make_corrs()
+    treecorr.process_multi_bin(corrs, cat)
+    for gg in corrs:
+        gg1 = gg.copy()
+        gg1.clear()
+        gg1.process_auto(cat)
+        np.testing.assert_allclose(gg.npairs, gg1.npairs)
+        np.testing.assert_allclose(gg.weight, gg1.weight)
+        np.testing.assert_allclose(gg.meanr, gg1.meanr)
+        np.testing.assert_allclose(gg.xip, gg1.xip, atol=1.e-12)
+        np.testing.assert_allclose(gg.xim, gg1.xim, atol=1.e-12)
+
+    # With bin_slop > 0, the looser binnings are split more than they would have been,
+    # so they are only approximately the same.
+    gg_log = treecorr.GGCorrelation(min_sep=1., max_sep=20., nbins=10, bin_slop=1)
+    gg_lin = treecorr.GGCorrelation(min_sep=1., max_sep=20., nbins=50, bin_type='Linear')
+    treecorr.process_multi_bin([gg_log, gg_lin], cat)
+    gg1 = gg_log.copy()
+    gg1.clear()
+    gg1.process_auto(cat)
+    np.testing.assert_allclose(gg_log.npairs, gg1.npairs, rtol=5.e-2)
+    np.testing.assert_allclose(gg_log.meanr, gg1.meanr, rtol=5.e-2)
+
+    # Invalid inputs
+    with assert_raises(ValueError):
+        treecorr.process_multi_bin([], cat)
+    with assert_raises(ValueError):
+        treecorr.process_multi_bin([gg_log, treecorr.KKCorrelation(min_sep=1., max_sep=20.,
+                                                                   nbins=10)], cat)
+    with assert_raises(ValueError):
+        treecorr.process_multi_bin([treecorr.NGCorrelation(min_sep=1., max_sep=20.,
+                                                           nbins=10)], cat)
+
+
+@timer
+def test_pairwise_arrays():
+    # process_pairwise now works directly from the catalog arrays.  Check that this matches
+    # the old calculation using SimpleFields for the other coordinate systems and data types.
+    # ngal is not a multiple of the block size in the C++ layer, so we also check the last
+    # partial block.
+    ngal = 1111
+    s = 10.
+    rng = np.random.RandomState(8675309)
+    x1 = rng.normal(0,s, (ngal,) )
+    y1 = rng.normal(0,s, (ngal,) )
+    z1 = rng.normal(100,s, (ngal,) )
+    w1 = rng.random_sample(ngal)
+    k1 = rng.normal(0,1, (ngal,) )
+    g11 = rng.normal(0,0.2, (ngal,) )
+    g21 = rng.normal(0,0.2, (ngal,) )
+    x2 = rng.normal(0,s, (ngal,) )
+    y2 = rng.normal(0,s, (ngal,) )
+    z2 = rng.normal(100,s, (ngal,) )
+    w2 = rng.random_sample(ngal)
+    k2 = rng.normal(0,1, (ngal,) )
+    g12 = rng.normal(0,0.2, (ngal,) )
+    g22 = rng.normal(0,0.2, (ngal,) )
+
+    ra1, dec1 = coord.CelestialCoord.xyz_to_radec(x1,y1,z1)
+    ra2, dec2 = coord.CelestialCoord.xyz_to_radec(x2,y2,z2)
+
+    cats = [
+        (treecorr.Catalog(x=x1, y=y1, w=w1, k=k1, g1=g11, g2=g21),
+         treecorr.Catalog(x=x2, y=y2, w=w2, k=k2, g1=g12, g2=g22), 'Euclidean', 1.),
+        (treecorr.Catalog(x=x1, y=y1, z=z1, w=w1, k=k1, g1=g11, g2=g21),
+         treecorr.Catalog(x=x2, y=y2, z=z2, w=w2, k=k2, g1=g12, g2=g22), 'Rperp', 1.),
+        (treecorr.Catalog(ra=ra1, dec=dec1, ra_units='rad', dec_units='rad',
+                          w=w1, k=k1, g1=g11, g2=g21),
+         treecorr.Catalog(ra=ra2, dec=dec2, ra_units='rad', dec_units='rad',
+                          w=w2, k=k2, g1=g12, g2=g22), 'Arc', 0.01),
+    ]
+    classes = [ (treecorr.NNCorrelation, 'N', 'N', ['weight']),
+                (treecorr.NKCorrelation, 'N', 'K', ['xi']),
+                (treecorr.NGCorrelation, 'N', 'G', ['xi', 'xi_im']),
+                (treecorr.KKCorrelation, 'K', 'K', ['xi']),
+                (treecorr.KGCorrelation, 'K', 'G', ['xi', 'xi_im']),
+                (treecorr.GGCorrelation, 'G', 'G', ['xip', 'xip_im', 'xim', 'xim_im']) ]
+
+    for cat1, cat2, metric, scale in cats:
+        for cls, t1, t2, attrs in classes:
+            c1 = cls(min_sep=scale, max_sep=30.*scale, nbins=10)
+            with assert_warns(FutureWarning):
+                c1.process_pairwise(cat1, cat2, metric=metric)
+
+            # The old way, using SimpleFields.
+            c2 = cls(min_sep=scale, max_sep=30.*scale, nbins=10)
+            c2._set_metric(metric, cat1.coords, cat2.coords)
+            f1 = getattr(cat1, 'get%sSimpleField'%t1)()
+            f2 = getattr(cat2, 'get%sSimpleField'%t2)()
+            treecorr._lib.ProcessPair(c2.corr, f1.data, f2.data, 0, f1._d, f2._d,
+                                      c2._coords, c2._bintype, c2._metric)
+
+            print(metric, t1+t2, c1.npairs, c2.npairs)
+            assert np.sum(c1.npairs) > 0
+            np.testing.assert_array_equal(c1.npairs, c2.npairs)
+            np.testing.assert_allclose(c1.weight, c2.weight, rtol=1.e-10)
+            np.testing.assert_allclose(c1.meanr, c2.meanr, rtol=1.e-10)
+            np.testing.assert_allclose(c1.meanlogr, c2.meanlogr, rtol=1.e-10)
+            for attr in attrs:
+                np.testing.assert_allclose(getattr(c1,attr), getattr(c2,attr),
+                                           rtol=1.e-10, atol=1.e-12)
+
+    # The catalogs need to have the same number of objects.
+    cat3 = treecorr.Catalog(x=x1[:100], y=y1[:100], g1=g11[:100], g2=g21[:100])
+    gg = treecorr.GGCorrelation(min_sep=1., max_sep=30., nbins=10)
+    with assert_warns(FutureWarning):
+        with assert_raises(ValueError):
+            gg.process_pairwise(cats[0][0], cat3)
+    # And the right values for the data types.
+    cat4 = treecorr.Catalog(x=x1, y=y1)
+    with assert_warns(FutureWarning):
+        with assert_raises(TypeError):
+            gg.process_pairwise(cats[0][0], cat4)
+
+
+@timer
+def test_replay():
+    # If the positions and weights stay the same, the pairs of cells that get accumulated are
+    # the same too, so they can be recorded once and replayed for new shear values.
+    ngal = 3000
+    s = 10.
+    rng = np.random.RandomState(8675309)
+    x = rng.normal(0,s, (ngal,) )
+    y = rng.normal(0,s, (ngal,) )
+    w = rng.random_sample(ngal)
+    g1 = rng.normal(0,0.2, (ngal,) )
+    g2 = rng.normal(0,0.2, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y, w=w, g1=g1, g2=g2)
+
+    config = dict(min_sep=1., max_sep=30., nbins=15, bin_slop=0.5)
+    gg0 = treecorr.GGCorrelation(config)
+    gg0.process(cat)
+    gg1 = treecorr.GGCorrelation(config)
+    ilist = gg1.record_interactions(cat)
+    gg1.finalize(cat.varg, cat.varg)
+    assert len(ilist) > 0
+    np.testing.assert_array_equal(gg1.npairs, gg0.npairs)
+    np.testing.assert_allclose(gg1.xip, gg0.xip, rtol=1.e-10)
+    np.testing.assert_allclose(gg1.xim, gg0.xim, rtol=1.e-10)
+
+    # New shape noise with the same positions.
+    for i in range(3):
+        g1 = rng.normal(0,0.2, (ngal,) )
+        g2 = rng.normal(0,0.2, (ngal,) )
+        cat_i = treecorr.Catalog(x=x, y=y, w=w, g1=g1, g2=g2)
+        gg2 = treecorr.GGCorrelation(config)
+        gg2.process(cat_i)
+        gg3 = treecorr.GGCorrelation(config)
+        gg3.replay_interactions(ilist, cat_i)
+        gg3.finalize(cat_i.varg, cat_i.varg)
+        np.testing.assert_array_equal(gg3.npairs, gg2.npairs)
+        np.testing.assert_allclose(gg3.weight, gg2.weight, rtol=1.e-10)
+        np.testing.assert_allclose(gg3.meanr, gg2.meanr, rtol=1.e-10)
+        np.testing.assert_allclose(gg3.xip, gg2.xip, rtol=1.e-10, atol=1.e-14)
+        np.testing.assert_allclose(gg3.xim, gg2.xim, rtol=1.e-10, atol=1.e-14)
+        np.testing.assert_allclose(gg3.xip_im, gg2.xip_im, rtol=1.e-10, atol=1.e-14)
+        np.testing.assert_allclose(gg3.xim_im, gg2.xim_im, rtol=1.e-10, atol=1.e-14)
+
+    # Cross-correlations work the same way, and the list can be replayed by other kinds
+    # of correlations with the same binning.
+    x2 = rng.normal(0,s, (ngal,) )
+    y2 = rng.normal(0,s, (ngal,) )
+    k2 = rng.normal(0,1, (ngal,) )
+    lens = treecorr.Catalog(x=x2, y=y2, k=k2)
+    nn = treecorr.NNCorrelation(config)
+    ilist2 = nn.record_interactions(lens, cat)
+    nn2 = treecorr.NNCorrelation(config)
+    nn2.process(lens, cat)
+    np.testing.assert_array_equal(nn.npairs, nn2.npairs)
+    assert nn.tot == nn2.tot
+    kg = treecorr.KGCorrelation(config)
+    kg.replay_interactions(ilist2, lens, cat)
+    kg.finalize(lens.vark, cat.varg)
+    kg2 = treecorr.KGCorrelation(config)
+    kg2.process(lens, cat)
+    np.testing.assert_array_equal(kg.npairs, kg2.npairs)
+    np.testing.assert_allclose(kg.xi, kg2.xi, rtol=1.e-10, atol=1.e-14)
+    np.testing.assert_allclose(kg.xi_im, kg2.xi_im, rtol=1.e-10, atol=1.e-14)
+
+    # Spherical coordinates with fast_bins record the pairs in chord space.
+    ra = rng.uniform(0,20, (ngal,) )
+    dec = rng.uniform(-10,10, (ngal,) )
+    config = dict(min_sep=0.1, max_sep=5., nbins=15, sep_units='deg', metric='Arc',
+                  bin_slop=0, fast_bins=True)
+    sph = treecorr.Catalog(ra=ra, dec=dec, ra_units='deg', dec_units='deg', g1=g1, g2=g2)
+    gg4 = treecorr.GGCorrelation(config)
+    ilist3 = gg4.record_interactions(sph)
+    assert ilist3.metric == 'Arc'
+    sph2 = treecorr.Catalog(ra=ra, dec=dec, ra_units='deg', dec_units='deg', g1=g2, g2=g1)
+    gg5 = treecorr.GGCorrelation(config)
+    gg5.replay_interactions(ilist3, sph2)
+    gg6 = treecorr.GGCorrelation(config)
+    gg6.process(sph2)
+    np.testing.assert_array_equal(gg5.npairs, gg6.npairs)
+    np.testing.assert_allclose(gg5.xip, gg6.xip, rtol=1.e-10, atol=1.e-14)
+    np.testing.assert_allclose(gg5.xim, gg6.xim, rtol=1.e-10, atol=1.e-14)
+
+    # Errors
+    with assert_raises(ValueError):
+        gg3.replay_interactions(ilist, cat, cat)   # ilist is an auto-correlation
+    with assert_raises(ValueError):
+        gg3.replay_interactions(ilist2, lens)      # ilist2 is a cross-correlation
+    with assert_raises(ValueError):
+        cat_x = treecorr.Catalog(x=x, y=y, g1=g1, g2=g2) # Different weights
+        gg3.replay_interactions(ilist, cat_x)
+    with assert_raises(ValueError):
+        gg7 = treecorr.GGCorrelation(min_sep=1., max_sep=30., nbins=10)
+        gg7.replay_interactions(ilist, cat)        # Different binning
+    with assert_raises(TypeError):
+        kg.replay_interactions(ilist, cat)         # KG needs cat2
+    with assert_raises(TypeError):
+        kk = treecorr.KKCorrelation(min_sep=1., max_sep=30., nbins=15, bin_slop=0.5)
+        kk.replay_interactions(ilist, cat)         # cat doesn't have k
+    with assert_raises(ValueError):
+        gg7 = treecorr.GGCorrelation(config, max_pairs=100)
+        gg7.record_interactions(sph)
+
+
+@timer
+def test_process_columns():
+    # Many shear columns with the same positions can be done with a single tree traversal.
+    ngal = 2000
+    ncol = 5
+    s = 10.
+    rng = np.random.RandomState(8675309)
+    x = rng.normal(0,s, (ngal,) )
+    y = rng.normal(0,s, (ngal,) )
+    w = rng.random_sample(ngal)
+    g = rng.normal(0,0.2, (ncol,ngal) ) + 1j * rng.normal(0,0.2, (ncol,ngal) )
+    k = rng.normal(0,1, (ncol,ngal) )
+    cat = treecorr.Catalog(x=x, y=y, w=w)
+
+    for config in [dict(min_sep=1., max_sep=30., nbins=15, brute=True),
+                   dict(min_sep=1., max_sep=30., nbins=15, bin_slop=0.5)]:
+        rtol = 1.e-10 if 'brute' in config else 2.e-5
+        gg = treecorr.GGCorrelation(config)
+        ggs = gg.process_columns(cat, values1=g)
+        assert len(ggs) == ncol
+        assert np.all(gg.npairs == 0)  # gg itself isn't changed.
+        for j in range(ncol):
+            cat_j = treecorr.Catalog(x=x, y=y, w=w, g1=g[j].real, g2=g[j].imag)
+            gg_j = treecorr.GGCorrelation(config)
+            gg_j.process(cat_j)
+            np.testing.assert_array_equal(ggs[j].npairs, gg_j.npairs)
+            np.testing.assert_allclose(ggs[j].weight, gg_j.weight, rtol=1.e-10)
+            np.testing.assert_allclose(ggs[j].meanr, gg_j.meanr, rtol=1.e-10)
+            np.testing.assert_allclose(ggs[j].meanlogr, gg_j.meanlogr, rtol=1.e-10)
+            np.testing.assert_allclose(ggs[j].xip, gg_j.xip, rtol=rtol, atol=1.e-8)
+            np.testing.assert_allclose(ggs[j].xip_im, gg_j.xip_im, rtol=rtol, atol=1.e-8)
+            np.testing.assert_allclose(ggs[j].xim, gg_j.xim, rtol=rtol, atol=1.e-8)
+            np.testing.assert_allclose(ggs[j].xim_im, gg_j.xim_im, rtol=rtol, atol=1.e-8)
+            np.testing.assert_allclose(ggs[j].varxip, gg_j.varxip, rtol=1.e-10)
+
+        # Cross-correlations with an N or K field on the other side.
+        x2 = rng.normal(0,s, (ngal,) )
+        y2 = rng.normal(0,s, (ngal,) )
+        lens = treecorr.Catalog(x=x2, y=y2)
+        ngs = treecorr.NGCorrelation(config).process_columns(lens, cat, values2=g)
+        kgs = treecorr.KGCorrelation(config).process_columns(lens, cat, values1=k, values2=g)
+        for j in range(ncol):
+            cat_j = treecorr.Catalog(x=x, y=y, w=w, g1=g[j].real, g2=g[j].imag)
+            lens_j = treecorr.Catalog(x=x2, y=y2, k=k[j])
+            ng_j = treecorr.NGCorrelation(config)
+            ng_j.process(lens, cat_j)
+            np.testing.assert_array_equal(ngs[j].npairs, ng_j.npairs)
+            np.testing.assert_allclose(ngs[j].xi, ng_j.xi, rtol=rtol, atol=1.e-8)
+            np.testing.assert_allclose(ngs[j].xi_im, ng_j.xi_im, rtol=rtol, atol=1.e-8)
+            np.testing.assert_allclose(ngs[j].varxi, ng_j.varxi, rtol=1.e-10)
+            kg_j = treecorr.KGCorrelation(config)
+            kg_j.process(lens_j, cat_j)
+            np.testing.assert_array_equal(kgs[j].npairs, kg_j.npairs)
+            np.testing.assert_allclose(kgs[j].xi, kg_j.xi, rtol=rtol, atol=1.e-8)
+            np.testing.assert_allclose(kgs[j].xi_im, kg_j.xi_im, rtol=rtol, atol=1.e-8)
+            np.testing.assert_allclose(kgs[j].varxi, kg_j.varxi, rtol=1.e-10)
+
+    # Spherical coordinates use the same projections as the usual calculation.
+    ra = rng.uniform(0,20, (ngal,) )
+    dec = rng.uniform(-10,10, (ngal,) )
+    sph = treecorr.Catalog(ra=ra, dec=dec, ra_units='deg', dec_units='deg', w=w)
+    config = dict(min_sep=10., max_sep=300., nbins=10, sep_units='arcmin', brute=True)
+    ggs = treecorr.GGCorrelation(config).process_columns(sph, values1=g[:2])
+    kks = treecorr.KKCorrelation(config).process_columns(sph, values1=k[:2])
+    for j in range(2):
+        sph_j = treecorr.Catalog(ra=ra, dec=dec, ra_units='deg', dec_units='deg', w=w,
+                                 g1=g[j].real, g2=g[j].imag, k=k[j])
+        gg_j = treecorr.GGCorrelation(config)
+        gg_j.process(sph_j)
+        np.testing.assert_allclose(ggs[j].meanr, gg_j.meanr, rtol=1.e-10)
+        np.testing.assert_allclose(ggs[j].xip, gg_j.xip, rtol=1.e-10, atol=1.e-12)
+        np.testing.assert_allclose(ggs[j].xim, gg_j.xim, rtol=1.e-10, atol=1.e-12)
+        kk_j = treecorr.KKCorrelation(config)
+        kk_j.process(sph_j)
+        np.testing.assert_allclose(kks[j].xi, kk_j.xi, rtol=1.e-10, atol=1.e-12)
+        np.testing.assert_allclose(kks[j].varxi, kk_j.varxi, rtol=1.e-10)
+
+    # Without values, the catalog's own g is used as a single column.
+    cat_0 = treecorr.Catalog(x=x, y=y, w=w, g1=g[0].real, g2=g[0].imag)
+    gg = treecorr.GGCorrelation(min_sep=1., max_sep=30., nbins=15, brute=True)
+    ggs = gg.process_columns(cat_0)
+    assert len(ggs) == 1
+    gg.process(cat_0)
+    np.testing.assert_allclose(ggs[0].xip, gg.xip, rtol=1.e-10, atol=1.e-12)
+
+    # Errors
+    nn = treecorr.NNCorrelation(min_sep=1., max_sep=30., nbins=15)
+    with assert_raises(TypeError):
+        nn.process_columns(cat)
+    with assert_raises(TypeError):
+        gg.process_columns(cat)                     # No g in cat
+    with assert_raises(TypeError):
+        gg.process_columns(cat, values1=g, values2=g)
+    with assert_raises(ValueError):
+        gg.process_columns(cat, values1=g[:,:10])   # Wrong number of objects
+    with assert_raises(TypeError):
+        treecorr.NGCorrelation(min_sep=1., max_sep=30., nbins=15).process_columns(cat, cat)
+    with assert_raises(TypeError):
+        treecorr.NGCorrelation(min_sep=1., max_sep=30., nbins=15).process_columns(
+            lens, values1=g)                        # NG needs cat2
+    with assert_raises(TypeError):
+        treecorr.NGCorrelation(min_sep=1., max_sep=30., nbins=15).process_columns(
+            lens, cat, values1=g, values2=g)        # No values for the N field
+    with assert_raises(ValueError):
+        treecorr.KGCorrelation(min_sep=1., max_sep=30., nbins=15).process_columns(
+            lens, cat, values1=k[:2], values2=g)    # Different numbers of columns
+    with assert_raises(TypeError):
+        treecorr.KKCorrelation(min_sep=1., max_sep=30., nbins=15).process_columns(
+            cat, values1=g)                         # Complex values for K
+    with assert_raises(ValueError):
+        treecorr.GGCorrelation(min_sep=1., max_sep=30., nbins=15,
+                               var_method='jackknife').process_columns(cat, values1=g)
+
+
+@timer
+def test_grid_min_sep():
+    # With grid_min_sep, the bins above that scale are computed on a mesh with FFTs.
+    # Compare to the tree for all the different kinds of correlations.
+    ngal = 5000
+    L = 200.
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0, L, ngal)
+    y = rng.uniform(0, L, ngal)
+    w = rng.uniform(0.5, 1.5, ngal)
+    # A smooth field made from a few E-mode plane waves.
+    k = np.zeros(ngal)
+    g1 = np.zeros(ngal)
+    g2 = np.zeros(ngal)
+    for j in range(10):
+        kmag = 2.*np.pi / rng.uniform(30, 60)
+        theta = rng.uniform(0, 2.*np.pi)
+        phase = rng.uniform(0, 2.*np.pi) + kmag * (x * np.cos(theta) + y * np.sin(theta))
+        k += 0.1 * np.cos(phase)
+        g1 += 0.05 * np.cos(phase) * np.cos(2.*theta)
+        g2 += 0.05 * np.cos(phase) * np.sin(2.*theta)
+    cat = treecorr.Catalog(x=x, y=y, w=w, k=k, g1=g1, g2=g2)
+    cat2 = treecorr.Catalog(x=x[::2], y=y[::2], w=w[::2], k=k[::2], g1=g1[::2], g2=g2[::2])
+
+    # The bin edges are 1, sqrt(2), 2, ..., so bins 6 and up are done on the mesh.
+    config = dict(min_sep=1., max_sep=64., nbins=12, bin_slop=0)
+    grid_config = dict(config, grid_min_sep=8., grid_cell_size=0.5)
+    k0 = 6
+    classes = [treecorr.NNCorrelation, treecorr.NKCorrelation, treecorr.NGCorrelation,
+               treecorr.KKCorrelation, treecorr.KGCorrelation, treecorr.GGCorrelation]
+    for cls in classes:
+        for auto in [True, False]:
+            if auto and cls not in [treecorr.NNCorrelation, treecorr.KKCorrelation,
+                                    treecorr.GGCorrelation]:
+                continue
+            cats = [cat] if auto else [cat, cat2]
+            tree = cls(config)
+            tree.process(*cats)
+            grid = cls(grid_config)
+            grid.process(*cats)
+            print(cls.__name__, auto)
+            print('tree npairs = ',tree.npairs)
+            print('grid npairs = ',grid.npairs)
+            # The tree bins are the same as before.
+            np.testing.assert_allclose(grid.npairs[:k0], tree.npairs[:k0], rtol=1.e-10)
+            np.testing.assert_allclose(grid.weight[:k0], tree.weight[:k0], rtol=1.e-10)
+            # The mesh bins are close, since the objects are moved by at most half a cell.
+            np.testing.assert_allclose(grid.npairs[k0:], tree.npairs[k0:], rtol=0.02)
+            np.testing.assert_allclose(grid.weight[k0:], tree.weight[k0:], rtol=0.02)
+            np.testing.assert_allclose(grid.meanr, tree.meanr, rtol=0.01)
+            np.testing.assert_allclose(grid.meanlogr, tree.meanlogr, atol=0.01)
+            for name in ['xi', 'xip', 'xim']:
+                if hasattr(tree, name):
+                    t = getattr(tree, name)
+                    g = getattr(grid, name)
+                    print(name, t, g)
+                    np.testing.assert_allclose(g[:k0], t[:k0], rtol=1.e-8,
+                                               atol=1.e-12 * np.max(np.abs(t)))
+                    np.testing.assert_allclose(g[k0:], t[k0:], atol=0.03 * np.max(np.abs(t)))
+
+    # The Periodic metric uses one period for the mesh, and the FFTs do the wrapping.
+    tree = treecorr.GGCorrelation(config, period=L)
+    tree.process(cat, metric='Periodic')
+    grid = treecorr.GGCorrelation(grid_config, period=L)
+    grid.process(cat, metric='Periodic')
+    np.testing.assert_allclose(grid.npairs, tree.npairs, rtol=0.02)
+    np.testing.assert_allclose(grid.xip, tree.xip, atol=0.03 * np.max(np.abs(tree.xip)))
+    np.testing.assert_allclose(grid.xim, tree.xim, atol=0.03 * np.max(np.abs(tree.xim)))
+
+    # With spherical coordinates, the mesh isn't used.
+    ra = x / L * 10.
+    dec = y / L * 10.
+    scat = treecorr.Catalog(ra=ra, dec=dec, ra_units='deg', dec_units='deg', g1=g1, g2=g2)
+    tree = treecorr.GGCorrelation(config, sep_units='arcmin')
+    tree.process(scat)
+    grid = treecorr.GGCorrelation(grid_config, sep_units='arcmin')
+    grid.process(scat)
+    np.testing.assert_array_equal(grid.npairs, tree.npairs)
+    np.testing.assert_array_equal(grid.xip, tree.xip)
+
+    # bin_slop = 0 needs an explicit grid_cell_size.
+    with assert_raises(ValueError):
+        treecorr.GGCorrelation(config, grid_min_sep=8.)
+
+
 if __name__ == '__main__':
     test_direct()
     test_direct_spherical()
@@ -1351,3 +1799,8 @@ if __name__ == '__main__':
     test_shuffle()
     test_haloellip()
     test_varxi
+    test_process_multi_bin()
+    test_pairwise_arrays()
+    test_replay()
+    test_process_columns()
+    test_grid_min_sep()
@@ -72,6 +72,30 @@ def test_count_near():
     assert n4 == n1
     assert n5 == n1
 
+    # share_leaves builds the same tree, just with the leaves stored differently.
+    gfield2 = cat.getGField(min_size=0.05, max_size=sep, max_top=2, share_leaves=True)
+    assert gfield2.share_leaves
+    assert gfield2.nTopLevelNodes == gfield.nTopLevelNodes
+    assert gfield2.count_near(x0, y0, sep) == n1
+    nfield2 = treecorr.NField(cat, share_leaves=True)
+    assert nfield2.count_near(x=x0, y=y0, sep=sep) == n1
+
+    # lazy only builds the lower cells when they are needed, but the answer is the same.
+    gfield3 = cat.getGField(min_size=0.05, max_size=sep, max_top=2, lazy=True)
+    assert gfield3.lazy
+    assert gfield3.nTopLevelNodes == gfield.nTopLevelNodes
+    assert gfield3.count_near(x0, y0, sep) == n1
+    assert gfield3.count_near(x0, y0, sep) == n1
+    nfield3 = treecorr.NField(cat, lazy=True, share_leaves=True)
+    assert nfield3.count_near(x=x0, y=y0, sep=sep) == n1
+
+    # presort changes the order of the objects in memory, but not the answer.
+    gfield4 = cat.getGField(min_size=0.05, max_size=sep, max_top=2, presort=True)
+    assert gfield4.presort
+    assert gfield4.count_near(x0, y0, sep) == n1
+    nfield4 = treecorr.NField(cat, presort=True, share_leaves=True)
+    assert nfield4.count_near(x=x0, y=y0, sep=sep) == n1
+
     # 3D coords
 
     r = np.sqrt(x*x+y*y+z*z)
@@ -125,6 +149,9 @@ def test_count_near():
     assert n12 == n1
     assert n13 == n1
 
+    kfield2 = cat.getKField(min_size=0.01, max_size=sep, min_top=5, presort=True)
+    assert kfield2.count_near(x0, y0, z0, sep=sep) == n1
+
     # Spherical
     cat = treecorr.Catalog(ra=ra, dec=dec, ra_units='deg', dec_units='deg',
                            w=w, g1=w, g2=w, k=w, keep_zero_weight=True)
@@ -223,6 +250,47 @@ def test_get_near():
     #assert t2 < t1    # These don't always pass.  The tree version is usually a faster,
     #assert t3 < t1    # but not always.  So don't require it in unit test.
 
+    # Building a field from part of the catalog and appending the rest gives the same answer.
+    cat1 = treecorr.Catalog(x=x[:60000], y=y[:60000], w=w[:60000], keep_zero_weight=True)
+    cat2 = treecorr.Catalog(x=x[60000:], y=y[60000:], w=w[60000:], keep_zero_weight=True)
+    field2 = treecorr.NField(cat1)
+    n1 = field2.nTopLevelNodes
+    field2.append(cat2)
+    assert field2.ntot == nobj
+    assert field2.nTopLevelNodes > n1
+    np.testing.assert_array_equal(field2.get_near(x0, y0, sep), i1)
+    assert field2.count_near(x0, y0, sep) == len(i1)
+    assert_raises(TypeError, treecorr.GField(cat).append, cat1)
+
+    # The field now has its own catalog with all the objects, and the one in the cache of
+    # the original catalog still only has the original objects.
+    assert field2.cat.ntot == nobj
+    np.testing.assert_array_equal(field2.cat.x, x)
+    assert cat1.ntot == 60000
+    field3 = cat1.getNField()
+    field3.append(cat2)
+    assert cat1.getNField() is not field3
+    assert cat1.getNField().ntot == 60000
+    assert field3.cat.ntot == nobj
+
+    # With min_size > 0, the leaves have several objects, whose indices need to be found in
+    # the combined catalog.
+    field4 = treecorr.NField(cat1, min_size=0.1*sep)
+    field4.append(cat2)
+    np.testing.assert_array_equal(np.sort(field4.get_near(x0, y0, sep)), np.sort(i1))
+
+    # Appending many small batches rebuilds the tree once in a while, so the number of
+    # top-level cells doesn't keep growing.
+    field5 = treecorr.NField(cat1)
+    ntop = field5.nTopLevelNodes
+    for i in range(0, 2*ntop):
+        cat3 = treecorr.Catalog(x=x[60000+i:60001+i], y=y[60000+i:60001+i],
+                                w=w[60000+i:60001+i], keep_zero_weight=True)
+        field5.append(cat3)
+        assert field5.nTopLevelNodes < 3*ntop
+    assert field5.ntot == 60000 + 2*ntop
+    assert_raises(ValueError, field2.append, treecorr.Catalog(x=x, y=y, z=z))
+
     # Invalid ways to specify x,y,sep
     assert_raises(TypeError, field.get_near)
     assert_raises(TypeError, field.get_near, x0)
@@ -403,6 +471,82 @@ def test_get_near():
     np.testing.assert_array_equal(i5, i1)
 
 
+@timer
+def test_near_many():
+    # Test the batched versions of count_near and get_near, and the k-nearest-neighbor search.
+    nobj = 20000
+    nq = 200
+    rng = np.random.RandomState(8675309)
+    x = rng.random_sample(nobj)
+    y = rng.random_sample(nobj)
+    z = rng.random_sample(nobj)
+    qx = rng.random_sample(nq)
+    qy = rng.random_sample(nq)
+    qz = rng.random_sample(nq)
+    sep = rng.uniform(0.005, 0.03, nq)
+    k = 5
+
+    # Put a tight cluster around one of the query points.
+    x[100:130] = rng.normal(qx[3], 1.e-4, 30)
+    y[100:130] = rng.normal(qy[3], 1.e-4, 30)
+    z[100:130] = rng.normal(qz[3], 1.e-4, 30)
+
+    for coords in ['flat', '3d']:
+        if coords == 'flat':
+            cat = treecorr.Catalog(x=x, y=y)
+            points = np.array([qx, qy]).T
+            rsq = (x[np.newaxis,:]-qx[:,np.newaxis])**2 + (y[np.newaxis,:]-qy[:,np.newaxis])**2
+        else:
+            cat = treecorr.Catalog(x=x, y=y, z=z)
+            points = np.array([qx, qy, qz]).T
+            rsq = ((x[np.newaxis,:]-qx[:,np.newaxis])**2 + (y[np.newaxis,:]-qy[:,np.newaxis])**2
+                   + (z[np.newaxis,:]-qz[:,np.newaxis])**2)
+        true_nn = np.argsort(rsq, axis=1, kind='stable')[:,:k]
+        true_dist = np.sqrt(np.take_along_axis(rsq, true_nn, axis=1))
+
+        for min_size, lazy in [(0., False), (0., True), (0.01, False)]:
+            field = cat.getNField(min_size=min_size, lazy=lazy)
+            counts = field.count_near_many(points, sep)
+            ind, offsets = field.get_near_many(points, sep)
+            assert len(counts) == nq
+            assert len(offsets) == nq+1
+            np.testing.assert_array_equal(np.diff(offsets), counts)
+            for q in range(nq):
+                i1 = np.where(rsq[q] < sep[q]**2)[0]
+                np.testing.assert_array_equal(ind[offsets[q]:offsets[q+1]], i1)
+                if min_size == 0:
+                    assert counts[q] == field.count_near(*points[q], sep=sep[q])
+                if q < 10:
+                    np.testing.assert_array_equal(field.get_near(*points[q], sep=sep[q]), i1)
+
+            # Scalar sep is broadcast to all the points.
+            np.testing.assert_array_equal(field.count_near_many(points, 0.02),
+                                          np.sum(rsq < 0.02**2, axis=1))
+
+            nn_ind, nn_dist = field.get_nearest(points, k=k)
+            assert nn_ind.shape == (nq, k)
+            assert nn_dist.shape == (nq, k)
+            np.testing.assert_allclose(nn_dist, true_dist, rtol=1.e-10)
+            # Ties are possible in principle, but not with these random points.
+            np.testing.assert_array_equal(nn_ind, true_nn)
+            nn1, d1 = field.get_nearest(points[0])
+            assert nn1.shape == (1, 1)
+            assert nn1[0,0] == true_nn[0,0]
+
+    # If k > nobj, the extra indices are -1.
+    cat = treecorr.Catalog(x=x[:10], y=y[:10])
+    field = cat.getNField()
+    nn_ind, nn_dist = field.get_nearest(points[:3,:2], k=12)
+    np.testing.assert_array_equal(np.sort(nn_ind[:,:10], axis=1), np.tile(np.arange(10), (3,1)))
+    np.testing.assert_array_equal(nn_ind[:,10:], -1)
+    assert np.all(np.isinf(nn_dist[:,10:]))
+
+    assert_raises(ValueError, field.get_nearest, points[:3,:2], k=0)
+    assert_raises(ValueError, field.get_nearest, points[:3])
+    assert_raises(ValueError, field.count_near_many, points[:3], 0.1)
+    assert_raises(ValueError, field.get_near_many, points[:3], 0.1)
+
+
 @timer
 def test_sample_pairs():
 
@@ -573,8 +717,64 @@ def test_sample_pairs():
     np.testing.assert_array_less(nn.left_edges[b], sep)
 
 
+@timer
+def test_sample_pairs_seed():
+    # The sampling is done in parallel over the pairs of top-level cells.  With a seed, it
+    # should be reproducible for a given number of threads, and it should still be uniform.
+    nobj = 2000
+    rng = np.random.RandomState(1234)
+    x = rng.random_sample(nobj)
+    y = rng.random_sample(nobj)
+    cat = treecorr.Catalog(x=x, y=y)
+
+    nn = treecorr.NNCorrelation(min_sep=0.01, max_sep=0.02, nbins=1, bin_slop=0, max_top=4)
+    nn.process(cat)
+    ntot = int(nn.npairs[0] * 2)  # sample_pairs uses both orders of each pair.
+    print('ntot = ',ntot)
+
+    n = 200
+    i1, i2, sep = nn.sample_pairs(n, cat, cat, 0.01, 0.02, seed=1234, num_threads=4)
+    j1, j2, sep2 = nn.sample_pairs(n, cat, cat, 0.01, 0.02, seed=1234, num_threads=4)
+    assert len(i1) == n
+    np.testing.assert_array_equal(i1, j1)
+    np.testing.assert_array_equal(i2, j2)
+    np.testing.assert_array_equal(sep, sep2)
+    j1, j2, sep2 = nn.sample_pairs(n, cat, cat, 0.01, 0.02, seed=1235, num_threads=4)
+    assert not np.array_equal(i1, j1)
+    actual_sep = ((x[i1]-x[i2])**2 + (y[i1]-y[i2])**2)**0.5
+    np.testing.assert_allclose(sep, actual_sep, rtol=1.e-6)
+    np.testing.assert_array_less(sep, 0.02)
+    np.testing.assert_array_less(0.01, sep)
+
+    # Each pair should be chosen with probability n/ntot.
+    nrep = 200
+    counts = np.zeros((nobj, nobj), dtype=int)
+    for seed in range(1, nrep+1):
+        i1, i2, sep = nn.sample_pairs(n, cat, cat, 0.01, 0.02, seed=seed, num_threads=3)
+        assert len(set(zip(i1, i2))) == n  # No duplicates.
+        counts[i1, i2] += 1
+    p = n / ntot
+    all_pairs = counts.sum() + 0.
+    assert all_pairs == n * nrep
+    # The number of times each object is the first one of a pair should match the
+    # number of pairs it is in.
+    sel = counts.sum(axis=1)
+    dx = x[:,None] - x[None,:]
+    dy = y[:,None] - y[None,:]
+    r = np.sqrt(dx**2 + dy**2)
+    npairs_i = np.sum((r >= 0.01) & (r < 0.02), axis=1)
+    assert np.sum(npairs_i) == ntot
+    expected = nrep * p * npairs_i
+    chisq = np.sum((sel - expected)**2 / np.maximum(expected, 1))
+    print('chisq/dof = ',chisq / nobj)
+    assert chisq / nobj < 1.3
+
+    with assert_raises(ValueError):
+        nn.sample_pairs(n, cat, cat, 0.01, 0.02, seed=0)
 
 if __name__ == '__main__':
     test_count_near()
     test_get_near()
+    test_near_many()
     test_sample_pairs()
+    test_sample_pairs_seed()
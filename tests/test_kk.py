@@ -614,6 +614,271 @@ def test_varxi():
 
 
 
+@timer
+def test_max_time():
+    # With max_time or max_pairs, only a random subset of the top-level pairs is done,
+    # and frac_done reports how many.
+    ngal = 20000
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0,100, (ngal,) )
+    y = rng.uniform(0,100, (ngal,) )
+    k = rng.normal(0.3,0.1, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y, k=k)
+
+    kk = treecorr.KKCorrelation(min_sep=1., max_sep=10., nbins=10, max_top=6)
+    kk.process(cat)
+    assert kk.frac_done == 1.
+
+    kk2 = treecorr.KKCorrelation(min_sep=1., max_sep=10., nbins=10, max_top=6, max_pairs=3.e6)
+    kk2.process(cat)
+    print('frac_done = ',kk2.frac_done)
+    assert 0. < kk2.frac_done < 1.
+    assert np.all(kk2.npairs <= kk.npairs)
+    # xi is still a good estimate, since k is about the same everywhere.
+    np.testing.assert_allclose(kk2.xi, kk.xi, rtol=0.1)
+    # And the rescaled npairs is a rough estimate of the full value.
+    np.testing.assert_allclose(np.sum(kk2.npairs)/kk2.frac_done, np.sum(kk.npairs), rtol=0.2)
+
+    # A very large max_time does everything.
+    kk3 = treecorr.KKCorrelation(min_sep=1., max_sep=10., nbins=10, max_top=6, max_time=1.e4)
+    kk3.process(cat)
+    assert kk3.frac_done == 1.
+    np.testing.assert_allclose(kk3.npairs, kk.npairs)
+
+    # With patches, the budget is for the whole process call, not each pair of patches,
+    # and frac_done is the fraction of all of them.
+    pcat = treecorr.Catalog(x=x, y=y, k=k, npatch=8, rng=rng)
+    kk4 = treecorr.KKCorrelation(min_sep=1., max_sep=10., nbins=10, max_top=6, max_pairs=3.e6)
+    kk4.process(pcat)
+    print('frac_done = ',kk4.frac_done)
+    assert 0. < kk4.frac_done < 1.
+    np.testing.assert_allclose(kk4.frac_done, kk2.frac_done, rtol=0.5)
+    np.testing.assert_allclose(np.sum(kk4.npairs)/kk4.frac_done, np.sum(kk.npairs), rtol=0.2)
+    # Each pair of patches gets its share of the budget, so the ones that are done first don't
+    # use all of it.
+    for i in range(8):
+        print(i,np.sum(kk4.results[(i,i)].npairs))
+        assert np.sum(kk4.results[(i,i)].npairs) > 0
+    # It starts over with the next process call.
+    kk4.process(pcat)
+    np.testing.assert_allclose(kk4.frac_done, kk2.frac_done, rtol=0.5)
+    kk4.clear()
+    assert kk4.frac_done == 1.
+
+    # Also for the three-point function.
+    kkk = treecorr.KKKCorrelation(min_sep=1., max_sep=10., nbins=5, max_top=4,
+                                  max_triples=1.e5)
+    kkk.process(treecorr.Catalog(x=x[:2000], y=y[:2000], k=k[:2000]))
+    assert 0. < kkk.frac_done < 1.
+
+
+@timer
+def test_stats():
+    # The stats dict counts what happened during the tree traversal.
+    ngal = 5000
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0,100, (ngal,) )
+    y = rng.uniform(0,100, (ngal,) )
+    k = rng.normal(0.3,0.1, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y, k=k)
+
+    kk = treecorr.KKCorrelation(min_sep=1., max_sep=10., nbins=10)
+    kk.process(cat)
+    stats = kk.stats
+    print('stats = ',stats)
+    assert stats['nodes'] > 0
+    assert stats['direct'] > 0
+    assert stats['direct'] < np.sum(kk.npairs)
+    assert stats['split1'] + stats['split2'] + stats['split_multi'] > 0
+    assert stats['large_exit'] > 0
+    assert stats['nitems'] > 0
+    assert stats['nthreads'] >= 1
+    assert 0. <= stats['max_item_time'] <= stats['max_thread_time'] <= stats['item_time']
+    assert stats['split3'] == stats['range_exit'] == 0
+
+    # With brute force, every pair of objects is added to a bin one at a time.
+    kk2 = treecorr.KKCorrelation(min_sep=1., max_sep=10., nbins=10, brute=True)
+    kk2.process(cat)
+    assert kk2.stats['direct'] == np.sum(kk2.npairs)
+    # Each pair of leaves drops into a single bin, but only the ones in range are added.
+    assert kk2.stats['single_bin'] >= kk2.stats['direct']
+
+    # The counters accumulate over process calls until clear is called.
+    kk2.process_auto(cat)
+    assert kk2.stats['direct'] == np.sum(kk2.npairs)
+    kk2.clear()
+    assert kk2.stats['nodes'] == kk2.stats['direct'] == 0
+
+    # With leaf_size, small pairs of cells are done leaf by leaf.
+    kk3 = treecorr.KKCorrelation(min_sep=1., max_sep=10., nbins=10, leaf_size=20)
+    kk3.process(cat)
+    assert kk3.stats['leaf_pairs'] > 0
+    assert kk.stats['leaf_pairs'] == 0
+
+    # Also for the three-point function.
+    cat3 = treecorr.Catalog(x=x[:1000], y=y[:1000], k=k[:1000])
+    kkk = treecorr.KKKCorrelation(min_sep=1., max_sep=10., nbins=5)
+    kkk.process(cat3)
+    print('kkk stats = ',kkk.stats)
+    assert kkk.stats['nodes'] > 0
+    assert kkk.stats['direct'] > 0
+    assert kkk.stats['direct'] <= np.sum(kkk.ntri)
+    assert kkk.stats['nitems'] > 0
+
+
+@timer
+def test_narrow_cross():
+    # When max_sep is small compared to the size of the fields, most pairs of top-level cells
+    # are too far apart to matter, and the cross-correlations skip them without making a work
+    # item for each one.
+    ngal = 5000
+    rng = np.random.RandomState(8675309)
+    x1 = rng.uniform(0,1000, (ngal,) )
+    y1 = rng.uniform(0,1000, (ngal,) )
+    k1 = rng.normal(0.3,0.1, (ngal,) )
+    x2 = rng.uniform(0,1000, (ngal,) )
+    y2 = rng.uniform(0,1000, (ngal,) )
+    k2 = rng.normal(0.3,0.1, (ngal,) )
+    cat1 = treecorr.Catalog(x=x1, y=y1, k=k1)
+    cat2 = treecorr.Catalog(x=x2, y=y2, k=k2)
+
+    kk = treecorr.KKCorrelation(min_sep=1., max_sep=20., nbins=10, bin_slop=0,
+                                min_top=8, max_top=8)
+    kk.process(cat1, cat2)
+    kk_brute = treecorr.KKCorrelation(min_sep=1., max_sep=20., nbins=10, brute=True)
+    kk_brute.process(cat1, cat2)
+    print('nitems = ',kk.stats['nitems'])
+    assert kk.stats['nitems'] < 256**2 / 10
+    np.testing.assert_allclose(kk.npairs, kk_brute.npairs)
+    np.testing.assert_allclose(kk.xi, kk_brute.xi, rtol=1.e-8)
+
+    # Also on the sphere with the Arc metric.
+    ra1 = x1 / 1000. * 360.
+    dec1 = y1 / 1000. * 90. - 45.
+    ra2 = x2 / 1000. * 360.
+    dec2 = y2 / 1000. * 90. - 45.
+    cat1s = treecorr.Catalog(ra=ra1, dec=dec1, k=k1, ra_units='deg', dec_units='deg')
+    cat2s = treecorr.Catalog(ra=ra2, dec=dec2, k=k2, ra_units='deg', dec_units='deg')
+    for metric in ['Euclidean', 'Arc']:
+        kk = treecorr.KKCorrelation(min_sep=10., max_sep=200., nbins=10, sep_units='arcmin',
+                                    bin_slop=0, min_top=8, max_top=8)
+        kk.process(cat1s, cat2s, metric=metric)
+        kk_brute = treecorr.KKCorrelation(min_sep=10., max_sep=200., nbins=10,
+                                          sep_units='arcmin', brute=True)
+        kk_brute.process(cat1s, cat2s, metric=metric)
+        assert kk.stats['nitems'] < 256**2 / 10
+        np.testing.assert_allclose(kk.npairs, kk_brute.npairs)
+        np.testing.assert_allclose(kk.xi, kk_brute.xi, rtol=1.e-8)
+
+    # And the three-point cross-correlation.
+    cat3 = treecorr.Catalog(x=x1[:1000], y=y1[:1000], k=k1[:1000])
+    kkk = treecorr.KKKCorrelation(min_sep=5., max_sep=50., nbins=5, bin_slop=0,
+                                  min_top=6, max_top=6)
+    kkk.process(cat3, cat3, cat3)
+    kkk_brute = treecorr.KKKCorrelation(min_sep=5., max_sep=50., nbins=5, brute=True)
+    kkk_brute.process(cat3, cat3, cat3)
+    np.testing.assert_allclose(kkk.ntri, kkk_brute.ntri)
+    np.testing.assert_allclose(kkk.zeta, kkk_brute.zeta, rtol=1.e-8, atol=1.e-12)
+
+
+@timer
+def test_fast_bins():
+    # With fast_bins, the Log bins come from a table of the bin edges rather than from log(r).
+    # The pairs go into exactly the same bins, so with bin_slop=0 this matches brute force.
+    ngal = 2000
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0,100, (ngal,) )
+    y = rng.uniform(0,100, (ngal,) )
+    k = rng.normal(0.3,0.1, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y, k=k)
+
+    kk_brute = treecorr.KKCorrelation(min_sep=0.5, max_sep=20., nbins=17, brute=True)
+    kk_brute.process(cat)
+    kk_fast_brute = treecorr.KKCorrelation(min_sep=0.5, max_sep=20., nbins=17, brute=True,
+                                           fast_bins=True)
+    kk_fast_brute.process(cat)
+    np.testing.assert_array_equal(kk_fast_brute.npairs, kk_brute.npairs)
+    np.testing.assert_allclose(kk_fast_brute.xi, kk_brute.xi, rtol=1.e-12)
+    np.testing.assert_allclose(kk_fast_brute.meanlogr, kk_brute.meanlogr, rtol=1.e-12)
+
+    kk_fast = treecorr.KKCorrelation(min_sep=0.5, max_sep=20., nbins=17, bin_slop=0,
+                                     fast_bins=True)
+    kk_fast.process(cat)
+    np.testing.assert_array_equal(kk_fast.npairs, kk_brute.npairs)
+    np.testing.assert_allclose(kk_fast.xi, kk_brute.xi, rtol=1.e-8)
+    np.testing.assert_allclose(kk_fast.meanr, kk_brute.meanr, rtol=1.e-3)
+
+    # With bin_slop > 0, the single bin test is a little different, but it is still close.
+    kk_slop = treecorr.KKCorrelation(min_sep=0.5, max_sep=20., nbins=17, bin_slop=0.3)
+    kk_slop.process(cat)
+    kk_fast_slop = treecorr.KKCorrelation(min_sep=0.5, max_sep=20., nbins=17, bin_slop=0.3,
+                                          fast_bins=True)
+    kk_fast_slop.process(cat)
+    np.testing.assert_allclose(kk_fast_slop.npairs, kk_slop.npairs, rtol=2.e-2)
+    np.testing.assert_allclose(kk_fast_slop.xi, kk_slop.xi, rtol=2.e-2)
+
+    # skip_meanlogr leaves out the meanlogr accumulation, and sets it to log(meanr).
+    for bin_type in ['Log', 'Linear']:
+        kk1 = treecorr.KKCorrelation(min_sep=0.5, max_sep=20., nbins=17, brute=True,
+                                     bin_type=bin_type)
+        kk1.process(cat)
+        kk2 = treecorr.KKCorrelation(min_sep=0.5, max_sep=20., nbins=17, brute=True,
+                                     bin_type=bin_type, fast_bins=True, skip_meanlogr=True)
+        kk2.process(cat)
+        np.testing.assert_array_equal(kk2.npairs, kk1.npairs)
+        np.testing.assert_allclose(kk2.xi, kk1.xi, rtol=1.e-12)
+        np.testing.assert_allclose(kk2.meanr, kk1.meanr, rtol=1.e-12)
+        np.testing.assert_allclose(kk2.meanlogr, np.log(kk1.meanr), rtol=1.e-12)
+
+
+@timer
+def test_fast_bins_arc():
+    # With metric='Arc', fast_bins also lets the traversal use the chord distances, so the
+    # angles are only computed for the pairs that are accumulated.  With brute force, the
+    # results are the same as the usual calculation.
+    ngal = 2000
+    rng = np.random.RandomState(8675309)
+    ra = rng.uniform(0,20, (ngal,) )
+    dec = rng.uniform(-10,10, (ngal,) )
+    k = rng.normal(0.3,0.1, (ngal,) )
+    cat = treecorr.Catalog(ra=ra, dec=dec, ra_units='deg', dec_units='deg', k=k)
+
+    config = dict(min_sep=0.1, max_sep=5., nbins=15, sep_units='deg', metric='Arc')
+    kk_brute = treecorr.KKCorrelation(config, brute=True)
+    kk_brute.process(cat)
+    kk_fast_brute = treecorr.KKCorrelation(config, brute=True, fast_bins=True)
+    kk_fast_brute.process(cat)
+    np.testing.assert_array_equal(kk_fast_brute.npairs, kk_brute.npairs)
+    np.testing.assert_allclose(kk_fast_brute.xi, kk_brute.xi, rtol=1.e-12)
+    np.testing.assert_allclose(kk_fast_brute.meanr, kk_brute.meanr, rtol=1.e-12)
+    np.testing.assert_allclose(kk_fast_brute.meanlogr, kk_brute.meanlogr, rtol=1.e-12)
+
+    kk_fast = treecorr.KKCorrelation(config, bin_slop=0, fast_bins=True)
+    kk_fast.process(cat)
+    np.testing.assert_array_equal(kk_fast.npairs, kk_brute.npairs)
+    np.testing.assert_allclose(kk_fast.xi, kk_brute.xi, rtol=1.e-8)
+    np.testing.assert_allclose(kk_fast.meanr, kk_brute.meanr, rtol=1.e-3)
+
+    # The cross-correlation goes through the same path.
+    kk_cross = treecorr.KKCorrelation(config, bin_slop=0, fast_bins=True)
+    kk_cross.process(cat, cat)
+    np.testing.assert_array_equal(kk_cross.npairs, 2*kk_brute.npairs)
+    np.testing.assert_allclose(kk_cross.xi, kk_brute.xi, rtol=1.e-8)
+
+    # If the bins go up to angles near pi, the chord distances can't be used, so it falls back
+    # to the usual calculation with the angles.
+    config = dict(min_sep=1., max_sep=179., nbins=10, sep_units='deg', metric='Arc')
+    ra = rng.uniform(0,360, (ngal,) )
+    dec = np.arcsin(rng.uniform(-1,1, (ngal,) )) * 180./np.pi
+    cat = treecorr.Catalog(ra=ra, dec=dec, ra_units='deg', dec_units='deg', k=k)
+    kk_brute = treecorr.KKCorrelation(config, brute=True)
+    kk_brute.process(cat)
+    kk_fast = treecorr.KKCorrelation(config, brute=True, fast_bins=True)
+    kk_fast.process(cat)
+    np.testing.assert_array_equal(kk_fast.npairs, kk_brute.npairs)
+    np.testing.assert_allclose(kk_fast.xi, kk_brute.xi, rtol=1.e-12)
+
+
 if __name__ == '__main__':
     test_direct()
     test_direct_spherical()
@@ -622,3 +887,8 @@ if __name__ == '__main__':
     test_kk()
     test_large_scale()
     test_varxi()
+    test_max_time()
+    test_stats()
+    test_narrow_cross()
+    test_fast_bins()
+    test_fast_bins_arc()
@@ -559,8 +559,166 @@ def test_kkk():
     assert kkk2.sep_units == kkk.sep_units
     assert kkk2.bin_type == kkk.bin_type
 
+@timer
+def test_multipole():
+    # Check the multipole algorithm against a brute force calculation.
+    ngal = 200
+    s = 10.
+    rng = np.random.RandomState(8675309)
+    x = rng.normal(0,s, (ngal,) )
+    y = rng.normal(0,s, (ngal,) )
+    w = rng.random_sample(ngal) + 0.5
+    kap = rng.normal(0,3, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y, w=w, k=kap)
+
+    min_sep = 2.
+    max_sep = 20.
+    nbins = 5
+    max_n = 6
+    kkk = treecorr.KKKCorrelation(min_sep=min_sep, max_sep=max_sep, nbins=nbins,
+                                  bin_slop=0.)
+    mp = kkk.process_multipole(cat, max_n=max_n)
+    assert mp.weight.shape == (nbins, nbins, max_n+1)
+    assert mp.zeta.shape == (nbins, nbins, max_n+1)
+    np.testing.assert_allclose(mp.rnom, np.exp(kkk.logr1d))
+    # kkk itself isn't changed.
+    assert np.all(kkk.weight == 0.)
+
+    log_min_sep = np.log(min_sep)
+    bin_size = np.log(max_sep / min_sep) / nbins
+    true_weight = np.zeros((nbins, nbins, max_n+1), dtype=complex)
+    true_zeta = np.zeros((nbins, nbins, max_n+1), dtype=complex)
+    true_npairs = np.zeros(nbins, dtype=float)
+    true_meanr = np.zeros(nbins, dtype=float)
+    n = np.arange(max_n+1)
+    for i in range(ngal):
+        dx = x - x[i]
+        dy = y - y[i]
+        r = np.sqrt(dx**2 + dy**2)
+        use = (r >= min_sep) & (r < max_sep)
+        r = r[use]
+        phi = np.arctan2(dy[use], dx[use])
+        kr = np.floor((np.log(r) - log_min_sep) / bin_size).astype(int)
+        ww = w[use]
+        wk = w[use] * kap[use]
+        np.add.at(true_npairs, kr, w[i] * ww)
+        np.add.at(true_meanr, kr, w[i] * ww * r)
+        for j in range(len(r)):
+            for k in range(len(r)):
+                if j == k: continue
+                e = np.exp(-1j * n * (phi[j] - phi[k]))
+                true_weight[kr[j],kr[k]] += w[i] * ww[j] * ww[k] * e
+                true_zeta[kr[j],kr[k]] += w[i] * kap[i] * wk[j] * wk[k] * e
+    true_meanr /= true_npairs
+
+    np.testing.assert_allclose(mp.weight, true_weight, rtol=1.e-5, atol=1.e-5)
+    np.testing.assert_allclose(mp.zeta, true_zeta, rtol=1.e-5, atol=1.e-5)
+    np.testing.assert_allclose(mp.npairs, true_npairs, rtol=1.e-5)
+    np.testing.assert_allclose(mp.meanr, true_meanr, rtol=1.e-5)
+
+    # Swapping the two sides is the complex conjugate.
+    np.testing.assert_allclose(mp.weight, np.conj(mp.weight.transpose(1,0,2)), rtol=1.e-8)
+
+    # The weights in all the phi bins add up to the n=0 term.
+    phi, weight, zeta = mp.toPhi(12)
+    assert weight.shape == (nbins, nbins, 12)
+    np.testing.assert_allclose(phi, (np.arange(12)+0.5) * np.pi/12)
+    np.testing.assert_allclose(np.sum(weight, axis=2), mp.weight[:,:,0].real, rtol=1.e-8)
+    np.testing.assert_allclose(np.sum(zeta * weight, axis=2), mp.zeta[:,:,0].real,
+                               rtol=1.e-6, atol=1.e-6)
+
+    # NNN gives the same weights, and no zeta.
+    nnn = treecorr.NNNCorrelation(min_sep=min_sep, max_sep=max_sep, nbins=nbins, bin_slop=0.)
+    mp2 = nnn.process_multipole(cat, max_n=max_n)
+    np.testing.assert_allclose(mp2.weight, mp.weight, rtol=1.e-8)
+    assert mp2.zeta is None
+    phi2, weight2, zeta2 = mp2.toPhi(12)
+    np.testing.assert_allclose(weight2, weight, rtol=1.e-8)
+    assert zeta2 is None
+
+    # With the default bin_slop, the results are approximately the same.
+    kkk = treecorr.KKKCorrelation(min_sep=min_sep, max_sep=max_sep, nbins=nbins)
+    mp3 = kkk.process_multipole(cat, max_n=max_n)
+    np.testing.assert_allclose(mp3.npairs, true_npairs, rtol=0.05)
+    np.testing.assert_allclose(mp3.weight[:,:,0].real, true_weight[:,:,0].real, rtol=0.1)
+
+    # When a cell of several points is used as a single point, only the degenerate triangles
+    # with both vertices at the same object are removed, not the whole cell's w^2.
+    # With a tight clump of points, the total weight is then exact for any bin_slop.
+    xc = rng.uniform(9.5, 10.5, (ngal,))
+    yc = rng.uniform(-0.5, 0.5, (ngal,))
+    clump = treecorr.Catalog(x=xc, y=yc, w=w, k=kap)
+    center = treecorr.Catalog(x=[0.], y=[0.], w=[2.], k=[1.])
+    for bin_slop in [0., 1., 10.]:
+        kkk = treecorr.KKKCorrelation(min_sep=min_sep, max_sep=max_sep, nbins=nbins,
+                                      bin_slop=bin_slop)
+        mp6 = kkk.process_multipole(center, clump, max_n=0)
+        np.testing.assert_allclose(np.sum(mp6.weight.real), 2. * (np.sum(w)**2 - np.sum(w**2)),
+                                   rtol=1.e-5)
+        np.testing.assert_allclose(np.sum(mp6.zeta.real),
+                                   2. * (np.sum(w*kap)**2 - np.sum((w*kap)**2)),
+                                   rtol=1.e-5, atol=1.e-3)
+
+    # Cross correlations use cat1 for the central points and cat2 for the other two.
+    cat2 = treecorr.Catalog(x=x[:100], y=y[:100], w=w[:100], k=kap[:100])
+    mp4 = nnn.process_multipole(cat2, cat, max_n=max_n)
+    cat3 = treecorr.Catalog(x=x[100:], y=y[100:], w=w[100:], k=kap[100:])
+    mp5 = nnn.process_multipole(cat3, cat, max_n=max_n)
+    np.testing.assert_allclose(mp4.weight + mp5.weight, mp.weight, rtol=1.e-5, atol=1.e-5)
+
+    # Not implemented for spherical coordinates or GGG.
+    ra = rng.uniform(0, 1., (ngal,))
+    dec = rng.uniform(0, 1., (ngal,))
+    scat = treecorr.Catalog(ra=ra, dec=dec, ra_units='deg', dec_units='deg', k=kap)
+    with assert_raises(ValueError):
+        kkk.process_multipole(scat)
+    with assert_raises(ValueError):
+        kkk.process_multipole(cat, max_n=-1)
+    ggg = treecorr.GGGCorrelation(min_sep=min_sep, max_sep=max_sep, nbins=nbins)
+    with assert_raises(NotImplementedError):
+        ggg.process_multipole(cat)
+
+
+@timer
+def test_shared_accum():
+    # With a small max_thread_memory, the threads all add to one shared copy of the results.
+    # This should give the same answer as separate copies for each thread.
+    ngal = 500
+    s = 10.
+    rng = np.random.RandomState(8675309)
+    x = rng.normal(0,s, (ngal,) )
+    y = rng.normal(0,s, (ngal,) )
+    w = rng.random_sample(ngal) + 0.5
+    kap = rng.normal(0,3, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y, w=w, k=kap)
+
+    kwargs = dict(min_sep=1., max_sep=20., nbins=10, nubins=5, nvbins=5, bin_slop=0.5)
+    kkk1 = treecorr.KKKCorrelation(**kwargs)
+    kkk1.process(cat, num_threads=4)
+    kkk2 = treecorr.KKKCorrelation(max_thread_memory=1.e-6, **kwargs)
+    kkk2.process(cat, num_threads=4)
+    np.testing.assert_allclose(kkk2.ntri, kkk1.ntri)
+    np.testing.assert_allclose(kkk2.weight, kkk1.weight, rtol=1.e-10)
+    np.testing.assert_allclose(kkk2.meand2, kkk1.meand2, rtol=1.e-10)
+    np.testing.assert_allclose(kkk2.meanu, kkk1.meanu, rtol=1.e-10)
+    np.testing.assert_allclose(kkk2.zeta, kkk1.zeta, rtol=1.e-10, atol=1.e-10)
+
+    # Again with the same object, to check that the shared copy is cleared between calls.
+    kkk2.process(cat, num_threads=4)
+    np.testing.assert_allclose(kkk2.ntri, kkk1.ntri)
+    np.testing.assert_allclose(kkk2.zeta, kkk1.zeta, rtol=1.e-10, atol=1.e-10)
+
+    # Also a cross correlation.
+    kkk1.process(cat, cat, cat, num_threads=4)
+    kkk2.process(cat, cat, cat, num_threads=4)
+    np.testing.assert_allclose(kkk2.ntri, kkk1.ntri)
+    np.testing.assert_allclose(kkk2.zeta, kkk1.zeta, rtol=1.e-10, atol=1.e-10)
+
+
 if __name__ == '__main__':
     test_direct()
     test_direct_spherical()
     test_constant()
     test_kkk()
+    test_multipole()
+    test_shared_accum()
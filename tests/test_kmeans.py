@@ -736,6 +736,65 @@ def test_init_kmpp():
     np.testing.assert_equal(sorted(p_n), list(range(n)))
 
 
+@timer
+def test_init_kmpar():
+    # Test the init=kmeans|| option
+
+    ngal = 100000
+    s = 1.
+    rng = np.random.RandomState(8675309)
+    x = rng.normal(0,s, (ngal,) )
+    y = rng.normal(0,s, (ngal,) )
+    z = rng.normal(0,s, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y, z=z)
+    xyz = np.array([x, y, z]).T
+
+    for npatch in [10, 200]:
+        print('3d with init=kmeans||, npatch = ',npatch)
+        field = cat.getNField(max_top=int.bit_length(npatch)-1)
+        cen1 = field.kmeans_initialize_centers(npatch, 'kmeans||')
+        assert cen1.shape == (npatch, 3)
+        assert len(np.unique(cen1, axis=0)) == npatch
+        p1 = field.kmeans_assign_patches(cen1)
+        assert len(p1) == cat.ntot
+        assert min(p1) == 0
+        assert max(p1) == npatch-1
+        inertia1 = np.array([np.sum((xyz[p1==i] - cen1[i])**2) for i in range(npatch)])
+        print('total inertia = ',np.sum(inertia1))
+
+        # Compare to the kmeans++ initialization.  It should be at least as good.
+        cen2 = field.kmeans_initialize_centers(npatch, 'kmeans++')
+        p2 = field.kmeans_assign_patches(cen2)
+        inertia2 = np.array([np.sum((xyz[p2==i] - cen2[i])**2) for i in range(npatch)])
+        print('kmeans++: total inertia = ',np.sum(inertia2))
+        assert np.sum(inertia1) < 1.1 * np.sum(inertia2)
+
+        # And the final result after refining.
+        p3, cen3 = field.run_kmeans(npatch, init='kmeans||')
+        inertia3 = np.array([np.sum((xyz[p3==i] - cen3[i])**2) for i in range(npatch)])
+        p4, cen4 = field.run_kmeans(npatch, init='kmeans++')
+        inertia4 = np.array([np.sum((xyz[p4==i] - cen4[i])**2) for i in range(npatch)])
+        print('total inertia => ',np.sum(inertia3), np.sum(inertia4))
+        assert np.sum(inertia3) < np.sum(inertia1)
+        assert np.sum(inertia3) < 1.05 * np.sum(inertia4)
+
+    # Check with the config option in a spherical catalog.
+    ra = rng.uniform(0, 1, (ngal,))
+    dec = rng.uniform(-0.5, 0.5, (ngal,))
+    cat = treecorr.Catalog(ra=ra, dec=dec, ra_units='rad', dec_units='rad', npatch=50,
+                           kmeans_init='kmeans||')
+    assert cat.patch_centers.shape == (50, 3)
+    np.testing.assert_allclose(np.sum(cat.patch_centers**2, axis=1), 1.)
+    assert min(cat.patch) == 0
+    assert max(cat.patch) == 49
+
+    # With npatch close to ngal, it falls back to kmeans++.
+    cat = treecorr.Catalog(x=x[:100], y=y[:100])
+    field = cat.getNField()
+    cen = field.kmeans_initialize_centers(90, 'kmeans||')
+    assert len(np.unique(cen, axis=0)) == 90
+
+
 @timer
 def test_zero_weight():
     # Based on test_ra_dec, but where many galaxies have w=0.
@@ -949,6 +1008,78 @@ def test_catalog_3d():
 
 
 
+@timer
+def test_kmeans_chunks():
+    # Test finding the patch centers from several chunks of a catalog at a time.
+
+    ngal = 100000
+    s = 1.
+    rng = np.random.RandomState(8675309)
+    x = rng.normal(0,s, (ngal,) )
+    y = rng.normal(0,s, (ngal,) )
+    w = rng.random_sample(ngal) + 1
+    xy = np.array([x, y]).T
+    npatch = 40
+    nchunk = 5
+
+    def get_inertia(cen):
+        p = treecorr.Catalog(x=x, y=y, w=w).getNField().kmeans_assign_patches(cen)
+        return np.array([np.sum(w[p==i][:,None] * (xy[p==i] - cen[i])**2)
+                         for i in range(npatch)])
+
+    cat = treecorr.Catalog(x=x, y=y, w=w)
+    p, cen1 = cat.getNField().run_kmeans(npatch)
+    inertia1 = get_inertia(cen1)
+    print('full: total inertia = ',np.sum(inertia1))
+
+    # The chunks are in a random order of the objects, so each one covers the whole field.
+    edges = np.linspace(0, ngal, nchunk+1).astype(int)
+    chunks = [treecorr.Catalog(x=x[i1:i2], y=y[i1:i2], w=w[i1:i2])
+              for i1,i2 in zip(edges[:-1], edges[1:])]
+    cen2 = treecorr.kmeans_chunks(chunks, npatch)
+    assert cen2.shape == (npatch, 2)
+    inertia2 = get_inertia(cen2)
+    print('chunks: total inertia = ',np.sum(inertia2))
+    print('rms inertia = ',np.std(inertia2))
+    assert np.sum(inertia2) < 1.02 * np.sum(inertia1)
+    assert np.std(inertia2) < 0.3 * np.mean(inertia2)
+
+    # A single pass is just the mini-batch step, which is already pretty good.
+    cen3 = treecorr.kmeans_chunks(chunks, npatch, max_iter=1)
+    inertia3 = get_inertia(cen3)
+    print('1 pass: total inertia = ',np.sum(inertia3))
+    assert np.sum(inertia3) < 1.1 * np.sum(inertia1)
+
+    # The alternate algorithm should give a lower rms inertia.
+    cen4 = treecorr.kmeans_chunks(chunks, npatch, alt=True)
+    inertia4 = get_inertia(cen4)
+    print('alt: total inertia = ',np.sum(inertia4))
+    print('rms inertia = ',np.std(inertia4))
+    assert np.sum(inertia4) < 1.05 * np.sum(inertia1)
+    assert np.std(inertia4) < np.std(inertia2)
+
+    # Check the spherical version, using chunks that are contiguous in ra.
+    ra = rng.uniform(0, 1, (ngal,))
+    dec = rng.uniform(-0.5, 0.5, (ngal,))
+    order = np.argsort(ra)
+    ra = ra[order]
+    dec = dec[order]
+    chunks = [treecorr.Catalog(ra=ra[i1:i2], dec=dec[i1:i2], ra_units='rad', dec_units='rad')
+              for i1,i2 in zip(edges[:-1], edges[1:])]
+    cen5 = treecorr.kmeans_chunks(chunks, npatch)
+    assert cen5.shape == (npatch, 3)
+    np.testing.assert_allclose(np.sum(cen5**2, axis=1), 1.)
+    cat = treecorr.Catalog(ra=ra, dec=dec, ra_units='rad', dec_units='rad')
+    field = cat.getNField()
+    xyz = np.array([cat.x, cat.y, cat.z]).T
+    p, cen6 = field.run_kmeans(npatch)
+    p5 = field.kmeans_assign_patches(cen5)
+    inertia5 = np.sum([np.sum((xyz[p5==i] - cen5[i])**2) for i in range(npatch)])
+    inertia6 = np.sum([np.sum((xyz[p==i] - cen6[i])**2) for i in range(npatch)])
+    print('sphere: total inertia = ',inertia5, inertia6)
+    assert inertia5 < 1.05 * inertia6
+
+
 if __name__ == '__main__':
     test_dessv()
     test_radec()
@@ -956,6 +1087,8 @@ if __name__ == '__main__':
     test_2d()
     test_init_random()
     test_init_kmpp()
+    test_init_kmpar()
     test_zero_weight()
     test_catalog_sphere()
     test_catalog_3d()
+    test_kmeans_chunks()
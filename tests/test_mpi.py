@@ -56,6 +56,24 @@ def test_mpi_kk():
     mock_mpiexec(4, do_mpi_kk)
     mock_mpiexec(1, do_mpi_kk)
 
+@unittest.skipIf(sys.version_info < (3, 0), "mock_mpiexec doesn't support python 2")
+@timer
+def test_mpi_cells():
+    mock_mpiexec(4, do_mpi_cells)
+    mock_mpiexec(1, do_mpi_cells)
+
+@unittest.skipIf(sys.version_info < (3, 0), "mock_mpiexec doesn't support python 2")
+@timer
+def test_mpi_queue():
+    mock_mpiexec(4, do_mpi_queue)
+    mock_mpiexec(2, do_mpi_queue)
+
+@unittest.skipIf(sys.version_info < (3, 0), "mock_mpiexec doesn't support python 2")
+@timer
+def test_mpi_kmeans():
+    mock_mpiexec(4, do_mpi_kmeans)
+    mock_mpiexec(1, do_mpi_kmeans)
+
 if __name__ == '__main__':
     setup()
     test_mpi_gg()
@@ -64,3 +82,6 @@ if __name__ == '__main__':
     test_mpi_nn()
     test_mpi_kg()
     test_mpi_kk()
+    test_mpi_cells()
+    test_mpi_queue()
+    test_mpi_kmeans()
@@ -1378,6 +1378,145 @@ def test_varxi():
 
 
 
+@timer
+def test_process_multi():
+    # Processing several correlations with a single tree walk should give the same answers
+    # as doing them one at a time.
+    ngal = 5000
+    s = 10.
+    rng = np.random.RandomState(8675309)
+    x1 = rng.normal(0,s, (ngal,) )
+    y1 = rng.normal(0,s, (ngal,) )
+    w1 = rng.random_sample(ngal)
+    k1 = rng.normal(0,0.2, (ngal,) )
+    g11 = rng.normal(0,0.2, (ngal,) )
+    g21 = rng.normal(0,0.2, (ngal,) )
+    x2 = rng.normal(0,s, (ngal,) )
+    y2 = rng.normal(0,s, (ngal,) )
+    w2 = rng.random_sample(ngal)
+    k2 = rng.normal(0,0.2, (ngal,) )
+    g12 = rng.normal(0,0.2, (ngal,) )
+    g22 = rng.normal(0,0.2, (ngal,) )
+    cat1 = treecorr.Catalog(x=x1, y=y1, w=w1, k=k1, g1=g11, g2=g21)
+    cat2 = treecorr.Catalog(x=x2, y=y2, w=w2, k=k2, g1=g12, g2=g22)
+
+    config = dict(min_sep=1., max_sep=30., nbins=15, bin_slop=0.5)
+
+    # Auto-correlations
+    nn = treecorr.NNCorrelation(config)
+    kk = treecorr.KKCorrelation(config)
+    gg = treecorr.GGCorrelation(config)
+    treecorr.process_multi([nn, kk, gg], cat1)
+    nn1 = treecorr.NNCorrelation(config)
+    kk1 = treecorr.KKCorrelation(config)
+    gg1 = treecorr.GGCorrelation(config)
+    nn1.process_auto(cat1)
+    kk1.process_auto(cat1)
+    gg1.process_auto(cat1)
+    np.testing.assert_allclose(nn.npairs, nn1.npairs)
+    np.testing.assert_allclose(nn.weight, nn1.weight)
+    np.testing.assert_allclose(nn.meanr, nn1.meanr)
+    np.testing.assert_allclose(kk.xi, kk1.xi)
+    np.testing.assert_allclose(gg.xip, gg1.xip)
+    np.testing.assert_allclose(gg.xim, gg1.xim)
+    np.testing.assert_allclose(gg.xim_im, gg1.xim_im)
+
+    # Cross-correlations
+    corrs = [treecorr.NNCorrelation(config), treecorr.NKCorrelation(config),
+             treecorr.NGCorrelation(config), treecorr.KKCorrelation(config),
+             treecorr.KGCorrelation(config), treecorr.GGCorrelation(config)]
+    treecorr.process_multi(corrs, cat1, cat2)
+    for c in corrs:
+        c1 = c.copy()
+        c1.clear()
+        c1.process_cross(cat1, cat2)
+        np.testing.assert_allclose(c.npairs, c1.npairs)
+        np.testing.assert_allclose(c.weight, c1.weight)
+        np.testing.assert_allclose(c.meanlogr, c1.meanlogr)
+        if hasattr(c, 'xi'):
+            np.testing.assert_allclose(c.xi, c1.xi, atol=1.e-12)
+        if hasattr(c, 'xi_im'):
+            np.testing.assert_allclose(c.xi_im, c1.xi_im, atol=1.e-12)
+        if hasattr(c, 'xip'):
+            np.testing.assert_allclose(c.xip, c1.xip, atol=1.e-12)
+            np.testing.assert_allclose(c.xim, c1.xim, atol=1.e-12)
+
+    # Invalid inputs
+    with assert_raises(ValueError):
+        treecorr.process_multi([treecorr.NGCorrelation(config)], cat1)
+    with assert_raises(ValueError):
+        treecorr.process_multi([nn, nn1], cat1)
+    with assert_raises(ValueError):
+        treecorr.process_multi([nn, treecorr.GGCorrelation(config, nbins=20)], cat1)
+    with assert_raises(ValueError):
+        treecorr.process_multi([], cat1)
+    # They all need to use the same metric.
+    cat3d = treecorr.Catalog(x=x1, y=y1, z=x2+100., w=w1, k=k1)
+    with assert_raises(ValueError):
+        treecorr.process_multi([treecorr.NNCorrelation(config),
+                                treecorr.KKCorrelation(config, metric='Rperp')], cat3d)
+
+
+@timer
+def test_process_multi_partner():
+    # Processing several lens samples against one source catalog (or the other way around)
+    # with a single walk of the shared tree should give the same answers as doing them one
+    # at a time with process_cross.
+    ngal = 2000
+    nlens = 500
+    s = 10.
+    rng = np.random.RandomState(8675309)
+    x2 = rng.normal(0,s, (ngal,) )
+    y2 = rng.normal(0,s, (ngal,) )
+    w2 = rng.random_sample(ngal)
+    g1 = rng.normal(0,0.2, (ngal,) )
+    g2 = rng.normal(0,0.2, (ngal,) )
+    source_cat = treecorr.Catalog(x=x2, y=y2, w=w2, g1=g1, g2=g2)
+    lens_cats = []
+    for i in range(4):
+        x1 = rng.normal(0,s, (nlens,) )
+        y1 = rng.normal(0,s, (nlens,) )
+        w1 = rng.random_sample(nlens)
+        lens_cats.append(treecorr.Catalog(x=x1, y=y1, w=w1))
+
+    for bin_slop in [0, 0.5]:
+        config = dict(min_sep=1., max_sep=20., nbins=10, bin_slop=bin_slop)
+        ngs = [ treecorr.NGCorrelation(config) for cat in lens_cats ]
+        treecorr.process_multi_partner(ngs, lens_cats, source_cat)
+        for ng, cat in zip(ngs, lens_cats):
+            ng1 = treecorr.NGCorrelation(config)
+            ng1.process_cross(cat, source_cat)
+            np.testing.assert_allclose(ng.npairs, ng1.npairs)
+            np.testing.assert_allclose(ng.weight, ng1.weight)
+            np.testing.assert_allclose(ng.meanr, ng1.meanr)
+            np.testing.assert_allclose(ng.xi, ng1.xi, atol=1.e-12)
+            np.testing.assert_allclose(ng.xi_im, ng1.xi_im, atol=1.e-12)
+
+        # One lens sample with several source samples, which share side 1 instead.
+        sources = [source_cat, lens_cats[0], lens_cats[1]]
+        nns = [ treecorr.NNCorrelation(config) for cat in sources ]
+        treecorr.process_multi_partner(nns, lens_cats[2], sources)
+        for nn, cat in zip(nns, sources):
+            nn1 = treecorr.NNCorrelation(config)
+            nn1.process_cross(lens_cats[2], cat)
+            np.testing.assert_allclose(nn.npairs, nn1.npairs)
+            np.testing.assert_allclose(nn.weight, nn1.weight)
+            np.testing.assert_allclose(nn.meanr, nn1.meanr)
+
+    # Invalid inputs
+    with assert_raises(ValueError):
+        treecorr.process_multi_partner([], lens_cats, source_cat)
+    with assert_raises(ValueError):
+        treecorr.process_multi_partner(ngs, lens_cats[0], source_cat)
+    with assert_raises(ValueError):
+        treecorr.process_multi_partner(ngs, lens_cats, [source_cat])
+    with assert_raises(ValueError):
+        treecorr.process_multi_partner(ngs[:2], lens_cats, source_cat)
+    with assert_raises(ValueError):
+        treecorr.process_multi_partner([ngs[0], treecorr.NGCorrelation(config, bin_type='Linear')],
+                                       lens_cats[:2], source_cat)
+
+
 if __name__ == '__main__':
     test_direct()
     test_direct_spherical()
@@ -1390,3 +1529,5 @@ if __name__ == '__main__':
     test_pieces()
     test_haloellip()
     test_varxi()
+    test_process_multi()
+    test_process_multi_partner()
@@ -18,6 +18,7 @@ import os
 import coord
 import time
 import shutil
+import json
 import sys
 
 from test_helper import get_from_wiki, get_script_name, do_pickle, CaptureLog
@@ -533,6 +534,30 @@ def test_direct_count():
     dd.process(cat1, cat2)
     np.testing.assert_array_equal(dd.npairs, true_npairs)
 
+    # And processing small cells leaf by leaf
+    dd = treecorr.NNCorrelation(min_sep=min_sep, max_sep=max_sep, nbins=nbins, bin_slop=0,
+                                leaf_size=32)
+    dd.process(cat1, cat2)
+    np.testing.assert_array_equal(dd.npairs, true_npairs)
+    dd = treecorr.NNCorrelation(min_sep=min_sep, max_sep=max_sep, nbins=nbins, bin_slop=0,
+                                max_top=0, leaf_size=1000)
+    dd.process(cat1, cat2)
+    np.testing.assert_array_equal(dd.npairs, true_npairs)
+    with assert_raises(ValueError):
+        treecorr.NNCorrelation(min_sep=min_sep, max_sep=max_sep, nbins=nbins, leaf_size=-1)
+
+    # And building the fields lazily
+    dd = treecorr.NNCorrelation(min_sep=min_sep, max_sep=max_sep, nbins=nbins, bin_slop=0,
+                                lazy_build=True)
+    dd.process(cat1, cat2)
+    np.testing.assert_array_equal(dd.npairs, true_npairs)
+
+    # And presorting the objects before building the fields
+    dd = treecorr.NNCorrelation(min_sep=min_sep, max_sep=max_sep, nbins=nbins, bin_slop=0,
+                                presort=True)
+    dd.process(cat1, cat2)
+    np.testing.assert_array_equal(dd.npairs, true_npairs)
+
     # Invalid to omit file_name
     config['verbose'] = 0
     del config['file_name']
@@ -2008,6 +2033,378 @@ def test_linear_binslop():
             np.testing.assert_allclose(dd1.npairs, dd0.npairs, rtol=bin_slop)
 
 
+@timer
+def test_cache():
+    # With cache_dir, the results of each process call are saved, and an identical calculation
+    # reads them back rather than recomputing them.
+    ngal = 5000
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0,100, (ngal,) )
+    y = rng.uniform(0,100, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y, npatch=4, rng=rng)
+    cache_dir = os.path.join('output', 'nn_cache')
+    if os.path.exists(cache_dir):
+        shutil.rmtree(cache_dir)
+
+    rr0 = treecorr.NNCorrelation(min_sep=1., max_sep=20., nbins=10)
+    rr0.process(cat)
+    rr1 = treecorr.NNCorrelation(min_sep=1., max_sep=20., nbins=10, cache_dir=cache_dir)
+    rr1.process(cat)
+    np.testing.assert_allclose(rr1.npairs, rr0.npairs)
+    np.testing.assert_allclose(rr1.meanr, rr0.meanr)
+    cache_files = os.listdir(cache_dir)
+    print('cache_files = ',cache_files)
+    assert len(cache_files) == 1
+
+    # The second time, the results come from the cache, including the patch results.
+    rr2 = treecorr.NNCorrelation(min_sep=1., max_sep=20., nbins=10, cache_dir=cache_dir,
+                                 verbose=2)
+    with CaptureLog() as cl:
+        rr2.logger = cl.logger
+        rr2.process(cat)
+    assert 'Using cached results' in cl.output
+    assert rr2 == rr1
+    assert sorted(rr2.results.keys()) == sorted(rr1.results.keys())
+    for key in rr1.results:
+        np.testing.assert_array_equal(rr2.results[key].weight, rr1.results[key].weight)
+        assert rr2.results[key].tot == rr1.results[key].tot
+    assert len(os.listdir(cache_dir)) == 1
+
+    # Different binning, catalogs or metric are calculated separately.
+    rr3 = treecorr.NNCorrelation(min_sep=1., max_sep=20., nbins=12, cache_dir=cache_dir)
+    rr3.process(cat)
+    assert len(os.listdir(cache_dir)) == 2
+    cat2 = treecorr.Catalog(x=x, y=y+1.e-3, patch_centers=cat.patch_centers)
+    rr4 = treecorr.NNCorrelation(min_sep=1., max_sep=20., nbins=10, cache_dir=cache_dir)
+    rr4.process(cat2)
+    assert len(os.listdir(cache_dir)) == 3
+    assert rr4 != rr0
+    rr5 = treecorr.NNCorrelation(min_sep=1., max_sep=20., nbins=10, cache_dir=cache_dir)
+    rr5.process(cat, cat2)
+    assert len(os.listdir(cache_dir)) == 4
+    rr6 = treecorr.NNCorrelation(min_sep=1., max_sep=20., nbins=10, cache_dir=cache_dir)
+    rr6.process(cat, cat2)
+    assert rr6 == rr5
+
+    # Parameters that don't affect the results, like num_threads, don't change the key.
+    rr7 = treecorr.NNCorrelation(min_sep=1., max_sep=20., nbins=10, cache_dir=cache_dir,
+                                 num_threads=1)
+    rr7.process(cat)
+    assert rr7 == rr1
+    assert len(os.listdir(cache_dir)) == 4
+
+    # A bad cache file is ignored with a warning.
+    for name in os.listdir(cache_dir):
+        with open(os.path.join(cache_dir, name), 'w') as fid:
+            fid.write('not a pickle')
+    rr8 = treecorr.NNCorrelation(min_sep=1., max_sep=20., nbins=10, cache_dir=cache_dir)
+    with CaptureLog() as cl:
+        rr8.logger = cl.logger
+        rr8.process(cat)
+    assert 'Ignoring cache file' in cl.output
+    np.testing.assert_allclose(rr8.npairs, rr0.npairs)
+    np.testing.assert_allclose(rr8.meanr, rr0.meanr)
+
+
+@timer
+def test_spill():
+    # Test storing the cells in a memory mapped spill file.
+    ngal = 20000
+    s = 10.
+    rng = np.random.RandomState(8675309)
+    x1 = rng.normal(0,s, (ngal,) )
+    y1 = rng.normal(0,s, (ngal,) )
+    x2 = rng.normal(0,s, (ngal,) )
+    y2 = rng.normal(0,s, (ngal,) )
+    cat1 = treecorr.Catalog(x=x1, y=y1)
+    cat2 = treecorr.Catalog(x=x2, y=y2)
+    spill_dir = 'output'
+
+    kwargs = dict(min_sep=1., max_sep=30., nbins=10, bin_slop=0.5)
+    dd1 = treecorr.NNCorrelation(**kwargs)
+    dd1.process(cat1)
+    dd2 = treecorr.NNCorrelation(spill_dir=spill_dir, **kwargs)
+    dd2.process(cat1)
+    np.testing.assert_array_equal(dd2.npairs, dd1.npairs)
+    np.testing.assert_allclose(dd2.meanr, dd1.meanr, rtol=1.e-12)
+
+    dd1.process(cat1, cat2)
+    dd2.process(cat1, cat2)
+    np.testing.assert_array_equal(dd2.npairs, dd1.npairs)
+    np.testing.assert_allclose(dd2.meanr, dd1.meanr, rtol=1.e-12)
+
+    # Also with share_leaves and presort, which use the spill file for the leaves and the
+    # input objects.
+    field1 = treecorr.NField(cat1, min_size=0.1, max_size=30.)
+    field2 = treecorr.NField(cat1, min_size=0.1, max_size=30., share_leaves=True, presort=True,
+                             spill_dir=spill_dir)
+    assert field2.spill_dir == spill_dir
+    assert field2.nTopLevelNodes == field1.nTopLevelNodes
+    np.testing.assert_array_equal(np.sort(field2.get_near(x=0, y=0, sep=5.)),
+                                  np.sort(field1.get_near(x=0, y=0, sep=5.)))
+
+    # A field built from the tree of a spilled field also uses the spill dir.
+    cat3 = treecorr.Catalog(x=x1, y=y1, k=x1)
+    nfield = cat3.getNField(min_size=0.1, max_size=30., spill_dir=spill_dir)
+    kfield = cat3.getKField(min_size=0.1, max_size=30., spill_dir=spill_dir)
+    assert kfield.spill_dir == spill_dir
+    with assert_raises(ValueError):
+        treecorr.KField(cat3, min_size=0.1, max_size=30., tree=nfield)
+
+    # If the spill file can't be made, it raises an OSError.
+    with assert_raises(OSError):
+        treecorr.NField(cat1, spill_dir='invalid_dir')
+
+
+@timer
+def test_autotune():
+    # Test choosing the split_method, min_top and split_factor with autotune.
+    ngal = 20000
+    s = 10.
+    rng = np.random.RandomState(8675309)
+    x1 = rng.normal(0,s, (ngal,) )
+    y1 = rng.normal(0,s, (ngal,) )
+    x2 = rng.normal(0,s, (ngal,) )
+    y2 = rng.normal(0,s, (ngal,) )
+    cat1 = treecorr.Catalog(x=x1, y=y1)
+    cat2 = treecorr.Catalog(x=x2, y=y2)
+    autotune_file = os.path.join('output', 'autotune.json')
+    if os.path.exists(autotune_file):
+        os.remove(autotune_file)
+
+    # With bin_slop=0, the choices don't change the results.
+    kwargs = dict(min_sep=1., max_sep=30., nbins=10, bin_slop=0)
+    dd1 = treecorr.NNCorrelation(**kwargs)
+    dd1.process(cat1)
+    dd2 = treecorr.NNCorrelation(autotune=True, autotune_time=0.02, autotune_file=autotune_file,
+                                 **kwargs)
+    t0 = time.time()
+    dd2.process(cat1)
+    t1 = time.time()
+    np.testing.assert_array_equal(dd2.npairs, dd1.npairs)
+    np.testing.assert_allclose(dd2.meanr, dd1.meanr, rtol=1.e-12)
+    print('autotune chose ',dd2.split_method, dd2.min_top, dd2.split_factor)
+    assert dd2.split_method in ['mean', 'median', 'middle']
+    assert dd2.split_factor in [0.4, 0.5, 0.585, 0.7, 0.85]
+
+    with open(autotune_file) as f:
+        saved = json.load(f)
+    assert len(saved) == 1
+    key = list(saved.keys())[0]
+    assert 'NNCorrelation' in key and 'auto' in key
+    assert saved[key] == dict(split_method=dd2.split_method, min_top=dd2.min_top,
+                              split_factor=dd2.split_factor)
+
+    # The second time, it uses the saved choices, which is faster.
+    dd3 = treecorr.NNCorrelation(autotune=True, autotune_time=0.02, autotune_file=autotune_file,
+                                 **kwargs)
+    t2 = time.time()
+    dd3.process(cat1)
+    t3 = time.time()
+    print('times = ',t1-t0,t3-t2)
+    np.testing.assert_array_equal(dd3.npairs, dd1.npairs)
+    assert (dd3.split_method, dd3.min_top, dd3.split_factor) == (
+            dd2.split_method, dd2.min_top, dd2.split_factor)
+    assert t3-t2 < t1-t0
+
+    # A cross correlation is a different entry.
+    dd3.process(cat1, cat2)
+    with open(autotune_file) as f:
+        saved = json.load(f)
+    assert len(saved) == 2
+    dd1.process(cat1, cat2)
+    np.testing.assert_array_equal(dd3.npairs, dd1.npairs)
+
+    # split_factor can also be set by hand.  With bin_slop > 0, it changes which pairs are
+    # split, but the results should still be close.
+    kwargs['bin_slop'] = 1
+    dd4 = treecorr.NNCorrelation(**kwargs)
+    dd4.process(cat1)
+    dd5 = treecorr.NNCorrelation(split_factor=0.3, **kwargs)
+    dd5.process(cat1)
+    np.testing.assert_allclose(dd5.npairs, dd4.npairs, rtol=1.e-2)
+
+    with assert_raises(ValueError):
+        treecorr.NNCorrelation(split_factor=0, **kwargs)
+    with assert_raises(ValueError):
+        treecorr.NNCorrelation(autotune_time=-1, **kwargs)
+
+
+@timer
+def test_unit_weights():
+    # Catalogs without weights use the counts for the pair weights.  Check that this gives the
+    # same answer as giving all the weights as 1, and that switching to a weighted catalog with
+    # the same object works.
+    ngal = 5000
+    s = 10.
+    rng = np.random.RandomState(8675309)
+    x1 = rng.normal(0,s, (ngal,) )
+    y1 = rng.normal(0,s, (ngal,) )
+    x2 = rng.normal(0,s, (ngal,) )
+    y2 = rng.normal(0,s, (ngal,) )
+    w2 = rng.uniform(0.5,1.5, (ngal,) )
+    cat1 = treecorr.Catalog(x=x1, y=y1)
+    cat2 = treecorr.Catalog(x=x2, y=y2)
+    cat1w = treecorr.Catalog(x=x1, y=y1, w=np.ones(ngal))
+    cat2w = treecorr.Catalog(x=x2, y=y2, w=np.ones(ngal))
+    cat2r = treecorr.Catalog(x=x2, y=y2, w=w2)
+    assert not cat1.nontrivial_w
+    assert cat1w.nontrivial_w
+
+    config = dict(min_sep=1., max_sep=25., nbins=10, bin_slop=0.5)
+    dd1 = treecorr.NNCorrelation(config)
+    dd1.process(cat1, cat2)
+    dd2 = treecorr.NNCorrelation(config)
+    dd2.process(cat1w, cat2w)
+    np.testing.assert_array_equal(dd1.npairs, dd2.npairs)
+    np.testing.assert_allclose(dd1.weight, dd2.weight, rtol=1.e-12)
+    np.testing.assert_allclose(dd1.weight, dd1.npairs, rtol=1.e-12)
+    np.testing.assert_allclose(dd1.meanr, dd2.meanr, rtol=1.e-12)
+    np.testing.assert_allclose(dd1.meanlogr, dd2.meanlogr, rtol=1.e-12)
+
+    dd1.process(cat1)
+    dd2.process(cat1w)
+    np.testing.assert_array_equal(dd1.npairs, dd2.npairs)
+    np.testing.assert_allclose(dd1.weight, dd2.weight, rtol=1.e-12)
+    np.testing.assert_allclose(dd1.meanr, dd2.meanr, rtol=1.e-12)
+
+    # The same correlation object with a weighted catalog needs to use the weights again.
+    dd1.process(cat1, cat2r)
+    dd3 = treecorr.NNCorrelation(config)
+    dd3.process(cat1w, cat2r)
+    np.testing.assert_array_equal(dd1.npairs, dd3.npairs)
+    np.testing.assert_allclose(dd1.weight, dd3.weight, rtol=1.e-12)
+    np.testing.assert_allclose(dd1.meanr, dd3.meanr, rtol=1.e-12)
+    assert np.all(dd1.weight != dd1.npairs)
+
+    # Also with patches.
+    cat1p = treecorr.Catalog(x=x1, y=y1, npatch=4, rng=rng)
+    cat2p = treecorr.Catalog(x=x2, y=y2, patch_centers=cat1p.patch_centers)
+    cat2pw = treecorr.Catalog(x=x2, y=y2, w=np.ones(ngal), patch_centers=cat1p.patch_centers)
+    dd1 = treecorr.NNCorrelation(config)
+    dd1.process(cat1p, cat2p)
+    dd2 = treecorr.NNCorrelation(config)
+    dd2.process(cat1p, cat2pw)
+    np.testing.assert_array_equal(dd1.npairs, dd2.npairs)
+    np.testing.assert_allclose(dd1.weight, dd2.weight, rtol=1.e-12)
+    np.testing.assert_allclose(dd1.meanr, dd2.meanr, rtol=1.e-12)
+
+
+@timer
+def test_dilute():
+    # Test using a subsample of the randoms for the bins above dilute_min_sep.
+    ngal = 2000
+    nrand = 20000
+    s = 10.
+    rng = np.random.RandomState(8675309)
+    x = rng.normal(0,s, (ngal,) )
+    y = rng.normal(0,s, (ngal,) )
+    rx = rng.uniform(-4*s,4*s, (nrand,) )
+    ry = rng.uniform(-4*s,4*s, (nrand,) )
+    cat = treecorr.Catalog(x=x, y=y)
+    rand = treecorr.Catalog(x=rx, y=ry)
+
+    config = dict(min_sep=1., max_sep=30., nbins=15, bin_slop=0)
+    rr0 = treecorr.NNCorrelation(config)
+    rr0.process(rand)
+    dr0 = treecorr.NNCorrelation(config)
+    dr0.process(cat, rand)
+    k0 = np.searchsorted(rr0.left_edges, 5.)
+    print('k0 = ',k0)
+
+    # With dilute_frac = 1, the subsample is the whole catalog, so this just splits up
+    # the bins between two calls.
+    rr1 = treecorr.NNCorrelation(config, dilute_min_sep=5., dilute_frac=1.)
+    rr1.process(rand)
+    np.testing.assert_array_equal(rr1.npairs, rr0.npairs)
+    np.testing.assert_allclose(rr1.weight, rr0.weight, rtol=1.e-10)
+    np.testing.assert_allclose(rr1.meanr, rr0.meanr, rtol=1.e-10)
+    np.testing.assert_allclose(rr1.meanlogr, rr0.meanlogr, rtol=1.e-10)
+
+    # With a real subsample, the small scale bins are the same, and the large scale ones
+    # have the same weight on average.
+    rr2 = treecorr.NNCorrelation(config, dilute_min_sep=5., dilute_frac=0.2)
+    rr2.process(rand)
+    print('rr0.weight = ',rr0.weight)
+    print('rr2.weight = ',rr2.weight)
+    np.testing.assert_array_equal(rr2.npairs[:k0], rr0.npairs[:k0])
+    np.testing.assert_allclose(rr2.weight[:k0], rr0.weight[:k0], rtol=1.e-10)
+    np.testing.assert_allclose(rr2.weight[k0:], rr0.weight[k0:], rtol=0.05)
+    np.testing.assert_array_less(rr2.npairs[k0:], rr0.npairs[k0:])
+    np.testing.assert_allclose(rr2.meanr, rr0.meanr, rtol=1.e-2)
+    assert rr2.tot == rr0.tot
+
+    # Only diluting the randoms for the cross-correlation with the data.
+    dr2 = treecorr.NNCorrelation(config, dilute_min_sep=5., dilute_frac=0.2, dilute_cat=2)
+    dr2.process(cat, rand)
+    print('dr0.weight = ',dr0.weight)
+    print('dr2.weight = ',dr2.weight)
+    np.testing.assert_allclose(dr2.weight[:k0], dr0.weight[:k0], rtol=1.e-10)
+    np.testing.assert_allclose(dr2.weight[k0:], dr0.weight[k0:], rtol=0.05)
+
+    # Diluting both catalogs of a cross-correlation uses independent subsamples, even if they
+    # have the same length.  Here object i of srand2 is 10 away from object i of srand, which
+    # is about a fifth of the pairs in that bin.  If the same indices were kept in both, the
+    # weight of those pairs would be too large by a factor of 1/dilute_frac.
+    sx = rng.uniform(-40*s,40*s, (nrand,) )
+    sy = rng.uniform(-40*s,40*s, (nrand,) )
+    srand = treecorr.Catalog(x=sx, y=sy)
+    srand2 = treecorr.Catalog(x=sx+10., y=sy)
+    rr5 = treecorr.NNCorrelation(config)
+    rr5.process(srand, srand2)
+    rr6 = treecorr.NNCorrelation(config, dilute_min_sep=5., dilute_frac=0.2, dilute_cat=0)
+    rr6.process(srand, srand2)
+    k10 = np.searchsorted(rr5.left_edges, 10.) - 1
+    print('rr5.weight = ',rr5.weight)
+    print('rr6.weight = ',rr6.weight)
+    np.testing.assert_allclose(rr6.weight[k10], rr5.weight[k10], rtol=0.1)
+    np.testing.assert_allclose(np.sum(rr6.weight[k0:]), np.sum(rr5.weight[k0:]), rtol=0.05)
+
+    # With patches, the subsample of each patch is made once and reused for all its pairs.
+    prand = treecorr.Catalog(x=rx, y=ry, npatch=4)
+    rr7 = treecorr.NNCorrelation(config)
+    rr7.process(prand)
+    rr8 = treecorr.NNCorrelation(config, dilute_min_sep=5., dilute_frac=0.2)
+    rr8.process(prand)
+    np.testing.assert_allclose(rr8.weight[k0:], rr7.weight[k0:], rtol=0.05)
+    subs = [dict(p._diluted) for p in prand.patches]
+    assert all(1 <= len(d) <= 2 for d in subs)  # As cat1 and/or cat2.
+    rr9 = treecorr.NNCorrelation(config, dilute_min_sep=5., dilute_frac=0.2)
+    rr9.process(prand)
+    np.testing.assert_array_equal(rr9.npairs, rr8.npairs)
+    for p, d in zip(prand.patches, subs):
+        assert all(p._diluted[key] is d[key] for key in d)
+        p.clear_cache()
+        assert len(p._diluted) == 0
+
+    # The same seed gives the same subsample.
+    rr3 = treecorr.NNCorrelation(config, dilute_min_sep=5., dilute_frac=0.2)
+    rr3.process(rand)
+    np.testing.assert_array_equal(rr3.npairs, rr2.npairs)
+    rr4 = treecorr.NNCorrelation(config, dilute_min_sep=5., dilute_frac=0.2, dilute_seed=1234)
+    rr4.process(rand)
+    assert not np.array_equal(rr4.npairs, rr2.npairs)
+
+    # Also works for other correlations.
+    kcat = treecorr.Catalog(x=rx, y=ry, k=np.sin(rx/s) + np.cos(ry/s))
+    kk0 = treecorr.KKCorrelation(config)
+    kk0.process(kcat)
+    kk1 = treecorr.KKCorrelation(config, dilute_min_sep=5., dilute_frac=1.)
+    kk1.process(kcat)
+    np.testing.assert_allclose(kk1.xi, kk0.xi, rtol=1.e-10)
+
+    with assert_raises(ValueError):
+        treecorr.NNCorrelation(config, dilute_min_sep=5., dilute_frac=0.)
+    with assert_raises(ValueError):
+        treecorr.NNCorrelation(config, dilute_min_sep=5., dilute_frac=1.5)
+    with assert_raises(ValueError):
+        treecorr.NNCorrelation(config, dilute_min_sep=0.5)
+    with assert_raises(ValueError):
+        treecorr.NNCorrelation(config, dilute_min_sep=5., grid_min_sep=5.)
+    with assert_raises(ValueError):
+        treecorr.NNCorrelation(config, dilute_min_sep=5., dilute_cat=3)
+
+
 if __name__ == '__main__':
     test_log_binning()
     test_linear_binning()
@@ -2025,3 +2422,8 @@ if __name__ == '__main__':
     test_varxi()
     test_sph_linear()
     test_linear_binslop()
+    test_cache()
+    test_spill()
+    test_autotune()
+    test_unit_weights()
+    test_dilute()
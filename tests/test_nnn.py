@@ -2285,6 +2285,35 @@ def test_list():
     np.testing.assert_allclose(corr3_output['zeta'], zeta.flatten(), rtol=1.e-3)
 
 
+@timer
+def test_narrow_uv():
+    # With a narrow range of u and v, most triples of cells are rejected early based on the
+    # allowed ranges of the side lengths.  Make sure this doesn't lose any triangles.
+    ngal = 200
+    s = 10.
+    rng = np.random.RandomState(8675309)
+    x = rng.normal(0,s, (ngal,) )
+    y = rng.normal(0,s, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y)
+
+    for min_u, max_u, min_v, max_v in [ (0.9, 1., 0., 0.1),
+                                        (0.5, 0.6, 0.3, 0.4),
+                                        (0.1, 0.2, 0.8, 1.) ]:
+        kwargs = dict(min_sep=1., max_sep=20., nbins=5,
+                      min_u=min_u, max_u=max_u, nubins=2,
+                      min_v=min_v, max_v=max_v, nvbins=2)
+        ddd = treecorr.NNNCorrelation(brute=True, **kwargs)
+        ddd.process(cat)
+        ddd0 = treecorr.NNNCorrelation(bin_slop=0, **kwargs)
+        ddd0.process(cat)
+        print(min_u, max_u, min_v, max_v, np.sum(ddd.ntri), np.sum(ddd0.ntri))
+        assert np.sum(ddd.ntri) > 0
+        np.testing.assert_array_equal(ddd0.ntri, ddd.ntri)
+
+        ddd0.process(cat, cat, cat)
+        np.testing.assert_array_equal(ddd0.ntri, ddd.ntri)
+
+
 if __name__ == '__main__':
     test_log_binning()
     test_direct_count_auto()
@@ -2297,3 +2326,4 @@ if __name__ == '__main__':
     test_nnn()
     test_3d()
     test_list()
+    test_narrow_uv()
@@ -2409,6 +2409,535 @@ def test_lowmem():
     np.testing.assert_allclose(kg1.xi, kg2.xi)
     np.testing.assert_allclose(kg1.weight, kg2.weight)
 
+@timer
+def test_checkpoint():
+    # With the checkpoint option, an interrupted patch-based calculation resumes where it
+    # left off, rather than starting over.
+    ngal = 10000
+    npatch = 8
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0,100, (ngal,) )
+    y = rng.uniform(0,100, (ngal,) )
+    k = rng.normal(0.3,0.1, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y, k=k, npatch=npatch)
+    patches = cat.get_patches()
+
+    kk1 = treecorr.KKCorrelation(bin_size=0.3, min_sep=1., max_sep=20.)
+    kk1.process(patches)
+
+    # Make one of the patches fail part way through.
+    class FailCatalog(treecorr.Catalog):
+        def getKField(self, *args, **kwargs):
+            raise RuntimeError("Simulated interruption")
+        def getNField(self, *args, **kwargs):
+            raise RuntimeError("Simulated interruption")
+
+    file_name = os.path.join('output','kk_checkpoint.pkl')
+    if os.path.exists(file_name):
+        os.remove(file_name)
+    config = dict(bin_size=0.3, min_sep=1., max_sep=20., checkpoint=file_name,
+                  checkpoint_time=0.)
+    kk2 = treecorr.KKCorrelation(config)
+    patches[npatch//2].__class__ = FailCatalog
+    with assert_raises(RuntimeError):
+        kk2.process(patches)
+    patches[npatch//2].__class__ = treecorr.Catalog
+    assert os.path.exists(file_name)
+    assert not os.path.exists(file_name + '.cells')
+
+    kk3 = treecorr.KKCorrelation(config)
+    kk3.process(patches)
+    print('kk1.xi = ',kk1.xi)
+    print('kk3.xi = ',kk3.xi)
+    np.testing.assert_allclose(kk3.npairs, kk1.npairs)
+    np.testing.assert_allclose(kk3.weight, kk1.weight)
+    np.testing.assert_allclose(kk3.xi, kk1.xi)
+    assert set(kk3.results.keys()) == set(kk1.results.keys())
+    np.testing.assert_allclose(kk3.estimate_cov('jackknife'), kk1.estimate_cov('jackknife'))
+    # Once finished, the checkpoint file is removed.
+    assert not os.path.exists(file_name)
+
+    # A checkpoint for some other calculation is ignored.
+    with open(file_name, 'wb') as fid:
+        import pickle
+        pickle.dump((set([(0,0)]), treecorr.NNCorrelation(config), 'Euclidean'), fid)
+    kk4 = treecorr.KKCorrelation(config)
+    kk4.process(patches)
+    np.testing.assert_allclose(kk4.xi, kk1.xi)
+    assert not os.path.exists(file_name)
+
+    # So is one from the same catalogs with a different metric.
+    z = rng.uniform(0,100, (ngal,) )
+    patches3d = treecorr.Catalog(x=x, y=y, z=z, k=k, npatch=npatch).get_patches()
+    kkp1 = treecorr.KKCorrelation(bin_size=0.3, min_sep=1., max_sep=20.)
+    kkp1.process(patches3d, metric='Rperp')
+    kkp2 = treecorr.KKCorrelation(config)
+    patches3d[npatch//2].__class__ = FailCatalog
+    with assert_raises(RuntimeError):
+        kkp2.process(patches3d, metric='Euclidean')
+    patches3d[npatch//2].__class__ = treecorr.Catalog
+    assert os.path.exists(file_name)
+    kkp3 = treecorr.KKCorrelation(config)
+    kkp3.process(patches3d, metric='Rperp')
+    np.testing.assert_allclose(kkp3.npairs, kkp1.npairs)
+    np.testing.assert_allclose(kkp3.xi, kkp1.xi)
+    assert not os.path.exists(file_name)
+
+    # NN needs the tot values of all the pairs, including ones in the checkpoint.
+    nn1 = treecorr.NNCorrelation(bin_size=0.3, min_sep=1., max_sep=20.)
+    nn1.process(patches)
+    nn2 = treecorr.NNCorrelation(config)
+    patches[npatch//2].__class__ = FailCatalog
+    with assert_raises(RuntimeError):
+        nn2.process(patches)
+    patches[npatch//2].__class__ = treecorr.Catalog
+    assert os.path.exists(file_name)
+    nn3 = treecorr.NNCorrelation(config)
+    nn3.process(patches)
+    np.testing.assert_allclose(nn3.npairs, nn1.npairs)
+    np.testing.assert_allclose(nn3.tot, nn1.tot)
+    assert set(nn3.results.keys()) == set(nn1.results.keys())
+    assert not os.path.exists(file_name)
+
+    # The three-point classes also accept the checkpoint option.  Without an interruption,
+    # the results are the same.
+    cat3 = treecorr.Catalog(x=x[:500], y=y[:500], k=k[:500])
+    kkk1 = treecorr.KKKCorrelation(min_sep=1., max_sep=20., nbins=5)
+    kkk1.process(cat3)
+    kkk2 = treecorr.KKKCorrelation(min_sep=1., max_sep=20., nbins=5, checkpoint=file_name,
+                                   checkpoint_time=0.)
+    kkk2.process(cat3)
+    np.testing.assert_allclose(kkk2.ntri, kkk1.ntri)
+    np.testing.assert_allclose(kkk2.zeta, kkk1.zeta)
+    assert not os.path.exists(file_name + '.cells')
+
+    # If the checkpoint file can't be written, this is an OSError, rather than an abort.
+    bad_file_name = os.path.join('output','no_such_dir','kk_checkpoint.pkl')
+    kk5 = treecorr.KKCorrelation(config, checkpoint=bad_file_name)
+    with assert_raises(OSError):
+        kk5.process(cat3)
+    kkk3 = treecorr.KKKCorrelation(min_sep=1., max_sep=20., nbins=5, checkpoint=bad_file_name,
+                                   checkpoint_time=0.)
+    with assert_raises(OSError):
+        kkk3.process(cat3)
+
+
+@timer
+def test_patch_engine():
+    # By default, all the pairs of patches are done together in the C++ layer.  Check that
+    # this gives the same results as doing them one at a time in python.
+    ngal = 10000
+    npatch = 8
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0,100, (ngal,) )
+    y = rng.uniform(0,100, (ngal,) )
+    k = rng.normal(0.3,0.1, (ngal,) )
+    g1 = rng.normal(0,0.1, (ngal,) )
+    g2 = rng.normal(0,0.1, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y, k=k, g1=g1, g2=g2, npatch=npatch)
+    patches = cat.get_patches()
+
+    def one_at_a_time(comm, low_mem):
+        return False
+
+    for cls in [treecorr.NNCorrelation, treecorr.KKCorrelation, treecorr.GGCorrelation,
+                treecorr.NGCorrelation]:
+        # max_sep is small enough that many pairs of patches have no pairs.
+        for config in [dict(bin_size=0.3, min_sep=1., max_sep=10.),
+                       dict(nbins=11, max_sep=10., bin_type='TwoD')]:
+            c1 = cls(config)
+            c2 = cls(config)
+            c2._use_patch_engine = one_at_a_time
+            if cls is treecorr.NGCorrelation:
+                c1.process(patches, patches)
+                c2.process(patches, patches)
+            else:
+                c1.process(patches)
+                c2.process(patches)
+            print(cls.__name__, config.get('bin_type','Log'), len(c1.results))
+            np.testing.assert_allclose(c1.npairs, c2.npairs)
+            np.testing.assert_allclose(c1.weight, c2.weight)
+            np.testing.assert_allclose(c1.meanr, c2.meanr)
+            assert set(c1.results.keys()) == set(c2.results.keys())
+            if cls is treecorr.NNCorrelation:
+                np.testing.assert_allclose(c1.tot, c2.tot)
+                assert len(c1.results) == npatch*(npatch+1)//2
+            elif cls is treecorr.GGCorrelation:
+                np.testing.assert_allclose(c1.xip, c2.xip, atol=1.e-12)
+                np.testing.assert_allclose(c1.xim, c2.xim, atol=1.e-12)
+            else:
+                np.testing.assert_allclose(c1.xi, c2.xi, atol=1.e-12)
+            if config.get('bin_type') != 'TwoD':
+                np.testing.assert_allclose(c1.estimate_cov('jackknife'),
+                                           c2.estimate_cov('jackknife'))
+
+    # The stats are accumulated too.
+    kk = treecorr.KKCorrelation(bin_size=0.3, min_sep=1., max_sep=10.)
+    kk.process(patches)
+    assert kk.stats['nitems'] > 0
+
+
+@timer
+def test_many_centers():
+    # With many centers, assigning patches from patch_centers uses a grid over the points.
+    # Check that it gives exactly the same answer as a brute force search.
+    ngal = 20000
+    npatch = 200
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0,100, (ngal,) )
+    y = rng.uniform(0,100, (ngal,) )
+    z = rng.normal(0,0.01, (ngal,) )  # Much thinner in z.
+    cx = rng.uniform(0,100, (npatch,) )
+    cy = rng.uniform(0,100, (npatch,) )
+    cz = rng.normal(0,0.01, (npatch,) )
+    # Include some points exactly on the centers and two identical centers.
+    x[:npatch] = cx
+    y[:npatch] = cy
+    z[:npatch] = cz
+    cx[7] = cx[3]
+    cy[7] = cy[3]
+    cz[7] = cz[3]
+
+    centers = np.array([cx, cy]).T
+    cat = treecorr.Catalog(x=x, y=y, patch_centers=centers)
+    dsq = (x[:,np.newaxis] - cx)**2 + (y[:,np.newaxis] - cy)**2
+    np.testing.assert_array_equal(cat.patch, np.argmin(dsq, axis=1))
+    assert 7 not in cat.patch
+
+    centers = np.array([cx, cy, cz]).T
+    cat = treecorr.Catalog(x=x, y=y, z=z, patch_centers=centers)
+    dsq = (x[:,np.newaxis] - cx)**2 + (y[:,np.newaxis] - cy)**2 + (z[:,np.newaxis] - cz)**2
+    np.testing.assert_array_equal(cat.patch, np.argmin(dsq, axis=1))
+
+    # Also on the sphere.
+    ra, dec = coord.CelestialCoord.xyz_to_radec(x-50, y-50, z+30)
+    cat1 = treecorr.Catalog(ra=ra, dec=dec, ra_units='rad', dec_units='rad', npatch=npatch)
+    cat2 = treecorr.Catalog(ra=ra, dec=dec, ra_units='rad', dec_units='rad',
+                            patch_centers=cat1.patch_centers)
+    c = cat1.patch_centers
+    dsq = ((cat2.x[:,np.newaxis] - c[:,0])**2 + (cat2.y[:,np.newaxis] - c[:,1])**2 +
+           (cat2.z[:,np.newaxis] - c[:,2])**2)
+    np.testing.assert_array_equal(cat2.patch, np.argmin(dsq, axis=1))
+
+
+@timer
+def test_memory():
+    # Test the memory accounting functions and the max_memory option.
+    ngal = 20000
+    npatch = 8
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0, 100, (ngal,))
+    y = rng.uniform(0, 100, (ngal,))
+    file_name = os.path.join('output','test_memory.dat')
+    treecorr.Catalog(x=x, y=y).write(file_name)
+    kwargs = dict(x_col=1, y_col=2)
+
+    cat = treecorr.Catalog(file_name, npatch=npatch, **kwargs)
+    assert cat.nbytes == 0  # Not loaded yet.
+    field = cat.getNField()
+    assert cat.nbytes >= 2*ngal*8 + field.nbytes
+    # A tree down to single objects has about 2N cells.
+    assert field.nbytes > 2*ngal * 32
+    assert field.spill_nbytes == 0
+    est = treecorr.Field.estimate_nbytes(ngal, 'flat')
+    assert 0.25 * field.nbytes < est < 4 * field.nbytes
+    spill_field = cat.getNField(spill_dir='output')
+    assert spill_field.spill_nbytes > 0
+    assert spill_field.nbytes < field.nbytes
+
+    dd = treecorr.NNCorrelation(bin_size=0.3, min_sep=1., max_sep=10., num_threads=4)
+    n0 = dd.nbytes
+    assert n0 >= 5 * dd.nbins * 8  # at least rnom, meanr, meanlogr, weight, npairs.
+    dd.process(cat)
+    assert dd.nbytes > n0  # The per-thread accumulators now exist.
+    est = dd.estimate_nbytes(ngal, num_threads=4, coords='flat')
+    assert est > treecorr.Field.estimate_nbytes(ngal, 'flat', 1)
+    npairs = dd.npairs.copy()
+
+    # With plenty of memory, the patches are all kept loaded.
+    patch_centers = cat.patch_centers
+    for max_memory in [1.e10, 1.e5, 1]:
+        cat1 = treecorr.Catalog(file_name, patch_centers=patch_centers, **kwargs)
+        dd1 = treecorr.NNCorrelation(bin_size=0.3, min_sep=1., max_sep=10.,
+                                     max_memory=max_memory)
+        dd1.process(cat1)
+        np.testing.assert_allclose(dd1.npairs, npairs)
+        nloaded = sum(p.loaded for p in cat1.patches)
+        total = sum(p.nbytes for p in cat1.patches)
+        print('max_memory = ',max_memory,': nloaded = ',nloaded,', nbytes = ',total)
+        if max_memory == 1.e10:
+            assert nloaded == npatch
+        elif max_memory == 1:
+            assert nloaded == 0
+        assert total <= max(max_memory, max(p.nbytes for p in cat1.patches) * 2)
+
+        # Cross correlations use it too.
+        dd2 = treecorr.NNCorrelation(bin_size=0.3, min_sep=1., max_sep=10.,
+                                     max_memory=max_memory)
+        dd2.process(cat1, cat1)
+        np.testing.assert_allclose(dd2.npairs, 2*npairs, rtol=1.e-6)
+
+
+@timer
+def test_prefetch():
+    # With prefetch, the patches for the next pairs are loaded in the background.  The results
+    # should be the same as without it, and with low_mem, nothing should be left loaded.
+    ngal = 20000
+    npatch = 8
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0, 100, (ngal,))
+    y = rng.uniform(0, 100, (ngal,))
+    k = rng.normal(0, 1, (ngal,))
+    file_name = os.path.join('output','test_prefetch.dat')
+    treecorr.Catalog(x=x, y=y, k=k).write(file_name)
+    kwargs = dict(x_col=1, y_col=2, k_col=3)
+    patch_centers = treecorr.Catalog(file_name, npatch=npatch, **kwargs).patch_centers
+
+    config = dict(bin_size=0.3, min_sep=1., max_sep=10.)
+    cat = treecorr.Catalog(file_name, patch_centers=patch_centers, **kwargs)
+    kk0 = treecorr.KKCorrelation(config)
+    kk0.process(cat, low_mem=True)
+    kk0x = treecorr.KKCorrelation(config)
+    kk0x.process(cat, cat, low_mem=True)
+
+    for prefetch in [1, 3]:
+        for max_memory in [None, 1.e10, 1.e5]:
+            cat1 = treecorr.Catalog(file_name, patch_centers=patch_centers, **kwargs)
+            kk1 = treecorr.KKCorrelation(config, prefetch=prefetch, max_memory=max_memory)
+            kk1.process(cat1, low_mem=True)
+            np.testing.assert_array_equal(kk1.npairs, kk0.npairs)
+            np.testing.assert_allclose(kk1.xi, kk0.xi, rtol=1.e-10)
+            nloaded = sum(p.loaded for p in cat1.patches)
+            print('prefetch = ',prefetch,', max_memory = ',max_memory,': nloaded = ',nloaded)
+            if max_memory is None:
+                assert nloaded == 0
+            elif max_memory == 1.e10:
+                assert nloaded == npatch
+
+            kk2 = treecorr.KKCorrelation(config, prefetch=prefetch, max_memory=max_memory)
+            kk2.process(cat1, cat1, low_mem=True)
+            np.testing.assert_array_equal(kk2.npairs, kk0x.npairs)
+            np.testing.assert_allclose(kk2.xi, kk0x.xi, rtol=1.e-10)
+            if max_memory is None:
+                assert sum(p.loaded for p in cat1.patches) == 0
+
+    with assert_raises(ValueError):
+        treecorr.KKCorrelation(config, prefetch=-1)
+
+
+@timer
+def test_patch_tagged():
+    # With patch_tagged=True, all the pairs of patches are done in one pass over a single field
+    # for the whole catalog.  With bin_slop=0, this should give the same results as processing
+    # the patches separately.
+    ngal = 10000
+    npatch = 8
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0,100, (ngal,) )
+    y = rng.uniform(0,100, (ngal,) )
+    k = rng.normal(0.3,0.1, (ngal,) )
+    g1 = rng.normal(0,0.1, (ngal,) )
+    g2 = rng.normal(0,0.1, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y, k=k, g1=g1, g2=g2, npatch=npatch)
+    patches = cat.get_patches()
+
+    for cls in [treecorr.NNCorrelation, treecorr.KKCorrelation, treecorr.GGCorrelation,
+                treecorr.NGCorrelation]:
+        config = dict(bin_size=0.3, min_sep=1., max_sep=10., bin_slop=0)
+        c1 = cls(config, patch_tagged=True)
+        c2 = cls(config)
+        if cls is treecorr.NGCorrelation:
+            c1.process(cat, cat)
+            c2.process(patches, patches)
+        else:
+            c1.process(cat)
+            c2.process(patches)
+        print(cls.__name__, len(c1.results), len(c2.results))
+        np.testing.assert_allclose(c1.npairs, c2.npairs)
+        np.testing.assert_allclose(c1.weight, c2.weight)
+        np.testing.assert_allclose(c1.meanr, c2.meanr)
+        assert set(c1.results.keys()) == set(c2.results.keys())
+        for key in c1.results:
+            np.testing.assert_allclose(c1.results[key].npairs, c2.results[key].npairs)
+        if cls is treecorr.NNCorrelation:
+            np.testing.assert_allclose(c1.tot, c2.tot)
+        elif cls is treecorr.GGCorrelation:
+            np.testing.assert_allclose(c1.xip, c2.xip, atol=1.e-12)
+            np.testing.assert_allclose(c1.xim, c2.xim, atol=1.e-12)
+        else:
+            np.testing.assert_allclose(c1.xi, c2.xi, atol=1.e-12)
+        np.testing.assert_allclose(c1.estimate_cov('jackknife'), c2.estimate_cov('jackknife'))
+
+    # The results are also close with the default bin_slop.
+    gg1 = treecorr.GGCorrelation(bin_size=0.3, min_sep=1., max_sep=10., patch_tagged=True)
+    gg2 = treecorr.GGCorrelation(bin_size=0.3, min_sep=1., max_sep=10.)
+    gg1.process(cat)
+    gg2.process(patches)
+    np.testing.assert_allclose(gg1.npairs, gg2.npairs, rtol=1.e-2)
+    np.testing.assert_allclose(gg1.xip, gg2.xip, atol=1.e-4)
+
+    # If some objects at the same position are in different patches, it falls back to doing
+    # each patch separately.
+    x2 = np.concatenate([x, x[:10]])
+    y2 = np.concatenate([y, y[:10]])
+    cat2 = treecorr.Catalog(x=x2, y=y2, patch=np.arange(ngal+10) % npatch)
+    nn1 = treecorr.NNCorrelation(bin_size=0.3, min_sep=1., max_sep=10., bin_slop=0,
+                                 patch_tagged=True)
+    nn2 = treecorr.NNCorrelation(bin_size=0.3, min_sep=1., max_sep=10., bin_slop=0)
+    nn1.process(cat2)
+    nn2.process(cat2)
+    np.testing.assert_allclose(nn1.npairs, nn2.npairs)
+    assert set(nn1.results.keys()) == set(nn2.results.keys())
+
+
+@timer
+def test_native_cov():
+    # The design matrices for the covariance estimates are made in C++ when possible.  Check
+    # that this gives the same answer as the python implementation.
+    ngal = 10000
+    npatch = 16
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0,100, (ngal,) )
+    y = rng.uniform(0,100, (ngal,) )
+    k = rng.normal(0.3,0.1, (ngal,) )
+    g1 = rng.normal(0,0.1, (ngal,) )
+    g2 = rng.normal(0,0.1, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y, k=k, g1=g1, g2=g2, npatch=npatch)
+    cat1 = treecorr.Catalog(x=x[:100], y=y[:100], k=k[:100])
+
+    def python_cov(comm=None):
+        return False
+
+    gg = treecorr.GGCorrelation(bin_size=0.3, min_sep=1., max_sep=20., num_bootstrap=100)
+    gg.process(cat)
+    ng = treecorr.NGCorrelation(bin_size=0.3, min_sep=1., max_sep=20., num_bootstrap=100)
+    ng.process(cat, cat)
+    kk = treecorr.KKCorrelation(bin_size=0.3, min_sep=1., max_sep=20., num_bootstrap=100)
+    kk.process(cat, cat1)
+    for c in [gg, ng, kk]:
+        assert c._use_native_cov()
+        for method in ['jackknife', 'sample', 'bootstrap', 'marked_bootstrap']:
+            np.random.seed(1234)
+            cov1 = c.estimate_cov(method)
+            c._use_native_cov = python_cov
+            np.random.seed(1234)
+            cov2 = c.estimate_cov(method)
+            del c._use_native_cov
+            print(type(c).__name__, method, np.max(np.abs(cov1-cov2)))
+            np.testing.assert_allclose(cov1, cov2, rtol=1.e-8, atol=1.e-14 * np.max(cov2))
+
+    # The combined covariance matrix mixes the two versions.
+    rg = ng.copy()
+    ng.calculateXi(rg)
+    assert not ng._use_native_cov()
+    np.random.seed(1234)
+    cov1 = treecorr.estimate_multi_cov([gg, ng], 'jackknife')
+    gg._use_native_cov = python_cov
+    np.random.seed(1234)
+    cov2 = treecorr.estimate_multi_cov([gg, ng], 'jackknife')
+    np.testing.assert_allclose(cov1, cov2, rtol=1.e-8, atol=1.e-14 * np.max(cov2))
+
+
+
+@timer
+def test_process_async():
+    # process_async runs the process call on a background thread, and streams the results of
+    # each pair of patches as they finish.
+    import concurrent.futures
+    ngal = 20000
+    npatch = 8
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0, 100, (ngal,))
+    y = rng.uniform(0, 100, (ngal,))
+    k = rng.normal(0, 1, (ngal,))
+    g1 = rng.normal(0, 0.2, (ngal,))
+    g2 = rng.normal(0, 0.2, (ngal,))
+    cat = treecorr.Catalog(x=x, y=y, k=k, g1=g1, g2=g2, npatch=npatch)
+    config = dict(bin_size=0.3, min_sep=1., max_sep=10.)
+
+    kk0 = treecorr.KKCorrelation(config)
+    kk0.process(cat, low_mem=True)
+    gg0 = treecorr.GGCorrelation(config)
+    gg0.process(cat)
+
+    # Two at once, one with a callback.
+    done = []
+    kk1 = treecorr.KKCorrelation(config)
+    gg1 = treecorr.GGCorrelation(config)
+    f1 = kk1.process_async(cat, low_mem=True)
+    f2 = gg1.process_async(cat, callback=lambda key, res: done.append(key))
+    keys = [key for key, res in f1.patch_results()]
+    assert f1.result() is kk1
+    assert f2.result() is gg1
+    assert sorted(keys) == sorted(kk0.results.keys())
+    assert sorted(done) == sorted(gg0.results.keys())
+    np.testing.assert_array_equal(kk1.npairs, kk0.npairs)
+    np.testing.assert_allclose(kk1.xi, kk0.xi, rtol=1.e-10)
+    np.testing.assert_array_equal(gg1.npairs, gg0.npairs)
+    np.testing.assert_allclose(gg1.xip, gg0.xip, rtol=1.e-10)
+    np.testing.assert_allclose(kk1.estimate_cov('jackknife'), kk0.estimate_cov('jackknife'),
+                               rtol=1.e-8)
+
+    # The same object can be used again after the future is done.
+    f3 = kk1.process_async(cat, cat, low_mem=True)
+    f3.result()
+    kk0.process(cat, cat, low_mem=True)
+    np.testing.assert_array_equal(kk1.npairs, kk0.npairs)
+
+    # Cancel one while it is running.  Since each pair of patches checks the flag, it stops
+    # well before doing all of them.
+    def slow_callback(key, res):
+        time.sleep(0.1)
+    kk2 = treecorr.KKCorrelation(config)
+    f4 = kk2.process_async(cat, low_mem=True, callback=slow_callback)
+    while not f4.running() and not f4.done():
+        time.sleep(0.01)
+    assert f4.cancel()
+    with assert_raises(concurrent.futures.CancelledError):
+        f4.result()
+    with assert_raises(concurrent.futures.CancelledError):
+        list(f4.patch_results())
+    assert len(kk2.results) < len(kk0.results)
+    assert not f4.cancel()  # Already done.
+
+    # After a cancel, the next call works normally.
+    f5 = kk2.process_async(cat, low_mem=True)
+    f5.result()
+    kk0.process(cat, low_mem=True)
+    np.testing.assert_array_equal(kk2.npairs, kk0.npairs)
+
+    # With publish_time, snapshot has the sums so far, which only ever grow, up to the final
+    # ones.  This is the case with and without patches.
+    with assert_raises(RuntimeError):
+        f5.snapshot()
+    for c in [cat, treecorr.Catalog(x=x, y=y, k=k)]:
+        kk0.process(c, low_mem=c.npatch > 1)
+        kk4 = treecorr.KKCorrelation(config)
+        f7 = kk4.process_async(c, low_mem=c.npatch > 1, publish_time=0.01)
+        snaps = []
+        while not f7.done():
+            snaps.append(f7.snapshot())
+            time.sleep(0.005)
+        f7.result()
+        snaps.append(f7.snapshot())
+        npairs = np.array([s.npairs for s in snaps])
+        print('sum(npairs) = ',np.sum(npairs, axis=1))
+        assert np.all(np.diff(npairs, axis=0) >= 0)
+        np.testing.assert_array_equal(npairs[-1], kk0.npairs)
+        # The last one is from before finalize.
+        np.testing.assert_allclose(snaps[-1].xi / snaps[-1].weight, kk0.xi, rtol=1.e-10)
+        np.testing.assert_array_equal(kk4.npairs, kk0.npairs)
+
+    # Errors are raised by result().
+    f6 = kk2.process_async(cat, metric='Invalid')
+    with assert_raises(ValueError):
+        f6.result()
+
+    # Copies don't share the cancel flag.
+    kk3 = kk2.copy()
+    assert kk3._async is not kk2._async
+
+
 if __name__ == '__main__':
     test_cat_patches()
     test_cat_centers()
@@ -2420,3 +2949,11 @@ if __name__ == '__main__':
     test_clusters()
     test_brute_jk()
     test_lowmem()
+    test_checkpoint()
+    test_patch_engine()
+    test_many_centers()
+    test_memory()
+    test_prefetch()
+    test_patch_tagged()
+    test_native_cov()
+    test_process_async()
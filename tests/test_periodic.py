@@ -491,6 +491,162 @@ def test_3pt():
         ddd.process(cat)
 
 
+@timer
+def test_periodic_images():
+    # When max_sep <= L/2, the Periodic metric is done with periodic images of the top-level
+    # cells and the Euclidean metric.  Check the auto and cross counts, including TwoD binning,
+    # which uses the separation vectors in the periodic space.
+
+    ngal = 200
+    Lx = 50.
+    Ly = 80.
+    rng = np.random.RandomState(8675309)
+    x1 = rng.random_sample(ngal) * Lx
+    y1 = rng.random_sample(ngal) * Ly
+    cat1 = treecorr.Catalog(x=x1, y=y1)
+    x2 = rng.random_sample(ngal) * Lx
+    y2 = rng.random_sample(ngal) * Ly
+    cat2 = treecorr.Catalog(x=x2, y=y2)
+
+    def periodic_sep(xa, ya, xb, yb):
+        dx = (xb - xa + Lx/2.) % Lx - Lx/2.
+        dy = (yb - ya + Ly/2.) % Ly - Ly/2.
+        return dx, dy
+
+    min_sep = 1.
+    max_sep = 20.
+    nbins = 20
+    bin_size = np.log(max_sep/min_sep) / nbins
+    for auto in [True, False]:
+        xb, yb = (x1, y1) if auto else (x2, y2)
+        dx, dy = periodic_sep(x1[:,None], y1[:,None], xb[None,:], yb[None,:])
+        if auto:
+            mask = np.triu(np.ones((ngal,ngal), dtype=bool), 1)
+            dx = dx[mask]
+            dy = dy[mask]
+
+        dd = treecorr.NNCorrelation(min_sep=min_sep, max_sep=max_sep, nbins=nbins, bin_slop=0,
+                                    xperiod=Lx, yperiod=Ly)
+        if auto:
+            dd.process(cat1, metric='Periodic')
+        else:
+            dd.process(cat1, cat2, metric='Periodic')
+        r = np.sqrt(dx**2 + dy**2).ravel()
+        true_npairs = np.histogram(np.log(r), bins=nbins,
+                                   range=(np.log(min_sep), np.log(max_sep)))[0]
+        np.testing.assert_array_equal(dd.npairs, true_npairs)
+
+        dd2 = treecorr.NNCorrelation(max_sep=max_sep, nbins=10, bin_slop=0, bin_type='TwoD',
+                                     xperiod=Lx, yperiod=Ly)
+        if auto:
+            dd2.process(cat1, metric='Periodic')
+            # The auto-correlation counts each pair in both directions.
+            dx = np.concatenate([dx, -dx])
+            dy = np.concatenate([dy, -dy])
+        else:
+            dd2.process(cat1, cat2, metric='Periodic')
+        true_npairs = np.histogram2d(dy.ravel(), dx.ravel(), bins=10,
+                                     range=[[-max_sep,max_sep],[-max_sep,max_sep]])[0]
+        np.testing.assert_array_equal(dd2.npairs, true_npairs)
+
+
+@timer
+def test_periodic_rr():
+    # For a uniform box, RR can be computed analytically from the volume in each bin.
+    Lx = 50.
+    Ly = 80.
+    Lz = 60.
+    ngal = 2000
+    rng = np.random.RandomState(8675309)
+    x1 = rng.random_sample(ngal) * Lx
+    y1 = rng.random_sample(ngal) * Ly
+    z1 = rng.random_sample(ngal) * Lz
+    x2 = rng.random_sample(ngal) * Lx
+    y2 = rng.random_sample(ngal) * Ly
+    z2 = rng.random_sample(ngal) * Lz
+
+    # Random pairs in a periodic box have (nearly) Poisson counts, so check each bin to 5 sigma.
+    def check_counts(dd, rr):
+        print('dd.npairs = ',dd.npairs)
+        print('rr.npairs = ',rr.npairs)
+        assert rr.tot == dd.tot
+        assert np.all(np.abs(dd.npairs - rr.npairs) < 5. * np.sqrt(rr.npairs) + 1.)
+
+    # 2d, with max_sep larger than half the period, so the outer bins are cut off by the box.
+    cat1 = treecorr.Catalog(x=x1, y=y1)
+    cat2 = treecorr.Catalog(x=x2, y=y2)
+    for bin_type in ['Log', 'Linear']:
+        dd = treecorr.NNCorrelation(min_sep=1., max_sep=50., nbins=20, bin_type=bin_type,
+                                    xperiod=Lx, yperiod=Ly)
+        dd.process(cat1, cat2, metric='Periodic')
+        check_counts(dd, dd.periodic_rr())
+
+    # The bins that cover the whole box add up to all the pairs.
+    dd = treecorr.NNCorrelation(min_sep=0., max_sep=np.hypot(Lx,Ly)/2., nbins=10,
+                                bin_type='Linear', xperiod=Lx, yperiod=Ly)
+    dd.process(cat1, cat2, metric='Periodic')
+    np.testing.assert_allclose(np.sum(dd.periodic_rr().npairs), dd.tot, rtol=1.e-10)
+    np.testing.assert_allclose(np.sum(dd.periodic_rr().npairs), np.sum(dd.npairs), rtol=1.e-10)
+
+    # TwoD, including a min_sep, which removes a disc from the middle bins.
+    dd = treecorr.NNCorrelation(min_sep=3., max_sep=20., nbins=10, bin_type='TwoD',
+                                xperiod=Lx, yperiod=Ly)
+    dd.process(cat1, cat2, metric='Periodic')
+    rr = dd.periodic_rr()
+    check_counts(dd, rr)
+    np.testing.assert_allclose(np.sum(rr.npairs),
+                               dd.tot * (40.**2 - np.pi * 3.**2) / (Lx*Ly), rtol=1.e-10)
+
+    # 3d, where the cut off volume is integrated numerically.
+    cat1 = treecorr.Catalog(x=x1, y=y1, z=z1)
+    cat2 = treecorr.Catalog(x=x2, y=y2, z=z2)
+    dd = treecorr.NNCorrelation(min_sep=5., max_sep=55., nbins=10, bin_type='Linear',
+                                xperiod=Lx, yperiod=Ly, zperiod=Lz)
+    dd.process(cat1, cat2, metric='Periodic')
+    check_counts(dd, dd.periodic_rr())
+    dd = treecorr.NNCorrelation(min_sep=0., max_sep=np.sqrt(Lx**2+Ly**2+Lz**2)/2., nbins=10,
+                                bin_type='Linear', xperiod=Lx, yperiod=Ly, zperiod=Lz)
+    dd.process(cat1, cat2, metric='Periodic')
+    np.testing.assert_allclose(np.sum(dd.periodic_rr().npairs), dd.tot, rtol=1.e-6)
+
+    # Using rr=None in calculateXi uses the analytic RR.  These are randoms, so xi ~ 0.
+    dd = treecorr.NNCorrelation(min_sep=5., max_sep=25., nbins=5, xperiod=Lx, yperiod=Ly,
+                                zperiod=Lz)
+    dd.process(cat1, metric='Periodic')
+    xi, varxi = dd.calculateXi()
+    print('xi = ',xi)
+    print('sigma = ',np.sqrt(varxi))
+    np.testing.assert_allclose(xi, 0., atol=5.*np.sqrt(varxi))
+    rr = dd.periodic_rr()
+    xi2, varxi2 = dd.calculateXi(rr)
+    np.testing.assert_array_equal(xi2, xi)
+    np.testing.assert_array_equal(varxi2, varxi)
+    # The randoms don't add any shot noise.
+    np.testing.assert_allclose(varxi, 1./rr.weight)
+
+    # With patches, the analytic RR has results for each pair of patches.
+    cat1p = treecorr.Catalog(x=x1, y=y1, z=z1, npatch=4)
+    dd = treecorr.NNCorrelation(min_sep=5., max_sep=25., nbins=5, xperiod=Lx, yperiod=Ly,
+                                zperiod=Lz, var_method='jackknife')
+    dd.process(cat1p, metric='Periodic')
+    rr = dd.periodic_rr()
+    assert sorted(rr.results.keys()) == sorted(dd.results.keys())
+    for ij in dd.results:
+        np.testing.assert_allclose(rr.results[ij].weight * dd.tot,
+                                   rr.weight * dd.results[ij].tot)
+    xi3, varxi3 = dd.calculateXi()
+    np.testing.assert_allclose(xi3, xi)
+    print('jackknife varxi = ',varxi3)
+    assert np.all(varxi3 > 0)
+
+    # Only valid for the Periodic metric.
+    dd = treecorr.NNCorrelation(min_sep=5., max_sep=25., nbins=5)
+    dd.process(cat1)
+    with assert_raises(ValueError):
+        dd.periodic_rr()
+    with assert_raises(ValueError):
+        dd.calculateXi()
+
 
 if __name__ == '__main__':
     test_direct_count()
@@ -498,3 +654,5 @@ if __name__ == '__main__':
     test_periodic_ps()
     test_halotools()
     test_3pt()
+    test_periodic_images()
+    test_periodic_rr()
@@ -1956,6 +1956,33 @@ def test_symmetric():
     np.testing.assert_allclose(gg1.xim, gg2.xim)
 
 
+@timer
+def test_rpar_leaves():
+    # The rpar metrics have their own versions of the distance and rpar calculations for the
+    # tight loops over pairs of leaves.  Check that these match brute force with and without
+    # an rpar range.
+
+    ngal = 300
+    s = 10.
+    rng = np.random.RandomState(8675309)
+    x = rng.normal(312, s, (ngal,) )
+    y = rng.normal(728, s, (ngal,) )
+    z = rng.normal(-932, s, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y, z=z)
+
+    for metric in ['FisherRperp', 'OldRperp', 'Rlens']:
+        for rpar_range in [{}, dict(min_rpar=-10., max_rpar=5.), dict(min_rpar=0.)]:
+            kwargs = dict(min_sep=1., max_sep=30., nbins=10, **rpar_range)
+            dd1 = treecorr.NNCorrelation(brute=True, **kwargs)
+            dd1.process(cat, cat, metric=metric)
+            dd2 = treecorr.NNCorrelation(bin_slop=0, leaf_size=32, **kwargs)
+            dd2.process(cat, cat, metric=metric)
+            print(metric, rpar_range, dd1.npairs, dd2.npairs)
+            assert np.sum(dd1.npairs) > 0
+            np.testing.assert_array_equal(dd2.npairs, dd1.npairs)
+            np.testing.assert_allclose(dd2.meanr, dd1.meanr, rtol=1.e-10)
+
+
 if __name__ == '__main__':
     test_nn_direct_rperp()
     test_nn_direct_oldrperp()
@@ -1970,3 +1997,4 @@ if __name__ == '__main__':
     test_gg_oldrperp()
     test_gg_oldrperp_local()
     test_symmetric()
+    test_rpar_leaves()
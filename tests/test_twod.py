@@ -328,6 +328,45 @@ def test_twod_singlebin():
     np.testing.assert_array_equal(kg2.npairs, ng2.npairs)
     np.testing.assert_allclose(kg2.xi, 10.*ng2.xi, atol=1.e-10)
 
+@timer
+def test_twod_sparse():
+    # The accumulators for TwoD only allocate the parts of the grid that get some pairs.
+    # Check that the result is still right when most of the grid is empty.
+    rng = np.random.RandomState(1234)
+    N = 1000
+    x = rng.uniform(0, 100, N)
+    y = rng.uniform(0, 3, N)
+    k = rng.normal(0, 1, N)
+    cat = treecorr.Catalog(x=x, y=y, k=k)
+
+    max_sep = 20.
+    nbins = 80
+    kk = treecorr.KKCorrelation(max_sep=max_sep, nbins=nbins, bin_type='TwoD', bin_slop=0,
+                                num_threads=4)
+    kk.process(cat)
+
+    dx = x[None,:] - x[:,None]
+    dy = y[None,:] - y[:,None]
+    use = (np.abs(dx) < max_sep) & (np.abs(dy) < max_sep)
+    np.fill_diagonal(use, False)
+    i = ((dx[use] + max_sep) / kk.bin_size).astype(int)
+    j = ((dy[use] + max_sep) / kk.bin_size).astype(int)
+    kkk = (k[None,:] * k[:,None])[use]
+    true_npairs = np.bincount(j*nbins + i, minlength=nbins**2).reshape(nbins, nbins)
+    true_xi = np.bincount(j*nbins + i, weights=kkk, minlength=nbins**2).reshape(nbins, nbins)
+    true_xi[true_npairs > 0] /= true_npairs[true_npairs > 0]
+    print('used bins = ',np.sum(true_npairs > 0),' of ',nbins**2)
+    np.testing.assert_array_equal(kk.npairs, true_npairs)
+    np.testing.assert_allclose(kk.xi, true_xi, atol=1.e-10)
+
+    # The cross-correlation should be the same.
+    kk2 = treecorr.KKCorrelation(max_sep=max_sep, nbins=nbins, bin_type='TwoD', bin_slop=0,
+                                 num_threads=4)
+    kk2.process(cat, cat)
+    np.testing.assert_array_equal(kk2.npairs, true_npairs)
+    np.testing.assert_allclose(kk2.xi, true_xi, atol=1.e-10)
+
 if __name__ == '__main__':
     test_twod()
     test_twod_singlebin()
+    test_twod_sparse()
@@ -44,9 +44,12 @@ _lib = _ffi.dlopen(lib_file)
 Rperp_alias = 'FisherRperp'
 
 from .config import read_config
-from .util import set_omp_threads, get_omp_threads
-from .catalog import Catalog, read_catalogs, calculateVarG, calculateVarK
-from .binnedcorr2 import BinnedCorr2, estimate_multi_cov
+from .util import set_omp_threads, get_omp_threads, set_phase_threads, submit
+from .util import start_trace, stop_trace
+from .catalog import Catalog, read_catalogs, calculateVarG, calculateVarK, kmeans_chunks
+from .binnedcorr2 import BinnedCorr2, estimate_multi_cov, process_multi, process_multi_bin
+from .binnedcorr2 import process_multi_partner
+from .binnedcorr2 import InteractionList
 from .ggcorrelation import GGCorrelation
 from .nncorrelation import NNCorrelation
 from .kkcorrelation import KKCorrelation
@@ -55,7 +58,7 @@ from .nkcorrelation import NKCorrelation
 from .kgcorrelation import KGCorrelation
 from .field import Field, NField, KField, GField
 from .field import SimpleField, NSimpleField, KSimpleField, GSimpleField
-from .binnedcorr3 import BinnedCorr3
+from .binnedcorr3 import BinnedCorr3, Multipole3
 from .nnncorrelation import NNNCorrelation
 from .kkkcorrelation import KKKCorrelation
 from .gggcorrelation import GGGCorrelation
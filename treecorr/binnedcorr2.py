@@ -16,11 +16,712 @@
 """
 
 import math
+import bisect
+import contextlib
 import numpy as np
 import sys
+import os
+import time
+import pickle
+import threading
 import coord
 import treecorr
 
+# The names of the traversal stats, in the order they are stored by the C++ layer.
+# cf. TraversalStats.h.
+_traversal_stats_names = ('nodes', 'split1', 'split2', 'split3', 'split_multi',
+                          'rpar_exit', 'small_exit', 'large_exit', 'range_exit',
+                          'single_bin', 'direct', 'leaf_pairs', 'nitems', 'item_time',
+                          'max_item_time', 'max_thread_time', 'tasks', 'nthreads')
+
+
+def _add_traversal_stats(stats, other):
+    # Add the traversal stats from another correlation object.  Most of them are sums,
+    # but a few are maxima.
+    maxes = [_traversal_stats_names.index(k) for k in ('max_item_time', 'nthreads')]
+    m = np.maximum(stats[maxes], other[maxes])
+    stats += other
+    stats[maxes] = m
+
+
+# The config parameters that don't affect the results, so they are left out of the key for
+# the result cache.
+_cache_ignore_keys = ('verbose', 'log_file', 'output_dots', 'num_threads', 'checkpoint',
+                      'checkpoint_time', 'cache_dir', 'autotune_time', 'autotune_file')
+
+# The attributes besides the numpy arrays that are saved in the result cache.
+_cache_attrs = ('tot', 'results', 'npatch1', 'npatch2', 'coords', 'metric', '_coords', '_metric')
+
+
+def _hash_arrays(h, arrays):
+    # Add the contents of some arrays (any of which may be None) to the hash h.
+    for a in arrays:
+        if a is None:
+            h.update(b'None')
+        else:
+            h.update(np.ascontiguousarray(a, dtype=float).data)
+
+
+def _hash_catalog(h, cat):
+    # Add the contents of a catalog to the hash h for the result cache.
+    h.update(repr((cat.ntot, cat.coords, cat.patch)).encode())
+    _hash_arrays(h, (cat.x, cat.y, cat.z, cat.w, cat.wpos, cat.k, cat.g1, cat.g2))
+
+
+def _fft_size(n):
+    # The smallest n' >= n whose only prime factors are 2, 3, and 5, for which the FFTs are fast.
+    while True:
+        m = n
+        for p in (2, 3, 5):
+            while m % p == 0:
+                m //= p
+        if m == 1:
+            return n
+        n += 1
+
+
+def _grid_correlate(a, b):
+    # The sum over x of a(x) b(x+d) for each offset d on the periodic grid.
+    if np.iscomplexobj(a) or np.iscomplexobj(b):
+        fa = np.conj(np.fft.fft2(np.conj(a)))
+        return np.fft.ifft2(fa * np.fft.fft2(b))
+    else:
+        fa = np.conj(np.fft.rfft2(a))
+        return np.fft.irfft2(fa * np.fft.rfft2(b), s=a.shape)
+
+
+def _hash_positions(cat):
+    # A hash of the positions and weights of a catalog, which are all that the tree depends on.
+    import hashlib
+    h = hashlib.sha1()
+    h.update(repr((cat.ntot, cat.coords)).encode())
+    _hash_arrays(h, (cat.x, cat.y, cat.z, cat.w, cat.wpos))
+    return h.hexdigest()
+
+
+def _read_autotune(file_name):
+    # The dict of the saved autotune choices, or {} if the file doesn't exist yet.
+    import json
+    if not os.path.exists(file_name):
+        return {}
+    try:
+        with open(file_name) as fid:
+            return json.load(fid)
+    except ValueError:
+        # Another process may have been writing it.  Just tune again.
+        return {}
+
+
+def _write_autotune(file_name, saved):
+    # Write to a temporary file first, so another process never reads a partial file.
+    import json
+    dir_name = os.path.dirname(file_name)
+    if dir_name and not os.path.exists(dir_name):
+        os.makedirs(dir_name)
+    tmp_name = file_name + '.%d.tmp'%os.getpid()
+    with open(tmp_name, 'w') as fid:
+        json.dump(saved, fid, indent=1, sort_keys=True)
+    os.rename(tmp_name, file_name)
+
+
+def _dilute_catalog(cat, frac, seed, which):
+    # A random subsample of cat with each object kept with probability frac, and the weights
+    # scaled by 1/frac, so the sums over pairs are the same on average as for cat.  Returns
+    # None if there are no objects in the subsample.
+    #
+    # which is 1 or 2 for the position of cat in the correlation.  The random stream depends
+    # on it and on the patch number, so the two catalogs of a cross-correlation (or two
+    # patches) with the same number of objects don't keep the same indices, which would keep
+    # the pairs of objects with the same index with probability frac rather than frac**2.
+    #
+    # The subsample is cached in cat, so processing many pairs of patches doesn't dilute each
+    # patch and build its fields again for every pair.  (cf. Catalog.clear_cache)
+    key = (frac, seed, which)
+    cache = cat.__dict__.setdefault('_diluted', {})
+    if key not in cache:
+        cache[key] = _make_dilute_catalog(cat, frac, seed, which)
+    return cache[key]
+
+def _make_dilute_catalog(cat, frac, seed, which):
+    patch = cat.patch + 1 if cat.patch is not None else 0
+    rng = np.random.RandomState([seed, which, patch])
+    indx = np.where(rng.uniform(size=cat.ntot) < frac)[0]
+    if len(indx) == 0:
+        return None
+    def sub(a):
+        return a[indx] if a is not None else None
+    check_wpos = cat.wpos if cat.wpos is not None else cat.w
+    kwargs = dict(keep_zero_weight=np.any(check_wpos==0))
+    if cat.ra is not None:
+        kwargs['ra_units'] = 'rad'
+        kwargs['dec_units'] = 'rad'
+        kwargs['allow_xyz'] = True
+    return treecorr.Catalog(x=sub(cat.x), y=sub(cat.y), z=sub(cat.z),
+                            ra=sub(cat.ra), dec=sub(cat.dec), r=sub(cat.r),
+                            w=cat.w[indx]/frac, wpos=sub(cat.wpos),
+                            g1=sub(cat.g1), g2=sub(cat.g2), k=sub(cat.k), **kwargs)
+
+
+class InteractionList(object):
+    """The list of pairs of cells that a correlation added to its bins, which is returned by
+    `BinnedCorr2.record_interactions`.
+
+    Which pairs of cells these are only depends on the positions and weights of the objects,
+    not on their k or g1,g2 values.  So for other catalogs with the same positions and weights,
+    `BinnedCorr2.replay_interactions` can add the same pairs to the bins directly from this
+    list, which is much faster than going through the tree traversal again.
+
+    This keeps a reference to the fields that were used to record it, since their trees are
+    used to build the fields for the new catalogs.
+
+    Attributes:
+        metric:     The metric that was used to record the list.
+        field1:     The field that was used for the first catalog.
+        field2:     The field that was used for the second catalog, or None for an
+                    auto-correlation.
+    """
+    def __init__(self, data, metric, field1, field2, cat1, cat2):
+        self.data = data
+        self.metric = metric
+        self.field1 = field1
+        self.field2 = field2
+        self._pos1 = _hash_positions(cat1)
+        self._pos2 = _hash_positions(cat2) if cat2 is not None else None
+
+    def __len__(self):
+        """The number of pairs of cells in the list."""
+        return treecorr._lib.InteractionListSize(self.data)
+
+    def __del__(self):
+        # Using memory allocated from the C layer means we have to explicitly deallocate it
+        # rather than being able to rely on the Python memory manager.
+        if hasattr(self,'data'):  # pragma: no branch
+            if not treecorr._ffi._lock.locked(): # pragma: no branch
+                treecorr._lib.DestroyInteractionList(self.data)
+
+
+class _PatchCheckpoint(object):
+    # Keeps track of which pairs of patches are done in _process_all_auto and
+    # _process_all_cross when the checkpoint option is set, and every checkpoint_time seconds,
+    # writes them to the checkpoint file along with their accumulated results.  If the file
+    # already exists from an earlier run that was interrupted, its results are added to corr,
+    # and the pairs that were done are skipped.  The metric is saved with them, since the
+    # binning checks in += don't catch a file from a run with a different metric.
+
+    def __init__(self, corr, file_name, metric):
+        self.corr = corr
+        self.file_name = file_name
+        if metric is None:
+            metric = treecorr.config.get(corr.config,'metric',str,'Euclidean')
+        self.metric = metric
+        self.done = set()
+        self.total = None
+        self.last_write = time.time()
+        if file_name is not None:
+            self.total = corr.copy()
+            self.total.clear()
+            self._read()
+
+    def _read(self):
+        if not os.path.exists(self.file_name):
+            return
+        try:
+            with open(self.file_name, 'rb') as fid:
+                done, saved, metric = pickle.load(fid)
+            if (type(saved) is not type(self.corr) or saved.npatch1 != self.corr.npatch1 or
+                    saved.npatch2 != self.corr.npatch2 or metric != self.metric):
+                raise ValueError("It is for a different calculation.")
+            self.corr += saved
+        except Exception as e:
+            self.corr.logger.warning("Ignoring checkpoint file %s: %s", self.file_name, e)
+            return
+        self.corr.logger.info("Resuming from checkpoint file %s with %d pairs of patches done",
+                              self.file_name, len(done))
+        self.corr.results.update(saved.results)
+        self.done = done
+        self.total = saved
+
+    def is_done(self, i, j):
+        return (i,j) in self.done
+
+    def add(self, i, j, temp):
+        # Call this after adding temp, the results for the pair (i,j), to corr.
+        if self.total is None: return
+        self.total += temp
+        self.total.results[(i,j)] = self.corr.results[(i,j)]
+        self._finish_pair(i,j)
+
+    def add_tot(self, i, j, c1, c2):
+        # Call this instead of add when there were no pairs in (i,j).
+        if self.total is None: return
+        self.total._add_tot(i, j, c1, c2)
+        self._finish_pair(i,j)
+
+    def _finish_pair(self, i, j):
+        self.done.add((i,j))
+        if time.time() - self.last_write >= self.corr.checkpoint_time:
+            # Write to a temporary file and then rename it, so if we are killed in the middle
+            # of writing, the previous checkpoint is still intact.
+            self.corr.logger.info("Writing checkpoint file %s", self.file_name)
+            tmp_name = self.file_name + '.tmp'
+            with open(tmp_name, 'wb') as fid:
+                pickle.dump((self.done, self.total, self.metric), fid)
+            os.rename(tmp_name, self.file_name)
+            self.last_write = time.time()
+
+    def finish(self):
+        # Once everything is done, we don't need the file anymore.
+        if self.file_name is not None and os.path.exists(self.file_name):
+            os.remove(self.file_name)
+
+
+def _arrays_nbytes(obj):
+    # The number of bytes in the numpy arrays that are attributes of obj.
+    return sum(v.nbytes for v in obj.__dict__.values() if isinstance(v, np.ndarray))
+
+
+class _AsyncState(object):
+    # The flag for cancelling a process_async call, and its callback for the results of each
+    # pair of patches.  While the call is running, this is shared by all the copies of the
+    # correlation (e.g. the temporary ones in the patch loops), so deepcopy doesn't copy it.
+    # Other copies get a new one.  The C++ layer checks the flag before starting each
+    # top-level pair of cells.
+    #
+    # With publish_time, the C++ layer also adds the results so far to the output arrays
+    # about that often, and ProcessFuture.snapshot can look at them.  current is the
+    # correlation whose C++ call is running (e.g. the temporary one for a pair of patches),
+    # whose outputs haven't been added to the main one yet.  The lock is held while they are
+    # added, so snapshot doesn't see them in both or neither.  Once owner (the correlation
+    # that process_async was called for) has all its results, frozen is a copy of it from
+    # before finalize, which snapshot then uses.
+
+    def __init__(self):
+        self.cancel = np.zeros(1, dtype=int)
+        self.callback = None
+        self.running = False
+        self.publish_time = 0.
+        self.owner = None
+        self.current = None
+        self.frozen = None
+        self.lock = threading.RLock()
+
+    def __deepcopy__(self, memo):
+        return self if self.running else _AsyncState()
+
+    def __getstate__(self):
+        # The callback can't be pickled (e.g. to send the results with MPI).
+        return {'cancel': self.cancel}
+
+    def __setstate__(self, d):
+        self.cancel = d['cancel']
+        self.callback = None
+        self.running = False
+        self.publish_time = 0.
+        self.owner = None
+        self.current = None
+        self.frozen = None
+        self.lock = threading.RLock()
+
+    def start_job(self, corr):
+        # Call this before the C++ call for corr, once it has been cleared.
+        with self.lock:
+            self.current = corr
+
+    def freeze(self, corr):
+        # Call this once corr has all of its results, before it is finalized.
+        if self.publish_time and corr is self.owner:
+            with self.lock:
+                self.frozen = corr.copy()
+                self.current = None
+
+    @contextlib.contextmanager
+    def finish_job(self):
+        # Add the results of the current job to the main correlation inside this with block.
+        with self.lock:
+            yield
+            self.current = None
+
+    def patch_done(self, key, result):
+        import concurrent.futures
+        if self.cancel[0]:
+            raise concurrent.futures.CancelledError()
+        if self.callback is not None:
+            self.callback(key, result)
+
+
+class _BudgetState(object):
+    # The budget used so far by the process calls that max_time and max_pairs (or max_triples)
+    # limit.  This is everything since the last clear, so all of a process call, rather than
+    # each call to the C++ layer.  While process is running, it is shared by all the copies of
+    # the correlation (e.g. the temporary ones in the patch loops), so deepcopy doesn't copy it.
+    # The C++ layer updates used as it starts each top-level pair of cells.  cf. ProcessBudget.h.
+    #
+    # The pairs of patches are done one after another, so if the first ones could use all of
+    # the budget, the results would only be for the patches that happen to come first.  So each
+    # of them only gets its share: the k-th of njobs may use up to (k+1)/njobs of the limits,
+    # including whatever the ones before it didn't use.  share is the current fraction.
+
+    def __init__(self):
+        self.used = np.zeros(4, dtype=float)
+        self.running = False
+        self.share = 1.
+        self.njobs = 0
+        self.job = 0
+
+    def __deepcopy__(self, memo):
+        if self.running:
+            return self
+        ret = _BudgetState()
+        ret.used[:] = self.used
+        return ret
+
+    def __setstate__(self, d):
+        self.used = d['used']
+        self.running = False
+        self.share = 1.
+        self.njobs = 0
+        self.job = 0
+
+    @contextlib.contextmanager
+    def run(self):
+        # Share this with the copies made inside the with block.
+        running = self.running
+        self.running = True
+        try:
+            yield
+        finally:
+            self.running = running
+            if not running:
+                self.share_jobs(0)
+
+    def share_jobs(self, njobs):
+        # Split the budget evenly between the next njobs jobs.  (0 for no split.)
+        self.njobs = njobs
+        self.job = 0
+        self.share = 1.
+
+    def next_job(self):
+        # Call this before starting each of the jobs from share_jobs.
+        if self.njobs > 0:
+            self.job += 1
+            self.share = min(float(self.job) / self.njobs, 1.)
+
+    def reset(self):
+        if not self.running:
+            self.used[:] = 0.
+
+    @property
+    def frac_done(self):
+        return self.used[2] / self.used[3] if self.used[3] > 0 else 1.
+
+
+def _make_process_future(corr, callback, publish_time):
+    import concurrent.futures
+
+    class ProcessFuture(concurrent.futures.Future):
+        """The future returned by `BinnedCorr2.process_async`.
+
+        This is a ``concurrent.futures.Future``, whose result is the correlation object once
+        the processing is finished.  Unlike the usual futures, it can be cancelled while it is
+        running, in which case the C++ layer stops starting new pairs of cells, and `result`
+        raises ``CancelledError`` soon after.  The results of each pair of patches are
+        available from `patch_results` as they finish, and with publish_time, the results so
+        far are available from `snapshot`.
+        """
+        def __init__(self):
+            super(ProcessFuture, self).__init__()
+            import queue
+            self.corr = corr
+            self._queue = queue.Queue()
+            self._frozen = None
+
+        def cancel(self):
+            if super(ProcessFuture, self).cancel():
+                return True
+            if self.done():
+                return False
+            self.corr._async.cancel[0] = 1
+            return True
+
+        def patch_results(self):
+            """Yield the (key, result) for each pair of patches as they finish, where key is
+            the (i,j) in corr.results.  This ends when the processing is done, and if it
+            failed or was cancelled, raises the exception.
+            """
+            while True:
+                item = self._queue.get()
+                if item is None:
+                    break
+                yield item
+            self.result()
+
+        def snapshot(self):
+            """Return a copy of the correlation with the results accumulated so far.
+
+            This is only available if process_async was given a publish_time.  The results
+            are the sums before `finalize` (e.g. xi is not yet divided by the weight), for the
+            pairs of patches that are finished, and the top-level pairs of cells that were
+            done in the current one as of the last time its C++ call published them.
+            """
+            if not publish_time:
+                raise RuntimeError("snapshot requires process_async to be given publish_time")
+            state = corr._async
+            with state.lock:
+                if self._frozen is not None:
+                    return self._frozen.copy()
+                if state.frozen is not None:
+                    return state.frozen.copy()
+                snap = corr.copy()
+                current = state.current
+                if current is corr:
+                    if hasattr(corr, '_corr'):
+                        snap._copy_results(corr)
+                elif current is not None and hasattr(current, '_corr'):
+                    part = current.copy()
+                    part._copy_results(current)
+                    snap += part
+            return snap
+
+        def _patch_done(self, key, result):
+            self._queue.put((key, result))
+            if callback is not None:
+                callback(key, result)
+
+        def _run(self, args, kwargs):
+            if not self.set_running_or_notify_cancel():
+                self._queue.put(None)
+                return
+            state = corr._async
+            state.cancel[0] = 0
+            state.callback = self._patch_done
+            state.running = True
+            state.publish_time = publish_time or 0.
+            state.owner = corr
+            state.current = corr
+            if state.publish_time and hasattr(corr, '_corr'):
+                corr._set_checkpoint()
+            error = None
+            try:
+                corr.process(*args, **kwargs)
+            except BaseException as e:
+                error = e
+            if state.cancel[0]:
+                error = concurrent.futures.CancelledError()
+            # Reset the state before setting the result, since the caller may start another
+            # call as soon as this one is done.
+            state.running = False
+            state.callback = None
+            state.cancel[0] = 0
+            with state.lock:
+                self._frozen = state.frozen
+                state.publish_time = 0.
+                state.owner = None
+                state.current = None
+                state.frozen = None
+            if publish_time and hasattr(corr, '_corr'):
+                corr._set_checkpoint()
+            self._queue.put(None)
+            if error is not None:
+                self.set_exception(error)
+            else:
+                self.set_result(corr)
+
+    return ProcessFuture()
+
+
+class _PatchMemory(object):
+    # Decides which patches to load and unload in _process_all_auto and _process_all_cross
+    # when the max_memory option is set.  jobs is the list of the catalogs used by each job,
+    # in the order that the loop does them (empty for the ones it skips).  After each job, if the
+    # patches that have been used use more than max_memory, the ones whose next use is
+    # farthest in the future are unloaded until they don't.  (This is the optimal strategy for
+    # minimizing the number of times patches need to be loaded again.)
+    #
+    # With the prefetch option, the patches of the next few jobs are also loaded, and their
+    # fields built, on background threads while the current job is processed, as far as they
+    # fit in max_memory.  With low_mem and no max_memory, only the patches of the current job
+    # and the next prefetch jobs are kept loaded.
+
+    def __init__(self, corr, jobs):
+        self.corr = corr
+        self.jobs = jobs
+        self.step = 0
+        self.uses = {}
+        for k, cats in enumerate(jobs):
+            for c in cats:
+                self.uses.setdefault(id(c), []).append(k)
+        self.active = {}
+        self.pending = {}  # The patches being loaded in the background, with their futures.
+        self.sizes = {}    # The nbytes of each patch the last time it was loaded.
+
+    def _next_use(self, cat):
+        uses = self.uses[id(cat)]
+        k = bisect.bisect_left(uses, self.step)
+        return uses[k] if k < len(uses) else len(self.jobs)
+
+    def _wait(self, cat):
+        if id(cat) in self.pending:
+            future = self.pending.pop(id(cat))[1]
+            future.result()
+            self.active[id(cat)] = cat
+
+    def _collect(self):
+        for k, (c, future) in list(self.pending.items()):
+            if future.done():
+                self._wait(c)
+
+    @staticmethod
+    def _load(temp, cat, fields):
+        # Run on a background thread.  The fields can only be built once the coordinates are
+        # known, i.e. after the first job.
+        with treecorr.util.trace('load patch'):
+            cat.load()
+            if temp.coords is not None:
+                for d, brute in fields:
+                    temp._get_field(cat, d, brute)
+
+    def _fields(self, temp, k, cat):
+        # The (d, brute) of the fields that job k uses for cat, as process_auto and
+        # process_cross get them.
+        cats = self.jobs[k]
+        if len(cats) == 1:
+            return [(temp._d1, bool(temp.brute))]
+        fields = []
+        if cats[0] is cat:
+            fields.append((temp._d1, temp.brute is True or temp.brute == 1))
+        if cats[1] is cat:
+            fields.append((temp._d2, temp.brute is True or temp.brute == 2))
+        return fields
+
+    def start_job(self, temp):
+        # Call this before each job that is actually done, with the correlation object that
+        # does it.  This waits for its patches, if they are still being loaded, and starts
+        # loading the ones for the next jobs.
+        for c in self.jobs[self.step]:
+            self._wait(c)
+        prefetch = self.corr.prefetch
+        if not prefetch:
+            return
+        self._collect()
+        current = set(id(c) for c in self.jobs[self.step])
+        # Patches that haven't been loaded yet are guessed to be as large as the largest one.
+        guess = max(self.sizes.values()) if self.sizes else 0
+        total = sum(self.sizes.get(k, guess) for k in list(self.active) + list(self.pending))
+        for k in range(self.step+1, min(self.step+1+prefetch, len(self.jobs))):
+            for c in self.jobs[k]:
+                if id(c) in current or id(c) in self.active or id(c) in self.pending:
+                    continue
+                nbytes = self.sizes.get(id(c), guess)
+                if self.corr.max_memory is not None and total + nbytes > self.corr.max_memory:
+                    return
+                total += nbytes
+                self.corr.logger.debug('Prefetching %s',c.name)
+                future = treecorr.submit(self._load, temp, c, self._fields(temp, k, c))
+                self.pending[id(c)] = (c, future)
+
+    def finish_job(self):
+        # Call this after each job, whether or not it was actually done.
+        for c in self.jobs[self.step]:
+            self.active[id(c)] = c
+        self.step += 1
+        self._collect()
+        nbytes = dict((k, c.nbytes) for k, c in self.active.items())
+        self.sizes.update((k, n) for k, n in nbytes.items() if n > 0)
+        if self.corr.max_memory is None:
+            # Then this is for low_mem with prefetch.
+            keep = set(id(c) for cats in self.jobs[self.step:self.step+self.corr.prefetch]
+                       for c in cats)
+            for k, c in list(self.active.items()):
+                if k not in keep:
+                    c.unload()
+                    del self.active[k]
+            return
+        total = sum(nbytes.values())
+        if total <= self.corr.max_memory:
+            return
+        for c in sorted(self.active.values(), key=self._next_use, reverse=True):
+            self.corr.logger.debug('Unloading %s, which uses %d bytes', c.name, nbytes[id(c)])
+            c.unload()
+            total -= nbytes[id(c)]
+            del self.active[id(c)]
+            if total <= self.corr.max_memory:
+                break
+
+    def finish(self, low_mem):
+        # Wait for any loads that are still going on (for jobs that were skipped).
+        for c, future in list(self.pending.values()):
+            self._wait(c)
+            if low_mem and self.corr.max_memory is None:
+                c.unload()
+
+
+def _any_source(comm):
+    # The source to use for receiving a message from any process.  The mock comm object in
+    # the tests defines its own, but for a real mpi4py comm, it is MPI.ANY_SOURCE.
+    if hasattr(comm, 'ANY_SOURCE'):
+        return comm.ANY_SOURCE
+    from mpi4py import MPI
+    return MPI.ANY_SOURCE
+
+
+class _PatchQueue(object):
+    # Hands out the pairs of patches to the processes as they ask for them when
+    # mpi_split='queue'.  Rank 0 only does the bookkeeping.  Each request gets the most
+    # expensive job that is left, except that of the next few, it prefers one whose
+    # catalogs are already loaded on the process that asked for it.
+    # jobs is the list of (ii,jj) indices into the lists of catalogs, names is the list of
+    # (i,j) patch numbers for them, and keys is the list of the sets of the keys of the
+    # catalogs that each one uses.
+
+    def __init__(self, corr, comm, jobs, names, keys):
+        self.corr = corr
+        self.comm = comm
+        self.jobs = jobs
+        self.names = names
+        self.keys = keys
+
+    def serve(self, costs):
+        # Run on rank 0 until all the jobs are done.
+        comm = self.comm
+        nworkers = comm.Get_size() - 1
+        # First get the first request from each process, which includes the jobs that it
+        # had already done according to its checkpoint file, so no one does these again.
+        requests = []
+        done = set()
+        for p in range(1, nworkers+1):
+            rank, loaded, done_p = comm.recv(source=p)
+            requests.append((rank, loaded))
+            done.update(done_p)
+        todo = sorted([k for k in range(len(self.jobs)) if self.names[k] not in done],
+                      key=lambda k: -costs[k])
+        self.corr.logger.info("Rank 0: Handing out %d jobs to %d processes",len(todo),nworkers)
+        nactive = nworkers
+        while nactive > 0:
+            if requests:
+                rank, loaded = requests.pop(0)
+            else:
+                rank, loaded, _ = comm.recv(source=_any_source(comm))
+            k = self._pick(todo, set(loaded), nworkers)
+            if k is None:
+                comm.send(None, dest=rank)
+                nactive -= 1
+            else:
+                self.corr.logger.info("Rank 0: Job %s goes to rank %d",self.names[k],rank)
+                comm.send(self.jobs[k], dest=rank)
+
+    def _pick(self, todo, loaded, window):
+        if not todo:
+            return None
+        nloaded = [len(self.keys[k] & loaded) for k in todo[:window]]
+        return todo.pop(nloaded.index(max(nloaded)))
+
+    def request(self, loaded, done=()):
+        # Run on the other ranks to get the next job, or None when there are no more.
+        # loaded is the list of the keys of the catalogs that are loaded on this process.
+        self.comm.send((self.comm.Get_rank(), list(loaded), list(done)), dest=0)
+        return self.comm.recv(source=0)
+
+
 class BinnedCorr2(object):
     """This class stores the results of a 2-point correlation calculation, along with some
     ancillary data.
@@ -124,6 +825,157 @@ class BinnedCorr2(object):
                                cat2 when the error is compatible with the given bin_slop.
                              - 2: Always go to the leaves for cat2, but stop at non-leaf cells of
                                cat1 when the error is compatible with the given bin_slop.
+        leaf_size (int):    When a pair of cells needs to be split and both cells have at most
+                            this many objects, compute all the pairs of their leaves directly
+                            rather than continuing to recurse down the tree.  When most pairs
+                            need to be resolved all the way to the leaves anyway (e.g. small
+                            bin_slop with narrow bins), this is typically faster, since the last
+                            few levels of the tree are dominated by recursion overhead.  With
+                            wider bins, the tree can usually place whole cells into a single bin,
+                            so this tends to be slower.  Values around 32 are a good place to
+                            start.  (default: 0, which means never do this)
+        lazy_build (bool):  Whether to build the fields lazily, so cells below the top level are
+                            only built when the calculation first needs them.  This can save a
+                            lot of time and memory when most of the deep cells are never used,
+                            e.g. when one catalog only overlaps a small part of the other.
+                            (default: False)
+        presort (bool):     Whether to sort the objects of each catalog along a space-filling
+                            curve before building the fields, which makes the build more cache
+                            friendly for large catalogs.  (default: False)
+        spill_dir (str):    If given, store most of the cells of the fields in memory mapped
+                            temporary files in this directory, rather than in memory, so
+                            catalogs whose trees are too large to fit in memory can still be
+                            used.  (default: None; cf. `NField`)
+        max_memory (float): If given, the maximum number of bytes of memory to use for the
+                            patches that are loaded during cross-patch processing.  Patches are
+                            kept loaded after they are used until this is exceeded, and then the
+                            ones that will be needed again last are unloaded first.  This is a
+                            more flexible version of the ``low_mem`` option of `process`, which
+                            unloads each patch as soon as it is done.  cf. `estimate_nbytes`
+                            for how much memory a calculation needs. (default: None)
+        prefetch (int):     When processing the pairs of patches one at a time (e.g. with
+                            ``low_mem`` or ``max_memory``), the number of the next pairs whose
+                            patches are loaded, and their fields built, on background threads
+                            while the current pair is processed.  With ``max_memory``, this only
+                            loads as many as fit in that budget.  cf. `set_phase_threads` for
+                            how the threads are shared between these. (default: 0)
+        mpi_split (str):    How to split the work over the processes when running with MPI
+                            (i.e. when a ``comm`` is given to `process`).  Options are:
+
+                            - 'patches' (default): Each process does some of the pairs of
+                              patches, so it only needs to load the patches it uses.
+                            - 'cells': Each process builds the fields for all the patches, and
+                              does its share of the pairs of top-level cells of all the pairs
+                              of patches, which balances the work much better when some pairs
+                              of patches are much more expensive than others.  With
+                              ``lazy_build``, each process only builds the parts of the trees
+                              that its own pairs of cells need.  This also works without
+                              patches.  The results are only added up on the rank 0 process.
+                              This uses the native multi-patch engine, so if the options don't
+                              allow that (e.g. ``low_mem`` or ``checkpoint``), it falls back
+                              to 'patches'.
+                            - 'queue': Rank 0 hands out the pairs of patches to the other
+                              processes as they ask for them, the most expensive ones (by
+                              the number of pairs of objects that are roughly within max_sep)
+                              first, preferring pairs whose patches are already loaded on the
+                              process that asks.  Rank 0 only does this bookkeeping, so this
+                              needs at least 2 processes.
+        patch_tagged (bool): Whether to compute all the pairs of patches in a single pass over
+                            one field built from the whole catalog, rather than one for each
+                            patch.  Each cell knows which patch its objects are in, and the
+                            pairs of cells are added to the results of their pair of patches.
+                            Only the cells that straddle a patch boundary need to be split
+                            further than usual.  This requires the full catalog (not a list of
+                            patches) to be given to `process`, and the same options as the
+                            native multi-patch engine (e.g. not ``low_mem`` or
+                            ``checkpoint``).  If a leaf cell has objects in more than one patch
+                            (which is only possible if some objects at the same position are
+                            in different patches), this falls back to the usual processing.
+                            (default: False)
+        max_time (float):   If given, the maximum wall clock time in seconds to spend on the
+                            pairs of cells in a process call (including all the pairs of
+                            patches, or for the lower level functions, all the calls since the
+                            last `clear`).  The top-level pairs of cells are then done in a
+                            random order, and no new ones are started once the time is up.
+                            With patches, each pair of patches gets an equal share of the
+                            time (plus whatever the ones before it didn't use), so the ones
+                            that were done are spread over all of them, rather than being
+                            the ones that happen to come first.  (With very different sizes
+                            of patches, the larger ones get a smaller fraction done, so it is
+                            best to use patches of similar size, e.g. from the kmeans.)
+                            The fraction that were done is
+                            available as `frac_done`.  Since the ones that were done are a
+                            random subset, xi is an unbiased (if noisy) estimate of the full
+                            result, and npairs and weight may be divided by frac_done to
+                            estimate their full values.  (default: None)
+        max_pairs (float):  Like max_time, but stop starting new top-level pairs of cells after
+                            approximately this many pairs of objects. (default: None)
+        checkpoint (str):   If given, a file name to use for checkpointing long calculations.
+                            When using patches, the results of the finished pairs of patches
+                            are periodically written to this file, and within each call to
+                            the C++ layer, the results of the finished top-level pairs of
+                            cells are written to checkpoint + '.cells'.  If the calculation is
+                            interrupted, running it again with the same parameters and catalogs
+                            resumes from these files, rather than starting over.  The files are
+                            removed once the calculation is finished.  With MPI, each rank
+                            appends its rank to the file name.  (default: None)
+        checkpoint_time (float): How often in seconds to write the checkpoint files.
+                            (default: 600)
+        cache_dir (str):    If given, a directory in which to save the results of each process
+                            call, keyed on a hash of the contents of the catalogs and all the
+                            parameters that affect the results.  If the same calculation is
+                            done again, the results (including the results for each pair of
+                            patches) are read from this directory rather than being computed.
+                            This is useful for things like the RR counts of random catalogs,
+                            which are often the same for many analyses.  It is not used with
+                            MPI, max_time or max_pairs.  (default: None)
+        fast_bins (bool):   Whether to find the bins for Log binning from a table of the bin
+                            edges, rather than computing log(r) for each pair.  The pairs go
+                            into exactly the same bins either way, but when bin_slop > 0, the
+                            test of whether a pair of cells can go into a single bin is a bit
+                            different, so the results are not identical.  With metric='Arc'
+                            on the sphere, this also lets the tree traversal use the chord
+                            distances between the points, so the angles are only computed
+                            for the pairs that are accumulated.  (This is only done when
+                            max_sep is small enough that all the angles are less than pi.)
+                            (default: False)
+        skip_meanlogr (bool): Whether to skip the accumulation of meanlogr, which is the only
+                            reason to compute log(r) for each pair with fast_bins or Linear
+                            binning.  If True, meanlogr is set to log(meanr).  (default: False)
+        grid_min_sep (float): If given, the bins above this separation are computed by
+                            painting the catalogs onto a mesh and correlating them with FFTs,
+                            and only the bins below it are done with the tree.  At large
+                            separations, this is much faster than the tree traversal.  Each
+                            object is moved to the center of its mesh cell, so this is similar
+                            in accuracy to a bin_slop that makes b*grid_min_sep comparable to
+                            the cell size.  This is only done for flat coordinates with the
+                            Euclidean or Periodic metric and Log or Linear binning.  For other
+                            cases (or with brute), the tree does all the bins.  (default: None)
+        grid_cell_size (float): The size of the mesh cells for grid_min_sep, in the same units
+                            as grid_min_sep.  (default: b * grid_min_sep / sqrt(2), which is
+                            about the largest error in the separations allowed by bin_slop)
+        dilute_min_sep (float): If given, the bins above this separation are computed using a
+                            random subsample of the catalogs with the weights scaled up by
+                            1/dilute_frac, and only the bins below it are done with the full
+                            catalogs.  This is meant for random catalogs that are much denser
+                            than the data, where the extra density is only needed to beat down
+                            the noise at small scales.  The sums in the large scale bins are
+                            the same on average, but they are noisier, and npairs is the number
+                            of pairs of the subsample.  This is only done for Log or Linear
+                            binning, and it can't be used with grid_min_sep.  (default: None)
+        dilute_frac (float): The fraction of the objects to keep for dilute_min_sep.
+                            (default: 0.1)
+        dilute_cat (int):   Which catalog to subsample for the cross-correlations with
+                            dilute_min_sep: 1 or 2 for just cat1 or cat2 (e.g. just the
+                            randoms for a data-random cross-correlation), or 0 for both.
+                            For an auto-correlation, the one catalog is always subsampled.
+                            (default: 0)
+        dilute_seed (int):  The seed for choosing the subsample for dilute_min_sep.  The same
+                            catalog always gets the same subsample for a given seed when it
+                            is in the same position (cat1 or cat2).  The two catalogs of a
+                            cross-correlation, and different patches, get independent
+                            subsamples.  The subsamples and their fields are cached in the
+                            catalogs until `Catalog.clear_cache`.  (default: 31415)
 
         verbose (int):      If no logger is provided, this will optionally specify a logging level
                             to use:
@@ -156,6 +1008,23 @@ class BinnedCorr2(object):
                             The top-level cells are where each calculation job starts. There will
                             typically be of order :math:`2^{\\rm max\\_top}` top-level cells.
                             (default: 10)
+        split_factor (float): When a pair of cells of comparable size needs to be split, the
+                            larger one is always split, and the smaller one is also split if
+                            its size is more than split_factor * b.  (default: 0.585)
+        autotune (bool):    Whether to choose the split_method, min_top and split_factor that
+                            give the fastest processing for this calculation.  Before the first
+                            process call with a given combination of catalog size, coordinates,
+                            metric, binning and number of threads, a few short trial runs are
+                            done on a random subset of the top-level pairs of cells of the first
+                            patch (cf. max_time), varying each of these in turn, and the one
+                            with the most pairs per second is used.  The choices are saved in
+                            autotune_file, so later runs with the same combination just use
+                            them.  Any of these that are given explicitly are still varied.
+                            (default: False)
+        autotune_time (float): The time in seconds to spend on each trial run of autotune.
+                            (default: 0.2)
+        autotune_file (str): The file in which to save the autotune choices.
+                            (default: ~/.treecorr/autotune.json)
         precision (int):    The precision to use for the output values. This specifies how many
                             digits to write. (default: 4)
         pairwise (bool):    Whether to use a different kind of calculation for cross correlations
@@ -214,6 +1083,49 @@ class BinnedCorr2(object):
                 'The default is to use 1 if bin_size <= 0.1, or 0.1/bin_size if bin_size > 0.1.'),
         'brute' : (bool, False, False, [False, True, 1, 2],
                 'Whether to use brute-force algorithm'),
+        'leaf_size' : (int, False, 0, None,
+                'The number of objects below which pairs of cells are processed leaf by leaf.'),
+        'lazy_build' : (bool, False, False, None,
+                'Whether to only build the lower cells of the fields when they are needed.'),
+        'presort' : (bool, False, False, None,
+                'Whether to sort the objects along a space-filling curve before building fields.'),
+        'spill_dir' : (str, False, None, None,
+                'A directory for memory mapped files to store the fields.'),
+        'max_memory' : (float, False, None, None,
+                'The maximum number of bytes to use for the patches loaded while processing.'),
+        'prefetch' : (int, False, 0, None,
+                'How many of the next pairs of patches to load in the background.'),
+        'mpi_split' : (str, False, 'patches', ['patches', 'cells', 'queue'],
+                'How to split the work over the processes when using MPI.'),
+        'patch_tagged' : (bool, False, False, None,
+                'Whether to compute all the pairs of patches in one pass over a single field.'),
+        'max_time' : (float, False, None, None,
+                'The maximum wall clock time in seconds for each processing call.'),
+        'max_pairs' : (float, False, None, None,
+                'The maximum number of pairs to do in each processing call.'),
+        'checkpoint' : (str, False, None, None,
+                'A file name to use for checkpointing long calculations.'),
+        'checkpoint_time' : (float, False, 600., None,
+                'How often in seconds to write the checkpoint files.'),
+        'cache_dir' : (str, False, None, None,
+                'A directory in which to save the results to reuse for identical calculations.'),
+        'fast_bins' : (bool, False, False, None,
+                'Whether to find the Log bins from a table of the bin edges.'),
+        'skip_meanlogr' : (bool, False, False, None,
+                'Whether to skip the accumulation of meanlogr.'),
+        'grid_min_sep' : (float, False, None, None,
+                'The separation above which to compute the bins on a mesh with FFTs.'),
+        'grid_cell_size' : (float, False, None, None,
+                'The size of the mesh cells to use for grid_min_sep.'),
+        'dilute_min_sep' : (float, False, None, None,
+                'The separation above which to use a random subsample of the catalogs.'),
+        'dilute_frac' : (float, False, 0.1, None,
+                'The fraction of the objects to keep for dilute_min_sep.'),
+        'dilute_cat' : (int, False, 0, [0, 1, 2],
+                'Which catalog to subsample in cross-correlations for dilute_min_sep.',
+                '0 = both, 1 = cat1, 2 = cat2'),
+        'dilute_seed' : (int, False, 31415, None,
+                'The seed for choosing the subsample for dilute_min_sep.'),
         'verbose' : (int, False, 1, [0, 1, 2, 3],
                 'How verbose the code should be during processing. ',
                 '0 = Errors Only, 1 = Warnings, 2 = Progress, 3 = Debugging'),
@@ -229,6 +1141,14 @@ class BinnedCorr2(object):
                 'The minimum number of top layers to use when setting up the field.'),
         'max_top' : (int, False, 10, None,
                 'The maximum number of top layers to use when setting up the field.'),
+        'split_factor' : (float, False, 0.585, None,
+                'The factor of b above which the smaller of two cells is also split.'),
+        'autotune' : (bool, False, False, None,
+                'Whether to choose the fastest split_method, min_top and split_factor.'),
+        'autotune_time' : (float, False, 0.2, None,
+                'The time in seconds for each trial run of autotune.'),
+        'autotune_file' : (str, False, None, None,
+                'The file in which to save the autotune choices.'),
         'precision' : (int, False, 4, None,
                 'The number of digits after the decimal in the output.'),
         'pairwise' : (bool, True, False, None,
@@ -423,6 +1343,17 @@ class BinnedCorr2(object):
 
         self.min_top = treecorr.config.get(self.config,'min_top',int,None)
         self.max_top = treecorr.config.get(self.config,'max_top',int,10)
+        self.split_factor = treecorr.config.get(self.config,'split_factor',float,0.585)
+        if self.split_factor <= 0:
+            raise ValueError("split_factor must be > 0")
+        self.autotune = treecorr.config.get(self.config,'autotune',bool,False)
+        self.autotune_time = treecorr.config.get(self.config,'autotune_time',float,0.2)
+        if self.autotune_time <= 0:
+            raise ValueError("autotune_time must be > 0")
+        self.autotune_file = treecorr.config.get(self.config,'autotune_file',str,None)
+        if self.autotune_file is None:
+            self.autotune_file = os.path.join(os.path.expanduser('~'), '.treecorr',
+                                              'autotune.json')
 
         self.bin_slop = treecorr.config.get(self.config,'bin_slop',float,-1.0)
         if self.bin_slop < 0.0:
@@ -442,6 +1373,46 @@ class BinnedCorr2(object):
                              self.brute is True and "" or
                              self.brute == 1 and " for first field" or
                              " for second field")
+        self.leaf_size = treecorr.config.get(self.config,'leaf_size',int,0)
+        if self.leaf_size < 0:
+            raise ValueError("leaf_size must be >= 0")
+        self.lazy_build = treecorr.config.get(self.config,'lazy_build',bool,False)
+        self.presort = treecorr.config.get(self.config,'presort',bool,False)
+        self.spill_dir = treecorr.config.get(self.config,'spill_dir',str,None)
+        self.max_memory = treecorr.config.get(self.config,'max_memory',float,None)
+        self.prefetch = treecorr.config.get(self.config,'prefetch',int,0)
+        if self.prefetch < 0:
+            raise ValueError("prefetch must be >= 0")
+        self.mpi_split = treecorr.config.get(self.config,'mpi_split',str,'patches')
+        self.patch_tagged = treecorr.config.get(self.config,'patch_tagged',bool,False)
+        self._tagged_cats = None
+        self.max_time = treecorr.config.get(self.config,'max_time',float,None)
+        self.max_pairs = treecorr.config.get(self.config,'max_pairs',float,None)
+        self.checkpoint = treecorr.config.get(self.config,'checkpoint',str,None)
+        self.checkpoint_time = treecorr.config.get(self.config,'checkpoint_time',float,600.)
+        self.cache_dir = treecorr.config.get(self.config,'cache_dir',str,None)
+        self.fast_bins = treecorr.config.get(self.config,'fast_bins',bool,False)
+        self.skip_meanlogr = treecorr.config.get(self.config,'skip_meanlogr',bool,False)
+        self.grid_min_sep = treecorr.config.get(self.config,'grid_min_sep',float,None)
+        self.grid_cell_size = treecorr.config.get(self.config,'grid_cell_size',float,None)
+        if self.grid_min_sep is not None and self.grid_cell_size is None:
+            if self.b == 0:
+                raise ValueError("grid_min_sep requires grid_cell_size when bin_slop = 0")
+            self.grid_cell_size = self.b * self.grid_min_sep / math.sqrt(2.)
+        self.dilute_min_sep = treecorr.config.get(self.config,'dilute_min_sep',float,None)
+        self.dilute_frac = treecorr.config.get(self.config,'dilute_frac',float,0.1)
+        self.dilute_cat = treecorr.config.get(self.config,'dilute_cat',int,0)
+        self.dilute_seed = treecorr.config.get(self.config,'dilute_seed',int,31415)
+        if self.dilute_frac <= 0 or self.dilute_frac > 1:
+            raise ValueError("dilute_frac must be in the range (0,1]")
+        if self.dilute_min_sep is not None:
+            if self.grid_min_sep is not None:
+                raise ValueError("dilute_min_sep cannot be used with grid_min_sep")
+            if self.dilute_min_sep <= self.min_sep:
+                raise ValueError("dilute_min_sep must be larger than min_sep")
+        self._budget = _BudgetState()
+        self._async = _AsyncState()
+        self._stats = np.zeros(len(_traversal_stats_names), dtype=float)
         self.coords = None
         self.metric = None
         self.min_rpar = treecorr.config.get(self.config,'min_rpar',float,-sys.float_info.max)
@@ -469,7 +1440,900 @@ class BinnedCorr2(object):
         d = ((x1-x2)**2 + (y1-y2)**2 + (z1-z2)**2)**0.5
         return (d > s1 + s2 + 2*self._max_sep)  # The 2* is where we are being conservative.
 
+    def _get_xi_arrays(self):
+        # The xi arrays that are given to BuildCorr2, or None for the ones that aren't used.
+        return [None, None, None, None]
+
+    def _set_patch_tot(self, c1, c2):
+        # No op for all but NNCorrelation, which needs to set the tot value for the results
+        # of a pair of patches from _process_patches.  c2 is None for the auto-correlation
+        # of a single patch.
+        pass
+
+    def _process_pairwise_arrays(self, cat1, cat2, d1, d2):
+        # Process the corresponding pairs of objects directly from the catalog arrays.  This
+        # is equivalent to making SimpleFields and calling ProcessPair, but it doesn't need to
+        # build a Cell for each object first.
+        from treecorr.util import double_ptr as dp
+        for cat, d in [(cat1, d1), (cat2, d2)]:
+            if d == 2 and cat.k is None:
+                raise TypeError("k is not defined.")
+            if d == 3 and (cat.g1 is None or cat.g2 is None):
+                raise TypeError("g1,g2 are not defined.")
+        if cat1.ntot != cat2.ntot:
+            raise ValueError("process_pairwise requires catalogs with the same number of objects")
+        treecorr._lib.ProcessPairwiseArrays(
+                self.corr,
+                dp(cat1.x), dp(cat1.y), dp(cat1.z), dp(cat1.g1), dp(cat1.g2), dp(cat1.k),
+                dp(cat1.w),
+                dp(cat2.x), dp(cat2.y), dp(cat2.z), dp(cat2.g1), dp(cat2.g2), dp(cat2.k),
+                dp(cat2.w),
+                cat1.ntot, self.output_dots, d1, d2, self._coords, self._bintype, self._metric)
+
+    def _get_field(self, cat, d, brute):
+        # Get the field of type d for a catalog, as process_auto and process_cross do.
+        min_size, max_size = self._get_minmax_size()
+        get_field = [cat.getNField, cat.getKField, cat.getGField][d-1]
+        return get_field(min_size, max_size, self.split_method, brute,
+                         self.min_top, self.max_top, self.coords,
+                         lazy=self.lazy_build, presort=self.presort,
+                         spill_dir=self.spill_dir)
+
+    def _build_field_from_tree(self, tree, cat, d):
+        # Build the C++ field of type d for cat using the tree of another field.  Unlike the
+        # Field classes with tree=tree, cat doesn't need to be the catalog that tree was built
+        # from, so the caller needs to check that it has the same positions and weights.
+        from treecorr.util import double_ptr as dp
+        if d == 1:
+            return treecorr._lib.BuildNFieldFromTree(tree.data, tree._d,
+                                                     dp(cat.x), dp(cat.y), dp(cat.z),
+                                                     dp(cat.w), dp(cat.wpos), tree._coords)
+        elif d == 2:
+            if cat.k is None:
+                raise TypeError("k is not defined.")
+            return treecorr._lib.BuildKFieldFromTree(tree.data, tree._d,
+                                                     dp(cat.x), dp(cat.y), dp(cat.z), dp(cat.k),
+                                                     dp(cat.w), dp(cat.wpos), tree._coords)
+        else:
+            if cat.g1 is None or cat.g2 is None:
+                raise TypeError("g1,g2 are not defined.")
+            return treecorr._lib.BuildGFieldFromTree(tree.data, tree._d,
+                                                     dp(cat.x), dp(cat.y), dp(cat.z),
+                                                     dp(cat.g1), dp(cat.g2),
+                                                     dp(cat.w), dp(cat.wpos), tree._coords)
+
+    def _destroy_field(self, data, d, coords):
+        destroy = [treecorr._lib.DestroyNField, treecorr._lib.DestroyKField,
+                   treecorr._lib.DestroyGField][d-1]
+        destroy(data, coords)
+
+    def _add_process_tot(self, cat1, cat2):
+        # No op for all but NNCorrelation, which adds to tot for each process_auto or
+        # process_cross call.  cat2 is None for an auto-correlation.
+        pass
+
+    def record_interactions(self, cat1, cat2=None, metric=None, num_threads=None):
+        """Process a catalog like `process_auto`, or a pair of catalogs like `process_cross`,
+        and also record the list of pairs of cells that were added to the bins.
+
+        The pairs of cells only depend on the positions and weights of the objects.  So when
+        correlating many catalogs with the same positions and weights, but different k or
+        g1,g2 values (e.g. random realizations of the shape noise for a covariance estimate),
+        you can record the interactions once and then use `replay_interactions` for each of
+        the other catalogs, which skips the tree traversal entirely::
+
+            >>> gg = treecorr.GGCorrelation(config)
+            >>> ilist = gg.record_interactions(cat)
+            >>> gg.finalize(cat.varg, cat.varg)
+            >>> for cat_i in realizations:
+            ...     gg_i = treecorr.GGCorrelation(config)
+            ...     gg_i.replay_interactions(ilist, cat_i)
+            ...     gg_i.finalize(cat_i.varg, cat_i.varg)
+
+        Like ``process_auto`` and ``process_cross``, this only accumulates the weighted sums
+        into the bins.  It cannot be used with the max_time, max_pairs, checkpoint or
+        lazy_build options.
+
+        Parameters:
+            cat1 (Catalog):     The first catalog to process.
+            cat2 (Catalog):     The second catalog to process, or None for an auto-correlation.
+                                (default: None)
+            metric (str):       Which metric to use.  See `Metrics` for details.
+                                (default: 'Euclidean'; this value can also be given in the
+                                constructor in the config dict.)
+            num_threads (int):  How many OpenMP threads to use during the calculation.
+                                (default: use the number of cpu cores; this value can also be given
+                                in the constructor in the config dict.)
+
+        Returns:
+            An `InteractionList` for use with `replay_interactions`.
+        """
+        if self.max_time or self.max_pairs or self.checkpoint is not None:
+            raise ValueError("record_interactions cannot be used with max_time, max_pairs "
+                             "or checkpoint")
+        if self.lazy_build:
+            raise ValueError("record_interactions cannot be used with lazy_build")
+        if cat2 is None and self._d1 != self._d2:
+            raise TypeError("cat2 is required for %s"%type(self).__name__)
+        self.logger.info('Starting process with recorded interactions')
+        self._set_metric(metric, cat1.coords, cat2.coords if cat2 is not None else None)
+        self._set_unit_weights(cat1, cat2)
+        self._set_num_threads(num_threads)
+        if cat2 is None:
+            f1 = f2 = self._get_field(cat1, self._d1, bool(self.brute))
+        else:
+            f1 = self._get_field(cat1, self._d1, self.brute is True or self.brute == 1)
+            f2 = self._get_field(cat2, self._d2, self.brute is True or self.brute == 2)
+        data = treecorr._lib.RecordInteractions2(self.corr, f1.data, f2.data, cat2 is None,
+                                                 self.output_dots, self._d1, self._d2,
+                                                 self._coords, self._bintype, self._metric)
+        self._add_process_tot(cat1, cat2)
+        ilist = InteractionList(data, self.metric, f1, f2 if cat2 is not None else None,
+                                cat1, cat2)
+        self.logger.info('Recorded %d pairs of cells', len(ilist))
+        return ilist
+
+    def replay_interactions(self, ilist, cat1, cat2=None, num_threads=None):
+        """Accumulate the correlation of a catalog (or pair of catalogs) using the pairs of
+        cells in an `InteractionList` from `record_interactions`.
+
+        The catalogs need to have the same positions and weights (in the same order) as the
+        ones that were used to record the list, but they may have different values of k or
+        g1,g2.  The data in each cell are recalculated for the new values using the recorded
+        trees, and then the pairs in the list are added to the bins directly.  The results are
+        the same as what ``process_auto`` or ``process_cross`` would give with the same
+        binning, except for differences in the order the pairs are added up.
+
+        This correlation needs to have the same binning as the one that recorded the list,
+        but it may be a different kind of correlation, e.g. a `KKCorrelation` can replay a
+        list recorded by an `NNCorrelation` of the same positions.
+
+        Parameters:
+            ilist (InteractionList): The list of pairs to add to the bins.
+            cat1 (Catalog):     The first catalog to process.
+            cat2 (Catalog):     The second catalog to process, or None for an auto-correlation.
+                                This needs to match whether the list was recorded for an
+                                auto-correlation or a cross-correlation. (default: None)
+            num_threads (int):  How many OpenMP threads to use during the calculation.
+                                (default: use the number of cpu cores; this value can also be given
+                                in the constructor in the config dict.)
+        """
+        if (cat2 is None) != (ilist.field2 is None):
+            raise ValueError("cat2 must be given if and only if ilist is for a "
+                             "cross-correlation")
+        if cat2 is None and self._d1 != self._d2:
+            raise TypeError("cat2 is required for %s"%type(self).__name__)
+        if (_hash_positions(cat1) != ilist._pos1 or
+                (cat2 is not None and _hash_positions(cat2) != ilist._pos2)):
+            raise ValueError("The catalogs do not have the same positions and weights as the "
+                             "ones used to record ilist")
+        self.logger.info('Starting process by replaying %d pairs of cells', len(ilist))
+        self._set_metric(ilist.metric, cat1.coords, cat2.coords if cat2 is not None else None)
+        self._set_unit_weights(cat1, cat2)
+        self._set_num_threads(num_threads)
+        f1 = self._build_field_from_tree(ilist.field1, cat1, self._d1)
+        try:
+            if cat2 is None:
+                f2 = f1
+            else:
+                f2 = self._build_field_from_tree(ilist.field2, cat2, self._d2)
+            try:
+                ok = treecorr._lib.ReplayInteractions2(self.corr, ilist.data, f1, f2,
+                                                       self.output_dots, self._d1, self._d2,
+                                                       self._coords, self._bintype)
+            finally:
+                if cat2 is not None:
+                    self._destroy_field(f2, self._d2, ilist.field2._coords)
+        finally:
+            self._destroy_field(f1, self._d1, ilist.field1._coords)
+        if not ok:
+            raise ValueError("ilist was recorded with different binning than this correlation")
+        self._add_process_tot(cat1, cat2)
+
+    @property
+    def _xi_names(self):
+        # The names of the xi arrays, in the order they are given to the C++ layer.
+        # NK and NG accumulate into raw_xi, since xi may be compensated later.
+        if self._d2 == 1:
+            return []
+        elif self._d1 == 1:
+            return ['raw_xi', 'raw_xi_im'][:self._d2-1]
+        elif self._d2 == 2:
+            return ['xi']
+        elif self._d1 != 3:
+            return ['xi', 'xi_im']
+        else:
+            return ['xip', 'xip_im', 'xim', 'xim_im']
+
+    def _get_columns(self, cat, d, values):
+        # The column values for process_columns as real and imaginary parts with shape
+        # (ncol, ntot), and the variance of each column.
+        if d == 1:
+            if values is not None:
+                raise TypeError("values are not used for the N field of %s"%(
+                                type(self).__name__))
+            return None, None, None
+        if values is None:
+            if d == 2:
+                if cat.k is None:
+                    raise TypeError("k is not defined.")
+                values = cat.k
+            else:
+                if cat.g1 is None or cat.g2 is None:
+                    raise TypeError("g1,g2 are not defined.")
+                values = cat.g1 + 1j * cat.g2
+        values = np.asarray(values)
+        if values.ndim == 1:
+            values = values[np.newaxis,:]
+        if values.ndim != 2 or values.shape[1] != cat.ntot:
+            raise ValueError("values must have shape (ncol, %d)"%cat.ntot)
+        if d == 2:
+            if np.iscomplexobj(values):
+                raise TypeError("values must be real for a K field")
+            vr = np.ascontiguousarray(values, dtype=float)
+            vi = None
+            vsq = vr**2
+        else:
+            vr = np.ascontiguousarray(values.real, dtype=float)
+            vi = np.ascontiguousarray(values.imag, dtype=float)
+            # The 2 is because we need the variance _per component_.
+            vsq = (vr**2 + vi**2) / 2.
+        # These are the same as Catalog.vark and Catalog.varg for each column.
+        if cat.nontrivial_w:
+            use = cat.w != 0
+            var = np.sum(cat.w[use]**2 * vsq[:,use], axis=1) / cat.sumw
+        else:
+            var = np.sum(vsq, axis=1) / cat.nobj
+        return vr, vi, var
+
+    def process_columns(self, cat1, cat2=None, values1=None, values2=None, metric=None,
+                        num_threads=None):
+        """Compute the correlation functions of many columns of k or g values with the same
+        positions and weights, using a single walk through the trees.
+
+        This is much faster than processing a separate catalog for each column, e.g. for many
+        realizations of the shape noise or many mock kappa maps on the same positions.  The
+        pairs of cells that the tree traversal uses only depend on the positions and weights,
+        so they are only found once, and then each pair is added to the bins of all the
+        columns at once.  (cf. `record_interactions`)
+
+        The values are given as arrays with shape (ncol, ntot), where ntot is the number of
+        objects in the catalog.  For a K field, these are the k values of each column, and for a
+        G field, they are complex, g1 + 1j * g2.  If the values for a K or G field are None,
+        the catalog's own k or g1,g2 values are used as a single column.  The values for an
+        N field (e.g. cat1 for `NGCorrelation`) should be None.  All of the K and G fields need
+        to have the same number of columns.
+
+        This correlation object isn't changed.  The results are returned as a list of ncol
+        finalized correlation objects of the same type, one for each column.  They all have
+        the same npairs, weight, meanr and meanlogr, and their variances are calculated from
+        each column's values.  This only works for single catalogs (not lists), and only with
+        var_method='shot'.
+
+        .. note::
+
+            For spherical coordinates, the shears in each cell are summed without parallel
+            transporting them to the cell's center first, so the results for G fields differ
+            slightly from the ones from `process` when bin_slop > 0.  With bin_slop = 0,
+            they are the same.
+
+        Parameters:
+            cat1 (Catalog):     The first catalog to process.
+            cat2 (Catalog):     The second catalog to process, or None for an auto-correlation.
+                                (default: None)
+            values1 (array):    The values of the columns for cat1. (default: None)
+            values2 (array):    The values of the columns for cat2.  For an auto-correlation,
+                                this should be None, and values1 is used for both.
+                                (default: None)
+            metric (str):       Which metric to use.  See `Metrics` for details.
+                                (default: 'Euclidean'; this value can also be given in the
+                                constructor in the config dict.)
+            num_threads (int):  How many OpenMP threads to use during the calculation.
+                                (default: use the number of cpu cores; this value can also be given
+                                in the constructor in the config dict.)
+
+        Returns:
+            A list of correlation objects, one for each column.
+        """
+        from treecorr.util import double_ptr as dp
+        if self._d2 == 1:
+            raise TypeError("process_columns is not valid for %s"%type(self).__name__)
+        if isinstance(cat1, list) or isinstance(cat2, list):
+            raise TypeError("process_columns requires single catalogs, not lists")
+        if self.var_method != 'shot':
+            raise ValueError("process_columns only works with var_method='shot'")
+        if cat2 is None:
+            if self._d1 != self._d2:
+                raise TypeError("cat2 is required for %s"%type(self).__name__)
+            if values2 is not None:
+                raise TypeError("values2 is not used for an auto-correlation")
+
+        vr1, vi1, var1 = self._get_columns(cat1, self._d1, values1)
+        if cat2 is None:
+            vr2, vi2, var2 = vr1, vi1, var1
+        else:
+            vr2, vi2, var2 = self._get_columns(cat2, self._d2, values2)
+        ncol = vr2.shape[0]
+        if vr1 is not None and vr1.shape[0] != ncol:
+            raise ValueError("values1 and values2 have different numbers of columns")
+        self.logger.info('Starting process_columns with %d columns', ncol)
+
+        # The NN correlation finds the pairs of cells and accumulates npairs, etc.
+        nn = treecorr.NNCorrelation(self.config, logger=self.logger)
+        ilist = nn.record_interactions(cat1, cat2, metric=metric, num_threads=num_threads)
+        f1 = ilist.field1
+        f2 = ilist.field2 if cat2 is not None else f1
+        c2 = cat2 if cat2 is not None else cat1
+        xi = np.zeros((4, ncol, self._nbins), dtype=float)
+        ok = treecorr._lib.ProcessColumns2(nn.corr, ilist.data, f1.data, f2.data,
+                                           self.output_dots, self._d1, self._d2, ncol,
+                                           cat1.ntot, c2.ntot,
+                                           dp(cat1.w), dp(vr1), dp(vi1),
+                                           dp(c2.w), dp(vr2), dp(vi2),
+                                           dp(xi[0]), dp(xi[1]), dp(xi[2]), dp(xi[3]),
+                                           nn._coords, nn._bintype)
+        assert ok  # The list was just recorded with the same fields and binning.
+
+        corrs = []
+        for j in range(ncol):
+            c = self.copy()
+            c.clear()
+            c.coords = nn.coords
+            c.metric = nn.metric
+            c._coords = nn._coords
+            c._metric = nn._metric
+            c.npatch1 = c.npatch2 = 1
+            c.meanr[:] = nn.meanr
+            c.meanlogr[:] = nn.meanlogr
+            c.weight[:] = nn.weight
+            c.npairs[:] = nn.npairs
+            for x, name in enumerate(self._xi_names):
+                getattr(c, name)[:] = xi[x,j]
+            var = [v[j] for d, v in ((self._d1, var1), (self._d2, var2)) if d != 1]
+            c.finalize(*var)
+            corrs.append(c)
+        return corrs
+
+    def _use_patch_engine(self, comm, low_mem):
+        # The native multi-patch engine does all the pairs of patches in a single call, so it
+        # can't be used with the options that need to do each pair of patches separately.
+        # Also, if only one side is brute, the patches need different fields for their auto and
+        # cross correlations.
+        return (comm is None and not low_mem and self.max_memory is None and
+                self.checkpoint is None and not self._async.publish_time and
+                not self.max_time and not self.max_pairs and self.grid_min_sep is None and
+                self.dilute_min_sep is None and (not self.brute or self.brute is True))
+
+    def _cell_split(self, comm, low_mem):
+        # Whether to split the pairs of top-level cells over the MPI processes, rather than
+        # the pairs of patches.  This uses the native multi-patch engine, so it needs the
+        # same options.
+        if comm is None or self.mpi_split != 'cells' or comm.Get_size() == 1:
+            return False
+        if not self._use_patch_engine(None, low_mem):
+            self.logger.warning("Cannot use mpi_split='cells' with these options.  "+
+                                "Splitting the pairs of patches instead.")
+            return False
+        return True
+
+    def _pair_cost(self, n1, cs1, n2=None, cs2=None):
+        # A rough estimate of how long a pair of patches with n1 and n2 objects and centers and
+        # sizes cs1 and cs2 will take, for ordering the jobs when mpi_split='queue'.  n2 is
+        # None for the auto-correlation of the first one.  This is the number of pairs of
+        # objects, times roughly the fraction of them that are closer than max_sep.
+        if n2 is None:
+            npairs = 0.5 * n1**2
+            s = 2. * cs1[3]
+            overlap = 1.
+        else:
+            npairs = float(n1) * n2
+            s = cs1[3] + cs2[3]
+            d = sum((a-b)**2 for a,b in zip(cs1[:3], cs2[:3]))**0.5
+            # Patches that don't overlap only have the pairs near their edges in range.
+            overlap = min(1., max(0., s + self._max_sep - d) / max(s, self._max_sep))
+        if s > self._max_sep:
+            npairs *= (self._max_sep / s)**2
+        return npairs * overlap
+
+    def _process_queue(self, cat1, cat2, metric, num_threads, comm, low_mem):
+        # Process all the pairs of patches, using a _PatchQueue to hand them out.
+        # cat2 is None for an auto-correlation.
+        rank = comm.Get_rank()
+        auto = cat2 is None
+        if auto:
+            cat2 = cat1
+        pnum1 = [c.patch if c.patch is not None else k for k,c in enumerate(cat1)]
+        pnum2 = [c.patch if c.patch is not None else k for k,c in enumerate(cat2)]
+        if auto:
+            jobs = [ (ii,jj) for ii in range(len(cat1)) for jj in range(len(cat1))
+                     if ii == jj or pnum1[ii] < pnum1[jj] ]
+        else:
+            jobs = [ (ii,jj) for ii in range(len(cat1)) for jj in range(len(cat2)) ]
+        # The keys of the catalogs.  For the auto-correlation, both are in cat1.
+        key2 = 0 if auto else 1
+        cats = dict(((0,ii),c) for ii,c in enumerate(cat1))
+        cats.update(((key2,jj),c) for jj,c in enumerate(cat2))
+        names = [ (pnum1[ii],pnum2[jj]) for ii,jj in jobs ]
+        keys = [ set([(0,ii),(key2,jj)]) for ii,jj in jobs ]
+        queue = _PatchQueue(self, comm, jobs, names, keys)
+
+        if rank == 0:
+            info = {}
+            for k,c in cats.items():
+                info[k] = (c.ntot, c._get_center_size())
+                if low_mem:
+                    c.unload()
+            costs = []
+            for ii,jj in jobs:
+                if auto and ii == jj:
+                    costs.append(self._pair_cost(*info[(0,ii)]))
+                else:
+                    costs.append(self._pair_cost(*(info[(0,ii)] + info[(key2,jj)])))
+            queue.serve(costs)
+        else:
+            temp = self.copy()
+            temp.checkpoint = self._checkpoint_file(comm)
+            ckpt = _PatchCheckpoint(self, temp.checkpoint, metric)
+            loaded = []  # The keys of the loaded catalogs, least recently used first.
+            job = queue.request(loaded, ckpt.done)
+            while job is not None:
+                ii, jj = job
+                c1 = cat1[ii]
+                c2 = cat2[jj]
+                i = pnum1[ii]
+                j = pnum2[jj]
+                temp.clear()
+                if auto and ii == jj:
+                    self.logger.info('Rank %d: Process patch %d auto',rank,i)
+                    with treecorr.util.trace('patch %d auto', i):
+                        temp.process_auto(c1,metric,num_threads)
+                    self._add_patch_result(i, i, temp)
+                    self += temp
+                    ckpt.add(i, i, temp)
+                else:
+                    if not self._trivially_zero(c1,c2,metric):
+                        self.logger.info('Rank %d: Process patches %d,%d cross',rank,i,j)
+                        with treecorr.util.trace('patches %d,%d cross', i, j):
+                            temp.process_cross(c1,c2,metric,num_threads)
+                    else:
+                        self.logger.info('Skipping %d,%d pair, which are too far apart ' +
+                                         'for this set of separations',i,j)
+                    if np.sum(temp.npairs) > 0:
+                        self._add_patch_result(i, j, temp)
+                        self += temp
+                        ckpt.add(i, j, temp)
+                    else:
+                        # NNCorrelation needs to add the tot value
+                        self._add_tot(i, j, c1, c2)
+                        ckpt.add_tot(i, j, c1, c2)
+                for k in ((0,ii), (key2,jj)):
+                    if k in loaded:
+                        loaded.remove(k)
+                    loaded.append(k)
+                if low_mem:
+                    for k in loaded:
+                        cats[k].unload()
+                    loaded = []
+                elif self.max_memory is not None:
+                    nbytes = sum(cats[k].nbytes for k in loaded)
+                    while loaded and nbytes > self.max_memory:
+                        c = cats[loaded.pop(0)]
+                        nbytes -= c.nbytes
+                        c.unload()
+                job = queue.request(loaded)
+            ckpt.finish()
+        # Rank 0 receives requests from any process until it has sent None to all of them.
+        # So wait for it to finish, or else it could receive another rank's results below as
+        # a request.
+        comm.Barrier()
+        self._send_results(comm)
+
+    def _send_results(self, comm):
+        # Send all the results back to the rank 0 process, which adds them up.
+        rank = comm.Get_rank()
+        size = comm.Get_size()
+        self.logger.info("Rank %d: Completed jobs %s",rank,list(self.results.keys()))
+        if rank > 0:
+            comm.send(self, dest=0)
+        else:
+            for p in range(1,size):
+                temp = comm.recv(source=p)
+                self += temp
+                self.results.update(temp.results)
+
+    def _set_partition(self, rank, nranks):
+        # Tell the C++ layer to only do the share of the work that belongs to rank.
+        treecorr._lib.SetCorr2Partition(self.corr, self._d1, self._d2, self._bintype,
+                                        rank, nranks)
+
+    def _reduce_arrays(self, comm, arrays):
+        # Add up the arrays from all the processes into the ones on the rank 0 process.
+        # They are combined into a single buffer for one Reduce call, rather than pickling
+        # the whole object as the patch-based split does.
+        arrays = [a for a in arrays if a is not None]
+        buf = np.concatenate([a.ravel() for a in arrays])
+        total = np.empty_like(buf) if comm.Get_rank() == 0 else None
+        comm.Reduce(buf, total, root=0)
+        if total is not None:
+            k = 0
+            for a in arrays:
+                a.ravel()[:] = total[k:k+a.size]
+                k += a.size
+
+    def _process_patches(self, cat1, cat2, metric, num_threads, comm=None):
+        # Process all the pairs of patches with a single call to ProcessPatches2.  This does
+        # all the work in one parallel loop, which balances it across the threads much better
+        # than doing one pair of patches at a time, especially when there are many small pairs.
+        # The results for each pair are written to their own row of the output arrays, which we
+        # then use to fill in the results dict just as _process_all_auto/cross would have done.
+        # If comm is given, each process only does its share of the work items, and the
+        # output arrays are added up on the rank 0 process.
+        from treecorr.util import double_ptr as dp
+        from treecorr.util import long_ptr as lp
+
+        temp = self.copy()
+        temp.clear()
+        temp._set_metric(metric, cat1[0].coords, None if cat2 is None else cat2[0].coords)
+        temp._set_unit_weights(cat1, cat2)
+        temp._set_num_threads(num_threads)
+        if comm is not None:
+            temp._set_partition(comm.Get_rank(), comm.Get_size())
+        min_size, max_size = temp._get_minmax_size()
+
+        def get_field(cat, d, brute):
+            getter = { 1:cat.getNField, 2:cat.getKField, 3:cat.getGField }[d]
+            return getter(min_size, max_size, self.split_method, brute, self.min_top,
+                          self.max_top, temp.coords, lazy=self.lazy_build, presort=self.presort,
+                          spill_dir=self.spill_dir)
+
+        def patch_num(c, k):
+            return c.patch if c.patch is not None else k
+
+        if cat2 is None:
+            f1 = [get_field(c, self._d1, bool(self.brute)) for c in cat1]
+            f2 = None
+            # Use the same order as the loop in _process_all_auto.
+            pairs = []
+            for ii,c1 in enumerate(cat1):
+                pairs.append((ii,ii))
+                for jj,c2 in list(enumerate(cat1))[::-1]:
+                    if patch_num(c1,ii) < patch_num(c2,jj):
+                        pairs.append((ii,jj))
+            cat2 = cat1
+        else:
+            f1 = [get_field(c, self._d1, self.brute is True or self.brute == 1) for c in cat1]
+            f2 = [get_field(c, self._d2, self.brute is True or self.brute == 2) for c in cat2]
+            pairs = [ (ii,jj) for ii in range(len(cat1)) for jj in range(len(cat2)) ]
+
+        npairs = len(pairs)
+        pairs_i = np.array([ p[0] for p in pairs ], dtype=int)
+        pairs_j = np.array([ p[1] for p in pairs ], dtype=int)
+        shape = (npairs, self._nbins)
+        xi = [ None if a is None else np.zeros(shape) for a in temp._get_xi_arrays() ]
+        meanr = np.zeros(shape)
+        meanlogr = np.zeros(shape)
+        weight = np.zeros(shape)
+        counts = np.zeros(shape)
+
+        ffi = treecorr._ffi
+        fields1 = ffi.new('void*[]', [f.data for f in f1])
+        fields2 = ffi.NULL if f2 is None else ffi.new('void*[]', [f.data for f in f2])
+        self.logger.info('Starting %d pairs of patches.',npairs)
+        treecorr._lib.ProcessPatches2(temp.corr, fields1, len(f1),
+                                      fields2, 0 if f2 is None else len(f2),
+                                      npairs, lp(pairs_i), lp(pairs_j),
+                                      dp(xi[0]), dp(xi[1]), dp(xi[2]), dp(xi[3]),
+                                      dp(meanr), dp(meanlogr), dp(weight), dp(counts),
+                                      self.output_dots, self._d1, self._d2,
+                                      temp._coords, self._bintype, temp._metric)
+        if comm is not None:
+            temp._set_partition(0, 1)
+            self._reduce_arrays(comm, xi + [meanr, meanlogr, weight, counts])
+        stats = temp._stats.copy()
+
+        for k, (ii,jj) in enumerate(pairs):
+            c1 = cat1[ii]
+            c2 = cat2[jj]
+            i = patch_num(c1,ii)
+            j = patch_num(c2,jj)
+            is_auto = f2 is None and ii == jj
+            if is_auto or np.sum(counts[k]) > 0:
+                temp.clear()
+                for a, b in zip(temp._get_xi_arrays(), xi):
+                    if a is not None:
+                        a.ravel()[:] = b[k]
+                temp.meanr.ravel()[:] = meanr[k]
+                temp.meanlogr.ravel()[:] = meanlogr[k]
+                temp.weight.ravel()[:] = weight[k]
+                temp.npairs.ravel()[:] = counts[k]
+                temp._set_patch_tot(c1, None if is_auto else c2)
+                self._add_patch_result(i, j, temp)
+                self += temp
+            else:
+                # NNCorrelation needs to add the tot value
+                self._add_tot(i, j, c1, c2)
+        _add_traversal_stats(self._stats, stats)
+
+    def _set_tagged_cats(self, cat1, cat2):
+        # Keep the full catalogs that process was given, before they are split into patches,
+        # for _process_tagged.
+        if self.patch_tagged and not isinstance(cat1,list) and not isinstance(cat2,list):
+            self._tagged_cats = (cat1, cat2)
+
+    def _process_tagged(self, tagged, cat1, cat2, metric, num_threads, comm, low_mem):
+        # Process all the pairs of patches with a single call to ProcessTagged2, using one
+        # field for each of the full catalogs in tagged, which _set_tagged_cats saved.  cat1
+        # and cat2 are the lists of patches, which are used for the patch numbers and tot
+        # values.  cat2 is None for an auto-correlation.  Returns whether this worked.
+        # If comm is given, each process only does its share of the work items, as with
+        # mpi_split='cells', and the output arrays are added up on the rank 0 process.
+        from treecorr.util import double_ptr as dp
+        from treecorr.util import long_ptr as lp
+
+        full1, full2 = tagged
+        fulls = [full1] if cat2 is None else [full1, full2]
+        if (not self._use_patch_engine(None, low_mem) or
+                any(np.ndim(c.patch) != 1 for c in fulls)):
+            # This also needs a patch number for each object.
+            self.logger.warning("Cannot use patch_tagged with these options.  "+
+                                "Processing the patches separately instead.")
+            return False
+        npatch1 = full1._npatch
+        npatch2 = npatch1 if cat2 is None else full2._npatch
+
+        temp = self.copy()
+        temp.clear()
+        temp._set_metric(metric, full1.coords, None if cat2 is None else full2.coords)
+        temp._set_unit_weights(full1, None if cat2 is None else full2)
+        temp._set_num_threads(num_threads)
+        if comm is not None:
+            temp._set_partition(comm.Get_rank(), comm.Get_size())
+        min_size, max_size = temp._get_minmax_size()
+
+        def get_field(cat, d):
+            getter = { 1:cat.getNField, 2:cat.getKField, 3:cat.getGField }[d]
+            return getter(min_size, max_size, self.split_method, False, self.min_top,
+                          self.max_top, temp.coords, lazy=self.lazy_build, presort=self.presort,
+                          spill_dir=self.spill_dir)
+
+        f1 = get_field(full1, self._d1)
+        patch1 = np.ascontiguousarray(full1.patch, dtype=np.int64)
+        if cat2 is None:
+            f2 = None
+            patch2 = None
+        else:
+            f2 = get_field(full2, self._d2)
+            patch2 = np.ascontiguousarray(full2.patch, dtype=np.int64)
+
+        shape = (npatch1 * npatch2, self._nbins)
+        xi = [ None if a is None else np.zeros(shape) for a in temp._get_xi_arrays() ]
+        meanr = np.zeros(shape)
+        meanlogr = np.zeros(shape)
+        weight = np.zeros(shape)
+        counts = np.zeros(shape)
+
+        self.logger.info('Starting %d patches in a single pass.',npatch1)
+        ok = treecorr._lib.ProcessTagged2(temp.corr, f1.data,
+                                          treecorr._ffi.NULL if f2 is None else f2.data,
+                                          lp(patch1), lp(patch2), npatch1, npatch2,
+                                          dp(xi[0]), dp(xi[1]), dp(xi[2]), dp(xi[3]),
+                                          dp(meanr), dp(meanlogr), dp(weight), dp(counts),
+                                          self.output_dots, self._d1, self._d2,
+                                          temp._coords, self._bintype, temp._metric)
+        if comm is not None:
+            temp._set_partition(0, 1)
+        if not ok:
+            self.logger.warning("Some leaf cells have objects in more than one patch.  "+
+                                "Processing the patches separately instead.")
+            return False
+        if comm is not None:
+            self._reduce_arrays(comm, xi + [meanr, meanlogr, weight, counts])
+        stats = temp._stats.copy()
+
+        def patch_num(c, k):
+            return c.patch if c.patch is not None else k
+
+        pcat1 = dict((patch_num(c,k), c) for k,c in enumerate(cat1))
+        pcat2 = pcat1 if cat2 is None else dict((patch_num(c,k), c) for k,c in enumerate(cat2))
+        for i in sorted(pcat1):
+            for j in sorted(pcat2):
+                if cat2 is None and i > j:
+                    continue
+                c1 = pcat1[i]
+                c2 = pcat2[j]
+                k = i * npatch2 + j
+                is_auto = cat2 is None and i == j
+                if is_auto or np.sum(counts[k]) > 0:
+                    temp.clear()
+                    for a, b in zip(temp._get_xi_arrays(), xi):
+                        if a is not None:
+                            a.ravel()[:] = b[k]
+                    temp.meanr.ravel()[:] = meanr[k]
+                    temp.meanlogr.ravel()[:] = meanlogr[k]
+                    temp.weight.ravel()[:] = weight[k]
+                    temp.npairs.ravel()[:] = counts[k]
+                    temp._set_patch_tot(c1, None if is_auto else c2)
+                    self._add_patch_result(i, j, temp)
+                    self += temp
+                else:
+                    # NNCorrelation needs to add the tot value
+                    self._add_tot(i, j, c1, c2)
+        _add_traversal_stats(self._stats, stats)
+        return True
+
+    def _cache_file(self, cat1, cat2, metric, comm, low_mem):
+        # The file in cache_dir with the results for these catalogs, or None if not caching.
+        if (self.cache_dir is None or comm is not None or self.max_time or self.max_pairs):
+            return None
+        import hashlib
+        h = hashlib.sha1()
+        h.update(repr((type(self).__name__, treecorr.__version__, metric)).encode())
+        config = sorted((k,v) for k,v in self.config.items() if k not in _cache_ignore_keys)
+        h.update(repr(config).encode())
+        for cats in (cat1, cat2):
+            if cats is None: continue
+            h.update(repr(len(cats)).encode())
+            for c in cats:
+                _hash_catalog(h, c)
+                if low_mem:
+                    c.unload()
+        return os.path.join(self.cache_dir, '%s_%s.pkl'%(type(self).__name__, h.hexdigest()))
+
+    def _read_cache(self, cache_file):
+        # If the cache has the results for this calculation, use them.  Returns whether it did.
+        if cache_file is None or not os.path.exists(cache_file):
+            return False
+        try:
+            with open(cache_file, 'rb') as fid:
+                saved = pickle.load(fid)
+        except Exception as e:
+            self.logger.warning("Ignoring cache file %s: %s", cache_file, e)
+            return False
+        self.logger.info("Using cached results from %s", cache_file)
+        for key, value in saved.items():
+            current = getattr(self, key, None)
+            if (isinstance(value, np.ndarray) and isinstance(current, np.ndarray) and
+                    current.shape == value.shape):
+                # The C++ layer has pointers to these arrays, so copy the values in place.
+                current[...] = value
+            else:
+                setattr(self, key, value)
+        return True
+
+    def _write_cache(self, cache_file):
+        # Save the accumulated results (before finalize) to the cache.
+        if cache_file is None:
+            return
+        saved = {}
+        for key, value in self.__dict__.items():
+            if isinstance(value, np.ndarray) or key in _cache_attrs:
+                saved[key] = value
+        if not os.path.exists(self.cache_dir):
+            os.makedirs(self.cache_dir)
+        # Write to a temporary file and then rename it, so another process reading the cache
+        # never sees a partially written file.
+        self.logger.info("Writing results to cache file %s", cache_file)
+        tmp_name = cache_file + '.%d.tmp'%os.getpid()
+        with open(tmp_name, 'wb') as fid:
+            pickle.dump(saved, fid)
+        os.rename(tmp_name, cache_file)
+
     def _process_all_auto(self, cat1, metric, num_threads, comm, low_mem):
+        # The budget for max_time and max_pairs is shared by all the pairs of patches.
+        with self._budget.run():
+            tagged = self._tagged_cats
+            self._tagged_cats = None
+            if self.autotune:
+                self._autotune(cat1, None, metric, num_threads)
+            cache_file = self._cache_file(cat1, None, metric, comm, low_mem)
+            if not self._read_cache(cache_file):
+                if (tagged is None or len(cat1) == 1 or self._async.publish_time or
+                        not self._process_tagged(tagged, cat1, None, metric, num_threads,
+                                                 comm, low_mem)):
+                    self._process_all_auto_patches(cat1, metric, num_threads, comm, low_mem)
+                self._write_cache(cache_file)
+            self._async.freeze(self)
+
+    def _process_all_cross(self, cat1, cat2, metric, num_threads, comm, low_mem):
+        # The budget for max_time and max_pairs is shared by all the pairs of patches.
+        with self._budget.run():
+            tagged = self._tagged_cats
+            self._tagged_cats = None
+            if self.autotune:
+                self._autotune(cat1, cat2, metric, num_threads)
+            cache_file = self._cache_file(cat1, cat2, metric, comm, low_mem)
+            if not self._read_cache(cache_file):
+                if (tagged is None or len(cat1) * len(cat2) == 1 or self._async.publish_time or
+                        not self._process_tagged(tagged, cat1, cat2, metric, num_threads,
+                                                 comm, low_mem)):
+                    self._process_all_cross_patches(cat1, cat2, metric, num_threads, comm, low_mem)
+                self._write_cache(cache_file)
+            self._async.freeze(self)
+
+    def _autotune_key(self, cat1, cat2, metric, num_threads):
+        # The choices are saved for each kind of correlation, coordinates, metric and binning,
+        # the number of threads, and the size of the catalogs to the nearest factor of 2.
+        if metric is None:
+            metric = treecorr.config.get(self.config,'metric',str,'Euclidean')
+        coords, metric = treecorr.util.parse_metric(
+                metric, cat1[0].coords, None if cat2 is None else cat2[0].coords)
+        if num_threads is None:
+            num_threads = self.config.get('num_threads',None)
+        if num_threads is None:
+            num_threads = treecorr.get_omp_threads()
+        ntot = sum(c.ntot for c in cat1) + (0 if cat2 is None else sum(c.ntot for c in cat2))
+        return ' '.join(str(k) for k in [
+                self.__class__.__name__, coords, metric, self.bin_type, self._nbins,
+                '%.4g'%self.b, 'cross' if cat2 is not None else 'auto',
+                int(round(math.log(max(ntot,1), 2))), num_threads])
+
+    def _autotune_trial(self, cat1, cat2, metric, num_threads, params):
+        # Time a short run on the first patch with the given parameters.  Returns the number of
+        # pairs per second.  The fields are built first, so that time isn't included.
+        # The config can't be given None to turn off an option, so remove those instead.
+        config = dict(self.config)
+        for key in ['max_pairs', 'checkpoint', 'cache_dir', 'grid_min_sep']:
+            config.pop(key, None)
+        config.update(autotune=False, max_time=self.autotune_time, verbose=0)
+        config.update(params)
+        temp = self.__class__(config)
+        c1 = cat1[0]
+        c2 = None if cat2 is None else cat2[0]
+        temp._set_metric(metric, c1.coords, None if c2 is None else c2.coords)
+        temp._set_num_threads(num_threads)
+        temp._get_field(c1, temp._d1, bool(temp.brute))
+        if c2 is not None:
+            temp._get_field(c2, temp._d2, bool(temp.brute))
+        t0 = time.time()
+        if c2 is None:
+            temp.process_auto(c1, metric=metric, num_threads=num_threads)
+        else:
+            temp.process_cross(c1, c2, metric=metric, num_threads=num_threads)
+        t1 = time.time()
+        return np.sum(temp.npairs) / max(t1-t0, 1.e-6)
+
+    def _autotune(self, cat1, cat2, metric, num_threads):
+        # Choose the split_method, min_top and split_factor with the most pairs per second,
+        # or use the ones saved in autotune_file for the same kind of calculation.
+        # Each parameter is varied in turn, keeping the best values of the others.
+        key = self._autotune_key(cat1, cat2, metric, num_threads)
+        saved = _read_autotune(self.autotune_file)
+        if key in saved:
+            best = saved[key]
+            self.logger.info("Using autotune choices for %s: %s", key, best)
+        else:
+            self.logger.info("Autotuning for %s", key)
+            nthreads = int(key.split()[-1])
+            min_top = self.min_top
+            if min_top is None:
+                min_top = max(3, int.bit_length(nthreads-1))
+            min_top = min(min_top, self.max_top)
+            choices = [
+                ('split_method', ['mean', 'median', 'middle']),
+                ('min_top', sorted(set(min(max(min_top+d, 0), self.max_top)
+                                       for d in [-2, 0, 2, 4]))),
+                ('split_factor', [0.4, 0.5, 0.585, 0.7, 0.85]),
+            ]
+            best = dict(split_method=self.split_method, min_top=min_top,
+                        split_factor=self.split_factor)
+            for name, values in choices:
+                rates = {}
+                for value in values:
+                    params = dict(best)
+                    params[name] = value
+                    rates[value] = self._autotune_trial(cat1, cat2, metric, num_threads, params)
+                    self.logger.debug("autotune %s: %s pairs/sec", params, rates[value])
+                best[name] = max(values, key=lambda v: rates[v])
+            self.logger.info("Autotune chose %s", best)
+            saved[key] = best
+            _write_autotune(self.autotune_file, saved)
+        self.split_method = best['split_method']
+        self.min_top = best['min_top']
+        self.split_factor = best['split_factor']
+        if hasattr(self, '_corr'):
+            self._set_bin_options()
+
+    def _process_all_auto_patches(self, cat1, metric, num_threads, comm, low_mem):
 
         def is_my_job(my_indices, i, j, n):
             # Helper function to figure out if a given (i,j) job should be done on the
@@ -511,7 +2375,13 @@ class BinnedCorr2(object):
                 self.logger.info("Rank %d: Job (%d,%d) is mine.",rank,i,j)
             return ret
 
-        if len(cat1) == 1:
+        if len(cat1) == 1 and self._cell_split(comm, low_mem):
+            self._set_partition(comm.Get_rank(), comm.Get_size())
+            self.process_auto(cat1[0],metric,num_threads)
+            self._set_partition(0, 1)
+            self._reduce_arrays(comm, self._get_xi_arrays() +
+                                [self.meanr, self.meanlogr, self.weight, self.npairs])
+        elif len(cat1) == 1:
             self.process_auto(cat1[0],metric,num_threads)
         else:
             # When patch processing, keep track of the pair-wise results.
@@ -519,6 +2389,18 @@ class BinnedCorr2(object):
                 self.npatch1 = self.npatch2 = len(cat1)
             n = self.npatch1
 
+            if self._cell_split(comm, low_mem):
+                self._process_patches(cat1, None, metric, num_threads, comm)
+                return
+
+            if comm is not None and self.mpi_split == 'queue' and comm.Get_size() > 1:
+                self._process_queue(cat1, None, metric, num_threads, comm, low_mem)
+                return
+
+            if self._use_patch_engine(comm, low_mem):
+                self._process_patches(cat1, None, metric, num_threads)
+                return
+
             # Setup for deciding when this is my job.
             if comm:
                 size = comm.Get_size()
@@ -529,49 +2411,77 @@ class BinnedCorr2(object):
                 my_indices = None
 
             temp = self.copy()
+            temp.checkpoint = self._checkpoint_file(comm)
+            ckpt = _PatchCheckpoint(self, temp.checkpoint, metric)
+            pnum = [c.patch if c.patch is not None else k for k,c in enumerate(cat1)]
+            todo = set((ii,jj) for ii in range(len(cat1)) for jj in range(len(cat1))
+                       if (ii == jj or pnum[ii] < pnum[jj]) and
+                       is_my_job(my_indices, pnum[ii], pnum[jj], n) and
+                       not ckpt.is_done(pnum[ii], pnum[jj]))
+            self._share_budget([(cat1[ii], cat1[jj]) for ii,jj in todo], metric)
+            pmem = None
+            if self.max_memory is not None or (low_mem and self.prefetch):
+                # The same order as the loop below.
+                jobs = []
+                for ii,c1 in enumerate(cat1):
+                    jobs.append([c1] if (ii,ii) in todo else [])
+                    jobs.extend([[c1,c2] if (ii,jj) in todo else []
+                                 for jj,c2 in list(enumerate(cat1))[::-1]
+                                 if pnum[ii] < pnum[jj]])
+                pmem = _PatchMemory(self, jobs)
             for ii,c1 in enumerate(cat1):
-                i = c1.patch if c1.patch is not None else ii
-                if is_my_job(my_indices, i, i, n):
+                i = pnum[ii]
+                if (ii,ii) in todo:
+                    if pmem is not None:
+                        pmem.start_job(temp)
                     temp.clear()
                     self.logger.info('Process patch %d auto',i)
-                    temp.process_auto(c1,metric,num_threads)
-                    self.results[(i,i)] = temp._copy_for_results()
-                    self += temp
+                    self._start_patch_job(temp)
+                    with treecorr.util.trace('patch %d auto', i):
+                        temp.process_auto(c1,metric,num_threads)
+                    with self._async.finish_job():
+                        self._add_patch_result(i, i, temp)
+                        self += temp
+                        ckpt.add(i, i, temp)
+                if pmem is not None:
+                    pmem.finish_job()
                 for jj,c2 in list(enumerate(cat1))[::-1]:
-                    j = c2.patch if c2.patch is not None else jj
-                    if i < j and is_my_job(my_indices, i, j, n):
+                    j = pnum[jj]
+                    if i < j and (ii,jj) in todo:
+                        if pmem is not None:
+                            pmem.start_job(temp)
                         temp.clear()
                         if not self._trivially_zero(c1,c2,metric):
                             self.logger.info('Process patches %d,%d cross',i,j)
-                            temp.process_cross(c1,c2,metric,num_threads)
+                            self._start_patch_job(temp)
+                            with treecorr.util.trace('patches %d,%d cross', i, j):
+                                temp.process_cross(c1,c2,metric,num_threads)
                         else:
                             self.logger.info('Skipping %d,%d pair, which are too far apart ' +
                                              'for this set of separations',i,j)
-                        if np.sum(temp.npairs) > 0:
-                            self.results[(i,j)] = temp._copy_for_results()
-                            self += temp
-                        else:
-                            # NNCorrelation needs to add the tot value
-                            self._add_tot(i, j, c1, c2)
-                        if low_mem and jj != ii+1:
+                        with self._async.finish_job():
+                            if np.sum(temp.npairs) > 0:
+                                self._add_patch_result(i, j, temp)
+                                self += temp
+                                ckpt.add(i, j, temp)
+                            else:
+                                # NNCorrelation needs to add the tot value
+                                self._add_tot(i, j, c1, c2)
+                                ckpt.add_tot(i, j, c1, c2)
+                        if low_mem and pmem is None and jj != ii+1:
                             # Don't unload i+1, since that's the next one we'll need.
                             c2.unload()
-                if low_mem:
+                    if i < j and pmem is not None:
+                        pmem.finish_job()
+                if low_mem and pmem is None:
                     c1.unload()
+            if pmem is not None:
+                pmem.finish(low_mem)
+            ckpt.finish()
             if comm is not None:
-                rank = comm.Get_rank()
-                size = comm.Get_size()
-                self.logger.info("Rank %d: Completed jobs %s",rank,list(self.results.keys()))
-                # Send all the results back to rank 0 process.
-                if rank > 0:
-                    comm.send(self, dest=0)
-                else:
-                    for p in range(1,size):
-                        temp = comm.recv(source=p)
-                        self += temp
-                        self.results.update(temp.results)
+                self._send_results(comm)
 
-    def _process_all_cross(self, cat1, cat2, metric, num_threads, comm, low_mem):
+    def _process_all_cross_patches(self, cat1, cat2, metric, num_threads, comm, low_mem):
 
         def is_my_job(my_indices, i, j, n1, n2):
             # Helper function to figure out if a given (i,j) job should be done on the
@@ -604,6 +2514,12 @@ class BinnedCorr2(object):
                 if c1.ntot != c2.ntot:
                     raise ValueError("Number of objects must be equal for pairwise.")
                 self.process_pairwise(c1,c2,metric,num_threads)
+        elif len(cat1) == 1 and len(cat2) == 1 and self._cell_split(comm, low_mem):
+            self._set_partition(comm.Get_rank(), comm.Get_size())
+            self.process_cross(cat1[0],cat2[0],metric,num_threads)
+            self._set_partition(0, 1)
+            self._reduce_arrays(comm, self._get_xi_arrays() +
+                                [self.meanr, self.meanlogr, self.weight, self.npairs])
         elif len(cat1) == 1 and len(cat2) == 1:
             self.process_cross(cat1[0],cat2[0],metric,num_threads)
         else:
@@ -615,6 +2531,18 @@ class BinnedCorr2(object):
             if self.npatch1 != self.npatch2 and self.npatch1 != 1 and self.npatch2 != 1:
                 raise RuntimeError("Cross correlation requires both catalogs use the same patches.")
 
+            if self._cell_split(comm, low_mem):
+                self._process_patches(cat1, cat2, metric, num_threads, comm)
+                return
+
+            if comm is not None and self.mpi_split == 'queue' and comm.Get_size() > 1:
+                self._process_queue(cat1, cat2, metric, num_threads, comm, low_mem)
+                return
+
+            if self._use_patch_engine(comm, low_mem):
+                self._process_patches(cat1, cat2, metric, num_threads)
+                return
+
             # Setup for deciding when this is my job.
             n1 = self.npatch1
             n2 = self.npatch2
@@ -630,40 +2558,55 @@ class BinnedCorr2(object):
                 my_indices = None
 
             temp = self.copy()
+            temp.checkpoint = self._checkpoint_file(comm)
+            ckpt = _PatchCheckpoint(self, temp.checkpoint, metric)
+            pnum1 = [c.patch if c.patch is not None else k for k,c in enumerate(cat1)]
+            pnum2 = [c.patch if c.patch is not None else k for k,c in enumerate(cat2)]
+            todo = set((ii,jj) for ii in range(len(cat1)) for jj in range(len(cat2))
+                       if is_my_job(my_indices, pnum1[ii], pnum2[jj], n1, n2) and
+                       not ckpt.is_done(pnum1[ii], pnum2[jj]))
+            self._share_budget([(cat1[ii], cat2[jj]) for ii,jj in todo], metric)
+            pmem = None
+            if self.max_memory is not None or (low_mem and self.prefetch):
+                pmem = _PatchMemory(self, [[c1,c2] if (ii,jj) in todo else []
+                                           for ii,c1 in enumerate(cat1)
+                                           for jj,c2 in enumerate(cat2)])
             for ii,c1 in enumerate(cat1):
-                i = c1.patch if c1.patch is not None else ii
+                i = pnum1[ii]
                 for jj,c2 in enumerate(cat2):
-                    j = c2.patch if c2.patch is not None else jj
-                    if is_my_job(my_indices, i, j, n1, n2):
+                    j = pnum2[jj]
+                    if (ii,jj) in todo:
+                        if pmem is not None:
+                            pmem.start_job(temp)
                         temp.clear()
                         if not self._trivially_zero(c1,c2,metric):
                             self.logger.info('Process patches %d,%d cross',i,j)
-                            temp.process_cross(c1,c2,metric,num_threads)
+                            self._start_patch_job(temp)
+                            with treecorr.util.trace('patches %d,%d cross', i, j):
+                                temp.process_cross(c1,c2,metric,num_threads)
                         else:
                             self.logger.info('Skipping %d,%d pair, which are too far apart ' +
                                              'for this set of separations',i,j)
-                        if np.sum(temp.npairs) > 0:
-                            self.results[(i,j)] = temp._copy_for_results()
-                            self += temp
-                        else:
-                            # NNCorrelation needs to add the tot value
-                            self._add_tot(i, j, c1, c2)
-                        if low_mem:
+                        with self._async.finish_job():
+                            if np.sum(temp.npairs) > 0:
+                                self._add_patch_result(i, j, temp)
+                                self += temp
+                                ckpt.add(i, j, temp)
+                            else:
+                                # NNCorrelation needs to add the tot value
+                                self._add_tot(i, j, c1, c2)
+                                ckpt.add_tot(i, j, c1, c2)
+                        if low_mem and pmem is None:
                             c2.unload()
-                if low_mem:
+                    if pmem is not None:
+                        pmem.finish_job()
+                if low_mem and pmem is None:
                     c1.unload()
+            if pmem is not None:
+                pmem.finish(low_mem)
+            ckpt.finish()
             if comm is not None:
-                rank = comm.Get_rank()
-                size = comm.Get_size()
-                self.logger.info("Rank %d: Completed jobs %s",rank,list(self.results.keys()))
-                # Send all the results back to rank 0 process.
-                if rank > 0:
-                    comm.send(self, dest=0)
-                else:
-                    for p in range(1,size):
-                        temp = comm.recv(source=p)
-                        self += temp
-                        self.results.update(temp.results)
+                self._send_results(comm)
 
     def _getStatLen(self):
         # The length of the array that will be returned by _getStat.
@@ -728,6 +2671,403 @@ class BinnedCorr2(object):
         """
         return estimate_multi_cov([self], method)
 
+    @property
+    def frac_done(self):
+        """The fraction of the top-level pairs of cells that were done since the last `clear`,
+        i.e. in the most recent `process` call.  This is only less than 1 if max_time or
+        max_pairs is set.
+        """
+        return self._budget.frac_done
+
+    def process_async(self, *args, **kwargs):
+        """Start the `process` call on a background thread, and return a future for it.
+
+        The arguments are the same as for `process`, plus an optional callback.  The C++
+        layer releases the GIL, so the calling thread is free to do other things, like starting
+        other correlations, which then run at the same time.  E.g.
+
+            >>> f1 = nn.process_async(cat1)
+            >>> f2 = gg.process_async(cat1)
+            >>> for key, res in f1.patch_results():
+            ...     # Do something with the results for each pair of patches as they finish.
+            >>> f2.result()
+
+        The future's ``result()`` returns this object after the processing is finished.
+        ``cancel()`` stops the processing soon after, even if it is already running, in which
+        case the partial results should not be used.  ``patch_results()`` yields the
+        (key, result) of each pair of patches as they finish, where key is the (i,j) in
+        `results`, so e.g. the covariance estimates can start with the ones that are done.
+
+        The calls run on a pool of background python threads, and they share the OpenMP
+        threads according to `set_phase_threads`.  This object shouldn't be used for anything
+        else until the future is done.
+
+        Parameters:
+            args:               The positional arguments for `process`.
+            callback (function): If given, a function to call with (key, result) for each pair
+                                of patches as they finish.  It is called on the background
+                                thread.  (default: None)
+            publish_time (float): If given, how often in seconds to make the results so far
+                                available to the future's ``snapshot()``.  The top-level pairs
+                                of cells are then done in chunks, and after each one, its
+                                results are added to the output arrays.  This doesn't use the
+                                native multi-patch engine, since it only has results at the
+                                end.  (default: None)
+            kwargs:             The keyword arguments for `process`.
+
+        Returns:
+            future:             A ``concurrent.futures.Future`` for the result.
+        """
+        callback = kwargs.pop('callback', None)
+        publish_time = kwargs.pop('publish_time', None)
+        future = _make_process_future(self, callback, publish_time)
+        treecorr.util._submit_process(future._run, args, kwargs)
+        return future
+
+    def _add_patch_result(self, i, j, temp):
+        # Save the results of the pair of patches i,j in temp.
+        self.results[(i,j)] = temp._copy_for_results()
+        self._async.patch_done((i,j), self.results[(i,j)])
+
+    def _share_budget(self, jobs, metric):
+        # Split max_time and max_pairs between the pairs of catalogs in jobs.  cf. _BudgetState.
+        # The ones that are too far apart to have any pairs don't use any of the budget.
+        if self.max_time or self.max_pairs:
+            self._budget.share_jobs(sum(1 for c1,c2 in jobs
+                                        if c1 is c2 or not self._trivially_zero(c1,c2,metric)))
+
+    def _start_patch_job(self, temp):
+        # Call this before the C++ call for the next job from _share_budget.  This gives temp
+        # its share of the budget, and lets ProcessFuture.snapshot see its results so far.
+        if self.max_time or self.max_pairs:
+            self._budget.next_job()
+            temp._set_budget()
+        self._async.start_job(temp)
+
+    def _set_budget(self):
+        # Tell the C++ layer about max_time and max_pairs, where to keep track of how much of
+        # them has been used, and where to check for a cancelled process_async call.
+        from treecorr.util import double_ptr as dp
+        from treecorr.util import long_ptr as lp
+        share = self._budget.share
+        treecorr._lib.SetCorr2Budget(self.corr, self._d1, self._d2, self._bintype,
+                                     (self.max_time or 0.) * share, (self.max_pairs or 0.) * share,
+                                     dp(self._budget.used), lp(self._async.cancel))
+
+    @property
+    def stats(self):
+        """A dict of counters describing the tree traversal in all the processing calls since
+        the last `clear`.  These are useful for tuning bin_slop, min_top and max_top, and for
+        seeing how well the work was spread over the threads.  The keys are:
+
+            - nodes: The number of pairs of cells (or single cells for auto-correlations)
+              that were visited.
+            - split1, split2: The number of times only the first or second cell was split.
+            - split3: Not used for two-point correlations.
+            - split_multi: The number of times both cells were split.
+            - rpar_exit, small_exit, large_exit: The number of times the recursion stopped
+              because rpar was out of range, or the separation was too small or too large.
+            - range_exit: Not used for two-point correlations.
+            - single_bin: The number of pairs of cells that were small enough to drop into
+              a single bin.
+            - direct: The number of pairs of cells (or leaves) that were added to the bins.
+            - leaf_pairs: The number of pairs of leaves that were checked directly because
+              both cells had at most leaf_size objects.
+            - nitems: The number of top-level pairs of cells that were done.
+            - item_time: The total time in seconds spent on the top-level pairs.
+            - max_item_time: The longest time spent on a single top-level pair.
+            - max_thread_time: The time spent on top-level pairs by the busiest thread,
+              summed over the processing calls.
+            - tasks: The number of OpenMP tasks that big pairs of cells were split into.
+            - nthreads: The number of threads used.
+
+        The times do not include the work that was split off into tasks.  The ratio
+        max_thread_time / (item_time / nthreads) is a measure of the load imbalance, which
+        would be 1 if the work were evenly spread over the threads.
+        """
+        return dict(zip(_traversal_stats_names, self._stats))
+
+    @property
+    def nbytes(self):
+        """The number of bytes of memory currently used by this correlation function.
+
+        This includes the output arrays, the results for each pair of patches, and the
+        accumulators in the C++ layer, which include a copy of the bins for each thread.
+        It doesn't include the fields of the catalogs (cf. `Catalog.nbytes`).
+        """
+        n = _arrays_nbytes(self)
+        n += sum(_arrays_nbytes(r) for r in self.results.values())
+        if hasattr(self, '_corr'):
+            n += treecorr._lib.GetCorr2NBytes(self._corr, self._d1, self._d2, self._bintype,
+                                              self._nbins)
+        return n
+
+    def estimate_nbytes(self, ntot1, ntot2=None, num_threads=None, coords='3d'):
+        """Estimate the peak number of bytes of memory needed to process catalogs of the
+        given sizes.
+
+        This is the memory for the fields (cf. `Field.estimate_nbytes`), the output arrays, and
+        a copy of the accumulators for each thread.  It doesn't include the catalog arrays
+        themselves.  For catalogs with patches that are processed with ``low_mem`` or
+        ``max_memory``, use the number of objects in the largest patches, since only a few of
+        them need to be loaded at a time.
+
+        Parameters:
+            ntot1 (int):        The number of objects in the first catalog.
+            ntot2 (int):        The number of objects in the second catalog, if any.
+                                (default: None)
+            num_threads (int):  How many OpenMP threads will be used. (default: use the number
+                                of cpu cores; this value can also be given in the constructor
+                                in the config dict.)
+            coords (str):       The kind of coordinate system. (default: '3d')
+
+        Returns:
+            The estimated number of bytes.
+        """
+        if num_threads is None:
+            num_threads = self.config.get('num_threads',None)
+        if num_threads is None:
+            num_threads = treecorr.get_omp_threads()
+        n = treecorr.Field.estimate_nbytes(ntot1, coords, self._d1)
+        if ntot2 is not None:
+            n += treecorr.Field.estimate_nbytes(ntot2, coords, self._d2)
+        n += _arrays_nbytes(self)
+        thread_nbytes = treecorr._lib.GetCorr2NBytes(treecorr._ffi.NULL, self._d1, self._d2,
+                                                     self._bintype, self._nbins)
+        n += int(num_threads) * thread_nbytes
+        return n
+
+    def _set_stats(self):
+        # Tell the C++ layer where to add the traversal stats.
+        from treecorr.util import double_ptr as dp
+        assert treecorr._lib.GetNTraversalStats() == len(self._stats)
+        treecorr._lib.SetCorr2Stats(self._corr, self._d1, self._d2, self._bintype,
+                                    dp(self._stats))
+
+    def _add_stats(self, other):
+        _add_traversal_stats(self._stats, other._stats)
+
+    def _checkpoint_file(self, comm=None):
+        # The checkpoint file to use.  With MPI, each rank needs its own.
+        if self.checkpoint is None or comm is None:
+            return self.checkpoint
+        else:
+            return self.checkpoint + '.%d'%comm.Get_rank()
+
+    def _set_checkpoint(self):
+        # Tell the C++ layer where to write the checkpoints of each processing call.
+        # Also how often to publish the results so far for ProcessFuture.snapshot.
+        file_name = (self.checkpoint + '.cells') if self.checkpoint is not None else ''
+        treecorr._lib.SetCorr2Checkpoint(self._corr, self._d1, self._d2, self._bintype,
+                                         file_name.encode(), self.checkpoint_time,
+                                         self._async.publish_time)
+
+    def _copy_results(self, other):
+        # Copy the output arrays of other's C++ object to ours, as of the last time it
+        # published them.  cf. _AsyncState.
+        from treecorr.util import double_ptr as dp
+        arrays = self._get_xi_arrays() + [self.meanr, self.meanlogr, self.weight, self.npairs]
+        treecorr._lib.CopyCorr2Results(other.corr, other._d1, other._d2, other._bintype,
+                                       *[dp(a) for a in arrays])
+
+    def _check_processed(self, ok):
+        # The C++ layer returns 0 if it could not read or write the checkpoint file.
+        if not ok:
+            raise OSError("Unable to read or write the checkpoint file %s.cells"%self.checkpoint)
+
+    def _set_bin_options(self):
+        # Tell the C++ layer whether to use the table of bin edges and whether to skip meanlogr.
+        treecorr._lib.SetCorr2BinOptions(self._corr, self._d1, self._d2, self._bintype,
+                                         self.fast_bins, self.skip_meanlogr)
+        treecorr._lib.SetCorr2SplitFactor(self._corr, self._d1, self._d2, self._bintype,
+                                          self.split_factor)
+
+    def _set_unit_weights(self, cat1, cat2=None):
+        # If none of the catalogs have weights, w = n for every cell, so the C++ layer can use
+        # the counts for the weight of each pair rather than multiplying the weights.
+        # cat1 and cat2 may also be lists of catalogs (e.g. the patches).
+        cats = []
+        for c in [cat1, cat2]:
+            if c is None: continue
+            cats.extend(c if isinstance(c, list) else [c])
+        unit_weights = not any(c.nontrivial_w for c in cats)
+        treecorr._lib.SetCorr2UnitWeights(self.corr, self._d1, self._d2, self._bintype,
+                                          unit_weights)
+
+    def _grid_start(self):
+        # The first bin to compute on the mesh for grid_min_sep, or nbins if the mesh isn't used.
+        if (self.grid_min_sep is None or self.brute or self.coords != 'flat' or
+                self.metric not in ['Euclidean', 'Periodic'] or self.bin_type == 'TwoD'):
+            return self._nbins
+        left = self.left_edges * self._sep_units
+        return int(np.searchsorted(left, self.grid_min_sep * self._sep_units * (1.-1.e-10)))
+
+    def _process_grid(self, cat1, cat2):
+        # For grid_min_sep, accumulate the bins above that scale by painting the catalogs onto
+        # a mesh and correlating them with FFTs, and tell the C++ layer to only do the pairs
+        # below it with the tree until _finish_grid.  cat2 is None for an auto-correlation.
+        if self.grid_min_sep is None:
+            return
+        k0 = self._grid_start()
+        max_sep = self._max_sep if k0 == self._nbins else self.left_edges[k0] * self._sep_units
+        treecorr._lib.SetCorr2MaxSep(self.corr, self._d1, self._d2, self._bintype, max_sep)
+        if k0 == self._nbins:
+            self.logger.info("grid_min_sep is not used for these catalogs and options.")
+            return
+        self.logger.info("Using a mesh for the %d bins above %g", self._nbins-k0, max_sep)
+
+        # Set up the mesh.  For the Periodic metric, it covers one period, and the FFTs do
+        # the wrapping.  Otherwise, it covers all the objects, plus enough padding that the
+        # offsets up to max_sep don't wrap around.
+        cats = [cat1] if cat2 is None else [cat1, cat2]
+        cell = self.grid_cell_size * self._sep_units
+        shape = []
+        origin = []
+        step = []
+        for x, period in ((lambda c: c.x, self.xperiod), (lambda c: c.y, self.yperiod)):
+            if self.metric == 'Periodic':
+                n = int(math.ceil(period / cell))
+                origin.append(0.)
+                step.append(period / n)
+            else:
+                lo = min(np.min(x(c)) for c in cats)
+                hi = max(np.max(x(c)) for c in cats)
+                n = _fft_size(int((hi-lo) / cell) + int(math.ceil(self._max_sep / cell)) + 2)
+                origin.append(lo)
+                step.append(cell)
+            shape.append(n)
+        nx, ny = shape
+        self.logger.info("Mesh is %d x %d with cells of size %g, %g", nx, ny, step[0], step[1])
+        if nx * ny > 2**28:
+            raise ValueError("The mesh for grid_min_sep would have %d cells.  "%(nx*ny) +
+                             "Use a larger grid_cell_size.")
+
+        def paint(cat, v):
+            # The sum of v over the objects in each mesh cell.
+            ix = np.floor((cat.x - origin[0]) / step[0]).astype(int) % nx
+            iy = np.floor((cat.y - origin[1]) / step[1]).astype(int) % ny
+            index = iy * nx + ix
+            grid = np.bincount(index, weights=np.real(v), minlength=nx*ny)
+            if np.iscomplexobj(v):
+                grid = grid + 1j * np.bincount(index, weights=np.imag(v), minlength=nx*ny)
+            return grid.reshape(ny, nx)
+
+        def value(cat, d):
+            if d == 1:
+                return cat.w
+            elif d == 2:
+                return cat.w * cat.k
+            else:
+                return cat.w * (cat.g1 + 1j * cat.g2)
+
+        # The separations and bins of the offsets on the mesh.  For an auto-correlation, the
+        # correlation has each pair twice, once for each direction.
+        dx = np.fft.fftfreq(nx, 1./nx) * step[0]
+        dy = np.fft.fftfreq(ny, 1./ny) * step[1]
+        dx, dy = np.meshgrid(dx, dy)
+        r = np.sqrt(dx**2 + dy**2)
+        with np.errstate(divide='ignore'):
+            logr = np.log(r)
+        if self.bin_type == 'Log':
+            kr = np.floor((logr - math.log(self._min_sep)) / self._bin_size)
+        else:
+            kr = np.floor((r - self._min_sep) / self._bin_size)
+        mask = (r > 0) & (kr >= k0) & (kr < self._nbins) & (r < self._max_sep)
+        kr = kr[mask].astype(int)
+        fac = 0.5 if cat2 is None else 1.
+
+        def accumulate(a, c):
+            a[k0:] += fac * np.bincount(kr, weights=c[mask], minlength=self._nbins)[k0:]
+
+        c1 = cats[0]
+        c2 = cats[-1]
+        ones = [paint(c, (c.w != 0).astype(float)) for c in cats]
+        ww = _grid_correlate(paint(c1, c1.w), paint(c2, c2.w))
+        accumulate(self.npairs, _grid_correlate(ones[0], ones[-1]))
+        accumulate(self.weight, ww)
+        accumulate(self.meanr, ww * r)
+        if not self.skip_meanlogr:
+            accumulate(self.meanlogr, np.where(r > 0, ww * logr, 0.))
+
+        xi = self._get_xi_arrays()
+        if self._d2 == 1:
+            return
+        v1 = paint(c1, value(c1, self._d1))
+        v2 = paint(c2, value(c2, self._d2))
+        if self._d2 == 2:
+            accumulate(xi[0], _grid_correlate(v1, v2))
+        elif self._d1 < 3:
+            # The minus sign makes this the tangential shear, as in the C++ layer.
+            expm2iphi = (dx - 1j*dy)**2 / np.where(r > 0, r**2, 1.)
+            c = -_grid_correlate(v1, v2) * expm2iphi
+            accumulate(xi[0], np.real(c))
+            accumulate(xi[1], np.imag(c))
+        else:
+            expm4iphi = ((dx - 1j*dy)**2 / np.where(r > 0, r**2, 1.))**2
+            cp = _grid_correlate(v1, np.conj(v2))
+            cm = _grid_correlate(v1, v2) * expm4iphi
+            accumulate(xi[0], np.real(cp))
+            accumulate(xi[1], np.imag(cp))
+            accumulate(xi[2], np.real(cm))
+            accumulate(xi[3], np.imag(cm))
+
+    def _dilute_start(self):
+        # The first bin to compute with the subsample for dilute_min_sep, or nbins if it isn't
+        # used.
+        if self.dilute_min_sep is None or self.bin_type == 'TwoD':
+            return self._nbins
+        return int(np.searchsorted(self.left_edges, self.dilute_min_sep * (1.-1.e-10)))
+
+    def _process_dilute(self, cat1, cat2, num_threads):
+        # For dilute_min_sep, accumulate the bins above that scale from a random subsample of
+        # the catalogs, and tell the C++ layer to only do the pairs below it with the full
+        # catalogs until _finish_grid.  cat2 is None for an auto-correlation.
+        if self.dilute_min_sep is None:
+            return
+        k0 = self._dilute_start()
+        if k0 == self._nbins:
+            self.logger.info("dilute_min_sep is not used for these options.")
+            return
+        max_sep = self.left_edges[k0] * self._sep_units
+        treecorr._lib.SetCorr2MaxSep(self.corr, self._d1, self._d2, self._bintype, max_sep)
+
+        d1 = cat1 if self.dilute_cat == 2 and cat2 is not None else (
+                _dilute_catalog(cat1, self.dilute_frac, self.dilute_seed, 1))
+        d2 = cat2 if cat2 is None or self.dilute_cat == 1 else (
+                _dilute_catalog(cat2, self.dilute_frac, self.dilute_seed, 2))
+        if d1 is None or (cat2 is not None and d2 is None):
+            self.logger.warning("The subsample for dilute_min_sep has no objects.")
+            return
+        self.logger.info("Using a subsample with %s of the objects for the %d bins above %g",
+                         self.dilute_frac, self._nbins-k0, self.left_edges[k0])
+
+        # A correlation with just the bins above k0, which are added into these bins below.
+        config = dict(self.config)
+        for key in ['dilute_min_sep', 'bin_size', 'max_time', 'max_pairs', 'checkpoint',
+                    'cache_dir', 'autotune']:
+            config.pop(key, None)
+        config.update(min_sep=self.left_edges[k0], max_sep=self.max_sep,
+                      nbins=self._nbins-k0)
+        temp = self.__class__(config, logger=self.logger)
+        if cat2 is None:
+            temp.process_auto(d1, metric=self.metric, num_threads=num_threads)
+        else:
+            temp.process_cross(d1, d2, metric=self.metric, num_threads=num_threads)
+        self.npairs[k0:] += temp.npairs
+        self.weight[k0:] += temp.weight
+        self.meanr[k0:] += temp.meanr
+        self.meanlogr[k0:] += temp.meanlogr
+        for xi, temp_xi in zip(self._get_xi_arrays(), temp._get_xi_arrays()):
+            if xi is not None:
+                xi[k0:] += temp_xi
+
+    def _finish_grid(self):
+        # Put back the full range of separations for the tree after _process_grid or
+        # _process_dilute.
+        if self.grid_min_sep is not None or self.dilute_min_sep is not None:
+            treecorr._lib.SetCorr2MaxSep(self.corr, self._d1, self._d2, self._bintype,
+                                         self._max_sep)
+
     def _set_num_threads(self, num_threads):
         if num_threads is None:
             num_threads = self.config.get('num_threads',None)
@@ -769,6 +3109,8 @@ class BinnedCorr2(object):
         self._metric = treecorr.util.metric_enum(metric)
 
     def _apply_units(self, mask):
+        if self.skip_meanlogr:
+            self.meanlogr[mask] = np.log(self.meanr[mask])
         if self.coords == 'spherical' and self.metric == 'Euclidean':
             # Then our distances are all angles.  Convert from the chord distance to a real angle.
             # L = 2 sin(theta/2)
@@ -800,7 +3142,8 @@ class BinnedCorr2(object):
             # (And for the max_size, always split 10 levels for the top-level cells.)
             return 0., 0.
 
-    def sample_pairs(self, n, cat1, cat2, min_sep, max_sep, metric=None):
+    def sample_pairs(self, n, cat1, cat2, min_sep, max_sep, metric=None, seed=None,
+                     num_threads=None):
         """Return a random sample of n pairs whose separations fall between min_sep and max_sep.
 
         This would typically be used to get some random subset of the indices of pairs that
@@ -843,6 +3186,12 @@ class BinnedCorr2(object):
                                 allowed by the bin_slop parameter).
             metric (str):       Which metric to use.  See `Metrics` for details.  (default:
                                 self.metric, or 'Euclidean' if not set yet)
+            seed (int):         A positive seed for the random selection.  The sample is the
+                                same for a given seed and number of threads.  (default: None,
+                                which means to use a random seed)
+            num_threads (int):  How many OpenMP threads to use for the selection.  (default:
+                                use the number of cpu cores; this value can also be given in
+                                the constructor in the config dict.)
 
         Returns:
             Tuple containing
@@ -856,8 +3205,13 @@ class BinnedCorr2(object):
 
         if metric is None:
             metric = self.config.get('metric', 'Euclidean')
+        if seed is None:
+            seed = 0
+        elif seed <= 0:
+            raise ValueError("seed must be positive")
 
         self._set_metric(metric, cat1.coords, cat2.coords)
+        self._set_num_threads(num_threads)
 
         f1 = cat1.field
         f2 = cat2.field
@@ -870,13 +3224,17 @@ class BinnedCorr2(object):
             min_size, max_size = self._get_minmax_size()
             f1 = cat1.getNField(min_size, max_size, self.split_method,
                                 self.brute is True or self.brute == 1,
-                                self.min_top, self.max_top, self.coords)
+                                self.min_top, self.max_top, self.coords,
+                                lazy=self.lazy_build, presort=self.presort,
+                                spill_dir=self.spill_dir)
         if f2 is None or f2._coords != self._coords:
             self.logger.debug("In sample_pairs, making default field for cat2")
             min_size, max_size = self._get_minmax_size()
             f2 = cat2.getNField(min_size, max_size, self.split_method,
                                 self.brute is True or self.brute == 2,
-                                self.min_top, self.max_top, self.coords)
+                                self.min_top, self.max_top, self.coords,
+                                lazy=self.lazy_build, presort=self.presort,
+                                spill_dir=self.spill_dir)
 
         # Apply units to min_sep, max_sep:
         min_sep *= self._sep_units
@@ -887,7 +3245,7 @@ class BinnedCorr2(object):
         sep = np.zeros(n, dtype=float)
         ntot = treecorr._lib.SamplePairs(self.corr, f1.data, f2.data, min_sep, max_sep,
                                          f1._d, f2._d, self._coords, self._bintype, self._metric,
-                                         lp(i1), lp(i2), dp(sep), n)
+                                         lp(i1), lp(i2), dp(sep), n, int(seed))
 
         if ntot < n:
             n = ntot
@@ -909,6 +3267,49 @@ class BinnedCorr2(object):
         w = np.sum(d)
         return xi,w
 
+    def _use_native_cov(self):
+        # Whether the design matrices for the covariance estimates can be made in C++ from the
+        # dense arrays of _get_pair_tensors.  This requires that _calculate_xi_from_pairs is
+        # just the ratio of the sums of the results.
+        return type(self)._calculate_xi_from_pairs is BinnedCorr2._calculate_xi_from_pairs
+
+    def _get_pair_tensors(self):
+        # Dense [npatch1, npatch2, nstat] arrays of the _getStat and _getWeight values of the
+        # results for each pair of patches, with zeros for the pairs that aren't in results.
+        shape = (self.npatch1, self.npatch2, self._getStatLen())
+        stat = np.zeros(shape, dtype=float)
+        weight = np.zeros(shape, dtype=float)
+        for (i,j), cij in self.results.items():
+            stat[i,j] = cij._getStat()
+            weight[i,j] = cij._getWeight()
+        return stat, weight
+
+    def _make_native_cov_design_matrix(self, method, cnt=None):
+        # The same as _make_cov_design_matrix for the rows that the given method uses, but
+        # done in C++.  cnt is the [nboot, npatch] array of how many times each patch is
+        # selected for each bootstrap sample.
+        from treecorr.util import double_ptr as dp
+        stat, weight = self._get_pair_tensors()
+        nstat = stat.shape[2]
+        if cnt is None:
+            nrows = self.npatch1 if self.npatch2 == 1 else self.npatch2
+        else:
+            cnt = np.ascontiguousarray(cnt, dtype=float)
+            nrows = cnt.shape[0]
+        x = np.zeros((nrows,nstat), dtype=float)
+        w = np.zeros(nrows, dtype=float)
+        if method == 'jackknife':
+            treecorr._lib.CovJackknife(dp(stat), dp(weight), self.npatch1, self.npatch2, nstat,
+                                       dp(x), dp(w))
+        elif method == 'sample':
+            treecorr._lib.CovSample(dp(stat), dp(weight), self.npatch1, self.npatch2, nstat,
+                                    dp(x), dp(w))
+        else:
+            treecorr._lib.CovBootstrap(dp(stat), dp(weight), self.npatch1, self.npatch2, nstat,
+                                       dp(cnt), nrows, method == 'marked_bootstrap',
+                                       dp(x), dp(w))
+        return x, w
+
     def _make_cov_design_matrix(self, all_pairs):
         xisize = self._getStatLen()
         nrows = len(all_pairs)
@@ -979,6 +3380,292 @@ def estimate_multi_cov(corrs, method):
     else:
         raise ValueError("Invalid method: %s"%method)
 
+def process_multi(corrs, cat1, cat2=None, metric=None, num_threads=None):
+    """Process several correlation functions of the same catalog(s) with a single walk through
+    the trees.
+
+    For example, to accumulate NN and GG correlations of a single catalog that has both
+    positions and shears, you could write::
+
+        >>> nn = treecorr.NNCorrelation(config)
+        >>> gg = treecorr.GGCorrelation(config)
+        >>> treecorr.process_multi([nn, gg], cat)
+        >>> nn.finalize()
+        >>> gg.finalize(cat.varg, cat.varg)
+
+    NG correlations need two catalogs, so e.g. the NG and KG correlations of a lens catalog
+    with a source catalog would be ``treecorr.process_multi([ng, kg], lens, source)``.
+
+    This gives the same results as calling ``process_auto`` (or ``process_cross`` if ``cat2``
+    is given) for each of them, but the decisions about which pairs of cells to split are
+    only made once for all of them, which is typically faster than doing them separately.
+
+    The correlations must all use the same binning (min_sep, max_sep, nbins, bin_type,
+    bin_slop, etc.) and metric, and there can be at most one of each type.  For an auto-correlation,
+    only NN, KK and GG correlations are allowed.  For a cross-correlation, the first letter
+    refers to cat1 and the second to cat2.
+
+    Like ``process_auto``, this only accumulates the weighted sums into the bins.  You still
+    need to call ``finalize`` on each of them when you are done.
+
+    Parameters:
+        corrs (list):       A list of `BinnedCorr2` instances.
+        cat1 (Catalog):     The first catalog to process.
+        cat2 (Catalog):     The second catalog to process, if any. (default: None)
+        metric (str):       Which metric to use.  See `Metrics` for details.
+                            (default: 'Euclidean'; this value can also be given in the
+                            constructor in the config dict.)
+        num_threads (int):  How many OpenMP threads to use during the calculation.
+                            (default: use the number of cpu cores; this value can also be given
+                            in the constructor in the config dict.)
+    """
+    names = { (1,1):'nn', (1,2):'nk', (1,3):'ng', (2,2):'kk', (2,3):'kg', (3,3):'gg' }
+    slots = {}
+    for c in corrs:
+        name = names[(c._d1, c._d2)]
+        if name in slots:
+            raise ValueError("Only one %s correlation may be given to process_multi"%name)
+        if cat2 is None and c._d1 != c._d2:
+            raise ValueError("%s correlation requires two catalogs"%name)
+        slots[name] = c
+    if len(corrs) == 0:
+        raise ValueError("No correlations given to process_multi")
+
+    # If metric is None, each one uses the metric from its own config, so set these before
+    # checking that they are all the same.
+    for c in corrs:
+        c._set_metric(metric, cat1.coords, None if cat2 is None else cat2.coords)
+        c._set_unit_weights(cat1, cat2)
+
+    c0 = corrs[0]
+    def binning(c):
+        return (c._bintype, c._nbins, c._min_sep, c._max_sep, c._bin_size, c.b,
+                c.min_rpar, c.max_rpar, c.xperiod, c.yperiod, c.zperiod,
+                c.split_method, c.min_top, c.max_top, c.brute, c._metric)
+    for c in corrs[1:]:
+        if binning(c) != binning(c0):
+            raise ValueError("All correlations given to process_multi must use the same binning")
+
+    if cat2 is None:
+        c0.logger.info('Starting process_multi auto-correlations')
+    else:
+        c0.logger.info('Starting process_multi cross-correlations')
+    c0._set_num_threads(num_threads)
+    min_size, max_size = c0._get_minmax_size()
+
+    # Build the fields we need for each catalog.  These all use the same tree, so they can be
+    # walked together.
+    def get_fields(cat, brute, letters):
+        fields = []
+        for letter, getter in (('n', cat.getNField), ('k', cat.getKField),
+                               ('g', cat.getGField)):
+            if letter in letters:
+                fields.append(getter(min_size, max_size, c0.split_method, brute,
+                                     c0.min_top, c0.max_top, c0.coords,
+                                     lazy=c0.lazy_build, presort=c0.presort,
+                                     spill_dir=c0.spill_dir))
+            else:
+                fields.append(None)
+        return fields
+
+    if cat2 is None:
+        fields1 = get_fields(cat1, bool(c0.brute), [name[0] for name in slots])
+        fields2 = [None, None, None]
+    else:
+        fields1 = get_fields(cat1, c0.brute is True or c0.brute == 1, [name[0] for name in slots])
+        fields2 = get_fields(cat2, c0.brute is True or c0.brute == 2, [name[1] for name in slots])
+
+    null = treecorr._ffi.NULL
+    args = [slots[name].corr if name in slots else null
+            for name in ('nn', 'nk', 'ng', 'kk', 'kg', 'gg')]
+    args += [f.data if f is not None else null for f in fields1 + fields2]
+    args += [c0.output_dots, c0._coords, c0._bintype, c0._metric]
+    ok = treecorr._lib.ProcessMulti2(*args)
+    if not ok:
+        raise ValueError("The fields for process_multi do not have the same tree structure")
+
+def process_multi_bin(corrs, cat1, cat2=None, metric=None, num_threads=None):
+    """Process the same correlation function with several different binnings with a single
+    walk through the trees.
+
+    For example, to accumulate a GG correlation with coarse Log bins, fine Linear bins, and
+    a TwoD map, you could write::
+
+        >>> gg_log = treecorr.GGCorrelation(min_sep=1, max_sep=100, nbins=10)
+        >>> gg_lin = treecorr.GGCorrelation(min_sep=1, max_sep=20, nbins=100, bin_type='Linear')
+        >>> gg_2d = treecorr.GGCorrelation(max_sep=10, nbins=21, bin_type='TwoD')
+        >>> treecorr.process_multi_bin([gg_log, gg_lin, gg_2d], cat)
+        >>> for gg in [gg_log, gg_lin, gg_2d]:
+        ...     gg.finalize(cat.varg, cat.varg)
+
+    Each pair of cells is checked against each of the binnings, and added to any of them for
+    which it falls into a single bin.  When any of the others need the cells to be split, they
+    are split according to the strictest bin_slop of those.  So the binnings with a looser
+    bin_slop are typically computed somewhat more accurately than they would have been if they
+    were done separately.  With bin_slop=0, the results are the same.
+
+    The correlations must all be the same type (e.g. all GGCorrelation), and they must use the
+    same metric parameters (min_rpar, max_rpar, and the periods), split_method, min_top,
+    max_top, and brute.  At most 32 may be done at once.
+
+    Like ``process_auto``, this only accumulates the weighted sums into the bins.  You still
+    need to call ``finalize`` on each of them when you are done.
+
+    Parameters:
+        corrs (list):       A list of `BinnedCorr2` instances.
+        cat1 (Catalog):     The first catalog to process.
+        cat2 (Catalog):     The second catalog to process, if any. (default: None)
+        metric (str):       Which metric to use.  See `Metrics` for details.
+                            (default: 'Euclidean'; this value can also be given in the
+                            constructor in the config dict.)
+        num_threads (int):  How many OpenMP threads to use during the calculation.
+                            (default: use the number of cpu cores; this value can also be given
+                            in the constructor in the config dict.)
+    """
+    if len(corrs) == 0:
+        raise ValueError("No correlations given to process_multi_bin")
+    if len(corrs) > 32:
+        raise ValueError("At most 32 correlations may be given to process_multi_bin")
+    c0 = corrs[0]
+    if cat2 is None and c0._d1 != c0._d2:
+        raise ValueError("%s requires two catalogs"%c0.__class__.__name__)
+    def params(c):
+        return (c.__class__, c.min_rpar, c.max_rpar, c.xperiod, c.yperiod, c.zperiod,
+                c.split_method, c.min_top, c.max_top, c.brute)
+    for c in corrs[1:]:
+        if params(c) != params(c0):
+            raise ValueError("All correlations given to process_multi_bin must be the same "
+                             "type with the same metric parameters")
+
+    c0.logger.info('Starting process_multi_bin for %d binnings', len(corrs))
+
+    for c in corrs:
+        c._set_metric(metric, cat1.coords, None if cat2 is None else cat2.coords)
+        c._set_unit_weights(cat1, cat2)
+    c0._set_num_threads(num_threads)
+
+    # The fields need to be good enough for all of the binnings.
+    sizes = [c._get_minmax_size() for c in corrs]
+    min_size = min(s[0] for s in sizes)
+    max_size = max(s[1] for s in sizes)
+
+    def get_field(cat, d, brute):
+        getter = { 1:cat.getNField, 2:cat.getKField, 3:cat.getGField }[d]
+        return getter(min_size, max_size, c0.split_method, brute, c0.min_top, c0.max_top,
+                      c0.coords, lazy=c0.lazy_build, presort=c0.presort,
+                      spill_dir=c0.spill_dir)
+
+    if cat2 is None:
+        f1 = get_field(cat1, c0._d1, bool(c0.brute))
+        f2 = None
+    else:
+        f1 = get_field(cat1, c0._d1, c0.brute is True or c0.brute == 1)
+        f2 = get_field(cat2, c0._d2, c0.brute is True or c0.brute == 2)
+
+    ffi = treecorr._ffi
+    corr_ptrs = ffi.new('void*[]', [c.corr for c in corrs])
+    bin_types = ffi.new('int[]', [c._bintype for c in corrs])
+    treecorr._lib.ProcessMultiBin2(corr_ptrs, bin_types, len(corrs), f1.data,
+                                   ffi.NULL if f2 is None else f2.data, c0.output_dots,
+                                   c0._d1, c0._d2, c0._coords, c0._metric)
+
+def process_multi_partner(corrs, cat1, cat2, metric=None, num_threads=None):
+    """Process the cross-correlations of one catalog with each of several others with a single
+    walk through the tree of the shared catalog.
+
+    For example, to accumulate the NG correlations of several lens samples with a single
+    source catalog, you could write::
+
+        >>> ngs = [treecorr.NGCorrelation(config) for lens_cat in lens_cats]
+        >>> treecorr.process_multi_partner(ngs, lens_cats, source_cat)
+        >>> for ng in ngs:
+        ...     ng.finalize(source_cat.varg)
+
+    Either cat1 or cat2 may be the list, so for a single lens sample with several source
+    samples, you would give the list of source catalogs as cat2 instead.
+
+    This gives the same results as calling ``process_cross`` for each pair of catalogs, but
+    each cell of the shared catalog is only compared with the nearby cells of all the others
+    once, and it is only split once for all of the ones that need it.  This is typically
+    faster than doing them separately when there are many partner catalogs.
+
+    The correlations must all be the same type (e.g. all NGCorrelation) with the same bin_type,
+    and they must use the same metric parameters (min_rpar, max_rpar, and the periods),
+    split_method, min_top, max_top, and brute.
+
+    Like ``process_cross``, this only accumulates the weighted sums into the bins.  You still
+    need to call ``finalize`` on each of them when you are done.
+
+    Parameters:
+        corrs (list):       A list of `BinnedCorr2` instances.
+        cat1 (Catalog):     The first catalog to process, or a list of them, one for each of
+                            the correlations.
+        cat2 (Catalog):     The second catalog to process, or a list of them, one for each of
+                            the correlations.  Exactly one of cat1 and cat2 must be a list.
+        metric (str):       Which metric to use.  See `Metrics` for details.
+                            (default: 'Euclidean'; this value can also be given in the
+                            constructor in the config dict.)
+        num_threads (int):  How many OpenMP threads to use during the calculation.
+                            (default: use the number of cpu cores; this value can also be given
+                            in the constructor in the config dict.)
+    """
+    if len(corrs) == 0:
+        raise ValueError("No correlations given to process_multi_partner")
+    shared1 = not isinstance(cat1, list)
+    if shared1 == (not isinstance(cat2, list)):
+        raise ValueError("Exactly one of cat1 and cat2 must be a list for process_multi_partner")
+    cats1 = [cat1] * len(corrs) if shared1 else cat1
+    cats2 = cat2 if shared1 else [cat2] * len(corrs)
+    if len(cats1) != len(corrs) or len(cats2) != len(corrs):
+        raise ValueError("process_multi_partner needs one partner catalog for each correlation")
+    c0 = corrs[0]
+    def params(c):
+        return (c.__class__, c._bintype, c.min_rpar, c.max_rpar, c.xperiod, c.yperiod,
+                c.zperiod, c.split_method, c.min_top, c.max_top, c.brute)
+    for c in corrs[1:]:
+        if params(c) != params(c0):
+            raise ValueError("All correlations given to process_multi_partner must be the same "
+                             "type with the same bin_type and metric parameters")
+
+    c0.logger.info('Starting process_multi_partner for %d partners', len(corrs))
+
+    for c, c1, c2 in zip(corrs, cats1, cats2):
+        c._set_metric(metric, c1.coords, c2.coords)
+        c._set_unit_weights(c1, c2)
+    c0._set_num_threads(num_threads)
+    for c, c1, c2 in zip(corrs, cats1, cats2):
+        c._process_grid(c1, c2)
+        c._process_dilute(c1, c2, num_threads)
+
+    # The fields need to be good enough for all of the correlations.
+    sizes = [c._get_minmax_size() for c in corrs]
+    min_size = min(s[0] for s in sizes)
+    max_size = max(s[1] for s in sizes)
+
+    def get_field(cat, d, brute):
+        getter = { 1:cat.getNField, 2:cat.getKField, 3:cat.getGField }[d]
+        return getter(min_size, max_size, c0.split_method, brute, c0.min_top, c0.max_top,
+                      c0.coords, lazy=c0.lazy_build, presort=c0.presort,
+                      spill_dir=c0.spill_dir)
+
+    brute1 = c0.brute is True or c0.brute == 1
+    brute2 = c0.brute is True or c0.brute == 2
+    if shared1:
+        field = get_field(cat1, c0._d1, brute1)
+        fields = [get_field(c, c0._d2, brute2) for c in cats2]
+    else:
+        field = get_field(cat2, c0._d2, brute2)
+        fields = [get_field(c, c0._d1, brute1) for c in cats1]
+
+    ffi = treecorr._ffi
+    corr_ptrs = ffi.new('void*[]', [c.corr for c in corrs])
+    field_ptrs = ffi.new('void*[]', [f.data for f in fields])
+    treecorr._lib.ProcessMultiPartner2(corr_ptrs, len(corrs), field.data, field_ptrs,
+                                       shared1, c0.output_dots, c0._d1, c0._d2, c0._coords,
+                                       c0._bintype, c0._metric)
+    for c in corrs:
+        c._finish_grid()
+
 def _cov_shot(corrs):
     vlist = []
     for c in corrs:
@@ -1016,6 +3703,10 @@ def _cov_jackknife(corrs):
 
     vlist = []
     for c, pairs in zip(corrs, all_pairs):
+        if c._use_native_cov():
+            v, w = c._make_native_cov_design_matrix('jackknife')
+            vlist.append(v)
+            continue
         if c.npatch2 == 1:
             vpairs = [ [(j,0) for j in range(c.npatch1) if j!=i] for i in range(c.npatch1) ]
         elif c.npatch1 == 1:
@@ -1048,6 +3739,18 @@ def _cov_sample(corrs):
     vlist = []
     wlist = []
     for c, pairs in zip(corrs, all_pairs):
+        if c._use_native_cov():
+            if c.npatch1 == 1 and c.npatch2 != 1:
+                used = set(j for i,j in pairs)
+            else:
+                used = set(i for i,j in pairs)
+            if len(used) < (c.npatch1 if c.npatch2 == 1 else c.npatch2):
+                raise RuntimeError("Cannot compute sample variance when some patches have no "
+                                   "data.")
+            v, w = c._make_native_cov_design_matrix('sample')
+            vlist.append(v)
+            wlist.append(w)
+            continue
         if c.npatch2 == 1:
             vpairs = [ [(i,0)] for i in range(c.npatch1) ]
         elif c.npatch1 == 1:
@@ -1097,6 +3800,14 @@ def _cov_marked(corrs):
     nboot = np.max([c.num_bootstrap for c in corrs])  # use the maximum if they differ.
     vlist = []
     for c, pairs in zip(corrs, all_pairs):
+        if c._use_native_cov():
+            # Just count how many times each patch is selected, using the same random numbers
+            # as the loop below would.
+            cnt = [np.bincount(np.random.randint(npatch, size=npatch), minlength=npatch)
+                   for k in range(nboot)]
+            v, w = c._make_native_cov_design_matrix('marked_bootstrap', np.array(cnt))
+            vlist.append(v)
+            continue
         vpairs = []
         if c.npatch1 != 1 and c.npatch2 != 1:
             # Precompute this for use below.
@@ -1136,6 +3847,12 @@ def _cov_bootstrap(corrs):
     nboot = np.max([c.num_bootstrap for c in corrs])  # use the maximum if they differ.
     vlist = []
     for c, pairs in zip(corrs, all_pairs):
+        if c._use_native_cov():
+            cnt = [np.bincount(np.random.randint(npatch, size=npatch), minlength=npatch)
+                   for k in range(nboot)]
+            v, w = c._make_native_cov_design_matrix('bootstrap', np.array(cnt))
+            vlist.append(v)
+            continue
         vpairs = []
         if c.npatch1 != 1 and c.npatch2 != 1:
             # Precompute this for use below.
@@ -171,6 +171,28 @@ class BinnedCorr3(object):
                             The top-level cells are where each calculation job starts. There will
                             typically be of order :math:`2^{\\rm max\\_top}` top-level cells.
                             (default: 10)
+        max_time (float):   If given, the maximum wall clock time in seconds to spend on the
+                            pairs of top-level cells in a process call (or since the last
+                            `clear`).  They are then done in a random order, and no new ones
+                            are started once the time is up.
+                            The fraction that were done is available as `frac_done`.
+                            cf. `BinnedCorr2` for details.  (default: None)
+        max_triples (float): Like max_time, but stop starting new pairs of top-level cells after
+                            approximately this many triples of objects. (default: None)
+        checkpoint (str):   If given, a file name to use for checkpointing long calculations.
+                            The results of the finished pairs of top-level cells in each call
+                            to the C++ layer are periodically written to checkpoint + '.cells',
+                            and running the calculation again after an interruption resumes
+                            from there.  cf. `BinnedCorr2` for details.  (default: None)
+        checkpoint_time (float): How often in seconds to write the checkpoint file.
+                            (default: 600)
+        max_thread_memory (float): The maximum memory in GB to use for the copies of the
+                            results that each OpenMP thread accumulates.  With many threads
+                            and fine u,v bins, these copies can be very large.  If they would
+                            take more than this, the threads all add to a single shared copy
+                            with atomic updates instead, which is slower but only needs one
+                            copy.  The memory that will be used is reported in the log at the
+                            start of each processing call.  (default: 1)
         precision (int):    The precision to use for the output values. This specifies how many
                             digits to write. (default: 4)
 
@@ -248,6 +270,16 @@ class BinnedCorr3(object):
                 'The minimum number of top layers to use when setting up the field.'),
         'max_top' : (int, False, 10, None,
                 'The maximum number of top layers to use when setting up the field.'),
+        'max_time' : (float, False, None, None,
+                'The maximum wall clock time in seconds for each processing call.'),
+        'max_triples' : (float, False, None, None,
+                'The maximum number of triples to do in each processing call.'),
+        'checkpoint' : (str, False, None, None,
+                'A file name to use for checkpointing long calculations.'),
+        'checkpoint_time' : (float, False, 600., None,
+                'How often in seconds to write the checkpoint file.'),
+        'max_thread_memory' : (float, False, 1., None,
+                'The maximum memory in GB to use for the per-thread copies of the results.'),
         'precision' : (int, False, 4, None,
                 'The number of digits after the decimal in the output.'),
         'num_threads' : (int, False, None, None,
@@ -402,6 +434,13 @@ class BinnedCorr3(object):
 
         self.min_top = treecorr.config.get(self.config,'min_top',int,None)
         self.max_top = treecorr.config.get(self.config,'max_top',int,10)
+        self.max_time = treecorr.config.get(self.config,'max_time',float,None)
+        self.max_triples = treecorr.config.get(self.config,'max_triples',float,None)
+        self.checkpoint = treecorr.config.get(self.config,'checkpoint',str,None)
+        self.checkpoint_time = treecorr.config.get(self.config,'checkpoint_time',float,600.)
+        self.max_thread_memory = treecorr.config.get(self.config,'max_thread_memory',float,1.)
+        self._budget = treecorr.binnedcorr2._BudgetState()
+        self._stats = np.zeros(len(treecorr.binnedcorr2._traversal_stats_names), dtype=float)
 
         self.bin_slop = treecorr.config.get(self.config,'bin_slop',float,-1.0)
         if self.bin_slop < 0.0:
@@ -521,14 +560,183 @@ class BinnedCorr3(object):
                 for c3 in cat3:
                     self.process_cross(c1,c2,c3, metric, num_threads)
 
-    def _set_num_threads(self, num_threads):
+    def process_multipole(self, cat1, cat2=None, max_n=10, metric=None, num_threads=None):
+        """Compute the multipoles of the three-point function, rather than binning the
+        triangles in (r,u,v).
+
+        This uses a different algorithm from `process`, which scales much better to large
+        catalogs.  For each point in cat1 (or each small cell of points), the neighbours in
+        cat2 with min_sep <= r < max_sep are found with the same kind of tree traversal as
+        for a two-point correlation, and their Fourier multipoles are accumulated in each
+        radial bin,
+
+        .. math::
+
+            a_n(r) = \\sum_j w_j \\kappa_j e^{-i n \\phi_j}
+
+        where :math:`\\phi_j` is the angle of point j around the central point (and
+        :math:`\\kappa_j = 1` for NNN).  The products
+        of these for two radial bins then give the multipoles of the three-point function
+        as a function of the two sides :math:`r_1, r_2` that meet at the central point and the
+        angle :math:`\\phi` between them.  (cf. Slepian & Eisenstein 2015, Porth et al. 2023)
+        The cost scales as :math:`N n_{bins}^2 n_{max}` after the two-point traversal.
+
+        Each triangle is counted once for each of its vertices as the central point (if they
+        are all in cat1 and cat2), and for each order of the other two.
+
+        The radial binning is taken from the min_sep, max_sep and nbins of this object.
+        The u and v binning are not used.  Use `Multipole3.toPhi` to convert the results
+        to bins in :math:`\\phi`.
+
+        This is only implemented for `NNNCorrelation` and `KKKCorrelation`, and only for
+        flat coordinates with the Euclidean metric.  This correlation object isn't changed.
+        `GGGCorrelation` is not implemented yet, since the shears need to be projected
+        relative to each side of the triangle, which makes the multipoles more complicated.
+
+        Parameters:
+            cat1 (Catalog):     The catalog with the central points of the triangles.
+            cat2 (Catalog):     The catalog with the other two points of the triangles, or
+                                None to use cat1. (default: None)
+            max_n (int):        The maximum multipole to compute. (default: 10)
+            metric (str):       Which metric to use.  Only 'Euclidean' is allowed currently.
+                                (default: 'Euclidean'; this value can also be given in the
+                                constructor in the config dict.)
+            num_threads (int):  How many OpenMP threads to use during the calculation.
+                                (default: use the number of cpu cores; this value can also be given
+                                in the constructor in the config dict.)
+
+        Returns:
+            A `Multipole3` instance with the results.
+        """
+        from treecorr.util import double_ptr as dp
+        if self._d1 not in (1,2) or self._d2 != self._d1 or self._d3 != self._d1:
+            raise NotImplementedError(
+                "process_multipole is only implemented for NNN and KKK correlations")
+        if max_n < 0:
+            raise ValueError("max_n must be >= 0")
+        if cat2 is None:
+            cat2 = cat1
+        self._set_metric(metric, cat1.coords, cat2.coords)
+        if self.coords != 'flat' or self.metric != 'Euclidean':
+            raise ValueError("process_multipole is only implemented for flat coordinates "+
+                             "with the Euclidean metric")
+        self._set_num_threads(num_threads, report_memory=False)
+
+        # The maximum error in the angle is the fraction bin_slop of the scale that the
+        # highest multipole can resolve.
+        bphi = self.bin_slop * math.pi / max(max_n,1)
+        b = min(self.b, bphi)
+        min_size = self._min_sep * b / (2.+3.*b)
+        max_size = self._max_sep * b
+        if self._d1 == 1:
+            f1 = cat1.getNField(min_size, max_size, self.split_method,
+                                bool(self.brute), self.min_top, self.max_top, self.coords)
+            f2 = cat2.getNField(min_size, max_size, self.split_method,
+                                bool(self.brute), self.min_top, self.max_top, self.coords)
+        else:
+            f1 = cat1.getKField(min_size, max_size, self.split_method,
+                                bool(self.brute), self.min_top, self.max_top, self.coords)
+            f2 = cat2.getKField(min_size, max_size, self.split_method,
+                                bool(self.brute), self.min_top, self.max_top, self.coords)
+
+        mp = Multipole3(self, max_n)
+        shape = mp.weight.shape
+        weight_re = np.zeros(shape, dtype=float)
+        weight_im = np.zeros(shape, dtype=float)
+        if self._d1 == 2:
+            zeta_re = np.zeros(shape, dtype=float)
+            zeta_im = np.zeros(shape, dtype=float)
+        else:
+            zeta_re = zeta_im = None
+        self.logger.info('Starting multipole calculation with max_n = %d',max_n)
+        treecorr._lib.ProcessMultipole3(f1.data, f2.data, self.output_dots, f1._d, self._coords,
+                                        self._min_sep, self._max_sep, self.nbins, self._bin_size,
+                                        self.b, bphi, max_n, dp(weight_re), dp(weight_im),
+                                        dp(zeta_re), dp(zeta_im), dp(mp.meanr), dp(mp.meanlogr),
+                                        dp(mp.npairs))
+        mp.weight = weight_re + 1j * weight_im
+        if self._d1 == 2:
+            mp.zeta = zeta_re + 1j * zeta_im
+        mask = mp.npairs != 0.
+        mp.meanr[mask] /= mp.npairs[mask]
+        mp.meanlogr[mask] /= mp.npairs[mask]
+        mp.meanr[~mask] = mp.rnom[~mask]
+        mp.meanlogr[~mask] = mp.logr[~mask]
+        return mp
+
+    @property
+    def frac_done(self):
+        """The fraction of the pairs of top-level cells that were done since the last `clear`,
+        i.e. in the most recent `process` call.  This is only less than 1 if max_time or
+        max_triples is set.
+        """
+        return self._budget.frac_done
+
+    def _set_budget(self):
+        # Tell the C++ layer about max_time and max_triples, and where to keep track of how much
+        # of them has been used.
+        from treecorr.util import double_ptr as dp
+        treecorr._lib.SetCorr3Budget(self._corr, self._d1, self._d2, self._d3, self._bintype,
+                                     self.max_time or 0., self.max_triples or 0.,
+                                     dp(self._budget.used))
+
+    @property
+    def stats(self):
+        """A dict of counters describing the tree traversal in all the processing calls since
+        the last `clear`.  cf. `BinnedCorr2.stats`.  Here nodes counts the sets of one, two
+        or three cells that were visited, split1, split2 and split3 are the number of times
+        only that cell was split, and range_exit is the number of times the recursion stopped
+        because the triangles could not be in the range of d2, u or v.  rpar_exit and
+        leaf_pairs are not used.  The top-level items are the top-level cells of the first
+        field.
+        """
+        return dict(zip(treecorr.binnedcorr2._traversal_stats_names, self._stats))
+
+    def _set_stats(self):
+        # Tell the C++ layer where to add the traversal stats.
+        from treecorr.util import double_ptr as dp
+        treecorr._lib.SetCorr3Stats(self._corr, self._d1, self._d2, self._d3, self._bintype,
+                                    dp(self._stats))
+
+    def _add_stats(self, other):
+        treecorr.binnedcorr2._add_traversal_stats(self._stats, other._stats)
+
+    def _set_checkpoint(self):
+        # Tell the C++ layer where to write the checkpoints of each processing call.
+        file_name = (self.checkpoint + '.cells') if self.checkpoint is not None else ''
+        treecorr._lib.SetCorr3Checkpoint(self._corr, self._d1, self._d2, self._d3,
+                                         self._bintype, file_name.encode(),
+                                         self.checkpoint_time)
+
+    def _check_processed(self, ok):
+        # The C++ layer returns 0 if it could not read or write the checkpoint file.
+        if not ok:
+            raise OSError("Unable to read or write the checkpoint file %s.cells"%self.checkpoint)
+
+    def _set_thread_memory(self):
+        # Tell the C++ layer how much memory it may use for the per-thread results.
+        treecorr._lib.SetCorr3ThreadMemory(self._corr, self._d1, self._d2, self._d3,
+                                           self._bintype, self.max_thread_memory * 1.e9)
+
+    def _set_num_threads(self, num_threads, report_memory=True):
         if num_threads is None:
             num_threads = self.config.get('num_threads',None)
         if num_threads is None:
             self.logger.debug('Set num_threads automatically from ncpu')
         else:
             self.logger.debug('Set num_threads = %d',num_threads)
-        treecorr.set_omp_threads(num_threads, self.logger)
+        num_threads = treecorr.set_omp_threads(num_threads, self.logger)
+        if report_memory:
+            from treecorr.util import double_ptr as dp
+            info = np.zeros(2, dtype=float)
+            treecorr._lib.GetCorr3ThreadMemory(self.corr, self._d1, self._d2, self._d3,
+                                               self._bintype, num_threads, dp(info))
+            if info[1]:
+                self.logger.info('The results for %d threads will use %.1f MB in one shared copy',
+                                 num_threads, info[0]/2**20)
+            else:
+                self.logger.info('The results for %d threads will use %.1f MB',
+                                 num_threads, info[0]/2**20)
 
     def _set_metric(self, metric, coords1, coords2=None, coords3=None):
         if metric is None:
@@ -584,3 +792,79 @@ class BinnedCorr3(object):
         else:
             return 0., 0.
 
+
+
+class Multipole3(object):
+    """The multipoles of a three-point correlation function, as computed by
+    `BinnedCorr3.process_multipole`.
+
+    The triangles are described by the two sides :math:`r_1, r_2` that meet at the central
+    point (from cat1) and the angle :math:`\\phi` between them.  The weight of the triangles
+    in radial bins b1, b2 as a function of :math:`\\phi` is
+
+    .. math::
+
+        W(b_1,b_2,\\phi) = \\frac{1}{2\\pi} \\sum_{n=-n_{max}}^{n_{max}} W_n(b_1,b_2) e^{i n \\phi}
+
+    with :math:`W_{-n} = W_n^*`, so only :math:`n \\ge 0` are stored.
+
+    Attributes:
+        max_n:      The maximum multipole.
+        nbins:      The number of radial bins.
+        logr:       The nominal centers of the radial bins in log(r).
+        rnom:       The nominal centers of the radial bins.
+        meanr:      The mean separation of the pairs in each radial bin.
+        meanlogr:   The mean log(r) of the pairs in each radial bin.
+        npairs:     The total weight of the pairs in each radial bin.
+        weight:     The multipoles of the weight, :math:`W_n(b_1,b_2)`, as a complex array with
+                    shape (nbins, nbins, max_n+1).
+        zeta:       For KKK, the multipoles of :math:`\\sum w_1 w_2 w_3 \\kappa_1 \\kappa_2
+                    \\kappa_3`, with the same shape.  None for NNN.
+    """
+    def __init__(self, corr, max_n):
+        self.max_n = max_n
+        self.nbins = corr.nbins
+        self.logr = corr.logr1d.copy()
+        self.rnom = np.exp(self.logr)
+        self.meanr = np.zeros(self.nbins, dtype=float)
+        self.meanlogr = np.zeros(self.nbins, dtype=float)
+        self.npairs = np.zeros(self.nbins, dtype=float)
+        self.weight = np.zeros((self.nbins, self.nbins, max_n+1), dtype=complex)
+        self.zeta = None
+
+    def toPhi(self, nphi_bins):
+        """Resum the multipoles into nphi_bins bins of the angle :math:`\\phi` between
+        the two sides, from 0 to :math:`\\pi`.
+
+        Since the multipoles are truncated at max_n, the resolution in :math:`\\phi` is only
+        about :math:`\\pi/n_{max}`, so using many more bins than max_n isn't useful.
+
+        Parameters:
+            nphi_bins (int):    The number of bins in phi.
+
+        Returns:
+            Tuple containing
+
+                - phi (array): The centers of the phi bins.
+                - weight (array): The weight of the triangles in each (b1, b2, phi) bin, with
+                  shape (nbins, nbins, nphi_bins).
+                - zeta (array): For KKK, the mean of :math:`\\kappa_1 \\kappa_2 \\kappa_3` in
+                  each bin, with the same shape.  None for NNN.
+        """
+        edges = np.linspace(0., np.pi, nphi_bins+1)
+        phi = 0.5 * (edges[:-1] + edges[1:])
+        # The integral over each bin (and the corresponding negative angles) of
+        # exp(i n phi) / 2pi for each n >= 0, including the matching -n term.
+        n = np.arange(1, self.max_n+1)[:,np.newaxis]
+        c = np.empty((self.max_n+1, nphi_bins), dtype=float)
+        c[0] = np.diff(edges) / np.pi
+        c[1:] = 2. * np.diff(np.sin(n * edges), axis=1) / (np.pi * n)
+        weight = self.weight.real.dot(c)
+        if self.zeta is None:
+            zeta = None
+        else:
+            zeta = self.zeta.real.dot(c)
+            mask = weight != 0.
+            zeta[mask] /= weight[mask]
+            zeta[~mask] = 0.
+        return phi, weight, zeta
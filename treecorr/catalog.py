@@ -202,9 +202,11 @@ class Catalog(object):
 
     Keyword Arguments:
 
-        file_type (str):    What kind of file is the input file. Valid options are 'ASCII' or
-                            'FITS' (default: if the file_name extension starts with .fit, then use
-                            'FITS', else 'ASCII')
+        file_type (str):    What kind of file is the input file. Valid options are 'ASCII',
+                            'FITS' or 'Binary' (default: if the file_name extension starts with
+                            .fit, then use 'FITS', if it is .tcb, then use 'Binary', else 'ASCII')
+                            'Binary' files are the ones written by `write_binary`.  They always
+                            have the same columns, so the column parameters are not used for them.
         delimiter (str):    For ASCII files, what delimiter to use between values. (default: None,
                             which means any whitespace)
         comment_marker (str): For ASCII files, what token indicates a comment line. (default: '#')
@@ -304,9 +306,28 @@ class Catalog(object):
                             would be included in ntot and also in npairs calculations that use
                             this Catalog, although of course not contribute to the accumulated
                             weight of pairs. (default: False)
+        keep_radec (bool):  Whether to keep the ra and dec arrays after making the x,y,z arrays
+                            from them.  If False, they are dropped to save memory, and the
+                            ra and dec attributes are recomputed from x,y,z when they are
+                            used.  In that case, ra is in the range [0, 2pi).
+                            (default: True)
         save_patch_dir (str): If desired, when building patches from this Catalog, save them
                             as FITS files in the given directory for more efficient loading when
                             doing cross-patch correlations with the ``low_mem`` option.
+        save_patch_type (str): What kind of files to write in ``save_patch_dir``.  Valid options
+                            are 'FITS' or 'Binary'.  Binary files are memory mapped when they are
+                            loaded, so they don't need any parsing. (default: 'FITS')
+        save_fields (bool): For Binary files, whether to save the fields that are built from
+                            this Catalog in files next to it, so loading the Catalog again later
+                            can read the trees rather than rebuilding them.  This is used for
+                            the patches written to ``save_patch_dir`` when ``save_patch_type``
+                            is 'Binary'. (default: False)
+        share_fields (str): If given, put the fields that are built from this Catalog in shared
+                            memory (cf. `Field.share`) with names starting with this prefix, and
+                            use the ones that another process already put there rather than
+                            building them again.  This lets many processes on one machine (e.g.
+                            ``multiprocessing`` workers) that correlate the same catalog share a
+                            single copy of its trees. (default: None)
 
         hdu (int):          For FITS files, which hdu to read. (default: 1)
         x_hdu (int):        Which hdu to use for the x values. (default: hdu)
@@ -365,7 +386,7 @@ class Catalog(object):
     #    list of valid values
     #    description
     _valid_params = {
-        'file_type' : (str, True, None, ['ASCII', 'FITS'],
+        'file_type' : (str, True, None, ['ASCII', 'FITS', 'Binary'],
                 'The file type of the input files. The default is to use the file name extension.'),
         'delimiter' : (str, True, None, None,
                 'The delimeter between values in an ASCII catalog. The default is any whitespace.'),
@@ -451,11 +472,13 @@ class Catalog(object):
         'flip_g2' : (bool, True, False, None,
                 'Whether to flip the sign of g2'),
 
+        'keep_radec' : (bool, False, True, None,
+                'Whether to keep the ra, dec arrays after making x, y, z from them'),
         'keep_zero_weight' : (bool, False, False, None,
                 'Whether to keep objects with zero weight in the catalog'),
         'npatch' : (int, False, 1, None,
                 'Number of patches to split the catalog into'),
-        'kmeans_init' : (str, False, 'tree', ['tree','random','kmeans++'],
+        'kmeans_init' : (str, False, 'tree', ['tree','random','kmeans++','kmeans||'],
                 'Which initialization method to use for kmeans when making patches'),
         'kmeans_alt' : (bool, False, False, None,
                 'Whether to use the alternate kmeans algorithm when making patches'),
@@ -463,6 +486,12 @@ class Catalog(object):
                 'File with patch centers to use to determine patches'),
         'save_patch_dir' : (str, False, None, None,
                 'If desired, save the patches as FITS files in this directory.'),
+        'save_patch_type' : (str, False, 'FITS', ['FITS', 'Binary'],
+                'The type of file to use for the patches written to save_patch_dir.'),
+        'save_fields' : (bool, False, False, None,
+                'Whether to save the fields built from a Binary catalog next to the file.'),
+        'share_fields' : (str, False, None, None,
+                'A name prefix for the fields that are shared with other processes.'),
         'verbose' : (int, False, 1, [0, 1, 2, 3],
                 'How verbose the code should be during processing. ',
                 '0 = Errors Only, 1 = Warnings, 2 = Progress, 3 = Debugging'),
@@ -474,6 +503,10 @@ class Catalog(object):
         'cat_precision' : (int, False, 16, None,
                 'The number of digits after the decimal in the output.'),
     }
+
+    # The number of rows to read at a time from a FITS file.
+    _fits_chunk_size = 1000000
+
     def __init__(self, file_name=None, config=None, num=0, logger=None, is_rand=False,
                  x=None, y=None, z=None, ra=None, dec=None, r=None, w=None, wpos=None, flag=None,
                  g1=None, g2=None, k=None, patch=None, patch_centers=None, **kwargs):
@@ -498,6 +531,7 @@ class Catalog(object):
         self._z = None
         self._ra = None
         self._dec = None
+        self._drop_radec = False
         self._r = None
         self._w = None
         self._wpos = None
@@ -568,6 +602,10 @@ class Catalog(object):
                 self._centers = self.read_patch_centers(patch_centers)
 
         self.save_patch_dir = self.config.get('save_patch_dir',None)
+        self.save_patch_type = treecorr.config.get(self.config,'save_patch_type',str,'FITS')
+        self._save_fields = treecorr.config.get(self.config,'save_fields',bool,False)
+        self._share_fields = treecorr.config.get(self.config,'share_fields',str,None)
+        self._binary_full = False
         allow_xyz = self.config.get('allow_xyz', False)
 
         # First style -- read from a file
@@ -586,11 +624,15 @@ class Catalog(object):
                 name, ext = os.path.splitext(file_name)
                 if ext.lower().startswith('.fit'):
                     file_type = 'FITS'
+                elif ext.lower() == '.tcb':
+                    file_type = 'Binary'
                 else:
                     file_type = 'ASCII'
                 self.logger.info("   file_type assumed to be %s from the file name.",file_type)
             if file_type == 'FITS':
                 self._check_fits(file_name, num, is_rand)
+            elif file_type == 'Binary':
+                self._check_binary(file_name, num, is_rand)
             else:
                 self._check_ascii(file_name, num, is_rand)
 
@@ -714,13 +756,22 @@ class Catalog(object):
     @property
     def ra(self):
         self.load()
+        if self._drop_radec:
+            return np.arctan2(self._y, self._x) % (2.*np.pi)
         return self._ra
 
     @property
     def dec(self):
         self.load()
+        if self._drop_radec:
+            return np.arctan2(self._z, np.hypot(self._x, self._y))
         return self._dec
 
+    def _is_radec(self):
+        # Whether the positions were given as ra, dec, without recomputing them if they
+        # were dropped.
+        return self._ra is not None or self._drop_radec
+
     @property
     def r(self):
         self.load()
@@ -826,6 +877,21 @@ class Catalog(object):
         if self._sumw is None: self.load()
         return self._sumw
 
+    @property
+    def nbytes(self):
+        """The number of bytes of memory currently used by the catalog's arrays and by the
+        fields in its cache.  (This doesn't load the catalog if it isn't loaded yet.)
+        """
+        n = 0
+        for col in [self._x, self._y, self._z, self._ra, self._dec, self._r, self._w,
+                    self._wpos, self._flag, self._g1, self._g2, self._k, self._patch]:
+            if col is not None:
+                n += col.nbytes
+        for name in ['_nfields', '_kfields', '_gfields']:
+            if hasattr(self, name):
+                n += sum(field.nbytes for field in getattr(self, name).values())
+        return n
+
     @property
     def coords(self):
         if self.ra is not None:
@@ -896,6 +962,11 @@ class Catalog(object):
         # If using ra/dec, generate x,y,z
         # Note: This also makes self.ntot work properly.
         self._generate_xyz()
+        if self._ra is not None and not treecorr.config.get(self.config,'keep_radec',bool,True):
+            self.logger.debug('Dropping ra, dec')
+            self._ra = None
+            self._dec = None
+            self._drop_radec = True
 
         # Copy w to wpos if necessary (Do this after checkForNaN's, since this may set some
         # entries to have w=0.)
@@ -930,11 +1001,15 @@ class Catalog(object):
             if np.any(wpos == 0):
                 self.select(np.where(wpos != 0)[0])
 
+        self._finish_patches()
+
+    def _finish_patches(self):
+        # Find or assign the patches if requested.
         if self.npatch != 1:
             init = treecorr.config.get(self.config,'kmeans_init',str,'tree')
             alt = treecorr.config.get(self.config,'kmeans_alt',bool,False)
             max_top = int.bit_length(self.npatch)-1
-            c = 'spherical' if self._ra is not None else self.coords
+            c = 'spherical' if self._is_radec() else self.coords
             field = self.getNField(max_top=max_top, coords=c)
             self.logger.info("Finding %d patches using kmeans.",self.npatch)
             self._patch, self._centers = field.run_kmeans(self.npatch, init=init, alt=alt)
@@ -1179,59 +1254,6 @@ class Catalog(object):
         """
         comment_marker = self.config.get('comment_marker','#')
         delimiter = self.config.get('delimiter',None)
-        # I want read_csv to ignore header lines that start with the comment marker, but
-        # there is currently a bug in read_csv that messing things up when we do this.
-        # cf. https://github.com/pydata/pandas/issues/4623
-        # For now, my workaround in to count how many lines start with the comment marker
-        # and skip them by hand.
-        skiprows = 0
-        with open(file_name, 'r') as fid:
-            for line in fid:  # pragma: no branch
-                if line.startswith(comment_marker): skiprows += 1
-                else: break
-        skiprows += self.start
-        if self.end is None:
-            nrows = None
-        else:
-            nrows = self.end - self.start
-        if self.every_nth != 1:
-            start = skiprows
-            skiprows = lambda x: x < start or (x-start) % self.every_nth != 0
-            if nrows is not None:
-                nrows = (nrows-1) // self.every_nth + 1
-        try:
-            import pandas
-            if delimiter is None:
-                data = pandas.read_csv(file_name, comment=comment_marker, delim_whitespace=True,
-                                       header=None, skiprows=skiprows, nrows=nrows)
-            else:
-                data = pandas.read_csv(file_name, comment=comment_marker, delimiter=delimiter,
-                                       header=None, skiprows=skiprows, nrows=nrows)
-            data = data.dropna(axis=0).values
-        except ImportError:
-            self.logger.warning("Unable to import pandas..  Using np.genfromtxt instead.\n"+
-                                "Installing pandas is recommended for increased speed when "+
-                                "reading ASCII catalogs.")
-            if self.every_nth == 1:
-                data = np.genfromtxt(file_name, comments=comment_marker, delimiter=delimiter,
-                                     skip_header=skiprows, max_rows=nrows)
-            else:
-                # Numpy can't handle skiprows being a function.  Have to do this manually.
-                if self.end is None:
-                    max_rows = None
-                else:
-                    max_rows = self.end - self.start
-                data = np.genfromtxt(file_name, comments=comment_marker, delimiter=delimiter,
-                                     skip_header=start, max_rows=max_rows)
-                data = data[::self.every_nth]
-
-        # If only one row, and not using pands, then the shape comes in as one-d.  Reshape it:
-        if len(data.shape) == 1:
-            data = data.reshape(1,-1)
-        ncols = data.shape[1]
-
-        self.logger.debug('read data from %s, num=%d',file_name,num)
-        self.logger.debug('data shape = %s',str(data.shape))
 
         # Get the column numbers
         x_col = treecorr.config.get_from_list(self.config,'x_col',num,int,0)
@@ -1248,46 +1270,68 @@ class Catalog(object):
         k_col = treecorr.config.get_from_list(self.config,'k_col',num,int,0)
         patch_col = treecorr.config.get_from_list(self.config,'patch_col',num,int,0)
 
+        # Use the C++ parser if we can.  Else use pandas or numpy.
+        all_cols = [x_col, y_col, z_col, ra_col, dec_col, r_col, w_col, wpos_col, flag_col,
+                    patch_col]
+        if not is_rand:
+            all_cols += [g1_col, g2_col, k_col]
+        columns, ncols = self._read_ascii_columns(file_name, comment_marker, delimiter, all_cols)
+        if columns is not None:
+            used = set()
+            def get_col(c, dtype=float):
+                # Like data[:,c-1] below, c=0 means the last column.
+                if c == 0: c = ncols
+                if c in used or dtype is not float:
+                    return columns[c].astype(dtype)
+                used.add(c)
+                return columns[c]
+        else:
+            data = self._read_ascii_data(file_name, comment_marker, delimiter)
+            ncols = data.shape[1]
+            def get_col(c, dtype=float):
+                # NB. astype always copies, even if the type is already correct.
+                # We actually want this, since it makes the result contiguous in memory,
+                # which we will need.
+                return data[:,c-1].astype(dtype)
+        self.logger.debug('read data from %s, num=%d',file_name,num)
+
         # Read x,y or ra,dec
         if x_col != 0:
-            # NB. astype always copies, even if the type is already correct.
-            # We actually want this, since it makes the result contiguous in memory,
-            # which we will need.
-            self._x = data[:,x_col-1].astype(float)
+            self._x = get_col(x_col)
             self.logger.debug('read x')
-            self._y = data[:,y_col-1].astype(float)
+            self._y = get_col(y_col)
             self.logger.debug('read y')
             if z_col != 0:
-                self._z = data[:,z_col-1].astype(float)
+                self._z = get_col(z_col)
                 self.logger.debug('read r')
         if ra_col != 0:
-            self._ra = data[:,ra_col-1].astype(float)
+            self._ra = get_col(ra_col)
             self.logger.debug('read ra')
-            self._dec = data[:,dec_col-1].astype(float)
+            self._dec = get_col(dec_col)
             self.logger.debug('read dec')
             if r_col != 0:
-                self._r = data[:,r_col-1].astype(float)
+                self._r = get_col(r_col)
                 self.logger.debug('read r')
         self._apply_units()
 
         # Read w
         if w_col != 0:
-            self._w = data[:,w_col-1].astype(float)
+            self._w = get_col(w_col)
             self.logger.debug('read w')
 
         # Read wpos
         if wpos_col != 0:
-            self._wpos = data[:,wpos_col-1].astype(float)
+            self._wpos = get_col(wpos_col)
             self.logger.debug('read wpos')
 
         # Read flag
         if flag_col != 0:
-            self._flag = data[:,flag_col-1].astype(int)
+            self._flag = get_col(flag_col, int)
             self.logger.debug('read flag')
 
         # Read patch
         if patch_col != 0:
-            self._patch = data[:,patch_col-1].astype(int)
+            self._patch = get_col(patch_col, int)
             self.logger.debug('read patch')
             self._set_npatch()
 
@@ -1295,19 +1339,109 @@ class Catalog(object):
         if not is_rand:
             # Read g1,g2
             if g1_col >= 0 and g1_col <= ncols:
-                self._g1 = data[:,g1_col-1].astype(float)
+                self._g1 = get_col(g1_col)
                 self.logger.debug('read g1')
-                self._g2 = data[:,g2_col-1].astype(float)
+                self._g2 = get_col(g2_col)
                 self.logger.debug('read g2')
 
             # Read k
             if k_col >= 0 and k_col <= ncols:
-                self._k = data[:,k_col-1].astype(float)
+                self._k = get_col(k_col)
                 self.logger.debug('read k')
 
         if self._single_patch is not None:
             self._select_patch(self._single_patch)
 
+    def _read_ascii_data(self, file_name, comment_marker, delimiter):
+        # Read all the columns of an ASCII file into a 2-d array with pandas or numpy.
+        # I want read_csv to ignore header lines that start with the comment marker, but
+        # there is currently a bug in read_csv that messing things up when we do this.
+        # cf. https://github.com/pydata/pandas/issues/4623
+        # For now, my workaround in to count how many lines start with the comment marker
+        # and skip them by hand.
+        skiprows = 0
+        with open(file_name, 'r') as fid:
+            for line in fid:  # pragma: no branch
+                if line.startswith(comment_marker): skiprows += 1
+                else: break
+        skiprows += self.start
+        if self.end is None:
+            nrows = None
+        else:
+            nrows = self.end - self.start
+        if self.every_nth != 1:
+            start = skiprows
+            skiprows = lambda x: x < start or (x-start) % self.every_nth != 0
+            if nrows is not None:
+                nrows = (nrows-1) // self.every_nth + 1
+        try:
+            import pandas
+            if delimiter is None:
+                data = pandas.read_csv(file_name, comment=comment_marker, delim_whitespace=True,
+                                       header=None, skiprows=skiprows, nrows=nrows)
+            else:
+                data = pandas.read_csv(file_name, comment=comment_marker, delimiter=delimiter,
+                                       header=None, skiprows=skiprows, nrows=nrows)
+            data = data.dropna(axis=0).values
+        except ImportError:
+            self.logger.warning("Unable to import pandas..  Using np.genfromtxt instead.\n"+
+                                "Installing pandas is recommended for increased speed when "+
+                                "reading ASCII catalogs.")
+            if self.every_nth == 1:
+                data = np.genfromtxt(file_name, comments=comment_marker, delimiter=delimiter,
+                                     skip_header=skiprows, max_rows=nrows)
+            else:
+                # Numpy can't handle skiprows being a function.  Have to do this manually.
+                if self.end is None:
+                    max_rows = None
+                else:
+                    max_rows = self.end - self.start
+                data = np.genfromtxt(file_name, comments=comment_marker, delimiter=delimiter,
+                                     skip_header=start, max_rows=max_rows)
+                data = data[::self.every_nth]
+
+        # If only one row, and not using pands, then the shape comes in as one-d.  Reshape it:
+        if len(data.shape) == 1:
+            data = data.reshape(1,-1)
+        return data
+
+    def _read_ascii_columns(self, file_name, comment_marker, delimiter, all_cols):
+        # Read the given columns (1-based, 0 means the last one) of an ASCII file with the
+        # C++ parser, which is multi-threaded and only parses the columns that are needed.
+        # Returns a dict of the arrays by column number and the number of columns in the file,
+        # or None, None if it can't read this file, in which case we use pandas instead.
+        # Note: Like pandas, any rows with missing or NaN values are dropped, but only the
+        # columns that are used are checked.
+        if (file_name.endswith(('.gz', '.bz2', '.zip', '.xz')) or
+                (delimiter is not None and len(delimiter) != 1)):
+            return None, None
+        from .util import double_ptr as dp
+        args = (file_name.encode(), comment_marker.encode(),
+                delimiter.encode() if delimiter is not None else b'\0',
+                self.start, self.end if self.end is not None else -1, self.every_nth)
+        treecorr.set_omp_threads(self.config.get('num_threads',None))
+        pncols = treecorr._ffi.new('int*')
+        nrows = treecorr._lib.CountAsciiRows(*(args + (pncols,)))
+        if nrows < 0:
+            return None, None
+        ncols = pncols[0]
+        cols = sorted(set(c if c != 0 else ncols for c in all_cols if 0 <= c <= ncols))
+        cols = [c for c in cols if c > 0]
+        arrays = [np.empty(nrows, dtype=float) for c in cols]
+        pcols = treecorr._ffi.new('int[]', cols)
+        parrays = treecorr._ffi.new('double*[]', [dp(a) for a in arrays])
+        nbad = treecorr._lib.ReadAsciiColumns(*(args + (len(cols), pcols, parrays, nrows)))
+        if nbad < 0:
+            return None, None
+        bad = np.zeros(nrows, dtype=bool)
+        for a in arrays:
+            bad |= np.isnan(a)
+        if np.any(bad):
+            arrays = [a[~bad] for a in arrays]
+        self.logger.debug('read %d rows, %d columns with C++ parser', len(bad)-np.sum(bad),
+                          len(cols))
+        return dict(zip(cols, arrays)), ncols
+
     def _check_fits(self, file_name, num=0, is_rand=False):
         # Just check the consistency of the various column numbers so we can fail fast.
         try:
@@ -1450,29 +1584,39 @@ class Catalog(object):
             num (int):          Which number catalog are we reading. (default: 0)
             is_rand (bool):     Is this a random catalog? (default: False)
         """
+        # The arrays read below are normally the right type already, so they can be used
+        # directly, rather than making another copy of each column.  The exception is if the
+        # same column is used for two things (e.g. w and wpos), since some are modified in place.
+        used = set()
+        def take(data, col, dtype=float):
+            if col in used:
+                return np.array(data[col], dtype=dtype)
+            used.add(col)
+            return np.ascontiguousarray(data[col], dtype=dtype)
+
         # Helper functions for things we might do in one of two places.
         def set_pos(data, x_col, y_col, z_col, ra_col, dec_col, r_col):
             if x_col != '0' and x_col in data:
-                self._x = data[x_col].astype(float)
+                self._x = take(data, x_col)
                 self.logger.debug('read x')
-                self._y = data[y_col].astype(float)
+                self._y = take(data, y_col)
                 self.logger.debug('read y')
                 if z_col != '0':
-                    self._z = data[z_col].astype(float)
+                    self._z = take(data, z_col)
                     self.logger.debug('read z')
             if ra_col != '0' and ra_col in data:
-                self._ra = data[ra_col].astype(float)
+                self._ra = take(data, ra_col)
                 self.logger.debug('read ra')
-                self._dec = data[dec_col].astype(float)
+                self._dec = take(data, dec_col)
                 self.logger.debug('read dec')
                 if r_col != '0':
-                    self._r = data[r_col].astype(float)
+                    self._r = take(data, r_col)
                     self.logger.debug('read r')
             self._apply_units()
 
         def set_patch(data, patch_col):
             if patch_col != '0' and patch_col in data:
-                self._patch = data[patch_col].astype(int)
+                self._patch = take(data, patch_col, int)
                 self.logger.debug('read patch')
                 self._set_npatch()
 
@@ -1573,6 +1717,7 @@ class Catalog(object):
                     s = use
                 self._patch = None
                 data = {}  # Start fresh, since the ones we used so far are done.
+                used.clear()
 
                 # We might actually be done now, in which case, just return.
                 # (Else the fits read below won't actually work.)
@@ -1580,14 +1725,23 @@ class Catalog(object):
                     return
 
             # Now read the rest using the updated s
+            # Read them in chunks of rows directly into arrays of the final type, so we don't
+            # have the full catalog in memory more than once.
+            int_cols = [patch_col, flag_col]
             for h in all_hdus:
                 use_cols1 = [c for c in all_cols if col_by_hdu[c] == h and
                                                     c in fits[h].get_colnames()]
                 if len(use_cols1) == 0:
                     continue
-                data1 = fits[h][use_cols1][s]
+                nrows = fits[h].get_nrows() if isinstance(s, slice) else len(s)
                 for c in use_cols1:
-                    data[c] = data1[c]
+                    data[c] = np.empty(nrows, dtype=int if c in int_cols else float)
+                for i1 in range(0, nrows, self._fits_chunk_size):
+                    i2 = min(i1 + self._fits_chunk_size, nrows)
+                    rows = slice(i1, i2) if isinstance(s, slice) else s[i1:i2]
+                    data1 = fits[h][use_cols1][rows]
+                    for c in use_cols1:
+                        data[c][i1:i2] = data1[c]
 
             # Set position values
             set_pos(data, x_col, y_col, z_col, ra_col, dec_col, r_col)
@@ -1597,33 +1751,109 @@ class Catalog(object):
 
             # Set w
             if w_col != '0':
-                self._w = data[w_col].astype(float)
+                self._w = take(data, w_col)
                 self.logger.debug('read w')
 
             # Set wpos
             if wpos_col != '0':
-                self._wpos = data[wpos_col].astype(float)
+                self._wpos = take(data, wpos_col)
                 self.logger.debug('read wpos')
 
             # Set flag
             if flag_col != '0':
-                self._flag = data[flag_col].astype(int)
+                self._flag = take(data, flag_col, int)
                 self.logger.debug('read flag')
 
             # Skip g1,g2,k if this file is a random catalog
             if not is_rand:
                 # Set g1,g2
                 if g1_col in fits[g1_hdu].get_colnames():
-                    self._g1 = data[g1_col].astype(float)
+                    self._g1 = take(data, g1_col)
                     self.logger.debug('read g1')
-                    self._g2 = data[g2_col].astype(float)
+                    self._g2 = take(data, g2_col)
                     self.logger.debug('read g2')
 
                 # Set k
                 if k_col in fits[k_hdu].get_colnames():
-                    self._k = data[k_col].astype(float)
+                    self._k = take(data, k_col)
                     self.logger.debug('read k')
 
+    def _check_binary(self, file_name, num=0, is_rand=False):
+        # Read the header, so we fail fast if the file is not a valid binary catalog.
+        _, header = treecorr.util.read_binary(file_name, header_only=True)
+        names = [c[0] for c in header['columns']]
+
+        # If the whole file will be used, then the header values are still valid.
+        # In particular, the center and size let cross-patch correlations skip this catalog
+        # without loading it.
+        self._binary_full = (self.start == 0 and self.end is None and self.every_nth == 1 and
+                             not (self._single_patch is not None and
+                                  ('patch' in names or self._centers is not None)))
+        if self._binary_full:
+            self._cen_s = tuple(header['center_size'])
+
+    def read_binary(self, file_name, num=0, is_rand=False):
+        """Read the catalog from a binary file that was written by `write_binary`.
+
+        The arrays are memory mapped from the file, so this is very fast.  Only the rows
+        from first_row, last_row and every_nth are used, but the other column parameters
+        are not relevant for these files.
+
+        Parameters:
+            file_name (str):    The name of the file to read in.
+            num (int):          Which number catalog are we reading. (default: 0)
+            is_rand (bool):     Is this a random catalog? (default: False)
+        """
+        columns, header = treecorr.util.read_binary(file_name)
+        use = slice(self.start, self.end, self.every_nth)
+
+        def take(name):
+            if name not in columns:
+                return None
+            # With every_nth > 1, the slice isn't contiguous, so this needs a copy.
+            return np.ascontiguousarray(columns[name][use])
+
+        self._x = take('x')
+        self._y = take('y')
+        self._z = take('z')
+        self._ra = take('ra')
+        self._dec = take('dec')
+        self._r = take('r')
+        self._w = take('w')
+        self._wpos = take('wpos')
+        if not is_rand:
+            self._g1 = take('g1')
+            self._g2 = take('g2')
+            self._k = take('k')
+        self._patch = take('patch')
+        self._drop_radec = header['drop_radec']
+        self.x_units = self.y_units = 1.
+        if self._ra is not None:
+            self.ra_units = self.dec_units = 1.
+        self.logger.debug('read binary columns %s',list(columns.keys()))
+
+        if self._patch is not None:
+            self._set_npatch()
+        if self._single_patch is not None and (self._patch is not None or
+                                               self._centers is not None):
+            self._select_patch(self._single_patch)
+
+        self._nontrivial_w = header['nontrivial_w']
+        if self._binary_full:
+            self._sumw = header['sumw']
+            self._nobj = header['nobj']
+            if not is_rand:
+                self._varg = header['varg']
+                self._vark = header['vark']
+        elif self._nontrivial_w:
+            self._sumw = np.sum(self._w)
+            if self._sumw == 0:
+                raise ValueError("Catalog has invalid sumw == 0")
+        else:
+            self._sumw = self.ntot
+        if self._w is None:
+            self._w = np.ones((self.ntot), dtype=float)
+
     @property
     def nfields(self):
         if not hasattr(self, '_nfields'):
@@ -1757,6 +1987,8 @@ class Catalog(object):
         if hasattr(self, '_nsimplefields'): self.nsimplefields.clear()
         if hasattr(self, '_ksimplefields'): self.ksimplefields.clear()
         if hasattr(self, '_gsimplefields'): self.gsimplefields.clear()
+        # The subsamples for dilute_min_sep, and their fields.
+        if hasattr(self, '_diluted'): self._diluted.clear()
         self._field = lambda : None  # Acts like a dead weakref
 
     @property
@@ -1766,8 +1998,70 @@ class Catalog(object):
         # But if the weakref is alive, this returns the field we want.
         return self._field()
 
+    def _get_tree(self, key):
+        # Look for an existing field of any type that was built with the same parameters.
+        # Its tree structure can be reused for a new field, which is much faster than building
+        # a new tree.  (Only used if the new one isn't already in the cache.)
+        lazy = key[8]
+        if lazy: return None
+        for name in ['_nfields', '_kfields', '_gfields']:
+            if hasattr(self, name):
+                field = getattr(self, name).get(*key)
+                if field is None or field.ntot != self.ntot or field.lazy:
+                    continue
+                # The default min_top depends on the number of threads, which may have changed.
+                if field._determine_top(key[4], key[5]) == (field.min_top, field.max_top):
+                    return field
+        return None
+
+    def _get_field(self, cache, letter, key, logger):
+        # Get the field from the cache, building it if necessary.  For a Binary catalog, the
+        # field may have been saved next to the file (cf. save_fields), in which case reading
+        # it is much faster than building it.  The saved file only matches the catalog if all
+        # of it is used, and it doesn't apply to lazy or spilled fields.
+        lazy = key[8]
+        spill_dir = key[10]
+        if (self._share_fields is not None and not lazy and spill_dir is None and
+                cache.get(*key) is None):
+            return self._get_shared_field(cache, letter, key, logger)
+        if (self.file_type != 'Binary' or not self._binary_full or lazy or
+                spill_dir is not None or cache.get(*key) is not None):
+            return cache(*key, tree=self._get_tree(key), logger=logger)
+        saved = self.file_name + '.' + letter + 'field'
+        if os.path.exists(saved):
+            try:
+                return cache(*key, file_name=saved, logger=logger)
+            except OSError as e:
+                logger.info('Unable to use saved field %s: %s',saved,e)
+        field = cache(*key, tree=self._get_tree(key), logger=logger)
+        if self._save_fields:
+            logger.info('Saving field to %s',saved)
+            field.write(saved)
+        return field
+
+    def _get_shared_field(self, cache, letter, key, logger):
+        # cf. share_fields.  The name identifies the catalog (or patch) and the field parameters.
+        import hashlib
+        ident = repr((self.name, self.patch if self._single_patch is not None else None,
+                      self.ntot, key))
+        digest = hashlib.md5(ident.encode()).hexdigest()[:16]
+        name = '/%s_%s%s'%(self._share_fields, letter, digest)
+        try:
+            return cache(*key, shared_name=name, logger=logger)
+        except OSError as e:
+            logger.debug('No shared field %s: %s',name,e)
+        field = cache(*key, tree=self._get_tree(key), logger=logger)
+        try:
+            field.share(name)
+            logger.info('Shared field as %s',name)
+        except OSError as e:
+            # e.g. another process is sharing one with different parameters.
+            logger.info('Unable to share field as %s: %s',name,e)
+        return field
+
     def getNField(self, min_size=0, max_size=None, split_method=None, brute=False,
-                  min_top=None, max_top=10, coords=None, logger=None):
+                  min_top=None, max_top=10, coords=None, share_leaves=False, lazy=False,
+                  presort=False, spill_dir=None, logger=None):
         """Return an `NField` based on the positions in this catalog.
 
         The `NField` object is cached, so this is efficient to call multiple times.
@@ -1785,6 +2079,16 @@ class Catalog(object):
             max_top (int):      The maximum number of top layers to use when setting up the
                                 field. (default: 10)
             coords (str):       The kind of coordinate system to use. (default: self.coords)
+            share_leaves (bool): Whether to build the leaf cells directly from the catalog
+                                arrays to save memory while building the field.
+                                (default: False; cf. `NField`)
+            lazy (bool):        Whether to only build the lower cells when they are first
+                                needed. (default: False; cf. `NField`)
+            presort (bool):     Whether to sort the objects along a space-filling curve before
+                                building the field. (default: False; cf. `NField`)
+            spill_dir (str):    A directory in which to store most of the tree in a memory
+                                mapped file, rather than in memory. (default: None;
+                                cf. `NField`)
             logger:             A Logger object if desired (default: self.logger)
 
         Returns:
@@ -1794,14 +2098,16 @@ class Catalog(object):
             split_method = treecorr.config.get(self.config,'split_method',str,'mean')
         if logger is None:
             logger = self.logger
-        field = self.nfields(min_size, max_size, split_method, brute, min_top, max_top, coords,
-                             logger=logger)
+        key = (min_size, max_size, split_method, brute, min_top, max_top, coords,
+               share_leaves, lazy, presort, spill_dir)
+        field = self._get_field(self.nfields, 'n', key, logger)
         self._field = weakref.ref(field)
         return field
 
 
     def getKField(self, min_size=0, max_size=None, split_method=None, brute=False,
-                  min_top=None, max_top=10, coords=None, logger=None):
+                  min_top=None, max_top=10, coords=None, share_leaves=False, lazy=False,
+                  presort=False, spill_dir=None, logger=None):
         """Return a `KField` based on the k values in this catalog.
 
         The `KField` object is cached, so this is efficient to call multiple times.
@@ -1819,6 +2125,16 @@ class Catalog(object):
             max_top (int):      The maximum number of top layers to use when setting up the
                                 field. (default: 10)
             coords (str):       The kind of coordinate system to use. (default self.coords)
+            share_leaves (bool): Whether to build the leaf cells directly from the catalog
+                                arrays to save memory while building the field.
+                                (default: False; cf. `NField`)
+            lazy (bool):        Whether to only build the lower cells when they are first
+                                needed. (default: False; cf. `NField`)
+            presort (bool):     Whether to sort the objects along a space-filling curve before
+                                building the field. (default: False; cf. `NField`)
+            spill_dir (str):    A directory in which to store most of the tree in a memory
+                                mapped file, rather than in memory. (default: None;
+                                cf. `NField`)
             logger:             A Logger object if desired (default: self.logger)
 
         Returns:
@@ -1830,14 +2146,16 @@ class Catalog(object):
             raise TypeError("k is not defined.")
         if logger is None:
             logger = self.logger
-        field = self.kfields(min_size, max_size, split_method, brute, min_top, max_top, coords,
-                             logger=logger)
+        key = (min_size, max_size, split_method, brute, min_top, max_top, coords,
+               share_leaves, lazy, presort, spill_dir)
+        field = self._get_field(self.kfields, 'k', key, logger)
         self._field = weakref.ref(field)
         return field
 
 
     def getGField(self, min_size=0, max_size=None, split_method=None, brute=False,
-                  min_top=None, max_top=10, coords=None, logger=None):
+                  min_top=None, max_top=10, coords=None, share_leaves=False, lazy=False,
+                  presort=False, spill_dir=None, logger=None):
         """Return a `GField` based on the g1,g2 values in this catalog.
 
         The `GField` object is cached, so this is efficient to call multiple times.
@@ -1855,6 +2173,16 @@ class Catalog(object):
             max_top (int):      The maximum number of top layers to use when setting up the
                                 field. (default: 10)
             coords (str):       The kind of coordinate system to use. (default self.coords)
+            share_leaves (bool): Whether to build the leaf cells directly from the catalog
+                                arrays to save memory while building the field.
+                                (default: False; cf. `NField`)
+            lazy (bool):        Whether to only build the lower cells when they are first
+                                needed. (default: False; cf. `NField`)
+            presort (bool):     Whether to sort the objects along a space-filling curve before
+                                building the field. (default: False; cf. `NField`)
+            spill_dir (str):    A directory in which to store most of the tree in a memory
+                                mapped file, rather than in memory. (default: None;
+                                cf. `NField`)
             logger:             A Logger object if desired (default: self.logger)
 
         Returns:
@@ -1866,8 +2194,9 @@ class Catalog(object):
             raise TypeError("g1,g2 are not defined.")
         if logger is None:
             logger = self.logger
-        field = self.gfields(min_size, max_size, split_method, brute, min_top, max_top, coords,
-                             logger=logger)
+        key = (min_size, max_size, split_method, brute, min_top, max_top, coords,
+               share_leaves, lazy, presort, spill_dir)
+        field = self._get_field(self.gfields, 'g', key, logger)
         self._field = weakref.ref(field)
         return field
 
@@ -2055,6 +2384,11 @@ class Catalog(object):
                 self.read_fits(self.file_name,self._num,self._is_rand)
             elif self.file_type == 'ASCII':
                 self.read_ascii(self.file_name,self._num,self._is_rand)
+            elif self.file_type == 'Binary':
+                # Binary files are already in their final form, so only the patches are left.
+                self.read_binary(self.file_name,self._num,self._is_rand)
+                self._finish_patches()
+                return
             else: # pragma: no cover
                 # This is already checked, so shouldn't be possible to happen.
                 raise ValueError("Invalid file_type %s"%self.file_type)
@@ -2162,20 +2496,31 @@ class Catalog(object):
 
         # Write the patches to files if requested.
         if self.save_patch_dir is not None:
+            binary = self.save_patch_type == 'Binary'
+            ext = '.tcb' if binary else '.fits'
             file_names = []
             for i, p in enumerate(self._patches):
                 if self.file_name is not None:
                     file_name = os.path.splitext(os.path.basename(self.file_name))[0]
-                    file_name += '_%00d.fits'%i
+                    file_name += '_%00d'%i + ext
                 else:
-                    file_name = 'patch%00d.fits'%i
+                    file_name = 'patch%00d'%i + ext
                 file_name = os.path.join(self.save_patch_dir, file_name)
                 self.logger.info('Writing patch %d to %s',i,file_name)
-                col_names = p.write(file_name)
+                if binary:
+                    p.write_binary(file_name)
+                else:
+                    col_names = p.write(file_name)
                 file_names.append(file_name)
                 if low_mem:
                     p.unload()
-            if low_mem:
+            if low_mem and binary:
+                # Binary files have all the information about the columns, so these don't
+                # need any other parameters.
+                self._patches = [Catalog(file_name=file_names[i], patch=i,
+                                         save_fields=self._save_fields)
+                                 for i in range(len(file_names))]
+            elif low_mem:
                 # If low_mem, replace _patches with a version the reads from these files.
                 # This will typically be a lot faster for when the load does happen.
                 kwargs = {c + '_col' : c for c in col_names if c != 'patch'}
@@ -2223,14 +2568,19 @@ class Catalog(object):
 
         Parameters:
             file_name (str):    The name of the file to write to.
-            file_type (str):    The type of file to write ('ASCII' or 'FITS').  (default:
-                                determine the type automatically from the extension of file_name.)
+            file_type (str):    The type of file to write ('ASCII', 'FITS' or 'Binary').
+                                (default: determine the type automatically from the extension
+                                of file_name.)  cf. `write_binary` for the 'Binary' option.
             cat_precision (int): For ASCII output catalogs, the desired precision. (default: 16;
                                 this value can also be given in the Catalog constructor in the
                                 config dict.)
         Returns:
             The column names that were written to the file as a list.
         """
+        if file_type == 'Binary' or (file_type is None and
+                                     os.path.splitext(file_name)[1].lower() == '.tcb'):
+            return self.write_binary(file_name)
+
         self.logger.info('Writing catalog to %s',file_name)
 
         col_names = []
@@ -2277,6 +2627,68 @@ class Catalog(object):
                                 file_type=file_type, logger=self.logger)
         return col_names
 
+    def write_binary(self, file_name):
+        """Write the catalog to a binary file that can be loaded very quickly.
+
+        The file has the arrays that are used internally, so when it is read back (using
+        ``file_type='Binary'`` or a file name ending in .tcb), the arrays are memory mapped
+        directly from the file with no parsing or other processing.  The positions are always
+        written in radians, and the summary statistics (sumw, varg, etc.) are written in the
+        header, so they don't need to be recomputed either.
+
+        .. note::
+
+            The arrays are written in the native byte order, so the file should be read back
+            on the same kind of machine.
+
+        Any fields saved next to this file (cf. the ``save_fields`` option) are removed, since
+        they would not match the new file.
+
+        Parameters:
+            file_name (str):    The name of the file to write to.
+
+        Returns:
+            The column names that were written to the file as a list.
+        """
+        self.logger.info('Writing catalog to binary file %s',file_name)
+        self.load()
+
+        col_names = []
+        columns = []
+        def add(name, col, dtype=float):
+            if col is not None:
+                col_names.append(name)
+                columns.append(np.asarray(col, dtype=dtype))
+        add('x', self._x)
+        add('y', self._y)
+        add('z', self._z)
+        add('ra', self._ra)
+        add('dec', self._dec)
+        add('r', self._r)
+        if self.nontrivial_w:
+            add('w', self._w)
+        add('wpos', self._wpos)
+        add('g1', self._g1)
+        add('g2', self._g2)
+        add('k', self._k)
+        add('patch', self._patch, np.int64)
+
+        params = {
+            'nontrivial_w' : bool(self.nontrivial_w),
+            'sumw' : float(self.sumw),
+            'nobj' : int(self.nobj),
+            'varg' : float(self.varg),
+            'vark' : float(self.vark),
+            'drop_radec' : bool(self._drop_radec),
+            'center_size' : [float(v) for v in self._get_center_size()],
+        }
+        treecorr.util.write_binary(file_name, col_names, columns, params)
+        for letter in 'nkg':
+            saved = file_name + '.' + letter + 'field'
+            if os.path.exists(saved):
+                os.remove(saved)
+        return col_names
+
     def copy(self):
         """Make a copy"""
         import copy
@@ -2292,6 +2704,7 @@ class Catalog(object):
         d.pop('_nsimplefields',None)
         d.pop('_ksimplefields',None)
         d.pop('_gsimplefields',None)
+        d.pop('_diluted',None)
         return d
 
     def __setstate__(self, d):
@@ -2397,6 +2810,109 @@ def read_catalogs(config, key=None, list_key=None, num=0, logger=None, is_rand=N
     return [ Catalog(file_name, config, num, logger, is_rand) for file_name in file_names ]
 
 
+def kmeans_chunks(cat_list, npatch, max_iter=200, tol=1.e-5, init='tree', alt=False,
+                  logger=None):
+    """Find patch centers with K-Means for a catalog that is too large to hold in memory.
+
+    The catalog is given as a list of Catalogs, each of which is one chunk of the full catalog,
+    e.g. individual files, or row ranges of a single file using ``first_row`` and ``last_row``.
+    The chunks are loaded one at a time, and each is unloaded again (cf. `Catalog.unload`)
+    before going on to the next one, so only one of them needs to fit in memory.
+
+    The initial centers are found from the first chunk according to ``init``.
+    (cf. `Field.kmeans_initialize_centers`)  Then the first pass through the chunks is
+    mini-batch K-Means (Sculley, 2010): after each chunk, each center is moved to the
+    weighted mean of its previous position (weighted by the total weight of the points
+    assigned to it so far) and the points in this chunk assigned to it.  This usually gets
+    close to the final centers in a single pass.  After that, each pass is one iteration of the
+    normal K-Means algorithm, accumulating the centroids of each patch over all the chunks
+    before updating the centers.  This continues until the rms shift in the centers is less
+    than ``tol`` times the size of the region covered by the centers, or the maximum number of
+    passes is reached.
+
+    With ``alt=True``, the inertia of each patch used for the alternate assignment is the one
+    calculated during the previous pass, rather than with the current centers, since the
+    latter would need another pass through all the chunks each iteration.
+
+    The resulting centers can then be used as ``patch_centers`` for each chunk (or the full
+    catalog), which is fast even for very large catalogs.
+
+    Parameters:
+        cat_list:           A list of Catalogs to use as the chunks.
+        npatch (int):       How many patches to generate
+        max_iter (int):     How many passes through the chunks at most to run. (default: 200)
+        tol (float):        Tolerance in the rms centroid shift to consider as converged
+                            as a fraction of the total field size. (default: 1.e-5)
+        init (str):         Initialization method for the first chunk. Options are 'tree',
+                            'random', 'kmeans++', or 'kmeans||'.  (default: 'tree')
+        alt (bool):         Use the alternate assignment algorithm to minimize the standard
+                            deviation of the inertia rather than the total inertia (aka WCSS).
+                            (default: False)
+        logger:             If desired, a logger object for logging. (default: None, in which
+                            case the logger of the first catalog is used.)
+
+    Returns:
+        An array of center coordinates.  Shape is (npatch, 2) for flat geometries or
+        (npatch, 3) for 3d or spherical geometries.  In the latter case, the centers represent
+        (x,y,z) coordinates on the unit sphere.
+    """
+    from treecorr.util import double_ptr as dp
+    if isinstance(cat_list, Catalog):
+        cat_list = [cat_list]
+    if len(cat_list) == 0:
+        raise ValueError("No catalogs provided")
+    if logger is None:
+        logger = cat_list[0].logger
+    max_top = int.bit_length(npatch)-1
+
+    def get_field(cat):
+        cat.load()
+        c = 'spherical' if cat._is_radec() else cat.coords
+        return cat.getNField(max_top=max_top, coords=c)
+
+    field = get_field(cat_list[0])
+    centers = field.kmeans_initialize_centers(npatch, init)
+    sphere = field._coords == treecorr._lib.Sphere
+
+    def normalize(c):
+        if sphere:
+            c /= np.sqrt(np.sum(c**2, axis=1))[:,np.newaxis]
+
+    counts = np.zeros(npatch)
+    inertia = None
+    for it in range(max_iter):
+        minibatch = (it == 0)
+        sums = np.zeros_like(centers)
+        weights = np.zeros(npatch)
+        new_inertia = np.zeros(npatch) if alt else None
+        old_centers = centers.copy()
+        for cat in cat_list:
+            field = get_field(cat)
+            if minibatch:
+                sums[:] = 0.
+                weights[:] = 0.
+            treecorr._lib.KMeansChunk(field.data, dp(centers), npatch, dp(inertia),
+                                      dp(sums), dp(weights), dp(new_inertia),
+                                      field._d, field._coords)
+            cat.unload()
+            if minibatch:
+                use = weights > 0
+                counts += weights
+                centers[use] += (sums[use] - weights[use,np.newaxis] * centers[use]) / (
+                                counts[use,np.newaxis])
+                normalize(centers)
+        if not minibatch:
+            treecorr.field._kmeans_update_centers(centers, sums, weights, field._coords)
+        if alt:
+            # The same normalization as CalculateInertia::finalize in KMeans.cpp.
+            inertia = new_inertia * 3. * npatch / np.sum(weights if not minibatch else counts)
+
+        logger.info("kmeans_chunks pass %d: rms shift = %g", it,
+                    np.sqrt(np.sum((centers - old_centers)**2) / npatch))
+        if treecorr.field._kmeans_converged(centers, old_centers, tol):
+            break
+    return centers
+
 def calculateVarG(cat_list):
     """Calculate the overall shear variance from a list of catalogs.
 
@@ -26,6 +26,37 @@ def _parse_split_method(split_method):
     else: return 3  # random
 
 
+def _kmeans_update_centers(centers, sums, weights, coords):
+    # Set the centers to the centroids given by the sums of w x and w for each patch.
+    # Patches with no weight keep their previous centers.
+    use = weights > 0
+    centers[use] = sums[use] / weights[use,np.newaxis]
+    if coords == treecorr._lib.Sphere:
+        centers /= np.sqrt(np.sum(centers**2, axis=1))[:,np.newaxis]
+
+def _kmeans_converged(centers, old_centers, tol):
+    # Like KMeansRun, check if the rms shift in the centers is less than tol times the size
+    # of the field.  Here the size is the largest distance from any center to their mean.
+    npatch = len(centers)
+    shiftsq = np.sum((centers - old_centers)**2)
+    sizesq = np.max(np.sum((centers - np.mean(centers, axis=0))**2, axis=1))
+    return shiftsq < tol**2 * sizesq * npatch
+
+def _concatenate_catalogs(cat1, cat2):
+    # A new catalog with the objects in cat1 followed by the ones in cat2, for Field.append.
+    def concat(name):
+        a = getattr(cat1, name)
+        b = getattr(cat2, name)
+        return None if a is None or b is None else np.concatenate([a, b])
+    kwargs = dict(w=concat('w'), wpos=concat('wpos'), g1=concat('g1'), g2=concat('g2'),
+                  k=concat('k'), keep_zero_weight=True)
+    if cat1.ra is not None:
+        kwargs.update(ra=concat('ra'), dec=concat('dec'), r=concat('r'),
+                      ra_units='rad', dec_units='rad')
+    else:
+        kwargs.update(x=concat('x'), y=concat('y'), z=concat('z'))
+    return treecorr.Catalog(**kwargs)
+
 class Field(object):
     r"""A Field in TreeCorr is the object that stores the tree structure we use for efficient
     calculation of the correlation functions.
@@ -99,6 +130,263 @@ class Field(object):
         """
         return treecorr._lib.FieldGetNTopLevel(self.data, self._d, self._coords)
 
+    @property
+    def build_times(self):
+        """A dict with the wall clock time (in seconds) taken by each stage of building the field.
+
+        The stages are:
+
+            - 'init' = making the data for each object and finding the overall center and size.
+            - 'top' = splitting the field into the top-level cells.
+            - 'cells' = building the trees below each of the top-level cells.
+
+        The cells are built lazily when they are first needed, so accessing this property
+        will build them if that hasn't happened yet.
+        """
+        from treecorr.util import double_ptr as dp
+        times = np.zeros(3)
+        treecorr._lib.FieldGetBuildTimes(self.data, self._d, self._coords, dp(times))
+        return { 'init' : times[0], 'top' : times[1], 'cells' : times[2] }
+
+    @property
+    def nbytes(self):
+        """The number of bytes of memory currently used by this field.
+
+        This includes the cells of the tree, and for a lazy field that isn't fully built yet,
+        the data for the objects that haven't been built into cells.  It doesn't include the
+        catalog arrays or the part of the tree that is in a spill file (cf. ``spill_nbytes``).
+
+        The cells are built lazily when they are first needed, so accessing this property
+        will build them if that hasn't happened yet.
+        """
+        return self._get_nbytes()[0]
+
+    @property
+    def spill_nbytes(self):
+        """The number of bytes of this field's spill file that are used by the tree.
+        (This is 0 unless the field was built with ``spill_dir``.)
+        """
+        return self._get_nbytes()[1]
+
+    def _get_nbytes(self):
+        from treecorr.util import long_ptr as lp
+        nbytes = np.zeros(2, dtype=int)
+        treecorr._lib.FieldGetNBytes(self.data, self._d, self._coords, lp(nbytes))
+        return nbytes
+
+    @staticmethod
+    def estimate_nbytes(ntot, coords='3d', d=1):
+        """Estimate the peak number of bytes of memory needed to build a field.
+
+        This assumes the tree goes all the way down to single objects (i.e. min_size = 0),
+        which is the most memory a field can use.  The peak is while the tree is being built,
+        when both the cells and the input data for each object are in memory.
+
+        Parameters:
+            ntot (int):     The number of objects.
+            coords (str):   The kind of coordinate system. (default: '3d')
+            d (int):        The type of field: 1 for NField, 2 for KField, 3 for GField.
+                            (default: 1)
+
+        Returns:
+            The estimated number of bytes.
+        """
+        from treecorr.util import long_ptr as lp
+        nbytes = np.zeros(2, dtype=int)
+        treecorr._lib.FieldGetObjectNBytes(d, treecorr.util.coord_enum(coords), lp(nbytes))
+        cell, obj = nbytes
+        # A tree with ntot leaves has 2 ntot - 1 cells.
+        return int(max(2*ntot-1, 0) * cell + ntot * obj)
+
+    def write(self, file_name):
+        """Write the tree structure of this field to a binary file.
+
+        The file can be read back by giving ``file_name`` when constructing a new field from
+        the same catalog with the same parameters, which is much faster than building the tree
+        again.
+
+        .. note::
+
+            The file format is a direct dump of the C++ structures, so it should only be read
+            back on the same kind of machine with the same version of TreeCorr.
+
+        Parameters:
+            file_name (str):    The name of the file to write to.
+        """
+        ok = treecorr._lib.FieldWrite(self.data, self._d, self._coords, file_name.encode(),
+                                      self._data_hash())
+        if not ok:
+            raise OSError("Unable to write field to %s"%file_name)
+
+    def append(self, cat):
+        """Add the objects in another catalog to this field.
+
+        The new objects are built into their own top-level cells, so the existing tree doesn't
+        need to be rebuilt.  The indices of the new objects (e.g. as returned by `get_near`)
+        continue on from the ones already in the field, so index ``self.ntot + i`` refers to
+        object i in the new catalog.
+
+        Each append adds more top-level cells, which makes the pruning of the tree a bit less
+        efficient.  So once the appended objects outnumber the ones from the last full build,
+        or there have been more appends than that build had top-level cells, the whole tree
+        is rebuilt instead.
+
+        .. note::
+
+            After this, the `cat` attribute is a new catalog with the objects of both
+            catalogs, which this field keeps alive.  The field is removed from the cache of
+            the original catalog, so `Catalog.getNField` and the like will build a new field
+            with just the original objects.
+
+        Parameters:
+            cat (Catalog):  The catalog with the objects to add.
+        """
+        from treecorr.util import double_ptr as dp
+        if treecorr.util.coord_enum(cat.coords) != self._coords:
+            raise ValueError("Cannot append a catalog with different coords")
+        if self._d == 3:
+            if cat.g1 is None or cat.g2 is None:
+                raise TypeError("g1,g2 are not defined.")
+            g1, g2, k = cat.g1, cat.g2, cat.w
+        elif self._d == 2:
+            if cat.k is None:
+                raise TypeError("k is not defined.")
+            g1, g2, k = cat.w, cat.w, cat.k
+        else:
+            g1, g2, k = cat.w, cat.w, cat.w
+
+        orig = self.cat
+        if orig is None:
+            raise ValueError("Cannot append to a field whose catalog no longer exists")
+        if not hasattr(self, '_nbuilt'):
+            self._nbuilt = self.ntot
+            self._ntop_built = self.nTopLevelNodes
+            self._nappend = 0
+            # This field doesn't describe the original catalog anymore.
+            for cache in (orig.nfields, orig.kfields, orig.gfields):
+                cache.discard(self)
+            if orig.field is self:
+                orig._field = lambda : None
+        combined = _concatenate_catalogs(orig, cat)
+
+        self._nappend += 1
+        if self.ntot + cat.ntot > 2 * self._nbuilt or self._nappend > self._ntop_built:
+            self._rebuild(combined)
+        else:
+            treecorr._lib.FieldAppend(self.data, dp(cat.x), dp(cat.y), dp(cat.z),
+                                      dp(g1), dp(g2), dp(k), dp(cat.w), dp(cat.wpos), cat.ntot,
+                                      self._d, self._coords)
+        self._combined_cat = combined
+        self._cat = weakref.ref(combined)
+        self.ntot = combined.ntot
+
+    def _rebuild(self, cat):
+        # Replace the tree with a new one built from all the objects in cat.
+        new = self.__class__(cat, self.min_size, self.max_size, self.split_method, self.brute,
+                             self.min_top, self.max_top, self.coords,
+                             share_leaves=self.share_leaves, lazy=self.lazy,
+                             presort=self.presort, spill_dir=self.spill_dir)
+        # Swap the C++ fields, so the old one is destroyed along with new.
+        self.data, new.data = new.data, self.data
+        self._nbuilt = cat.ntot
+        self._ntop_built = self.nTopLevelNodes
+        self._nappend = 0
+
+    def _data_hash(self):
+        # A hash of the values the tree was built from, so a file or shared segment built from
+        # a different catalog with the same size isn't used by mistake.
+        import hashlib
+        import struct
+        cat = self.cat
+        if cat is None:
+            raise ValueError("Cannot identify a field whose catalog no longer exists")
+        if self._d == 3:
+            arrays = [cat.g1, cat.g2]
+        elif self._d == 2:
+            arrays = [cat.k]
+        else:
+            arrays = []
+        h = hashlib.sha1()
+        for a in [cat.x, cat.y, cat.z, cat.w, cat.wpos] + arrays:
+            if a is None:
+                h.update(b'None')
+            else:
+                h.update(np.ascontiguousarray(a, dtype=float).tobytes())
+        return struct.unpack('<q', h.digest()[:8])[0]
+
+    def _read(self, file_name):
+        data = treecorr._lib.BuildFieldFromFile(file_name.encode(), self.ntot, self._data_hash(),
+                                                self.min_size, self.max_size, self._sm,
+                                                self.brute, self.min_top, self.max_top,
+                                                self._d, self._coords)
+        if data == treecorr._ffi.NULL:
+            raise OSError("Unable to read a field built from the same objects with matching "
+                          "parameters from %s"%file_name)
+        return data
+
+    def share(self, name):
+        """Put a copy of the tree of this field in shared memory, so other processes on the
+        same machine can use it without building it again.
+
+        Another process can use it by giving ``shared_name=name`` when constructing a field
+        from the same catalog with the same parameters (or more simply with the
+        ``share_fields`` option of `Catalog`).  The tree is used directly from the shared
+        memory, which is mapped read-only at the same address as in this process, so it doesn't
+        need to be copied or converted.  Attaching works when that address is free in the other
+        process, which is normally the case for a process forked from this one (e.g. with
+        ``multiprocessing``) or another instance of the same program.
+
+        The shared memory is removed when this field is deleted, although any processes that
+        are already using it can keep doing so.
+
+        .. note::
+
+            This process keeps using its own copy of the tree, so sharing a field doesn't
+            reduce the memory used here.
+
+        Parameters:
+            name (str):     The name of the shared memory segment, e.g. '/treecorr_cat1'.
+                            It should start with a '/' and not have any other slashes.
+        """
+        ok = treecorr._lib.FieldShare(self.data, self._d, self._coords, name.encode(),
+                                      self._data_hash())
+        if not ok:
+            raise OSError("Unable to share field as %s"%name)
+
+    def _attach(self, name):
+        data = treecorr._lib.AttachSharedField(name.encode(), self.ntot, self._data_hash(),
+                                               self.min_size, self.max_size, self._sm,
+                                               self.brute, self.min_top, self.max_top,
+                                               self._d, self._coords)
+        if data == treecorr._ffi.NULL:
+            raise OSError("Unable to use a shared field built from the same objects with matching "
+                          "parameters from %s"%name)
+        return data
+
+    def _spill_dir(self):
+        if self.spill_dir is None:
+            return treecorr._ffi.NULL
+        else:
+            return self.spill_dir.encode()
+
+    def _check_spill(self):
+        if self.data == treecorr._ffi.NULL:
+            # Remove it, so __del__ doesn't try to destroy it.
+            del self.data
+            raise OSError("Unable to make a spill file in %s"%self.spill_dir)
+
+    def _check_tree(self, tree, cat):
+        # Make sure that tree is a field whose tree structure we can use for this one.
+        if tree.cat is not cat or tree.ntot != cat.ntot:
+            raise ValueError("tree must be a field built from the same catalog")
+        if (tree.min_size != self.min_size or tree.max_size != self.max_size or
+                tree.split_method != self.split_method or tree.brute != self.brute or
+                tree.min_top != self.min_top or tree.max_top != self.max_top or
+                tree._coords != self._coords or tree.spill_dir != self.spill_dir):
+            raise ValueError("tree must be a field built with the same parameters")
+        if tree.lazy or self.lazy:
+            raise ValueError("tree cannot be used with lazy fields")
+
     @property
     def cat(self):
         """The catalog from which this field was constructed.
@@ -260,7 +548,171 @@ class Field(object):
         treecorr._lib.FieldGetNear(self.data, x, y, z, sep, self._d, self._coords, lp(ind), n)
         return ind
 
-    def run_kmeans(self, npatch, max_iter=200, tol=1.e-5, init='tree', alt=False):
+    def _parse_points(self, points, sep=None):
+        # Split an (nq,2) or (nq,3) array of positions into contiguous x,y,z arrays, and
+        # broadcast sep to the same length.
+        ndim = 2 if self._coords == treecorr._lib.Flat else 3
+        points = np.atleast_2d(np.asarray(points, dtype=float))
+        if points.ndim != 2 or points.shape[1] != ndim:
+            raise ValueError("points must have shape (nq, %d)"%ndim)
+        nq = points.shape[0]
+        x = np.ascontiguousarray(points[:,0])
+        y = np.ascontiguousarray(points[:,1])
+        z = np.ascontiguousarray(points[:,2]) if ndim == 3 else np.zeros(nq)
+        if sep is not None:
+            sep = np.ascontiguousarray(np.broadcast_to(np.asarray(sep, dtype=float), (nq,)))
+        return x, y, z, sep
+
+    def count_near_many(self, points, sep):
+        """Count how many points are near each of many given coordinates.
+
+        This is the batched version of `count_near`.  The queries are run in parallel using
+        OpenMP, so this is much faster than calling `count_near` in a loop.
+
+        Parameters:
+            points (array):     An array of query coordinates.
+                                Shape is (nq, 2) for flat geometries or (nq, 3) for 3d or
+                                spherical geometries.  In the latter case, the points represent
+                                (x,y,z) coordinates on the unit sphere.
+            sep (float or array):   The separation distance, either a single value for all the
+                                queries or an array of length nq.  For spherical geometries,
+                                this is the chord distance on the unit sphere, which is
+                                2 sin(theta/2) for an angle theta.
+
+        Returns:
+            An array of counts with length nq.
+        """
+        if self.min_size == 0:
+            return self._count_near_many(*self._parse_points(points, sep))
+        else:
+            # As for count_near, let get_near_many do the exact check of the radii.
+            ind, offsets = self.get_near_many(points, sep)
+            return np.diff(offsets)
+
+    def _count_near_many(self, x, y, z, sep):
+        from treecorr.util import double_ptr as dp
+        from treecorr.util import long_ptr as lp
+        counts = np.empty(len(x), dtype=int)
+        treecorr._lib.FieldCountNearMany(self.data, dp(x), dp(y), dp(z), dp(sep), len(x),
+                                         self._d, self._coords, lp(counts))
+        return counts
+
+    def get_near_many(self, points, sep):
+        """Get the indices of points near each of many given coordinates.
+
+        This is the batched version of `get_near`.  The queries are run in parallel using
+        OpenMP, and the results are returned in compressed sparse row (CSR) format:
+        the indices near query q are ``indices[offsets[q]:offsets[q+1]]``.
+
+        Parameters:
+            points (array):     An array of query coordinates.
+                                Shape is (nq, 2) for flat geometries or (nq, 3) for 3d or
+                                spherical geometries.  In the latter case, the points represent
+                                (x,y,z) coordinates on the unit sphere.
+            sep (float or array):   The separation distance, either a single value for all the
+                                queries or an array of length nq.  For spherical geometries,
+                                this is the chord distance on the unit sphere.
+
+        Returns:
+            Tuple containing
+
+                - indices (array):  The indices of the nearby points for all the queries.
+                                    Within each query, they are sorted.
+                - offsets (array):  An array of length nq+1 giving the start of each query's
+                                    section of indices.
+        """
+        x, y, z, sep = self._parse_points(points, sep)
+        if self.min_size == 0:
+            # If min_size == 0, then regular method is already exact.
+            ind, offsets = self._get_near_many(x, y, z, sep)
+            q = np.repeat(np.arange(len(x)), np.diff(offsets))
+        else:
+            # Expand the radius by the minimum size of the cells, and then check the actual
+            # radii of these points using the catalog x,y,z values, as in get_near.
+            ind, offsets = self._get_near_many(x, y, z, sep + self.min_size)
+            q = np.repeat(np.arange(len(x)), np.diff(offsets))
+            rsq = (self.cat.x[ind]-x[q])**2 + (self.cat.y[ind]-y[q])**2
+            if self._coords != treecorr._lib.Flat:
+                rsq += (self.cat.z[ind]-z[q])**2
+            near = rsq < sep[q]**2
+            ind = ind[near]
+            q = q[near]
+            offsets = np.zeros(len(x)+1, dtype=int)
+            offsets[1:] = np.cumsum(np.bincount(q, minlength=len(x)))
+        # Sort the indices within each query.
+        ind = ind[np.lexsort((ind, q))]
+        return ind, offsets
+
+    def _get_near_many(self, x, y, z, sep):
+        from treecorr.util import double_ptr as dp
+        from treecorr.util import long_ptr as lp
+        # First count how many there are near each point to get the offsets for the output.
+        counts = self._count_near_many(x, y, z, sep)
+        offsets = np.zeros(len(x)+1, dtype=int)
+        offsets[1:] = np.cumsum(counts)
+        ind = np.empty(offsets[-1], dtype=int)
+        treecorr._lib.FieldGetNearMany(self.data, dp(x), dp(y), dp(z), dp(sep), len(x),
+                                       self._d, self._coords, lp(offsets), lp(ind))
+        return ind, offsets
+
+    def get_nearest(self, points, k=1):
+        """Find the k nearest points to each of many given coordinates.
+
+        This uses the existing tree structure to do a k-nearest-neighbor search for each
+        query point.  The queries are run in parallel using OpenMP.
+
+        Parameters:
+            points (array):     An array of query coordinates.
+                                Shape is (nq, 2) for flat geometries or (nq, 3) for 3d or
+                                spherical geometries.  In the latter case, the points represent
+                                (x,y,z) coordinates on the unit sphere.
+            k (int):            The number of neighbors to find for each point. (default: 1)
+
+        Returns:
+            Tuple containing
+
+                - indices (array):  The indices of the k nearest points, sorted from nearest to
+                                    farthest.  Shape is (nq, k).  If the field has fewer than k
+                                    points, the extra entries are -1.
+                - dist (array):     The distances to those points.  Shape is (nq, k).  For
+                                    spherical geometries, this is the chord distance.
+        """
+        k = int(k)
+        if k < 1:
+            raise ValueError("k must be at least 1")
+        x, y, z, _ = self._parse_points(points)
+        ind, dsq = self._get_nearest(x, y, z, k)
+        if self.min_size > 0:
+            # The tree search only knows the positions of the leaf cells, which may group
+            # several points together.  Each point is within min_size of its leaf, so the real
+            # k-th nearest point is within R = d_k + min_size, and all such points are within
+            # R + min_size of their leaves.  So get all the points within that radius and pick
+            # the nearest ones from their catalog positions.
+            dk = np.sqrt(dsq[:,-1])
+            near, offsets = self._get_near_many(x, y, z, dk + 2.*self.min_size)
+            q = np.repeat(np.arange(len(x)), np.diff(offsets))
+            rsq = (self.cat.x[near]-x[q])**2 + (self.cat.y[near]-y[q])**2
+            if self._coords != treecorr._lib.Flat:
+                rsq += (self.cat.z[near]-z[q])**2
+            order = np.lexsort((near, rsq, q))
+            rank = np.arange(len(order)) - offsets[q]
+            use = rank < k
+            ind[:,:] = -1
+            dsq[:,:] = np.inf
+            ind[q[use], rank[use]] = near[order][use]
+            dsq[q[use], rank[use]] = rsq[order][use]
+        return ind, np.sqrt(dsq)
+
+    def _get_nearest(self, x, y, z, k):
+        from treecorr.util import double_ptr as dp
+        from treecorr.util import long_ptr as lp
+        ind = np.empty((len(x), k), dtype=int)
+        dsq = np.empty((len(x), k), dtype=float)
+        treecorr._lib.FieldGetNearest(self.data, dp(x), dp(y), dp(z), len(x), k,
+                                      self._d, self._coords, lp(ind), dp(dsq))
+        return ind, dsq
+
+    def run_kmeans(self, npatch, max_iter=200, tol=1.e-5, init='tree', alt=False, comm=None):
         r"""Use k-means algorithm to set patch labels for a field.
 
         The k-means algorithm (cf. https://en.wikipedia.org/wiki/K-means_clustering) identifies
@@ -340,6 +792,15 @@ class Field(object):
         failure mode.) If this happens for you, your best bet is probably to switch to the
         standard algorithm, which can never suffer from this problem.
 
+        With MPI, each process can make a field from its own part of the catalog (e.g. some
+        region of the sky) and pass ``comm``.  Then the patches are found for the full catalog
+        without gathering it together on one process.  Each process starts with a share of the
+        initial centers from its own field, in proportion to its number of objects, and in
+        each iteration the sums for the new centers are added up over all the processes.
+        All the processes end up with the same centers, and the patches that are returned are
+        the ones for the objects in this field.  Since the full field size is not available,
+        the convergence criterion uses the size of the region spanned by the centers instead.
+
         Parameters:
             npatch (int):       How many patches to generate
             max_iter (int):     How many iterations at most to run. (default: 200)
@@ -354,10 +815,16 @@ class Field(object):
                                     - 'random' =  Use npatch random points as the intial centers.
                                     - 'kmeans++' =  Use the k-means++ algorithm.
                                       cf. https://en.wikipedia.org/wiki/K-means%2B%2B
+                                    - 'kmeans||' =  Use the k-means|| algorithm, a variant of
+                                      k-means++ that is faster for large npatch, since
+                                      it can be run in parallel.
+                                      cf. Bahmani et al, 2012, arXiv:1203.6402
 
             alt (bool):         Use the alternate assignment algorithm to minimize the standard
                                 deviation of the inertia rather than the total inertia (aka WCSS).
                                 (default: False)
+            comm (mpi4py.Comm): If running MPI, an mpi4py Comm object to communicate between
+                                processes.  (default: None)
 
         Returns:
             Tuple containing
@@ -369,11 +836,59 @@ class Field(object):
                   spherical geometries.  In the latter case, the centers represent
                   (x,y,z) coordinates on the unit sphere.
         """
-        centers = self.kmeans_initialize_centers(npatch, init)
-        self.kmeans_refine_centers(centers, max_iter, tol, alt)
+        if comm is not None:
+            centers = self._run_kmeans_mpi(npatch, max_iter, tol, init, alt, comm)
+        else:
+            centers = self.kmeans_initialize_centers(npatch, init)
+            self.kmeans_refine_centers(centers, max_iter, tol, alt)
         patches = self.kmeans_assign_patches(centers)
         return patches, centers
 
+    def _run_kmeans_mpi(self, npatch, max_iter, tol, init, alt, comm):
+        from treecorr.util import double_ptr as dp
+        rank = comm.Get_rank()
+
+        # Split up the initial centers according to the number of objects on each process.
+        all_ntot = np.array(comm.allgather(self.ntot))
+        if npatch > np.sum(all_ntot):
+            raise ValueError("Invalid npatch.  Cannot be greater than the total ntot.")
+        frac = npatch * all_ntot / float(np.sum(all_ntot))
+        nmine = np.floor(frac).astype(int)
+        # Give the rest to the ones with the largest remainders.
+        nmine[np.argsort(nmine - frac, kind='mergesort')[:npatch - np.sum(nmine)]] += 1
+        if nmine[rank] > 0:
+            my_centers = self.kmeans_initialize_centers(nmine[rank], init)
+        else:
+            my_centers = None
+        centers = np.concatenate([c for c in comm.allgather(my_centers) if c is not None])
+
+        if alt:
+            # The total weight, to normalize the inertia as CalculateInertia::finalize does.
+            weights = np.zeros(npatch)
+            treecorr._lib.KMeansChunk(self.data, dp(centers), npatch, dp(None),
+                                      dp(np.zeros_like(centers)), dp(weights), dp(None),
+                                      self._d, self._coords)
+            sumw = comm.allreduce(np.sum(weights))
+
+        inertia = None
+        for it in range(max_iter):
+            if alt:
+                inertia = np.zeros(npatch)
+                treecorr._lib.KMeansChunk(self.data, dp(centers), npatch, dp(None), dp(None),
+                                          dp(None), dp(inertia), self._d, self._coords)
+                inertia = comm.allreduce(inertia) * 3. * npatch / sumw
+            sums = np.zeros_like(centers)
+            weights = np.zeros(npatch)
+            treecorr._lib.KMeansChunk(self.data, dp(centers), npatch, dp(inertia),
+                                      dp(sums), dp(weights), dp(None), self._d, self._coords)
+            sums = comm.allreduce(sums)
+            weights = comm.allreduce(weights)
+            old_centers = centers.copy()
+            _kmeans_update_centers(centers, sums, weights, self._coords)
+            if _kmeans_converged(centers, old_centers, tol):
+                break
+        return centers
+
     def kmeans_initialize_centers(self, npatch, init='tree'):
         """Use the field's tree structure to assign good initial centers for a K-Means run.
 
@@ -399,6 +914,10 @@ class Field(object):
                                     - 'random' =  Use npatch random points as the intial centers.
                                     - 'kmeans++' =  Use the k-means++ algorithm.
                                       cf. https://en.wikipedia.org/wiki/K-means%2B%2B
+                                    - 'kmeans||' =  Use the k-means|| algorithm, a variant of
+                                      k-means++ that is faster for large npatch, since
+                                      it can be run in parallel.
+                                      cf. Bahmani et al, 2012, arXiv:1203.6402
 
         Returns:
             An array of center coordinates.
@@ -421,9 +940,11 @@ class Field(object):
             treecorr._lib.KMeansInitRand(self.data, dp(centers), int(npatch), self._d, self._coords)
         elif init == 'kmeans++':
             treecorr._lib.KMeansInitKMPP(self.data, dp(centers), int(npatch), self._d, self._coords)
+        elif init == 'kmeans||':
+            treecorr._lib.KMeansInitKMPar(self.data, dp(centers), int(npatch), self._d, self._coords)
         else:
             raise ValueError("Invalid init: %s. "%init +
-                             "Must be one of 'tree', 'random', or 'kmeans++.'")
+                             "Must be one of 'tree', 'random', 'kmeans++', or 'kmeans||'.")
 
         return centers
 
@@ -521,10 +1042,52 @@ class NField(Field):
         max_top (int):      The maximum number of top layers to use when setting up the field.
                             (default: 10)
         coords (str):       The kind of coordinate system to use. (default: cat.coords)
+        share_leaves (bool): Whether to build the leaf cells directly from the catalog arrays
+                            and use them while building the rest of the tree, rather than
+                            making a temporary copy of every object.  This lowers the peak
+                            memory during the build, but the leaves aren't stored next to the
+                            rest of the tree in memory, which makes correlations a bit slower.
+                            (default: False)
+        lazy (bool):        Whether to build the cells below the top level only when they are
+                            first needed, rather than building the whole tree up front.  This
+                            can save a lot of time and memory when most of the deep cells are
+                            never used, e.g. when the other catalog only overlaps a small part
+                            of this one, or when min_sep is large compared to the typical
+                            separation of the objects.  (default: False)
+        presort (bool):     Whether to sort the objects along a space-filling (Morton) curve
+                            before building the tree, so that nearby objects are also near each
+                            other in memory.  This makes building the tree more cache friendly
+                            for large catalogs whose objects are not already in a spatially
+                            coherent order.  (default: False)
+        spill_dir (str):    If given, store the cells of the tree in a temporary file in this
+                            directory, which is memory mapped, rather than in regular memory.
+                            Only the top few levels of the tree are kept in memory, and the
+                            operating system pages the rest in from the file as they are used.
+                            This allows building fields that are too large to fit in memory,
+                            at the cost of some speed when they don't.  The directory should
+                            be on a fast local disk with enough space for the tree, which is
+                            typically 100-200 bytes per object.  (default: None)
+        file_name (str):    If given, read the tree from this file, which was previously
+                            written with `Field.write`, rather than building it.  The other
+                            parameters must match the ones used to build the field that was
+                            written.  (default: None)
+        shared_name (str):  If given, use the tree that another process put in shared memory
+                            with this name using `Field.share`, rather than building it.  As
+                            for ``file_name``, the other parameters must match. (default: None)
+        tree (Field):       If given, an existing field of any type (N, K, or G) built from the
+                            same catalog with the same parameters, whose tree structure should
+                            be used for this field.  The way the objects are split into cells
+                            only depends on their positions, so only the data in each cell
+                            needs to be calculated, which is a lot faster than building the
+                            tree from scratch.  `Catalog.getNField` and the like do this
+                            automatically when there is a suitable field in the cache.
+                            (default: None)
         logger (Logger):    A logger file if desired. (default: None)
     """
     def __init__(self, cat, min_size=0, max_size=None, split_method='mean', brute=False,
-                 min_top=None, max_top=10, coords=None, logger=None):
+                 min_top=None, max_top=10, coords=None, share_leaves=False, lazy=False,
+                 presort=False, spill_dir=None, file_name=None, tree=None, shared_name=None,
+                 logger=None):
         from treecorr.util import double_ptr as dp
         if logger:
             if cat.name != '':
@@ -540,14 +1103,31 @@ class NField(Field):
         self._sm = _parse_split_method(split_method)
         self._d = 1  # NData
         self.brute = bool(brute)
+        self.share_leaves = bool(share_leaves)
+        self.lazy = bool(lazy)
+        self.presort = bool(presort)
+        self.spill_dir = spill_dir
         self.min_top, self.max_top = self._determine_top(min_top, max_top)
         self.coords = coords if coords is not None else cat.coords
         self._coords = treecorr.util.coord_enum(self.coords)  # These are the C++-layer enums
 
-        self.data = treecorr._lib.BuildNField(dp(cat.x), dp(cat.y), dp(cat.z),
-                                              dp(cat.w), dp(cat.wpos), cat.ntot,
-                                              self.min_size, self.max_size, self._sm,
-                                              self.brute, self.min_top, self.max_top, self._coords)
+        if file_name is not None:
+            self.data = self._read(file_name)
+        elif shared_name is not None:
+            self.data = self._attach(shared_name)
+        elif tree is not None:
+            self._check_tree(tree, cat)
+            self.data = treecorr._lib.BuildNFieldFromTree(tree.data, tree._d,
+                                                          dp(cat.x), dp(cat.y), dp(cat.z),
+                                                          dp(cat.w), dp(cat.wpos), self._coords)
+        else:
+            self.data = treecorr._lib.BuildNField(dp(cat.x), dp(cat.y), dp(cat.z),
+                                                  dp(cat.w), dp(cat.wpos), cat.ntot,
+                                                  self.min_size, self.max_size, self._sm,
+                                                  self.brute, self.min_top, self.max_top,
+                                                  self.share_leaves, self.lazy, self.presort,
+                                                  self._spill_dir(), self._coords)
+            self._check_spill()
         if logger:
             logger.debug('Finished building NField (%s)',self.coords)
 
@@ -585,10 +1165,52 @@ class KField(Field):
         max_top (int):      The maximum number of top layers to use when setting up the field.
                             (default: 10)
         coords (str):       The kind of coordinate system to use. (default: cat.coords)
+        share_leaves (bool): Whether to build the leaf cells directly from the catalog arrays
+                            and use them while building the rest of the tree, rather than
+                            making a temporary copy of every object.  This lowers the peak
+                            memory during the build, but the leaves aren't stored next to the
+                            rest of the tree in memory, which makes correlations a bit slower.
+                            (default: False)
+        lazy (bool):        Whether to build the cells below the top level only when they are
+                            first needed, rather than building the whole tree up front.  This
+                            can save a lot of time and memory when most of the deep cells are
+                            never used, e.g. when the other catalog only overlaps a small part
+                            of this one, or when min_sep is large compared to the typical
+                            separation of the objects.  (default: False)
+        presort (bool):     Whether to sort the objects along a space-filling (Morton) curve
+                            before building the tree, so that nearby objects are also near each
+                            other in memory.  This makes building the tree more cache friendly
+                            for large catalogs whose objects are not already in a spatially
+                            coherent order.  (default: False)
+        spill_dir (str):    If given, store the cells of the tree in a temporary file in this
+                            directory, which is memory mapped, rather than in regular memory.
+                            Only the top few levels of the tree are kept in memory, and the
+                            operating system pages the rest in from the file as they are used.
+                            This allows building fields that are too large to fit in memory,
+                            at the cost of some speed when they don't.  The directory should
+                            be on a fast local disk with enough space for the tree, which is
+                            typically 100-200 bytes per object.  (default: None)
+        file_name (str):    If given, read the tree from this file, which was previously
+                            written with `Field.write`, rather than building it.  The other
+                            parameters must match the ones used to build the field that was
+                            written.  (default: None)
+        shared_name (str):  If given, use the tree that another process put in shared memory
+                            with this name using `Field.share`, rather than building it.  As
+                            for ``file_name``, the other parameters must match. (default: None)
+        tree (Field):       If given, an existing field of any type (N, K, or G) built from the
+                            same catalog with the same parameters, whose tree structure should
+                            be used for this field.  The way the objects are split into cells
+                            only depends on their positions, so only the data in each cell
+                            needs to be calculated, which is a lot faster than building the
+                            tree from scratch.  `Catalog.getNField` and the like do this
+                            automatically when there is a suitable field in the cache.
+                            (default: None)
         logger (Logger):    A logger file if desired. (default: None)
     """
     def __init__(self, cat, min_size=0, max_size=None, split_method='mean', brute=False,
-                 min_top=None, max_top=10, coords=None, logger=None):
+                 min_top=None, max_top=10, coords=None, share_leaves=False, lazy=False,
+                 presort=False, spill_dir=None, file_name=None, tree=None, shared_name=None,
+                 logger=None):
         from treecorr.util import double_ptr as dp
         if logger:
             if cat.name != '':
@@ -604,15 +1226,33 @@ class KField(Field):
         self._sm = _parse_split_method(split_method)
         self._d = 2  # KData
         self.brute = bool(brute)
+        self.share_leaves = bool(share_leaves)
+        self.lazy = bool(lazy)
+        self.presort = bool(presort)
+        self.spill_dir = spill_dir
         self.min_top, self.max_top = self._determine_top(min_top, max_top)
         self.coords = coords if coords is not None else cat.coords
         self._coords = treecorr.util.coord_enum(self.coords)  # These are the C++-layer enums
 
-        self.data = treecorr._lib.BuildKField(dp(cat.x), dp(cat.y), dp(cat.z),
-                                              dp(cat.k),
-                                              dp(cat.w), dp(cat.wpos), cat.ntot,
-                                              self.min_size, self.max_size, self._sm,
-                                              self.brute, self.min_top, self.max_top, self._coords)
+        if file_name is not None:
+            self.data = self._read(file_name)
+        elif shared_name is not None:
+            self.data = self._attach(shared_name)
+        elif tree is not None:
+            self._check_tree(tree, cat)
+            self.data = treecorr._lib.BuildKFieldFromTree(tree.data, tree._d,
+                                                          dp(cat.x), dp(cat.y), dp(cat.z),
+                                                          dp(cat.k),
+                                                          dp(cat.w), dp(cat.wpos), self._coords)
+        else:
+            self.data = treecorr._lib.BuildKField(dp(cat.x), dp(cat.y), dp(cat.z),
+                                                  dp(cat.k),
+                                                  dp(cat.w), dp(cat.wpos), cat.ntot,
+                                                  self.min_size, self.max_size, self._sm,
+                                                  self.brute, self.min_top, self.max_top,
+                                                  self.share_leaves, self.lazy, self.presort,
+                                                  self._spill_dir(), self._coords)
+            self._check_spill()
         if logger:
             logger.debug('Finished building KField (%s)',self.coords)
 
@@ -647,10 +1287,52 @@ class GField(Field):
         max_top (int):      The maximum number of top layers to use when setting up the field.
                             (default: 10)
         coords (str):       The kind of coordinate system to use. (default: cat.coords)
+        share_leaves (bool): Whether to build the leaf cells directly from the catalog arrays
+                            and use them while building the rest of the tree, rather than
+                            making a temporary copy of every object.  This lowers the peak
+                            memory during the build, but the leaves aren't stored next to the
+                            rest of the tree in memory, which makes correlations a bit slower.
+                            (default: False)
+        lazy (bool):        Whether to build the cells below the top level only when they are
+                            first needed, rather than building the whole tree up front.  This
+                            can save a lot of time and memory when most of the deep cells are
+                            never used, e.g. when the other catalog only overlaps a small part
+                            of this one, or when min_sep is large compared to the typical
+                            separation of the objects.  (default: False)
+        presort (bool):     Whether to sort the objects along a space-filling (Morton) curve
+                            before building the tree, so that nearby objects are also near each
+                            other in memory.  This makes building the tree more cache friendly
+                            for large catalogs whose objects are not already in a spatially
+                            coherent order.  (default: False)
+        spill_dir (str):    If given, store the cells of the tree in a temporary file in this
+                            directory, which is memory mapped, rather than in regular memory.
+                            Only the top few levels of the tree are kept in memory, and the
+                            operating system pages the rest in from the file as they are used.
+                            This allows building fields that are too large to fit in memory,
+                            at the cost of some speed when they don't.  The directory should
+                            be on a fast local disk with enough space for the tree, which is
+                            typically 100-200 bytes per object.  (default: None)
+        file_name (str):    If given, read the tree from this file, which was previously
+                            written with `Field.write`, rather than building it.  The other
+                            parameters must match the ones used to build the field that was
+                            written.  (default: None)
+        shared_name (str):  If given, use the tree that another process put in shared memory
+                            with this name using `Field.share`, rather than building it.  As
+                            for ``file_name``, the other parameters must match. (default: None)
+        tree (Field):       If given, an existing field of any type (N, K, or G) built from the
+                            same catalog with the same parameters, whose tree structure should
+                            be used for this field.  The way the objects are split into cells
+                            only depends on their positions, so only the data in each cell
+                            needs to be calculated, which is a lot faster than building the
+                            tree from scratch.  `Catalog.getNField` and the like do this
+                            automatically when there is a suitable field in the cache.
+                            (default: None)
         logger (Logger):    A logger file if desired. (default: None)
     """
     def __init__(self, cat, min_size=0, max_size=None, split_method='mean', brute=False,
-                 min_top=None, max_top=10, coords=None, logger=None):
+                 min_top=None, max_top=10, coords=None, share_leaves=False, lazy=False,
+                 presort=False, spill_dir=None, file_name=None, tree=None, shared_name=None,
+                 logger=None):
         from treecorr.util import double_ptr as dp
         if logger:
             if cat.name != '':
@@ -666,15 +1348,33 @@ class GField(Field):
         self._sm = _parse_split_method(split_method)
         self._d = 3  # GData
         self.brute = bool(brute)
+        self.share_leaves = bool(share_leaves)
+        self.lazy = bool(lazy)
+        self.presort = bool(presort)
+        self.spill_dir = spill_dir
         self.min_top, self.max_top = self._determine_top(min_top, max_top)
         self.coords = coords if coords is not None else cat.coords
         self._coords = treecorr.util.coord_enum(self.coords)  # These are the C++-layer enums
 
-        self.data = treecorr._lib.BuildGField(dp(cat.x), dp(cat.y), dp(cat.z),
-                                              dp(cat.g1), dp(cat.g2),
-                                              dp(cat.w), dp(cat.wpos), cat.ntot,
-                                              self.min_size, self.max_size, self._sm,
-                                              self.brute, self.min_top, self.max_top, self._coords)
+        if file_name is not None:
+            self.data = self._read(file_name)
+        elif shared_name is not None:
+            self.data = self._attach(shared_name)
+        elif tree is not None:
+            self._check_tree(tree, cat)
+            self.data = treecorr._lib.BuildGFieldFromTree(tree.data, tree._d,
+                                                          dp(cat.x), dp(cat.y), dp(cat.z),
+                                                          dp(cat.g1), dp(cat.g2),
+                                                          dp(cat.w), dp(cat.wpos), self._coords)
+        else:
+            self.data = treecorr._lib.BuildGField(dp(cat.x), dp(cat.y), dp(cat.z),
+                                                  dp(cat.g1), dp(cat.g2),
+                                                  dp(cat.w), dp(cat.wpos), cat.ntot,
+                                                  self.min_size, self.max_size, self._sm,
+                                                  self.brute, self.min_top, self.max_top,
+                                                  self.share_leaves, self.lazy, self.presort,
+                                                  self._spill_dir(), self._coords)
+            self._check_spill()
         if logger:
             logger.debug('Finished building GField (%s)',self.coords)
 
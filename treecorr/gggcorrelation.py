@@ -186,6 +186,10 @@ class GGGCorrelation(treecorr.BinnedCorr3):
                     dp(self.meand1), dp(self.meanlogd1), dp(self.meand2), dp(self.meanlogd2),
                     dp(self.meand3), dp(self.meanlogd3), dp(self.meanu), dp(self.meanv),
                     dp(self.weight), dp(self.ntri));
+            self._set_budget()
+            self._set_stats()
+            self._set_checkpoint()
+            self._set_thread_memory()
         return self._corr
 
     def __del__(self):
@@ -294,8 +298,9 @@ class GGGCorrelation(treecorr.BinnedCorr3):
                               bool(self.brute), self.min_top, self.max_top, self.coords)
 
         self.logger.info('Starting %d jobs.',field.nTopLevelNodes)
-        treecorr._lib.ProcessAuto3(self.corr, field.data, self.output_dots,
-                                   field._d, self._coords, self._bintype, self._metric)
+        ok = treecorr._lib.ProcessAuto3(self.corr, field.data, self.output_dots,
+                                        field._d, self._coords, self._bintype, self._metric)
+        self._check_processed(ok)
 
     def process_cross21(self, cat1, cat2, metric=None, num_threads=None):
         """Process two catalogs, accumulating the 3pt cross-correlation, where two of the
@@ -360,8 +365,10 @@ class GGGCorrelation(treecorr.BinnedCorr3):
                             bool(self.brute), self.min_top, self.max_top, self.coords)
 
         self.logger.info('Starting %d jobs.',f1.nTopLevelNodes)
-        treecorr._lib.ProcessCross3(self.corr, f1.data, f2.data, f3.data, self.output_dots,
-                                    f1._d, f2._d, f3._d, self._coords, self._bintype, self._metric)
+        ok = treecorr._lib.ProcessCross3(self.corr, f1.data, f2.data, f3.data, self.output_dots,
+                                         f1._d, f2._d, f3._d, self._coords, self._bintype,
+                                         self._metric)
+        self._check_processed(ok)
 
 
     def finalize(self, varg1, varg2, varg3):
@@ -444,6 +451,8 @@ class GGGCorrelation(treecorr.BinnedCorr3):
         self.weight[:,:,:] = 0.
         self.ntri[:,:,:] = 0.
         self.results.clear()
+        self._stats[:] = 0.
+        self._budget.reset()
 
     def __iadd__(self, other):
         """Add a second `GGGCorrelation`'s data to this one.
@@ -490,6 +499,7 @@ class GGGCorrelation(treecorr.BinnedCorr3):
         self.meanv[:] += other.meanv[:]
         self.weight[:] += other.weight[:]
         self.ntri[:] += other.ntri[:]
+        self._add_stats(other)
         return self
 
 
@@ -118,10 +118,14 @@ class NKCorrelation(treecorr.BinnedCorr2):
             from treecorr.util import double_ptr as dp
             self._corr = treecorr._lib.BuildCorr2(
                     self._d1, self._d2, self._bintype,
-                    self._min_sep,self._max_sep,self._nbins,self._bin_size,self.b,
+                    self._min_sep,self._max_sep,self._nbins,self._bin_size,self.b,self.leaf_size,
                     self.min_rpar, self.max_rpar, self.xperiod, self.yperiod, self.zperiod,
                     dp(self.raw_xi), dp(None), dp(None), dp(None),
                     dp(self.meanr),dp(self.meanlogr),dp(self.weight),dp(self.npairs));
+            self._set_budget()
+            self._set_stats()
+            self._set_checkpoint()
+            self._set_bin_options()
         return self._corr
 
     def __del__(self):
@@ -159,6 +163,9 @@ class NKCorrelation(treecorr.BinnedCorr2):
         import copy
         return copy.deepcopy(self)
 
+    def _get_xi_arrays(self):
+        return [self.raw_xi, None, None, None]
+
     def _copy_for_results(self):
         # Make a copy of just the things we need to keep in results.
         ret = NKCorrelation.__new__(NKCorrelation)
@@ -208,21 +215,30 @@ class NKCorrelation(treecorr.BinnedCorr2):
                              cat1.name, cat2.name)
 
         self._set_metric(metric, cat1.coords, cat2.coords)
+        self._set_unit_weights(cat1, cat2)
 
         self._set_num_threads(num_threads)
+        self._process_grid(cat1, cat2)
+        self._process_dilute(cat1, cat2, num_threads)
 
         min_size, max_size = self._get_minmax_size()
 
         f1 = cat1.getNField(min_size, max_size, self.split_method,
                             self.brute is True or self.brute == 1,
-                            self.min_top, self.max_top, self.coords)
+                            self.min_top, self.max_top, self.coords,
+                            lazy=self.lazy_build, presort=self.presort,
+                            spill_dir=self.spill_dir)
         f2 = cat2.getKField(min_size, max_size, self.split_method,
                             self.brute is True or self.brute == 2,
-                            self.min_top, self.max_top, self.coords)
+                            self.min_top, self.max_top, self.coords,
+                            lazy=self.lazy_build, presort=self.presort,
+                            spill_dir=self.spill_dir)
 
         self.logger.info('Starting %d jobs.',f1.nTopLevelNodes)
-        treecorr._lib.ProcessCross2(self.corr, f1.data, f2.data, self.output_dots,
-                                    f1._d, f2._d, self._coords, self._bintype, self._metric)
+        ok = treecorr._lib.ProcessCross2(self.corr, f1.data, f2.data, self.output_dots,
+                                         f1._d, f2._d, self._coords, self._bintype, self._metric)
+        self._check_processed(ok)
+        self._finish_grid()
 
 
     def process_pairwise(self, cat1, cat2, metric=None, num_threads=None):
@@ -262,14 +278,11 @@ class NKCorrelation(treecorr.BinnedCorr2):
                              cat1.name, cat2.name)
 
         self._set_metric(metric, cat1.coords, cat2.coords)
+        self._set_unit_weights(cat1, cat2)
 
         self._set_num_threads(num_threads)
 
-        f1 = cat1.getNSimpleField()
-        f2 = cat2.getKSimpleField()
-
-        treecorr._lib.ProcessPair(self.corr, f1.data, f2.data, self.output_dots,
-                                  f1._d, f2._d, self._coords, self._bintype, self._metric)
+        self._process_pairwise_arrays(cat1, cat2, 1, 2)
 
 
     def finalize(self, vark):
@@ -312,6 +325,8 @@ class NKCorrelation(treecorr.BinnedCorr2):
         if hasattr(self,'cov'):
             self.cov.ravel()[:] = 0
         self.results.clear()
+        self._stats[:] = 0.
+        self._budget.reset()
         self._rk = None
         self.xi = self.raw_xi
         self.varxi = self.raw_varxi
@@ -339,6 +354,7 @@ class NKCorrelation(treecorr.BinnedCorr2):
         self.meanlogr.ravel()[:] += other.meanlogr.ravel()[:]
         self.weight.ravel()[:] += other.weight.ravel()[:]
         self.npairs.ravel()[:] += other.npairs.ravel()[:]
+        self._add_stats(other)
         return self
 
 
@@ -365,13 +381,14 @@ class NKCorrelation(treecorr.BinnedCorr2):
         """
         import math
         self.clear()
+        self._set_tagged_cats(cat1, cat2)
 
         if not isinstance(cat1,list):
             self.npatch1 = cat1._npatch
-            cat1 = cat1.get_patches(low_mem=low_mem)
+            cat1 = cat1.get_patches(low_mem=low_mem or self.max_memory is not None)
         if not isinstance(cat2,list):
             self.npatch2 = cat2._npatch
-            cat2 = cat2.get_patches(low_mem=low_mem)
+            cat2 = cat2.get_patches(low_mem=low_mem or self.max_memory is not None)
 
         vark = treecorr.calculateVarK(cat2)
         self.logger.info("vark = %f: sig_k = %f",vark,math.sqrt(vark))
@@ -433,6 +450,10 @@ class NKCorrelation(treecorr.BinnedCorr2):
 
         return self.xi, self.varxi
 
+    def _use_native_cov(self):
+        # The design matrices can be made in C++ unless there is a compensation term.
+        return self._rk is None
+
     def _calculate_xi_from_pairs(self, pairs):
         okij = set(self.results.keys())
         n = np.sum([self.results[ij]._getStat() for ij in pairs if ij in okij], axis=0)
@@ -19,6 +19,54 @@ import treecorr
 import numpy as np
 
 
+def _quadrant_disc_area(x, y, r):
+    # The area of the part of the disc of radius r around the origin that is between 0 and x
+    # in one direction and between 0 and y in the other, with the sign of x*y.
+    sign = np.sign(x) * np.sign(y)
+    x = np.minimum(np.abs(x), r)
+    y = np.minimum(np.abs(y), r)
+    x0 = np.sqrt(np.maximum(r**2 - y**2, 0.))
+    rr = np.where(r > 0, r, 1.)
+    def H(t):  # The integral of sqrt(r^2-t^2) dt from 0 to t
+        return 0.5 * (t * np.sqrt(np.maximum(r**2 - t**2, 0.)) +
+                      r**2 * np.arcsin(np.clip(t/rr, -1., 1.)))
+    area = np.where(x <= x0, x*y, y*x0 + H(x) - H(x0))
+    return sign * area
+
+def _rect_disc_area(x0, x1, y0, y1, r):
+    # The area of the part of the disc of radius r around the origin inside the rectangle
+    # x0 < x < x1, y0 < y < y1.
+    return (_quadrant_disc_area(x1, y1, r) - _quadrant_disc_area(x0, y1, r) -
+            _quadrant_disc_area(x1, y0, r) + _quadrant_disc_area(x0, y0, r))
+
+def _periodic_volume(r, xp, yp, zp=None):
+    # The area (2d) or volume (3d) of the region with a periodic distance less than r.
+    # This is the disc or ball of radius r cut off by the box of half widths xp/2, yp/2, zp/2.
+    r = np.asarray(r, dtype=float)
+    a, b = 0.5*xp, 0.5*yp
+    if zp is None:
+        return _rect_disc_area(-a, a, -b, b, r)
+    c = 0.5*zp
+    vol = 4./3. * np.pi * r**3
+    big = r > min(a, b, c)
+    if np.any(big):
+        # Integrate the area of each slice in z.  The area has kinks where the disc reaches
+        # the sides or the corners of the rectangle, so split the integral there.
+        nodes, wts = np.polynomial.legendre.leggauss(32)
+        for k in np.nonzero(big.ravel())[0]:
+            R = r.ravel()[k]
+            zmax = min(R, c)
+            zb = [np.sqrt(R**2 - s**2) for s in (a, b, np.sqrt(a**2+b**2)) if s < R]
+            zb = np.unique([0.] + [z for z in zb if z < zmax] + [zmax])
+            v = 0.
+            for z0, z1 in zip(zb[:-1], zb[1:]):
+                z = 0.5*(z1+z0) + 0.5*(z1-z0)*nodes
+                rho = np.sqrt(np.maximum(R**2 - z**2, 0.))
+                v += 0.5*(z1-z0) * np.sum(wts * _rect_disc_area(-a, a, -b, b, rho))
+            vol.ravel()[k] = 2.*v
+    return vol
+
+
 class NNCorrelation(treecorr.BinnedCorr2):
     r"""This class handles the calculation and storage of a 2-point count-count correlation
     function.  i.e. the regular density correlation function.
@@ -98,6 +146,7 @@ class NNCorrelation(treecorr.BinnedCorr2):
         self.npairs = np.zeros_like(self.rnom, dtype=float)
         self.tot = 0.
         self._rr_weight = None  # Marker that calculateXi hasn't been called yet.
+        self._analytic = False  # Whether the counts are from periodic_rr.
         self.logger.debug('Finished building NNCorr')
 
     @property
@@ -106,10 +155,14 @@ class NNCorrelation(treecorr.BinnedCorr2):
             from treecorr.util import double_ptr as dp
             self._corr = treecorr._lib.BuildCorr2(
                     self._d1, self._d2, self._bintype,
-                    self._min_sep,self._max_sep,self._nbins,self._bin_size,self.b,
+                    self._min_sep,self._max_sep,self._nbins,self._bin_size,self.b,self.leaf_size,
                     self.min_rpar, self.max_rpar, self.xperiod, self.yperiod, self.zperiod,
                     dp(None), dp(None), dp(None), dp(None),
                     dp(self.meanr),dp(self.meanlogr),dp(self.weight),dp(self.npairs));
+            self._set_budget()
+            self._set_stats()
+            self._set_checkpoint()
+            self._set_bin_options()
         return self._corr
 
     def __del__(self):
@@ -192,17 +245,24 @@ class NNCorrelation(treecorr.BinnedCorr2):
             self.logger.info('Starting process NN auto-correlations for cat %s.', cat.name)
 
         self._set_metric(metric, cat.coords)
+        self._set_unit_weights(cat)
 
         self._set_num_threads(num_threads)
+        self._process_grid(cat, None)
+        self._process_dilute(cat, None, num_threads)
 
         min_size, max_size = self._get_minmax_size()
 
         field = cat.getNField(min_size, max_size, self.split_method,
-                              bool(self.brute), self.min_top, self.max_top, self.coords)
+                              bool(self.brute), self.min_top, self.max_top, self.coords,
+                              lazy=self.lazy_build, presort=self.presort,
+                              spill_dir=self.spill_dir)
 
         self.logger.info('Starting %d jobs.',field.nTopLevelNodes)
-        treecorr._lib.ProcessAuto2(self.corr, field.data, self.output_dots,
-                                   field._d, self._coords, self._bintype, self._metric)
+        ok = treecorr._lib.ProcessAuto2(self.corr, field.data, self.output_dots,
+                                        field._d, self._coords, self._bintype, self._metric)
+        self._check_processed(ok)
+        self._finish_grid()
         self.tot += 0.5 * cat.sumw**2
 
 
@@ -230,21 +290,30 @@ class NNCorrelation(treecorr.BinnedCorr2):
                              cat1.name, cat2.name)
 
         self._set_metric(metric, cat1.coords, cat2.coords)
+        self._set_unit_weights(cat1, cat2)
 
         self._set_num_threads(num_threads)
+        self._process_grid(cat1, cat2)
+        self._process_dilute(cat1, cat2, num_threads)
 
         min_size, max_size = self._get_minmax_size()
 
         f1 = cat1.getNField(min_size, max_size, self.split_method,
                             self.brute is True or self.brute == 1,
-                            self.min_top, self.max_top, self.coords)
+                            self.min_top, self.max_top, self.coords,
+                            lazy=self.lazy_build, presort=self.presort,
+                            spill_dir=self.spill_dir)
         f2 = cat2.getNField(min_size, max_size, self.split_method,
                             self.brute is True or self.brute == 2,
-                            self.min_top, self.max_top, self.coords)
+                            self.min_top, self.max_top, self.coords,
+                            lazy=self.lazy_build, presort=self.presort,
+                            spill_dir=self.spill_dir)
 
         self.logger.info('Starting %d jobs.',f1.nTopLevelNodes)
-        treecorr._lib.ProcessCross2(self.corr, f1.data, f2.data, self.output_dots,
-                                    f1._d, f2._d, self._coords, self._bintype, self._metric)
+        ok = treecorr._lib.ProcessCross2(self.corr, f1.data, f2.data, self.output_dots,
+                                         f1._d, f2._d, self._coords, self._bintype, self._metric)
+        self._check_processed(ok)
+        self._finish_grid()
         self.tot += cat1.sumw*cat2.sumw
 
 
@@ -284,14 +353,11 @@ class NNCorrelation(treecorr.BinnedCorr2):
                              cat1.name, cat2.name)
 
         self._set_metric(metric, cat1.coords, cat2.coords)
+        self._set_unit_weights(cat1, cat2)
 
         self._set_num_threads(num_threads)
 
-        f1 = cat1.getNSimpleField()
-        f2 = cat2.getNSimpleField()
-
-        treecorr._lib.ProcessPair(self.corr, f1.data, f2.data, self.output_dots,
-                                  f1._d, f2._d, self._coords, self._bintype, self._metric)
+        self._process_pairwise_arrays(cat1, cat2, 1, 1)
         self.tot += (cat1.sumw+cat2.sumw)/2.
 
 
@@ -323,6 +389,8 @@ class NNCorrelation(treecorr.BinnedCorr2):
         self.weight.ravel()[:] = 0.
         self.npairs.ravel()[:] = 0.
         self.results.clear()
+        self._stats[:] = 0.
+        self._budget.reset()
         self.tot = 0.
 
     def __iadd__(self, other):
@@ -347,8 +415,21 @@ class NNCorrelation(treecorr.BinnedCorr2):
         self.weight.ravel()[:] += other.weight.ravel()[:]
         self.npairs.ravel()[:] += other.npairs.ravel()[:]
         self.tot += other.tot
+        self._add_stats(other)
         return self
 
+    def _set_patch_tot(self, c1, c2):
+        if c2 is None:
+            self.tot = 0.5 * c1.sumw**2
+        else:
+            self.tot = c1.sumw * c2.sumw
+
+    def _add_process_tot(self, cat1, cat2):
+        if cat2 is None:
+            self.tot += 0.5 * cat1.sumw**2
+        else:
+            self.tot += cat1.sumw * cat2.sumw
+
     def _add_tot(self, i, j, c1, c2):
         # When storing results from a patch-based run, tot needs to be accumulated even if
         # the total weight being accumulated comes out to be zero.
@@ -391,14 +472,15 @@ class NNCorrelation(treecorr.BinnedCorr2):
                                 This only works if using patches. (default: False)
         """
         self.clear()
+        self._set_tagged_cats(cat1, cat2)
 
         if not isinstance(cat1,list):
             self.npatch1 = cat1._npatch
-            cat1 = cat1.get_patches(low_mem=low_mem)
+            cat1 = cat1.get_patches(low_mem=low_mem or self.max_memory is not None)
             if cat2 is None: self.npatch2 = self.npatch1
         if cat2 is not None and not isinstance(cat2,list):
             self.npatch2 = cat2._npatch
-            cat2 = cat2.get_patches(low_mem=low_mem)
+            cat2 = cat2.get_patches(low_mem=low_mem or self.max_memory is not None)
 
         if cat2 is None or len(cat2) == 0:
             self._process_all_auto(cat1, metric, num_threads, comm, low_mem)
@@ -407,6 +489,9 @@ class NNCorrelation(treecorr.BinnedCorr2):
         self.finalize()
 
     def _mean_weight(self):
+        if self._analytic:
+            # The analytic counts don't have any shot noise.
+            return 0.
         mean_np = np.mean(self.npairs)
         return 1 if mean_np == 0 else np.mean(self.weight)/mean_np
 
@@ -422,7 +507,77 @@ class NNCorrelation(treecorr.BinnedCorr2):
     def _getWeight(self):
         return self._rr_weight
 
-    def calculateXi(self, rr, dr=None, rd=None):
+    def _periodic_bin_fraction(self):
+        # The fraction of the periodic box that is in each bin.
+        xp = self.xperiod
+        yp = self.yperiod
+        if self.coords == '3d':
+            box = xp * yp * self.zperiod
+            zp = self.zperiod
+        else:
+            box = xp * yp
+            zp = None
+        if self.bin_type == 'TwoD':
+            if self.coords != 'flat':
+                raise ValueError("TwoD binning requires flat coordinates")
+            # Pairs are binned by their wrapped separation, which is at most half the period.
+            x0 = np.maximum(self.left_edges * self._sep_units, -0.5*xp)
+            x1 = np.minimum(self.right_edges * self._sep_units, 0.5*xp)
+            y0 = np.maximum(self.bottom_edges * self._sep_units, -0.5*yp)
+            y1 = np.minimum(self.top_edges * self._sep_units, 0.5*yp)
+            x1 = np.maximum(x1, x0)
+            y1 = np.maximum(y1, y0)
+            area = (x1-x0) * (y1-y0) - _rect_disc_area(x0, x1, y0, y1, self._min_sep)
+            return area / box
+        else:
+            v0 = _periodic_volume(self.left_edges * self._sep_units, xp, yp, zp)
+            v1 = _periodic_volume(self.right_edges * self._sep_units, xp, yp, zp)
+            return (v1 - v0) / box
+
+    def periodic_rr(self):
+        r"""Make the expected counts of uniform random points in a periodic box.
+
+        For the 'Periodic' metric, the number of pairs of uniformly distributed points in each
+        bin is just the total number of pairs times the fraction of the box's volume (or area)
+        in that bin.  So rather than process a large random catalog, you can use the
+        `NNCorrelation` returned by this function as the RR term in `calculateXi`.  This is
+        what `calculateXi` does if rr is None.
+
+        The counts are normalized to the total number of pairs (``tot``) of the current object,
+        so it may be used as DR or RD as well.  For a uniform box, these are the same as RR,
+        which means the Landy-Szalay estimator reduces to the simple one.  If the current object
+        has patches, the results for each pair of patches are similarly computed, so the
+        patch-based covariance estimates work as usual.
+
+        .. note::
+
+            This must be called after `process`, so the metric and the number of pairs are
+            known.  For an auto-correlation, ``tot`` includes the self-pairs of each object, so
+            the simple estimator is biased low by roughly 1/N.
+
+        Returns:
+            An `NNCorrelation` with the expected counts for uniform randoms.
+        """
+        if self.metric != 'Periodic':
+            raise ValueError("periodic_rr is only valid for the Periodic metric.")
+        frac = self._periodic_bin_fraction()
+        rr = NNCorrelation(self.config, logger=self.logger)
+        rr._set_metric(self.metric, self.coords)
+        rr._analytic = True
+        rr.npatch1 = self.npatch1
+        rr.npatch2 = self.npatch2
+        rr.tot = self.tot
+        rr.weight[:] = frac * self.tot
+        rr.npairs[:] = rr.weight
+        rr.meanr[:] = self.rnom
+        rr.meanlogr[:] = self.logr
+        for ij, cij in self.results.items():
+            res = cij._copy_for_results()
+            res.weight = frac * cij.tot
+            rr.results[ij] = res
+        return rr
+
+    def calculateXi(self, rr=None, dr=None, rd=None):
         r"""Calculate the correlation function given another correlation function of random
         points using the same mask, and possibly cross correlations of the data and random.
 
@@ -436,6 +591,9 @@ class NNCorrelation(treecorr.BinnedCorr2):
 
         where DD is the data NN correlation function, which is the current object.
 
+        For the 'Periodic' metric, rr may be None, in which case the expected counts for
+        uniform randoms are calculated analytically.  cf. `periodic_rr`.
+
         .. note::
 
             The default method for estimating the variance is 'shot', which only includes the
@@ -449,7 +607,9 @@ class NNCorrelation(treecorr.BinnedCorr2):
         varxi returned from this function will be available as attributes.
 
         Parameters:
-            rr (NNCorrelation):     The auto-correlation of the random field (RR)
+            rr (NNCorrelation):     The auto-correlation of the random field (RR).
+                                    (default: None, which is only allowed for the Periodic
+                                    metric, and means to use `periodic_rr`)
             dr (NNCorrelation):     The cross-correlation of the data with randoms (DR), if
                                     desired, in which case the Landy-Szalay estimator will be
                                     calculated.  (default: None)
@@ -462,6 +622,9 @@ class NNCorrelation(treecorr.BinnedCorr2):
                 - xi = array of :math:`\xi(r)`
                 - varxi = an estimate of the variance of :math:`\xi(r)`
         """
+        if rr is None:
+            rr = self.periodic_rr()
+
         # Each random weight value needs to be rescaled by the ratio of total possible pairs.
         if rr.tot == 0:
             raise ValueError("rr has tot=0.")
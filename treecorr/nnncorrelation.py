@@ -139,6 +139,10 @@ class NNNCorrelation(treecorr.BinnedCorr3):
                     dp(self.meand1), dp(self.meanlogd1), dp(self.meand2), dp(self.meanlogd2),
                     dp(self.meand3), dp(self.meanlogd3), dp(self.meanu), dp(self.meanv),
                     dp(self.weight), dp(self.ntri));
+            self._set_budget()
+            self._set_stats()
+            self._set_checkpoint()
+            self._set_thread_memory()
         return self._corr
 
     def __del__(self):
@@ -235,8 +239,9 @@ class NNNCorrelation(treecorr.BinnedCorr3):
                               bool(self.brute), self.min_top, self.max_top, self.coords)
 
         self.logger.info('Starting %d jobs.',field.nTopLevelNodes)
-        treecorr._lib.ProcessAuto3(self.corr, field.data, self.output_dots,
-                                   field._d, self._coords, self._bintype, self._metric)
+        ok = treecorr._lib.ProcessAuto3(self.corr, field.data, self.output_dots,
+                                        field._d, self._coords, self._bintype, self._metric)
+        self._check_processed(ok)
         self.tot += (1./6.) * cat.sumw**3
 
     def process_cross21(self, cat1, cat2, metric=None, num_threads=None):
@@ -302,8 +307,10 @@ class NNNCorrelation(treecorr.BinnedCorr3):
                             bool(self.brute), self.min_top, self.max_top, self.coords)
 
         self.logger.info('Starting %d jobs.',f1.nTopLevelNodes)
-        treecorr._lib.ProcessCross3(self.corr, f1.data, f2.data, f3.data, self.output_dots,
-                                    f1._d, f2._d, f3._d, self._coords, self._bintype, self._metric)
+        ok = treecorr._lib.ProcessCross3(self.corr, f1.data, f2.data, f3.data, self.output_dots,
+                                         f1._d, f2._d, f3._d, self._coords, self._bintype,
+                                         self._metric)
+        self._check_processed(ok)
         self.tot += cat1.sumw * cat2.sumw * cat3.sumw / 6.0
 
 
@@ -354,6 +361,8 @@ class NNNCorrelation(treecorr.BinnedCorr3):
         self.weight[:,:,:] = 0.
         self.ntri[:,:,:] = 0.
         self.results.clear()
+        self._stats[:] = 0.
+        self._budget.reset()
         self.tot = 0.
 
     def __iadd__(self, other):
@@ -390,6 +399,7 @@ class NNNCorrelation(treecorr.BinnedCorr3):
         self.weight[:] += other.weight[:]
         self.ntri[:] += other.ntri[:]
         self.tot += other.tot
+        self._add_stats(other)
         return self
 
 
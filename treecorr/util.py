@@ -19,6 +19,7 @@ import treecorr
 import numpy as np
 import os
 import warnings
+import threading
 import coord
 
 def ensure_dir(target):
@@ -27,11 +28,20 @@ def ensure_dir(target):
         if not os.path.exists(d):
             os.makedirs(d)
 
-def set_omp_threads(num_threads, logger=None):
+def set_omp_threads(num_threads, logger=None, numa_domains=None, pin=False):
     """Set the number of OpenMP threads to use in the C++ layer.
 
+    On a machine with several NUMA domains (e.g. a multi-socket node), the threads can be
+    split into that many contiguous blocks with ``numa_domains``.  Then each top-level cell of
+    a field is built by a thread in one domain, so its memory ends up there, and the threads
+    processing the pairs start with the cells in their own domain.  This works best with the
+    threads pinned to the cores, either with ``pin=True`` or with OMP_PROC_BIND.
+
     :param num_threads: The target number of threads to use
     :param logger:      If desired, a logger object for logging any warnings here. (default: None)
+    :param numa_domains: If given, the number of NUMA domains to use. 1 turns this off.
+                        (default: None, which leaves the current setting)
+    :param pin:         Whether to pin each thread to a core. (default: False)
 
     :returns:           The  number of threads OpenMP reports that it will use.  Typically this
                         matches the input, but OpenMP reserves the right not to comply with
@@ -51,6 +61,19 @@ def set_omp_threads(num_threads, logger=None):
         logger.debug('Telling OpenMP to use %d threads',num_threads)
     num_threads = treecorr._lib.SetOMPThreads(num_threads)
 
+    if numa_domains is not None:
+        if numa_domains < 1:
+            raise ValueError("numa_domains must be >= 1")
+        numa_domains = treecorr._lib.SetOMPNumaDomains(int(numa_domains))
+        if logger:
+            logger.debug('Using %d NUMA domains',numa_domains)
+    if pin:
+        npin = treecorr._lib.PinOMPThreads()
+        if logger:
+            logger.debug('Pinned %d threads',npin)
+            if npin == 0:
+                logger.warning("Unable to pin the threads on this system.")
+
     # Report back appropriately.
     if logger:
         logger.debug('OpenMP reports that it will use %d threads',num_threads)
@@ -69,6 +92,150 @@ def get_omp_threads():
     """
     return treecorr._lib.GetOMPThreads()
 
+def set_phase_threads(build=None, process=None):
+    """Set the maximum number of threads for building fields and for processing them.
+
+    Several calls into the C++ layer can run at the same time from different python threads,
+    e.g. using `submit` to build the fields for the next pair of patches while the current
+    pair is being processed.  Rather than each one using all the threads, they share the total
+    number from `set_omp_threads`.  A call that starts when all the threads are in use waits
+    until some are free.  These limits let you reserve some of the threads for one kind of
+    work, so it doesn't have to wait for the other.  E.g. with 16 threads,
+
+        >>> treecorr.set_phase_threads(build=4, process=12)
+
+    lets up to 4 threads build fields while the rest do the correlations.
+
+    :param build:       The maximum number of threads for building fields.  0 means no limit.
+                        (default: None, which leaves the current setting)
+    :param process:     The maximum number of threads for processing correlations.  0 means no
+                        limit. (default: None, which leaves the current setting)
+
+    :returns:           A tuple (build, process) with the current limits.
+    """
+    for phase, n in enumerate((build, process)):
+        if n is not None:
+            if n < 0:
+                raise ValueError("The number of threads must be >= 0")
+            treecorr._lib.SetOMPPhaseThreads(phase, int(n))
+    return (treecorr._lib.GetOMPPhaseThreads(0), treecorr._lib.GetOMPPhaseThreads(1))
+
+_executor = None
+_executor_lock = threading.Lock()
+
+def submit(func, *args, **kwargs):
+    """Run func(*args, **kwargs) on a background python thread.
+
+    The C++ layer releases the GIL, so this lets e.g. reading a catalog or building its
+    fields run at the same time as processing other ones.  The threads the calls use are
+    shared according to `set_phase_threads`.  E.g.
+
+        >>> future = treecorr.submit(cat2.load)
+        >>> nn.process(cat1)
+        >>> future.result()
+        >>> nn.process(cat1, cat2)
+
+    The fields are cached in the catalog (cf. `Catalog.getNField`), so a field built this way
+    is used by any later correlation that needs one with the same parameters.  If that
+    starts before the field is done, it waits for it rather than building another one.
+
+    :param func:        The function to run.
+    :param args:        The positional arguments for func.
+    :param kwargs:      The keyword arguments for func.
+
+    :returns:           A ``concurrent.futures.Future`` for the result.
+    """
+    global _executor
+    with _executor_lock:
+        if _executor is None:
+            import concurrent.futures
+            _executor = concurrent.futures.ThreadPoolExecutor(max_workers=4)
+    return _executor.submit(func, *args, **kwargs)
+
+_process_executor = None
+
+def _submit_process(func, *args, **kwargs):
+    # Like submit, but for the process_async calls.  These use their own threads, since they
+    # may wait for the loads that they submit (e.g. with the prefetch option), so they can't
+    # take up all the threads of submit.
+    global _process_executor
+    with _executor_lock:
+        if _process_executor is None:
+            import concurrent.futures
+            import multiprocessing
+            _process_executor = concurrent.futures.ThreadPoolExecutor(
+                    max_workers=max(4, multiprocessing.cpu_count()))
+    return _process_executor.submit(func, *args, **kwargs)
+
+_tracing = False
+
+def start_trace(nevents=1000000):
+    """Start recording a trace of what each thread does in the C++ layer and in the main
+    python steps of the calculation.
+
+    The events include building the fields and their top-level cells, each top-level item of
+    the process calls, the reductions of the per-thread results, the K-Means iterations and
+    the pairs of patches.  Use `stop_trace` to write them in the Chrome trace format, which can
+    be viewed with chrome://tracing or https://ui.perfetto.dev.  E.g.
+
+        >>> treecorr.start_trace()
+        >>> gg.process(cat)
+        >>> treecorr.stop_trace('gg_trace.json')
+
+    The events are kept in a ring buffer for each thread, so if there are more than nevents,
+    the oldest ones are dropped.  Starting a new trace drops any previous events.
+
+    :param nevents:     The maximum number of events to keep for each thread.
+                        (default: 1000000)
+    """
+    global _tracing
+    if nevents <= 0:
+        raise ValueError("nevents must be > 0")
+    treecorr._lib.SetTrace(int(nevents))
+    _tracing = True
+
+def stop_trace(file_name=None):
+    """Stop recording the trace started by `start_trace`, and write it to a file.
+
+    With MPI, each process should use a different file name.  The events are on the wall clock
+    times, labeled by the host name and pid, so the files can be combined into one trace by
+    concatenating their "traceEvents" lists.
+
+    :param file_name:   The file to write the trace to in the Chrome trace JSON format.
+                        (default: None, which just stops the trace)
+    """
+    global _tracing
+    treecorr._lib.SetTrace(0)
+    _tracing = False
+    if file_name is not None:
+        if not treecorr._lib.WriteTraceFile(file_name.encode()):
+            raise OSError("Unable to write trace file %s"%file_name)
+
+class trace(object):
+    """A context manager that records the code inside it as an event in the trace started by
+    `start_trace`.  When there is no trace, this does nothing.
+
+    :param name:        The name of the event.  Any args are formatted into it with %, but
+                        only when there is a trace.
+    :param arg:         An integer to record with the event. (default: -1)
+    """
+    def __init__(self, name, *args, **kwargs):
+        self.name = name
+        self.args = args
+        self.arg = kwargs.pop('arg', -1)
+        self.start = None
+
+    def __enter__(self):
+        if _tracing:
+            self.start = treecorr._lib.GetTraceTime()
+        return self
+
+    def __exit__(self, *exc):
+        if self.start is not None:
+            name = self.name % self.args if self.args else self.name
+            treecorr._lib.AddTraceEvent(name.encode(), self.arg, self.start)
+        return False
+
 def gen_write(file_name, col_names, columns, params=None, precision=4, file_type=None, logger=None):
     """Write some columns to an output file with the given column names.
 
@@ -167,6 +334,97 @@ def gen_write_fits(file_name, col_names, columns, params):
         data[name] = col
     fitsio.write(file_name, data, header=params, clobber=True)
 
+# The binary catalog format used by write_binary and read_binary is:
+#
+#     8 bytes       The magic string b'TCBINv1\0'
+#     8 bytes       The length of the header as a little-endian unsigned integer
+#     header        A JSON dict with ntot, the name, dtype and offset of each column,
+#                   and any other parameters
+#     columns       Each column as a contiguous array, starting at a multiple of 64 bytes
+#
+# The columns are in the native byte order of the machine that wrote them, and are read
+# with np.memmap, so they don't need to be parsed or even read until they are used.
+_binary_magic = b'TCBINv1\0'
+_binary_align = 64
+
+def write_binary(file_name, col_names, columns, params=None):
+    """Write some columns to a binary file, which can be read back with `read_binary`.
+
+    :param file_name:   The name of the file to write to.
+    :param col_names:   A list of columns names for the given columns.
+    :param columns:     A list of 1-d numpy arrays with the data to write.
+    :param params:      A dict of extra parameters to write in the header.  These need to be
+                        types that json can handle. (default: None)
+    """
+    import json, struct
+    ntot = len(columns[0])
+    columns = [np.ascontiguousarray(col) for col in columns]
+    for col in columns:
+        if col.shape != (ntot,):
+            raise ValueError("columns are not all the same shape")
+
+    def pad(n):
+        return (n + _binary_align - 1) // _binary_align * _binary_align
+
+    # The header has the column offsets, which depend on the length of the header, so
+    # start with no room for it and move the columns back until it fits.
+    header = dict(params) if params is not None else {}
+    header['ntot'] = ntot
+    header['columns'] = [[name, col.dtype.str, 0] for name, col in zip(col_names, columns)]
+    start = 0
+    while True:
+        offset = start
+        for c, col in zip(header['columns'], columns):
+            c[2] = offset
+            offset += pad(col.nbytes)
+        h = json.dumps(header).encode()
+        if 16 + len(h) <= start: break
+        start = pad(16 + len(h))
+
+    # Write to a temporary file first, since the columns may be memory mapped from an existing
+    # version of this file, which must not be truncated while they are being written.
+    ensure_dir(file_name)
+    tmp_name = file_name + '.tmp'
+    with open(tmp_name, 'wb') as fid:
+        fid.write(_binary_magic)
+        fid.write(struct.pack('<Q', len(h)))
+        fid.write(h)
+        for c, col in zip(header['columns'], columns):
+            fid.write(b'\0' * (c[2] - fid.tell()))
+            col.tofile(fid)
+    os.rename(tmp_name, file_name)
+
+def read_binary(file_name, header_only=False):
+    """Read a binary file that was written with `write_binary`.
+
+    The columns are memory mapped, rather than read in.  They are copy-on-write, so they may
+    be modified without changing the file.
+
+    :param file_name:   The name of the file to read.
+    :param header_only: Whether to only read the header. (default: False)
+
+    :returns: (columns, header), a dict of the columns by name (or None if header_only) and the
+              header dict.
+    """
+    import json, struct
+    with open(file_name, 'rb') as fid:
+        if fid.read(len(_binary_magic)) != _binary_magic:
+            raise OSError("%s is not a TreeCorr binary file"%file_name)
+        n = struct.unpack('<Q', fid.read(8))[0]
+        header = json.loads(fid.read(n).decode())
+    if header_only:
+        return None, header
+    ntot = header['ntot']
+    columns = {}
+    for name, dtype, offset in header['columns']:
+        if ntot == 0:
+            columns[name] = np.empty(0, dtype=dtype)
+        else:
+            mm = np.memmap(file_name, dtype=dtype, mode='c', offset=offset, shape=(ntot,))
+            # Use a plain ndarray view, so the results of numpy operations aren't memmaps.
+            columns[name] = mm.view(np.ndarray)
+    return columns, header
+
 
 def gen_read(file_name, file_type=None, logger=None):
     """Read some columns from an input file.
@@ -252,6 +510,9 @@ class LRU_Cache:
         self.root = [None, None, None, None]
         self.user_function = user_function
         self.cache = {}
+        # So a field being built in the background (cf. submit) isn't built again by a call
+        # that needs it before it's done.
+        self.lock = threading.RLock()
 
         last = self.root
         for i in range(maxsize):
@@ -261,6 +522,10 @@ class LRU_Cache:
         self.count = 0
 
     def __call__(self, *key, **kwargs):
+        with self.lock:
+            return self._call(key, kwargs)
+
+    def _call(self, key, kwargs):
         link = self.cache.get(key)
         if link is not None:
             # Cache hit: move link to last position
@@ -286,6 +551,30 @@ class LRU_Cache:
         if self.count < self.size: self.count += 1
         return result
 
+    def get(self, *key):
+        """Return the cached result for the given inputs if there is one, or else None.
+
+        Unlike calling the cache, this doesn't change the order of the cached items, and it
+        doesn't call the function on a cache miss.
+        """
+        link = self.cache.get(key)
+        return link[3] if link is not None else None
+
+    def discard(self, value):
+        """Remove the given value from the cache, if it is there.
+
+        A later call with its inputs will evaluate the function again.
+        """
+        with self.lock:
+            for key, link in list(self.cache.items()):
+                if link[3] is value:
+                    del self.cache[key]
+                    # Keep the link in the ring as an empty slot with a new dummy key.
+                    link[2] = object()
+                    link[3] = None
+                    self.cache[link[2]] = link
+                    self.count -= 1
+
     def values(self):
         """Lists all items stored in the cache"""
         return list([v[3] for v in self.cache.values() if v[3] is not None])